@@ -0,0 +1,644 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "app_db.h"
+
+#include "badgevms_config.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "thirdparty/khash.h"
+#include "why_io.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <ctype.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+
+#define APP_DB_MAGIC   0x44415642 // "BVAD"
+#define APP_DB_VERSION 1
+
+#define HEADER_BYTES        16
+#define RECORD_HEADER_BYTES 8
+#define RECORD_MAX_PAYLOAD  0xffff
+#define NO_STRING           0xffff
+
+typedef enum {
+    RECORD_PUT    = 1,
+    RECORD_DELETE = 2,
+} record_type_t;
+
+// The strings follow the entry in the same allocation
+typedef struct {
+    app_db_record_t record;
+    uint32_t        encoded_bytes;
+} db_entry_t;
+
+static inline khint_t fold_hash(char const *s) {
+    khint_t h = 0;
+    for (; *s; ++s) {
+        h = (h << 5) - h + (khint_t)tolower((unsigned char)*s);
+    }
+    return h;
+}
+
+#define fold_equal(a, b) (strcasecmp(a, b) == 0)
+
+KHASH_INIT(apptable, char const *, db_entry_t *, 1, fold_hash, fold_equal);
+
+struct app_db {
+    SemaphoreHandle_t  lock;
+    char              *path;
+    char              *tmp_path;
+    khash_t(apptable) *table;
+    uint32_t           generation;
+    uint32_t           log_bytes;
+    uint32_t           live_bytes;
+    uint32_t           compactions;
+    uint32_t           dropped_bytes;
+    bool               needs_rewrite;  // The file might end in a partial record
+    bool               pending_rename; // The compacted file is complete but not in place yet
+};
+
+static char const *TAG = "app_db";
+
+static uint32_t crc32(uint8_t const *data, size_t len) {
+    static uint32_t const nibbles[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+        0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+    };
+
+    uint32_t crc = 0xffffffff;
+    for (size_t i = 0; i < len; i++) {
+        crc = nibbles[(crc ^ data[i]) & 0x0f] ^ (crc >> 4);
+        crc = nibbles[(crc ^ (data[i] >> 4)) & 0x0f] ^ (crc >> 4);
+    }
+    return ~crc;
+}
+
+static inline void put_u16(uint8_t *p, uint16_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static inline void put_u32(uint8_t *p, uint32_t v) {
+    put_u16(p, v);
+    put_u16(p + 2, v >> 16);
+}
+
+static inline uint16_t get_u16(uint8_t const *p) {
+    return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t get_u32(uint8_t const *p) {
+    return get_u16(p) | ((uint32_t)get_u16(p + 2) << 16);
+}
+
+static size_t put_record_bytes(app_db_record_t const *record) {
+    size_t len = RECORD_HEADER_BYTES + 4;
+    for (int i = 0; i < APP_DB_STRINGS; i++) {
+        len += 2 + (record->strings[i] ? strlen(record->strings[i]) : 0);
+    }
+    return len;
+}
+
+static void encode_record_header(uint8_t *out, size_t len, record_type_t type) {
+    put_u16(out + 4, len - RECORD_HEADER_BYTES);
+    out[6] = type;
+    out[7] = 0;
+    put_u32(out, crc32(out + 4, len - 4));
+}
+
+static size_t encode_put(uint8_t *out, app_db_record_t const *record) {
+    uint8_t *p = out + RECORD_HEADER_BYTES;
+
+    put_u32(p, record->source);
+    p += 4;
+    for (int i = 0; i < APP_DB_STRINGS; i++) {
+        if (!record->strings[i]) {
+            put_u16(p, NO_STRING);
+            p += 2;
+            continue;
+        }
+        size_t len = strlen(record->strings[i]);
+        put_u16(p, len);
+        memcpy(p + 2, record->strings[i], len);
+        p += 2 + len;
+    }
+
+    encode_record_header(out, p - out, RECORD_PUT);
+    return p - out;
+}
+
+static size_t encode_delete(uint8_t *out, char const *unique_identifier) {
+    size_t len = strlen(unique_identifier);
+    put_u16(out + RECORD_HEADER_BYTES, len);
+    memcpy(out + RECORD_HEADER_BYTES + 2, unique_identifier, len);
+    encode_record_header(out, RECORD_HEADER_BYTES + 2 + len, RECORD_DELETE);
+    return RECORD_HEADER_BYTES + 2 + len;
+}
+
+static void encode_header(uint8_t *out, uint32_t generation) {
+    put_u32(out, APP_DB_MAGIC);
+    put_u16(out + 4, APP_DB_VERSION);
+    put_u16(out + 6, 0);
+    put_u32(out + 8, generation);
+    put_u32(out + 12, crc32(out, 12));
+}
+
+static db_entry_t *entry_create(char const *const strings[APP_DB_STRINGS], size_t const lengths[APP_DB_STRINGS]) {
+    size_t string_bytes = 0;
+    for (int i = 0; i < APP_DB_STRINGS; i++) {
+        if (strings[i]) {
+            string_bytes += lengths[i] + 1;
+        }
+    }
+
+    db_entry_t *entry = malloc(sizeof(db_entry_t) + string_bytes);
+    if (!entry) {
+        return NULL;
+    }
+
+    char  *p             = (char *)(entry + 1);
+    size_t encoded_bytes = RECORD_HEADER_BYTES + 4;
+    for (int i = 0; i < APP_DB_STRINGS; i++) {
+        encoded_bytes += 2;
+        if (!strings[i]) {
+            entry->record.strings[i] = NULL;
+            continue;
+        }
+        memcpy(p, strings[i], lengths[i]);
+        p[lengths[i]]            = '\0';
+        entry->record.strings[i] = p;
+        p                       += lengths[i] + 1;
+        encoded_bytes           += lengths[i];
+    }
+    entry->encoded_bytes = encoded_bytes;
+    return entry;
+}
+
+static db_entry_t *entry_from_record(app_db_record_t const *record) {
+    size_t lengths[APP_DB_STRINGS];
+    for (int i = 0; i < APP_DB_STRINGS; i++) {
+        lengths[i] = record->strings[i] ? strlen(record->strings[i]) : 0;
+    }
+
+    db_entry_t *entry = entry_create(record->strings, lengths);
+    if (entry) {
+        entry->record.source = record->source;
+    }
+    return entry;
+}
+
+static db_entry_t *entry_decode(uint8_t const *payload, size_t len) {
+    char const *strings[APP_DB_STRINGS];
+    size_t      lengths[APP_DB_STRINGS];
+
+    if (len < 4) {
+        return NULL;
+    }
+
+    size_t off = 4;
+    for (int i = 0; i < APP_DB_STRINGS; i++) {
+        if (off + 2 > len) {
+            return NULL;
+        }
+        uint16_t slen  = get_u16(payload + off);
+        off           += 2;
+        if (slen == NO_STRING) {
+            strings[i] = NULL;
+            lengths[i] = 0;
+            continue;
+        }
+        if (off + slen > len) {
+            return NULL;
+        }
+        strings[i]  = (char const *)payload + off;
+        lengths[i]  = slen;
+        off        += slen;
+    }
+
+    if (off != len || !strings[APP_DB_UNIQUE_IDENTIFIER] || !lengths[APP_DB_UNIQUE_IDENTIFIER]) {
+        return NULL;
+    }
+
+    db_entry_t *entry = entry_create(strings, lengths);
+    if (entry) {
+        entry->record.source = get_u32(payload);
+    }
+    return entry;
+}
+
+static bool index_put(app_db_t *db, db_entry_t *entry) {
+    int     r;
+    khint_t k = kh_put(apptable, db->table, entry->record.strings[APP_DB_UNIQUE_IDENTIFIER], &r);
+    if (r < 0) {
+        return false;
+    }
+
+    if (r == 0) {
+        db_entry_t *old  = kh_value(db->table, k);
+        db->live_bytes  -= old->encoded_bytes;
+        free(old);
+        // The key pointed into the old entry
+        kh_key(db->table, k) = entry->record.strings[APP_DB_UNIQUE_IDENTIFIER];
+    }
+
+    kh_value(db->table, k)  = entry;
+    db->live_bytes         += entry->encoded_bytes;
+    return true;
+}
+
+static void index_delete(app_db_t *db, char const *unique_identifier) {
+    khint_t k = kh_get(apptable, db->table, unique_identifier);
+    if (k == kh_end(db->table)) {
+        return;
+    }
+
+    db_entry_t *entry  = kh_value(db->table, k);
+    db->live_bytes    -= entry->encoded_bytes;
+    kh_del(apptable, db->table, k);
+    free(entry);
+}
+
+static bool write_file(char const *path, int flags, uint8_t const *data, size_t len) {
+    int fd = why_open(path, flags, 0644);
+    if (fd < 0) {
+        return false;
+    }
+
+    bool ok = why_write(fd, data, len) == (ssize_t)len && why_fsync(fd) == 0;
+    if (why_close(fd) != 0) {
+        ok = false;
+    }
+    return ok;
+}
+
+static bool write_compacted(app_db_t *db) {
+    uint8_t *buf = malloc(db->live_bytes);
+    if (!buf) {
+        return false;
+    }
+
+    encode_header(buf, db->generation + 1);
+    size_t      off = HEADER_BYTES;
+    db_entry_t *entry;
+    kh_foreach_value(db->table, entry, { off += encode_put(buf + off, &entry->record); });
+
+    bool ok = write_file(db->tmp_path, O_WRONLY | O_CREAT | O_TRUNC, buf, off);
+    free(buf);
+    if (!ok) {
+        ESP_LOGW(TAG, "Unable to write %s", db->tmp_path);
+        why_unlink(db->tmp_path);
+        return false;
+    }
+
+    // FAT won't rename over an existing file. From here on a crash leaves only the complete new file, which is
+    // renamed when the database is opened.
+    db->pending_rename = true;
+    why_unlink(db->path);
+    return true;
+}
+
+static bool compact_locked(app_db_t *db) {
+    // Nothing changes while the compacted file waits to be put in place, it is not written again
+    if (!db->pending_rename && !write_compacted(db)) {
+        return false;
+    }
+
+    if (why_rename(db->tmp_path, db->path) != 0) {
+        ESP_LOGW(TAG, "Unable to rename %s to %s", db->tmp_path, db->path);
+        return false;
+    }
+
+    db->pending_rename = false;
+    db->needs_rewrite  = false;
+    db->log_bytes      = db->live_bytes;
+    db->generation++;
+    db->compactions++;
+    return true;
+}
+
+static void maybe_compact(app_db_t *db) {
+    uint32_t garbage = db->log_bytes - db->live_bytes;
+    if (garbage > APP_DB_COMPACT_SLACK && garbage > db->live_bytes) {
+        compact_locked(db);
+    }
+}
+
+static bool append(app_db_t *db, uint8_t const *data, size_t len) {
+    if ((db->needs_rewrite || db->pending_rename) && !compact_locked(db)) {
+        return false;
+    }
+
+    if (!write_file(db->path, O_WRONLY | O_APPEND, data, len)) {
+        // Part of the record might have made it, nothing more can go after it
+        db->needs_rewrite = true;
+        return false;
+    }
+
+    db->log_bytes += len;
+    return true;
+}
+
+static uint8_t *read_file(char const *path, size_t *len) {
+    int fd = why_open(path, O_RDONLY, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    uint8_t *buf  = NULL;
+    off_t    size = why_lseek(fd, 0, SEEK_END);
+    if (size < 0 || why_lseek(fd, 0, SEEK_SET) != 0 || !(buf = malloc(size ? size : 1))) {
+        why_close(fd);
+        return NULL;
+    }
+
+    size_t done = 0;
+    while (done < (size_t)size) {
+        ssize_t r = why_read(fd, buf + done, size - done);
+        if (r <= 0) {
+            break;
+        }
+        done += r;
+    }
+    why_close(fd);
+
+    if (done != (size_t)size) {
+        free(buf);
+        return NULL;
+    }
+
+    *len = done;
+    return buf;
+}
+
+static void replay(app_db_t *db, uint8_t const *buf, size_t len) {
+    size_t off = HEADER_BYTES;
+
+    while (off + RECORD_HEADER_BYTES <= len) {
+        uint8_t const *record      = buf + off;
+        size_t         payload_len = get_u16(record + 4);
+        size_t         record_len  = RECORD_HEADER_BYTES + payload_len;
+
+        if (off + record_len > len || crc32(record + 4, record_len - 4) != get_u32(record)) {
+            break;
+        }
+
+        uint8_t const *payload = record + RECORD_HEADER_BYTES;
+        if (record[6] == RECORD_PUT) {
+            db_entry_t *entry = entry_decode(payload, payload_len);
+            if (!entry) {
+                break;
+            }
+            if (!index_put(db, entry)) {
+                free(entry);
+                break;
+            }
+        } else if (record[6] == RECORD_DELETE && payload_len >= 2 && get_u16(payload) == payload_len - 2) {
+            char *unique_identifier = strndup((char const *)payload + 2, payload_len - 2);
+            if (!unique_identifier) {
+                break;
+            }
+            index_delete(db, unique_identifier);
+            free(unique_identifier);
+        } else {
+            break;
+        }
+
+        off += record_len;
+    }
+
+    db->log_bytes = off;
+    if (off < len) {
+        ESP_LOGW(TAG, "Dropping %zu bytes at the end of %s", len - off, db->path);
+        db->dropped_bytes += len - off;
+        db->needs_rewrite  = true;
+    }
+}
+
+static bool load(app_db_t *db) {
+    struct stat st;
+    bool        exists = why_stat(db->path, &st) == 0;
+
+    if (exists) {
+        // Left behind by a compaction that didn't get as far as removing the old file
+        why_unlink(db->tmp_path);
+    } else if (why_rename(db->tmp_path, db->path) == 0) {
+        ESP_LOGW(TAG, "Finishing interrupted compaction of %s", db->path);
+        exists = true;
+    }
+
+    db->live_bytes = HEADER_BYTES;
+    db->log_bytes  = HEADER_BYTES;
+
+    if (!exists) {
+        ESP_LOGI(TAG, "Creating %s", db->path);
+        return compact_locked(db);
+    }
+
+    size_t   len;
+    uint8_t *buf = read_file(db->path, &len);
+    if (!buf) {
+        ESP_LOGE(TAG, "Unable to read %s", db->path);
+        return false;
+    }
+
+    bool header_ok = len >= HEADER_BYTES && get_u32(buf) == APP_DB_MAGIC && get_u32(buf + 12) == crc32(buf, 12);
+    if (header_ok && get_u16(buf + 4) > APP_DB_VERSION) {
+        ESP_LOGE(TAG, "%s has version %u, newer than this firmware", db->path, get_u16(buf + 4));
+        free(buf);
+        return false;
+    }
+
+    if (!header_ok) {
+        ESP_LOGE(TAG, "Bad header in %s, starting over", db->path);
+        db->dropped_bytes += len;
+        free(buf);
+        return compact_locked(db);
+    }
+
+    db->generation = get_u32(buf + 8);
+    replay(db, buf, len);
+    free(buf);
+
+    if (db->needs_rewrite) {
+        compact_locked(db);
+    }
+    return true;
+}
+
+app_db_t *app_db_open(char const *path) {
+    app_db_t *db = calloc(1, sizeof(app_db_t));
+    if (!db) {
+        return NULL;
+    }
+
+    db->path     = strdup(path);
+    db->tmp_path = malloc(strlen(path) + 2);
+    db->table    = kh_init(apptable);
+    db->lock     = xSemaphoreCreateMutex();
+    if (db->tmp_path) {
+        sprintf(db->tmp_path, "%s_", path);
+    }
+
+    if (!db->path || !db->tmp_path || !db->table || !db->lock || !load(db)) {
+        app_db_close(db);
+        return NULL;
+    }
+
+    return db;
+}
+
+void app_db_close(app_db_t *db) {
+    if (!db) {
+        return;
+    }
+
+    if (db->table) {
+        db_entry_t *entry;
+        kh_foreach_value(db->table, entry, { free(entry); });
+        kh_destroy(apptable, db->table);
+    }
+    if (db->lock) {
+        vSemaphoreDelete(db->lock);
+    }
+    free(db->tmp_path);
+    free(db->path);
+    free(db);
+}
+
+bool app_db_get(app_db_t *db, char const *unique_identifier, app_db_visit_fn fn, void *context) {
+    if (!unique_identifier) {
+        return false;
+    }
+
+    xSemaphoreTake(db->lock, portMAX_DELAY);
+    khint_t k     = kh_get(apptable, db->table, unique_identifier);
+    bool    found = k != kh_end(db->table);
+    if (found && fn) {
+        fn(&kh_value(db->table, k)->record, context);
+    }
+    xSemaphoreGive(db->lock);
+    return found;
+}
+
+size_t app_db_foreach(app_db_t *db, app_db_visit_fn fn, void *context) {
+    size_t visited = 0;
+
+    xSemaphoreTake(db->lock, portMAX_DELAY);
+    for (khint_t k = kh_begin(db->table); k != kh_end(db->table); ++k) {
+        if (!kh_exist(db->table, k)) {
+            continue;
+        }
+        visited++;
+        if (!fn(&kh_value(db->table, k)->record, context)) {
+            break;
+        }
+    }
+    xSemaphoreGive(db->lock);
+    return visited;
+}
+
+bool app_db_put(app_db_t *db, app_db_record_t const *record, bool create) {
+    char const *unique_identifier = record->strings[APP_DB_UNIQUE_IDENTIFIER];
+    if (!unique_identifier || !unique_identifier[0]) {
+        return false;
+    }
+
+    for (int i = 0; i < APP_DB_STRINGS; i++) {
+        if (record->strings[i] && strlen(record->strings[i]) >= NO_STRING) {
+            return false;
+        }
+    }
+
+    size_t len = put_record_bytes(record);
+    if (len - RECORD_HEADER_BYTES > RECORD_MAX_PAYLOAD) {
+        return false;
+    }
+
+    db_entry_t *entry = entry_from_record(record);
+    uint8_t    *buf   = malloc(len);
+    if (!entry || !buf) {
+        free(entry);
+        free(buf);
+        return false;
+    }
+    encode_put(buf, record);
+
+    xSemaphoreTake(db->lock, portMAX_DELAY);
+    bool ok = !(create && kh_get(apptable, db->table, unique_identifier) != kh_end(db->table));
+    ok      = ok && append(db, buf, len);
+    if (ok && !index_put(db, entry)) {
+        // Written but not indexed, the file is rewritten from what is in memory
+        db->needs_rewrite = true;
+        ok                = false;
+    }
+    if (ok) {
+        maybe_compact(db);
+    }
+    xSemaphoreGive(db->lock);
+
+    if (!ok) {
+        free(entry);
+    }
+    free(buf);
+    return ok;
+}
+
+bool app_db_delete(app_db_t *db, char const *unique_identifier) {
+    if (!unique_identifier || !unique_identifier[0] || strlen(unique_identifier) > RECORD_MAX_PAYLOAD - 2) {
+        return false;
+    }
+
+    uint8_t *buf = malloc(RECORD_HEADER_BYTES + 2 + strlen(unique_identifier));
+    if (!buf) {
+        return false;
+    }
+    size_t len = encode_delete(buf, unique_identifier);
+
+    xSemaphoreTake(db->lock, portMAX_DELAY);
+    bool ok = kh_get(apptable, db->table, unique_identifier) != kh_end(db->table) && append(db, buf, len);
+    if (ok) {
+        index_delete(db, unique_identifier);
+        maybe_compact(db);
+    }
+    xSemaphoreGive(db->lock);
+
+    free(buf);
+    return ok;
+}
+
+bool app_db_compact(app_db_t *db) {
+    xSemaphoreTake(db->lock, portMAX_DELAY);
+    bool ok = compact_locked(db);
+    xSemaphoreGive(db->lock);
+    return ok;
+}
+
+void app_db_stats_get(app_db_t *db, app_db_stats_t *stats) {
+    xSemaphoreTake(db->lock, portMAX_DELAY);
+    stats->records       = kh_size(db->table);
+    stats->log_bytes     = db->log_bytes;
+    stats->live_bytes    = db->live_bytes;
+    stats->compactions   = db->compactions;
+    stats->dropped_bytes = db->dropped_bytes;
+    xSemaphoreGive(db->lock);
+}
@@ -0,0 +1,74 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The installed applications of one directory, kept in a single file. The file is a header followed by an append-only
+// log of records, each holding every field of one application or the removal of one. A record is one write that is
+// made durable before the change is visible, a torn or corrupted tail is dropped when the file is opened. All records
+// are replayed into an index in memory when the database is opened, lookups are by case insensitive unique
+// identifier. Once the log holds enough superseded records it is compacted into a fresh file.
+
+typedef enum {
+    APP_DB_UNIQUE_IDENTIFIER,
+    APP_DB_NAME,
+    APP_DB_AUTHOR,
+    APP_DB_VERSION,
+    APP_DB_INTERPRETER,
+    APP_DB_METADATA_FILE,
+    APP_DB_BINARY_PATH,
+    APP_DB_STRINGS,
+} app_db_string_t;
+
+typedef struct {
+    char const *strings[APP_DB_STRINGS]; // NULL if not set
+    uint32_t    source;
+} app_db_record_t;
+
+typedef struct {
+    uint32_t records;
+    uint32_t log_bytes;  // Size of the file
+    uint32_t live_bytes; // Bytes a compacted file would take
+    uint32_t compactions;
+    uint32_t dropped_bytes; // Torn or corrupted tail dropped when opening
+} app_db_stats_t;
+
+typedef struct app_db app_db_t;
+
+// Called with the lock held, the record is only valid during the call. Return false to stop iterating.
+typedef bool (*app_db_visit_fn)(app_db_record_t const *record, void *context);
+
+// Opens or creates the database at path, finishing an interrupted compaction
+app_db_t *app_db_open(char const *path);
+void      app_db_close(app_db_t *db);
+
+// Returns false if there is no such application, fn can be NULL
+bool app_db_get(app_db_t *db, char const *unique_identifier, app_db_visit_fn fn, void *context);
+
+// Returns the number of records visited
+size_t app_db_foreach(app_db_t *db, app_db_visit_fn fn, void *context);
+
+// Replaces all fields of an application at once, with create set this fails if the application already exists
+bool app_db_put(app_db_t *db, app_db_record_t const *record, bool create);
+bool app_db_delete(app_db_t *db, char const *unique_identifier);
+
+bool app_db_compact(app_db_t *db);
+void app_db_stats_get(app_db_t *db, app_db_stats_t *stats);
@@ -16,6 +16,8 @@
 
 #include "badgevms/application.h"
 
+#include "app_db.h"
+#include "application_private.h"
 #include "badgevms/pathfuncs.h"
 #include "badgevms/process.h"
 #include "esp_log.h"
@@ -28,7 +30,9 @@
 
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -37,8 +41,27 @@
 #define APPLICATION_MAGIC 0xDEADBEEF
 #define MAX_PATH_LEN      512
 
+#define APPLICATION_DB_FILE "APPLICATIONS.DB"
+#define MAX_DATABASES       2
+
 static char applications_base_dir[MAX_PATH_LEN] = "";
 
+// One database per member of the applications search list, in search order
+static app_db_t *databases[MAX_DATABASES];
+static int       num_databases;
+
+// What an application_t handed out by this API really is
+typedef struct {
+    application_t app;
+    app_db_t     *db;
+    bool          deferred; // Between application_begin_update() and application_commit_update()
+} application_entry_t;
+
+typedef struct {
+    app_db_t      *db;
+    application_t *app;
+} application_lookup_t;
+
 typedef struct application_list {
     application_t **applications;
     size_t          count;
@@ -62,26 +85,6 @@ static bool validate_path(application_t *app, char const *path) {
     return success;
 }
 
-static char *get_metadata_path(char const *unique_identifier) {
-    if (!unique_identifier || !applications_base_dir[0])
-        return NULL;
-
-    path_t parsed_path;
-    char  *filename;
-    why_asprintf(&filename, "%s.json", unique_identifier);
-    char *path = path_fileconcat(applications_base_dir, filename);
-
-    if (parse_path(path, &parsed_path) != PATH_PARSE_OK) {
-        free(path);
-        path = NULL;
-    } else {
-        path_free(&parsed_path);
-    }
-
-    why_free(filename);
-    return path;
-}
-
 static char *get_application_dir(char const *unique_identifier) {
     if (!unique_identifier || !applications_base_dir[0])
         return NULL;
@@ -99,140 +102,158 @@ static char *get_application_dir(char const *unique_identifier) {
     return path;
 }
 
-static cJSON *application_to_json(application_t const *app) {
-    cJSON *json = cJSON_CreateObject();
-    if (!json)
-        return NULL;
-
-    cJSON_AddStringToObject(json, "unique_identifier", app->unique_identifier ?: "");
-    cJSON_AddStringToObject(json, "name", app->name ?: "");
-    cJSON_AddStringToObject(json, "author", app->author ?: "");
-    cJSON_AddStringToObject(json, "version", app->version ?: "");
-    cJSON_AddStringToObject(json, "interpreter", app->interpreter ?: "");
-    cJSON_AddStringToObject(json, "metadata_file", app->metadata_file ?: "");
-    cJSON_AddStringToObject(json, "binary_path", app->binary_path ?: "");
-    cJSON_AddNumberToObject(json, "source", app->source);
-
-    return json;
+// Everything of an application that goes into the database at once
+static void application_to_record(application_t const *app, app_db_record_t *record) {
+    record->strings[APP_DB_UNIQUE_IDENTIFIER] = app->unique_identifier;
+    record->strings[APP_DB_NAME]              = app->name;
+    record->strings[APP_DB_AUTHOR]            = app->author;
+    record->strings[APP_DB_VERSION]           = app->version;
+    record->strings[APP_DB_INTERPRETER]       = app->interpreter;
+    record->strings[APP_DB_METADATA_FILE]     = app->metadata_file;
+    record->strings[APP_DB_BINARY_PATH]       = app->binary_path;
+    record->source                            = app->source;
 }
 
-static application_t *json_to_application(cJSON *json) {
-    application_t *app = why_calloc(1, sizeof(application_t));
-    if (!app)
-        return NULL;
+// Unset fields read back as empty strings, like they did from the JSON files
+static bool record_to_application(app_db_record_t const *record, void *context) {
+    application_lookup_t *lookup = context;
+    application_entry_t  *entry  = why_calloc(1, sizeof(application_entry_t));
+    if (!entry)
+        return false;
 
-    // Cast away const for internal modification
+    application_t *app = &entry->app;
 
-    cJSON *item;
-    if ((item = cJSON_GetObjectItem(json, "unique_identifier")) && cJSON_IsString(item)) {
-        app->unique_identifier = why_strdup(item->valuestring);
-        app->installed_path    = get_application_dir(item->valuestring);
-    }
-    if ((item = cJSON_GetObjectItem(json, "name")) && cJSON_IsString(item)) {
-        app->name = why_strdup(item->valuestring);
-    }
-    if ((item = cJSON_GetObjectItem(json, "author")) && cJSON_IsString(item)) {
-        app->author = why_strdup(item->valuestring);
-    }
-    if ((item = cJSON_GetObjectItem(json, "version")) && cJSON_IsString(item)) {
-        app->version = why_strdup(item->valuestring);
-    }
-    if ((item = cJSON_GetObjectItem(json, "interpreter")) && cJSON_IsString(item)) {
-        app->interpreter = why_strdup(item->valuestring);
-    }
-    if ((item = cJSON_GetObjectItem(json, "metadata_file")) && cJSON_IsString(item)) {
-        app->metadata_file = why_strdup(item->valuestring);
-    }
-    if ((item = cJSON_GetObjectItem(json, "binary_path")) && cJSON_IsString(item)) {
-        app->binary_path = why_strdup(item->valuestring);
-    }
-    if ((item = cJSON_GetObjectItem(json, "source")) && cJSON_IsNumber(item)) {
-        *((application_source_t *)&app->source) = (application_source_t)item->valueint;
-    }
-
-    return app;
+    // Cast away const for internal modification
+    app->unique_identifier                  = why_strdup(record->strings[APP_DB_UNIQUE_IDENTIFIER]);
+    app->name                               = why_strdup(record->strings[APP_DB_NAME] ?: "");
+    app->author                             = why_strdup(record->strings[APP_DB_AUTHOR] ?: "");
+    app->version                            = why_strdup(record->strings[APP_DB_VERSION] ?: "");
+    app->interpreter                        = why_strdup(record->strings[APP_DB_INTERPRETER] ?: "");
+    app->metadata_file                      = why_strdup(record->strings[APP_DB_METADATA_FILE] ?: "");
+    app->binary_path                        = why_strdup(record->strings[APP_DB_BINARY_PATH] ?: "");
+    app->installed_path                     = get_application_dir(record->strings[APP_DB_UNIQUE_IDENTIFIER]);
+    *((application_source_t *)&app->source) = (application_source_t)record->source;
+    entry->db                               = lookup->db;
+
+    lookup->app = app;
+    return true;
 }
 
-static bool save_application_metadata(application_t const *app) {
-    if (!app || !app->unique_identifier)
-        return false;
+static bool save_application(application_t const *app) {
+    application_entry_t const *entry = (application_entry_t const *)app;
+    if (entry->deferred)
+        return true;
 
-    char *metadata_path = get_metadata_path(app->unique_identifier);
-    if (!metadata_path)
-        return false;
+    app_db_record_t record;
+    application_to_record(app, &record);
+    return app_db_put(entry->db, &record, false);
+}
 
-    cJSON *json = application_to_json(app);
-    if (!json) {
-        why_free(metadata_path);
-        return false;
+static app_db_t *find_application(char const *unique_identifier) {
+    for (int i = 0; i < num_databases; i++) {
+        if (app_db_get(databases[i], unique_identifier, NULL, NULL)) {
+            return databases[i];
+        }
     }
+    return NULL;
+}
 
-    char *json_string = cJSON_Print(json);
-    cJSON_Delete(json);
+static cJSON *read_json(char const *path) {
+    int fd = why_open(path, O_RDONLY, 0);
+    if (fd < 0)
+        return NULL;
 
-    if (!json_string) {
-        why_free(metadata_path);
-        return false;
-    }
+    off_t file_size = why_lseek(fd, 0, SEEK_END);
+    why_lseek(fd, 0, SEEK_SET);
 
-    FILE *fp = why_fopen(metadata_path, "w");
-    if (!fp) {
-        why_free(json_string);
-        why_free(metadata_path);
-        return false;
+    char *content = file_size >= 0 ? malloc(file_size + 1) : NULL;
+    if (!content) {
+        why_close(fd);
+        return NULL;
     }
 
-    why_fputs(json_string, fp);
-    why_fclose(fp);
-    why_free(json_string);
-    why_free(metadata_path);
+    ssize_t r = why_read(fd, content, file_size);
+    why_close(fd);
+    content[r > 0 ? r : 0] = '\0';
 
-    return true;
+    cJSON *json = cJSON_Parse(content);
+    free(content);
+    return json;
 }
 
-static application_t *load_application_metadata(char const *unique_identifier) {
-    if (!unique_identifier)
-        return NULL;
+// Applications installed before the database existed each have a JSON file, these go into the database of the same
+// directory and the file is removed once it is in
+static void migrate_json_files(char const *dir, app_db_t *db) {
+    static char const *const keys[APP_DB_STRINGS] = {
+        [APP_DB_UNIQUE_IDENTIFIER] = "unique_identifier",
+        [APP_DB_NAME]              = "name",
+        [APP_DB_AUTHOR]            = "author",
+        [APP_DB_VERSION]           = "version",
+        [APP_DB_INTERPRETER]       = "interpreter",
+        [APP_DB_METADATA_FILE]     = "metadata_file",
+        [APP_DB_BINARY_PATH]       = "binary_path",
+    };
+
+    DIR *d = why_opendir(dir);
+    if (!d)
+        return;
 
-    char *metadata_path = get_metadata_path(unique_identifier);
-    if (!metadata_path)
-        return NULL;
+    struct dirent *entry;
+    int            migrated = 0;
 
-    FILE *fp = why_fopen(metadata_path, "r");
-    if (!fp) {
-        why_free(metadata_path);
-        return NULL;
-    }
+    while ((entry = why_readdir(d)) != NULL) {
+        size_t len = strlen(entry->d_name);
+        if (len <= 5 || strcasecmp(entry->d_name + len - 5, ".json") != 0) {
+            continue;
+        }
 
-    why_fseek(fp, 0, SEEK_END);
-    long file_size = why_ftell(fp);
-    why_fseek(fp, 0, SEEK_SET);
+        char  *path = path_fileconcat(dir, entry->d_name);
+        cJSON *json = path ? read_json(path) : NULL;
+        if (!json) {
+            ESP_LOGW(TAG, "Unable to read %s", entry->d_name);
+            free(path);
+            continue;
+        }
 
-    char *content = why_malloc(file_size + 1);
-    if (!content) {
-        why_fclose(fp);
-        why_free(metadata_path);
-        return NULL;
-    }
+        app_db_record_t record = {0};
+        for (int i = 0; i < APP_DB_STRINGS; i++) {
+            cJSON *item = cJSON_GetObjectItem(json, keys[i]);
+            if (cJSON_IsString(item)) {
+                record.strings[i] = item->valuestring;
+            }
+        }
 
-    why_fread(content, 1, file_size, fp);
-    content[file_size] = '\0';
-    why_fclose(fp);
-    why_free(metadata_path);
+        cJSON *source = cJSON_GetObjectItem(json, "source");
+        if (cJSON_IsNumber(source)) {
+            record.source = source->valueint;
+        }
 
-    cJSON *json = cJSON_Parse(content);
-    why_free(content);
+        char *unique_id = NULL;
+        if (!record.strings[APP_DB_UNIQUE_IDENTIFIER] || !record.strings[APP_DB_UNIQUE_IDENTIFIER][0]) {
+            unique_id                                = strndup(entry->d_name, len - 5);
+            record.strings[APP_DB_UNIQUE_IDENTIFIER] = unique_id;
+        }
 
-    if (!json)
-        return NULL;
+        if (app_db_get(db, record.strings[APP_DB_UNIQUE_IDENTIFIER], NULL, NULL) || app_db_put(db, &record, true)) {
+            why_unlink(path);
+            migrated++;
+        } else {
+            ESP_LOGW(TAG, "Unable to migrate %s", entry->d_name);
+        }
 
-    application_t *app = json_to_application(json);
-    cJSON_Delete(json);
+        free(unique_id);
+        cJSON_Delete(json);
+        free(path);
+    }
 
-    return app;
+    why_closedir(d);
+
+    if (migrated) {
+        ESP_LOGI(TAG, "Migrated %d applications in %s", migrated, dir);
+    }
 }
 
-bool application_init(char const *applications_dir, char const *flash_dir, char const *sd_dir) {
+bool application_init(char const *applications_dir, char const *primary_dir, char const *secondary_dir) {
     if (!applications_dir || strlen(applications_dir) >= MAX_PATH_LEN) {
         return false;
     }
@@ -240,15 +261,25 @@ bool application_init(char const *applications_dir, char const *flash_dir, char
     strncpy(applications_base_dir, applications_dir, MAX_PATH_LEN - 1);
     applications_base_dir[MAX_PATH_LEN - 1] = '\0';
 
-    if (flash_dir) {
-        mkdir_p(flash_dir);
-    }
+    char const *member_dirs[MAX_DATABASES] = {primary_dir, secondary_dir};
+    for (int i = 0; i < MAX_DATABASES; i++) {
+        if (!member_dirs[i] || !mkdir_p(member_dirs[i])) {
+            continue;
+        }
+
+        char     *db_path = path_fileconcat(member_dirs[i], APPLICATION_DB_FILE);
+        app_db_t *db      = db_path ? app_db_open(db_path) : NULL;
+        free(db_path);
+        if (!db) {
+            ESP_LOGE(TAG, "Unable to open the application database in %s", member_dirs[i]);
+            continue;
+        }
 
-    if (sd_dir) {
-        mkdir_p(sd_dir);
+        migrate_json_files(member_dirs[i], db);
+        databases[num_databases++] = db;
     }
 
-    return mkdir_p(applications_base_dir);
+    return mkdir_p(applications_base_dir) && num_databases;
 }
 
 application_t *application_create(
@@ -259,40 +290,34 @@ application_t *application_create(
     char const          *interpreter,
     application_source_t source
 ) {
-    if (!unique_identifier || !applications_base_dir[0]) {
+    if (!unique_identifier || !num_databases) {
         return NULL;
     }
 
-    char *metadata_path = get_metadata_path(unique_identifier);
-    if (!metadata_path) {
-        ESP_LOGW(TAG, "Illegal application name %s", unique_identifier);
-        return NULL;
-    }
-
-    FILE *fp = why_fopen(metadata_path, "r");
-    if (fp) {
+    if (find_application(unique_identifier)) {
         // Already exists
-        why_fclose(fp);
-        why_free(metadata_path);
         return NULL;
     }
-    why_free(metadata_path);
 
     char *app_dir = get_application_dir(unique_identifier);
-    if (!app_dir)
+    if (!app_dir) {
+        ESP_LOGW(TAG, "Illegal application name %s", unique_identifier);
         return NULL;
+    }
 
     if (!mkdir_p(app_dir)) {
         why_free(app_dir);
         return NULL;
     }
 
-    application_t *app = why_calloc(1, sizeof(application_t));
-    if (!app) {
+    application_entry_t *entry = why_calloc(1, sizeof(application_entry_t));
+    if (!entry) {
         why_free(app_dir);
         return NULL;
     }
 
+    application_t *app = &entry->app;
+
     // Cast away const for internal modification
     app->unique_identifier                  = why_strdup(unique_identifier);
     app->name                               = why_strdup(name);
@@ -301,8 +326,11 @@ application_t *application_create(
     app->interpreter                        = why_strdup(interpreter);
     app->installed_path                     = app_dir;
     *((application_source_t *)&app->source) = source;
+    entry->db                               = databases[0];
 
-    if (!save_application_metadata(app)) {
+    app_db_record_t record;
+    application_to_record(app, &record);
+    if (!app_db_put(entry->db, &record, true)) {
         application_free(app);
         return NULL;
     }
@@ -310,6 +338,22 @@ application_t *application_create(
     return app;
 }
 
+bool application_begin_update(application_t *app) {
+    if (!app)
+        return false;
+
+    ((application_entry_t *)app)->deferred = true;
+    return true;
+}
+
+bool application_commit_update(application_t *app) {
+    if (!app)
+        return false;
+
+    ((application_entry_t *)app)->deferred = false;
+    return save_application(app);
+}
+
 bool application_set_metadata(application_t *app, char const *metadata_file) {
     if (!app)
         return false;
@@ -321,7 +365,7 @@ bool application_set_metadata(application_t *app, char const *metadata_file) {
     why_free((void *)app->metadata_file);
     app->metadata_file = why_strdup(metadata_file);
 
-    return save_application_metadata(app);
+    return save_application(app);
 }
 
 bool application_set_binary_path(application_t *app, char const *binary_path) {
@@ -335,7 +379,7 @@ bool application_set_binary_path(application_t *app, char const *binary_path) {
     why_free((void *)app->binary_path);
     app->binary_path = why_strdup(binary_path);
 
-    return save_application_metadata(app);
+    return save_application(app);
 }
 
 bool application_set_version(application_t *app, char const *version) {
@@ -345,7 +389,7 @@ bool application_set_version(application_t *app, char const *version) {
     why_free((void *)app->version);
     app->version = why_strdup(version);
 
-    return save_application_metadata(app);
+    return save_application(app);
 }
 
 bool application_set_author(application_t *app, char const *author) {
@@ -355,7 +399,7 @@ bool application_set_author(application_t *app, char const *author) {
     why_free((void *)app->author);
     app->author = why_strdup(author);
 
-    return save_application_metadata(app);
+    return save_application(app);
 }
 
 bool application_set_name(application_t *app, char const *name) {
@@ -365,7 +409,7 @@ bool application_set_name(application_t *app, char const *name) {
     why_free((void *)app->name);
     app->name = why_strdup(name);
 
-    return save_application_metadata(app);
+    return save_application(app);
 }
 
 bool application_set_interpreter(application_t *app, char const *interpreter) {
@@ -375,7 +419,7 @@ bool application_set_interpreter(application_t *app, char const *interpreter) {
     why_free((void *)app->interpreter);
     app->interpreter = why_strdup(interpreter);
 
-    return save_application_metadata(app);
+    return save_application(app);
 }
 
 bool application_destroy(application_t *app) {
@@ -386,6 +430,13 @@ bool application_destroy(application_t *app) {
     if (!unique_id)
         return false;
 
+    // Gone from the list first, a half deleted directory is never launched
+    app_db_t *db = ((application_entry_t *)app)->db;
+    if (!db || !app_db_delete(db, unique_id)) {
+        ESP_LOGW(TAG, "Unable to remove %s from the application database", unique_id);
+        return false;
+    }
+
     bool  success = false;
     char *app_dir = get_application_dir(unique_id);
     if (app_dir) {
@@ -445,66 +496,57 @@ FILE *application_create_file(application_t *app, char const *file_path) {
     return ret;
 }
 
-application_list_handle application_list(application_t **out) {
-    if (!applications_base_dir[0])
-        return NULL;
+typedef struct {
+    application_list_t *list;
+    size_t              capacity;
+    app_db_t           *db;
+    int                 shadowed_by; // Databases earlier in the search list, which hide the same application here
+} list_context_t;
 
-    DIR *dir = why_opendir(applications_base_dir);
-    if (!dir) {
-        ESP_LOGW(TAG, "Unable to opendir(%s)", applications_base_dir);
-        return NULL;
-    }
+static bool add_to_list(app_db_record_t const *record, void *context) {
+    list_context_t *ctx = context;
 
-    application_list_t *list = why_calloc(1, sizeof(application_list_t));
-    if (!list) {
-        why_closedir(dir);
-        return NULL;
+    for (int i = 0; i < ctx->shadowed_by; i++) {
+        if (app_db_get(databases[i], record->strings[APP_DB_UNIQUE_IDENTIFIER], NULL, NULL)) {
+            return true;
+        }
     }
 
-    // Count .json files first
-    struct dirent *entry;
-    size_t         json_count = 0;
-
-    while ((entry = why_readdir(dir)) != NULL) {
-        size_t len = strlen(entry->d_name);
-        if (len > 5 && strcmp(entry->d_name + len - 5, ".json") == 0) {
-            json_count++;
+    if (ctx->list->count == ctx->capacity) {
+        size_t          new_capacity = ctx->capacity ? ctx->capacity * 2 : 8;
+        application_t **applications =
+            why_reallocarray(ctx->list->applications, new_capacity, sizeof(application_t *));
+        if (!applications) {
+            return false;
         }
+        ctx->list->applications = applications;
+        ctx->capacity           = new_capacity;
     }
 
-    if (json_count == 0) {
-        why_closedir(dir);
-        if (out)
-            *out = NULL;
-        return list;
+    application_lookup_t lookup = {.db = ctx->db};
+    if (!record_to_application(record, &lookup)) {
+        return false;
     }
 
-    list->applications = why_calloc(json_count, sizeof(application_t *));
-    if (!list->applications) {
-        why_closedir(dir);
-        why_free(list);
+    ctx->list->applications[ctx->list->count++] = lookup.app;
+    return true;
+}
+
+application_list_handle application_list(application_t **out) {
+    if (!num_databases)
         return NULL;
-    }
 
-    why_rewinddir(dir);
-    while ((entry = why_readdir(dir)) != NULL && list->count < json_count) {
-        size_t len = strlen(entry->d_name);
-        if (len > 5 && strcmp(entry->d_name + len - 5, ".json") == 0) {
-            char *unique_id = why_malloc(len - 4);
-            if (unique_id) {
-                strncpy(unique_id, entry->d_name, len - 5);
-                unique_id[len - 5] = '\0';
-
-                application_t *app = load_application_metadata(unique_id);
-                if (app) {
-                    list->applications[list->count++] = app;
-                }
-                why_free(unique_id);
-            }
-        }
+    application_list_t *list = why_calloc(1, sizeof(application_list_t));
+    if (!list) {
+        return NULL;
     }
 
-    why_closedir(dir);
+    list_context_t ctx = {.list = list};
+    for (int i = 0; i < num_databases; i++) {
+        ctx.db          = databases[i];
+        ctx.shadowed_by = i;
+        app_db_foreach(databases[i], add_to_list, &ctx);
+    }
 
     if (out && list->count > 0) {
         *out = list->applications[0];
@@ -548,8 +590,14 @@ application_t *application_get(char const *unique_identifier) {
     if (!unique_identifier)
         return NULL;
 
-    application_t *app = load_application_metadata(unique_identifier);
-    return app;
+    for (int i = 0; i < num_databases; i++) {
+        application_lookup_t lookup = {.db = databases[i]};
+        if (app_db_get(databases[i], unique_identifier, record_to_application, &lookup)) {
+            return lookup.app;
+        }
+    }
+
+    return NULL;
 }
 
 void application_free(application_t *app) {
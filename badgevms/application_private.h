@@ -18,4 +18,6 @@
 
 #include <stdbool.h>
 
-bool application_init(char const *applications_dir, char const *flash_dir, char const *sd_dir);
+// The primary and secondary directories are the members of the applications_dir search list, in order, each keeps an
+// application database. Either can be NULL.
+bool application_init(char const *applications_dir, char const *primary_dir, char const *secondary_dir);
@@ -28,6 +28,150 @@
 // Maximum number of pending events for a window
 #define WINDOW_MAX_EVENTS 10
 
+// How often the input task polls the keyboard, rounded up to at least one tick
+#define INPUT_POLL_INTERVAL_MS 2
+
+// Maximum number of keyboard events read in one go
+#define INPUT_EVENTS_PER_POLL 16
+
+// Log key-to-client latency statistics every N seconds, 0 to disable
+#define INPUT_LATENCY_REPORT_SEC 0
+
+// Maximum number of window commands and transactions waiting for the compositor
+#define COMPOSITOR_QUEUE_LENGTH 32
+
+// The translations of the device of a path, or of a whole string that isn't a path, are cached as a flattened search
+// list, shared by every path on that device. Lists longer than LOGICAL_NAME_CACHE_MAX_LIST entries or that don't fit
+// in LOGICAL_NAME_CACHE_SLOT_BYTES are always resolved from scratch.
+#define LOGICAL_NAME_CACHE_SLOTS      32
+#define LOGICAL_NAME_CACHE_SLOT_BYTES 384
+#define LOGICAL_NAME_CACHE_MAX_LIST   8
+
+// Names from earlier search list members go through a bloom filter of this many bits when reading a directory, a
+// hit is confirmed by a stat in those members
+#define DIR_SHADOW_FILTER_BITS 4096
+
+// Default write-back interval of filesystems using FILESYSTEM_SYNC_PERIODIC
+#define FILESYSTEM_SYNC_INTERVAL_MS 5000
+
+// Files a fatfs mount keeps open after they were closed, when it is not using FILESYSTEM_SYNC_ON_CLOSE
+#define FATFS_WRITEBACK_FILES 8
+
+// PSRAM shared by all FAT filesystems to cache device blocks
+#define BLOCK_CACHE_BYTES (1024 * 1024)
+
+// A sequential reader's readahead starts at MIN blocks and doubles up to MAX, reads of MAX blocks or more bypass the
+// cache
+#define BLOCK_CACHE_READAHEAD_MIN 2
+#define BLOCK_CACHE_READAHEAD_MAX 16
+
+// Sequential readers followed per filesystem
+#define BLOCK_CACHE_STREAMS 8
+
+// Fastest SD bus mode to try and the highest clock the board wiring is trusted with, slower modes are tried when a
+// faster one doesn't work. The UHS-I modes are opt-in: a card that switched to 1.8V signalling stays there until its
+// power is cut, which the board can't do, so a failed UHS-I attempt can leave the card unmountable until a reboot.
+#define SD_MAX_BUS_MODE FILESYSTEM_BUS_SD_HIGH_SPEED
+#define SD_MAX_FREQ_KHZ 40000
+
+// Cluster size of SD cards formatted by BadgeVMS
+#define SD_ALLOCATION_UNIT_SIZE (32 * 1024)
+
+// Longest single SD card transfer, larger reads and writes are split
+#define SD_MAX_TRANSFER_SECTORS 128
+
+// Read from the start of an SD card when mounting it to measure its speed and check the bus mode is reliable, 0 to
+// skip
+#define SD_PROBE_BYTES (256 * 1024)
+
+// Results of stat on filesystem paths kept across all filesystems, paths of STAT_CACHE_KEY_BYTES or longer are never
+// cached
+#define STAT_CACHE_SLOTS     256
+#define STAT_CACHE_KEY_BYTES 96
+
+// The application database is compacted once superseded records take more than this and more than the live ones
+#define APP_DB_COMPACT_SLACK (8 * 1024)
+
+// File reads and writes waiting for or being handled by the kernel I/O tasks, across all processes
+#define IO_QUEUE_DEPTH 32
+
+// Number of kernel I/O tasks
+#define IO_TASKS 2
+
+// Largest single transfer through the I/O tasks, longer reads and writes are split or complete short
+#define IO_BOUNCE_MAX (64 * 1024)
+
+// sendfile() moves file data to sockets through SPLICE_BUFFERS buffers of SPLICE_BUFFER_BYTES shared by all processes
+#define SPLICE_BUFFERS      4
+#define SPLICE_BUFFER_BYTES (16 * 1024)
+
+// Registered devices and the longest device name, including the terminating NUL
+#define DEVICE_TABLE_SLOTS 32
+#define DEVICE_NAME_MAX    16
+
+// Kept-alive curl connections per process, of which at most MAX_PER_HOST to the same scheme, host and port. Idle ones
+// are closed after IDLE_TIMEOUT_MS, hosts of HOST_MAX characters or longer are never pooled.
+#define HTTP_POOL_CONNECTIONS     4
+#define HTTP_POOL_MAX_PER_HOST    2
+#define HTTP_POOL_IDLE_TIMEOUT_MS 15000
+#define HTTP_POOL_HOST_MAX        128
+
+// Transfers of a curl multi handle run at the same time over at most MAX_TOTAL connections, of which at most
+// MAX_PER_HOST to the same scheme, host and port, unless the application sets other limits. Each running transfer
+// reads the response through a buffer of BUFFER_BYTES, which also bounds the length of a header line.
+#define HTTP_MULTI_MAX_TOTAL    8
+#define HTTP_MULTI_MAX_PER_HOST 4
+#define HTTP_MULTI_BUFFER_BYTES 2048
+
+// Resumable TLS sessions kept per process, one per host and port, for at most MAX_AGE_S or the ticket lifetime the
+// server gave
+#define TLS_SESSION_CACHE_SLOTS     8
+#define TLS_SESSION_CACHE_MAX_AGE_S (2 * 60 * 60)
+
+// Cookies kept per process, found through BUCKETS buckets by domain. A cookie's name and value together can't be
+// longer than MAX_BYTES. Changes reach the cookie jar once the oldest is SAVE_DELAY_S old, when the curl handle is
+// cleaned up or when the application flushes them.
+#define COOKIE_STORE_BUCKETS     32
+#define COOKIE_STORE_MAX_COOKIES 128
+#define COOKIE_STORE_MAX_BYTES   4096
+#define COOKIE_JAR_SAVE_DELAY_S  30
+
+// Host names looked up by any process are kept for as long as the answer's TTL, but at least MIN_TTL_S so the
+// connection that asked finds them and at most MAX_TTL_S. Names that don't exist or lack addresses of a family are
+// kept for the negative TTL the server gave, at most NEGATIVE_MAX_TTL_S. Up to ADDRESSES_MAX addresses per family.
+#define DNS_CACHE_ENTRIES      64
+#define DNS_CACHE_MIN_TTL_S    5
+#define DNS_CACHE_MAX_TTL_S    (60 * 60)
+#define DNS_NEGATIVE_MAX_TTL_S (5 * 60)
+#define DNS_ADDRESSES_MAX      4
+
+// At most QUERIES_MAX lookups are in flight, the others wait their turn. A lookup is sent to the next of at most
+// SERVERS_MAX servers when there is no answer after RETRY_MS and given up on after ATTEMPTS tries. Once the addresses
+// of one family are in, the other gets RESOLUTION_DELAY_MS to follow.
+#define DNS_QUERIES_MAX         16
+#define DNS_SERVERS_MAX         3
+#define DNS_QUERY_RETRY_MS      1000
+#define DNS_QUERY_ATTEMPTS      3
+#define DNS_RESOLUTION_DELAY_MS 50
+
+// Parsed CA certificate chains shared by all connections, reparsed after MAX_AGE_S unless a transfer asks otherwise
+#define TLS_CA_CACHE_ENTRIES   4
+#define TLS_CA_CACHE_MAX_AGE_S (24 * 60 * 60)
+
+// An update is received into one of two buffers of OTA_STREAM_BUFFER_BYTES while the other is written to flash. A
+// broken download is resumed after RETRY_DELAY_MS, and given up on after RETRIES attempts in a row that got nowhere.
+#define OTA_STREAM_BUFFER_BYTES     (16 * 1024)
+#define OTA_DOWNLOAD_RETRIES        5
+#define OTA_DOWNLOAD_RETRY_DELAY_MS 1000
+
+// poll() and select() look at an fd again after this long when they can't be woken by it, like the TTY that can only
+// be polled
+#define POLL_FALLBACK_INTERVAL_MS 10
+#define TTY_POLL_INTERVAL_MS      10
+
+// eventfds that wake a poll() or tell a DNS lookup is done, anything beyond that is polled
+#define EVENTFD_MAX (8 + DNS_QUERIES_MAX + 1)
+
 // Maximum windows allowed on the screen
 #define MAX_WINDOWS 10
 
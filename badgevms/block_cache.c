@@ -0,0 +1,452 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "block_cache.h"
+
+#include "badgevms_config.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define NO_ENTRY (-1)
+
+typedef struct {
+    block_cache_volume_t *volume;
+    uint32_t              block;
+    int                   lru_prev;
+    int                   lru_next;
+    int                   hash_next;
+    bool                  readahead;
+} cache_entry_t;
+
+// A reader that is expected to continue at next_sector
+typedef struct {
+    uint32_t next_sector;
+    uint32_t window;
+    uint32_t used;
+} cache_stream_t;
+
+// Streams and scratch are only used by the caller, FatFs serializes access to a volume
+struct block_cache_volume {
+    block_cache_backend_t    backend;
+    uint32_t                 sectors_per_block;
+    uint32_t                 block_count;
+    uint8_t                 *scratch;
+    uint32_t                 clock;
+    cache_stream_t           streams[BLOCK_CACHE_STREAMS];
+    filesystem_cache_stats_t stats;
+};
+
+static char const *TAG = "block_cache";
+
+static SemaphoreHandle_t cache_lock;
+static cache_entry_t    *entries;
+static uint8_t          *blocks;
+static int              *buckets;
+static uint32_t          bucket_mask;
+static int               num_entries;
+static int               lru_head;
+static int               lru_tail;
+static size_t            blocks_used;
+
+static inline uint8_t *entry_data(int i) {
+    return blocks + (size_t)i * BLOCK_CACHE_BLOCK_SIZE;
+}
+
+static inline uint32_t bucket_of(block_cache_volume_t *volume, uint32_t block) {
+    uint32_t h = (uint32_t)(uintptr_t)volume * 2654435761u ^ block * 0x9e3779b1u;
+    return (h ^ (h >> 16)) & bucket_mask;
+}
+
+static int lookup(block_cache_volume_t *volume, uint32_t block) {
+    for (int i = buckets[bucket_of(volume, block)]; i != NO_ENTRY; i = entries[i].hash_next) {
+        if (entries[i].volume == volume && entries[i].block == block) {
+            return i;
+        }
+    }
+    return NO_ENTRY;
+}
+
+static void lru_unlink(int i) {
+    if (entries[i].lru_prev != NO_ENTRY) {
+        entries[entries[i].lru_prev].lru_next = entries[i].lru_next;
+    } else {
+        lru_head = entries[i].lru_next;
+    }
+
+    if (entries[i].lru_next != NO_ENTRY) {
+        entries[entries[i].lru_next].lru_prev = entries[i].lru_prev;
+    } else {
+        lru_tail = entries[i].lru_prev;
+    }
+}
+
+static void lru_push_head(int i) {
+    entries[i].lru_prev = NO_ENTRY;
+    entries[i].lru_next = lru_head;
+    if (lru_head != NO_ENTRY) {
+        entries[lru_head].lru_prev = i;
+    } else {
+        lru_tail = i;
+    }
+    lru_head = i;
+}
+
+static void lru_push_tail(int i) {
+    entries[i].lru_next = NO_ENTRY;
+    entries[i].lru_prev = lru_tail;
+    if (lru_tail != NO_ENTRY) {
+        entries[lru_tail].lru_next = i;
+    } else {
+        lru_head = i;
+    }
+    lru_tail = i;
+}
+
+// Unused entries live at the tail so they are handed out first
+static void entry_drop(int i) {
+    int *link = &buckets[bucket_of(entries[i].volume, entries[i].block)];
+    while (*link != i) {
+        link = &entries[*link].hash_next;
+    }
+    *link = entries[i].hash_next;
+
+    entries[i].volume    = NULL;
+    entries[i].hash_next = NO_ENTRY;
+    entries[i].readahead = false;
+    blocks_used--;
+
+    lru_unlink(i);
+    lru_push_tail(i);
+}
+
+static int entry_alloc(block_cache_volume_t *volume, uint32_t block, bool readahead) {
+    int i = lru_tail;
+    if (entries[i].volume) {
+        entries[i].volume->stats.evictions++;
+        entry_drop(i);
+    }
+
+    uint32_t bucket      = bucket_of(volume, block);
+    entries[i].volume    = volume;
+    entries[i].block     = block;
+    entries[i].readahead = readahead;
+    entries[i].hash_next = buckets[bucket];
+    buckets[bucket]      = i;
+    blocks_used++;
+
+    lru_unlink(i);
+    lru_push_head(i);
+    return i;
+}
+
+static int read_blocks(block_cache_volume_t *volume, uint32_t block, uint32_t num_blocks, uint8_t *dst) {
+    uint32_t sector = block * volume->sectors_per_block;
+    uint32_t count  = num_blocks * volume->sectors_per_block;
+    if (count > volume->backend.sector_count - sector) {
+        // The device ends halfway through the last block
+        size_t size = (size_t)num_blocks * BLOCK_CACHE_BLOCK_SIZE;
+        count       = volume->backend.sector_count - sector;
+        memset(dst + count * volume->backend.sector_size, 0, size - count * volume->backend.sector_size);
+    }
+
+    return volume->backend.read(volume->backend.ctx, dst, sector, count);
+}
+
+// Copies the part of block that overlaps the request into the caller's buffer
+static void copy_out(
+    block_cache_volume_t *volume, uint32_t block, uint8_t const *src, uint8_t *buf, uint32_t sector, uint32_t count
+) {
+    uint32_t start = block * volume->sectors_per_block;
+    uint32_t from  = start > sector ? start : sector;
+    uint32_t to    = start + volume->sectors_per_block;
+    if (to > sector + count) {
+        to = sector + count;
+    }
+
+    size_t ss = volume->backend.sector_size;
+    memcpy(buf + (from - sector) * ss, src + (from - start) * ss, (to - from) * ss);
+}
+
+static cache_stream_t *stream_update(block_cache_volume_t *volume, uint32_t sector, uint32_t count) {
+    cache_stream_t *stream = NULL;
+
+    for (int i = 0; i < BLOCK_CACHE_STREAMS; ++i) {
+        if (volume->streams[i].used && volume->streams[i].next_sector == sector) {
+            stream = &volume->streams[i];
+            break;
+        }
+    }
+
+    if (stream) {
+        if (!stream->window) {
+            stream->window = BLOCK_CACHE_READAHEAD_MIN;
+        }
+    } else {
+        stream = &volume->streams[0];
+        for (int i = 1; i < BLOCK_CACHE_STREAMS; ++i) {
+            if (volume->streams[i].used < stream->used) {
+                stream = &volume->streams[i];
+            }
+        }
+        stream->window = 0;
+    }
+
+    stream->next_sector = sector + count;
+    stream->used        = ++volume->clock;
+    return stream;
+}
+
+// Fetches the next window of a sequential reader once less than half of it is still cached
+static void readahead(block_cache_volume_t *volume, cache_stream_t *stream) {
+    uint32_t window = stream->window;
+    uint32_t next   = stream->next_sector / volume->sectors_per_block;
+    uint32_t ahead  = 0;
+    uint32_t run    = 0;
+
+    if (!window) {
+        return;
+    }
+
+    xSemaphoreTake(cache_lock, portMAX_DELAY);
+    while (ahead < window && next + ahead < volume->block_count && lookup(volume, next + ahead) != NO_ENTRY) {
+        ahead++;
+    }
+
+    uint32_t start = next + ahead;
+    if (ahead <= window / 2) {
+        while (run < window && start + run < volume->block_count && lookup(volume, start + run) == NO_ENTRY) {
+            run++;
+        }
+    }
+    xSemaphoreGive(cache_lock);
+
+    if (!run || read_blocks(volume, start, run, volume->scratch) != 0) {
+        return;
+    }
+
+    xSemaphoreTake(cache_lock, portMAX_DELAY);
+    for (uint32_t k = 0; k < run; ++k) {
+        if (lookup(volume, start + k) == NO_ENTRY) {
+            int i = entry_alloc(volume, start + k, true);
+            memcpy(entry_data(i), volume->scratch + (size_t)k * BLOCK_CACHE_BLOCK_SIZE, BLOCK_CACHE_BLOCK_SIZE);
+        }
+    }
+    volume->stats.readahead_blocks += run;
+    xSemaphoreGive(cache_lock);
+
+    stream->window = window * 2 > BLOCK_CACHE_READAHEAD_MAX ? BLOCK_CACHE_READAHEAD_MAX : window * 2;
+}
+
+int block_cache_read(block_cache_volume_t *volume, void *buf, uint32_t sector, uint32_t count) {
+    uint32_t spb = volume->sectors_per_block;
+
+    if (!count) {
+        return 0;
+    }
+
+    // Large reads are efficient on their own and would only push everything else out
+    if (count >= BLOCK_CACHE_READAHEAD_MAX * spb) {
+        xSemaphoreTake(cache_lock, portMAX_DELAY);
+        volume->stats.bypassed++;
+        xSemaphoreGive(cache_lock);
+
+        stream_update(volume, sector, count);
+        return volume->backend.read(volume->backend.ctx, buf, sector, count);
+    }
+
+    uint32_t block = sector / spb;
+    uint32_t last  = (sector + count - 1) / spb;
+    while (block <= last) {
+        xSemaphoreTake(cache_lock, portMAX_DELAY);
+        int i = lookup(volume, block);
+        if (i != NO_ENTRY) {
+            volume->stats.hits++;
+            if (entries[i].readahead) {
+                volume->stats.readahead_hits++;
+                entries[i].readahead = false;
+            }
+            lru_unlink(i);
+            lru_push_head(i);
+            copy_out(volume, block, entry_data(i), buf, sector, count);
+            xSemaphoreGive(cache_lock);
+            block++;
+            continue;
+        }
+
+        uint32_t run = 1;
+        while (block + run <= last && run < BLOCK_CACHE_READAHEAD_MAX && lookup(volume, block + run) == NO_ENTRY) {
+            run++;
+        }
+        xSemaphoreGive(cache_lock);
+
+        if (read_blocks(volume, block, run, volume->scratch) != 0) {
+            return -1;
+        }
+
+        xSemaphoreTake(cache_lock, portMAX_DELAY);
+        for (uint32_t k = 0; k < run; ++k) {
+            uint8_t const *src = volume->scratch + (size_t)k * BLOCK_CACHE_BLOCK_SIZE;
+
+            i = lookup(volume, block + k);
+            if (i == NO_ENTRY) {
+                i = entry_alloc(volume, block + k, false);
+                memcpy(entry_data(i), src, BLOCK_CACHE_BLOCK_SIZE);
+            }
+            copy_out(volume, block + k, src, buf, sector, count);
+        }
+        volume->stats.misses += run;
+        xSemaphoreGive(cache_lock);
+
+        block += run;
+    }
+
+    readahead(volume, stream_update(volume, sector, count));
+    return 0;
+}
+
+void block_cache_invalidate(block_cache_volume_t *volume, uint32_t sector, uint32_t count) {
+    if (!count) {
+        return;
+    }
+
+    uint32_t first = sector / volume->sectors_per_block;
+    uint32_t last  = (sector + count - 1) / volume->sectors_per_block;
+
+    xSemaphoreTake(cache_lock, portMAX_DELAY);
+    if (last - first >= (uint32_t)num_entries) {
+        for (int i = 0; i < num_entries; ++i) {
+            if (entries[i].volume == volume && entries[i].block >= first && entries[i].block <= last) {
+                entry_drop(i);
+                volume->stats.invalidations++;
+            }
+        }
+    } else {
+        for (uint32_t block = first; block <= last; ++block) {
+            int i = lookup(volume, block);
+            if (i != NO_ENTRY) {
+                entry_drop(i);
+                volume->stats.invalidations++;
+            }
+        }
+    }
+    xSemaphoreGive(cache_lock);
+}
+
+int block_cache_write(block_cache_volume_t *volume, void const *buf, uint32_t sector, uint32_t count) {
+    int ret = volume->backend.write(volume->backend.ctx, buf, sector, count);
+    block_cache_invalidate(volume, sector, count);
+    return ret;
+}
+
+block_cache_volume_t *block_cache_attach(block_cache_backend_t const *backend) {
+    if (!entries || !backend->sector_size || BLOCK_CACHE_BLOCK_SIZE % backend->sector_size) {
+        return NULL;
+    }
+
+    block_cache_volume_t *volume = calloc(1, sizeof(block_cache_volume_t));
+    if (!volume) {
+        return NULL;
+    }
+
+    volume->scratch = heap_caps_malloc(BLOCK_CACHE_READAHEAD_MAX * BLOCK_CACHE_BLOCK_SIZE, MALLOC_CAP_SPIRAM);
+    if (!volume->scratch) {
+        free(volume);
+        return NULL;
+    }
+
+    volume->backend           = *backend;
+    volume->sectors_per_block = BLOCK_CACHE_BLOCK_SIZE / backend->sector_size;
+    volume->block_count       = (backend->sector_count + volume->sectors_per_block - 1) / volume->sectors_per_block;
+
+    return volume;
+}
+
+void block_cache_detach(block_cache_volume_t *volume) {
+    if (!volume) {
+        return;
+    }
+
+    xSemaphoreTake(cache_lock, portMAX_DELAY);
+    for (int i = 0; i < num_entries; ++i) {
+        if (entries[i].volume == volume) {
+            entry_drop(i);
+        }
+    }
+    xSemaphoreGive(cache_lock);
+
+    heap_caps_free(volume->scratch);
+    free(volume);
+}
+
+void block_cache_stats_get(block_cache_volume_t *volume, filesystem_cache_stats_t *stats, bool reset) {
+    xSemaphoreTake(cache_lock, portMAX_DELAY);
+    *stats = volume->stats;
+    if (reset) {
+        memset(&volume->stats, 0, sizeof(filesystem_cache_stats_t));
+    }
+    xSemaphoreGive(cache_lock);
+}
+
+size_t block_cache_blocks_used(void) {
+    return blocks_used;
+}
+
+bool block_cache_init(size_t budget) {
+    num_entries = budget / BLOCK_CACHE_BLOCK_SIZE;
+    if (num_entries < BLOCK_CACHE_READAHEAD_MAX * 2) {
+        ESP_LOGE(TAG, "A budget of %zu bytes is too small", budget);
+        return false;
+    }
+
+    uint32_t num_buckets = 1;
+    while (num_buckets < (uint32_t)num_entries) {
+        num_buckets <<= 1;
+    }
+
+    cache_lock = xSemaphoreCreateMutex();
+    entries    = calloc(num_entries, sizeof(cache_entry_t));
+    buckets    = malloc(num_buckets * sizeof(int));
+    blocks     = heap_caps_malloc((size_t)num_entries * BLOCK_CACHE_BLOCK_SIZE, MALLOC_CAP_SPIRAM);
+    if (!cache_lock || !entries || !buckets || !blocks) {
+        ESP_LOGE(TAG, "Unable to allocate a cache of %zu bytes", budget);
+        free(entries);
+        free(buckets);
+        heap_caps_free(blocks);
+        entries = NULL;
+        return false;
+    }
+
+    bucket_mask = num_buckets - 1;
+    for (uint32_t b = 0; b < num_buckets; ++b) {
+        buckets[b] = NO_ENTRY;
+    }
+
+    lru_head = NO_ENTRY;
+    lru_tail = NO_ENTRY;
+    for (int i = 0; i < num_entries; ++i) {
+        entries[i].hash_next = NO_ENTRY;
+        lru_push_tail(i);
+    }
+    blocks_used = 0;
+
+    ESP_LOGI(TAG, "%d blocks of %d bytes", num_entries, BLOCK_CACHE_BLOCK_SIZE);
+    return true;
+}
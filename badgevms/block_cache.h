@@ -0,0 +1,53 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "badgevms/device.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A PSRAM cache of device sectors shared by all filesystems, in blocks of BLOCK_CACHE_BLOCK_SIZE bytes. Writes go
+// straight to the device and drop the blocks they touch. Readers that continue where they left off get a readahead
+// window that grows while they keep doing so.
+
+#define BLOCK_CACHE_BLOCK_SIZE 4096
+
+typedef struct {
+    void    *ctx;
+    int      (*read)(void *ctx, void *buf, uint32_t sector, uint32_t count);
+    int      (*write)(void *ctx, void const *buf, uint32_t sector, uint32_t count);
+    uint32_t sector_size; // Must divide BLOCK_CACHE_BLOCK_SIZE
+    uint32_t sector_count;
+} block_cache_backend_t;
+
+typedef struct block_cache_volume block_cache_volume_t;
+
+bool                  block_cache_init(size_t budget);
+block_cache_volume_t *block_cache_attach(block_cache_backend_t const *backend);
+void                  block_cache_detach(block_cache_volume_t *volume);
+
+// Both return 0 on success and -1 if the backend failed
+int block_cache_read(block_cache_volume_t *volume, void *buf, uint32_t sector, uint32_t count);
+int block_cache_write(block_cache_volume_t *volume, void const *buf, uint32_t sector, uint32_t count);
+
+// Drops cached sectors without writing anything, for discards
+void block_cache_invalidate(block_cache_volume_t *volume, uint32_t sector, uint32_t count);
+
+void   block_cache_stats_get(block_cache_volume_t *volume, filesystem_cache_stats_t *stats, bool reset);
+size_t block_cache_blocks_used(void);
@@ -23,20 +23,25 @@
 #include "badgevms/process.h"
 #include "badgevms_config.h"
 #include "compositor_private.h"
-#include "driver/ppa.h"
 #include "esp_cache.h"
+#include "esp_heap_caps.h"
 #include "esp_ipc.h"
 #include "esp_log.h"
 #include "esp_private/esp_cache_private.h"
+#include "esp_timer.h"
 #include "font.h"
+#include "freertos/event_groups.h"
 #include "memory.h"
-#include "pixel_functions.h"
+#include "render.h"
 #include "task.h"
-#include "window_decorations.h"
 
+#include <errno.h>
+#include <limits.h>
 #include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
 
-#include <math.h>
+#include <sys/poll.h>
 #include <sys/time.h>
 
 #define TAG "compositor"
@@ -50,18 +55,48 @@
 
 static TaskHandle_t  compositor_handle;
 static lcd_device_t *lcd_device;
-static device_t     *keyboard_device;
 
 static window_t     *window_stack = NULL;
 static QueueHandle_t compositor_queue;
+static QueueHandle_t shortcut_queue;
 
 static int        cur_fb = 0;
 static atomic_int cur_num_windows;
 static uint16_t  *framebuffers[DISPLAY_FRAMEBUFFERS];
 
-static int  background_damaged    = 7;
-static int  decoration_damaged    = 7;
-static bool visible_regions_valid = false;
+static SemaphoreHandle_t  stats_lock;
+static compositor_stats_t stats;
+static atomic_uint        vblank_count;
+static atomic_uint        compose_seq;
+static atomic_uint        scanout_seq;
+static EventGroupHandle_t frame_events;
+
+// The events fds of windows refer to them through this table, a handle is the slot plus a multiple of MAX_WINDOWS so
+// a stale one doesn't match the slot's next window. A window leaves the table before it is freed, so a poll() on
+// another thread finds out it went away rather than looking at freed memory.
+typedef struct {
+    window_t *window;
+    int       handle;
+} event_handle_t;
+
+static SemaphoreHandle_t event_handle_lock;
+static event_handle_t    event_handles[MAX_WINDOWS];
+static int               event_handle_generation;
+
+// With the event handle lock held
+static window_t *event_handle_window(int handle) {
+    event_handle_t *slot = &event_handles[handle % MAX_WINDOWS];
+    return slot->window && slot->handle == handle ? slot->window : NULL;
+}
+
+static void event_handle_release(window_t *window) {
+    xSemaphoreTake(event_handle_lock, portMAX_DELAY);
+    if (window->event_handle >= 0) {
+        event_handles[window->event_handle % MAX_WINDOWS].window = NULL;
+        window->event_handle                                     = -1;
+    }
+    xSemaphoreGive(event_handle_lock);
+}
 
 typedef enum {
     WINDOW_CREATE,
@@ -69,9 +104,35 @@ typedef enum {
     WINDOW_FLAGS,
     WINDOW_MOVE,
     WINDOW_RESIZE,
+    WINDOW_TRANSACTION,
     FRAMEBUFFER_SWAP
 } compositor_command_t;
 
+typedef enum {
+    TRANSACTION_MOVE,
+    TRANSACTION_RESIZE,
+    TRANSACTION_FLAGS,
+    TRANSACTION_TITLE,
+} transaction_op_type_t;
+
+typedef struct {
+    transaction_op_type_t type;
+    window_t             *window;
+    union {
+        window_coords_t coords;
+        window_size_t   size;
+        window_flag_t   flags;
+        char           *title;
+    };
+} transaction_op_t;
+
+typedef struct window_transaction {
+    transaction_op_t *ops;
+    int               num_ops;
+    int               max_ops;
+    bool              failed;
+} window_transaction_t;
+
 typedef struct {
     compositor_command_t   command;
     window_t              *window;
@@ -80,35 +141,21 @@ typedef struct {
     window_size_t          size;
     managed_framebuffer_t *fb_a;
     managed_framebuffer_t *fb_b;
+    window_transaction_t  *transaction;
     TaskHandle_t           caller;
 } compositor_message_t;
 
-rotation_angle_t rotation = ROTATION_ANGLE_270;
-
 #define WINDOW_MAX_W (FRAMEBUFFER_MAX_W - (2 * BORDER_PX) - SIDE_BAR_PX)
 #define WINDOW_MAX_H (FRAMEBUFFER_MAX_H - BORDER_TOP_PX - TOP_BAR_PX)
 
-#define ALL_DISPLAY_FB_MASK 7 // (1 + 2 + 4)
+// Two bits so a waiter that looked at scanout_seq just before a frame went out can't miss it
+#define FRAME_EVEN_BIT  (1 << 0)
+#define FRAME_ODD_BIT   (1 << 1)
+#define FRAME_PERIOD_US (1000000 / FRAMEBUFFER_MAX_REFRESH)
 
 #define WINDOW_MOVE_STEP          10
-#define WINDOW_COMMANDS_PER_FRAME 5
-#define KEYBOARD_EVENTS_PER_FRAME 10
-
-static inline void mark_scene_damaged(void) {
-    visible_regions_valid = false;
-    decoration_damaged    = ALL_DISPLAY_FB_MASK;
-    background_damaged    = ALL_DISPLAY_FB_MASK;
-}
-
-__attribute__((always_inline)) static inline ppa_srm_rotation_angle_t rotation_to_srm(rotation_angle_t rotation) {
-    switch (rotation) {
-        case ROTATION_ANGLE_270: return PPA_SRM_ROTATION_ANGLE_90;
-        case ROTATION_ANGLE_180: return PPA_SRM_ROTATION_ANGLE_180;
-        case ROTATION_ANGLE_90: return PPA_SRM_ROTATION_ANGLE_270;
-        default:
-    }
-    return PPA_SRM_ROTATION_ANGLE_0;
-}
+#define TRANSACTION_INITIAL_OPS   4
+#define SHORTCUT_QUEUE_LENGTH     10
 
 __attribute__((always_inline)) static inline window_size_t window_clamp_size(window_t *window, window_size_t size) {
     window_size_t ret;
@@ -163,6 +210,7 @@ __attribute__((always_inline)) static inline void push_window(window_t *window)
     }
 
     window_stack = window;
+    input_focus_set(window_stack);
     atomic_fetch_add(&cur_num_windows, 1);
 }
 
@@ -192,119 +240,10 @@ __attribute__((always_inline)) static inline void remove_window(window_t *window
     prev->next   = next;
     window_stack = next;
 out:
+    input_focus_set(window_stack);
     atomic_fetch_sub(&cur_num_windows, 1);
 }
 
-// Workaround for the PPA hardware. It really does not like 65 pixel high strips.
-__attribute__((always_inline)) static inline bool is_problematic_block_height(int content_height, float scale) {
-    // Check if height is "N × 32 + 1"
-    int fb_height = (int)(content_height / scale);
-    if (fb_height > 32 && (fb_height % 32) == 1) {
-        return true;
-    }
-    return false;
-}
-
-__attribute__((always_inline)) static inline bool ppa_workaround_split_rects(rect_array_t *visible, float scale) {
-    rect_array_t new_visible = {0};
-    bool         split       = false;
-
-    for (int i = 0; i < visible->count; i++) {
-        window_rect_t rect = visible->rects[i];
-
-        if (is_problematic_block_height(rect.h, scale)) {
-            split           = true;
-            int first_half  = (rect.h / 2) - 1;
-            int second_half = rect.h - first_half;
-            ESP_LOGW(TAG, "Splitting block of problematic height %u in %u and %u", rect.h, first_half, second_half);
-
-            new_visible.rects[new_visible.count++] =
-                (window_rect_t){.x = rect.x, .y = rect.y, .w = rect.w, .h = first_half};
-
-            if (new_visible.count < MAX_VISIBLE_RECTS) {
-                new_visible.rects[new_visible.count++] =
-                    (window_rect_t){.x = rect.x, .y = rect.y + first_half, .w = rect.w, .h = second_half};
-            }
-        } else {
-            if (new_visible.count < MAX_VISIBLE_RECTS) {
-                new_visible.rects[new_visible.count++] = rect;
-            }
-        }
-    }
-
-    *visible = new_visible;
-    return split;
-}
-
-void window_calculate_visible_regions(window_t *window, window_t *window_list_head, float scale) {
-    window->visible.count    = 1;
-    window->visible.rects[0] = window->rect;
-
-    if (!(window->flags & WINDOW_FLAG_FULLSCREEN)) {
-        // For occlusion we only care about our OWN content region
-        window->visible.rects[0].x += BORDER_PX;
-        window->visible.rects[0].y += BORDER_TOP_PX;
-    }
-
-    window_t *occluder = window_list_head;
-
-    while (occluder != NULL && occluder != window) {
-        rect_array_t new_visible = {0};
-
-        for (int j = 0; j < window->visible.count; j++) {
-            window_rect_t occluder_rect = occluder->rect;
-            if (!(occluder->flags & WINDOW_FLAG_FULLSCREEN)) {
-                // But other window decorations do occlude us
-                occluder_rect.w += (BORDER_PX * 2);
-                occluder_rect.h += BORDER_TOP_PX + BORDER_PX;
-            }
-
-            small_rect_array_t pieces = rect_subtract(window->visible.rects[j], occluder_rect);
-
-            for (int k = 0; k < pieces.count; k++) {
-                if (new_visible.count < MAX_VISIBLE_RECTS) {
-                    new_visible.rects[new_visible.count++] = pieces.rects[k];
-                }
-            }
-        }
-
-        window->visible = new_visible;
-
-        if (window->visible.count == 0) {
-            break;
-        }
-
-        occluder = occluder->next;
-    }
-
-    merge_rectangles(&window->visible);
-    while (ppa_workaround_split_rects(&window->visible, scale)) {
-    }
-}
-
-window_rect_t content_to_framebuffer_rect(window_rect_t content_rect, window_t *window, float scale) {
-    if (!(window->flags & WINDOW_FLAG_FULLSCREEN)) {
-        content_rect.x -= (window->rect.x + BORDER_PX);
-        content_rect.y -= (window->rect.y + BORDER_TOP_PX);
-    }
-
-    managed_framebuffer_t *framebuffer = window->framebuffers[window->front_fb];
-
-    int start_x = (int)(content_rect.x / scale);
-    int start_y = (int)(content_rect.y / scale);
-    int end_x   = (int)((content_rect.x + content_rect.w) / scale);
-    int end_y   = (int)((content_rect.y + content_rect.h) / scale);
-
-    start_x = MAX(0, MIN(start_x, (int)framebuffer->w - 1));
-    start_y = MAX(0, MIN(start_y, (int)framebuffer->h - 1));
-    end_x   = MAX(start_x, MIN(end_x, (int)framebuffer->w));
-    end_y   = MAX(start_y, MIN(end_y, (int)framebuffer->h));
-
-    window_rect_t fb_rect = {.x = start_x, .y = start_y, .w = end_x - start_x, .h = end_y - start_y};
-
-    return fb_rect;
-}
-
 static void reassign_vaddr(uintptr_t new_vaddr_start, size_t num_pages, allocation_range_t *head) {
     // we go backwards because we start from the highest address
     // and don't forget our guard page
@@ -437,6 +376,7 @@ void framebuffer_free(managed_framebuffer_t *framebuffer) {
 }
 
 IRAM_ATTR static void on_refresh(void *ignored) {
+    atomic_fetch_add(&vblank_count, 1);
     xTaskNotifyGiveIndexed(compositor_handle, 0);
 }
 
@@ -446,36 +386,179 @@ IRAM_ATTR static void on_refresh(void *ignored) {
 //     return true;
 // }
 
-static void IRAM_ATTR NOINLINE_ATTR compositor(void *ignored) {
-    static ppa_client_handle_t ppa_srm_handle = NULL;
+static void timing_add(compositor_timing_t *timing, uint32_t us) {
+    if (!timing->count || us < timing->min_us) {
+        timing->min_us = us;
+    }
+    if (us > timing->max_us) {
+        timing->max_us = us;
+    }
+    timing->total_us += us;
+    timing->count++;
 
-    ppa_client_config_t ppa_srm_config = {
-        .oper_type             = PPA_OPERATION_SRM,
-        .max_pending_trans_num = 1,
-    };
+    int bucket = 0;
+    while (bucket < COMPOSITOR_HISTOGRAM_BUCKETS - 1 && us >= (1000u << bucket)) {
+        ++bucket;
+    }
+    timing->histogram[bucket]++;
+}
+
+static void window_frame_composited(window_t *window) {
+    xSemaphoreTake(stats_lock, portMAX_DELAY);
+    window->composited_seq  = atomic_load(&compose_seq);
+    window->scanout_pending = true;
+    window->stats.frames_composited++;
+    xSemaphoreGive(stats_lock);
+}
+
+// Called once per refresh with the frame that just went (or would have gone, if nothing changed) to the panel
+static void frame_scanned_out(uint32_t seq) {
+    uint32_t now = (uint32_t)esp_timer_get_time();
+
+    xSemaphoreTake(stats_lock, portMAX_DELAY);
+    stats.frame_seq = seq;
+
+    window_t *window = window_stack;
+    if (window) {
+        do {
+            if (window->scanout_pending && (int32_t)(seq - window->composited_seq) >= 0) {
+                uint32_t latency = now - atomic_load(&window->present_time_us);
+                timing_add(&window->stats.present_latency, latency);
+                if (latency > FRAME_PERIOD_US) {
+                    window->stats.deadlines_missed++;
+                }
+                window->scanout_pending = false;
+            }
+            window = window->next;
+        } while (window != window_stack);
+    }
+    xSemaphoreGive(stats_lock);
+
+    atomic_store(&scanout_seq, seq);
+    xEventGroupSetBits(frame_events, (seq & 1) ? FRAME_ODD_BIT : FRAME_EVEN_BIT);
+    xEventGroupClearBits(frame_events, (seq & 1) ? FRAME_EVEN_BIT : FRAME_ODD_BIT);
+}
+
+static void window_apply_flags(window_t *window, window_flag_t flags) {
+    // Preserve the double buffered flag
+    bool double_buffered  = window->flags & WINDOW_FLAG_DOUBLE_BUFFERED;
+    flags                &= ~WINDOW_FLAG_DOUBLE_BUFFERED;
+    if (double_buffered) {
+        flags |= WINDOW_FLAG_DOUBLE_BUFFERED;
+    }
+
+    if (window->flags & WINDOW_FLAG_FULLSCREEN) {
+        if (!(flags & WINDOW_FLAG_FULLSCREEN)) {
+            window->rect = window->rect_orig;
+        }
+    } else {
+        if (flags & WINDOW_FLAG_FULLSCREEN) {
+            window->rect_orig = window->rect;
+            window->rect.x    = 0;
+            window->rect.y    = 0;
+            window->rect.w    = FRAMEBUFFER_MAX_W;
+            window->rect.h    = FRAMEBUFFER_MAX_H;
+        }
+    }
+    window->flags = flags;
+    mark_scene_damaged();
+}
+
+static void window_apply_position(window_t *window, window_coords_t coords) {
+    coords         = window_clamp_position(window, coords);
+    window->rect.x = coords.x;
+    window->rect.y = coords.y;
+    mark_scene_damaged();
+}
+
+static void window_apply_size(window_t *window, window_size_t size) {
+    size           = window_clamp_size(window, size);
+    window->rect.w = size.w;
+    window->rect.h = size.h;
+    mark_scene_damaged();
+}
+
+static bool window_in_stack(window_t *window) {
+    window_t *w = window_stack;
+    if (!w) {
+        return false;
+    }
+
+    do {
+        if (w == window) {
+            return true;
+        }
+        w = w->next;
+    } while (w != window_stack);
+
+    return false;
+}
+
+static void window_transaction_free(window_transaction_t *transaction) {
+    for (int i = 0; i < transaction->num_ops; ++i) {
+        if (transaction->ops[i].type == TRANSACTION_TITLE) {
+            free(transaction->ops[i].title);
+        }
+    }
+    free(transaction->ops);
+    free(transaction);
+}
+
+static void window_transaction_apply(window_transaction_t *transaction) {
+    for (int i = 0; i < transaction->num_ops; ++i) {
+        transaction_op_t *op = &transaction->ops[i];
 
-    // ppa_event_callbacks_t srm_callbacks = {
-    //     .on_trans_done = ppa_srm_callback,
-    // };
+        // An asynchronous transaction may outlive the windows it refers to
+        if (!window_in_stack(op->window)) {
+            ESP_LOGW(TAG, "Transaction refers to window %p which is gone", op->window);
+            continue;
+        }
 
-    ppa_register_client(&ppa_srm_config, &ppa_srm_handle);
-    // ppa_client_register_event_callbacks(ppa_srm_handle, &srm_callbacks);
+        switch (op->type) {
+            case TRANSACTION_MOVE: window_apply_position(op->window, op->coords); break;
+            case TRANSACTION_RESIZE: window_apply_size(op->window, op->size); break;
+            case TRANSACTION_FLAGS: window_apply_flags(op->window, op->flags); break;
+            case TRANSACTION_TITLE:
+                free(op->window->title);
+                op->window->title  = op->title;
+                op->title          = NULL;
+                decoration_damaged = ALL_DISPLAY_FB_MASK;
+                break;
+        }
+    }
 
-    bool   fn_down               = false;
-    bool   frame_ready           = false;
-    time_t launcher_last_started = time(NULL);
+    window_transaction_free(transaction);
+}
+
+static void IRAM_ATTR NOINLINE_ATTR compositor(void *ignored) {
+    if (!render_init()) {
+        ESP_LOGE(TAG, "Unable to initialize the renderer");
+    }
+
+    bool     frame_ready           = false;
+    time_t   launcher_last_started = time(NULL);
+    uint32_t last_vblank           = atomic_load(&vblank_count);
 
     while (1) {
-        bool changes   = false;
-        int  processed = 0;
+        bool        changes   = false;
+        UBaseType_t processed = 0;
+        uint32_t    ppa_us    = 0;
         ulTaskNotifyTakeIndexed(0, pdTRUE, portMAX_DELAY);
 
+        int64_t  frame_start = esp_timer_get_time();
+        uint32_t vblank      = atomic_load(&vblank_count);
+        uint32_t vblanks     = vblank - last_vblank;
+        last_vblank          = vblank;
+
         if (frame_ready) {
             lcd_device->_draw(lcd_device, 0, 0, FRAMEBUFFER_MAX_W, FRAMEBUFFER_MAX_H, framebuffers[cur_fb]);
             cur_fb      = (cur_fb + 1) % DISPLAY_FRAMEBUFFERS;
             frame_ready = false;
         }
 
+        frame_scanned_out(atomic_load(&compose_seq));
+        atomic_fetch_add(&compose_seq, 1);
+
         if (!window_stack) {
             time_t current_time = time(NULL);
             if (current_time - launcher_last_started > 2) {
@@ -486,7 +569,11 @@ static void IRAM_ATTR NOINLINE_ATTR compositor(void *ignored) {
 
         compositor_message_t message;
 
-        while (xQueueReceive(compositor_queue, &message, 0) == pdTRUE) {
+        // Only handle what was queued before this frame started, so a client committing in a tight loop can't
+        // starve the display. Whole transactions count as a single message.
+        UBaseType_t pending = uxQueueMessagesWaiting(compositor_queue);
+
+        while (processed < pending && xQueueReceive(compositor_queue, &message, 0) == pdTRUE) {
             ++processed;
             switch (message.command) {
                 case WINDOW_CREATE:
@@ -495,6 +582,8 @@ static void IRAM_ATTR NOINLINE_ATTR compositor(void *ignored) {
                     break;
                 case WINDOW_DESTROY:
                     remove_window(message.window);
+                    event_handle_release(message.window);
+                    wait_queue_deinit(&message.window->event_waiters);
                     vQueueDelete(message.window->event_queue);
 
                     for (int i = 0; i < 2; ++i) {
@@ -506,42 +595,10 @@ static void IRAM_ATTR NOINLINE_ATTR compositor(void *ignored) {
                     free(message.window);
                     mark_scene_damaged();
                     break;
-                case WINDOW_FLAGS:
-                    // Preserve the double buffered flag
-                    bool double_buffered  = message.window->flags & WINDOW_FLAG_DOUBLE_BUFFERED;
-                    message.flags        &= ~WINDOW_FLAG_DOUBLE_BUFFERED;
-                    if (double_buffered) {
-                        message.flags |= WINDOW_FLAG_DOUBLE_BUFFERED;
-                    }
-
-                    if (message.window->flags & WINDOW_FLAG_FULLSCREEN) {
-                        if (!(message.flags & WINDOW_FLAG_FULLSCREEN)) {
-                            message.window->rect = message.window->rect_orig;
-                        }
-                    } else {
-                        if (message.flags & WINDOW_FLAG_FULLSCREEN) {
-                            message.window->rect_orig = message.window->rect;
-                            message.window->rect.x    = 0;
-                            message.window->rect.y    = 0;
-                            message.window->rect.w    = FRAMEBUFFER_MAX_W;
-                            message.window->rect.h    = FRAMEBUFFER_MAX_H;
-                        }
-                    }
-                    message.window->flags = message.flags;
-                    mark_scene_damaged();
-                    break;
-                case WINDOW_MOVE:
-                    window_coords_t coords = window_clamp_position(message.window, message.coords);
-                    message.window->rect.x = coords.x;
-                    message.window->rect.y = coords.y;
-                    mark_scene_damaged();
-                    break;
-                case WINDOW_RESIZE:
-                    window_size_t size     = window_clamp_size(message.window, message.size);
-                    message.window->rect.w = size.w;
-                    message.window->rect.h = size.h;
-                    mark_scene_damaged();
-                    break;
+                case WINDOW_FLAGS: window_apply_flags(message.window, message.flags); break;
+                case WINDOW_MOVE: window_apply_position(message.window, message.coords); break;
+                case WINDOW_RESIZE: window_apply_size(message.window, message.size); break;
+                case WINDOW_TRANSACTION: window_transaction_apply(message.transaction); break;
                 case FRAMEBUFFER_SWAP: framebuffer_swap(message.fb_a, message.fb_b); break;
                 default: ESP_LOGE(TAG, "Unknown command %u", message.command);
             }
@@ -551,113 +608,74 @@ static void IRAM_ATTR NOINLINE_ATTR compositor(void *ignored) {
                     xTaskNotifyGiveIndexed(message.caller, 0);
                 }
             }
+        }
 
-            if (processed > WINDOW_COMMANDS_PER_FRAME) {
-                break;
+        // Key combinations the input task set aside for us, everything else went straight to the focused window
+        event_t shortcut;
+        while (xQueueReceive(shortcut_queue, &shortcut, 0) == pdTRUE) {
+            if (!window_stack) {
+                continue;
             }
-        }
 
-        event_t events[KEYBOARD_EVENTS_PER_FRAME];
-        ssize_t res = keyboard_device->_read(keyboard_device, 0, events, sizeof(event_t) * KEYBOARD_EVENTS_PER_FRAME);
-        for (int i = 0; i < res / sizeof(event_t); ++i) {
-            event_t *c = &events[i];
-            if (c->keyboard.scancode == KEY_SCANCODE_FN) {
-                if (c->keyboard.down) {
-                    fn_down = true;
+            if (shortcut.keyboard.scancode == KEY_SCANCODE_TAB && shortcut.keyboard.mod & BADGEVMS_KMOD_LALT) {
+                if (window_stack->next->title) {
+                    ESP_LOGW(
+                        TAG,
+                        "ALT-TAB switching to window %p (%s)",
+                        window_stack->next,
+                        window_stack->next->title
+                    );
                 } else {
-                    fn_down = false;
+                    ESP_LOGW(TAG, "ALT-TAB switching to window %p (no title)", window_stack->next);
                 }
-                // Hide the FN key
-                c->type = EVENT_NONE;
+                window_stack = window_stack->next;
+                input_focus_set(window_stack);
+                // No need to redraw the background
+                mark_stack_damaged(window_stack);
+                continue;
             }
 
-            if (window_stack) {
-                ESP_LOGV(TAG, "Got scancode %02X mods %02X", c->keyboard.scancode, c->keyboard.mod);
-                if (c->keyboard.scancode == KEY_SCANCODE_TAB && c->keyboard.mod & BADGEVMS_KMOD_LALT &&
-                    c->keyboard.down) {
-                    if (window_stack->next->title) {
-                        ESP_LOGW(
-                            TAG,
-                            "ALT-TAB switching to window %p (%s)",
-                            window_stack->next,
-                            window_stack->next->title
-                        );
-                    } else {
-                        ESP_LOGW(TAG, "ALT-TAB switching to window %p (no title)", window_stack->next);
-                    }
-                    window_stack          = window_stack->next;
-                    c->type               = EVENT_NONE;
-                    // No need to redraw the background
-                    visible_regions_valid = false;
-                    decoration_damaged    = 7;
-                }
+            window_coords_t cur_pos = {
+                .x = window_stack->rect.x,
+                .y = window_stack->rect.y,
+            };
+            switch (shortcut.keyboard.scancode) {
+                case KEY_SCANCODE_UP:
+                    cur_pos.y -= WINDOW_MOVE_STEP;
+                    mark_scene_damaged();
+                    break;
+                case KEY_SCANCODE_DOWN:
+                    cur_pos.y += WINDOW_MOVE_STEP;
+                    mark_scene_damaged();
+                    break;
+                case KEY_SCANCODE_LEFT:
+                    cur_pos.x -= WINDOW_MOVE_STEP;
+                    mark_scene_damaged();
+                    break;
+                case KEY_SCANCODE_RIGHT:
+                    cur_pos.x += WINDOW_MOVE_STEP;
+                    mark_scene_damaged();
+                    break;
+                case KEY_SCANCODE_CROSS:
+                    window_t    *window    = window_stack;
+                    task_info_t *task_info = (task_info_t *)atomic_load(&window->task_info);
+                    remove_window(window);
+                    // So we don't end up deleting this window twice
+                    window->next = NULL;
+                    window->prev = NULL;
 
-                if (fn_down) {
-                    if (c->keyboard.down) {
-                        window_coords_t cur_pos = {
-                            .x = window_stack->rect.x,
-                            .y = window_stack->rect.y,
-                        };
-                        switch (c->keyboard.scancode) {
-                            case KEY_SCANCODE_UP:
-                                cur_pos.y -= WINDOW_MOVE_STEP;
-                                mark_scene_damaged();
-                                break;
-                            case KEY_SCANCODE_DOWN:
-                                cur_pos.y += WINDOW_MOVE_STEP;
-                                mark_scene_damaged();
-                                break;
-                            case KEY_SCANCODE_LEFT:
-                                cur_pos.x -= WINDOW_MOVE_STEP;
-                                mark_scene_damaged();
-                                break;
-                            case KEY_SCANCODE_RIGHT:
-                                cur_pos.x += WINDOW_MOVE_STEP;
-                                mark_scene_damaged();
-                                break;
-                            case KEY_SCANCODE_CROSS:
-                                window_t    *window    = window_stack;
-                                task_info_t *task_info = (task_info_t *)atomic_load(&window->task_info);
-                                remove_window(window);
-                                // So we don't end up deleting this window twice
-                                window->next = NULL;
-                                window->prev = NULL;
-
-                                if (task_info) {
-                                    if (eTaskGetState(task_info->handle) != eDeleted) {
-                                        vTaskDelete(task_info->handle);
-                                    }
-                                }
-                                mark_scene_damaged();
-                                continue;
-                            default:
+                    if (task_info) {
+                        if (eTaskGetState(task_info->handle) != eDeleted) {
+                            vTaskDelete(task_info->handle);
                         }
-                        cur_pos              = window_clamp_position(window_stack, cur_pos);
-                        window_stack->rect.x = cur_pos.x;
-                        window_stack->rect.y = cur_pos.y;
-                    }
-                }
-
-                if (!fn_down && c->type != EVENT_NONE) {
-                    if (xQueueSend(window_stack->event_queue, c, 0) != pdTRUE) {
-                        ESP_LOGW(TAG, "Unable to send event to task");
                     }
-                }
+                    mark_scene_damaged();
+                    continue;
+                default:
             }
-        }
-
-        bool framebuffer_cleared = false;
-        if (background_damaged & (1 << cur_fb)) {
-            memset(framebuffers[cur_fb], 0xaa, FRAMEBUFFER_BYTES);
-            // Make sure the ppa will see our new background
-            esp_cache_msync(
-                framebuffers[cur_fb],
-                FRAMEBUFFER_BYTES,
-                ESP_CACHE_MSYNC_FLAG_DIR_C2M | ESP_CACHE_MSYNC_FLAG_INVALIDATE
-            );
-            background_damaged  &= ~(1 << cur_fb);
-            changes              = true;
-            framebuffer_cleared  = true;
+            cur_pos              = window_clamp_position(window_stack, cur_pos);
+            window_stack->rect.x = cur_pos.x;
+            window_stack->rect.y = cur_pos.y;
         }
 
         if (window_stack) {
@@ -681,141 +699,49 @@ static void IRAM_ATTR NOINLINE_ATTR compositor(void *ignored) {
                 }
 
                 managed_framebuffer_t *framebuffer = window->framebuffers[window->front_fb];
-
-                if (!framebuffer) {
-                    // Not yet allocated, or in the process of being destroyed
-                    if (!visible_regions_valid) {
-                        window_calculate_visible_regions(window, window_stack, 1.0);
-                    }
-                    window = window->prev;
-                    continue;
+                if (framebuffer && !atomic_flag_test_and_set(&framebuffer->clean)) {
+                    window->fb_dirty        = 7;
+                    window->content_pending = true;
+                    window_frame_composited(window);
                 }
 
-                float scale_x = ((float)window->rect.w / (float)framebuffer->w);
-                float scale_y = ((float)window->rect.h / (float)framebuffer->h);
-                float scale   = fminf(scale_x, scale_y);
-
-                if (!visible_regions_valid) {
-                    window_calculate_visible_regions(window, window_stack, scale);
-                }
-
-                bool is_clean             = atomic_flag_test_and_set(&framebuffer->clean);
-                bool need_decoration_draw = decoration_damaged & (1 << cur_fb);
-                bool need_content_draw    = false;
-
-                if (is_clean) {
-                    if (window->fb_dirty & (1 << cur_fb)) {
-                        need_content_draw = true;
-                    }
-                } else {
-                    window->fb_dirty  = 7;
-                    need_content_draw = true;
-                }
-
-                if (framebuffer_cleared || window == window_stack) {
-                    need_decoration_draw = true;
-                    need_content_draw    = true;
-                }
-
-                if (need_content_draw) {
-                    ppa_srm_rotation_angle_t ppa_rotation = rotation_to_srm(rotation);
-                    bool                     rgb_swap     = false;
-                    bool                     byte_swap    = false;
-                    ppa_srm_color_mode_t     mode         = PPA_SRM_COLOR_MODE_RGB565;
-
-                    if (window->flags & WINDOW_FLAG_FLIP_HORIZONTAL) {
-                        ppa_rotation = PPA_SRM_ROTATION_ANGLE_270;
-                    }
-
-                    switch (framebuffer->format) {
-                        case BADGEVMS_PIXELFORMAT_RGB565: rgb_swap = true; // Fallthrough
-                        case BADGEVMS_PIXELFORMAT_BGR565: break;
-                        case BADGEVMS_PIXELFORMAT_BGRA8888: rgb_swap = true; // Fallthrough
-                        case BADGEVMS_PIXELFORMAT_RGBA8888: mode = PPA_SRM_COLOR_MODE_ARGB8888; break;
-                        case BADGEVMS_PIXELFORMAT_ARGB8888: rgb_swap = true; // Fallthrough
-                        case BADGEVMS_PIXELFORMAT_ABGR8888: mode = PPA_SRM_COLOR_MODE_ARGB8888; break;
-                        default:
-                    }
-
-                    for (int i = 0; i < window->visible.count; i++) {
-                        window_rect_t visible_content = window->visible.rects[i];
-                        window_rect_t fb_rect         = content_to_framebuffer_rect(visible_content, window, scale);
+                window = window->prev;
+            } while (window != window_stack->prev);
+        }
 
-                        if (fb_rect.w <= 0 || fb_rect.h <= 0) {
-                            continue;
-                        }
+        changes |= render_scene(window_stack, framebuffers[cur_fb], cur_fb, &ppa_us);
 
-                        window_rect_t rotated_output = rotate_rect(visible_content, rotation);
-
-                        ppa_srm_oper_config_t oper_config = {
-                            .in.buffer         = framebuffer->framebuffer.pixels,
-                            .in.pic_w          = framebuffer->w,
-                            .in.pic_h          = framebuffer->h,
-                            .in.block_w        = fb_rect.w,
-                            .in.block_h        = fb_rect.h,
-                            .in.block_offset_x = fb_rect.x,
-                            .in.block_offset_y = fb_rect.y,
-                            .in.srm_cm         = mode,
-
-                            .out.buffer         = framebuffers[cur_fb],
-                            .out.buffer_size    = FRAMEBUFFER_BYTES,
-                            .out.pic_w          = FRAMEBUFFER_MAX_W,
-                            .out.pic_h          = FRAMEBUFFER_MAX_H,
-                            .out.block_offset_x = rotated_output.x,
-                            .out.block_offset_y = rotated_output.y,
-                            .out.srm_cm         = PPA_SRM_COLOR_MODE_RGB565,
-
-                            .rotation_angle = ppa_rotation,
-                            .scale_x        = scale,
-                            .scale_y        = scale,
-                            .rgb_swap       = rgb_swap,
-                            .byte_swap      = byte_swap,
-                            .mode           = PPA_TRANS_MODE_BLOCKING,
-                        };
-
-                        esp_err_t ppa_result = ppa_do_scale_rotate_mirror(ppa_srm_handle, &oper_config);
-                        if (ppa_result != ESP_OK) {
-                            printf("PPA operation failed: %s\n", esp_err_to_name(ppa_result));
-                        } else {
-                            changes           = true;
-                            window->fb_dirty &= ~(1 << cur_fb);
-                        }
-                    }
+        if (window_stack) {
+            window_t *window = window_stack;
 
+            do {
+                if (window->content_pending) {
                     // Notify app that content was processed
-                    if (!is_clean) {
-                        if (eTaskGetState(task_info->handle) != eDeleted) {
-                            xTaskNotifyGiveIndexed(task_info->handle, 1);
-                        }
+                    task_info_t *task_info = (task_info_t *)atomic_load(&window->task_info);
+                    if (task_info && eTaskGetState(task_info->handle) != eDeleted) {
+                        xTaskNotifyGiveIndexed(task_info->handle, 1);
                     }
+                    window->content_pending = false;
                 }
-
-                if (need_decoration_draw && !(window->flags & WINDOW_FLAG_FULLSCREEN)) {
-                    // Cache sync before drawing decorations
-                    esp_cache_msync(framebuffers[cur_fb], FRAMEBUFFER_BYTES, ESP_CACHE_MSYNC_FLAG_DIR_M2C);
-
-                    draw_window_box(framebuffers[cur_fb], window, window == window_stack);
-
-                    // Cache sync after drawing decorations
-                    esp_cache_msync(
-                        framebuffers[cur_fb],
-                        FRAMEBUFFER_BYTES,
-                        ESP_CACHE_MSYNC_FLAG_DIR_C2M | ESP_CACHE_MSYNC_FLAG_INVALIDATE
-                    );
-                    changes = true;
-                }
-
-                window = window->prev;
-            } while (window != window_stack->prev);
-
-            // Mark decorations as clean for this framebuffer
-            decoration_damaged    &= ~(1 << cur_fb);
-            visible_regions_valid  = true;
+                window = window->next;
+            } while (window != window_stack);
         }
 
         if (changes) {
             frame_ready = true;
         }
+
+        xSemaphoreTake(stats_lock, portMAX_DELAY);
+        stats.vblanks += vblanks;
+        if (vblanks > 1) {
+            stats.frames_missed += vblanks - 1;
+        }
+        if (changes) {
+            stats.frames_composited++;
+            timing_add(&stats.frame_time, esp_timer_get_time() - frame_start);
+            timing_add(&stats.ppa_time, ppa_us);
+        }
+        xSemaphoreGive(stats_lock);
     }
 }
 
@@ -906,6 +832,14 @@ window_t *window_create(char const *title, window_size_t size, window_flag_t fla
         goto error;
     }
 
+    if (!wait_queue_init(&window->event_waiters)) {
+        ESP_LOGW(TAG, "Out of memory trying to allocate window event waiters");
+        vQueueDelete(window->event_queue);
+        goto error;
+    }
+    window->event_fd     = -1;
+    window->event_handle = -1;
+
     window->flags  = flags;
     window->rect.x = 0;
     window->rect.y = 0;
@@ -957,6 +891,13 @@ void window_destroy(window_t *window) {
     ESP_LOGI(TAG, "Destroying window %p\n", window);
     atomic_store(&window->task_info, (uintptr_t)NULL);
 
+    xSemaphoreTake(event_handle_lock, portMAX_DELAY);
+    if (window->event_fd >= 0) {
+        memset(&get_task_info()->thread->file_handles[window->event_fd], 0, sizeof(file_handle_t));
+        window->event_fd = -1;
+    }
+    xSemaphoreGive(event_handle_lock);
+
     compositor_message_t message = {
         .command = WINDOW_DESTROY,
         .window  = window,
@@ -1053,6 +994,141 @@ window_flag_t window_flags_set(window_t *window, window_flag_t flags) {
     return flags;
 }
 
+window_transaction_handle_t window_transaction_begin(void) {
+    window_transaction_t *transaction = calloc(1, sizeof(window_transaction_t));
+    if (!transaction) {
+        ESP_LOGW(TAG, "Unable to allocate window transaction");
+    }
+
+    return transaction;
+}
+
+static transaction_op_t *window_transaction_add(window_transaction_t *transaction, window_t *window) {
+    if (!transaction || transaction->failed) {
+        return NULL;
+    }
+
+    if (!window) {
+        transaction->failed = true;
+        return NULL;
+    }
+
+    if (transaction->num_ops == transaction->max_ops) {
+        int               max_ops = transaction->max_ops ? transaction->max_ops * 2 : TRANSACTION_INITIAL_OPS;
+        transaction_op_t *ops     = realloc(transaction->ops, max_ops * sizeof(transaction_op_t));
+        if (!ops) {
+            ESP_LOGW(TAG, "Unable to grow window transaction");
+            transaction->failed = true;
+            return NULL;
+        }
+        transaction->ops     = ops;
+        transaction->max_ops = max_ops;
+    }
+
+    transaction_op_t *op = &transaction->ops[transaction->num_ops++];
+    op->window           = window;
+    return op;
+}
+
+bool window_transaction_position_set(
+    window_transaction_handle_t transaction, window_handle_t window, window_coords_t coords
+) {
+    transaction_op_t *op = window_transaction_add(transaction, window);
+    if (!op) {
+        return false;
+    }
+
+    op->type   = TRANSACTION_MOVE;
+    op->coords = coords;
+    return true;
+}
+
+bool window_transaction_size_set(window_transaction_handle_t transaction, window_handle_t window, window_size_t size) {
+    transaction_op_t *op = window_transaction_add(transaction, window);
+    if (!op) {
+        return false;
+    }
+
+    op->type = TRANSACTION_RESIZE;
+    op->size = size;
+    return true;
+}
+
+bool window_transaction_flags_set(
+    window_transaction_handle_t transaction, window_handle_t window, window_flag_t flags
+) {
+    transaction_op_t *op = window_transaction_add(transaction, window);
+    if (!op) {
+        return false;
+    }
+
+    op->type  = TRANSACTION_FLAGS;
+    op->flags = flags;
+    return true;
+}
+
+bool window_transaction_title_set(window_transaction_handle_t transaction, window_handle_t window, char const *title) {
+    char *copy = NULL;
+    if (title) {
+        copy = strndup(title, 20);
+        if (!copy) {
+            ESP_LOGW(TAG, "Unable to allocate window title");
+            if (transaction) {
+                transaction->failed = true;
+            }
+            return false;
+        }
+    }
+
+    transaction_op_t *op = window_transaction_add(transaction, window);
+    if (!op) {
+        free(copy);
+        return false;
+    }
+
+    op->type  = TRANSACTION_TITLE;
+    op->title = copy;
+    return true;
+}
+
+void window_transaction_abort(window_transaction_handle_t transaction) {
+    if (!transaction) {
+        return;
+    }
+
+    window_transaction_free(transaction);
+}
+
+bool window_transaction_commit(window_transaction_handle_t transaction, bool block) {
+    if (!transaction) {
+        return false;
+    }
+
+    if (transaction->failed) {
+        window_transaction_free(transaction);
+        return false;
+    }
+
+    if (!transaction->num_ops) {
+        window_transaction_free(transaction);
+        return true;
+    }
+
+    // From here on the transaction belongs to the compositor
+    compositor_message_t message = {
+        .command     = WINDOW_TRANSACTION,
+        .transaction = transaction,
+        .caller      = block ? xTaskGetCurrentTaskHandle() : NULL,
+    };
+
+    xQueueSend(compositor_queue, &message, portMAX_DELAY);
+    if (block) {
+        ulTaskNotifyTakeIndexed(0, pdTRUE, portMAX_DELAY);
+    }
+
+    return true;
+}
+
 framebuffer_t *window_framebuffer_get(window_handle_t window) {
     if (!window) {
         return NULL;
@@ -1117,11 +1193,16 @@ static inline void copy_framebuffer_rect(managed_framebuffer_t *dst, managed_fra
 }
 #endif
 
-void window_present(window_t *window, bool block, window_rect_t *rects, int num_rects) {
+uint32_t window_present(window_t *window, bool block, window_rect_t *rects, int num_rects) {
     if (!window || !window->framebuffers[0]) {
-        return;
+        return atomic_load(&scanout_seq);
     }
 
+    atomic_store(&window->present_time_us, (uint32_t)esp_timer_get_time());
+    xSemaphoreTake(stats_lock, portMAX_DELAY);
+    window->stats.frames_presented++;
+    xSemaphoreGive(stats_lock);
+
     managed_framebuffer_t *front_buffer = NULL;
     managed_framebuffer_t *back_buffer  = NULL;
 
@@ -1153,6 +1234,65 @@ void window_present(window_t *window, bool block, window_rect_t *rects, int num_
 
     if (block) {
         ulTaskNotifyTakeIndexed(1, pdTRUE, portMAX_DELAY);
+        return window->composited_seq;
+    }
+
+    // The compositor picks this up either in the frame it is building right now or the next one
+    return atomic_load(&compose_seq) + 1;
+}
+
+bool window_frame_wait(uint32_t frame_seq, bool block, uint32_t timeout_msec) {
+    TickType_t start   = xTaskGetTickCount();
+    TickType_t timeout = block ? portMAX_DELAY : pdMS_TO_TICKS(timeout_msec);
+
+    while (1) {
+        uint32_t cur = atomic_load(&scanout_seq);
+        if ((int32_t)(cur - frame_seq) >= 0) {
+            return true;
+        }
+
+        TickType_t waited = xTaskGetTickCount() - start;
+        if (!block && waited >= timeout) {
+            return false;
+        }
+
+        EventBits_t next_bit = ((cur + 1) & 1) ? FRAME_ODD_BIT : FRAME_EVEN_BIT;
+        xEventGroupWaitBits(frame_events, next_bit, pdFALSE, pdFALSE, block ? portMAX_DELAY : timeout - waited);
+    }
+}
+
+bool window_stats_get(window_t *window, window_stats_t *out, bool reset) {
+    if (!window || !out) {
+        return false;
+    }
+
+    xSemaphoreTake(stats_lock, portMAX_DELAY);
+    *out = window->stats;
+    if (reset) {
+        memset(&window->stats, 0, sizeof(window_stats_t));
+    }
+    xSemaphoreGive(stats_lock);
+
+    return true;
+}
+
+void compositor_stats_get(compositor_stats_t *out, bool reset) {
+    if (!out) {
+        return;
+    }
+
+    xSemaphoreTake(stats_lock, portMAX_DELAY);
+    *out = stats;
+    if (reset) {
+        memset(&stats, 0, sizeof(compositor_stats_t));
+        stats.frame_seq = out->frame_seq;
+    }
+    xSemaphoreGive(stats_lock);
+}
+
+void compositor_shortcut_post(event_t const *event) {
+    if (xQueueSend(shortcut_queue, event, 0) != pdTRUE) {
+        ESP_LOGW(TAG, "Dropping window manager shortcut");
     }
 }
 
@@ -1162,11 +1302,86 @@ event_t window_event_poll(window_t *window, bool block, uint32_t timeout_msec) {
 
     if (xQueueReceive(window->event_queue, &e, wait) != pdTRUE) {
         e.type = EVENT_NONE;
+    } else {
+        input_event_delivered(&e);
     }
 
     return e;
 }
 
+// The wait queue is only torn down after the window left the table, which is checked under the same lock the
+// waiter is hooked on under
+static short window_events_poll(void *dev, int fd, short events, struct poll_waiter *waiter) {
+    short revents = POLLHUP;
+
+    xSemaphoreTake(event_handle_lock, portMAX_DELAY);
+    window_t *window = event_handle_window(fd);
+    if (window) {
+        poll_wait(waiter, &window->event_waiters);
+        revents = uxQueueMessagesWaiting(window->event_queue) ? POLLIN | POLLRDNORM : 0;
+    }
+    xSemaphoreGive(event_handle_lock);
+
+    return revents;
+}
+
+static int window_events_close(void *dev, int fd) {
+    xSemaphoreTake(event_handle_lock, portMAX_DELAY);
+    window_t *window = event_handle_window(fd);
+    if (window) {
+        event_handles[fd % MAX_WINDOWS].window = NULL;
+        window->event_handle                   = -1;
+        window->event_fd                       = -1;
+    }
+    xSemaphoreGive(event_handle_lock);
+
+    return 0;
+}
+
+static device_t window_events_device = {
+    .type   = DEVICE_TYPE_WINDOW,
+    ._close = window_events_close,
+    ._poll  = window_events_poll,
+};
+
+int window_event_fd(window_t *window) {
+    task_info_t *task_info = get_task_info();
+    int          ret       = -1;
+
+    xSemaphoreTake(event_handle_lock, portMAX_DELAY);
+    if (window->event_fd >= 0) {
+        ret = window->event_fd;
+        goto out;
+    }
+
+    int slot = 0;
+    while (slot < MAX_WINDOWS && event_handles[slot].window) {
+        ++slot;
+    }
+
+    for (int fd = 0; slot < MAX_WINDOWS && fd < MAXFD; ++fd) {
+        if (!task_info->thread->file_handles[fd].is_open) {
+            event_handle_generation    = (event_handle_generation + 1) % (INT_MAX / MAX_WINDOWS);
+            event_handles[slot].window = window;
+            event_handles[slot].handle = event_handle_generation * MAX_WINDOWS + slot;
+
+            task_info->thread->file_handles[fd].is_open = true;
+            task_info->thread->file_handles[fd].dev_fd  = event_handles[slot].handle;
+            task_info->thread->file_handles[fd].device  = &window_events_device;
+            window->event_handle                        = event_handles[slot].handle;
+            window->event_fd                            = fd;
+            ret                                         = fd;
+            goto out;
+        }
+    }
+
+    task_info->_errno = EMFILE;
+
+out:
+    xSemaphoreGive(event_handle_lock);
+    return ret;
+}
+
 bool compositor_init(char const *lcd_device_name, char const *keyboard_device_name) {
     ESP_LOGI(TAG, "Initializing");
 
@@ -1176,12 +1391,6 @@ bool compositor_init(char const *lcd_device_name, char const *keyboard_device_na
         return false;
     }
 
-    keyboard_device = (device_t *)device_get(keyboard_device_name);
-    if (!keyboard_device) {
-        ESP_LOGE(TAG, "Unable to access the keyboard device '%s'", keyboard_device_name);
-        return false;
-    }
-
     for (int i = 0; i < DISPLAY_FRAMEBUFFERS; ++i) {
         lcd_device->_getfb(lcd_device, i, (void *)&framebuffers[i]);
         memset(framebuffers[i], 0xaa, FRAMEBUFFER_BYTES);
@@ -1193,7 +1402,17 @@ bool compositor_init(char const *lcd_device_name, char const *keyboard_device_na
 
     lcd_device->_set_refresh_cb(lcd_device, NULL, on_refresh);
 
-    compositor_queue = xQueueCreate(10, sizeof(compositor_message_t));
+    stats_lock        = xSemaphoreCreateMutex();
+    frame_events      = xEventGroupCreate();
+    event_handle_lock = xSemaphoreCreateMutex();
+
+    compositor_queue = xQueueCreate(COMPOSITOR_QUEUE_LENGTH, sizeof(compositor_message_t));
+    shortcut_queue   = xQueueCreate(SHORTCUT_QUEUE_LENGTH, sizeof(event_t));
+
+    if (!input_init(keyboard_device_name)) {
+        return false;
+    }
+
     create_kernel_task(compositor, "Compositor", 8192, NULL, 20, &compositor_handle, 0);
 
     return true;
@@ -17,10 +17,12 @@
 #pragma once
 
 #include "badgevms/compositor.h"
+#include "badgevms/event.h"
 #include "badgevms/framebuffer.h"
 #include "badgevms_config.h"
 #include "memory.h"
 #include "task.h"
+#include "wait_queue.h"
 
 #include <stdatomic.h>
 
@@ -57,6 +59,8 @@ typedef struct window {
     window_flag_t          flags;
     char                  *title;
     int                    fb_dirty;
+    // Presented since the last frame, only touched by the compositor task
+    bool                   content_pending;
 
     window_rect_t    rect;
     // Store the previous rect if we go fullscreen/maximized
@@ -64,6 +68,17 @@ typedef struct window {
     rect_array_t     visible;
     atomic_uintptr_t task_info;
     QueueHandle_t    event_queue;
+    // poll() on the fd from window_event_fd(), -1 when there is none. The fd's handle is its slot in the compositor's
+    // event handle table, both are protected by the event handle lock.
+    wait_queue_t     event_waiters;
+    int              event_fd;
+    int              event_handle;
+
+    // Protected by the compositor stats lock
+    window_stats_t stats;
+    atomic_uint    present_time_us;
+    uint32_t       composited_seq;
+    bool           scanout_pending;
 
     struct window *next;
     struct window *prev;
@@ -71,3 +86,8 @@ typedef struct window {
 
 bool compositor_init(char const *lcd_device_name, char const *keyboard_device_name);
 void window_destroy_task(window_handle_t window);
+void compositor_shortcut_post(event_t const *event);
+
+bool input_init(char const *keyboard_device_name);
+void input_focus_set(window_t *window);
+void input_event_delivered(event_t const *event);
@@ -0,0 +1,211 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "badgevms/device.h"
+#include "badgevms/event.h"
+#include "badgevms_config.h"
+#include "compositor_private.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "task.h"
+
+#include <stdatomic.h>
+
+#include <sys/time.h>
+
+#define TAG "iris"
+
+// Iris reads the keyboard and hands events straight to the focused window.
+// The compositor only gets to see the few key combinations it acts on itself.
+
+static TaskHandle_t      iris_handle;
+static device_t         *keyboard_device;
+static SemaphoreHandle_t focus_lock;
+static window_t         *focused_window;
+
+#if INPUT_LATENCY_REPORT_SEC
+#define LATENCY_BUCKETS 8
+
+// Bucket upper bounds in microseconds, the last bucket catches everything else
+static uint32_t const latency_bucket_us[LATENCY_BUCKETS] = {500, 1000, 2000, 5000, 10000, 20000, 50000, UINT32_MAX};
+
+static atomic_uint latency_count;
+static atomic_uint latency_max_us;
+static atomic_ullong latency_total_us;
+static atomic_uint latency_buckets[LATENCY_BUCKETS];
+
+static inline uint64_t now_us(void) {
+    struct timeval tv_now;
+    gettimeofday(&tv_now, NULL);
+    return (uint64_t)tv_now.tv_sec * 1000000L + (uint64_t)tv_now.tv_usec;
+}
+
+static void latency_report(void) {
+    unsigned int count = atomic_exchange(&latency_count, 0);
+    unsigned int max   = atomic_exchange(&latency_max_us, 0);
+    uint64_t     total = atomic_exchange(&latency_total_us, 0);
+
+    unsigned int buckets[LATENCY_BUCKETS];
+    for (int i = 0; i < LATENCY_BUCKETS; ++i) {
+        buckets[i] = atomic_exchange(&latency_buckets[i], 0);
+    }
+
+    if (!count) {
+        return;
+    }
+
+    ESP_LOGW(
+        TAG,
+        "Key-to-client latency: %u events, avg %lluus, max %uus, "
+        "<0.5ms %u <1ms %u <2ms %u <5ms %u <10ms %u <20ms %u <50ms %u >=50ms %u",
+        count,
+        total / count,
+        max,
+        buckets[0],
+        buckets[1],
+        buckets[2],
+        buckets[3],
+        buckets[4],
+        buckets[5],
+        buckets[6],
+        buckets[7]
+    );
+}
+#endif
+
+void input_event_delivered(event_t const *event) {
+#if INPUT_LATENCY_REPORT_SEC
+    if (event->type != EVENT_KEY_DOWN && event->type != EVENT_KEY_UP) {
+        return;
+    }
+
+    uint64_t now = now_us();
+    if (now < event->keyboard.timestamp) {
+        // Wall clock got adjusted while the event was in flight
+        return;
+    }
+
+    uint32_t latency = now - event->keyboard.timestamp;
+
+    atomic_fetch_add(&latency_count, 1);
+    atomic_fetch_add(&latency_total_us, latency);
+
+    unsigned int max = atomic_load(&latency_max_us);
+    while (latency > max && !atomic_compare_exchange_weak(&latency_max_us, &max, latency)) {
+    }
+
+    for (int i = 0; i < LATENCY_BUCKETS; ++i) {
+        if (latency < latency_bucket_us[i]) {
+            atomic_fetch_add(&latency_buckets[i], 1);
+            break;
+        }
+    }
+#endif
+}
+
+void input_focus_set(window_t *window) {
+    xSemaphoreTake(focus_lock, portMAX_DELAY);
+    focused_window = window;
+    xSemaphoreGive(focus_lock);
+}
+
+static void iris(void *ignored) {
+    event_t events[INPUT_EVENTS_PER_POLL];
+    bool    fn_down = false;
+
+#if INPUT_LATENCY_REPORT_SEC
+    TickType_t last_report = xTaskGetTickCount();
+#endif
+
+    while (1) {
+        ssize_t res = keyboard_device->_read(keyboard_device, 0, events, sizeof(events));
+        if (res < 0) {
+            res = 0;
+        }
+
+        for (int i = 0; i < res / sizeof(event_t); ++i) {
+            event_t *c = &events[i];
+
+            if (c->keyboard.scancode == KEY_SCANCODE_FN) {
+                // Hide the FN key
+                fn_down = c->keyboard.down;
+                continue;
+            }
+
+            if (fn_down) {
+                // Everything typed while FN is held belongs to the window manager
+                if (c->keyboard.down) {
+                    compositor_shortcut_post(c);
+                }
+                continue;
+            }
+
+            if (c->keyboard.scancode == KEY_SCANCODE_TAB && c->keyboard.mod & BADGEVMS_KMOD_LALT && c->keyboard.down) {
+                compositor_shortcut_post(c);
+                continue;
+            }
+
+            xSemaphoreTake(focus_lock, portMAX_DELAY);
+            if (focused_window) {
+                ESP_LOGV(TAG, "Got scancode %02X mods %02X", c->keyboard.scancode, c->keyboard.mod);
+                if (xQueueSend(focused_window->event_queue, c, 0) != pdTRUE) {
+                    ESP_LOGW(TAG, "Unable to send event to task");
+                } else {
+                    wait_queue_wake(&focused_window->event_waiters);
+                }
+            }
+            xSemaphoreGive(focus_lock);
+        }
+
+#if INPUT_LATENCY_REPORT_SEC
+        if (xTaskGetTickCount() - last_report >= pdMS_TO_TICKS(INPUT_LATENCY_REPORT_SEC * 1000)) {
+            latency_report();
+            last_report = xTaskGetTickCount();
+        }
+#endif
+
+        // The keyboard still had more for us, don't wait around
+        if (res == sizeof(events)) {
+            continue;
+        }
+
+        TickType_t delay = pdMS_TO_TICKS(INPUT_POLL_INTERVAL_MS);
+        vTaskDelay(delay ? delay : 1);
+    }
+}
+
+bool input_init(char const *keyboard_device_name) {
+    ESP_LOGI(TAG, "Initializing");
+
+    keyboard_device = device_get(keyboard_device_name);
+    if (!keyboard_device) {
+        ESP_LOGE(TAG, "Unable to access the keyboard device '%s'", keyboard_device_name);
+        return false;
+    }
+
+    focus_lock = xSemaphoreCreateMutex();
+    if (!focus_lock) {
+        ESP_LOGE(TAG, "Failed to create focus_lock");
+        return false;
+    }
+
+    if (create_kernel_task(iris, "Iris", 4096, NULL, 21, &iris_handle, 0) != pdTRUE) {
+        ESP_LOGE(TAG, "Failed to create input dispatch task");
+        return false;
+    }
+
+    return true;
+}
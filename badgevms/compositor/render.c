@@ -0,0 +1,463 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "render.h"
+
+#include "driver/ppa.h"
+#include "esp_cache.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <math.h>
+#include <sys/param.h>
+
+#define TAG "render"
+
+#define ALPHA_SCRATCH_BYTES (FRAMEBUFFER_MAX_W * FRAMEBUFFER_MAX_H * 4)
+#define ALPHA_SCRATCH_ALIGN 128
+
+rotation_angle_t rotation = ROTATION_ANGLE_270;
+
+int  background_damaged    = 7;
+int  decoration_damaged    = 7;
+bool visible_regions_valid = false;
+
+static ppa_client_handle_t ppa_srm_handle;
+static ppa_client_handle_t ppa_blend_handle;
+
+// Translucent windows are first scaled and rotated into here, then blended onto the display framebuffer
+static uint32_t *alpha_scratch;
+static bool      alpha_scratch_failed;
+
+__attribute__((always_inline)) static inline ppa_srm_rotation_angle_t rotation_to_srm(rotation_angle_t rotation) {
+    switch (rotation) {
+        case ROTATION_ANGLE_270: return PPA_SRM_ROTATION_ANGLE_90;
+        case ROTATION_ANGLE_180: return PPA_SRM_ROTATION_ANGLE_180;
+        case ROTATION_ANGLE_90: return PPA_SRM_ROTATION_ANGLE_270;
+        default:
+    }
+    return PPA_SRM_ROTATION_ANGLE_0;
+}
+
+// Workaround for the PPA hardware. It really does not like 65 pixel high strips.
+__attribute__((always_inline)) static inline bool is_problematic_block_height(int content_height, float scale) {
+    // Check if height is "N × 32 + 1"
+    int fb_height = (int)(content_height / scale);
+    if (fb_height > 32 && (fb_height % 32) == 1) {
+        return true;
+    }
+    return false;
+}
+
+bool ppa_workaround_split_rects(rect_array_t *visible, float scale) {
+    rect_array_t new_visible = {0};
+    bool         split       = false;
+
+    for (int i = 0; i < visible->count; i++) {
+        window_rect_t rect = visible->rects[i];
+
+        if (is_problematic_block_height(rect.h, scale)) {
+            split           = true;
+            int first_half  = (rect.h / 2) - 1;
+            int second_half = rect.h - first_half;
+            ESP_LOGW(TAG, "Splitting block of problematic height %u in %u and %u", rect.h, first_half, second_half);
+
+            if (new_visible.count < MAX_VISIBLE_RECTS) {
+                new_visible.rects[new_visible.count++] =
+                    (window_rect_t){.x = rect.x, .y = rect.y, .w = rect.w, .h = first_half};
+            }
+
+            if (new_visible.count < MAX_VISIBLE_RECTS) {
+                new_visible.rects[new_visible.count++] =
+                    (window_rect_t){.x = rect.x, .y = rect.y + first_half, .w = rect.w, .h = second_half};
+            }
+        } else {
+            if (new_visible.count < MAX_VISIBLE_RECTS) {
+                new_visible.rects[new_visible.count++] = rect;
+            }
+        }
+    }
+
+    *visible = new_visible;
+    return split;
+}
+
+void window_calculate_visible_regions(window_t *window, window_t *window_list_head, float scale) {
+    window->visible.count    = 1;
+    window->visible.rects[0] = window->rect;
+
+    if (!(window->flags & WINDOW_FLAG_FULLSCREEN)) {
+        // For occlusion we only care about our OWN content region
+        window->visible.rects[0].x += BORDER_PX;
+        window->visible.rects[0].y += BORDER_TOP_PX;
+    }
+
+    window_t *occluder = window_list_head;
+
+    while (occluder != NULL && occluder != window) {
+        rect_array_t new_visible = {0};
+
+        if (window_is_translucent(occluder)) {
+            // We shine through, the decorations get drawn over us afterwards
+            occluder = occluder->next;
+            continue;
+        }
+
+        for (int j = 0; j < window->visible.count; j++) {
+            // But other window decorations do occlude us
+            window_rect_t occluder_rect = window_outer_rect(occluder);
+
+            small_rect_array_t pieces = rect_subtract(window->visible.rects[j], occluder_rect);
+
+            for (int k = 0; k < pieces.count; k++) {
+                if (new_visible.count < MAX_VISIBLE_RECTS) {
+                    new_visible.rects[new_visible.count++] = pieces.rects[k];
+                }
+            }
+        }
+
+        window->visible = new_visible;
+
+        if (window->visible.count == 0) {
+            break;
+        }
+
+        occluder = occluder->next;
+    }
+
+    merge_rectangles(&window->visible);
+    while (ppa_workaround_split_rects(&window->visible, scale)) {
+    }
+}
+
+window_rect_t content_to_framebuffer_rect(window_rect_t content_rect, window_t *window, float scale) {
+    if (!(window->flags & WINDOW_FLAG_FULLSCREEN)) {
+        content_rect.x -= (window->rect.x + BORDER_PX);
+        content_rect.y -= (window->rect.y + BORDER_TOP_PX);
+    }
+
+    managed_framebuffer_t *framebuffer = window->framebuffers[window->front_fb];
+
+    int start_x = (int)(content_rect.x / scale);
+    int start_y = (int)(content_rect.y / scale);
+    int end_x   = (int)((content_rect.x + content_rect.w) / scale);
+    int end_y   = (int)((content_rect.y + content_rect.h) / scale);
+
+    start_x = MAX(0, MIN(start_x, (int)framebuffer->w - 1));
+    start_y = MAX(0, MIN(start_y, (int)framebuffer->h - 1));
+    end_x   = MAX(start_x, MIN(end_x, (int)framebuffer->w));
+    end_y   = MAX(start_y, MIN(end_y, (int)framebuffer->h));
+
+    window_rect_t fb_rect = {.x = start_x, .y = start_y, .w = end_x - start_x, .h = end_y - start_y};
+
+    return fb_rect;
+}
+
+static uint32_t *alpha_scratch_get(void) {
+    if (!alpha_scratch && !alpha_scratch_failed) {
+        alpha_scratch = heap_caps_aligned_calloc(
+            ALPHA_SCRATCH_ALIGN,
+            1,
+            ALPHA_SCRATCH_BYTES,
+            MALLOC_CAP_SPIRAM | MALLOC_CAP_DMA
+        );
+        if (!alpha_scratch) {
+            ESP_LOGE(TAG, "Unable to allocate alpha scratch buffer, translucent windows will be drawn opaque");
+            alpha_scratch_failed = true;
+        }
+    }
+
+    return alpha_scratch;
+}
+
+// Anything drawn below a translucent window changes what it should look like, and a translucent window can't be
+// drawn twice over itself. So if a translucent window or anything it covers has new content for this framebuffer
+// the whole framebuffer gets rebuilt from the background up. A scene where none of that changed is left alone, even
+// when the translucent window is on top.
+static bool translucent_scene_damaged(window_t *window_stack, int fb_index) {
+    window_rect_t translucent[MAX_WINDOWS];
+    int           num_translucent = 0;
+
+    window_t *window = window_stack;
+    if (!window) {
+        return false;
+    }
+
+    // Front to back
+    do {
+        if (window->framebuffers[window->front_fb]) {
+            window_rect_t outer   = window_outer_rect(window);
+            bool          pending = (window->fb_dirty & (1 << fb_index)) || window->content_pending;
+
+            if (window_is_translucent(window)) {
+                if (pending) {
+                    return true;
+                }
+                if (num_translucent < MAX_WINDOWS) {
+                    translucent[num_translucent++] = outer;
+                }
+            } else if (pending) {
+                for (int i = 0; i < num_translucent; ++i) {
+                    if (rect_intersects(outer, translucent[i])) {
+                        return true;
+                    }
+                }
+            }
+        }
+
+        window = window->next;
+    } while (window != window_stack);
+
+    return false;
+}
+
+static esp_err_t alpha_blend_rect(uint16_t *framebuffer, window_rect_t rect) {
+    ppa_blend_oper_config_t oper_config = {
+        .in_bg.buffer         = framebuffer,
+        .in_bg.pic_w          = FRAMEBUFFER_MAX_W,
+        .in_bg.pic_h          = FRAMEBUFFER_MAX_H,
+        .in_bg.block_w        = rect.w,
+        .in_bg.block_h        = rect.h,
+        .in_bg.block_offset_x = rect.x,
+        .in_bg.block_offset_y = rect.y,
+        .in_bg.blend_cm       = PPA_BLEND_COLOR_MODE_RGB565,
+
+        .in_fg.buffer         = alpha_scratch,
+        .in_fg.pic_w          = FRAMEBUFFER_MAX_W,
+        .in_fg.pic_h          = FRAMEBUFFER_MAX_H,
+        .in_fg.block_w        = rect.w,
+        .in_fg.block_h        = rect.h,
+        .in_fg.block_offset_x = rect.x,
+        .in_fg.block_offset_y = rect.y,
+        .in_fg.blend_cm       = PPA_BLEND_COLOR_MODE_ARGB8888,
+
+        .out.buffer         = framebuffer,
+        .out.buffer_size    = FRAMEBUFFER_BYTES,
+        .out.pic_w          = FRAMEBUFFER_MAX_W,
+        .out.pic_h          = FRAMEBUFFER_MAX_H,
+        .out.block_offset_x = rect.x,
+        .out.block_offset_y = rect.y,
+        .out.blend_cm       = PPA_BLEND_COLOR_MODE_RGB565,
+
+        .bg_alpha_update_mode = PPA_ALPHA_NO_CHANGE,
+        .fg_alpha_update_mode = PPA_ALPHA_NO_CHANGE,
+        .mode                 = PPA_TRANS_MODE_BLOCKING,
+    };
+
+    return ppa_do_blend(ppa_blend_handle, &oper_config);
+}
+
+static bool
+    render_window_content(window_t *window, float scale, uint16_t *framebuffer, int fb_index, uint32_t *ppa_us) {
+    managed_framebuffer_t   *window_fb    = window->framebuffers[window->front_fb];
+    ppa_srm_rotation_angle_t ppa_rotation = rotation_to_srm(rotation);
+    bool                     rgb_swap     = false;
+    bool                     byte_swap    = false;
+    ppa_srm_color_mode_t     mode         = PPA_SRM_COLOR_MODE_RGB565;
+    bool                     changes      = false;
+    // The hardware scales in steps of 1/16th
+    float                    ppa_scale    = floorf(scale * 16) / 16;
+
+    if (window->flags & WINDOW_FLAG_FLIP_HORIZONTAL) {
+        ppa_rotation = PPA_SRM_ROTATION_ANGLE_270;
+    }
+
+    switch (window_fb->format) {
+        case BADGEVMS_PIXELFORMAT_RGB565: rgb_swap = true; // Fallthrough
+        case BADGEVMS_PIXELFORMAT_BGR565: break;
+        case BADGEVMS_PIXELFORMAT_BGRA8888: rgb_swap = true; // Fallthrough
+        case BADGEVMS_PIXELFORMAT_RGBA8888: mode = PPA_SRM_COLOR_MODE_ARGB8888; break;
+        case BADGEVMS_PIXELFORMAT_ARGB8888: rgb_swap = true; // Fallthrough
+        case BADGEVMS_PIXELFORMAT_ABGR8888: mode = PPA_SRM_COLOR_MODE_ARGB8888; break;
+        default:
+    }
+
+    // Translucent windows go through the scratch buffer and get blended, the rest is copied over
+    bool translucent = window_is_translucent(window) && alpha_scratch_get();
+
+    for (int i = 0; i < window->visible.count; i++) {
+        window_rect_t visible_content = window->visible.rects[i];
+        window_rect_t fb_rect         = content_to_framebuffer_rect(visible_content, window, scale);
+
+        if (fb_rect.w <= 0 || fb_rect.h <= 0) {
+            continue;
+        }
+
+        // The PPA output is the scaled block, which can be a little smaller than what is visible. Anchor it at the
+        // same corner in every rotation.
+        window_rect_t scaled_content = visible_content;
+        scaled_content.w             = (int)(fb_rect.w * ppa_scale);
+        scaled_content.h             = (int)(fb_rect.h * ppa_scale);
+        window_rect_t rotated_output = rotate_rect(scaled_content, rotation);
+
+        ppa_srm_oper_config_t oper_config = {
+            .in.buffer         = window_fb->framebuffer.pixels,
+            .in.pic_w          = window_fb->w,
+            .in.pic_h          = window_fb->h,
+            .in.block_w        = fb_rect.w,
+            .in.block_h        = fb_rect.h,
+            .in.block_offset_x = fb_rect.x,
+            .in.block_offset_y = fb_rect.y,
+            .in.srm_cm         = mode,
+
+            .out.buffer         = framebuffer,
+            .out.buffer_size    = FRAMEBUFFER_BYTES,
+            .out.pic_w          = FRAMEBUFFER_MAX_W,
+            .out.pic_h          = FRAMEBUFFER_MAX_H,
+            .out.block_offset_x = rotated_output.x,
+            .out.block_offset_y = rotated_output.y,
+            .out.srm_cm         = PPA_SRM_COLOR_MODE_RGB565,
+
+            .rotation_angle = ppa_rotation,
+            .scale_x        = ppa_scale,
+            .scale_y        = ppa_scale,
+            .rgb_swap       = rgb_swap,
+            .byte_swap      = byte_swap,
+            .mode           = PPA_TRANS_MODE_BLOCKING,
+        };
+
+        if (translucent) {
+            oper_config.out.buffer      = alpha_scratch;
+            oper_config.out.buffer_size = ALPHA_SCRATCH_BYTES;
+            oper_config.out.srm_cm      = PPA_SRM_COLOR_MODE_ARGB8888;
+        }
+
+        int64_t   ppa_start  = esp_timer_get_time();
+        esp_err_t ppa_result = ppa_do_scale_rotate_mirror(ppa_srm_handle, &oper_config);
+        if (ppa_result == ESP_OK && translucent) {
+            ppa_result = alpha_blend_rect(framebuffer, rotated_output);
+        }
+        *ppa_us += esp_timer_get_time() - ppa_start;
+
+        if (ppa_result != ESP_OK) {
+            printf("PPA operation failed: %s\n", esp_err_to_name(ppa_result));
+        } else {
+            changes           = true;
+            window->fb_dirty &= ~(1 << fb_index);
+        }
+    }
+
+    return changes;
+}
+
+bool render_scene(window_t *window_stack, uint16_t *framebuffer, int fb_index, uint32_t *ppa_us) {
+    bool changes = false;
+
+    if (translucent_scene_damaged(window_stack, fb_index)) {
+        background_damaged |= (1 << fb_index);
+    }
+
+    bool framebuffer_cleared = false;
+    if (background_damaged & (1 << fb_index)) {
+        memset(framebuffer, 0xaa, FRAMEBUFFER_BYTES);
+        // Make sure the ppa will see our new background
+        esp_cache_msync(framebuffer, FRAMEBUFFER_BYTES, ESP_CACHE_MSYNC_FLAG_DIR_C2M | ESP_CACHE_MSYNC_FLAG_INVALIDATE);
+        background_damaged  &= ~(1 << fb_index);
+        changes              = true;
+        framebuffer_cleared  = true;
+    }
+
+    if (!window_stack) {
+        return changes;
+    }
+
+    window_t *window = window_stack->prev; // Start with back window
+
+    do {
+        managed_framebuffer_t *window_fb = window->framebuffers[window->front_fb];
+
+        if (!window_fb) {
+            // Not yet allocated, or in the process of being destroyed
+            if (!visible_regions_valid) {
+                window_calculate_visible_regions(window, window_stack, 1.0);
+            }
+            window = window->prev;
+            continue;
+        }
+
+        float scale_x = ((float)window->rect.w / (float)window_fb->w);
+        float scale_y = ((float)window->rect.h / (float)window_fb->h);
+        float scale   = fminf(scale_x, scale_y);
+
+        if (!visible_regions_valid) {
+            window_calculate_visible_regions(window, window_stack, scale);
+        }
+
+        bool need_decoration_draw = decoration_damaged & (1 << fb_index);
+        bool need_content_draw    = window->content_pending || (window->fb_dirty & (1 << fb_index));
+
+        if (framebuffer_cleared || window == window_stack) {
+            // A translucent top window would be blended over itself, it is only drawn when it or the scene changed
+            need_decoration_draw  = true;
+            need_content_draw    |= framebuffer_cleared || !window_is_translucent(window);
+        }
+
+        if (need_content_draw) {
+            changes |= render_window_content(window, scale, framebuffer, fb_index, ppa_us);
+        }
+
+        if (need_decoration_draw && !(window->flags & WINDOW_FLAG_FULLSCREEN)) {
+            // Cache sync before drawing decorations
+            esp_cache_msync(framebuffer, FRAMEBUFFER_BYTES, ESP_CACHE_MSYNC_FLAG_DIR_M2C);
+
+            draw_window_box(framebuffer, window, window == window_stack);
+
+            // Cache sync after drawing decorations
+            esp_cache_msync(
+                framebuffer,
+                FRAMEBUFFER_BYTES,
+                ESP_CACHE_MSYNC_FLAG_DIR_C2M | ESP_CACHE_MSYNC_FLAG_INVALIDATE
+            );
+            changes = true;
+        }
+
+        window = window->prev;
+    } while (window != window_stack->prev);
+
+    // Mark decorations as clean for this framebuffer
+    decoration_damaged    &= ~(1 << fb_index);
+    visible_regions_valid  = true;
+
+    return changes;
+}
+
+bool render_init(void) {
+    ppa_client_config_t ppa_srm_config = {
+        .oper_type             = PPA_OPERATION_SRM,
+        .max_pending_trans_num = 1,
+    };
+
+    if (ppa_register_client(&ppa_srm_config, &ppa_srm_handle) != ESP_OK) {
+        ESP_LOGE(TAG, "Unable to register PPA SRM client");
+        return false;
+    }
+
+    ppa_client_config_t ppa_blend_config = {
+        .oper_type             = PPA_OPERATION_BLEND,
+        .max_pending_trans_num = 1,
+    };
+
+    if (ppa_register_client(&ppa_blend_config, &ppa_blend_handle) != ESP_OK) {
+        ESP_LOGE(TAG, "Unable to register PPA blend client");
+        return false;
+    }
+
+    return true;
+}
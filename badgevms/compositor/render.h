@@ -0,0 +1,91 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "compositor_private.h"
+#include "pixel_functions.h"
+#include "window_decorations.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define ALL_DISPLAY_FB_MASK 7 // (1 + 2 + 4)
+
+extern rotation_angle_t rotation;
+
+// Per display framebuffer masks of what needs to be redrawn
+extern int  background_damaged;
+extern int  decoration_damaged;
+extern bool visible_regions_valid;
+
+static inline void mark_scene_damaged(void) {
+    visible_regions_valid = false;
+    decoration_damaged    = ALL_DISPLAY_FB_MASK;
+    background_damaged    = ALL_DISPLAY_FB_MASK;
+}
+
+// The stacking order changed but no window moved, everything gets drawn again over the old background
+static inline void mark_stack_damaged(window_t *window_stack) {
+    visible_regions_valid = false;
+    decoration_damaged    = ALL_DISPLAY_FB_MASK;
+
+    window_t *window = window_stack;
+    if (window) {
+        do {
+            window->fb_dirty = ALL_DISPLAY_FB_MASK;
+            window           = window->next;
+        } while (window != window_stack);
+    }
+}
+
+__attribute__((always_inline)) static inline bool window_is_translucent(window_t *window) {
+    if (!(window->flags & WINDOW_FLAG_ALPHA)) {
+        return false;
+    }
+
+    managed_framebuffer_t *framebuffer = window->framebuffers[window->front_fb];
+    if (!framebuffer) {
+        return false;
+    }
+
+    switch (framebuffer->format) {
+        case BADGEVMS_PIXELFORMAT_RGBA8888:
+        case BADGEVMS_PIXELFORMAT_BGRA8888:
+        case BADGEVMS_PIXELFORMAT_ARGB8888:
+        case BADGEVMS_PIXELFORMAT_ABGR8888: return true;
+        default: return false;
+    }
+}
+
+// Window rect including decorations
+__attribute__((always_inline)) static inline window_rect_t window_outer_rect(window_t *window) {
+    window_rect_t rect = window->rect;
+    if (!(window->flags & WINDOW_FLAG_FULLSCREEN)) {
+        rect.w += (BORDER_PX * 2);
+        rect.h += BORDER_TOP_PX + BORDER_PX;
+    }
+    return rect;
+}
+
+bool          render_init(void);
+bool          ppa_workaround_split_rects(rect_array_t *visible, float scale);
+void          window_calculate_visible_regions(window_t *window, window_t *window_list_head, float scale);
+window_rect_t content_to_framebuffer_rect(window_rect_t content_rect, window_t *window, float scale);
+
+// Draw the window stack onto display framebuffer fb_index. Windows with content_pending set have presented since the
+// last frame. Returns true if anything in the framebuffer changed, ppa_us is increased by the time spent in the PPA.
+bool render_scene(window_t *window_stack, uint16_t *framebuffer, int fb_index, uint32_t *ppa_us);
@@ -0,0 +1,840 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "cookie_store.h"
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include <ctype.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static char const *TAG = "cookie_store";
+
+#define HOST_MAX 256
+
+typedef enum {
+    SAMESITE_NONE,
+    SAMESITE_LAX,
+    SAMESITE_STRICT,
+} samesite_t;
+
+typedef struct cookie {
+    struct cookie *next;
+    uint32_t       hash;      // Of the domain
+    uint32_t       created;   // Cookies with equally long paths are sent in the order they were first set
+    uint32_t       last_used; // The least recently used cookie is evicted when the store is full
+    time_t         expires;   // 0 for a session cookie
+    bool           host_only;
+    bool           secure;
+    bool           http_only;
+    samesite_t     samesite;
+    char          *name;
+    char          *value;
+    char          *domain;
+    char          *path;
+    char           data[];
+} cookie_t;
+
+struct cookie_store {
+    SemaphoreHandle_t lock;
+    cookie_t         *buckets[COOKIE_STORE_BUCKETS];
+    size_t            count;
+    uint32_t          sequence;
+    bool              changed;
+    time_t            changed_at;
+};
+
+typedef struct {
+    bool        https;
+    char        host[HOST_MAX];
+    char const *path;
+    size_t      path_len;
+} request_t;
+
+typedef struct {
+    char const *p;
+    size_t      len;
+} span_t;
+
+static uint32_t hash_domain(char const *domain) {
+    uint32_t hash = 2166136261u;
+    for (; *domain; domain++) {
+        hash ^= (unsigned char)*domain;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static bool is_ip_literal(char const *host) {
+    if (strchr(host, ':')) {
+        return true;
+    }
+    for (; *host; host++) {
+        if (!isdigit((unsigned char)*host) && *host != '.') {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool parse_url(request_t *request, char const *url) {
+    if (strncasecmp(url, "http://", 7) == 0) {
+        request->https  = false;
+        url            += 7;
+    } else if (strncasecmp(url, "https://", 8) == 0) {
+        request->https  = true;
+        url            += 8;
+    } else {
+        return false;
+    }
+
+    char const *end = url + strcspn(url, "/?#");
+    for (char const *p = url; p < end; p++) {
+        if (*p == '@') {
+            url = p + 1;
+        }
+    }
+
+    char const *host_end = end;
+    if (*url == '[') {
+        host_end = memchr(url, ']', end - url);
+        if (!host_end) {
+            return false;
+        }
+        host_end++;
+    } else if (memchr(url, ':', end - url)) {
+        host_end = memchr(url, ':', end - url);
+    }
+
+    size_t len = host_end - url;
+    if (len == 0 || len >= HOST_MAX) {
+        return false;
+    }
+    for (size_t i = 0; i < len; i++) {
+        request->host[i] = tolower((unsigned char)url[i]);
+    }
+    request->host[len] = '\0';
+
+    if (*end == '/') {
+        request->path     = end;
+        request->path_len = strcspn(end, "?#");
+    } else {
+        request->path     = "/";
+        request->path_len = 1;
+    }
+    return true;
+}
+
+static span_t trim(char const *p, size_t len) {
+    while (len && (*p == ' ' || *p == '\t')) {
+        p++;
+        len--;
+    }
+    while (len && (p[len - 1] == ' ' || p[len - 1] == '\t')) {
+        len--;
+    }
+    return (span_t){p, len};
+}
+
+static bool span_is(span_t span, char const *string) {
+    return span.len == strlen(string) && strncasecmp(span.p, string, span.len) == 0;
+}
+
+// Names and values end up in a tab separated jar and in request headers
+static bool valid_text(span_t span) {
+    for (size_t i = 0; i < span.len; i++) {
+        if ((unsigned char)span.p[i] < 0x20 || span.p[i] == 0x7f) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool cookie_domain_match(char const *host, char const *domain) {
+    size_t host_len   = strlen(host);
+    size_t domain_len = strlen(domain);
+
+    if (strcasecmp(host, domain) == 0) {
+        return true;
+    }
+    if (!domain_len || host_len <= domain_len || is_ip_literal(host)) {
+        return false;
+    }
+    return host[host_len - domain_len - 1] == '.' && strcasecmp(host + host_len - domain_len, domain) == 0;
+}
+
+bool cookie_path_match(char const *request_path, size_t request_path_len, char const *cookie_path) {
+    size_t len = strlen(cookie_path);
+
+    if (len > request_path_len || strncmp(request_path, cookie_path, len) != 0) {
+        return false;
+    }
+    return len == request_path_len || cookie_path[len - 1] == '/' || request_path[len] == '/';
+}
+
+// The directory of the request path, RFC 6265 5.1.4
+static span_t default_path(char const *path, size_t len) {
+    if (!len || path[0] != '/') {
+        return (span_t){"/", 1};
+    }
+
+    size_t slash = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (path[i] == '/') {
+            slash = i;
+        }
+    }
+    return slash ? (span_t){path, slash} : (span_t){"/", 1};
+}
+
+static bool is_date_delimiter(char c) {
+    return c == 0x09 || (c >= 0x20 && c <= 0x2f) || (c >= 0x3b && c <= 0x40) || (c >= 0x5b && c <= 0x60) ||
+           (c >= 0x7b && c <= 0x7e);
+}
+
+// Number of leading digits of the token, up to 5, and their value
+static size_t leading_digits(char const *token, size_t len, int *value) {
+    size_t n = 0;
+    *value   = 0;
+    while (n < len && n < 5 && isdigit((unsigned char)token[n])) {
+        *value = *value * 10 + (token[n] - '0');
+        n++;
+    }
+    return n;
+}
+
+static bool parse_time_token(char const *token, size_t len, int *hour, int *minute, int *second) {
+    int   *fields[] = {hour, minute, second};
+    size_t pos      = 0;
+
+    for (int i = 0; i < 3; i++) {
+        size_t n = leading_digits(token + pos, len - pos, fields[i]);
+        if (n < 1 || n > 2) {
+            return false;
+        }
+        pos += n;
+        if (i < 2) {
+            if (pos >= len || token[pos] != ':') {
+                return false;
+            }
+            pos++;
+        }
+    }
+    return pos == len || !isdigit((unsigned char)token[pos]);
+}
+
+static int64_t days_from_civil(int year, int month, int day) {
+    year         -= month <= 2;
+    int      era  = (year >= 0 ? year : year - 399) / 400;
+    unsigned yoe  = (unsigned)(year - era * 400);
+    unsigned doy  = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    unsigned doe  = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return (int64_t)era * 146097 + doe - 719468;
+}
+
+// RFC 6265 5.1.1, which takes the dates servers actually send and not only the ones they should
+time_t cookie_parse_date(char const *date) {
+    static char const months[] = "janfebmaraprmayjunjulaugsepoctnovdec";
+    static int const  month_days[] = {31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+
+    int hour = -1, minute = 0, second = 0;
+    int day = -1, month = -1, year = -1;
+
+    char const *p = date;
+    while (*p) {
+        while (*p && is_date_delimiter(*p)) {
+            p++;
+        }
+        char const *token = p;
+        while (*p && !is_date_delimiter(*p)) {
+            p++;
+        }
+        size_t len = p - token;
+        if (!len) {
+            break;
+        }
+
+        int    value;
+        size_t digits = leading_digits(token, len, &value);
+        bool   ends   = digits == len || !isdigit((unsigned char)token[digits]);
+
+        int h, m, sec;
+        if (hour < 0 && parse_time_token(token, len, &h, &m, &sec)) {
+            hour   = h;
+            minute = m;
+            second = sec;
+        } else if (day < 0 && digits >= 1 && digits <= 2 && ends) {
+            day = value;
+        } else if (month < 0 && len >= 3 && !digits) {
+            for (int i = 0; i < 12; i++) {
+                if (strncasecmp(token, months + i * 3, 3) == 0) {
+                    month = i + 1;
+                    break;
+                }
+            }
+        } else if (year < 0 && digits >= 2 && digits <= 4 && ends) {
+            year = value;
+        }
+    }
+
+    if (year >= 70 && year <= 99) {
+        year += 1900;
+    } else if (year >= 0 && year <= 69) {
+        year += 2000;
+    }
+
+    if (hour < 0 || day < 1 || month < 1 || year < 1601 || hour > 23 || minute > 59 || second > 59) {
+        return -1;
+    }
+    bool leap = (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+    if (day > month_days[month - 1] || (month == 2 && day == 29 && !leap)) {
+        return -1;
+    }
+
+    return (time_t)(days_from_civil(year, month, day) * 86400 + hour * 3600 + minute * 60 + second);
+}
+
+static bool expired(cookie_t const *cookie, time_t now) {
+    return cookie->expires && cookie->expires <= now;
+}
+
+static void mark_changed(cookie_store_t *store, time_t now) {
+    if (!store->changed) {
+        store->changed    = true;
+        store->changed_at = now;
+    }
+}
+
+static cookie_t *cookie_new(span_t name, span_t value, char const *domain, span_t path) {
+    size_t    domain_len = strlen(domain);
+    cookie_t *cookie     = calloc(1, sizeof(cookie_t) + name.len + value.len + domain_len + path.len + 4);
+    if (!cookie) {
+        return NULL;
+    }
+
+    char *p       = cookie->data;
+    cookie->name  = p;
+    memcpy(p, name.p, name.len);
+    p            += name.len + 1;
+    cookie->value = p;
+    memcpy(p, value.p, value.len);
+    p             += value.len + 1;
+    cookie->domain = p;
+    memcpy(p, domain, domain_len);
+    p            += domain_len + 1;
+    cookie->path  = p;
+    memcpy(p, path.p, path.len);
+
+    cookie->hash = hash_domain(cookie->domain);
+    return cookie;
+}
+
+static bool same_cookie(cookie_t const *a, cookie_t const *b) {
+    return a->expires == b->expires && a->host_only == b->host_only && a->secure == b->secure &&
+           a->http_only == b->http_only && a->samesite == b->samesite && strcmp(a->value, b->value) == 0;
+}
+
+// The link to the cookie with the same name, domain and path, or to the end of its bucket
+static cookie_t **find_cookie(cookie_store_t *store, cookie_t const *cookie) {
+    cookie_t **link = &store->buckets[cookie->hash % COOKIE_STORE_BUCKETS];
+    for (; *link; link = &(*link)->next) {
+        cookie_t *other = *link;
+        if (other->hash == cookie->hash && strcmp(other->name, cookie->name) == 0 &&
+            strcmp(other->domain, cookie->domain) == 0 && strcmp(other->path, cookie->path) == 0) {
+            break;
+        }
+    }
+    return link;
+}
+
+static void unlink_cookie(cookie_store_t *store, cookie_t **link) {
+    cookie_t *cookie = *link;
+    *link            = cookie->next;
+    store->count--;
+    free(cookie);
+}
+
+// Makes room for one more cookie by dropping the expired ones, or the least recently used one if there are none
+static void evict(cookie_store_t *store, time_t now) {
+    cookie_t **oldest = NULL;
+    size_t     before = store->count;
+
+    for (int i = 0; i < COOKIE_STORE_BUCKETS; i++) {
+        for (cookie_t **link = &store->buckets[i]; *link;) {
+            if (expired(*link, now)) {
+                unlink_cookie(store, link);
+                continue;
+            }
+            if (!oldest || (int32_t)((*link)->last_used - (*oldest)->last_used) < 0) {
+                oldest = link;
+            }
+            link = &(*link)->next;
+        }
+    }
+
+    if (store->count == before && oldest) {
+        ESP_LOGW(TAG, "Cookie store full, dropping %s for %s", (*oldest)->name, (*oldest)->domain);
+        unlink_cookie(store, oldest);
+        mark_changed(store, now);
+    }
+}
+
+// Takes ownership of cookie. A cookie that already expired removes the one it replaces.
+static void store_cookie(cookie_store_t *store, cookie_t *cookie, time_t now, bool change) {
+    xSemaphoreTake(store->lock, portMAX_DELAY);
+
+    cookie_t **link = find_cookie(store, cookie);
+    cookie_t  *old  = *link;
+
+    if (expired(cookie, now)) {
+        if (old) {
+            unlink_cookie(store, link);
+            if (change) {
+                mark_changed(store, now);
+            }
+        }
+        free(cookie);
+    } else if (old && same_cookie(old, cookie)) {
+        // Servers tend to send the same cookies with every response
+        old->last_used = store->sequence++;
+        free(cookie);
+    } else {
+        if (old) {
+            cookie->created = old->created;
+            cookie->next    = old->next;
+            *link           = cookie;
+            free(old);
+        } else {
+            if (store->count >= COOKIE_STORE_MAX_COOKIES) {
+                evict(store, now);
+                link = find_cookie(store, cookie);
+            }
+            cookie->created = store->sequence++;
+            cookie->next    = *link;
+            *link           = cookie;
+            store->count++;
+        }
+        cookie->last_used = store->sequence++;
+        if (change) {
+            mark_changed(store, now);
+        }
+    }
+
+    xSemaphoreGive(store->lock);
+}
+
+cookie_store_t *cookie_store_create(void) {
+    cookie_store_t *store = calloc(1, sizeof(cookie_store_t));
+    if (!store) {
+        return NULL;
+    }
+
+    store->lock = xSemaphoreCreateMutex();
+    if (!store->lock) {
+        ESP_LOGE(TAG, "Unable to create cookie store lock");
+        free(store);
+        return NULL;
+    }
+    return store;
+}
+
+void cookie_store_destroy(cookie_store_t *store) {
+    if (!store) {
+        return;
+    }
+
+    for (int i = 0; i < COOKIE_STORE_BUCKETS; i++) {
+        while (store->buckets[i]) {
+            unlink_cookie(store, &store->buckets[i]);
+        }
+    }
+
+    vSemaphoreDelete(store->lock);
+    free(store);
+}
+
+bool cookie_store_receive(cookie_store_t *store, char const *url, char const *set_cookie, time_t now) {
+    request_t request;
+    if (url && !parse_url(&request, url)) {
+        return false;
+    }
+
+    char const *end    = set_cookie + strcspn(set_cookie, ";");
+    char const *equals = memchr(set_cookie, '=', end - set_cookie);
+    if (!equals) {
+        return false;
+    }
+
+    span_t name  = trim(set_cookie, equals - set_cookie);
+    span_t value = trim(equals + 1, end - equals - 1);
+    if (!name.len || name.len + value.len > COOKIE_STORE_MAX_BYTES || !valid_text(name) || !valid_text(value)) {
+        return false;
+    }
+
+    span_t     domain      = {NULL, 0};
+    span_t     path        = {NULL, 0};
+    bool       has_max_age = false;
+    time_t     max_age     = 0;
+    time_t     expires     = 0;
+    bool       secure      = false;
+    bool       http_only   = false;
+    samesite_t samesite    = SAMESITE_NONE;
+
+    for (char const *attr = end; *attr == ';';) {
+        attr++;
+        char const *attr_end    = attr + strcspn(attr, ";");
+        char const *attr_equals = memchr(attr, '=', attr_end - attr);
+        span_t      key         = trim(attr, (attr_equals ? attr_equals : attr_end) - attr);
+        span_t      val         = attr_equals ? trim(attr_equals + 1, attr_end - attr_equals - 1) : (span_t){attr, 0};
+        attr                    = attr_end;
+
+        if (span_is(key, "expires")) {
+            char date[64];
+            if (val.len < sizeof(date)) {
+                memcpy(date, val.p, val.len);
+                date[val.len] = '\0';
+                time_t parsed = cookie_parse_date(date);
+                if (parsed != -1) {
+                    // A date before the epoch still means the cookie is gone
+                    expires = parsed > 0 ? parsed : 1;
+                }
+            }
+        } else if (span_is(key, "max-age")) {
+            size_t i        = val.len && val.p[0] == '-' ? 1 : 0;
+            bool   negative = i == 1;
+            long   delta    = 0;
+            if (i == val.len) {
+                continue;
+            }
+            for (; i < val.len && isdigit((unsigned char)val.p[i]); i++) {
+                delta = delta < 100000000 ? delta * 10 + (val.p[i] - '0') : delta;
+            }
+            if (i == val.len) {
+                has_max_age = true;
+                max_age     = negative || !delta ? 1 : now + delta;
+            }
+        } else if (span_is(key, "domain")) {
+            domain = val;
+            if (domain.len && domain.p[0] == '.') {
+                domain.p++;
+                domain.len--;
+            }
+        } else if (span_is(key, "path")) {
+            path = val;
+        } else if (span_is(key, "secure")) {
+            secure = true;
+        } else if (span_is(key, "httponly")) {
+            http_only = true;
+        } else if (span_is(key, "samesite")) {
+            if (span_is(val, "strict")) {
+                samesite = SAMESITE_STRICT;
+            } else if (span_is(val, "lax")) {
+                samesite = SAMESITE_LAX;
+            }
+        }
+    }
+
+    char domain_buf[HOST_MAX];
+    bool host_only = !domain.len;
+    if (!host_only) {
+        if (domain.len >= HOST_MAX) {
+            return false;
+        }
+        for (size_t i = 0; i < domain.len; i++) {
+            domain_buf[i] = tolower((unsigned char)domain.p[i]);
+        }
+        domain_buf[domain.len] = '\0';
+
+        if (url && !cookie_domain_match(request.host, domain_buf)) {
+            ESP_LOGW(TAG, "Rejecting cookie %.*s for %s from %s", (int)name.len, name.p, domain_buf, request.host);
+            return false;
+        }
+        // A cookie for a whole top level domain is only taken from that exact host, and then only for that host
+        if (!strchr(domain_buf, '.')) {
+            if (!url || strcmp(request.host, domain_buf) != 0) {
+                return false;
+            }
+            host_only = true;
+        }
+    } else if (url) {
+        strcpy(domain_buf, request.host);
+    } else {
+        return false;
+    }
+
+    if (secure && url && !request.https) {
+        return false;
+    }
+
+    if (!path.len || path.p[0] != '/') {
+        path = url ? default_path(request.path, request.path_len) : (span_t){"/", 1};
+    }
+    if (!valid_text(path)) {
+        return false;
+    }
+
+    cookie_t *cookie = cookie_new(name, value, domain_buf, path);
+    if (!cookie) {
+        return false;
+    }
+
+    cookie->expires   = has_max_age ? max_age : expires;
+    cookie->host_only = host_only;
+    cookie->secure    = secure;
+    cookie->http_only = http_only;
+    cookie->samesite  = samesite;
+
+    store_cookie(store, cookie, now, true);
+    return true;
+}
+
+static int compare_cookies(cookie_t const *a, cookie_t const *b) {
+    size_t a_len = strlen(a->path);
+    size_t b_len = strlen(b->path);
+
+    if (a_len != b_len) {
+        return a_len > b_len ? -1 : 1;
+    }
+    return (int32_t)(a->created - b->created) < 0 ? -1 : 1;
+}
+
+size_t cookie_store_header(cookie_store_t *store, char const *url, time_t now, char *buf, size_t size) {
+    cookie_t *matches[COOKIE_STORE_MAX_COOKIES];
+    size_t    num_matches = 0;
+    request_t request;
+
+    if (size) {
+        buf[0] = '\0';
+    }
+    if (!parse_url(&request, url)) {
+        return 0;
+    }
+
+    bool ip = is_ip_literal(request.host);
+
+    xSemaphoreTake(store->lock, portMAX_DELAY);
+
+    // Only the buckets of the host and the domains above it can hold cookies for it
+    for (char const *domain = request.host; domain;) {
+        uint32_t hash = hash_domain(domain);
+
+        for (cookie_t **link = &store->buckets[hash % COOKIE_STORE_BUCKETS]; *link;) {
+            cookie_t *cookie = *link;
+            if (expired(cookie, now)) {
+                unlink_cookie(store, link);
+                continue;
+            }
+            link = &cookie->next;
+
+            if (cookie->hash != hash || strcmp(cookie->domain, domain) != 0) {
+                continue;
+            }
+            if ((cookie->host_only && domain != request.host) || (cookie->secure && !request.https) ||
+                !cookie_path_match(request.path, request.path_len, cookie->path)) {
+                continue;
+            }
+
+            cookie->last_used = store->sequence++;
+            size_t i          = num_matches++;
+            while (i > 0 && compare_cookies(cookie, matches[i - 1]) < 0) {
+                matches[i] = matches[i - 1];
+                i--;
+            }
+            matches[i] = cookie;
+        }
+
+        domain = ip ? NULL : strchr(domain, '.');
+        if (domain) {
+            domain++;
+        }
+    }
+
+    size_t total   = 0;
+    size_t written = 0;
+    bool   full    = false;
+    for (size_t i = 0; i < num_matches; i++) {
+        char const *separator = i ? "; " : "";
+        size_t      len = strlen(separator) + strlen(matches[i]->name) + 1 + strlen(matches[i]->value);
+
+        if (!full && written + len < size) {
+            snprintf(buf + written, size - written, "%s%s=%s", separator, matches[i]->name, matches[i]->value);
+            written += len;
+        } else {
+            full = true;
+        }
+        total += len;
+    }
+
+    xSemaphoreGive(store->lock);
+    return total;
+}
+
+bool cookie_store_load_line(cookie_store_t *store, char const *line, time_t now) {
+    span_t fields[9];
+    size_t num_fields = 0;
+    size_t len        = strcspn(line, "\r\n");
+
+    if (!len || line[0] == '#') {
+        return false;
+    }
+
+    for (char const *p = line; num_fields < 9;) {
+        char const *tab = memchr(p, '\t', line + len - p);
+        char const *end = tab ? tab : line + len;
+
+        fields[num_fields++] = (span_t){p, end - p};
+        if (!tab) {
+            break;
+        }
+        p = tab + 1;
+    }
+
+    // name, value, domain, path, expires, secure, http_only, samesite and host_only, which older jars don't have
+    if (num_fields < 8 || !fields[0].len || !fields[2].len || fields[2].len >= HOST_MAX || !fields[3].len ||
+        fields[3].p[0] != '/' || fields[0].len + fields[1].len > COOKIE_STORE_MAX_BYTES) {
+        return false;
+    }
+
+    char domain[HOST_MAX];
+    for (size_t i = 0; i < fields[2].len; i++) {
+        domain[i] = tolower((unsigned char)fields[2].p[i]);
+    }
+    domain[fields[2].len] = '\0';
+
+    time_t expires = (time_t)strtoll(fields[4].p, NULL, 10);
+    if (expires && expires <= now) {
+        return false;
+    }
+
+    cookie_t *cookie = cookie_new(fields[0], fields[1], domain, fields[3]);
+    if (!cookie) {
+        return false;
+    }
+
+    cookie->expires   = expires;
+    cookie->secure    = atoi(fields[5].p) != 0;
+    cookie->http_only = atoi(fields[6].p) != 0;
+    cookie->samesite  = atoi(fields[7].p);
+    cookie->host_only = num_fields > 8 && atoi(fields[8].p) != 0;
+    if (cookie->samesite > SAMESITE_STRICT) {
+        cookie->samesite = SAMESITE_NONE;
+    }
+
+    store_cookie(store, cookie, now, false);
+    return true;
+}
+
+static int format_line(char *line, size_t size, cookie_t const *cookie) {
+    return snprintf(
+        line,
+        size,
+        "%s\t%s\t%s\t%s\t%" PRId64 "\t%d\t%d\t%d\t%d\n",
+        cookie->name,
+        cookie->value,
+        cookie->domain,
+        cookie->path,
+        (int64_t)cookie->expires,
+        cookie->secure,
+        cookie->http_only,
+        cookie->samesite,
+        cookie->host_only
+    );
+}
+
+int cookie_store_save(cookie_store_t *store, time_t now, cookie_store_write_fn write, void *ctx) {
+    char  *line  = NULL;
+    size_t size  = 0;
+    int    saved = 0;
+
+    xSemaphoreTake(store->lock, portMAX_DELAY);
+
+    bool ok = write(ctx, "# BadgeVMS cookie jar\n") &&
+              write(ctx, "# name\tvalue\tdomain\tpath\texpires\tsecure\thttp_only\tsamesite\thost_only\n");
+
+    for (int i = 0; ok && i < COOKIE_STORE_BUCKETS; i++) {
+        for (cookie_t **link = &store->buckets[i]; ok && *link;) {
+            cookie_t *cookie = *link;
+            if (expired(cookie, now)) {
+                unlink_cookie(store, link);
+                continue;
+            }
+            link = &cookie->next;
+
+            int len = format_line(line, size, cookie);
+            if ((size_t)len >= size) {
+                char *grown = realloc(line, len + 1);
+                if (!grown) {
+                    ok = false;
+                    break;
+                }
+                line = grown;
+                size = len + 1;
+                format_line(line, size, cookie);
+            }
+
+            ok = write(ctx, line);
+            saved++;
+        }
+    }
+
+    if (ok) {
+        store->changed = false;
+    }
+
+    xSemaphoreGive(store->lock);
+    free(line);
+    return ok ? saved : -1;
+}
+
+void cookie_store_clear(cookie_store_t *store, bool session_only, time_t now) {
+    xSemaphoreTake(store->lock, portMAX_DELAY);
+
+    size_t before = store->count;
+    for (int i = 0; i < COOKIE_STORE_BUCKETS; i++) {
+        for (cookie_t **link = &store->buckets[i]; *link;) {
+            if (!session_only || !(*link)->expires) {
+                unlink_cookie(store, link);
+            } else {
+                link = &(*link)->next;
+            }
+        }
+    }
+    if (store->count != before) {
+        mark_changed(store, now);
+    }
+
+    xSemaphoreGive(store->lock);
+}
+
+bool cookie_store_needs_save(cookie_store_t *store, time_t now, uint32_t delay_s) {
+    xSemaphoreTake(store->lock, portMAX_DELAY);
+    bool needed = store->changed && (now - store->changed_at >= (time_t)delay_s || now < store->changed_at);
+    xSemaphoreGive(store->lock);
+    return needed;
+}
+
+size_t cookie_store_count(cookie_store_t *store) {
+    xSemaphoreTake(store->lock, portMAX_DELAY);
+    size_t count = store->count;
+    xSemaphoreGive(store->lock);
+    return count;
+}
@@ -0,0 +1,64 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "badgevms_config.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <time.h>
+
+// Cookies of one process, shared by all its curl handles. Cookies are kept in buckets by domain, a request only looks
+// in the buckets of its host and the domains above it. Expired cookies are dropped when they are come across. The
+// store remembers when it was first changed after the cookie jar was last written, so writing the jar can wait and
+// cover many changes at once.
+
+typedef struct cookie_store cookie_store_t;
+
+// Called for each line of the cookie jar, including the newline. Returning false stops saving.
+typedef bool (*cookie_store_write_fn)(void *ctx, char const *line);
+
+cookie_store_t *cookie_store_create(void);
+void            cookie_store_destroy(cookie_store_t *store);
+
+// Stores the cookie of a Set-Cookie header value received for a request to url. Without a url only cookies with a
+// Domain attribute are taken. Returns false if the cookie was rejected.
+bool cookie_store_receive(cookie_store_t *store, char const *url, char const *set_cookie, time_t now);
+
+// Writes the Cookie header value for a request to url into buf and returns its length, like snprintf. Cookies that
+// don't fit are left out whole. Returns 0 when no cookies go with the request.
+size_t cookie_store_header(cookie_store_t *store, char const *url, time_t now, char *buf, size_t size);
+
+// Adds a cookie from a line of a cookie jar written by cookie_store_save()
+bool cookie_store_load_line(cookie_store_t *store, char const *line, time_t now);
+// Returns the number of cookies written or -1 if write failed, in which case the store stays changed
+int  cookie_store_save(cookie_store_t *store, time_t now, cookie_store_write_fn write, void *ctx);
+
+// Drops all cookies, or only those that end with the session
+void cookie_store_clear(cookie_store_t *store, bool session_only, time_t now);
+
+// True if the store was changed at least delay_s ago and the jar wasn't written since
+bool   cookie_store_needs_save(cookie_store_t *store, time_t now, uint32_t delay_s);
+size_t cookie_store_count(cookie_store_t *store);
+
+// Parses a cookie date like "Wed, 21 Oct 2015 07:28:00 GMT", returns -1 if it isn't one
+time_t cookie_parse_date(char const *date);
+bool   cookie_domain_match(char const *host, char const *domain);
+bool   cookie_path_match(char const *request_path, size_t request_path_len, char const *cookie_path);
@@ -16,36 +16,35 @@
 
 #include "curl/curl.h"
 
+#include "cookie_store.h"
+#include "dns_service.h"
 #include "esp_crt_bundle.h"
 #include "esp_http_client.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_tls.h"
+#include "http_decoder.h"
+#include "http_multi.h"
+#include "http_pool.h"
+#include "mbedtls/base64.h"
 #include "task.h"
+#include "tls_cache.h"
 #include "thirdparty/dlmalloc.h"
 #include "why_io.h"
 
+#include <errno.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include <string.h>
+#include <sys/select.h>
+#include <sys/socket.h>
 #include <time.h>
 
 static char const *TAG = "ESP_CURL";
 
-typedef enum { CURL_SAMESITE_NONE = 0, CURL_SAMESITE_LAX, CURL_SAMESITE_STRICT } curl_samesite;
-
-typedef struct cookie_entry {
-    char                *name;
-    char                *value;
-    char                *domain;
-    char                *path;
-    time_t               expires;
-    bool                 secure;
-    bool                 http_only;
-    curl_samesite        samesite;
-    struct cookie_entry *next;
-} cookie_entry_t;
-
 struct curl_handle {
     esp_http_client_handle_t esp_client;
     esp_http_client_config_t config;
@@ -59,10 +58,13 @@ struct curl_handle {
     size_t             post_data_size;
     struct curl_slist *headers;
 
-    cookie_entry_t *cookies;
-    char           *cookie_file;
-    char           *cookie_jar;
-    char           *manual_cookies;
+    char   *accept_encoding; // NULL to leave response bodies alone
+    char   *range;
+    int64_t resume_from;
+
+    char *cookie_file;
+    char *cookie_jar;
+    char *manual_cookies;
 
     char          *proxy_url;
     char          *proxy_userpwd;
@@ -75,12 +77,48 @@ struct curl_handle {
     char   *content_type;
     char   *effective_url;
 
+    long num_connects; // Connections made by the last perform
+    long total_connects;
+    long total_reuses;
+    bool response_started;
+
+    http_encoding_t encoding;
+    http_decoder_t *decoder;
+    CURLcode        transfer_result; // Of the body of the last perform, set by the event handler
+
     bool configured;
     bool verbose;
     bool ssl_verify_peer;
+    bool fresh_connect;
+    bool forbid_reuse;
     long http_auth;
+
+    tls_cache_options_t tls_options;
+
+    struct curl_multi  *multi; // The multi handle the transfer was added to, NULL for none
+    struct curl_handle *multi_next;
+    CURLcode            multi_result;
 };
 
+struct curl_multi {
+    http_multi_t  *engine;
+    curl_handle_t *handles;
+    CURLMsg        message;
+    int            max_total;
+    int            max_per_host;
+};
+
+typedef struct {
+    esp_tls_t          *tls;
+    esp_tls_cfg_t       cfg;
+    char               *cert_pem;
+    char                host[HTTP_POOL_HOST_MAX];
+    int                 port;
+    bool                established; // esp-tls is done connecting, a plain TCP connect may still be going
+    tls_cache_options_t tls_options;
+    dns_query_t        *lookup; // Of the host, esp-tls finds the answer in the cache once it is done
+} multi_conn_t;
+
 static size_t default_write_callback(void *contents, size_t size, size_t nmemb, void *userp) {
     size_t realsize = size * nmemb;
     printf("%.*s", (int)realsize, (char *)contents);
@@ -93,396 +131,178 @@ static size_t default_header_callback(void *contents, size_t size, size_t nmemb,
     return realsize;
 }
 
-static void free_cookie(cookie_entry_t *cookie) {
-    if (!cookie)
-        return;
+static cookie_store_t *process_cookies(void) {
+    task_thread_t  *thread = get_task_info()->thread;
+    cookie_store_t *store  = (cookie_store_t *)atomic_load(&thread->cookie_store);
+    if (store) {
+        return store;
+    }
 
-    dlfree(cookie->name);
-    dlfree(cookie->value);
-    dlfree(cookie->domain);
-    dlfree(cookie->path);
-    dlfree(cookie);
-}
+    store = cookie_store_create();
+    if (!store) {
+        return NULL;
+    }
 
-static void free_all_cookies(cookie_entry_t *cookies) {
-    while (cookies) {
-        cookie_entry_t *next = cookies->next;
-        free_cookie(cookies);
-        cookies = next;
+    uintptr_t expected = 0;
+    if (!atomic_compare_exchange_strong(&thread->cookie_store, &expected, (uintptr_t)store)) {
+        cookie_store_destroy(store);
+        return (cookie_store_t *)expected;
     }
+    return store;
 }
 
-static cookie_entry_t *parse_set_cookie(char const *set_cookie_header) {
-    if (!set_cookie_header) {
-        ESP_LOGW(TAG, "No cookie header");
-        return NULL;
+static void receive_cookie(curl_handle_t *curl, char const *set_cookie) {
+    cookie_store_t *store = process_cookies();
+    if (store && !cookie_store_receive(store, curl->config.url, set_cookie, time(NULL))) {
+        ESP_LOGW(TAG, "Ignoring cookie '%s'", set_cookie);
     }
+}
 
-    ESP_LOGW(TAG, "Parsing header '%s'", set_cookie_header);
+static char *build_cookie_header(curl_handle_t *curl) {
+    cookie_store_t *store  = process_cookies();
+    time_t          now    = time(NULL);
+    size_t          stored = store && curl->config.url ? cookie_store_header(store, curl->config.url, now, NULL, 0) : 0;
+    size_t          manual = curl->manual_cookies ? strlen(curl->manual_cookies) : 0;
 
-    cookie_entry_t *cookie = dlcalloc(1, sizeof(cookie_entry_t));
-    if (!cookie) {
-        ESP_LOGW(TAG, "Cookie dlmalloc failed (cookie)");
+    if (!stored && !manual) {
         return NULL;
     }
 
-    char *header_copy = why_strdup(set_cookie_header);
-    if (!header_copy) {
-        ESP_LOGW(TAG, "Cookie dlmalloc failed (header_copy)");
-        free_cookie(cookie);
+    char *result = dlmalloc(manual + 2 + stored + 1);
+    if (!result) {
         return NULL;
     }
 
-    char *first_semicolon = strchr(header_copy, ';');
-    char *name_value_part = header_copy;
-
-    if (first_semicolon) {
-        *first_semicolon = '\0';
+    result[0] = '\0';
+    if (manual) {
+        strcpy(result, curl->manual_cookies);
     }
-
-    char *equals = strchr(name_value_part, '=');
-    if (equals) {
-        *equals = '\0';
-
-        char *name  = name_value_part;
-        char *value = equals + 1;
-
-        while (*name == ' ' || *name == '\t') name++;
-        char *name_end = name + strlen(name) - 1;
-        while (name_end > name && (*name_end == ' ' || *name_end == '\t')) {
-            *name_end = '\0';
-            name_end--;
+    if (stored) {
+        char *end = result + manual;
+        if (manual) {
+            end = stpcpy(end, "; ");
         }
-
-        while (*value == ' ' || *value == '\t') value++;
-        char *value_end = value + strlen(value) - 1;
-        while (value_end > value && (*value_end == ' ' || *value_end == '\t')) {
-            *value_end = '\0';
-            value_end--;
+        // Cookies set in the meantime are left out rather than cut off
+        cookie_store_header(store, curl->config.url, now, end, stored + 1);
+        if (!*end && manual) {
+            result[manual] = '\0';
         }
-
-        cookie->name  = why_strdup(name);
-        cookie->value = why_strdup(value);
-
-        if (!cookie->name || !cookie->value) {
-            ESP_LOGW(TAG, "No name or no value for '%s'", header_copy);
-            dlfree(header_copy);
-            free_cookie(cookie);
-            return NULL;
-        }
-    } else {
-        ESP_LOGW(TAG, "No = for '%s'", header_copy);
-        dlfree(header_copy);
-        free_cookie(cookie);
-        return NULL;
     }
+    return result;
+}
 
-    cookie->domain    = why_strdup("example.com");
-    cookie->path      = why_strdup("/");
-    cookie->expires   = 0;
-    cookie->secure    = false;
-    cookie->http_only = false;
-    cookie->samesite  = CURL_SAMESITE_NONE; // Default per RFC
-
-    if (!cookie->domain || !cookie->path) {
-        ESP_LOGW(TAG, "No domain or cookie path for '%s'", header_copy);
-        dlfree(header_copy);
-        free_cookie(cookie);
-        return NULL;
+static int load_cookies_from_file(char const *filename) {
+    cookie_store_t *store = process_cookies();
+    if (!store || !filename) {
+        return -1;
     }
 
-    if (first_semicolon) {
-        char *attr_start = first_semicolon + 1;
-
-        while (attr_start && *attr_start) {
-            while (*attr_start == ' ' || *attr_start == '\t') {
-                attr_start++;
-            }
-
-            if (!*attr_start)
-                break;
-
-            char *attr_end = strchr(attr_start, ';');
-            if (attr_end) {
-                *attr_end = '\0';
-            }
-
-            char *attr_equals = strchr(attr_start, '=');
-            if (attr_equals) {
-                *attr_equals     = '\0';
-                char *attr_name  = attr_start;
-                char *attr_value = attr_equals + 1;
-
-                while (*attr_name == ' ' || *attr_name == '\t') attr_name++;
-                char *name_end = attr_name + strlen(attr_name) - 1;
-                while (name_end > attr_name && (*name_end == ' ' || *name_end == '\t')) {
-                    *name_end = '\0';
-                    name_end--;
-                }
-
-                while (*attr_value == ' ' || *attr_value == '\t') {
-                    attr_value++;
-                }
-                char *value_end = attr_value + strlen(attr_value) - 1;
-                while (value_end > attr_value && (*value_end == ' ' || *value_end == '\t')) {
-                    *value_end = '\0';
-                    value_end--;
-                }
-
-                if (strcasecmp(attr_name, "domain") == 0) {
-                    dlfree(cookie->domain);
-                    cookie->domain = why_strdup(attr_value);
-                    if (!cookie->domain) {
-                        ESP_LOGW(TAG, "No domain for '%s'", header_copy);
-                        dlfree(header_copy);
-                        free_cookie(cookie);
-                        return NULL;
-                    }
-                } else if (strcasecmp(attr_name, "path") == 0) {
-                    dlfree(cookie->path);
-                    cookie->path = why_strdup(attr_value);
-                    if (!cookie->path) {
-                        ESP_LOGW(TAG, "No path for '%s'", header_copy);
-                        dlfree(header_copy);
-                        free_cookie(cookie);
-                        return NULL;
-                    }
-                } else if (strcasecmp(attr_name, "expires") == 0) {
-                    // RFC 1123 date format...
-                    cookie->expires = 2147483647; // Max time_t for 32-bit (year 2038)
-                } else if (strcasecmp(attr_name, "max-age") == 0) {
-                    long max_age = atol(attr_value);
-                    if (max_age > 0) {
-                        time_t current_time = time(NULL);
-                        if (current_time != (time_t)-1) {
-                            cookie->expires = current_time + max_age;
-                        }
-                    } else if (max_age == 0) {
-                        // max-age=0 means delete cookie immediately
-                        cookie->expires = 1; // Past time
-                    }
-                } else if (strcasecmp(attr_name, "samesite") == 0) {
-                    if (strcasecmp(attr_value, "strict") == 0) {
-                        cookie->samesite = CURL_SAMESITE_STRICT;
-                    } else if (strcasecmp(attr_value, "lax") == 0) {
-                        cookie->samesite = CURL_SAMESITE_LAX;
-                    } else if (strcasecmp(attr_value, "none") == 0) {
-                        cookie->samesite = CURL_SAMESITE_NONE;
-                    } else {
-                        // Invalid SameSite value, default to None per spec
-                        cookie->samesite = CURL_SAMESITE_NONE;
-                        ESP_LOGW(TAG, "Invalid SameSite value: %s, defaulting to None", attr_value);
-                    }
-                }
-                // More attributes... maybe
-
-            } else {
-                char *attr_name = attr_start;
-
-                while (*attr_name == ' ' || *attr_name == '\t') attr_name++;
-                char *name_end = attr_name + strlen(attr_name) - 1;
-                while (name_end > attr_name && (*name_end == ' ' || *name_end == '\t')) {
-                    *name_end = '\0';
-                    name_end--;
-                }
-
-                if (strcasecmp(attr_name, "secure") == 0) {
-                    cookie->secure = true;
-                } else if (strcasecmp(attr_name, "httponly") == 0) {
-                    cookie->http_only = true;
-                }
-            }
-
-            if (attr_end) {
-                attr_start = attr_end + 1;
-            } else {
-                break;
-            }
-        }
+    FILE *file = why_fopen(filename, "r");
+    if (!file) {
+        ESP_LOGW(TAG, "Cookie file not found or can't be opened: %s", filename);
+        return 0;
     }
 
-    dlfree(header_copy);
-    return cookie;
-}
-
-static void add_cookie(curl_handle_t *curl, cookie_entry_t *new_cookie) {
-    if (!curl || !new_cookie)
-        return;
+    size_t size = COOKIE_STORE_MAX_BYTES + 512;
+    char  *line = dlmalloc(size);
+    if (!line) {
+        why_fclose(file);
+        return -1;
+    }
 
-    cookie_entry_t **current = &curl->cookies;
-    while (*current) {
-        if (strcmp((*current)->name, new_cookie->name) == 0) {
-            cookie_entry_t *to_remove = *current;
-            *current                  = (*current)->next;
-            free_cookie(to_remove);
-            break;
+    int    cookies_loaded = 0;
+    time_t now            = time(NULL);
+    while (why_fgets(line, size, file)) {
+        if (cookie_store_load_line(store, line, now)) {
+            cookies_loaded++;
         }
-        current = &(*current)->next;
     }
 
-    new_cookie->next = curl->cookies;
-    curl->cookies    = new_cookie;
+    dlfree(line);
+    why_fclose(file);
+    ESP_LOGI(TAG, "Loaded %d cookies from file: %s", cookies_loaded, filename);
+    return cookies_loaded;
 }
 
-static char *build_cookie_header(curl_handle_t *curl) {
-    if (!curl->cookies && !curl->manual_cookies)
-        return NULL;
-
-    size_t total_len = 0;
-    char  *result    = NULL;
+static bool write_cookie_line(void *ctx, char const *line) {
+    return why_fputs(line, ctx) >= 0;
+}
 
-    if (curl->manual_cookies) {
-        total_len += strlen(curl->manual_cookies);
-    }
+// Writes the cookies of the process to the jar of the handle if they changed, and waited long enough unless forced
+static void flush_cookie_jar(curl_handle_t *curl, bool force) {
+    cookie_store_t *store = process_cookies();
+    time_t          now   = time(NULL);
 
-    cookie_entry_t *cookie = curl->cookies;
-    while (cookie) {
-        if (total_len > 0)
-            total_len += 2;                                            // "; "
-        total_len += strlen(cookie->name) + 1 + strlen(cookie->value); // name=value
-        cookie     = cookie->next;
+    if (!curl->cookie_jar || !store || !cookie_store_needs_save(store, now, force ? 0 : COOKIE_JAR_SAVE_DELAY_S)) {
+        return;
     }
 
-    if (total_len == 0)
-        return NULL;
-
-    result = dlmalloc(total_len + 1);
-    if (!result)
-        return NULL;
-
-    result[0] = '\0';
-
-    if (curl->manual_cookies) {
-        strcat(result, curl->manual_cookies);
+    FILE *file = why_fopen(curl->cookie_jar, "w");
+    if (!file) {
+        ESP_LOGE(TAG, "Failed to open cookie file for writing: %s", curl->cookie_jar);
+        return;
     }
 
-    cookie = curl->cookies;
-    while (cookie) {
-        if (strlen(result) > 0)
-            strcat(result, "; ");
-        strcat(result, cookie->name);
-        strcat(result, "=");
-        strcat(result, cookie->value);
-        cookie = cookie->next;
+    int saved = cookie_store_save(store, now, write_cookie_line, file);
+    if (why_fclose(file) != 0 || saved < 0) {
+        ESP_LOGE(TAG, "Failed to write cookie file: %s", curl->cookie_jar);
+        return;
     }
-
-    return result;
+    ESP_LOGI(TAG, "Saved %d cookies to file: %s", saved, curl->cookie_jar);
 }
 
-static int load_cookies_from_file(curl_handle_t *curl, char const *filename) {
-    if (!curl || !filename)
-        return -1;
+static bool write_body(void *user_data, void const *data, size_t len) {
+    curl_handle_t *curl = user_data;
+    return !curl->write_function || curl->write_function((void *)data, 1, len, curl->write_data) == len;
+}
 
-    FILE *file = why_fopen(filename, "r");
-    if (!file) {
-        ESP_LOGW(TAG, "Cookie file not found or can't be opened: %s", filename);
-        return 0;
+static void receive_body(curl_handle_t *curl, void const *data, size_t len) {
+    if (curl->transfer_result != CURLE_OK) {
+        return;
     }
 
-    char line[512];
-    int  cookies_loaded = 0;
-
-    while (why_fgets(line, sizeof(line), file)) {
-        if (line[0] == '\n' || line[0] == '#' || line[0] == '\0') {
-            continue;
-        }
-
-        size_t len = strlen(line);
-        if (len > 0 && line[len - 1] == '\n') {
-            line[len - 1] = '\0';
-        }
-
-        char *name          = strtok(line, "\t");
-        char *value         = strtok(NULL, "\t");
-        char *domain        = strtok(NULL, "\t");
-        char *path          = strtok(NULL, "\t");
-        char *expires_str   = strtok(NULL, "\t");
-        char *secure_str    = strtok(NULL, "\t");
-        char *http_only_str = strtok(NULL, "\t");
-        char *samesite_str  = strtok(NULL, "\t");
-
-        if (!name || !value || !domain || !path || !expires_str || !secure_str || !http_only_str || !samesite_str) {
-            ESP_LOGW(TAG, "Malformed cookie line in file: %s", filename);
-            continue;
-        }
+    // A server that ignores the range sends the whole body again, appending that would corrupt what is resumed
+    if (curl->resume_from > 0 && !curl->range && esp_http_client_get_status_code(curl->esp_client) == 200) {
+        curl->transfer_result = CURLE_RANGE_ERROR;
+        return;
+    }
 
-        cookie_entry_t *cookie = dlcalloc(1, sizeof(cookie_entry_t));
-        if (!cookie) {
-            ESP_LOGE(TAG, "Failed to allocate memory for cookie");
-            continue;
+    if (!curl->accept_encoding || curl->encoding == HTTP_ENCODING_IDENTITY) {
+        if (!write_body(curl, data, len)) {
+            curl->transfer_result = CURLE_WRITE_ERROR;
         }
+        return;
+    }
 
-        cookie->name      = why_strdup(name);
-        cookie->value     = why_strdup(value);
-        cookie->domain    = why_strdup(domain);
-        cookie->path      = why_strdup(path);
-        cookie->expires   = (time_t)atol(expires_str);
-        cookie->secure    = (atoi(secure_str) != 0);
-        cookie->http_only = (atoi(http_only_str) != 0);
-        cookie->samesite  = (atoi(samesite_str) != 0);
-
-        time_t current_time = time(NULL);
-        if (cookie->expires > 0 && cookie->expires < current_time) {
-            ESP_LOGW(TAG, "Skipping expired cookie: %s", cookie->name);
-            free_cookie(cookie);
-            continue;
+    if (!curl->decoder) {
+        curl->decoder = http_decoder_create(curl->encoding, write_body, curl);
+        if (!curl->decoder) {
+            curl->transfer_result =
+                curl->encoding == HTTP_ENCODING_UNSUPPORTED ? CURLE_BAD_CONTENT_ENCODING : CURLE_OUT_OF_MEMORY;
+            return;
         }
-
-        add_cookie(curl, cookie);
-        cookies_loaded++;
     }
 
-    why_fclose(file);
-    ESP_LOGW(TAG, "Loaded %d cookies from file: %s", cookies_loaded, filename);
-    return cookies_loaded;
+    http_decoder_result_t result = http_decoder_write(curl->decoder, data, len);
+    if (result == HTTP_DECODER_ERR_DATA) {
+        curl->transfer_result = CURLE_BAD_CONTENT_ENCODING;
+    } else if (result == HTTP_DECODER_ERR_ABORTED) {
+        curl->transfer_result = CURLE_WRITE_ERROR;
+    }
 }
 
-static int save_cookies_to_file(curl_handle_t *curl, char const *filename) {
-    if (!curl || !filename)
-        return -1;
+// Whether the response ended before all of the body its framing announced came in
+static bool body_cut_short(curl_handle_t *curl) {
+    esp_http_client_handle_t client = curl->esp_client;
+    int                      status = curl->response_code;
 
-    FILE *file = why_fopen(filename, "w");
-    if (!file) {
-        ESP_LOGE(TAG, "Failed to open cookie file for writing: %s", filename);
-        return -1;
+    if (curl->config.method == HTTP_METHOD_HEAD || status == 204 || status == 304 || status < 200) {
+        return false;
     }
-
-    why_fprintf(file, "# BadgeVMS cookie jar file\n");
-    why_fprintf(file, "# Format: name\\tvalue\\tdomain\\tpath\\texpires\\tsecure\\thttp_only\\tsamesite\t\n");
-
-    int    cookies_saved = 0;
-    time_t current_time  = time(NULL);
-
-    cookie_entry_t *cookie = curl->cookies;
-    while (cookie) {
-        if (cookie->expires > 0 && cookie->expires < current_time) {
-            ESP_LOGW(TAG, "Skipping expired cookie when saving: %s", cookie->name);
-            cookie = cookie->next;
-            continue;
-        }
-        ESP_LOGW(TAG, "Saving cookie: %s", cookie->name);
-
-        why_fprintf(
-            file,
-            "%s\t%s\t%s\t%s\t%ld\t%d\t%d\t%d\t\n",
-            cookie->name ? cookie->name : "",
-            cookie->value ? cookie->value : "",
-            cookie->domain ? cookie->domain : "",
-            cookie->path ? cookie->path : "",
-            (long)cookie->expires,
-            cookie->secure ? 1 : 0,
-            cookie->http_only ? 1 : 0,
-            cookie->samesite ? 1 : 0
-        );
-
-        cookies_saved++;
-        cookie = cookie->next;
+    if (!esp_http_client_is_chunked_response(client) && esp_http_client_get_content_length(client) < 0) {
+        return false;
     }
-
-    ESP_LOGW(TAG, "Closing jar");
-    why_fclose(file);
-    ESP_LOGW(TAG, "Saved %d cookies to file: %s", cookies_saved, filename);
-    return cookies_saved;
+    return !esp_http_client_is_complete_data_received(client);
 }
 
 static esp_err_t http_event_handler(esp_http_client_event_t *evt) {
@@ -496,26 +316,34 @@ static esp_err_t http_event_handler(esp_http_client_event_t *evt) {
             break;
 
         case HTTP_EVENT_ON_CONNECTED:
+            curl->num_connects++;
             if (curl->verbose) {
                 ESP_LOGI(TAG, "HTTP_EVENT_ON_CONNECTED");
             }
             break;
 
         case HTTP_EVENT_HEADER_SENT:
+            // Only the body of the last response of a redirect chain counts
+            curl->encoding        = HTTP_ENCODING_IDENTITY;
+            curl->transfer_result = CURLE_OK;
+            http_decoder_destroy(curl->decoder);
+            curl->decoder = NULL;
             if (curl->verbose) {
                 ESP_LOGI(TAG, "HTTP_EVENT_HEADER_SENT");
             }
             break;
 
         case HTTP_EVENT_ON_HEADER:
+            // Known from the first header on, for the header function to look at like with libcurl
+            curl->response_code    = esp_http_client_get_status_code(curl->esp_client);
+            curl->response_started = true;
             if (evt->header_key) {
                 if (strncasecmp(evt->header_key, "Set-Cookie", 10) == 0) {
                     if (evt->header_value) {
-                        cookie_entry_t *cookie = parse_set_cookie(evt->header_value);
-                        if (cookie) {
-                            add_cookie(curl, cookie);
-                        }
+                        receive_cookie(curl, evt->header_value);
                     }
+                } else if (strcasecmp(evt->header_key, "Content-Encoding") == 0 && evt->header_value) {
+                    curl->encoding = http_encoding_parse(evt->header_value, strlen(evt->header_value));
                 }
             }
 
@@ -535,14 +363,19 @@ static esp_err_t http_event_handler(esp_http_client_event_t *evt) {
             break;
 
         case HTTP_EVENT_ON_DATA:
-            if (curl->write_function) {
-                curl->write_function(evt->data, 1, evt->data_len, curl->write_data);
-            }
+            curl->response_code    = esp_http_client_get_status_code(curl->esp_client);
+            curl->response_started = true;
+            receive_body(curl, evt->data, evt->data_len);
             break;
 
         case HTTP_EVENT_ON_FINISH:
             curl->response_code  = esp_http_client_get_status_code(curl->esp_client);
             curl->content_length = esp_http_client_get_content_length(curl->esp_client);
+            if (curl->transfer_result == CURLE_OK && body_cut_short(curl)) {
+                curl->transfer_result = CURLE_PARTIAL_FILE;
+            } else if (curl->transfer_result == CURLE_OK && curl->decoder && !http_decoder_finished(curl->decoder)) {
+                curl->transfer_result = CURLE_BAD_CONTENT_ENCODING;
+            }
             if (curl->verbose) {
                 ESP_LOGI(
                     TAG,
@@ -591,6 +424,9 @@ CURL *curl_easy_init(void) {
     curl->proxy_auth = CURLAUTH_BASIC;
     curl->http_auth  = CURLAUTH_BASIC;
 
+    curl->tls_options.sessions     = true;
+    curl->tls_options.ca_max_age_s = TLS_CA_CACHE_MAX_AGE_S;
+
     return (CURL *)curl;
 }
 
@@ -800,7 +636,7 @@ CURLcode curl_easy_setopt(CURL *curl_handle, CURLoption option, ...) {
             char const *filename = va_arg(args, char const *);
             dlfree(curl->cookie_file);
             curl->cookie_file = why_strdup(filename);
-            load_cookies_from_file(curl, filename);
+            load_cookies_from_file(filename);
             break;
         }
 
@@ -811,6 +647,33 @@ CURLcode curl_easy_setopt(CURL *curl_handle, CURLoption option, ...) {
             break;
         }
 
+        case CURLOPT_COOKIELIST: {
+            char const     *command = va_arg(args, char const *);
+            cookie_store_t *store   = process_cookies();
+            if (!command || !store) {
+                break;
+            }
+
+            if (strcasecmp(command, "ALL") == 0) {
+                cookie_store_clear(store, false, time(NULL));
+            } else if (strcasecmp(command, "SESS") == 0) {
+                cookie_store_clear(store, true, time(NULL));
+            } else if (strcasecmp(command, "FLUSH") == 0) {
+                flush_cookie_jar(curl, true);
+            } else if (strcasecmp(command, "RELOAD") == 0) {
+                if (curl->cookie_file) {
+                    load_cookies_from_file(curl->cookie_file);
+                }
+            } else if (strncasecmp(command, "Set-Cookie:", 11) == 0) {
+                if (!cookie_store_receive(store, NULL, command + 11, time(NULL))) {
+                    ESP_LOGW(TAG, "Ignoring cookie '%s'", command);
+                }
+            } else if (!cookie_store_load_line(store, command, time(NULL))) {
+                ESP_LOGW(TAG, "Ignoring cookie line '%s'", command);
+            }
+            break;
+        }
+
         case CURLOPT_BUFFERSIZE: {
             long size                = va_arg(args, long);
             curl->config.buffer_size = size;
@@ -868,11 +731,59 @@ CURLcode curl_easy_setopt(CURL *curl_handle, CURLoption option, ...) {
             break;
         }
 
+        case CURLOPT_FRESH_CONNECT: {
+            long fresh          = va_arg(args, long);
+            curl->fresh_connect = fresh != 0;
+            break;
+        }
+
+        case CURLOPT_FORBID_REUSE: {
+            long forbid        = va_arg(args, long);
+            curl->forbid_reuse = forbid != 0;
+            break;
+        }
+
+        case CURLOPT_SSL_SESSIONID_CACHE: {
+            long sessions              = va_arg(args, long);
+            curl->tls_options.sessions = sessions != 0;
+            break;
+        }
+
+        case CURLOPT_CA_CACHE_TIMEOUT: {
+            // -1 keeps the parsed certificates forever, 0 parses them for every connection
+            long max_age                   = va_arg(args, long);
+            curl->tls_options.ca_max_age_s = max_age < 0 ? -1 : max_age;
+            break;
+        }
+
         case CURLOPT_RANGE: {
             char const *range = va_arg(args, char const *);
-            ESP_LOGW(TAG, "CURLOPT_RANGE not implemented: %s", range);
-            va_end(args);
-            return CURLE_UNSUPPORTED_PROTOCOL;
+            dlfree(curl->range);
+            curl->range = range ? why_strdup(range) : NULL;
+            break;
+        }
+
+        case CURLOPT_RESUME_FROM: {
+            long offset       = va_arg(args, long);
+            curl->resume_from = offset;
+            break;
+        }
+
+        case CURLOPT_RESUME_FROM_LARGE: {
+            curl_off_t offset = va_arg(args, curl_off_t);
+            curl->resume_from = offset;
+            break;
+        }
+
+        case CURLOPT_ACCEPT_ENCODING: {
+            // An empty string asks for every encoding there is a decoder for
+            char const *encoding = va_arg(args, char const *);
+            dlfree(curl->accept_encoding);
+            curl->accept_encoding = NULL;
+            if (encoding) {
+                curl->accept_encoding = why_strdup(*encoding ? encoding : "gzip, deflate");
+            }
+            break;
         }
 
         case CURLOPT_REFERER: {
@@ -892,60 +803,269 @@ CURLcode curl_easy_setopt(CURL *curl_handle, CURLoption option, ...) {
     return CURLE_OK;
 }
 
+// An esp_http_client with its own copy of the CA PEM, which esp_http_client only points to, so the client can outlive
+// the curl handle that made it in the pool. The copy is on the kernel heap and goes when the client is cleaned up.
+typedef struct {
+    esp_http_client_handle_t client;
+    char                    *cert_pem;
+} pooled_client_t;
+
+static pooled_client_t *open_client(curl_handle_t const *curl) {
+    pooled_client_t *pooled = calloc(1, sizeof(pooled_client_t));
+    if (!pooled) {
+        return NULL;
+    }
+
+    esp_http_client_config_t config = curl->config;
+    if (config.cert_pem) {
+        pooled->cert_pem = strdup(config.cert_pem);
+        if (!pooled->cert_pem) {
+            free(pooled);
+            return NULL;
+        }
+        config.cert_pem = pooled->cert_pem;
+    }
+
+    pooled->client = esp_http_client_init(&config);
+    if (!pooled->client) {
+        free(pooled->cert_pem);
+        free(pooled);
+        return NULL;
+    }
+    return pooled;
+}
+
+static void close_client(void *handle) {
+    pooled_client_t *pooled = handle;
+    esp_http_client_cleanup(pooled->client);
+    free(pooled->cert_pem);
+    free(pooled);
+}
+
+static http_pool_t *process_pool(void) {
+    task_thread_t *thread = get_task_info()->thread;
+    http_pool_t   *pool   = (http_pool_t *)atomic_load(&thread->http_pool);
+    if (pool) {
+        return pool;
+    }
+
+    pool = http_pool_create(close_client);
+    if (!pool) {
+        return NULL;
+    }
+
+    uintptr_t expected = 0;
+    if (!atomic_compare_exchange_strong(&thread->http_pool, &expected, (uintptr_t)pool)) {
+        http_pool_destroy(pool, true);
+        return (http_pool_t *)expected;
+    }
+    return pool;
+}
+
+static uint64_t hash_bytes(uint64_t hash, void const *data, size_t len) {
+    unsigned char const *p = data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static uint64_t hash_string(uint64_t hash, char const *string) {
+    return string ? hash_bytes(hash, string, strlen(string) + 1) : hash_bytes(hash, "\xff", 1);
+}
+
+// Everything esp_http_client only takes at init, a pooled connection is only reused by handles that agree on it
+static uint64_t config_hash(curl_handle_t const *curl) {
+    esp_http_client_config_t const *config = &curl->config;
+
+    bool     bundle  = config->crt_bundle_attach != NULL;
+    bool     skip_cn = config->skip_cert_common_name_check;
+    uint64_t hash    = 0xcbf29ce484222325ULL;
+    hash             = hash_bytes(hash, &bundle, sizeof(bundle));
+    hash             = hash_bytes(hash, &skip_cn, sizeof(skip_cn));
+    hash             = hash_bytes(hash, &config->buffer_size, sizeof(config->buffer_size));
+    hash             = hash_bytes(hash, &config->max_redirection_count, sizeof(config->max_redirection_count));
+    hash             = hash_string(hash, config->cert_pem);
+    hash             = hash_string(hash, config->user_agent);
+    hash             = hash_string(hash, config->username);
+    hash             = hash_string(hash, config->password);
+    return hash;
+}
+
+// The value of the Range header the handle asks for, false for none
+// There is no proxy support, a transfer that asked for one fails rather than going out directly
+static bool proxy_requested(curl_handle_t const *curl) {
+    return curl->proxy_url && curl->proxy_url[0];
+}
+
+static bool range_header(curl_handle_t const *curl, char *value, size_t size) {
+    if (curl->range) {
+        return snprintf(value, size, "bytes=%s", curl->range) < (int)size;
+    }
+    if (curl->resume_from > 0) {
+        snprintf(value, size, "bytes=%lld-", (long long)curl->resume_from);
+        return true;
+    }
+    return false;
+}
+
+// Sets the request headers of the handle on the client, or removes them again so the next user of a pooled client
+// doesn't send them. Returns false if a header esp_http_client sets itself was overridden, the client can't be
+// pooled then.
+static bool apply_headers(curl_handle_t *curl, esp_http_client_handle_t client, bool remove) {
+    bool poolable = true;
+    char range[64];
+
+    // Before the headers of the handle, which replace them
+    if (remove) {
+        esp_http_client_delete_header(client, "Accept-Encoding");
+        esp_http_client_delete_header(client, "Range");
+    } else {
+        if (curl->accept_encoding) {
+            esp_http_client_set_header(client, "Accept-Encoding", curl->accept_encoding);
+        }
+        if (range_header(curl, range, sizeof(range))) {
+            esp_http_client_set_header(client, "Range", range);
+        }
+    }
+
+    for (struct curl_slist *header = curl->headers; header; header = header->next) {
+        char *colon = strchr(header->data, ':');
+        if (!colon) {
+            continue;
+        }
+
+        char *header_copy = why_strdup(header->data);
+        if (!header_copy) {
+            continue;
+        }
+
+        char *colon_copy = strchr(header_copy, ':');
+        *colon_copy      = '\0';
+
+        char *value = colon_copy + 1;
+        while (*value && (*value == ' ' || *value == '\t')) {
+            value++;
+        }
+
+        if (strcasecmp(header_copy, "Host") == 0 || strcasecmp(header_copy, "User-Agent") == 0) {
+            poolable = false;
+        } else if (remove) {
+            esp_http_client_delete_header(client, header_copy);
+        }
+
+        if (!remove) {
+            esp_http_client_set_header(client, header_copy, value);
+        }
+        dlfree(header_copy);
+    }
+
+    if (remove) {
+        esp_http_client_delete_header(client, "Cookie");
+        esp_http_client_set_post_field(client, NULL, 0);
+    } else {
+        char *cookie_header = build_cookie_header(curl);
+        if (cookie_header) {
+            esp_http_client_set_header(client, "Cookie", cookie_header);
+            dlfree(cookie_header);
+        }
+
+        if (curl->post_data && curl->config.method == HTTP_METHOD_POST) {
+            esp_http_client_set_post_field(client, curl->post_data, curl->post_data_size);
+        }
+    }
+
+    return poolable;
+}
+
 CURLcode curl_easy_perform(CURL *curl_handle) {
     if (!curl_handle) {
         return CURLE_FAILED_INIT;
     }
 
-    curl_handle_t *curl = (curl_handle_t *)curl_handle;
+    curl_handle_t   *curl   = (curl_handle_t *)curl_handle;
+    http_pool_t     *pool   = NULL;
+    pooled_client_t *pooled = NULL;
+    int              slot   = -1;
+    http_pool_key_t  key;
 
-    curl->esp_client = esp_http_client_init(&curl->config);
-    if (!curl->esp_client) {
+    if (curl->multi) {
+        ESP_LOGW(TAG, "Handle is in a multi handle, can't perform it on its own");
         return CURLE_FAILED_INIT;
     }
 
-    if (curl->headers) {
-        struct curl_slist *header = curl->headers;
-        while (header) {
-            char *colon = strchr(header->data, ':');
-            if (colon) {
-                char *header_copy = why_strdup(header->data);
-                char *colon_copy  = strchr(header_copy, ':');
-                *colon_copy       = '\0';
+    if (proxy_requested(curl)) {
+        return CURLE_UNSUPPORTED_PROTOCOL;
+    }
 
-                char *value = colon_copy + 1;
-                while (*value && (*value == ' ' || *value == '\t')) {
-                    value++;
-                }
+    pool = process_pool();
+    if (pool && http_pool_key_from_url(&key, curl->config.url, config_hash(curl))) {
+        slot = http_pool_acquire(pool, &key, esp_timer_get_time() / 1000, (void **)&pooled);
+    }
 
-                esp_http_client_set_header(curl->esp_client, header_copy, value);
-                dlfree(header_copy);
+    bool reused = pooled != NULL;
+    if (reused) {
+        curl->esp_client = pooled->client;
+        esp_http_client_set_user_data(curl->esp_client, curl);
+        esp_http_client_set_url(curl->esp_client, curl->config.url);
+        esp_http_client_set_method(curl->esp_client, curl->config.method);
+        esp_http_client_set_timeout_ms(curl->esp_client, curl->config.timeout_ms);
+        if (curl->fresh_connect) {
+            esp_http_client_close(curl->esp_client);
+        }
+    } else {
+        pooled = open_client(curl);
+        if (!pooled) {
+            if (slot >= 0) {
+                http_pool_release(pool, slot, NULL, false, 0);
             }
-            header = header->next;
+            return CURLE_FAILED_INIT;
         }
+        curl->esp_client = pooled->client;
     }
 
-    char *cookie_header = build_cookie_header(curl);
-    if (cookie_header) {
-        esp_http_client_set_header(curl->esp_client, "Cookie", cookie_header);
-        dlfree(cookie_header);
-    }
+    bool keep = apply_headers(curl, curl->esp_client, false) && !curl->forbid_reuse;
+
+    task_info_t *task = get_task_info();
+    task->tls_options = &curl->tls_options;
+
+    curl->num_connects     = 0;
+    curl->response_started = false;
+    curl->transfer_result  = CURLE_OK;
+    esp_err_t err          = esp_http_client_perform(curl->esp_client);
 
-    if (curl->post_data && curl->config.method == HTTP_METHOD_POST) {
-        esp_http_client_set_post_field(curl->esp_client, curl->post_data, curl->post_data_size);
+    // The server may have closed a connection that sat in the pool before this request reached it
+    if (err != ESP_OK && reused && !curl->num_connects && !curl->response_started) {
+        esp_http_client_close(curl->esp_client);
+        err = esp_http_client_perform(curl->esp_client);
     }
 
-    esp_err_t err = esp_http_client_perform(curl->esp_client);
+    task->tls_options = NULL;
 
-    if (curl->cookie_jar) {
-        save_cookies_to_file(curl, curl->cookie_jar);
+    curl->total_connects += curl->num_connects;
+    if (reused && !curl->num_connects) {
+        curl->total_reuses++;
     }
 
-    esp_http_client_cleanup(curl->esp_client);
+    flush_cookie_jar(curl, false);
+
+    http_decoder_destroy(curl->decoder);
+    curl->decoder = NULL;
+
+    if (slot >= 0 && keep && err == ESP_OK && curl->transfer_result == CURLE_OK) {
+        apply_headers(curl, curl->esp_client, true);
+        http_pool_release(pool, slot, pooled, true, esp_timer_get_time() / 1000);
+    } else {
+        if (slot >= 0) {
+            http_pool_release(pool, slot, NULL, false, 0);
+        }
+        close_client(pooled);
+    }
     curl->esp_client = NULL;
 
     if (err == ESP_OK) {
-        return CURLE_OK;
+        return curl->transfer_result;
     } else if (err == ESP_ERR_TIMEOUT) {
         return CURLE_OPERATION_TIMEDOUT;
     } else if (err == ESP_ERR_HTTP_CONNECT) {
@@ -962,16 +1082,22 @@ void curl_easy_cleanup(CURL *curl_handle) {
 
     curl_handle_t *curl = (curl_handle_t *)curl_handle;
 
+    if (curl->multi) {
+        curl_multi_remove_handle(curl->multi, curl);
+    }
+
     dlfree((void *)curl->config.url);
     dlfree((void *)curl->config.user_agent);
     dlfree((void *)curl->config.username);
     dlfree((void *)curl->config.password);
     dlfree((void *)curl->config.cert_pem);
     dlfree(curl->post_data);
+    dlfree(curl->accept_encoding);
+    dlfree(curl->range);
     dlfree(curl->content_type);
     dlfree(curl->effective_url);
 
-    free_all_cookies(curl->cookies);
+    flush_cookie_jar(curl, true);
     dlfree(curl->cookie_file);
     dlfree(curl->cookie_jar);
     dlfree(curl->manual_cookies);
@@ -1020,6 +1146,24 @@ CURLcode curl_easy_getinfo(CURL *curl_handle, curl_easy_info_t info, ...) {
             break;
         }
 
+        case CURLINFO_NUM_CONNECTS: {
+            long *connects = va_arg(args, long *);
+            *connects      = curl->num_connects;
+            break;
+        }
+
+        case CURLINFO_TOTAL_CONNECTS: {
+            long *connects = va_arg(args, long *);
+            *connects      = curl->total_connects;
+            break;
+        }
+
+        case CURLINFO_TOTAL_REUSES: {
+            long *reuses = va_arg(args, long *);
+            *reuses      = curl->total_reuses;
+            break;
+        }
+
         default: va_end(args); return CURLE_UNSUPPORTED_PROTOCOL;
     }
 
@@ -1038,6 +1182,11 @@ char const *curl_easy_strerror(CURLcode error) {
         case CURLE_HTTP_RETURNED_ERROR: return "HTTP returned error";
         case CURLE_OPERATION_TIMEDOUT: return "Operation timed out";
         case CURLE_SSL_CONNECT_ERROR: return "SSL connect error";
+        case CURLE_WRITE_ERROR: return "Failed writing received data";
+        case CURLE_OUT_OF_MEMORY: return "Out of memory";
+        case CURLE_BAD_CONTENT_ENCODING: return "Unrecognized or bad HTTP Content or Transfer-Encoding";
+        case CURLE_RANGE_ERROR: return "Requested range was not delivered by the server";
+        case CURLE_PARTIAL_FILE: return "Transferred a partial file";
         default: return "Unknown error";
     }
 }
@@ -1073,6 +1222,582 @@ void curl_slist_free_all(struct curl_slist *list) {
     }
 }
 
+static int multi_result(int ret, int want) {
+    if (ret >= 0) {
+        return ret;
+    }
+    if (ret == ESP_TLS_ERR_SSL_WANT_READ) {
+        return HTTP_MULTI_WANT_READ;
+    }
+    if (ret == ESP_TLS_ERR_SSL_WANT_WRITE) {
+        return HTTP_MULTI_WANT_WRITE;
+    }
+    if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return want;
+    }
+    return -1;
+}
+
+static void *multi_conn_open(void *ctx, http_pool_key_t const *key, void *user_data) {
+    curl_handle_t *curl = user_data;
+    multi_conn_t  *conn = dlcalloc(1, sizeof(multi_conn_t));
+    if (!conn) {
+        return NULL;
+    }
+
+    // esp-tls wants IPv6 addresses without the brackets
+    char const *host = key->host;
+    size_t      len  = strlen(host);
+    if (host[0] == '[') {
+        host++;
+        len -= 2;
+    }
+    memcpy(conn->host, host, len);
+
+    conn->port                  = key->port;
+    conn->tls_options           = curl->tls_options;
+    conn->cfg.non_block         = true;
+    conn->cfg.timeout_ms        = 1;
+    conn->cfg.is_plain_tcp      = !key->https;
+    conn->cfg.skip_common_name  = curl->config.skip_cert_common_name_check;
+    conn->cfg.crt_bundle_attach = curl->config.crt_bundle_attach;
+    if (curl->config.cert_pem) {
+        conn->cert_pem = why_strdup(curl->config.cert_pem);
+        if (!conn->cert_pem) {
+            dlfree(conn);
+            return NULL;
+        }
+        conn->cfg.cacert_buf   = (unsigned char const *)conn->cert_pem;
+        conn->cfg.cacert_bytes = strlen(conn->cert_pem) + 1;
+    }
+
+    conn->tls = esp_tls_init();
+    if (!conn->tls) {
+        dlfree(conn->cert_pem);
+        dlfree(conn);
+        return NULL;
+    }
+
+    conn->lookup = dns_service_query(conn->host, AF_UNSPEC);
+    return conn;
+}
+
+static bool multi_conn_writable(int fd) {
+    fd_set         writable;
+    struct timeval tv = {0};
+    FD_ZERO(&writable);
+    FD_SET(fd, &writable);
+    return select(fd + 1, NULL, &writable, NULL, &tv) > 0;
+}
+
+static int multi_conn_connect(void *handle) {
+    multi_conn_t *conn = handle;
+    int           fd   = -1;
+
+    if (conn->lookup) {
+        if (!dns_query_done(conn->lookup)) {
+            return HTTP_MULTI_WANT_READ;
+        }
+
+        dns_status_t status = dns_query_wait(conn->lookup, 0);
+        dns_query_release(conn->lookup);
+        conn->lookup = NULL;
+        if (status != DNS_STATUS_OK) {
+            return -1;
+        }
+    }
+
+    esp_tls_get_conn_sockfd(conn->tls, &fd);
+    if (!conn->established) {
+        esp_tls_conn_state_t state = ESP_TLS_INIT;
+        esp_tls_get_conn_state(conn->tls, &state);
+        if (state == ESP_TLS_CONNECTING && !multi_conn_writable(fd)) {
+            return HTTP_MULTI_WANT_WRITE;
+        }
+
+        task_info_t *task = get_task_info();
+        task->tls_options = &conn->tls_options;
+        int ret           = esp_tls_conn_new_async(conn->host, strlen(conn->host), conn->port, &conn->cfg, conn->tls);
+        task->tls_options = NULL;
+
+        if (ret < 0) {
+            return -1;
+        }
+        if (ret == 0) {
+            esp_tls_get_conn_state(conn->tls, &state);
+            return state == ESP_TLS_CONNECTING ? HTTP_MULTI_WANT_WRITE : HTTP_MULTI_WANT_READ;
+        }
+        conn->established = true;
+        esp_tls_get_conn_sockfd(conn->tls, &fd);
+    }
+
+    if (!multi_conn_writable(fd)) {
+        return HTTP_MULTI_WANT_WRITE;
+    }
+
+    int       error = 0;
+    socklen_t len   = sizeof(error);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) != 0 || error) {
+        return -1;
+    }
+    return 0;
+}
+
+static int multi_conn_fd(void *handle) {
+    multi_conn_t *conn = handle;
+    int           fd   = -1;
+
+    // Readable once the lookup is done, -1 without one has the multi look again right away
+    if (conn->lookup) {
+        return dns_query_fd(conn->lookup);
+    }
+    esp_tls_get_conn_sockfd(conn->tls, &fd);
+    return fd;
+}
+
+static int multi_conn_read(void *handle, void *buf, size_t len) {
+    multi_conn_t *conn = handle;
+
+    // TLS 1.3 session tickets arrive with the data
+    task_info_t *task = get_task_info();
+    task->tls_options = &conn->tls_options;
+    int ret           = esp_tls_conn_read(conn->tls, buf, len);
+    task->tls_options = NULL;
+
+    return multi_result(ret, HTTP_MULTI_WANT_READ);
+}
+
+static int multi_conn_write(void *handle, void const *buf, size_t len) {
+    multi_conn_t *conn = handle;
+    return multi_result(esp_tls_conn_write(conn->tls, buf, len), HTTP_MULTI_WANT_WRITE);
+}
+
+static void multi_conn_close(void *handle) {
+    multi_conn_t *conn = handle;
+    if (conn->lookup) {
+        dns_query_release(conn->lookup);
+    }
+    esp_tls_conn_destroy(conn->tls);
+    dlfree(conn->cert_pem);
+    dlfree(conn);
+}
+
+static http_multi_transport_t const multi_transport = {
+    .open    = multi_conn_open,
+    .connect = multi_conn_connect,
+    .fd      = multi_conn_fd,
+    .read    = multi_conn_read,
+    .write   = multi_conn_write,
+    .close   = multi_conn_close,
+};
+
+static bool multi_header(void *user_data, char const *line, size_t len) {
+    curl_handle_t *curl = user_data;
+
+    char *header = dlmalloc(len + 1);
+    if (!header) {
+        return false;
+    }
+    memcpy(header, line, len);
+    header[len] = '\0';
+
+    if (strncasecmp(header, "Set-Cookie:", 11) == 0) {
+        char const *value = header + 11;
+        while (*value == ' ' || *value == '\t') {
+            value++;
+        }
+        receive_cookie(curl, value);
+    }
+
+    if (curl->header_function) {
+        curl->header_function(header, 1, len, curl->header_data);
+    }
+    dlfree(header);
+    return true;
+}
+
+static CURLcode multi_curl_code(http_multi_result_t result) {
+    switch (result) {
+        case HTTP_MULTI_OK: return CURLE_OK;
+        case HTTP_MULTI_ERR_URL: return CURLE_URL_MALFORMAT;
+        case HTTP_MULTI_ERR_CONNECT: return CURLE_COULDNT_CONNECT;
+        case HTTP_MULTI_ERR_SEND: return CURLE_SEND_ERROR;
+        case HTTP_MULTI_ERR_RECV: return CURLE_RECV_ERROR;
+        case HTTP_MULTI_ERR_PARTIAL: return CURLE_PARTIAL_FILE;
+        case HTTP_MULTI_ERR_PROTOCOL: return CURLE_WEIRD_SERVER_REPLY;
+        case HTTP_MULTI_ERR_ENCODING: return CURLE_BAD_CONTENT_ENCODING;
+        case HTTP_MULTI_ERR_RANGE: return CURLE_RANGE_ERROR;
+        case HTTP_MULTI_ERR_TIMEOUT: return CURLE_OPERATION_TIMEDOUT;
+        case HTTP_MULTI_ERR_ABORTED: return CURLE_WRITE_ERROR;
+        case HTTP_MULTI_ERR_NO_MEM: return CURLE_OUT_OF_MEMORY;
+        default: return CURLE_HTTP_RETURNED_ERROR;
+    }
+}
+
+static void multi_done(void *user_data, http_multi_result_t result, http_multi_response_t const *response) {
+    curl_handle_t *curl = user_data;
+
+    curl->multi_result    = proxy_requested(curl) ? CURLE_UNSUPPORTED_PROTOCOL : multi_curl_code(result);
+    curl->response_code   = response->status;
+    curl->content_length  = response->content_length;
+    curl->num_connects    = response->connects;
+    curl->total_connects += response->connects;
+    if (result == HTTP_MULTI_OK && !response->connects) {
+        curl->total_reuses++;
+    }
+
+    dlfree(curl->effective_url);
+    curl->effective_url = response->url ? why_strdup(response->url) : NULL;
+
+    flush_cookie_jar(curl, false);
+}
+
+static bool append_header(char **headers, size_t *len, char const *name, char const *value) {
+    size_t add   = strlen(name) + 2 + strlen(value) + 2;
+    char  *grown = dlrealloc(*headers, *len + add + 1);
+    if (!grown) {
+        return false;
+    }
+    snprintf(grown + *len, add + 1, "%s: %s\r\n", name, value);
+    *headers  = grown;
+    *len     += add;
+    return true;
+}
+
+// The request headers the handle adds to what the multi engine sends, each line ending in CRLF
+static char *multi_request_headers(curl_handle_t *curl) {
+    char  *headers         = NULL;
+    size_t len             = 0;
+    bool   ok              = true;
+    bool   user_agent      = false;
+    bool   content_type    = false;
+    bool   accept_encoding = false;
+    char   range[64];
+
+    for (struct curl_slist *header = curl->headers; header && ok; header = header->next) {
+        char const *colon = strchr(header->data, ':');
+        if (!colon) {
+            continue;
+        }
+
+        size_t      name_len = colon - header->data;
+        char const *value    = colon + 1;
+        while (*value == ' ' || *value == '\t') {
+            value++;
+        }
+
+        char name[64];
+        if (name_len >= sizeof(name)) {
+            continue;
+        }
+        memcpy(name, header->data, name_len);
+        name[name_len] = '\0';
+
+        user_agent      |= strcasecmp(name, "User-Agent") == 0;
+        content_type    |= strcasecmp(name, "Content-Type") == 0;
+        accept_encoding |= strcasecmp(name, "Accept-Encoding") == 0;
+        ok               = append_header(&headers, &len, name, value);
+    }
+
+    if (ok && !accept_encoding && curl->accept_encoding) {
+        ok = append_header(&headers, &len, "Accept-Encoding", curl->accept_encoding);
+    }
+
+    if (ok && range_header(curl, range, sizeof(range))) {
+        ok = append_header(&headers, &len, "Range", range);
+    }
+
+    // The same default esp_http_client sends for curl_easy_perform
+    if (ok && !user_agent) {
+        char const *agent = curl->config.user_agent ? curl->config.user_agent : "ESP32 HTTP Client/1.0";
+        ok                = append_header(&headers, &len, "User-Agent", agent);
+    }
+
+    if (ok && curl->config.username && (curl->http_auth & CURLAUTH_BASIC)) {
+        char const *password = curl->config.password ? curl->config.password : "";
+        char        credentials[256];
+        char        encoded[350] = "Basic ";
+        size_t      encoded_len  = 0;
+        int credentials_len = snprintf(credentials, sizeof(credentials), "%s:%s", curl->config.username, password);
+        if (credentials_len < (int)sizeof(credentials) &&
+            mbedtls_base64_encode(
+                (unsigned char *)encoded + 6,
+                sizeof(encoded) - 6,
+                &encoded_len,
+                (unsigned char *)credentials,
+                credentials_len
+            ) == 0) {
+            ok = append_header(&headers, &len, "Authorization", encoded);
+        }
+    }
+
+    char *cookie_header = ok ? build_cookie_header(curl) : NULL;
+    if (cookie_header) {
+        ok = append_header(&headers, &len, "Cookie", cookie_header);
+        dlfree(cookie_header);
+    }
+
+    if (ok && !content_type && curl->post_data && curl->config.method == HTTP_METHOD_POST) {
+        ok = append_header(&headers, &len, "Content-Type", "application/x-www-form-urlencoded");
+    }
+
+    if (!ok) {
+        dlfree(headers);
+        return NULL;
+    }
+    return headers;
+}
+
+static char const *multi_method(esp_http_client_method_t method) {
+    switch (method) {
+        case HTTP_METHOD_POST: return "POST";
+        case HTTP_METHOD_PUT: return "PUT";
+        case HTTP_METHOD_PATCH: return "PATCH";
+        case HTTP_METHOD_DELETE: return "DELETE";
+        case HTTP_METHOD_HEAD: return "HEAD";
+        default: return "GET";
+    }
+}
+
+CURLM *curl_multi_init(void) {
+    struct curl_multi *multi = dlcalloc(1, sizeof(struct curl_multi));
+    if (!multi) {
+        return NULL;
+    }
+
+    multi->engine = http_multi_create(&multi_transport, NULL);
+    if (!multi->engine) {
+        dlfree(multi);
+        return NULL;
+    }
+
+    multi->max_total    = HTTP_MULTI_MAX_TOTAL;
+    multi->max_per_host = HTTP_MULTI_MAX_PER_HOST;
+    return multi;
+}
+
+CURLMcode curl_multi_setopt(CURLM *multi_handle, CURLMoption option, ...) {
+    struct curl_multi *multi = multi_handle;
+    if (!multi) {
+        return CURLM_BAD_HANDLE;
+    }
+
+    va_list args;
+    va_start(args, option);
+    long value = va_arg(args, long);
+    va_end(args);
+
+    switch (option) {
+        case CURLMOPT_MAX_HOST_CONNECTIONS: multi->max_per_host = value; break;
+        case CURLMOPT_MAX_TOTAL_CONNECTIONS: multi->max_total = value; break;
+        default: ESP_LOGW(TAG, "Unsupported curl multi option: %d", option); return CURLM_UNKNOWN_OPTION;
+    }
+
+    http_multi_set_limits(multi->engine, multi->max_total, multi->max_per_host);
+    return CURLM_OK;
+}
+
+CURLMcode curl_multi_add_handle(CURLM *multi_handle, CURL *curl_handle) {
+    struct curl_multi *multi = multi_handle;
+    curl_handle_t     *curl  = curl_handle;
+    if (!multi) {
+        return CURLM_BAD_HANDLE;
+    }
+    if (!curl) {
+        return CURLM_BAD_EASY_HANDLE;
+    }
+    if (curl->multi) {
+        return CURLM_ADDED_ALREADY;
+    }
+
+    char *headers = multi_request_headers(curl);
+    if (!headers) {
+        return CURLM_OUT_OF_MEMORY;
+    }
+
+    // Without a URL the engine finishes the transfer before connecting, multi_done turns that into the proxy error
+    bool                 post    = curl->post_data && curl->config.method == HTTP_METHOD_POST;
+    http_multi_request_t request = {
+        .url           = proxy_requested(curl) ? NULL : curl->config.url,
+        .method        = multi_method(curl->config.method),
+        .headers       = headers,
+        .body          = post ? curl->post_data : NULL,
+        .body_len      = post ? curl->post_data_size : 0,
+        .timeout_ms    = curl->config.timeout_ms,
+        .max_redirects = curl->config.max_redirection_count,
+        .fresh_connect = curl->fresh_connect,
+        .forbid_reuse  = curl->forbid_reuse,
+        .decode        = curl->accept_encoding != NULL,
+        .resume_from   = curl->range ? 0 : curl->resume_from,
+        .config        = config_hash(curl),
+        .user_data     = curl,
+        .header        = multi_header,
+        .data          = write_body,
+        .done          = multi_done,
+    };
+
+    bool added = http_multi_add(multi->engine, &request);
+    dlfree(headers);
+    if (!added) {
+        return CURLM_OUT_OF_MEMORY;
+    }
+
+    curl->multi        = multi;
+    curl->multi_next   = multi->handles;
+    curl->multi_result = CURLE_OK;
+    multi->handles     = curl;
+    return CURLM_OK;
+}
+
+CURLMcode curl_multi_remove_handle(CURLM *multi_handle, CURL *curl_handle) {
+    struct curl_multi *multi = multi_handle;
+    curl_handle_t     *curl  = curl_handle;
+    if (!multi) {
+        return CURLM_BAD_HANDLE;
+    }
+    if (!curl) {
+        return CURLM_BAD_EASY_HANDLE;
+    }
+    if (curl->multi != multi) {
+        return CURLM_OK;
+    }
+
+    for (curl_handle_t **link = &multi->handles; *link; link = &(*link)->multi_next) {
+        if (*link == curl) {
+            *link = curl->multi_next;
+            break;
+        }
+    }
+
+    http_multi_remove(multi->engine, curl);
+    curl->multi      = NULL;
+    curl->multi_next = NULL;
+    return CURLM_OK;
+}
+
+CURLMcode curl_multi_perform(CURLM *multi_handle, int *running_handles) {
+    struct curl_multi *multi = multi_handle;
+    if (!multi) {
+        return CURLM_BAD_HANDLE;
+    }
+
+    int running = http_multi_perform(multi->engine);
+    if (running_handles) {
+        *running_handles = running;
+    }
+    return CURLM_OK;
+}
+
+CURLMcode curl_multi_poll(
+    CURLM *multi_handle, struct curl_waitfd *extra_fds, unsigned extra_nfds, int timeout_ms, int *numfds
+) {
+    struct curl_multi *multi = multi_handle;
+    if (!multi) {
+        return CURLM_BAD_HANDLE;
+    }
+
+    http_multi_waitfd_t *extra = NULL;
+    if (extra_nfds) {
+        extra = dlmalloc(extra_nfds * sizeof(http_multi_waitfd_t));
+        if (!extra) {
+            return CURLM_OUT_OF_MEMORY;
+        }
+        for (unsigned i = 0; i < extra_nfds; i++) {
+            extra[i].fd     = extra_fds[i].fd;
+            extra[i].events = 0;
+            if (extra_fds[i].events & (CURL_WAIT_POLLIN | CURL_WAIT_POLLPRI)) {
+                extra[i].events |= HTTP_MULTI_POLL_IN;
+            }
+            if (extra_fds[i].events & CURL_WAIT_POLLOUT) {
+                extra[i].events |= HTTP_MULTI_POLL_OUT;
+            }
+        }
+    }
+
+    int ready = http_multi_poll(multi->engine, extra, extra_nfds, timeout_ms);
+
+    for (unsigned i = 0; i < extra_nfds; i++) {
+        extra_fds[i].revents = 0;
+        if (extra[i].revents & HTTP_MULTI_POLL_IN) {
+            extra_fds[i].revents |= extra_fds[i].events & (CURL_WAIT_POLLIN | CURL_WAIT_POLLPRI);
+        }
+        if (extra[i].revents & HTTP_MULTI_POLL_OUT) {
+            extra_fds[i].revents |= CURL_WAIT_POLLOUT;
+        }
+    }
+    dlfree(extra);
+
+    if (ready < 0) {
+        return CURLM_BAD_SOCKET;
+    }
+    if (numfds) {
+        *numfds = ready;
+    }
+    return CURLM_OK;
+}
+
+CURLMcode curl_multi_wait(
+    CURLM *multi_handle, struct curl_waitfd *extra_fds, unsigned extra_nfds, int timeout_ms, int *numfds
+) {
+    return curl_multi_poll(multi_handle, extra_fds, extra_nfds, timeout_ms, numfds);
+}
+
+CURLMsg *curl_multi_info_read(CURLM *multi_handle, int *msgs_in_queue) {
+    struct curl_multi  *multi = multi_handle;
+    void               *user_data;
+    http_multi_result_t result;
+    int                 left = 0;
+
+    if (!multi || !http_multi_info_read(multi->engine, &user_data, &result, &left)) {
+        if (msgs_in_queue) {
+            *msgs_in_queue = 0;
+        }
+        return NULL;
+    }
+
+    curl_handle_t *curl        = user_data;
+    multi->message.msg         = CURLMSG_DONE;
+    multi->message.easy_handle = curl;
+    multi->message.data.result = curl->multi_result;
+    if (msgs_in_queue) {
+        *msgs_in_queue = left;
+    }
+    return &multi->message;
+}
+
+CURLMcode curl_multi_cleanup(CURLM *multi_handle) {
+    struct curl_multi *multi = multi_handle;
+    if (!multi) {
+        return CURLM_BAD_HANDLE;
+    }
+
+    while (multi->handles) {
+        curl_handle_t *curl = multi->handles;
+        multi->handles      = curl->multi_next;
+        curl->multi         = NULL;
+        curl->multi_next    = NULL;
+    }
+
+    http_multi_destroy(multi->engine);
+    dlfree(multi);
+    return CURLM_OK;
+}
+
+char const *curl_multi_strerror(CURLMcode error) {
+    switch (error) {
+        case CURLM_CALL_MULTI_PERFORM: return "Please call curl_multi_perform() soon";
+        case CURLM_OK: return "No error";
+        case CURLM_BAD_HANDLE: return "Invalid multi handle";
+        case CURLM_BAD_EASY_HANDLE: return "Invalid easy handle";
+        case CURLM_OUT_OF_MEMORY: return "Out of memory";
+        case CURLM_INTERNAL_ERROR: return "Internal error";
+        case CURLM_BAD_SOCKET: return "Invalid socket argument";
+        case CURLM_UNKNOWN_OPTION: return "Unknown option";
+        case CURLM_ADDED_ALREADY: return "The easy handle is already added to a multi handle";
+        default: return "Unknown error";
+    }
+}
+
 CURLcode curl_global_init(long flags) {
     return CURLE_OK;
 }
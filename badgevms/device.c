@@ -16,57 +16,126 @@
 
 #include "badgevms/device.h"
 
+#include "badgevms_config.h"
+#include "device_private.h"
 #include "esp_log.h"
+#include "esp_system.h"
 #include "freertos/FreeRTOS.h"
-#include "hash_helper.h"
-#include "thirdparty/khash.h"
+#include "freertos/semphr.h"
 
-KHASH_MAP_INIT_STR(devtable, void *);
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    uint32_t  hash;
+    device_t *device;
+    char      name[DEVICE_NAME_MAX];
+} device_slot_t;
 
 static char const *TAG = "device";
 
-static khash_t(devtable) * device_table;
-static SemaphoreHandle_t device_table_lock = NULL;
+// Devices are registered once and never go away. Readers don't lock, they never look past table_count and a slot is
+// complete before the count includes it. Writers serialize on table_lock.
+static atomic_uint       table_count;
+static device_slot_t     table[DEVICE_TABLE_SLOTS];
+static SemaphoreHandle_t table_lock = NULL;
 
-bool device_register(char const *name, device_t *device) {
-    if (!device) {
-        return false;
+static uint32_t name_hash(char const *name) {
+    uint32_t hash = 2166136261u;
+    for (; *name; ++name) {
+        hash = (hash ^ (uint8_t)*name) * 16777619u;
     }
+    return hash;
+}
+
+static int find_slot(char const *name, uint32_t hash, unsigned int count) {
+    for (unsigned int i = 0; i < count && i < DEVICE_TABLE_SLOTS; ++i) {
+        if (table[i].hash == hash && strncmp(table[i].name, name, DEVICE_NAME_MAX) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
 
-    if (xSemaphoreTake(device_table_lock, portMAX_DELAY) != pdTRUE) {
+static void table_take(void) {
+    if (xSemaphoreTake(table_lock, portMAX_DELAY) != pdTRUE) {
         ESP_LOGE(TAG, "Failed to get device table mutex");
         abort();
     }
+}
+
+bool device_register(char const *name, device_t *device) {
+    if (!device || !name || strlen(name) >= DEVICE_NAME_MAX) {
+        return false;
+    }
 
-    khash_insert_unique_str(devtable, device_table, name, device, "The device already exists");
+    uint32_t hash = name_hash(name);
 
-    xSemaphoreGive(device_table_lock);
+    table_take();
 
+    unsigned int count = atomic_load_explicit(&table_count, memory_order_relaxed);
+    if (find_slot(name, hash, count) >= 0) {
+        ESP_LOGE(TAG, "The device already exists: %s", name);
+        xSemaphoreGive(table_lock);
+        return false;
+    }
+
+    if (count == DEVICE_TABLE_SLOTS) {
+        ESP_LOGE(TAG, "No room for device %s", name);
+        xSemaphoreGive(table_lock);
+        return false;
+    }
+
+    table[count].hash   = hash;
+    table[count].device = device;
+    strcpy(table[count].name, name);
+    atomic_store_explicit(&table_count, count + 1, memory_order_release);
+
+    xSemaphoreGive(table_lock);
     return true;
 }
 
 device_t *device_get(char const *name) {
-    if (xSemaphoreTake(device_table_lock, portMAX_DELAY) != pdTRUE) {
-        ESP_LOGE(TAG, "Failed to get device table mutex");
-        abort();
+    if (!name) {
+        return NULL;
     }
 
-    khash_get_str(device_t *, device, devtable, device_table, name, "The device does not exist");
+    unsigned int count = atomic_load_explicit(&table_count, memory_order_acquire);
+    int          i     = find_slot(name, name_hash(name), count);
+    return i >= 0 ? table[i].device : NULL;
+}
 
-    xSemaphoreGive(device_table_lock);
+void device_sync_all(void) {
+    table_take();
+
+    unsigned int count = atomic_load_explicit(&table_count, memory_order_relaxed);
+    for (unsigned int i = 0; i < count; ++i) {
+        device_t *device = table[i].device;
+        if (device->type == DEVICE_TYPE_FILESYSTEM) {
+            filesystem_device_t *fs_device = (filesystem_device_t *)device;
+            if (fs_device->_sync) {
+                fs_device->_sync(fs_device);
+            }
+        }
+    }
 
-    return device;
+    xSemaphoreGive(table_lock);
 }
 
 bool device_init() {
     ESP_LOGI(TAG, "Initializing");
 
-    device_table      = kh_init(devtable);
-    device_table_lock = xSemaphoreCreateMutex();
-    if (!device_table_lock) {
-        ESP_LOGE(TAG, "Failed to create device_table_lock");
+    table_lock = xSemaphoreCreateMutex();
+    if (!table_lock) {
+        ESP_LOGE(TAG, "Failed to create table_lock");
         return false;
     }
 
+    if (esp_register_shutdown_handler(device_sync_all) != ESP_OK) {
+        ESP_LOGW(TAG, "Unable to register the shutdown handler, filesystems will not be synced on restart");
+    }
+
     return true;
 }
@@ -20,3 +20,6 @@
 
 bool device_register(char const *name, device_t *device);
 bool device_init();
+
+// Commits every filesystem, also runs from esp_restart()
+void device_sync_all(void);
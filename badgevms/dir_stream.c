@@ -0,0 +1,227 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "dir_stream.h"
+
+#include "badgevms/device.h"
+#include "badgevms_config.h"
+#include "esp_log.h"
+#include "logical_names.h"
+#include "pathfuncs_private.h"
+#include "stat_cache.h"
+#include "why_io.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <sys/errno.h>
+#include <sys/stat.h>
+
+#define TAG "dir_stream"
+
+struct dir_stream {
+    char                *name;
+    size_t               member_count;
+    size_t               member;
+    filesystem_device_t *device;
+    DIR                 *device_dir;
+    long                 position;
+    struct dirent        dirent;
+    uint8_t              shadow_filter[DIR_SHADOW_FILTER_BITS / 8];
+};
+
+static uint32_t name_hash(char const *name) {
+    uint32_t hash = 0x811c9dc5;
+    while (*name) {
+        hash = (hash ^ (uint8_t)*name++) * 0x01000193;
+    }
+    return hash;
+}
+
+// Three probes derived from one hash, returns whether all of them were already set
+static bool shadow_filter_add(dir_stream_t *stream, uint32_t hash) {
+    uint32_t step    = (hash >> 16) | 1;
+    bool     present = true;
+
+    for (int i = 0; i < 3; i++) {
+        uint32_t bit  = (hash + i * step) % DIR_SHADOW_FILTER_BITS;
+        uint8_t  mask = 1 << (bit & 7);
+        if (!(stream->shadow_filter[bit / 8] & mask)) {
+            stream->shadow_filter[bit / 8] |= mask;
+            present                         = false;
+        }
+    }
+
+    return present;
+}
+
+static filesystem_device_t *member_device(char const *member_path, path_t *path) {
+    if (parse_path(member_path, path) != PATH_PARSE_OK) {
+        return NULL;
+    }
+
+    device_t *device = device_get(path->device);
+    if (!device || device->type != DEVICE_TYPE_FILESYSTEM) {
+        return NULL;
+    }
+
+    return (filesystem_device_t *)device;
+}
+
+static bool member_has_entry(dir_stream_t *stream, size_t member, char const *entry_name) {
+    logical_name_result_t lname  = logical_name_resolve_const(stream->name, member);
+    bool                  found  = false;
+    path_t                path;
+    filesystem_device_t  *device = member_device(lname.result, &path);
+
+    if (device && path_set_filename(&path, entry_name) == PATH_PARSE_OK) {
+        struct stat st;
+        found = stat_cache_stat(device, &path, &st) == 0;
+    }
+
+    logical_name_result_free(lname);
+    return found;
+}
+
+static bool member_open(dir_stream_t *stream) {
+    logical_name_result_t lname  = logical_name_resolve_const(stream->name, stream->member);
+    path_t                path;
+    filesystem_device_t  *device = member_device(lname.result, &path);
+
+    if (device && device->_opendir && device->_readdir && device->_closedir) {
+        stream->device_dir = device->_opendir(device, &path);
+    }
+
+    if (stream->device_dir) {
+        ESP_LOGD(TAG, "Reading %s from %s", stream->name, lname.result);
+        stream->device = device;
+    }
+
+    logical_name_result_free(lname);
+    return stream->device_dir != NULL;
+}
+
+static void member_close(dir_stream_t *stream) {
+    if (stream->device_dir) {
+        stream->device->_closedir(stream->device, stream->device_dir);
+        stream->device_dir = NULL;
+        stream->device     = NULL;
+    }
+}
+
+dir_stream_t *dir_stream_open(char const *name, int *err) {
+    dir_stream_t *stream = why_calloc(1, sizeof(dir_stream_t));
+    if (!stream) {
+        *err = ENOMEM;
+        return NULL;
+    }
+
+    stream->name = why_strdup(name);
+    if (!stream->name) {
+        why_free(stream);
+        *err = ENOMEM;
+        return NULL;
+    }
+
+    logical_name_result_t lname = logical_name_resolve_const(name, 0);
+    stream->member_count        = lname.result_count;
+    logical_name_result_free(lname);
+
+    // Only the first readable member is opened now, the rest when the stream gets to them
+    for (; stream->member < stream->member_count; stream->member++) {
+        if (member_open(stream)) {
+            return stream;
+        }
+    }
+
+    ESP_LOGI(TAG, "No readable directories found for %s", name);
+    why_free(stream->name);
+    why_free(stream);
+    *err = ENOENT;
+    return NULL;
+}
+
+struct dirent *dir_stream_read(dir_stream_t *stream) {
+    while (stream->member < stream->member_count) {
+        if (!stream->device_dir && !member_open(stream)) {
+            stream->member++;
+            continue;
+        }
+
+        struct dirent *entry = stream->device->_readdir(stream->device, stream->device_dir);
+        if (!entry) {
+            member_close(stream);
+            stream->member++;
+            continue;
+        }
+
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+
+        // Every name goes into the filter, a name that was (probably) seen before is only skipped if an earlier
+        // member really has it
+        if (stream->member_count > 1) {
+            bool maybe_seen = shadow_filter_add(stream, name_hash(entry->d_name));
+            if (maybe_seen && stream->member > 0) {
+                bool shadowed = false;
+                for (size_t i = 0; i < stream->member && !shadowed; i++) {
+                    shadowed = member_has_entry(stream, i, entry->d_name);
+                }
+                if (shadowed) {
+                    continue;
+                }
+            }
+        }
+
+        memcpy(&stream->dirent, entry, sizeof(struct dirent));
+        stream->position++;
+        return &stream->dirent;
+    }
+
+    return NULL;
+}
+
+void dir_stream_close(dir_stream_t *stream) {
+    member_close(stream);
+    why_free(stream->name);
+    why_free(stream);
+}
+
+void dir_stream_abort(dir_stream_t *stream) {
+    member_close(stream);
+}
+
+void dir_stream_rewind(dir_stream_t *stream) {
+    member_close(stream);
+    stream->member   = 0;
+    stream->position = 0;
+    memset(stream->shadow_filter, 0, sizeof(stream->shadow_filter));
+}
+
+long dir_stream_tell(dir_stream_t *stream) {
+    return stream->position;
+}
+
+void dir_stream_seek(dir_stream_t *stream, long loc) {
+    if (loc < stream->position) {
+        dir_stream_rewind(stream);
+    }
+
+    while (stream->position < loc && dir_stream_read(stream)) {
+    }
+}
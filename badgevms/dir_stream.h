@@ -0,0 +1,36 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <dirent.h>
+
+// A directory read through every member of its search list, one member at a time. Names that already exist in an
+// earlier member are shadowed and skipped.
+typedef struct dir_stream dir_stream_t;
+
+// Returns NULL and sets *err if none of the members could be opened
+dir_stream_t  *dir_stream_open(char const *name, int *err);
+struct dirent *dir_stream_read(dir_stream_t *stream);
+void           dir_stream_close(dir_stream_t *stream);
+
+// Closes the member directory a dead process left open, the stream itself goes with the process's memory
+void dir_stream_abort(dir_stream_t *stream);
+
+// Positions count the entries returned since the last rewind, seeking backwards reads the directory again up to loc
+void dir_stream_rewind(dir_stream_t *stream);
+long dir_stream_tell(dir_stream_t *stream);
+void dir_stream_seek(dir_stream_t *stream, long loc);
@@ -0,0 +1,973 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "dns_resolver.h"
+
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_random.h"
+#include "esp_timer.h"
+#include "esp_vfs_eventfd.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <netinet/in.h>
+#include <sys/poll.h>
+
+static char const *TAG = "dns_resolver";
+
+#define DNS_HEADER_BYTES 12
+#define DNS_PACKET_MAX   512
+
+#define DNS_TYPE_A     1
+#define DNS_TYPE_CNAME 5
+#define DNS_TYPE_SOA   6
+#define DNS_TYPE_AAAA  28
+#define DNS_CLASS_IN   1
+
+#define DNS_FLAG_QR      0x8000
+#define DNS_FLAG_TC      0x0200
+#define DNS_FLAG_RD      0x0100
+#define DNS_RCODE(flags) ((flags) & 0xf)
+#define DNS_NOERROR      0
+#define DNS_NXDOMAIN     3
+
+#define CNAME_CHAIN_MAX   8
+#define NAME_POINTERS_MAX 16
+
+// Without an eventfd the resolver task looks for new lookups this often
+#define KICK_FALLBACK_MS 10
+
+enum {
+    V4,
+    V6,
+    FAMILIES,
+};
+
+static sa_family_t const family_af[FAMILIES]   = {AF_INET, AF_INET6};
+static uint16_t const    family_type[FAMILIES] = {DNS_TYPE_A, DNS_TYPE_AAAA};
+static uint8_t const     family_len[FAMILIES]  = {4, 16};
+
+typedef enum {
+    ANSWER_NONE,
+    ANSWER_ADDRESSES,
+    ANSWER_NEGATIVE, // The name or the addresses of the family don't exist
+    ANSWER_FAILED,   // No usable answer from any server
+} answer_state_t;
+
+typedef struct {
+    answer_state_t state;
+    uint8_t        count;
+    uint8_t        addr[DNS_ADDRESSES_MAX][16];
+} answer_t;
+
+typedef struct {
+    uint32_t hash; // 0 for a free entry
+    uint32_t last_used;
+    char     name[DNS_NAME_MAX + 1];
+    answer_t answers[FAMILIES];
+    int64_t  expires[FAMILIES];
+} cache_entry_t;
+
+struct dns_query {
+    dns_query_t    *next;
+    dns_resolver_t *resolver;
+    int             refs;
+    char            name[DNS_NAME_MAX + 1];
+    int             family;
+    bool            wanted[FAMILIES];
+    bool            asking[FAMILIES];
+    uint16_t        ids[FAMILIES];
+    answer_t        answers[FAMILIES];
+
+    struct sockaddr_storage servers[DNS_SERVERS_MAX];
+    size_t                  num_servers;
+    bool                    started;
+    bool                    timed_out;
+    int                     sock;
+    sa_family_t             sock_family;
+    int                     attempt;
+    int64_t                 retry_at;
+    int64_t                 finish_at;
+
+    atomic_bool       done;
+    dns_result_t      result;
+    int               done_fd;
+    SemaphoreHandle_t done_sem;
+};
+
+struct dns_resolver {
+    SemaphoreHandle_t  lock;
+    dns_resolver_ops_t ops;
+    void              *ctx;
+    int                kick_fd;
+    atomic_bool        stop;
+    dns_query_t       *queries; // In flight or finished and waiting for late answers, each holds a reference
+    cache_entry_t     *cache;
+    uint32_t           clock;
+    dns_stats_t        stats;
+
+    // Only used by the resolver task
+    uint8_t       packet[DNS_PACKET_MAX];
+    char          owner[DNS_NAME_MAX + 1];
+    char          target[DNS_NAME_MAX + 1];
+    struct pollfd fds[DNS_QUERIES_MAX + 1];
+    dns_query_t  *polled[DNS_QUERIES_MAX];
+};
+
+static uint16_t get16(uint8_t const *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static uint32_t get32(uint8_t const *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static uint8_t *put16(uint8_t *p, uint16_t value) {
+    p[0] = value >> 8;
+    p[1] = value & 0xff;
+    return p + 2;
+}
+
+static uint32_t name_hash(char const *name) {
+    uint32_t hash = 2166136261u;
+    for (; *name; name++) {
+        hash = (hash ^ (uint8_t)*name) * 16777619u;
+    }
+    return hash ? hash : 1;
+}
+
+// Lowercases name without the trailing dot, false unless it is made of labels of 1 to 63 characters
+static bool normalize_name(char const *name, char *out) {
+    size_t len = strlen(name);
+    if (len && name[len - 1] == '.') {
+        len--;
+    }
+    if (!len || len > DNS_NAME_MAX) {
+        return false;
+    }
+
+    size_t label = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (name[i] == '.') {
+            if (!label) {
+                return false;
+            }
+            label = 0;
+        } else if (++label > 63) {
+            return false;
+        }
+        out[i] = tolower((unsigned char)name[i]);
+    }
+    out[len] = '\0';
+    return label != 0;
+}
+
+static cache_entry_t *cache_find(dns_resolver_t *resolver, char const *name, uint32_t hash) {
+    for (int i = 0; i < DNS_CACHE_ENTRIES; i++) {
+        cache_entry_t *entry = &resolver->cache[i];
+        if (entry->hash == hash && strcmp(entry->name, name) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static bool cache_get(dns_resolver_t *resolver, char const *name, int f, answer_t *answer, int64_t now) {
+    cache_entry_t *entry = cache_find(resolver, name, name_hash(name));
+    if (!entry || entry->answers[f].state == ANSWER_NONE || entry->expires[f] <= now) {
+        return false;
+    }
+
+    entry->last_used = ++resolver->clock;
+    *answer          = entry->answers[f];
+    return true;
+}
+
+static void cache_put(dns_resolver_t *resolver, char const *name, int f, answer_t const *answer, int64_t expires) {
+    uint32_t       hash  = name_hash(name);
+    cache_entry_t *entry = cache_find(resolver, name, hash);
+
+    if (!entry) {
+        // A free entry, one whose answers all expired or else the least recently used
+        cache_entry_t *victim = NULL;
+        int64_t        now    = esp_timer_get_time();
+        for (int i = 0; i < DNS_CACHE_ENTRIES && !entry; i++) {
+            cache_entry_t *candidate = &resolver->cache[i];
+            if (!candidate->hash || (candidate->expires[V4] <= now && candidate->expires[V6] <= now)) {
+                entry = candidate;
+            } else if (!victim || candidate->last_used < victim->last_used) {
+                victim = candidate;
+            }
+        }
+        if (!entry) {
+            entry = victim;
+            resolver->stats.evictions++;
+        }
+
+        memset(entry, 0, sizeof(cache_entry_t));
+        entry->hash = hash;
+        strcpy(entry->name, name);
+    }
+
+    entry->answers[f] = *answer;
+    entry->expires[f] = expires;
+    entry->last_used  = ++resolver->clock;
+}
+
+static void build_result(answer_t const *answers, bool const *wanted, bool timed_out, dns_result_t *result) {
+    result->count = 0;
+
+    // IPv6 first, then taking turns, so a client connecting to them in order tries both families early on
+    for (int n = 0; n < DNS_ADDRESSES_MAX; n++) {
+        for (int f = FAMILIES - 1; f >= 0; f--) {
+            if (wanted[f] && answers[f].state == ANSWER_ADDRESSES && n < answers[f].count) {
+                dns_address_t *address = &result->addresses[result->count++];
+                memset(address, 0, sizeof(dns_address_t));
+                address->family = family_af[f];
+                memcpy(address->addr, answers[f].addr[n], family_len[f]);
+            }
+        }
+    }
+
+    bool failed = false;
+    for (int f = 0; f < FAMILIES; f++) {
+        if (wanted[f] && answers[f].state != ANSWER_NEGATIVE && answers[f].state != ANSWER_ADDRESSES) {
+            failed = true;
+        }
+    }
+
+    if (result->count) {
+        result->status = DNS_STATUS_OK;
+    } else if (!failed) {
+        result->status = DNS_STATUS_NOT_FOUND;
+    } else {
+        result->status = timed_out ? DNS_STATUS_TIMEOUT : DNS_STATUS_FAILED;
+    }
+}
+
+// Called with the lock held
+static void finish(dns_query_t *query, dns_status_t status) {
+    if (atomic_load(&query->done)) {
+        return;
+    }
+
+    build_result(query->answers, query->wanted, query->timed_out, &query->result);
+    if (status != DNS_STATUS_OK) {
+        query->result.status = status;
+    }
+    atomic_store(&query->done, true);
+
+    if (query->done_fd >= 0) {
+        uint64_t one = 1;
+        write(query->done_fd, &one, sizeof(one));
+    }
+    xSemaphoreGive(query->done_sem);
+}
+
+static bool asking_any(dns_query_t const *query) {
+    return query->asking[V4] || query->asking[V6];
+}
+
+static void check_finished(dns_query_t *query, int64_t now) {
+    if (!asking_any(query)) {
+        finish(query, DNS_STATUS_OK);
+        return;
+    }
+
+    // One family's addresses are in, the other gets a moment to follow before the lookup is done without them
+    for (int f = 0; f < FAMILIES; f++) {
+        if (!query->asking[f] && query->answers[f].state == ANSWER_ADDRESSES && !query->finish_at) {
+            query->finish_at = now + DNS_RESOLUTION_DELAY_MS * 1000LL;
+        }
+    }
+}
+
+static void free_query(dns_query_t *query) {
+    if (query->done_fd >= 0) {
+        close(query->done_fd);
+    }
+    vSemaphoreDelete(query->done_sem);
+    free(query);
+}
+
+// Called with the lock held, returns true if the query has to be freed
+static bool unref(dns_query_t *query) {
+    return --query->refs == 0;
+}
+
+static size_t build_query(uint8_t *packet, uint16_t id, char const *name, uint16_t type) {
+    uint8_t *p = packet;
+
+    p = put16(p, id);
+    p = put16(p, DNS_FLAG_RD);
+    p = put16(p, 1);
+    p = put16(p, 0);
+    p = put16(p, 0);
+    p = put16(p, 0);
+
+    while (*name) {
+        char const *dot = strchr(name, '.');
+        size_t      len = dot ? (size_t)(dot - name) : strlen(name);
+
+        *p++ = len;
+        memcpy(p, name, len);
+        p    += len;
+        name += dot ? len + 1 : len;
+    }
+    *p++ = 0;
+
+    p = put16(p, type);
+    p = put16(p, DNS_CLASS_IN);
+    return p - packet;
+}
+
+static socklen_t address_len(struct sockaddr_storage const *address) {
+    return address->ss_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+}
+
+static bool same_address(struct sockaddr_storage const *a, struct sockaddr_storage const *b) {
+    if (a->ss_family != b->ss_family) {
+        return false;
+    }
+
+    if (a->ss_family == AF_INET) {
+        struct sockaddr_in const *a4 = (struct sockaddr_in const *)a;
+        struct sockaddr_in const *b4 = (struct sockaddr_in const *)b;
+        return a4->sin_port == b4->sin_port && a4->sin_addr.s_addr == b4->sin_addr.s_addr;
+    }
+
+    struct sockaddr_in6 const *a6 = (struct sockaddr_in6 const *)a;
+    struct sockaddr_in6 const *b6 = (struct sockaddr_in6 const *)b;
+    return a6->sin6_port == b6->sin6_port && memcmp(&a6->sin6_addr, &b6->sin6_addr, sizeof(a6->sin6_addr)) == 0;
+}
+
+static void give_up(dns_resolver_t *resolver, dns_query_t *query, int64_t now) {
+    for (int f = 0; f < FAMILIES; f++) {
+        if (query->asking[f]) {
+            query->asking[f]        = false;
+            query->answers[f].state = ANSWER_FAILED;
+        }
+    }
+    query->timed_out = true;
+    resolver->stats.timeouts++;
+    check_finished(query, now);
+}
+
+// Sends the questions still open to the next server
+static void send_round(dns_resolver_t *resolver, dns_query_t *query, int64_t now) {
+    if (query->attempt >= DNS_QUERY_ATTEMPTS) {
+        give_up(resolver, query, now);
+        return;
+    }
+
+    struct sockaddr_storage const *server = &query->servers[query->attempt % query->num_servers];
+    query->attempt++;
+    query->retry_at = now + DNS_QUERY_RETRY_MS * 1000LL;
+
+    if (query->sock >= 0 && query->sock_family != server->ss_family) {
+        close(query->sock);
+        query->sock = -1;
+    }
+
+    if (query->sock < 0) {
+        query->sock = socket(server->ss_family, SOCK_DGRAM, 0);
+        if (query->sock < 0) {
+            ESP_LOGW(TAG, "Unable to create a socket for %s: %d", query->name, errno);
+            return;
+        }
+        fcntl(query->sock, F_SETFL, O_NONBLOCK);
+        query->sock_family = server->ss_family;
+    }
+
+    for (int f = 0; f < FAMILIES; f++) {
+        if (query->asking[f]) {
+            size_t len = build_query(resolver->packet, query->ids[f], query->name, family_type[f]);
+            sendto(query->sock, resolver->packet, len, 0, (struct sockaddr const *)server, address_len(server));
+            resolver->stats.queries++;
+        }
+    }
+}
+
+// Decodes the name at *pos, following compression pointers, and moves *pos past it
+static bool read_name(uint8_t const *msg, size_t len, size_t *pos, char *out) {
+    size_t p        = *pos;
+    size_t out_len  = 0;
+    int    pointers = 0;
+    bool   jumped   = false;
+
+    while (true) {
+        if (p >= len) {
+            return false;
+        }
+
+        uint8_t c = msg[p];
+        if ((c & 0xc0) == 0xc0) {
+            if (p + 1 >= len || ++pointers > NAME_POINTERS_MAX) {
+                return false;
+            }
+            if (!jumped) {
+                *pos = p + 2;
+            }
+            jumped = true;
+            p      = (c & 0x3f) << 8 | msg[p + 1];
+            continue;
+        }
+
+        if (c & 0xc0) {
+            return false;
+        }
+
+        if (!c) {
+            if (!jumped) {
+                *pos = p + 1;
+            }
+            out[out_len] = '\0';
+            return true;
+        }
+
+        if (p + 1 + c > len || out_len + (out_len ? 1 : 0) + c > DNS_NAME_MAX) {
+            return false;
+        }
+        if (out_len) {
+            out[out_len++] = '.';
+        }
+        for (int i = 0; i < c; i++) {
+            out[out_len++] = tolower(msg[p + 1 + i]);
+        }
+        p += 1 + c;
+    }
+}
+
+typedef struct {
+    uint16_t type;
+    uint16_t class;
+    uint32_t ttl;
+    size_t   rdata;
+    uint16_t rdlength;
+} record_t;
+
+// Reads the owner into resolver->owner and the fixed fields of the record at *pos, and moves *pos past it
+static bool read_record(dns_resolver_t *resolver, size_t len, size_t *pos, record_t *record) {
+    uint8_t const *msg = resolver->packet;
+
+    if (!read_name(msg, len, pos, resolver->owner) || *pos + 10 > len) {
+        return false;
+    }
+
+    record->type     = get16(msg + *pos);
+    record->class    = get16(msg + *pos + 2);
+    record->ttl      = get32(msg + *pos + 4);
+    record->rdlength = get16(msg + *pos + 8);
+    record->rdata    = *pos + 10;
+
+    // RFC 2181, TTLs with the top bit set count as 0
+    if (record->ttl & 0x80000000u) {
+        record->ttl = 0;
+    }
+
+    if (record->rdata + record->rdlength > len) {
+        return false;
+    }
+    *pos = record->rdata + record->rdlength;
+    return true;
+}
+
+// Follows the CNAME chain from the name asked for and takes the addresses of the name it ends at. *pos moves past the
+// answer section.
+static bool read_answers(
+    dns_resolver_t *resolver, dns_query_t *query, size_t len, size_t *pos, uint16_t count, int f, answer_t *answer,
+    uint32_t *ttl
+) {
+    uint8_t const *msg   = resolver->packet;
+    size_t         start = *pos;
+    record_t       record;
+    char           alias[DNS_NAME_MAX + 1];
+
+    strcpy(resolver->target, query->name);
+    for (int hop = 0; hop < CNAME_CHAIN_MAX; hop++) {
+        bool followed = false;
+
+        *pos = start;
+        for (uint16_t i = 0; i < count; i++) {
+            if (!read_record(resolver, len, pos, &record)) {
+                return false;
+            }
+
+            if (record.type == DNS_TYPE_CNAME && record.class == DNS_CLASS_IN &&
+                strcmp(resolver->owner, resolver->target) == 0) {
+                size_t rdata = record.rdata;
+                if (!read_name(msg, len, &rdata, alias)) {
+                    return false;
+                }
+                strcpy(resolver->target, alias);
+                *ttl     = record.ttl < *ttl ? record.ttl : *ttl;
+                followed = true;
+            }
+        }
+
+        if (!followed) {
+            break;
+        }
+    }
+
+    *pos = start;
+    for (uint16_t i = 0; i < count; i++) {
+        if (!read_record(resolver, len, pos, &record)) {
+            return false;
+        }
+
+        if (record.type == family_type[f] && record.class == DNS_CLASS_IN && record.rdlength == family_len[f] &&
+            strcmp(resolver->owner, resolver->target) == 0 && answer->count < DNS_ADDRESSES_MAX) {
+            memcpy(answer->addr[answer->count++], msg + record.rdata, family_len[f]);
+            *ttl = record.ttl < *ttl ? record.ttl : *ttl;
+        }
+    }
+
+    return true;
+}
+
+// RFC 2308, a negative answer may be kept for the TTL of the SOA record that comes with it or its minimum field,
+// whichever is lower. Without one it is not kept at all.
+static uint32_t negative_ttl(dns_resolver_t *resolver, size_t len, size_t pos, uint16_t count) {
+    uint8_t const *msg = resolver->packet;
+    record_t       record;
+
+    for (uint16_t i = 0; i < count; i++) {
+        if (!read_record(resolver, len, &pos, &record)) {
+            return 0;
+        }
+
+        if (record.type == DNS_TYPE_SOA && record.class == DNS_CLASS_IN) {
+            size_t rdata = record.rdata;
+            if (!read_name(msg, len, &rdata, resolver->target) || !read_name(msg, len, &rdata, resolver->target) ||
+                rdata + 20 > record.rdata + record.rdlength) {
+                return 0;
+            }
+
+            uint32_t minimum = get32(msg + rdata + 16);
+            uint32_t ttl     = minimum < record.ttl ? minimum : record.ttl;
+            return ttl < DNS_NEGATIVE_MAX_TTL_S ? ttl : DNS_NEGATIVE_MAX_TTL_S;
+        }
+    }
+    return 0;
+}
+
+static void store_answer(dns_resolver_t *resolver, dns_query_t *query, int f, answer_t const *answer, uint32_t ttl) {
+    query->asking[f]  = false;
+    query->answers[f] = *answer;
+
+    if (answer->state == ANSWER_ADDRESSES) {
+        ttl = ttl < DNS_CACHE_MIN_TTL_S ? DNS_CACHE_MIN_TTL_S : ttl;
+        ttl = ttl > DNS_CACHE_MAX_TTL_S ? DNS_CACHE_MAX_TTL_S : ttl;
+    }
+    if (ttl) {
+        cache_put(resolver, query->name, f, answer, esp_timer_get_time() + ttl * 1000000LL);
+    }
+}
+
+// Called with the lock held
+static void handle_response(dns_resolver_t *resolver, dns_query_t *query, size_t len, int64_t now) {
+    uint8_t const *msg = resolver->packet;
+
+    if (len < DNS_HEADER_BYTES) {
+        return;
+    }
+
+    uint16_t id    = get16(msg);
+    uint16_t flags = get16(msg + 2);
+    if (!(flags & DNS_FLAG_QR) || get16(msg + 4) != 1) {
+        return;
+    }
+
+    int f = query->asking[V4] && query->ids[V4] == id ? V4 : query->asking[V6] && query->ids[V6] == id ? V6 : -1;
+    if (f < 0) {
+        return;
+    }
+
+    size_t pos = DNS_HEADER_BYTES;
+    if (!read_name(msg, len, &pos, resolver->owner) || strcmp(resolver->owner, query->name) != 0 || pos + 4 > len ||
+        get16(msg + pos) != family_type[f] || get16(msg + pos + 2) != DNS_CLASS_IN) {
+        return;
+    }
+    pos += 4;
+
+    uint8_t rcode = DNS_RCODE(flags);
+    if ((flags & DNS_FLAG_TC) || (rcode != DNS_NOERROR && rcode != DNS_NXDOMAIN)) {
+        // Ask the next server right away
+        query->retry_at = now;
+        return;
+    }
+
+    answer_t answer = {.state = ANSWER_NEGATIVE};
+    uint32_t ttl    = UINT32_MAX;
+    if (!read_answers(resolver, query, len, &pos, get16(msg + 6), f, &answer, &ttl)) {
+        return;
+    }
+
+    if (answer.count) {
+        answer.state = ANSWER_ADDRESSES;
+        store_answer(resolver, query, f, &answer, ttl);
+    } else {
+        ttl = negative_ttl(resolver, len, pos, get16(msg + 8));
+        store_answer(resolver, query, f, &answer, ttl);
+
+        // A name that doesn't exist has no addresses of the other family either
+        if (rcode == DNS_NXDOMAIN) {
+            for (int other = 0; other < FAMILIES; other++) {
+                if (query->asking[other]) {
+                    store_answer(resolver, query, other, &answer, ttl);
+                }
+            }
+        }
+    }
+
+    check_finished(query, now);
+}
+
+static void receive(dns_resolver_t *resolver, dns_query_t *query) {
+    while (true) {
+        struct sockaddr_storage from;
+        socklen_t               from_len = sizeof(from);
+        ssize_t len = recvfrom(query->sock, resolver->packet, DNS_PACKET_MAX, 0, (struct sockaddr *)&from, &from_len);
+        if (len < 0) {
+            return;
+        }
+
+        bool from_server = false;
+        for (size_t i = 0; i < query->num_servers; i++) {
+            from_server |= same_address(&from, &query->servers[i]);
+        }
+        if (!from_server) {
+            continue;
+        }
+
+        xSemaphoreTake(resolver->lock, portMAX_DELAY);
+        handle_response(resolver, query, len, esp_timer_get_time());
+        xSemaphoreGive(resolver->lock);
+    }
+}
+
+static void kick(dns_resolver_t *resolver) {
+    if (resolver->kick_fd >= 0) {
+        uint64_t one = 1;
+        write(resolver->kick_fd, &one, sizeof(one));
+    }
+}
+
+dns_resolver_t *dns_resolver_create(dns_resolver_ops_t const *ops, void *ctx) {
+    dns_resolver_t *resolver = calloc(1, sizeof(dns_resolver_t));
+    if (!resolver) {
+        ESP_LOGE(TAG, "Unable to allocate the resolver");
+        return NULL;
+    }
+
+    resolver->cache = heap_caps_malloc(sizeof(cache_entry_t) * DNS_CACHE_ENTRIES, MALLOC_CAP_SPIRAM);
+    resolver->lock  = xSemaphoreCreateMutex();
+    if (!resolver->cache || !resolver->lock) {
+        ESP_LOGE(TAG, "Unable to allocate the cache");
+        if (resolver->lock) {
+            vSemaphoreDelete(resolver->lock);
+        }
+        heap_caps_free(resolver->cache);
+        free(resolver);
+        return NULL;
+    }
+
+    memset(resolver->cache, 0, sizeof(cache_entry_t) * DNS_CACHE_ENTRIES);
+    resolver->ops     = *ops;
+    resolver->ctx     = ctx;
+    resolver->kick_fd = eventfd(0, 0);
+    atomic_store(&resolver->stop, false);
+    return resolver;
+}
+
+void dns_resolver_destroy(dns_resolver_t *resolver) {
+    while (resolver->queries) {
+        dns_query_t *query = resolver->queries;
+        resolver->queries  = query->next;
+
+        if (query->sock >= 0) {
+            close(query->sock);
+            query->sock = -1;
+        }
+        finish(query, DNS_STATUS_FAILED);
+        if (unref(query)) {
+            free_query(query);
+        }
+    }
+
+    if (resolver->kick_fd >= 0) {
+        close(resolver->kick_fd);
+    }
+    vSemaphoreDelete(resolver->lock);
+    heap_caps_free(resolver->cache);
+    free(resolver);
+}
+
+void dns_resolver_stop(dns_resolver_t *resolver) {
+    atomic_store(&resolver->stop, true);
+    kick(resolver);
+}
+
+void dns_resolver_run(dns_resolver_t *resolver) {
+    while (!atomic_load(&resolver->stop)) {
+        int64_t now     = esp_timer_get_time();
+        int64_t wake_at = INT64_MAX;
+        int     running = 0;
+        size_t  count   = 0;
+
+        xSemaphoreTake(resolver->lock, portMAX_DELAY);
+        dns_query_t **link = &resolver->queries;
+        while (*link) {
+            dns_query_t *query = *link;
+
+            if (!query->started && running < DNS_QUERIES_MAX) {
+                query->started = true;
+                send_round(resolver, query, now);
+            } else if (query->started && asking_any(query) && query->retry_at <= now) {
+                send_round(resolver, query, now);
+            }
+
+            if (query->finish_at && query->finish_at <= now) {
+                finish(query, DNS_STATUS_OK);
+            }
+
+            if (query->started && !asking_any(query)) {
+                *link = query->next;
+                if (query->sock >= 0) {
+                    close(query->sock);
+                }
+                if (unref(query)) {
+                    free_query(query);
+                }
+                continue;
+            }
+
+            if (query->started) {
+                running++;
+                if (query->sock >= 0 && count < DNS_QUERIES_MAX) {
+                    resolver->fds[count + 1] = (struct pollfd){.fd = query->sock, .events = POLLIN};
+                    resolver->polled[count]  = query;
+                    count++;
+                }
+                wake_at = query->retry_at < wake_at ? query->retry_at : wake_at;
+                if (query->finish_at && !atomic_load(&query->done) && query->finish_at < wake_at) {
+                    wake_at = query->finish_at;
+                }
+            }
+            link = &query->next;
+        }
+        xSemaphoreGive(resolver->lock);
+
+        int timeout = wake_at == INT64_MAX ? -1 : (int)((wake_at - now + 999) / 1000);
+        if (resolver->kick_fd < 0 && (timeout < 0 || timeout > KICK_FALLBACK_MS)) {
+            timeout = KICK_FALLBACK_MS;
+        }
+
+        resolver->fds[0] = (struct pollfd){.fd = resolver->kick_fd, .events = POLLIN};
+        if (poll(resolver->fds, count + 1, timeout) <= 0) {
+            continue;
+        }
+
+        if (resolver->fds[0].revents & POLLIN) {
+            uint64_t kicks;
+            read(resolver->kick_fd, &kicks, sizeof(kicks));
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            if (resolver->fds[i + 1].revents & POLLIN) {
+                receive(resolver, resolver->polled[i]);
+            }
+        }
+    }
+}
+
+// Called with the lock held, true if every family wanted was in the cache
+static bool from_cache(dns_resolver_t *resolver, dns_query_t *query, int64_t now) {
+    bool all = true;
+    for (int f = 0; f < FAMILIES; f++) {
+        if (query->wanted[f] && !cache_get(resolver, query->name, f, &query->answers[f], now)) {
+            all = false;
+        }
+    }
+    return all;
+}
+
+static void set_wanted(dns_resolver_t *resolver, int family, bool *wanted) {
+    wanted[V4] = family != AF_INET6;
+    wanted[V6] = family == AF_INET6 || (family == AF_UNSPEC && resolver->ops.ipv6_usable(resolver->ctx));
+}
+
+bool dns_resolver_cached(dns_resolver_t *resolver, char const *name, int family, dns_result_t *result) {
+    dns_query_t query = {0};
+
+    if ((family != AF_UNSPEC && family != AF_INET && family != AF_INET6) || !normalize_name(name, query.name)) {
+        return false;
+    }
+    set_wanted(resolver, family, query.wanted);
+
+    xSemaphoreTake(resolver->lock, portMAX_DELAY);
+    bool cached = from_cache(resolver, &query, esp_timer_get_time());
+    xSemaphoreGive(resolver->lock);
+
+    if (cached) {
+        build_result(query.answers, query.wanted, false, result);
+    }
+    return cached;
+}
+
+void dns_resolver_flush(dns_resolver_t *resolver) {
+    xSemaphoreTake(resolver->lock, portMAX_DELAY);
+    memset(resolver->cache, 0, sizeof(cache_entry_t) * DNS_CACHE_ENTRIES);
+    xSemaphoreGive(resolver->lock);
+}
+
+void dns_resolver_stats_get(dns_resolver_t *resolver, dns_stats_t *stats) {
+    xSemaphoreTake(resolver->lock, portMAX_DELAY);
+    *stats = resolver->stats;
+    xSemaphoreGive(resolver->lock);
+}
+
+dns_query_t *dns_query_start(dns_resolver_t *resolver, char const *name, int family) {
+    dns_query_t *query = calloc(1, sizeof(dns_query_t));
+    if (!query) {
+        return NULL;
+    }
+
+    query->done_sem = xSemaphoreCreateBinary();
+    if (!query->done_sem) {
+        free(query);
+        return NULL;
+    }
+
+    query->resolver = resolver;
+    query->refs     = 1;
+    query->family   = family;
+    query->sock     = -1;
+    query->done_fd  = -1;
+    atomic_store(&query->done, false);
+
+    xSemaphoreTake(resolver->lock, portMAX_DELAY);
+    resolver->stats.lookups++;
+
+    if ((family != AF_UNSPEC && family != AF_INET && family != AF_INET6) || !normalize_name(name, query->name)) {
+        finish(query, DNS_STATUS_INVALID);
+        goto out;
+    }
+
+    set_wanted(resolver, family, query->wanted);
+    if (from_cache(resolver, query, esp_timer_get_time())) {
+        resolver->stats.hits++;
+        finish(query, DNS_STATUS_OK);
+        if (query->result.status != DNS_STATUS_OK) {
+            resolver->stats.negative++;
+        }
+        goto out;
+    }
+
+    for (dns_query_t *running = resolver->queries; running; running = running->next) {
+        if (!atomic_load(&running->done) && running->family == family && strcmp(running->name, query->name) == 0) {
+            running->refs++;
+            resolver->stats.coalesced++;
+            xSemaphoreGive(resolver->lock);
+            free_query(query);
+            return running;
+        }
+    }
+
+    query->num_servers = resolver->ops.servers(resolver->ctx, query->servers, DNS_SERVERS_MAX);
+    if (!query->num_servers) {
+        for (int f = 0; f < FAMILIES; f++) {
+            if (query->wanted[f] && query->answers[f].state == ANSWER_NONE) {
+                query->answers[f].state = ANSWER_FAILED;
+            }
+        }
+        finish(query, DNS_STATUS_OK);
+        goto out;
+    }
+
+    for (int f = 0; f < FAMILIES; f++) {
+        query->asking[f] = query->wanted[f] && query->answers[f].state == ANSWER_NONE;
+        query->ids[f]    = esp_random() & 0xffff;
+    }
+    if (query->ids[V4] == query->ids[V6]) {
+        query->ids[V6] ^= 1;
+    }
+
+    query->done_fd    = eventfd(0, 0);
+    query->refs       = 2;
+    query->next       = resolver->queries;
+    resolver->queries = query;
+    xSemaphoreGive(resolver->lock);
+
+    kick(resolver);
+    return query;
+
+out:
+    xSemaphoreGive(resolver->lock);
+    return query;
+}
+
+bool dns_query_done(dns_query_t *query) {
+    return atomic_load(&query->done);
+}
+
+int dns_query_fd(dns_query_t *query) {
+    return query->done_fd;
+}
+
+dns_status_t dns_query_wait(dns_query_t *query, int timeout_ms) {
+    if (!atomic_load(&query->done)) {
+        TickType_t ticks = timeout_ms < 0 ? portMAX_DELAY : pdMS_TO_TICKS(timeout_ms);
+        // Handed on so every sharer of the query gets through
+        if (xSemaphoreTake(query->done_sem, ticks) == pdTRUE) {
+            xSemaphoreGive(query->done_sem);
+        }
+    }
+
+    return atomic_load(&query->done) ? query->result.status : DNS_STATUS_PENDING;
+}
+
+void dns_query_result(dns_query_t *query, dns_result_t *result) {
+    if (!atomic_load(&query->done)) {
+        result->status = DNS_STATUS_PENDING;
+        result->count  = 0;
+        return;
+    }
+    *result = query->result;
+}
+
+void dns_query_release(dns_query_t *query) {
+    dns_resolver_t *resolver = query->resolver;
+
+    xSemaphoreTake(resolver->lock, portMAX_DELAY);
+    bool last = unref(query);
+    xSemaphoreGive(resolver->lock);
+
+    if (last) {
+        free_query(query);
+    }
+}
@@ -0,0 +1,100 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "badgevms_config.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/socket.h>
+
+// Host name lookups over UDP, shared by everyone through one cache. A lookup for both families sends the A and AAAA
+// queries at once and is done when both are answered, or a short while after the first family's addresses are in.
+// Answers the servers give, including that a name doesn't exist, are kept for as long as their TTL allows. Lookups
+// are driven by dns_resolver_run() on a task of its own, the other functions can be called from anywhere.
+
+#define DNS_NAME_MAX   253
+#define DNS_RESULT_MAX (2 * DNS_ADDRESSES_MAX)
+
+typedef enum {
+    DNS_STATUS_PENDING,
+    DNS_STATUS_OK,
+    DNS_STATUS_NOT_FOUND, // The name doesn't exist or has no addresses of the families asked for
+    DNS_STATUS_TIMEOUT,   // No server answered
+    DNS_STATUS_FAILED,    // The servers answered with errors or there are none
+    DNS_STATUS_INVALID,   // Not a valid host name
+    DNS_STATUS_NO_MEM,
+} dns_status_t;
+
+typedef struct {
+    sa_family_t family;
+    uint8_t     addr[16]; // Network byte order, only the first 4 bytes for AF_INET
+} dns_address_t;
+
+typedef struct {
+    dns_status_t  status;
+    size_t        count;
+    dns_address_t addresses[DNS_RESULT_MAX]; // IPv6 and IPv4 taking turns, starting with IPv6
+} dns_result_t;
+
+typedef struct {
+    // Fills in the addresses of the servers to ask, with their ports, returns how many there are
+    size_t (*servers)(void *ctx, struct sockaddr_storage *servers, size_t max);
+    // Whether IPv6 addresses are any use, lookups for both families only ask for IPv4 addresses if not
+    bool (*ipv6_usable)(void *ctx);
+} dns_resolver_ops_t;
+
+typedef struct {
+    uint32_t lookups;   // Lookups started
+    uint32_t hits;      // Lookups answered from the cache for every family
+    uint32_t negative;  // Of those, answered with a remembered failure
+    uint32_t coalesced; // Lookups that joined one for the same name already in flight
+    uint32_t queries;   // Query packets sent, retries included
+    uint32_t timeouts;  // Lookups no server answered
+    uint32_t evictions; // Cached names dropped to make room
+} dns_stats_t;
+
+typedef struct dns_resolver dns_resolver_t;
+typedef struct dns_query    dns_query_t;
+
+dns_resolver_t *dns_resolver_create(dns_resolver_ops_t const *ops, void *ctx);
+// dns_resolver_run() has to have returned and every query has to be released
+void            dns_resolver_destroy(dns_resolver_t *resolver);
+
+// Sends queries and takes in answers until dns_resolver_stop() is called
+void dns_resolver_run(dns_resolver_t *resolver);
+void dns_resolver_stop(dns_resolver_t *resolver);
+
+// Answers from the cache alone, false if any of the families has to be asked for
+bool dns_resolver_cached(dns_resolver_t *resolver, char const *name, int family, dns_result_t *result);
+void dns_resolver_flush(dns_resolver_t *resolver);
+void dns_resolver_stats_get(dns_resolver_t *resolver, dns_stats_t *stats);
+
+// Looks up name for AF_INET, AF_INET6 or AF_UNSPEC for both. A lookup that can't even start is done right away with
+// its status set, NULL is only returned without memory. Lookups for the same name and family share one query.
+dns_query_t *dns_query_start(dns_resolver_t *resolver, char const *name, int family);
+bool         dns_query_done(dns_query_t *query);
+// A native fd that turns readable once the query is done and stays that way, -1 if there is none, in which case the
+// query is already done or has to be waited for
+int          dns_query_fd(dns_query_t *query);
+// Waits at most timeout_ms, forever if it is negative, returns DNS_STATUS_PENDING if the query is still running
+dns_status_t dns_query_wait(dns_query_t *query, int timeout_ms);
+void         dns_query_result(dns_query_t *query, dns_result_t *result);
+void         dns_query_release(dns_query_t *query);
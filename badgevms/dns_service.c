@@ -0,0 +1,439 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "dns_service.h"
+
+#include "badgevms/dns.h"
+#include "badgevms_config.h"
+#include "esp_log.h"
+#include "esp_netif.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "task.h"
+#include "wait_queue.h"
+#include "why_io.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+
+#define DNS_PORT 53
+
+static char const *TAG = "dns_service";
+
+static dns_resolver_t *resolver;
+static TaskHandle_t    dns_task;
+static bool            dns_started;
+
+typedef struct {
+    dns_query_t *query; // NULL for numeric addresses, which are in result right away
+    dns_result_t result;
+} dns_lookup_t;
+
+typedef struct {
+    struct addrinfo         info;
+    struct sockaddr_storage address;
+    char                    canonname[];
+} addrinfo_entry_t;
+
+static size_t netif_servers(void *ctx, struct sockaddr_storage *servers, size_t max) {
+    esp_netif_t *netif = esp_netif_get_default_netif();
+    size_t       count = 0;
+
+    for (int type = ESP_NETIF_DNS_MAIN; netif && type < ESP_NETIF_DNS_MAX && count < max; type++) {
+        esp_netif_dns_info_t info;
+        if (esp_netif_get_dns_info(netif, type, &info) != ESP_OK) {
+            continue;
+        }
+
+        memset(&servers[count], 0, sizeof(struct sockaddr_storage));
+        if (info.ip.type == ESP_IPADDR_TYPE_V4 && info.ip.u_addr.ip4.addr) {
+            struct sockaddr_in *sin = (struct sockaddr_in *)&servers[count++];
+            sin->sin_family         = AF_INET;
+            sin->sin_port           = htons(DNS_PORT);
+            sin->sin_addr.s_addr    = info.ip.u_addr.ip4.addr;
+        } else if (info.ip.type == ESP_IPADDR_TYPE_V6 && (info.ip.u_addr.ip6.addr[0] || info.ip.u_addr.ip6.addr[1] ||
+                                                          info.ip.u_addr.ip6.addr[2] || info.ip.u_addr.ip6.addr[3])) {
+            struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&servers[count++];
+            sin6->sin6_family         = AF_INET6;
+            sin6->sin6_port           = htons(DNS_PORT);
+            sin6->sin6_scope_id       = info.ip.u_addr.ip6.zone;
+            memcpy(&sin6->sin6_addr, info.ip.u_addr.ip6.addr, sizeof(sin6->sin6_addr));
+        }
+    }
+
+    return count;
+}
+
+// Without a global address AAAA records are no use, the connection would fail
+static bool netif_ipv6_usable(void *ctx) {
+    esp_netif_t   *netif = esp_netif_get_default_netif();
+    esp_ip6_addr_t addresses[CONFIG_LWIP_IPV6_NUM_ADDRESSES];
+
+    int count = netif ? esp_netif_get_all_ip6(netif, addresses) : 0;
+    for (int i = 0; i < count; i++) {
+        esp_ip6_addr_type_t type = esp_netif_ip6_get_addr_type(&addresses[i]);
+        if (type == ESP_IP6_ADDR_IS_GLOBAL || type == ESP_IP6_ADDR_IS_UNIQUE_LOCAL) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static dns_resolver_ops_t const netif_ops = {
+    .servers     = netif_servers,
+    .ipv6_usable = netif_ipv6_usable,
+};
+
+static void hermes(void *ignored) {
+    dns_resolver_run(resolver);
+    vTaskDelete(NULL);
+}
+
+bool dns_service_init(void) {
+    resolver = dns_resolver_create(&netif_ops, NULL);
+    if (!resolver) {
+        ESP_LOGE(TAG, "Unable to create the resolver");
+        return false;
+    }
+
+    if (create_kernel_task(hermes, "Hermes", 4096, NULL, 8, &dns_task, 0) != pdTRUE) {
+        ESP_LOGE(TAG, "Unable to create the DNS task");
+        dns_resolver_destroy(resolver);
+        resolver = NULL;
+        return false;
+    }
+
+    dns_started = true;
+    return true;
+}
+
+bool dns_service_running(void) {
+    return dns_started;
+}
+
+// True if host is an address rather than a name, result is then filled in
+static bool numeric_address(char const *host, int family, dns_result_t *result) {
+    dns_address_t *address = &result->addresses[0];
+
+    memset(address, 0, sizeof(dns_address_t));
+    if (inet_pton(AF_INET, host, address->addr) == 1) {
+        address->family = AF_INET;
+    } else if (inet_pton(AF_INET6, host, address->addr) == 1) {
+        address->family = AF_INET6;
+    } else {
+        return false;
+    }
+
+    bool wanted    = family == AF_UNSPEC || family == address->family;
+    result->status = wanted ? DNS_STATUS_OK : DNS_STATUS_NOT_FOUND;
+    result->count  = wanted ? 1 : 0;
+    return true;
+}
+
+dns_query_t *dns_service_query(char const *host, int family) {
+    dns_result_t result;
+
+    if (!dns_started || numeric_address(host, family, &result)) {
+        return NULL;
+    }
+    return dns_query_start(resolver, host, family);
+}
+
+dns_status_t dns_service_resolve(char const *host, int family, int timeout_ms, dns_result_t *result) {
+    if (numeric_address(host, family, result)) {
+        return result->status;
+    }
+
+    result->count = 0;
+    if (!dns_started) {
+        result->status = DNS_STATUS_FAILED;
+        return result->status;
+    }
+
+    dns_query_t *query = dns_query_start(resolver, host, family);
+    if (!query) {
+        result->status = DNS_STATUS_NO_MEM;
+        return result->status;
+    }
+
+    dns_query_wait(query, timeout_ms);
+    dns_query_result(query, result);
+    dns_query_release(query);
+    return result->status;
+}
+
+static int service_port(char const *service, int flags, uint16_t *port) {
+    *port = 0;
+    if (!service) {
+        return 0;
+    }
+
+    char *end;
+    long  number = strtol(service, &end, 10);
+    if (*service && !*end) {
+        if (number < 0 || number > 65535) {
+            return EAI_SERVICE;
+        }
+        *port = number;
+        return 0;
+    }
+
+    if (flags & AI_NUMERICSERV) {
+        return EAI_NONAME;
+    }
+    if (strcmp(service, "http") == 0) {
+        *port = 80;
+    } else if (strcmp(service, "https") == 0) {
+        *port = 443;
+    } else {
+        return EAI_SERVICE;
+    }
+    return 0;
+}
+
+void why_freeaddrinfo(struct addrinfo *res) {
+    while (res) {
+        struct addrinfo *next = res->ai_next;
+        why_free(res);
+        res = next;
+    }
+}
+
+// One allocation per entry so freeaddrinfo() can take the list apart, the canonical name only goes with the first
+static int build_addrinfo(
+    dns_result_t const *result, char const *canonname, uint16_t port, struct addrinfo const *hints,
+    struct addrinfo **res
+) {
+    struct addrinfo **link = res;
+
+    *res = NULL;
+    for (size_t i = 0; i < result->count; i++) {
+        dns_address_t const *address = &result->addresses[i];
+        size_t               extra   = i == 0 && canonname ? strlen(canonname) + 1 : 0;
+
+        addrinfo_entry_t *entry = why_malloc(sizeof(addrinfo_entry_t) + extra);
+        if (!entry) {
+            why_freeaddrinfo(*res);
+            *res = NULL;
+            return EAI_MEMORY;
+        }
+        memset(entry, 0, sizeof(addrinfo_entry_t));
+
+        if (address->family == AF_INET) {
+            struct sockaddr_in *sin = (struct sockaddr_in *)&entry->address;
+            sin->sin_family         = AF_INET;
+            sin->sin_port           = htons(port);
+            memcpy(&sin->sin_addr, address->addr, sizeof(sin->sin_addr));
+            entry->info.ai_addrlen = sizeof(struct sockaddr_in);
+        } else {
+            struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&entry->address;
+            sin6->sin6_family         = AF_INET6;
+            sin6->sin6_port           = htons(port);
+            memcpy(&sin6->sin6_addr, address->addr, sizeof(sin6->sin6_addr));
+            entry->info.ai_addrlen = sizeof(struct sockaddr_in6);
+        }
+
+        entry->info.ai_family   = address->family;
+        entry->info.ai_socktype = hints ? hints->ai_socktype : 0;
+        entry->info.ai_protocol = hints ? hints->ai_protocol : 0;
+        entry->info.ai_addr     = (struct sockaddr *)&entry->address;
+        if (extra) {
+            strcpy(entry->canonname, canonname);
+            entry->info.ai_canonname = entry->canonname;
+        }
+
+        *link = &entry->info;
+        link  = &entry->info.ai_next;
+    }
+
+    return 0;
+}
+
+static int status_to_eai(dns_status_t status) {
+    switch (status) {
+        case DNS_STATUS_OK:
+            return 0;
+        case DNS_STATUS_PENDING:
+            return EAI_AGAIN;
+        case DNS_STATUS_NO_MEM:
+            return EAI_MEMORY;
+        case DNS_STATUS_NOT_FOUND:
+        case DNS_STATUS_INVALID:
+            return EAI_NONAME;
+        default:
+            return EAI_FAIL;
+    }
+}
+
+static int result_to_addrinfo(
+    dns_result_t const *result, char const *node, char const *service, struct addrinfo const *hints,
+    struct addrinfo **res
+) {
+    int      flags = hints ? hints->ai_flags : 0;
+    uint16_t port;
+
+    int err = service_port(service, flags, &port);
+    if (err) {
+        return err;
+    }
+
+    err = status_to_eai(result->status);
+    if (err) {
+        return err;
+    }
+
+    return build_addrinfo(result, flags & AI_CANONNAME ? node : NULL, port, hints, res);
+}
+
+static bool family_valid(int family) {
+    return family == AF_UNSPEC || family == AF_INET || family == AF_INET6;
+}
+
+// The list lives on the heap of the calling process
+int why_getaddrinfo(char const *node, char const *service, struct addrinfo const *hints, struct addrinfo **res) {
+    int          flags  = hints ? hints->ai_flags : 0;
+    int          family = hints ? hints->ai_family : AF_UNSPEC;
+    dns_result_t result = {.status = DNS_STATUS_OK, .count = 1};
+
+    if (!res || (!node && !service)) {
+        return EAI_NONAME;
+    }
+    if (!family_valid(family)) {
+        return EAI_FAMILY;
+    }
+
+    if (!node) {
+        // The address to bind to with AI_PASSIVE, loopback otherwise
+        dns_address_t *address = &result.addresses[0];
+        memset(address, 0, sizeof(dns_address_t));
+        address->family = family == AF_INET6 ? AF_INET6 : AF_INET;
+        if (!(flags & AI_PASSIVE)) {
+            if (address->family == AF_INET6) {
+                address->addr[15] = 1;
+            } else {
+                address->addr[0] = 127;
+                address->addr[3] = 1;
+            }
+        }
+    } else if (!numeric_address(node, family, &result)) {
+        if (flags & AI_NUMERICHOST) {
+            return EAI_NONAME;
+        }
+        dns_service_resolve(node, family, -1, &result);
+    }
+
+    return result_to_addrinfo(&result, node, service, hints, res);
+}
+
+// The fd of a lookup is the lookup itself
+static_assert(sizeof(dns_lookup_t *) <= sizeof(int), "lookup pointers must fit in an fd");
+
+static short dns_lookup_poll(void *dev, int fd, short events, struct poll_waiter *waiter) {
+    dns_lookup_t *lookup = (dns_lookup_t *)(intptr_t)fd;
+
+    if (lookup->query && !dns_query_done(lookup->query)) {
+        int native_fd = dns_query_fd(lookup->query);
+        if (native_fd >= 0) {
+            poll_wait_fd(waiter, native_fd, POLLIN);
+        } else {
+            poll_recheck(waiter, POLL_FALLBACK_INTERVAL_MS);
+        }
+    }
+
+    return !lookup->query || dns_query_done(lookup->query) ? POLLIN | POLLRDNORM : 0;
+}
+
+static int dns_lookup_close(void *dev, int fd) {
+    dns_lookup_t *lookup = (dns_lookup_t *)(intptr_t)fd;
+
+    if (lookup->query) {
+        dns_query_release(lookup->query);
+    }
+    free(lookup);
+    return 0;
+}
+
+static device_t dns_lookup_device = {
+    .type   = DEVICE_TYPE_DNS,
+    ._close = dns_lookup_close,
+    ._poll  = dns_lookup_poll,
+};
+
+int dns_lookup(char const *host, int family) {
+    task_info_t *task_info = get_task_info();
+
+    if (!host || !family_valid(family)) {
+        task_info->_errno = EINVAL;
+        return -1;
+    }
+
+    dns_lookup_t *lookup = calloc(1, sizeof(dns_lookup_t));
+    if (!lookup) {
+        task_info->_errno = ENOMEM;
+        return -1;
+    }
+
+    if (!numeric_address(host, family, &lookup->result)) {
+        lookup->query = dns_started ? dns_query_start(resolver, host, family) : NULL;
+        if (!lookup->query) {
+            free(lookup);
+            task_info->_errno = dns_started ? ENOMEM : ENETDOWN;
+            return -1;
+        }
+    }
+
+    for (int fd = 0; fd < MAXFD; ++fd) {
+        if (!task_info->thread->file_handles[fd].is_open) {
+            task_info->thread->file_handles[fd].is_open = true;
+            task_info->thread->file_handles[fd].dev_fd  = (int)(intptr_t)lookup;
+            task_info->thread->file_handles[fd].device  = &dns_lookup_device;
+            return fd;
+        }
+    }
+
+    dns_lookup_close(&dns_lookup_device, (int)(intptr_t)lookup);
+    task_info->_errno = EMFILE;
+    return -1;
+}
+
+int dns_lookup_result(int fd, char const *service, struct addrinfo const *hints, struct addrinfo **res) {
+    task_info_t *task_info = get_task_info();
+
+    if (fd < 0 || fd >= MAXFD || !task_info->thread->file_handles[fd].is_open ||
+        task_info->thread->file_handles[fd].device != &dns_lookup_device) {
+        task_info->_errno = EBADF;
+        return EAI_FAIL;
+    }
+
+    dns_lookup_t *lookup = (dns_lookup_t *)(intptr_t)task_info->thread->file_handles[fd].dev_fd;
+    if (lookup->query) {
+        dns_query_result(lookup->query, &lookup->result);
+    }
+
+    if (!res) {
+        return EAI_NONAME;
+    }
+    *res = NULL;
+    return result_to_addrinfo(&lookup->result, NULL, service, hints, res);
+}
@@ -0,0 +1,33 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "dns_resolver.h"
+
+#include <stdbool.h>
+
+bool dns_service_init(void);
+bool dns_service_running(void);
+
+// Starts looking host up through the shared cache, for the caller to release. NULL for numeric addresses, before the
+// service runs and without memory, the caller then has to resolve host itself.
+dns_query_t *dns_service_query(char const *host, int family);
+
+// Looks host up and waits for the answer, at most timeout_ms or forever if it is negative. Numeric addresses are
+// answered as they are.
+dns_status_t dns_service_resolve(char const *host, int family, int timeout_ms, dns_result_t *result);
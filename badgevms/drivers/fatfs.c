@@ -16,20 +16,36 @@
 
 #include "fatfs.h"
 
+#include "badgevms_config.h"
+#include "block_cache.h"
+#include "diskio.h"
+#include "diskio_impl.h"
+#include "diskio_sdmmc.h"
+#include "diskio_wl.h"
 #include "driver/sdmmc_host.h"
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
 #include "esp_vfs.h"
 #include "esp_vfs_fat.h"
+#include "ff.h"
 #include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 #include "pathfuncs_private.h"
+#include "sd_speed.h"
 #include "sd_test_io.h"
 #include "sdkconfig.h"
 #include "sdmmc_cmd.h"
+#include "task.h"
+#include "wear_levelling.h"
 
 #include <stdbool.h>
 #include <stdio.h>
 
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <sys/param.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -54,33 +70,244 @@
 #define SDCARD_PWR_CTRL_LDO_IO_ID       4
 #define SDCARD_PWR_CTRL_LDO_INTERNAL_IO 1
 
-#undef SDCARD_SDMMC_SPEED_HS
-#undef SDCARD_SDMMC_SPEED_UHS_I_SDR50
-#undef SDCARD_SDMMC_SPEED_UHS_I_DDR50
+#define SD_PROBE_ALIGN 64
 
-#define IS_UHS1 (SDCARD_SDMMC_SPEED_UHS_I_SDR50 || SDCARD_SDMMC_SPEED_UHS_I_DDR50)
+// A file opened for writing. Once the application closes it, it stays open underneath until it is committed, so a
+// file that is opened again before that is not committed twice.
+typedef struct {
+    int     fd;
+    int     flags;
+    bool    parked;
+    int64_t parked_at;
+    char    unixpath[PATH_UNIX_MAX_LEN];
+} writeback_file_t;
 
 typedef struct {
-    filesystem_device_t  filesystem;
-    wl_handle_t          wl_handle;
-    sdmmc_card_t        *sdmmc_handle;
-    sd_pwr_ctrl_handle_t pwr_ctrl_handle;
-    char                *base_path;
+    filesystem_device_t      filesystem;
+    wl_handle_t              wl_handle;
+    sdmmc_card_t            *sdmmc_handle;
+    sd_pwr_ctrl_handle_t     pwr_ctrl_handle;
+    char                    *base_path;
+    SemaphoreHandle_t        writeback_lock;
+    TaskHandle_t             writeback_task;
+    filesystem_sync_policy_t sync_policy;
+    uint32_t                 sync_interval_ms;
+    writeback_file_t         writeback_files[FATFS_WRITEBACK_FILES];
+    block_cache_backend_t    cache_backend;
+    block_cache_volume_t    *cache;
+    DSTATUS                  drive_status; // Of the drive under the cache, see cached_disk_status()
+    filesystem_bus_mode_t    bus_mode;
+    uint32_t                 max_transfer_sectors;
+    uint32_t                 allocation_unit;
+    uint32_t                 probe_read_kib_s;
+    uint64_t                 bytes_read;
+    uint64_t                 read_us;
+    uint64_t                 bytes_written;
+    uint64_t                 write_us;
 } fatfs_device_t;
 
+// FatFs drives that were switched over to the block cache
+static fatfs_device_t *cached_drives[FF_VOLUMES];
+
+#define REOPEN_FLAGS_MASK (~(O_CREAT | O_TRUNC))
+
+// Commits and closes parked files matching unixpath, or all of them if it is NULL. Lock must be held.
+static void writeback_commit_parked(fatfs_device_t *device, char const *unixpath) {
+    for (int i = 0; i < FATFS_WRITEBACK_FILES; i++) {
+        writeback_file_t *file = &device->writeback_files[i];
+        if (file->fd < 0 || !file->parked) {
+            continue;
+        }
+        if (unixpath && strcmp(file->unixpath, unixpath) != 0) {
+            continue;
+        }
+
+        close(file->fd);
+        file->fd     = -1;
+        file->parked = false;
+    }
+}
+
+static void writeback_lock(fatfs_device_t *device) {
+    xSemaphoreTake(device->writeback_lock, portMAX_DELAY);
+}
+
+static void writeback_unlock(fatfs_device_t *device) {
+    xSemaphoreGive(device->writeback_lock);
+}
+
+static void writeback_commit(fatfs_device_t *device, char const *unixpath) {
+    writeback_lock(device);
+    writeback_commit_parked(device, unixpath);
+    writeback_unlock(device);
+}
+
+// Takes back a parked file for unixpath if it was opened the same way, otherwise commits it. Lock must be held.
+static int writeback_reopen(fatfs_device_t *device, char const *unixpath, int flags) {
+    for (int i = 0; i < FATFS_WRITEBACK_FILES; i++) {
+        writeback_file_t *file = &device->writeback_files[i];
+        if (file->fd < 0 || !file->parked || strcmp(file->unixpath, unixpath) != 0) {
+            continue;
+        }
+
+        if ((flags & O_EXCL) || (file->flags & REOPEN_FLAGS_MASK) != (flags & REOPEN_FLAGS_MASK)) {
+            break;
+        }
+
+        if ((flags & O_TRUNC) && ftruncate(file->fd, 0) != 0) {
+            break;
+        }
+
+        lseek(file->fd, 0, (flags & O_APPEND) ? SEEK_END : SEEK_SET);
+        file->parked = false;
+        return file->fd;
+    }
+
+    writeback_commit_parked(device, unixpath);
+    return -1;
+}
+
+// Remembers a newly opened file, making room by committing the oldest parked file. Lock must be held.
+static void writeback_track(fatfs_device_t *device, int fd, char const *unixpath, int flags) {
+    writeback_file_t *slot = NULL;
+
+    for (int i = 0; i < FATFS_WRITEBACK_FILES && (!slot || slot->fd >= 0); i++) {
+        writeback_file_t *file = &device->writeback_files[i];
+        if (file->fd < 0 || (file->parked && (!slot || file->parked_at < slot->parked_at))) {
+            slot = file;
+        }
+    }
+
+    // Every slot belongs to a file that is still open, this one commits on close
+    if (!slot) {
+        return;
+    }
+
+    if (slot->fd >= 0) {
+        close(slot->fd);
+    }
+
+    slot->fd     = fd;
+    slot->flags  = flags;
+    slot->parked = false;
+    strcpy(slot->unixpath, unixpath);
+}
+
+static void fatfs_writeback_task(void *arg) {
+    fatfs_device_t *device = arg;
+
+    while (true) {
+        TickType_t wait = portMAX_DELAY;
+        if (device->sync_policy == FILESYSTEM_SYNC_PERIODIC) {
+            wait = pdMS_TO_TICKS(device->sync_interval_ms);
+        }
+
+        ulTaskNotifyTake(pdTRUE, wait);
+
+        if (device->sync_policy == FILESYSTEM_SYNC_PERIODIC) {
+            writeback_commit(device, NULL);
+        }
+    }
+}
+
 static int fatfs_open(void *dev, path_t *path, int flags, mode_t mode) {
-    fatfs_device_t *device   = dev;
-    char           *unixpath = path_to_unix(path);
+    fatfs_device_t *device = dev;
+    char            unixpath[PATH_UNIX_MAX_LEN];
+    if (path_to_unix(path, unixpath, sizeof(unixpath)) != PATH_PARSE_OK) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    writeback_lock(device);
+
+    int ret = writeback_reopen(device, unixpath, flags);
+    if (ret < 0) {
+        ret = open(unixpath, flags, mode);
+        if (ret >= 0 && (flags & O_ACCMODE) != O_RDONLY && device->sync_policy != FILESYSTEM_SYNC_ON_CLOSE) {
+            writeback_track(device, ret, unixpath, flags);
+        }
+    }
 
-    int ret = open(unixpath, flags, mode);
+    writeback_unlock(device);
     return ret;
 }
 
 static int fatfs_close(void *dev, int fd) {
+    fatfs_device_t *device = dev;
+
+    writeback_lock(device);
+    for (int i = 0; i < FATFS_WRITEBACK_FILES; i++) {
+        writeback_file_t *file = &device->writeback_files[i];
+        if (file->fd == fd && !file->parked) {
+            if (device->sync_policy == FILESYSTEM_SYNC_ON_CLOSE) {
+                file->fd = -1;
+                break;
+            }
+
+            file->parked    = true;
+            file->parked_at = esp_timer_get_time();
+            writeback_unlock(device);
+            return 0;
+        }
+    }
+    writeback_unlock(device);
+
     fsync(fd);
     return close(fd);
 }
 
+static int fatfs_fsync(void *dev, int fd) {
+    return fsync(fd);
+}
+
+static int fatfs_sync(void *dev) {
+    fatfs_device_t *device = dev;
+
+    writeback_lock(device);
+    writeback_commit_parked(device, NULL);
+    for (int i = 0; i < FATFS_WRITEBACK_FILES; i++) {
+        if (device->writeback_files[i].fd >= 0) {
+            fsync(device->writeback_files[i].fd);
+        }
+    }
+    writeback_unlock(device);
+    return 0;
+}
+
+static int fatfs_set_sync_policy(void *dev, filesystem_sync_policy_t policy, uint32_t interval_ms) {
+    fatfs_device_t *device = dev;
+
+    // Called straight from filesystem_sync_policy_set(), the application sees the errno of its task
+    if (policy == FILESYSTEM_SYNC_PERIODIC && !interval_ms) {
+        get_task_info()->_errno = EINVAL;
+        return -1;
+    }
+
+    writeback_lock(device);
+    if (policy == FILESYSTEM_SYNC_PERIODIC && !device->writeback_task) {
+        if (create_kernel_task(fatfs_writeback_task, "Writeback", 3072, device, 5, &device->writeback_task, 1) !=
+            pdTRUE) {
+            writeback_unlock(device);
+            get_task_info()->_errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    device->sync_policy      = policy;
+    device->sync_interval_ms = interval_ms;
+    if (policy == FILESYSTEM_SYNC_ON_CLOSE) {
+        writeback_commit_parked(device, NULL);
+    }
+    writeback_unlock(device);
+
+    if (device->writeback_task) {
+        xTaskNotifyGive(device->writeback_task);
+    }
+
+    ESP_LOGI("fatfs", "%s: sync policy %d, interval %" PRIu32 "ms", device->base_path, policy, interval_ms);
+    return 0;
+}
+
 static ssize_t fatfs_write(void *dev, int fd, void const *buf, size_t count) {
     return write(fd, buf, count);
 }
@@ -94,8 +321,12 @@ static ssize_t fatfs_lseek(void *dev, int fd, off_t offset, int whence) {
 }
 
 static int fatfs_stat(void *dev, path_t *path, struct stat *restrict statbuf) {
-    fatfs_device_t *device   = dev;
-    char           *unixpath = path_to_unix(path);
+    char unixpath[PATH_UNIX_MAX_LEN];
+    if (path_to_unix(path, unixpath, sizeof(unixpath)) != PATH_PARSE_OK) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    writeback_commit(dev, unixpath);
     return stat(unixpath, statbuf);
 }
 
@@ -104,33 +335,58 @@ static int fatfs_fstat(void *dev, int fd, struct stat *restrict statbuf) {
 }
 
 static int fatfs_unlink(void *dev, path_t *path) {
-    fatfs_device_t *device   = dev;
-    char           *unixpath = path_to_unix(path);
+    char unixpath[PATH_UNIX_MAX_LEN];
+    if (path_to_unix(path, unixpath, sizeof(unixpath)) != PATH_PARSE_OK) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    writeback_commit(dev, unixpath);
     return unlink(unixpath);
 }
 
 static int fatfs_rename(void *dev, path_t *oldpath, path_t *newpath) {
-    fatfs_device_t *device       = dev;
-    char           *old_unixpath = path_to_unix(oldpath);
-    char           *new_unixpath = path_to_unix(newpath);
+    char old_unixpath[PATH_UNIX_MAX_LEN];
+    if (path_to_unix(oldpath, old_unixpath, sizeof(old_unixpath)) != PATH_PARSE_OK) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    char new_unixpath[PATH_UNIX_MAX_LEN];
+    if (path_to_unix(newpath, new_unixpath, sizeof(new_unixpath)) != PATH_PARSE_OK) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    // Parked files might live anywhere below a renamed directory
+    writeback_commit(dev, NULL);
     return rename(old_unixpath, new_unixpath);
 }
 
 static int fatfs_mkdir(void *dev, path_t *path, mode_t mode) {
-    fatfs_device_t *device   = dev;
-    char           *unixpath = path_to_unix(path);
+    char unixpath[PATH_UNIX_MAX_LEN];
+    if (path_to_unix(path, unixpath, sizeof(unixpath)) != PATH_PARSE_OK) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
     return mkdir(unixpath, mode);
 }
 
 static int fatfs_rmdir(void *dev, path_t *path) {
-    fatfs_device_t *device   = dev;
-    char           *unixpath = path_to_unix(path);
+    char unixpath[PATH_UNIX_MAX_LEN];
+    if (path_to_unix(path, unixpath, sizeof(unixpath)) != PATH_PARSE_OK) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    writeback_commit(dev, NULL);
     return rmdir(unixpath);
 }
 
 static DIR *fatfs_opendir(void *dev, path_t *path) {
-    fatfs_device_t *device   = dev;
-    char           *unixpath = path_to_unix(path);
+    char unixpath[PATH_UNIX_MAX_LEN];
+    if (path_to_unix(path, unixpath, sizeof(unixpath)) != PATH_PARSE_OK) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
     return opendir(unixpath);
 }
 
@@ -144,6 +400,203 @@ static int fatfs_closedir(void *dev, DIR *dirp) {
     return closedir(dirp);
 }
 
+static bool fatfs_cache_stats(void *dev, filesystem_cache_stats_t *stats, bool reset) {
+    fatfs_device_t *device = dev;
+
+    if (!device->cache) {
+        return false;
+    }
+
+    block_cache_stats_get(device->cache, stats, reset);
+    return true;
+}
+
+static bool fatfs_info(void *dev, filesystem_info_t *info) {
+    fatfs_device_t *device = dev;
+    sdmmc_card_t   *card   = device->sdmmc_handle;
+
+    *info = (filesystem_info_t){
+        .bus_mode             = device->bus_mode,
+        .bus_freq_khz         = card ? card->real_freq_khz : 0,
+        .bus_width            = card ? 1 << card->log_bus_width : 0,
+        .sector_size          = device->cache_backend.sector_size,
+        .max_transfer_sectors = device->max_transfer_sectors,
+        .allocation_unit      = device->allocation_unit,
+        .probe_read_kib_s     = device->probe_read_kib_s,
+        .bytes_read           = device->bytes_read,
+        .read_us              = device->read_us,
+        .bytes_written        = device->bytes_written,
+        .write_us             = device->write_us,
+    };
+    return true;
+}
+
+// Callers are serialized by FatFs, so the totals need no lock of their own
+static void transfer_account(fatfs_device_t *device, bool write, uint32_t count, int64_t start) {
+    int64_t elapsed = esp_timer_get_time() - start;
+    size_t  bytes   = count * device->cache_backend.sector_size;
+
+    if (write) {
+        device->bytes_written += bytes;
+        device->write_us      += elapsed;
+    } else {
+        device->bytes_read += bytes;
+        device->read_us    += elapsed;
+    }
+}
+
+static int wl_cache_read(void *ctx, void *buf, uint32_t sector, uint32_t count) {
+    fatfs_device_t *device = ctx;
+    size_t          ss     = device->cache_backend.sector_size;
+    int64_t         start  = esp_timer_get_time();
+
+    if (wl_read(device->wl_handle, sector * ss, buf, count * ss) != ESP_OK) {
+        return -1;
+    }
+    transfer_account(device, false, count, start);
+    return 0;
+}
+
+static int wl_cache_write(void *ctx, void const *buf, uint32_t sector, uint32_t count) {
+    fatfs_device_t *device = ctx;
+    size_t          ss     = device->cache_backend.sector_size;
+    int64_t         start  = esp_timer_get_time();
+
+    esp_err_t err = wl_erase_range(device->wl_handle, sector * ss, count * ss);
+    if (err == ESP_OK) {
+        err = wl_write(device->wl_handle, sector * ss, buf, count * ss);
+    }
+    if (err != ESP_OK) {
+        return -1;
+    }
+    transfer_account(device, true, count, start);
+    return 0;
+}
+
+// Splits a transfer into runs of at most SD_MAX_TRANSFER_SECTORS
+static int sd_transfer(fatfs_device_t *device, bool write, uint8_t *buf, uint32_t sector, uint32_t count) {
+    size_t  ss    = device->cache_backend.sector_size;
+    int64_t start = esp_timer_get_time();
+
+    for (uint32_t done = 0; done < count;) {
+        uint32_t  run = MIN(count - done, SD_MAX_TRANSFER_SECTORS);
+        esp_err_t err;
+
+        if (write) {
+            err = sdmmc_write_sectors(device->sdmmc_handle, buf + done * ss, sector + done, run);
+        } else {
+            err = sdmmc_read_sectors(device->sdmmc_handle, buf + done * ss, sector + done, run);
+        }
+        if (err != ESP_OK) {
+            if (sdmmc_get_status(device->sdmmc_handle) != ESP_OK) {
+                device->drive_status |= STA_NOINIT;
+            }
+            return -1;
+        }
+        done += run;
+    }
+
+    transfer_account(device, write, count, start);
+    return 0;
+}
+
+static int sd_cache_read(void *ctx, void *buf, uint32_t sector, uint32_t count) {
+    return sd_transfer(ctx, false, buf, sector, count);
+}
+
+static int sd_cache_write(void *ctx, void const *buf, uint32_t sector, uint32_t count) {
+    return sd_transfer(ctx, true, (uint8_t *)buf, sector, count);
+}
+
+static DSTATUS cached_disk_initialize(unsigned char pdrv) {
+    fatfs_device_t *device = cached_drives[pdrv];
+
+    // A card that stopped answering is back once it answers again
+    if ((device->drive_status & STA_NOINIT) && device->sdmmc_handle &&
+        sdmmc_get_status(device->sdmmc_handle) == ESP_OK) {
+        device->drive_status &= ~STA_NOINIT;
+    }
+    return device->drive_status;
+}
+
+// FatFs asks before nearly every operation, so this is what the drive under the cache said when the cache was put in
+// front of it, until a transfer to an SD card fails and the card no longer answers
+static DSTATUS cached_disk_status(unsigned char pdrv) {
+    return cached_drives[pdrv]->drive_status;
+}
+
+static DRESULT cached_disk_read(unsigned char pdrv, unsigned char *buff, uint32_t sector, unsigned count) {
+    return block_cache_read(cached_drives[pdrv]->cache, buff, sector, count) == 0 ? RES_OK : RES_ERROR;
+}
+
+static DRESULT cached_disk_write(unsigned char pdrv, unsigned char const *buff, uint32_t sector, unsigned count) {
+    return block_cache_write(cached_drives[pdrv]->cache, buff, sector, count) == 0 ? RES_OK : RES_ERROR;
+}
+
+static DRESULT cached_disk_ioctl(unsigned char pdrv, unsigned char cmd, void *buff) {
+    fatfs_device_t *device = cached_drives[pdrv];
+
+    switch (cmd) {
+        case CTRL_SYNC: return RES_OK;
+        case GET_SECTOR_COUNT: *((LBA_t *)buff) = device->cache_backend.sector_count; return RES_OK;
+        case GET_SECTOR_SIZE: *((WORD *)buff) = device->cache_backend.sector_size; return RES_OK;
+        case CTRL_TRIM: {
+            LBA_t    start = ((LBA_t *)buff)[0];
+            uint32_t count = ((LBA_t *)buff)[1] - start + 1;
+            size_t   ss    = device->cache_backend.sector_size;
+
+            block_cache_invalidate(device->cache, start, count);
+            if (device->wl_handle != WL_INVALID_HANDLE) {
+                return wl_erase_range(device->wl_handle, start * ss, count * ss) == ESP_OK ? RES_OK : RES_ERROR;
+            }
+            if (sdmmc_can_trim(device->sdmmc_handle) == ESP_OK) {
+                esp_err_t err = sdmmc_erase_sectors(device->sdmmc_handle, start, count, SDMMC_TRIM_ARG);
+                return err == ESP_OK ? RES_OK : RES_ERROR;
+            }
+            return RES_OK;
+        }
+    }
+
+    return RES_PARERR;
+}
+
+static ff_diskio_impl_t const cached_diskio = {
+    .init   = cached_disk_initialize,
+    .status = cached_disk_status,
+    .read   = cached_disk_read,
+    .write  = cached_disk_write,
+    .ioctl  = cached_disk_ioctl,
+};
+
+// Puts the block cache between a mounted FatFs drive and its storage, leaving the drive uncached if that fails
+static void fatfs_cache_attach(fatfs_device_t *dev, unsigned char pdrv) {
+    if (pdrv >= FF_VOLUMES) {
+        return;
+    }
+
+    dev->cache = block_cache_attach(&dev->cache_backend);
+    if (!dev->cache) {
+        ESP_LOGW("fatfs", "%s is not cached", dev->base_path);
+        return;
+    }
+
+    dev->drive_status   = disk_status(pdrv);
+    cached_drives[pdrv] = dev;
+    ff_diskio_register(pdrv, &cached_diskio);
+}
+
+static bool fatfs_writeback_init(fatfs_device_t *dev) {
+    dev->writeback_lock   = xSemaphoreCreateMutex();
+    dev->writeback_task   = NULL;
+    dev->sync_policy      = FILESYSTEM_SYNC_ON_CLOSE;
+    dev->sync_interval_ms = FILESYSTEM_SYNC_INTERVAL_MS;
+    for (int i = 0; i < FATFS_WRITEBACK_FILES; i++) {
+        dev->writeback_files[i].fd     = -1;
+        dev->writeback_files[i].parked = false;
+    }
+    return dev->writeback_lock != NULL;
+}
+
 device_t *fatfs_create_spi(char const *devname, char const *partname, bool rw) {
     esp_vfs_fat_mount_config_t const mount_config = {
         .max_files              = 256,
@@ -152,10 +605,19 @@ device_t *fatfs_create_spi(char const *devname, char const *partname, bool rw) {
         .use_one_fat            = false,
     };
 
-    fatfs_device_t *dev = malloc(sizeof(fatfs_device_t));
+    fatfs_device_t *dev = calloc(1, sizeof(fatfs_device_t));
     dev->base_path      = malloc(strlen(devname) + 2);
     dev->base_path[0]   = '/';
     strcpy(dev->base_path + 1, devname);
+    dev->wl_handle       = WL_INVALID_HANDLE;
+    dev->sdmmc_handle    = NULL;
+    dev->cache           = NULL;
+    dev->bus_mode        = FILESYSTEM_BUS_NONE;
+    dev->allocation_unit = mount_config.allocation_unit_size;
+
+    if (!fatfs_writeback_init(dev)) {
+        goto error;
+    }
 
     esp_err_t err = esp_vfs_fat_spiflash_mount_rw_wl(dev->base_path, partname, &mount_config, &dev->wl_handle);
     if (err != ESP_OK) {
@@ -163,6 +625,15 @@ device_t *fatfs_create_spi(char const *devname, char const *partname, bool rw) {
         goto error;
     }
 
+    dev->cache_backend = (block_cache_backend_t){
+        .ctx          = dev,
+        .read         = wl_cache_read,
+        .write        = wl_cache_write,
+        .sector_size  = wl_sector_size(dev->wl_handle),
+        .sector_count = wl_size(dev->wl_handle) / wl_sector_size(dev->wl_handle),
+    };
+    fatfs_cache_attach(dev, ff_diskio_get_pdrv_wl(dev->wl_handle));
+
     // Initialize base device
     device_t *base_dev = &dev->filesystem.device;
     base_dev->type     = DEVICE_TYPE_FILESYSTEM;
@@ -183,27 +654,154 @@ device_t *fatfs_create_spi(char const *devname, char const *partname, bool rw) {
     fs_dev->_opendir            = fatfs_opendir;
     fs_dev->_readdir            = fatfs_readdir;
     fs_dev->_closedir           = fatfs_closedir;
+    fs_dev->_fsync              = fatfs_fsync;
+    fs_dev->_sync               = fatfs_sync;
+    fs_dev->_set_sync_policy    = fatfs_set_sync_policy;
+    fs_dev->_cache_stats        = fatfs_cache_stats;
+    fs_dev->_info               = fatfs_info;
 
     return (device_t *)dev;
 
 error:
+    if (dev->writeback_lock) {
+        vSemaphoreDelete(dev->writeback_lock);
+    }
     free(dev->base_path);
     free(dev);
     return NULL;
 }
 
+static char const *bus_mode_name(filesystem_bus_mode_t mode) {
+    switch (mode) {
+        case FILESYSTEM_BUS_SD_DEFAULT: return "default speed";
+        case FILESYSTEM_BUS_SD_HIGH_SPEED: return "high speed";
+        case FILESYSTEM_BUS_SD_UHS_DDR50: return "UHS-I DDR50";
+        case FILESYSTEM_BUS_SD_UHS_SDR50: return "UHS-I SDR50";
+        default: return "none";
+    }
+}
+
+// Times a sequential read from the start of the card, which also shows whether the bus mode is reliable
+static bool sd_probe(fatfs_device_t *dev) {
+    sdmmc_card_t *card  = dev->sdmmc_handle;
+    size_t        ss    = card->csd.sector_size;
+    uint32_t      total = MIN(SD_PROBE_BYTES / ss, card->csd.capacity);
+
+    dev->probe_read_kib_s = 0;
+    if (!total) {
+        return true;
+    }
+
+    uint8_t *buf = heap_caps_aligned_calloc(
+        SD_PROBE_ALIGN,
+        1,
+        SD_MAX_TRANSFER_SECTORS * ss,
+        MALLOC_CAP_SPIRAM | MALLOC_CAP_DMA
+    );
+    if (!buf) {
+        ESP_LOGW("fatfs-sd", "No memory to measure the card speed");
+        return true;
+    }
+
+    bool    ok    = true;
+    int64_t start = esp_timer_get_time();
+    for (uint32_t sector = 0; ok && sector < total; sector += SD_MAX_TRANSFER_SECTORS) {
+        ok = sdmmc_read_sectors(card, buf, sector, MIN(total - sector, SD_MAX_TRANSFER_SECTORS)) == ESP_OK;
+    }
+    int64_t elapsed = esp_timer_get_time() - start;
+    heap_caps_free(buf);
+
+    if (ok && elapsed > 0) {
+        dev->probe_read_kib_s = (uint64_t)total * ss * 1000000 / 1024 / elapsed;
+    }
+    return ok;
+}
+
+typedef struct {
+    fatfs_device_t                   *dev;
+    sdmmc_host_t                      host;
+    sdmmc_slot_config_t               slot_config;
+    esp_vfs_fat_mount_config_t const *mount_config;
+} sd_mount_attempt_t;
+
+// A card that switched to 1.8V signalling before a UHS-I mode failed only goes back to 3.3V when it is power cycled,
+// so the slower modes after it may fail as well, see SD_MAX_BUS_MODE. The host side is put back to 3.3V, so the
+// slower modes do work with a card that turned the switch down.
+static void sd_restore_io_voltage(fatfs_device_t *dev) {
+#if SDCARD_PWR_CTRL_LDO_INTERNAL_IO
+    if (sd_pwr_ctrl_set_io_voltage(dev->pwr_ctrl_handle, 3300) != ESP_OK) {
+        ESP_LOGW("fatfs-sd", "Failed to put the SD IO voltage back to 3.3V");
+    }
+#endif
+}
+
+static bool sd_try_mount(void *ctx, filesystem_bus_mode_t mode, sd_card_desc_t *card) {
+    sd_mount_attempt_t *attempt     = ctx;
+    fatfs_device_t     *dev         = attempt->dev;
+    sd_host_settings_t  settings    = sd_speed_host_settings(mode);
+    sdmmc_host_t        host        = attempt->host;
+    sdmmc_slot_config_t slot_config = attempt->slot_config;
+
+    host.max_freq_khz = settings.freq_khz;
+    if (!settings.ddr) {
+        host.flags &= ~SDMMC_HOST_FLAG_DDR;
+    }
+    if (settings.uhs1) {
+        slot_config.flags |= SDMMC_SLOT_FLAG_UHS1;
+    }
+
+    esp_err_t err =
+        esp_vfs_fat_sdmmc_mount(dev->base_path, &host, &slot_config, attempt->mount_config, &dev->sdmmc_handle);
+    if (err != ESP_OK) {
+        ESP_LOGW("fatfs-sd", "Mounting at %s failed: %s", bus_mode_name(mode), esp_err_to_name(err));
+        dev->sdmmc_handle = NULL;
+        if (settings.uhs1) {
+            sd_restore_io_voltage(dev);
+        }
+        return false;
+    }
+
+    if (!sd_probe(dev)) {
+        ESP_LOGW("fatfs-sd", "Reads at %s failed, trying a slower mode", bus_mode_name(mode));
+        esp_vfs_fat_sdcard_unmount(dev->base_path, dev->sdmmc_handle);
+        dev->sdmmc_handle = NULL;
+        if (settings.uhs1) {
+            sd_restore_io_voltage(dev);
+        }
+        return false;
+    }
+
+    *card = (sd_card_desc_t){
+        .is_mmc        = dev->sdmmc_handle->is_mmc,
+        .is_sdio       = dev->sdmmc_handle->is_sdio,
+        .is_uhs1       = dev->sdmmc_handle->is_uhs1,
+        .is_ddr        = dev->sdmmc_handle->is_ddr,
+        .real_freq_khz = dev->sdmmc_handle->real_freq_khz,
+    };
+    return true;
+}
+
 device_t *fatfs_create_sd(char const *devname, bool rw) {
     esp_vfs_fat_mount_config_t const mount_config = {
         .max_files              = 256,
         .format_if_mount_failed = false,
-        .allocation_unit_size   = CONFIG_WL_SECTOR_SIZE,
+        .allocation_unit_size   = SD_ALLOCATION_UNIT_SIZE,
         .use_one_fat            = false,
     };
 
-    fatfs_device_t *dev = malloc(sizeof(fatfs_device_t));
+    fatfs_device_t *dev = calloc(1, sizeof(fatfs_device_t));
     dev->base_path      = malloc(strlen(devname) + 2);
     dev->base_path[0]   = '/';
     strcpy(dev->base_path + 1, devname);
+    dev->wl_handle            = WL_INVALID_HANDLE;
+    dev->sdmmc_handle         = NULL;
+    dev->cache                = NULL;
+    dev->max_transfer_sectors = SD_MAX_TRANSFER_SECTORS;
+    dev->allocation_unit      = mount_config.allocation_unit_size;
+
+    if (!fatfs_writeback_init(dev)) {
+        goto error;
+    }
 
     // Initialize base device
     device_t *base_dev = &dev->filesystem.device;
@@ -217,14 +815,6 @@ device_t *fatfs_create_sd(char const *devname, bool rw) {
     esp_err_t    err;
     sdmmc_host_t host = SDMMC_HOST_DEFAULT();
     host.slot         = SDMMC_HOST_SLOT_0;
-#if SDCARD_SDMMC_SPEED_HS
-    host.max_freq_khz = SDMMC_FREQ_HIGHSPEED;
-#elif SDCARD_SDMMC_SPEED_UHS_I_SDR50
-    host.max_freq_khz  = SDMMC_FREQ_SDR50;
-    host.flags        &= ~SDMMC_HOST_FLAG_DDR;
-#elif SDCARD_SDMMC_SPEED_UHS_I_DDR50
-    host.max_freq_khz = SDMMC_FREQ_DDR50;
-#endif
 
 #if SDCARD_PWR_CTRL_LDO_INTERNAL_IO
     sd_pwr_ctrl_ldo_config_t ldo_config = {
@@ -240,11 +830,8 @@ device_t *fatfs_create_sd(char const *devname, bool rw) {
 #endif
 
     sdmmc_slot_config_t slot_config = SDMMC_SLOT_CONFIG_DEFAULT();
-#if IS_UHS1
-    slot_config.flags |= SDMMC_SLOT_FLAG_UHS1;
-#endif
-    slot_config.gpio_cd = SDMMC_SLOT_NO_CD;
-    slot_config.gpio_wp = SDMMC_SLOT_NO_WP;
+    slot_config.gpio_cd             = SDMMC_SLOT_NO_CD;
+    slot_config.gpio_wp             = SDMMC_SLOT_NO_WP;
 
     // Set bus width to use:
     slot_config.width = 4;
@@ -258,8 +845,22 @@ device_t *fatfs_create_sd(char const *devname, bool rw) {
 #endif
     slot_config.flags |= SDMMC_SLOT_FLAG_INTERNAL_PULLUP;
 
-    err = esp_vfs_fat_sdmmc_mount(dev->base_path, &host, &slot_config, &mount_config, &dev->sdmmc_handle);
-    if (err != ESP_OK) {
+    // Switching to 1.8V signalling needs the on-chip LDO
+    sd_board_t const board = {
+        .uhs1         = SDCARD_PWR_CTRL_LDO_INTERNAL_IO,
+        .ddr          = host.flags & SDMMC_HOST_FLAG_DDR,
+        .max_freq_khz = SD_MAX_FREQ_KHZ,
+        .max_mode     = SD_MAX_BUS_MODE,
+    };
+    sd_mount_attempt_t attempt = {
+        .dev          = dev,
+        .host         = host,
+        .slot_config  = slot_config,
+        .mount_config = &mount_config,
+    };
+
+    dev->bus_mode = sd_speed_negotiate(&board, sd_try_mount, &attempt);
+    if (dev->bus_mode == FILESYSTEM_BUS_NONE) {
 #if SDCARD_PWR_CTRL_LDO_INTERNAL_IO
         // Deinitialize the power control driver if it was used
         err = sd_pwr_ctrl_del_on_chip_ldo(host.pwr_ctrl_handle);
@@ -272,6 +873,23 @@ device_t *fatfs_create_sd(char const *devname, bool rw) {
         goto error;
     }
 
+    ESP_LOGI(
+        "fatfs-sd",
+        "SD card running at %s, %i kHz, reads %" PRIu32 " KiB/s",
+        bus_mode_name(dev->bus_mode),
+        dev->sdmmc_handle->real_freq_khz,
+        dev->probe_read_kib_s
+    );
+
+    dev->cache_backend = (block_cache_backend_t){
+        .ctx          = dev,
+        .read         = sd_cache_read,
+        .write        = sd_cache_write,
+        .sector_size  = dev->sdmmc_handle->csd.sector_size,
+        .sector_count = dev->sdmmc_handle->csd.capacity,
+    };
+    fatfs_cache_attach(dev, ff_diskio_get_pdrv_card(dev->sdmmc_handle));
+
     // Initialize filesystem-specific functions
     filesystem_device_t *fs_dev = &dev->filesystem;
     fs_dev->_stat               = fatfs_stat;
@@ -283,11 +901,19 @@ device_t *fatfs_create_sd(char const *devname, bool rw) {
     fs_dev->_opendir            = fatfs_opendir;
     fs_dev->_readdir            = fatfs_readdir;
     fs_dev->_closedir           = fatfs_closedir;
+    fs_dev->_fsync              = fatfs_fsync;
+    fs_dev->_sync               = fatfs_sync;
+    fs_dev->_set_sync_policy    = fatfs_set_sync_policy;
+    fs_dev->_cache_stats        = fatfs_cache_stats;
+    fs_dev->_info               = fatfs_info;
 
     sdmmc_card_print_info(stdout, dev->sdmmc_handle);
 
     return (device_t *)dev;
 error:
+    if (dev->writeback_lock) {
+        vSemaphoreDelete(dev->writeback_lock);
+    }
     free(dev->base_path);
     free(dev);
     return NULL;
@@ -0,0 +1,89 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "sd_speed.h"
+
+static bool board_can(sd_board_t const *board, filesystem_bus_mode_t mode) {
+    if (mode > board->max_mode) {
+        return false;
+    }
+
+    sd_host_settings_t settings = sd_speed_host_settings(mode);
+    if (settings.freq_khz > board->max_freq_khz) {
+        return false;
+    }
+    if (settings.uhs1 && !board->uhs1) {
+        return false;
+    }
+    return !settings.ddr || board->ddr;
+}
+
+int sd_speed_candidates(sd_board_t const *board, filesystem_bus_mode_t *modes, int max_modes) {
+    int count = 0;
+
+    for (filesystem_bus_mode_t mode = FILESYSTEM_BUS_SD_UHS_SDR50; mode > FILESYSTEM_BUS_SD_DEFAULT; mode--) {
+        if (count < max_modes - 1 && board_can(board, mode)) {
+            modes[count++] = mode;
+        }
+    }
+
+    if (count < max_modes) {
+        modes[count++] = FILESYSTEM_BUS_SD_DEFAULT;
+    }
+    return count;
+}
+
+sd_host_settings_t sd_speed_host_settings(filesystem_bus_mode_t mode) {
+    switch (mode) {
+        case FILESYSTEM_BUS_SD_HIGH_SPEED: return (sd_host_settings_t){SD_FREQ_HIGHSPEED_KHZ, false, false};
+        case FILESYSTEM_BUS_SD_UHS_DDR50: return (sd_host_settings_t){SD_FREQ_DDR50_KHZ, true, true};
+        case FILESYSTEM_BUS_SD_UHS_SDR50: return (sd_host_settings_t){SD_FREQ_SDR50_KHZ, false, true};
+        default: return (sd_host_settings_t){SD_FREQ_DEFAULT_KHZ, false, false};
+    }
+}
+
+// The driver quietly settles for less than the host asked for when the card can't keep up, so the mode is worked
+// out from where it ended
+filesystem_bus_mode_t sd_speed_resolve(sd_card_desc_t const *card) {
+    if (!card->is_mmc && !card->is_sdio && card->is_uhs1) {
+        if (card->is_ddr) {
+            return FILESYSTEM_BUS_SD_UHS_DDR50;
+        }
+        if (card->real_freq_khz > SD_FREQ_DDR50_KHZ) {
+            return FILESYSTEM_BUS_SD_UHS_SDR50;
+        }
+    }
+
+    if (card->real_freq_khz >= SD_FREQ_HIGHSPEED_KHZ) {
+        return FILESYSTEM_BUS_SD_HIGH_SPEED;
+    }
+    return FILESYSTEM_BUS_SD_DEFAULT;
+}
+
+filesystem_bus_mode_t sd_speed_negotiate(sd_board_t const *board, sd_speed_try_fn try_mount, void *ctx) {
+    filesystem_bus_mode_t modes[SD_SPEED_MAX_CANDIDATES];
+    int                   count = sd_speed_candidates(board, modes, SD_SPEED_MAX_CANDIDATES);
+
+    for (int i = 0; i < count; i++) {
+        sd_card_desc_t card = {0};
+        if (try_mount(ctx, modes[i], &card)) {
+            return sd_speed_resolve(&card);
+        }
+    }
+
+    return FILESYSTEM_BUS_NONE;
+}
@@ -0,0 +1,65 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "badgevms/device.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// SD bus speed negotiation, kept apart from the SDMMC driver so it can be tested against made up cards
+
+#define SD_FREQ_DEFAULT_KHZ   20000
+#define SD_FREQ_HIGHSPEED_KHZ 40000
+#define SD_FREQ_DDR50_KHZ     50000
+#define SD_FREQ_SDR50_KHZ     100000
+
+#define SD_SPEED_MAX_CANDIDATES 4
+
+typedef struct {
+    bool                  uhs1;         // IO voltage can switch to 1.8V
+    bool                  ddr;          // Host can clock data on both edges
+    uint32_t              max_freq_khz; // What the board layout can take
+    filesystem_bus_mode_t max_mode;     // Configured limit
+} sd_board_t;
+
+// The parts of an initialized card that tell which mode it ended up in
+typedef struct {
+    bool     is_mmc;
+    bool     is_sdio;
+    bool     is_uhs1; // Accepted the switch to 1.8V signalling
+    bool     is_ddr;
+    uint32_t real_freq_khz;
+} sd_card_desc_t;
+
+typedef struct {
+    uint32_t freq_khz;
+    bool     ddr;
+    bool     uhs1;
+} sd_host_settings_t;
+
+// Mounts the card with the host set up for mode, returns true if it works well enough to keep, filling in card
+typedef bool (*sd_speed_try_fn)(void *ctx, filesystem_bus_mode_t mode, sd_card_desc_t *card);
+
+// Fills modes with what is worth trying on this board, fastest first and always ending with default speed
+int                   sd_speed_candidates(sd_board_t const *board, filesystem_bus_mode_t *modes, int max_modes);
+sd_host_settings_t    sd_speed_host_settings(filesystem_bus_mode_t mode);
+filesystem_bus_mode_t sd_speed_resolve(sd_card_desc_t const *card);
+
+// Tries the candidates in order until one mounts, returns the mode the card really runs at or FILESYSTEM_BUS_NONE
+filesystem_bus_mode_t sd_speed_negotiate(sd_board_t const *board, sd_speed_try_fn try_mount, void *ctx);
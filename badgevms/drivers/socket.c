@@ -18,10 +18,20 @@
 #include "socket.h"
 
 #include "esp_log.h"
-#include "task.h"
+#include "wait_queue.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
 #include <unistd.h>
 
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/poll.h>
+#include <sys/socket.h>
+
 #define TAG "socket"
 
 static int socket_open(void *dev, path_t *path, int flags, mode_t mode) {
@@ -46,8 +56,241 @@ static ssize_t socket_lseek(void *dev, int fd, off_t offset, int whence) {
     return (off_t)-1;
 }
 
+static short socket_poll(void *dev, int fd, short events, struct poll_waiter *waiter) {
+    struct pollfd pfd = {.fd = fd, .events = events};
+
+    poll_wait_fd(waiter, fd, events);
+    if (poll(&pfd, 1, 0) < 0) {
+        return POLLERR;
+    }
+    return pfd.revents;
+}
+
+// lwIP sizes its send buffers at build time and has no SO_SNDBUF, applications that set it get what is configured
+#ifdef CONFIG_LWIP_TCP_SND_BUF_DEFAULT
+#define SOCKET_SNDBUF CONFIG_LWIP_TCP_SND_BUF_DEFAULT
+#else
+#define SOCKET_SNDBUF 0
+#endif
+
+#define FAMILY_END (offsetof(struct sockaddr, sa_family) + sizeof(sa_family_t))
+
+static bool address_valid(struct sockaddr const *addr, socklen_t addrlen, bool unspec_ok) {
+    if (!addr || addrlen < FAMILY_END) {
+        errno = EINVAL;
+        return false;
+    }
+
+    switch (addr->sa_family) {
+        case AF_UNSPEC:
+            if (!unspec_ok) {
+                errno = EAFNOSUPPORT;
+                return false;
+            }
+            return true;
+        case AF_INET:
+            if (addrlen < sizeof(struct sockaddr_in)) {
+                errno = EINVAL;
+                return false;
+            }
+            return true;
+        case AF_INET6:
+            if (addrlen < sizeof(struct sockaddr_in6)) {
+                errno = EINVAL;
+                return false;
+            }
+            return true;
+        default: errno = EAFNOSUPPORT; return false;
+    }
+}
+
+static bool option_allowed(int level, int name, bool get) {
+    switch (level) {
+        case SOL_SOCKET:
+            switch (name) {
+                case SO_REUSEADDR:
+                case SO_KEEPALIVE:
+                case SO_BROADCAST:
+                case SO_LINGER:
+                case SO_RCVBUF:
+                case SO_SNDBUF:
+                case SO_RCVTIMEO:
+                case SO_SNDTIMEO: return true;
+                case SO_ERROR:
+                case SO_TYPE: return get;
+            }
+            return false;
+        case IPPROTO_TCP:
+            switch (name) {
+                case TCP_NODELAY:
+                case TCP_KEEPIDLE:
+                case TCP_KEEPINTVL:
+                case TCP_KEEPCNT: return true;
+            }
+            return false;
+        case IPPROTO_IP:
+            switch (name) {
+                case IP_TOS:
+                case IP_TTL:
+#ifdef IP_MULTICAST_TTL
+                case IP_MULTICAST_TTL:
+                case IP_MULTICAST_LOOP:
+                case IP_MULTICAST_IF:
+#endif
+#ifdef IP_ADD_MEMBERSHIP
+                case IP_ADD_MEMBERSHIP:
+                case IP_DROP_MEMBERSHIP:
+#endif
+                    return true;
+            }
+            return false;
+        case IPPROTO_IPV6: return name == IPV6_V6ONLY;
+    }
+    return false;
+}
+
+static int socket_socket(void *dev, int domain, int type, int protocol) {
+    if (domain != AF_INET && domain != AF_INET6) {
+        errno = EAFNOSUPPORT;
+        return -1;
+    }
+
+    switch (type) {
+        case SOCK_STREAM:
+            if (protocol != 0 && protocol != IPPROTO_TCP) {
+                errno = EPROTONOSUPPORT;
+                return -1;
+            }
+            break;
+        case SOCK_DGRAM:
+            if (protocol != 0 && protocol != IPPROTO_UDP) {
+                errno = EPROTONOSUPPORT;
+                return -1;
+            }
+            break;
+        default: errno = EPROTOTYPE; return -1;
+    }
+
+    return socket(domain, type, protocol);
+}
+
+static int socket_accept(void *dev, int fd, struct sockaddr *addr, socklen_t *addrlen) {
+    return accept(fd, addr, addrlen);
+}
+
+static int socket_bind(void *dev, int fd, struct sockaddr const *addr, socklen_t addrlen) {
+    if (!address_valid(addr, addrlen, false)) {
+        return -1;
+    }
+    return bind(fd, addr, addrlen);
+}
+
+static int socket_connect(void *dev, int fd, struct sockaddr const *addr, socklen_t addrlen) {
+    // Connecting a datagram socket to AF_UNSPEC dissolves the association
+    if (!address_valid(addr, addrlen, true)) {
+        return -1;
+    }
+    return connect(fd, addr, addrlen);
+}
+
+static int socket_listen(void *dev, int fd, int backlog) {
+    return listen(fd, backlog);
+}
+
+static int socket_shutdown(void *dev, int fd, int how) {
+    return shutdown(fd, how);
+}
+
+static int socket_getsockname(void *dev, int fd, struct sockaddr *addr, socklen_t *addrlen) {
+    return getsockname(fd, addr, addrlen);
+}
+
+static int socket_getpeername(void *dev, int fd, struct sockaddr *addr, socklen_t *addrlen) {
+    return getpeername(fd, addr, addrlen);
+}
+
+static ssize_t socket_sendto(
+    void *dev, int fd, void const *buf, size_t len, int flags, struct sockaddr const *addr, socklen_t addrlen
+) {
+    if (addr && !address_valid(addr, addrlen, false)) {
+        return -1;
+    }
+    return sendto(fd, buf, len, flags, addr, addrlen);
+}
+
+static ssize_t socket_recvfrom(
+    void *dev, int fd, void *buf, size_t len, int flags, struct sockaddr *addr, socklen_t *addrlen
+) {
+    return recvfrom(fd, buf, len, flags, addr, addrlen);
+}
+
+static ssize_t socket_sendmsg(void *dev, int fd, struct msghdr const *msg, int flags) {
+    if (!msg) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (msg->msg_name && !address_valid(msg->msg_name, msg->msg_namelen, false)) {
+        return -1;
+    }
+    return sendmsg(fd, msg, flags);
+}
+
+static ssize_t socket_recvmsg(void *dev, int fd, struct msghdr *msg, int flags) {
+    if (!msg) {
+        errno = EINVAL;
+        return -1;
+    }
+    return recvmsg(fd, msg, flags);
+}
+
+static int socket_setsockopt(void *dev, int fd, int level, int name, void const *value, socklen_t len) {
+    if (!option_allowed(level, name, false)) {
+        errno = ENOPROTOOPT;
+        return -1;
+    }
+
+    int ret = setsockopt(fd, level, name, value, len);
+    if (ret < 0 && errno == ENOPROTOOPT && level == SOL_SOCKET && name == SO_SNDBUF) {
+        if (!value || len < sizeof(int)) {
+            errno = EINVAL;
+            return -1;
+        }
+        return 0;
+    }
+    return ret;
+}
+
+static int socket_getsockopt(void *dev, int fd, int level, int name, void *value, socklen_t *len) {
+    if (!option_allowed(level, name, true)) {
+        errno = ENOPROTOOPT;
+        return -1;
+    }
+
+    int ret = getsockopt(fd, level, name, value, len);
+    if (ret < 0 && errno == ENOPROTOOPT && level == SOL_SOCKET && name == SO_SNDBUF) {
+        if (!value || !len || *len < sizeof(int)) {
+            errno = EINVAL;
+            return -1;
+        }
+        *(int *)value = SOCKET_SNDBUF;
+        *len          = sizeof(int);
+        return 0;
+    }
+    return ret;
+}
+
+static int socket_fcntl(void *dev, int fd, int cmd, int arg) {
+    switch (cmd) {
+        case F_GETFL: return fcntl(fd, F_GETFL, 0);
+        // lwIP only takes O_NONBLOCK, the access mode can't change anyway
+        case F_SETFL: return fcntl(fd, F_SETFL, arg & O_NONBLOCK);
+    }
+    errno = EINVAL;
+    return -1;
+}
+
 device_t *socket_create() {
-    socket_device_t *dev = (socket_device_t *)malloc(sizeof(socket_device_t));
+    socket_device_t *dev = (socket_device_t *)calloc(1, sizeof(socket_device_t));
     if (!dev) {
         ESP_LOGE(TAG, "Failed to allocate memory for socket device");
         return NULL;
@@ -61,6 +304,23 @@ device_t *socket_create() {
     base_dev->_write = socket_write;
     base_dev->_read  = socket_read;
     base_dev->_lseek = socket_lseek;
+    base_dev->_poll  = socket_poll;
+
+    dev->_socket      = socket_socket;
+    dev->_accept      = socket_accept;
+    dev->_bind        = socket_bind;
+    dev->_connect     = socket_connect;
+    dev->_listen      = socket_listen;
+    dev->_shutdown    = socket_shutdown;
+    dev->_getsockname = socket_getsockname;
+    dev->_getpeername = socket_getpeername;
+    dev->_sendto      = socket_sendto;
+    dev->_recvfrom    = socket_recvfrom;
+    dev->_sendmsg     = socket_sendmsg;
+    dev->_recvmsg     = socket_recvmsg;
+    dev->_setsockopt  = socket_setsockopt;
+    dev->_getsockopt  = socket_getsockopt;
+    dev->_fcntl       = socket_fcntl;
 
     return (device_t *)dev;
 }
\ No newline at end of file
@@ -16,16 +16,25 @@
 
 #include "tty.h"
 
+#include "badgevms_config.h"
 #include "freertos/FreeRTOS.h"
 #include "rom/uart.h"
+#include "wait_queue.h"
 
 #include <stdbool.h>
 #include <stdio.h>
 
+#include <sys/poll.h>
+
 typedef struct {
-    device_t device;
-    bool     is_stdout;
-    bool     is_stdin;
+    device_t     device;
+    bool         is_stdout;
+    bool         is_stdin;
+    // A character taken from the UART by tty_poll to see if there was one, handed out by the next read. The reader
+    // and pollers can be on different tasks, the UART is only touched with the lock held so characters stay in order.
+    portMUX_TYPE lock;
+    bool         has_pending;
+    uint8_t      pending;
 } tty_device_t;
 
 static int tty_open(void *dev, path_t *path, int flags, mode_t mode) {
@@ -51,16 +60,28 @@ static ssize_t tty_write(void *dev, int fd, void const *buf, size_t count) {
     return 0;
 }
 
+static bool tty_rx(tty_device_t *device, uint8_t *c) {
+    bool got = true;
+
+    portENTER_CRITICAL(&device->lock);
+    if (device->has_pending) {
+        device->has_pending = false;
+        *c                  = device->pending;
+    } else {
+        got = uart_rx_one_char(c) == ETS_OK;
+    }
+    portEXIT_CRITICAL(&device->lock);
+
+    return got;
+}
+
 static ssize_t tty_read(void *dev, int fd, void *buf, size_t count) {
     tty_device_t *device = dev;
 
     if (device->is_stdin) {
         uint8_t c;
-        while (1) {
-            ETS_STATUS s = uart_rx_one_char(&c);
-            if (s == ETS_OK)
-                break;
-            vTaskDelay(10 / portTICK_PERIOD_MS);
+        while (!tty_rx(device, &c)) {
+            vTaskDelay(TTY_POLL_INTERVAL_MS / portTICK_PERIOD_MS);
         }
         ((char *)buf)[0] = c;
         return 1;
@@ -68,12 +89,39 @@ static ssize_t tty_read(void *dev, int fd, void *buf, size_t count) {
     return 0;
 }
 
+// The ROM UART can't tell us when a character arrives, so pollers look again every TTY_POLL_INTERVAL_MS
+static short tty_poll(void *dev, int fd, short events, struct poll_waiter *waiter) {
+    tty_device_t *device  = dev;
+    short         revents = 0;
+
+    if (device->is_stdout) {
+        revents |= POLLOUT | POLLWRNORM;
+    }
+
+    if (device->is_stdin) {
+        portENTER_CRITICAL(&device->lock);
+        if (!device->has_pending && uart_rx_one_char(&device->pending) == ETS_OK) {
+            device->has_pending = true;
+        }
+        bool readable = device->has_pending;
+        portEXIT_CRITICAL(&device->lock);
+
+        if (readable) {
+            revents |= POLLIN | POLLRDNORM;
+        } else {
+            poll_recheck(waiter, TTY_POLL_INTERVAL_MS);
+        }
+    }
+
+    return revents;
+}
+
 static ssize_t tty_lseek(void *dev, int fd, off_t offset, int whence) {
     return (off_t)-1;
 }
 
 device_t *tty_create(bool is_stdout, bool is_stdin) {
-    tty_device_t *dev      = malloc(sizeof(tty_device_t));
+    tty_device_t *dev      = calloc(1, sizeof(tty_device_t));
     device_t     *base_dev = (device_t *)dev;
 
     base_dev->type   = DEVICE_TYPE_BLOCK;
@@ -82,9 +130,11 @@ device_t *tty_create(bool is_stdout, bool is_stdin) {
     base_dev->_write = tty_write;
     base_dev->_read  = tty_read;
     base_dev->_lseek = tty_lseek;
+    base_dev->_poll  = tty_poll;
 
     dev->is_stdout = is_stdout;
     dev->is_stdin  = is_stdin;
+    portMUX_INITIALIZE(&dev->lock);
 
     return (device_t *)dev;
 }
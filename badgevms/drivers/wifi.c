@@ -615,7 +615,7 @@ device_t *wifi_create() {
     ESP_LOGI(TAG, "Flashing C6");
     flash_slave_c6_if_needed();
 
-    wifi_device_t *dev      = malloc(sizeof(wifi_device_t));
+    wifi_device_t *dev      = calloc(1, sizeof(wifi_device_t));
     device_t      *base_dev = (device_t *)dev;
 
     base_dev->type   = DEVICE_TYPE_BLOCK;
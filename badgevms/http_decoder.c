@@ -0,0 +1,725 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#include "http_decoder.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define WINDOW_BYTES 32768
+#define MAX_BITS     15
+#define MAX_CODES    288
+#define ADLER_BASE   65521
+#define ADLER_NMAX   5552 // Bytes that can be summed before the sums have to be reduced
+
+#define GZIP_FHCRC    0x02
+#define GZIP_FEXTRA   0x04
+#define GZIP_FNAME    0x08
+#define GZIP_FCOMMENT 0x10
+#define GZIP_RESERVED 0xe0
+
+// Canonical Huffman code, symbols ordered by code length and then by value
+typedef struct {
+    uint16_t counts[MAX_BITS + 1];
+    uint16_t symbols[MAX_CODES];
+} huffman_t;
+
+typedef enum {
+    STATE_GZIP_HEADER,
+    STATE_GZIP_TIME,
+    STATE_GZIP_EXTRA_LENGTH,
+    STATE_GZIP_EXTRA,
+    STATE_GZIP_NAME,
+    STATE_GZIP_COMMENT,
+    STATE_GZIP_HEADER_CRC,
+    STATE_ZLIB_HEADER,
+    STATE_BLOCK_HEADER,
+    STATE_STORED_LENGTH,
+    STATE_STORED,
+    STATE_TABLE_COUNTS,
+    STATE_TABLE_CODE_LENGTHS,
+    STATE_TABLE_LENGTHS,
+    STATE_CODES,
+    STATE_GZIP_TRAILER,
+    STATE_GZIP_SIZE,
+    STATE_ZLIB_TRAILER,
+    STATE_DONE,
+    STATE_ERROR,
+} state_t;
+
+struct http_decoder {
+    http_encoding_t       encoding;
+    http_decoder_output_t output;
+    void                 *ctx;
+    state_t               state;
+    http_decoder_result_t result;
+
+    uint8_t const *in; // What is left of the input passed to http_decoder_write
+    size_t         in_len;
+    uint64_t       bits; // Input taken in but not used yet, first bit in the least significant one
+    int            bit_count;
+
+    bool     zlib;  // A deflate stream with the zlib wrapper
+    uint8_t  flags; // Optional gzip header fields still to come
+    uint32_t skip;  // Bytes left of a gzip extra field or a stored block
+    uint32_t crc;
+    uint32_t adler;
+    uint32_t total; // Output bytes modulo 2^32, as in the gzip trailer
+    bool     last;  // In the final block
+
+    int       lit_count;
+    int       dist_count;
+    int       code_length_count;
+    int       have; // Code lengths read so far
+    uint8_t   lengths[MAX_CODES + 32];
+    huffman_t code_lengths;
+    huffman_t litlen;
+    huffman_t dist;
+
+    size_t  pos;     // Where the next output byte goes in the window
+    size_t  flushed; // Window bytes before pos already handed out
+    bool    full;    // The window wrapped, all of it is history a match can refer to
+    uint8_t window[WINDOW_BYTES];
+};
+
+static uint16_t const length_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+};
+static uint8_t const length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0,
+};
+static uint16_t const dist_base[30] = {
+    1,   2,   3,   4,   5,   7,    9,    13,   17,   25,   33,   49,   65,    97,    129,
+    193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577,
+};
+static uint8_t const dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13,
+};
+static uint8_t const code_length_order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+static uint32_t const crc_nibbles[16] = {
+    0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+    0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+};
+
+static bool token_is(char const *token, size_t len, char const *expected) {
+    return len == strlen(expected) && strncasecmp(token, expected, len) == 0;
+}
+
+http_encoding_t http_encoding_parse(char const *value, size_t len) {
+    http_encoding_t encoding = HTTP_ENCODING_IDENTITY;
+    size_t          pos      = 0;
+
+    while (pos < len) {
+        while (pos < len && (value[pos] == ' ' || value[pos] == '\t' || value[pos] == ',')) {
+            pos++;
+        }
+        size_t start = pos;
+        while (pos < len && value[pos] != ' ' && value[pos] != '\t' && value[pos] != ',') {
+            pos++;
+        }
+
+        char const     *token     = value + start;
+        size_t          token_len = pos - start;
+        http_encoding_t coding;
+        if (!token_len || token_is(token, token_len, "identity")) {
+            continue;
+        } else if (token_is(token, token_len, "gzip") || token_is(token, token_len, "x-gzip")) {
+            coding = HTTP_ENCODING_GZIP;
+        } else if (token_is(token, token_len, "deflate")) {
+            coding = HTTP_ENCODING_DEFLATE;
+        } else {
+            return HTTP_ENCODING_UNSUPPORTED;
+        }
+
+        if (encoding != HTTP_ENCODING_IDENTITY) {
+            return HTTP_ENCODING_UNSUPPORTED;
+        }
+        encoding = coding;
+    }
+    return encoding;
+}
+
+static void checksum(http_decoder_t *d, uint8_t const *data, size_t len) {
+    if (d->encoding == HTTP_ENCODING_GZIP) {
+        uint32_t crc = ~d->crc;
+        for (size_t i = 0; i < len; i++) {
+            crc = crc_nibbles[(crc ^ data[i]) & 0x0f] ^ (crc >> 4);
+            crc = crc_nibbles[(crc ^ (data[i] >> 4)) & 0x0f] ^ (crc >> 4);
+        }
+        d->crc = ~crc;
+    } else if (d->zlib) {
+        uint32_t a = d->adler & 0xffff;
+        uint32_t b = d->adler >> 16;
+        while (len) {
+            size_t n  = len < ADLER_NMAX ? len : ADLER_NMAX;
+            len      -= n;
+            while (n--) {
+                a += *data++;
+                b += a;
+            }
+            a %= ADLER_BASE;
+            b %= ADLER_BASE;
+        }
+        d->adler = b << 16 | a;
+    }
+}
+
+static bool fail(http_decoder_t *d) {
+    d->state  = STATE_ERROR;
+    d->result = HTTP_DECODER_ERR_DATA;
+    return false;
+}
+
+// Hands out the window bytes produced since the last flush
+static bool flush(http_decoder_t *d) {
+    size_t         len  = d->pos - d->flushed;
+    uint8_t const *data = d->window + d->flushed;
+    if (!len) {
+        return true;
+    }
+
+    checksum(d, data, len);
+    d->total   += len;
+    d->flushed  = d->pos;
+    if (!d->output(d->ctx, data, len)) {
+        d->state  = STATE_ERROR;
+        d->result = HTTP_DECODER_ERR_ABORTED;
+        return false;
+    }
+
+    if (d->pos == WINDOW_BYTES) {
+        d->pos     = 0;
+        d->flushed = 0;
+        d->full    = true;
+    }
+    return true;
+}
+
+static inline bool put(http_decoder_t *d, uint8_t byte) {
+    d->window[d->pos++] = byte;
+    return d->pos < WINDOW_BYTES || flush(d);
+}
+
+static bool copy(http_decoder_t *d, int length, size_t distance) {
+    size_t from = (d->pos - distance) & (WINDOW_BYTES - 1);
+    while (length--) {
+        uint8_t byte = d->window[from];
+        from         = (from + 1) & (WINDOW_BYTES - 1);
+        if (!put(d, byte)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Takes input into the bit buffer until it holds more than any header field or symbol with its extra bits needs
+static void fill(http_decoder_t *d) {
+    while (d->bit_count <= 56 && d->in_len) {
+        d->bits      |= (uint64_t)*d->in++ << d->bit_count;
+        d->bit_count += 8;
+        d->in_len--;
+    }
+}
+
+static uint32_t peek(http_decoder_t const *d, int offset, int count) {
+    return (d->bits >> offset) & (((uint64_t)1 << count) - 1);
+}
+
+static void drop(http_decoder_t *d, int count) {
+    d->bits      >>= count;
+    d->bit_count  -= count;
+}
+
+// Takes count bits, of which the first 32 are returned, false if the input ran out first
+static bool take(http_decoder_t *d, int count, uint32_t *value) {
+    fill(d);
+    if (d->bit_count < count) {
+        return false;
+    }
+    *value = peek(d, 0, count);
+    drop(d, count);
+    return true;
+}
+
+// Returns the codes left over, negative if the lengths are over-subscribed and positive if they are incomplete
+static int build(huffman_t *h, uint8_t const *lengths, int n) {
+    uint16_t offsets[MAX_BITS + 1];
+
+    memset(h->counts, 0, sizeof(h->counts));
+    for (int i = 0; i < n; i++) {
+        h->counts[lengths[i]]++;
+    }
+    if (h->counts[0] == n) {
+        return 0;
+    }
+
+    int left = 1;
+    for (int len = 1; len <= MAX_BITS; len++) {
+        left <<= 1;
+        left  -= h->counts[len];
+        if (left < 0) {
+            return left;
+        }
+    }
+
+    offsets[1] = 0;
+    for (int len = 1; len < MAX_BITS; len++) {
+        offsets[len + 1] = offsets[len] + h->counts[len];
+    }
+    for (int i = 0; i < n; i++) {
+        if (lengths[i]) {
+            h->symbols[offsets[lengths[i]]++] = i;
+        }
+    }
+    return left;
+}
+
+// An incomplete code is only allowed when it is a single code of one bit
+static bool build_checked(huffman_t *h, uint8_t const *lengths, int n) {
+    int left = build(h, lengths, n);
+    return !left || (left > 0 && n == h->counts[0] + h->counts[1]);
+}
+
+// Returns the symbol whose code starts offset bits into the buffer, -1 if the buffered bits end within it and -2 if
+// there is no such code
+static int decode(http_decoder_t const *d, huffman_t const *h, int offset, int *length) {
+    uint64_t bits      = d->bits >> offset;
+    int      available = d->bit_count - offset;
+    int      code      = 0;
+    int      first     = 0;
+    int      index     = 0;
+
+    for (int len = 1; len <= MAX_BITS; len++) {
+        if (len > available) {
+            return -1;
+        }
+        code  |= bits & 1;
+        bits >>= 1;
+
+        int count = h->counts[len];
+        if (code - first < count) {
+            *length = len;
+            return h->symbols[index + code - first];
+        }
+        index  += count;
+        first   = (first + count) << 1;
+        code  <<= 1;
+    }
+    return -2;
+}
+
+static void fixed_tables(http_decoder_t *d) {
+    memset(d->lengths, 8, 144);
+    memset(d->lengths + 144, 9, 112);
+    memset(d->lengths + 256, 7, 24);
+    memset(d->lengths + 280, 8, 8);
+    build(&d->litlen, d->lengths, 288);
+
+    memset(d->lengths, 5, 30);
+    build(&d->dist, d->lengths, 30);
+}
+
+// Goes on with the next optional gzip header field present, or the deflate stream after them
+static void gzip_fields(http_decoder_t *d) {
+    if (d->flags & GZIP_FEXTRA) {
+        d->flags &= ~GZIP_FEXTRA;
+        d->state  = STATE_GZIP_EXTRA_LENGTH;
+    } else if (d->flags & GZIP_FNAME) {
+        d->flags &= ~GZIP_FNAME;
+        d->state  = STATE_GZIP_NAME;
+    } else if (d->flags & GZIP_FCOMMENT) {
+        d->flags &= ~GZIP_FCOMMENT;
+        d->state  = STATE_GZIP_COMMENT;
+    } else if (d->flags & GZIP_FHCRC) {
+        d->flags &= ~GZIP_FHCRC;
+        d->state  = STATE_GZIP_HEADER_CRC;
+    } else {
+        d->state = STATE_BLOCK_HEADER;
+    }
+}
+
+static void block_done(http_decoder_t *d) {
+    if (!d->last) {
+        d->state = STATE_BLOCK_HEADER;
+        return;
+    }
+
+    drop(d, d->bit_count & 7);
+    if (d->encoding == HTTP_ENCODING_GZIP) {
+        d->state = STATE_GZIP_TRAILER;
+    } else {
+        d->state = d->zlib ? STATE_ZLIB_TRAILER : STATE_DONE;
+    }
+}
+
+// Reads the lengths of the literal/length and distance codes, each in the code of the code lengths
+static bool table_lengths(http_decoder_t *d) {
+    int total = d->lit_count + d->dist_count;
+
+    while (d->have < total) {
+        int length;
+        fill(d);
+        int symbol = decode(d, &d->code_lengths, 0, &length);
+        if (symbol < 0) {
+            return symbol == -1 ? false : fail(d);
+        }
+        if (symbol < 16) {
+            drop(d, length);
+            d->lengths[d->have++] = symbol;
+            continue;
+        }
+
+        int extra = symbol == 16 ? 2 : symbol == 17 ? 3 : 7;
+        if (length + extra > d->bit_count) {
+            return false;
+        }
+        int repeat = (symbol == 18 ? 11 : 3) + peek(d, length, extra);
+        if ((symbol == 16 && !d->have) || d->have + repeat > total) {
+            return fail(d);
+        }
+        uint8_t repeated = symbol == 16 ? d->lengths[d->have - 1] : 0;
+        drop(d, length + extra);
+        memset(d->lengths + d->have, repeated, repeat);
+        d->have += repeat;
+    }
+
+    if (!d->lengths[256] || !build_checked(&d->litlen, d->lengths, d->lit_count) ||
+        !build_checked(&d->dist, d->lengths + d->lit_count, d->dist_count)) {
+        return fail(d);
+    }
+    d->state = STATE_CODES;
+    return true;
+}
+
+// Literals and matches up to the end of the block
+static bool codes(http_decoder_t *d) {
+    for (;;) {
+        int length;
+        fill(d);
+        int symbol = decode(d, &d->litlen, 0, &length);
+        if (symbol < 0) {
+            return symbol == -1 ? false : fail(d);
+        }
+        if (symbol < 256) {
+            drop(d, length);
+            if (!put(d, symbol)) {
+                return false;
+            }
+            continue;
+        }
+        if (symbol == 256) {
+            drop(d, length);
+            block_done(d);
+            return true;
+        }
+
+        // A match is only taken once all of it is in the bit buffer
+        symbol -= 257;
+        if (symbol >= 29) {
+            return fail(d);
+        }
+        int used = length + length_extra[symbol];
+        if (used > d->bit_count) {
+            return false;
+        }
+        int match = length_base[symbol] + peek(d, length, length_extra[symbol]);
+
+        int dist_length;
+        int dist = decode(d, &d->dist, used, &dist_length);
+        if (dist < 0) {
+            return dist == -1 ? false : fail(d);
+        }
+        if (dist >= 30) {
+            return fail(d);
+        }
+        int dist_used = used + dist_length + dist_extra[dist];
+        if (dist_used > d->bit_count) {
+            return false;
+        }
+        size_t distance = dist_base[dist] + peek(d, used + dist_length, dist_extra[dist]);
+        if (!d->full && distance > d->pos) {
+            return fail(d);
+        }
+
+        drop(d, dist_used);
+        if (!copy(d, match, distance)) {
+            return false;
+        }
+    }
+}
+
+static bool stored(http_decoder_t *d) {
+    // The block starts on a byte boundary, so the bit buffer holds whole bytes
+    while (d->skip && d->bit_count >= 8) {
+        uint8_t byte = peek(d, 0, 8);
+        drop(d, 8);
+        d->skip--;
+        if (!put(d, byte)) {
+            return false;
+        }
+    }
+
+    while (d->skip && d->in_len) {
+        size_t n = WINDOW_BYTES - d->pos;
+        if (n > d->skip) {
+            n = d->skip;
+        }
+        if (n > d->in_len) {
+            n = d->in_len;
+        }
+        memcpy(d->window + d->pos, d->in, n);
+        d->pos    += n;
+        d->in     += n;
+        d->in_len -= n;
+        d->skip   -= n;
+        if (d->pos == WINDOW_BYTES && !flush(d)) {
+            return false;
+        }
+    }
+
+    if (d->skip) {
+        return false;
+    }
+    block_done(d);
+    return true;
+}
+
+// Moves the stream along by a header field, a block or a trailer, returns false when it needs more input or stopped
+static bool step(http_decoder_t *d) {
+    uint32_t value;
+
+    switch (d->state) {
+        case STATE_GZIP_HEADER:
+            if (!take(d, 32, &value)) {
+                return false;
+            }
+            if ((value & 0xffffff) != 0x088b1f || (value >> 24) & GZIP_RESERVED) {
+                return fail(d);
+            }
+            d->flags = value >> 24;
+            d->state = STATE_GZIP_TIME;
+            return true;
+
+        case STATE_GZIP_TIME:
+            // Modification time, extra flags and operating system
+            if (!take(d, 48, &value)) {
+                return false;
+            }
+            gzip_fields(d);
+            return true;
+
+        case STATE_GZIP_EXTRA_LENGTH:
+            if (!take(d, 16, &value)) {
+                return false;
+            }
+            d->skip  = value;
+            d->state = STATE_GZIP_EXTRA;
+            return true;
+
+        case STATE_GZIP_EXTRA:
+            while (d->skip) {
+                if (!take(d, 8, &value)) {
+                    return false;
+                }
+                d->skip--;
+            }
+            gzip_fields(d);
+            return true;
+
+        case STATE_GZIP_NAME:
+        case STATE_GZIP_COMMENT:
+            do {
+                if (!take(d, 8, &value)) {
+                    return false;
+                }
+            } while (value);
+            gzip_fields(d);
+            return true;
+
+        case STATE_GZIP_HEADER_CRC:
+            if (!take(d, 16, &value)) {
+                return false;
+            }
+            gzip_fields(d);
+            return true;
+
+        case STATE_ZLIB_HEADER: {
+            fill(d);
+            if (d->bit_count < 16) {
+                return false;
+            }
+            // Anything that isn't a zlib header is taken to be the start of a bare deflate stream
+            uint32_t cmf = peek(d, 0, 8);
+            uint32_t flg = peek(d, 8, 8);
+            if ((cmf & 0x0f) == 8 && cmf >> 4 <= 7 && !(flg & 0x20) && (cmf << 8 | flg) % 31 == 0) {
+                drop(d, 16);
+                d->zlib  = true;
+                d->adler = 1;
+            }
+            d->state = STATE_BLOCK_HEADER;
+            return true;
+        }
+
+        case STATE_BLOCK_HEADER:
+            if (!take(d, 3, &value)) {
+                return false;
+            }
+            d->last = value & 1;
+            switch (value >> 1) {
+                case 0:
+                    drop(d, d->bit_count & 7);
+                    d->state = STATE_STORED_LENGTH;
+                    break;
+                case 1:
+                    fixed_tables(d);
+                    d->state = STATE_CODES;
+                    break;
+                case 2:
+                    d->state = STATE_TABLE_COUNTS;
+                    break;
+                default:
+                    return fail(d);
+            }
+            return true;
+
+        case STATE_STORED_LENGTH:
+            if (!take(d, 32, &value)) {
+                return false;
+            }
+            if ((value & 0xffff) != (~value >> 16 & 0xffff)) {
+                return fail(d);
+            }
+            d->skip  = value & 0xffff;
+            d->state = STATE_STORED;
+            return true;
+
+        case STATE_STORED: return stored(d);
+
+        case STATE_TABLE_COUNTS:
+            if (!take(d, 14, &value)) {
+                return false;
+            }
+            d->lit_count         = 257 + (value & 0x1f);
+            d->dist_count        = 1 + (value >> 5 & 0x1f);
+            d->code_length_count = 4 + (value >> 10);
+            if (d->lit_count > 286 || d->dist_count > 30) {
+                return fail(d);
+            }
+            memset(d->lengths, 0, sizeof(code_length_order));
+            d->have  = 0;
+            d->state = STATE_TABLE_CODE_LENGTHS;
+            return true;
+
+        case STATE_TABLE_CODE_LENGTHS:
+            while (d->have < d->code_length_count) {
+                if (!take(d, 3, &value)) {
+                    return false;
+                }
+                d->lengths[code_length_order[d->have++]] = value;
+            }
+            if (build(&d->code_lengths, d->lengths, sizeof(code_length_order)) != 0) {
+                return fail(d);
+            }
+            d->have  = 0;
+            d->state = STATE_TABLE_LENGTHS;
+            return true;
+
+        case STATE_TABLE_LENGTHS: return table_lengths(d);
+
+        case STATE_CODES: return codes(d);
+
+        case STATE_GZIP_TRAILER:
+            if (!flush(d) || !take(d, 32, &value)) {
+                return false;
+            }
+            if (value != d->crc) {
+                return fail(d);
+            }
+            d->state = STATE_GZIP_SIZE;
+            return true;
+
+        case STATE_GZIP_SIZE:
+            if (!take(d, 32, &value)) {
+                return false;
+            }
+            if (value != d->total) {
+                return fail(d);
+            }
+            d->state = STATE_DONE;
+            return true;
+
+        case STATE_ZLIB_TRAILER:
+            if (!flush(d) || !take(d, 32, &value)) {
+                return false;
+            }
+            if (__builtin_bswap32(value) != d->adler) {
+                return fail(d);
+            }
+            d->state = STATE_DONE;
+            return true;
+
+        case STATE_DONE:
+            d->in_len = 0;
+            return false;
+
+        default: return false;
+    }
+}
+
+http_decoder_t *http_decoder_create(http_encoding_t encoding, http_decoder_output_t output, void *ctx) {
+    if (encoding != HTTP_ENCODING_GZIP && encoding != HTTP_ENCODING_DEFLATE) {
+        return NULL;
+    }
+
+    http_decoder_t *d = malloc(sizeof(http_decoder_t));
+    if (!d) {
+        return NULL;
+    }
+
+    memset(d, 0, offsetof(http_decoder_t, window));
+    d->encoding = encoding;
+    d->output   = output;
+    d->ctx      = ctx;
+    d->state    = encoding == HTTP_ENCODING_GZIP ? STATE_GZIP_HEADER : STATE_ZLIB_HEADER;
+    return d;
+}
+
+void http_decoder_destroy(http_decoder_t *decoder) {
+    free(decoder);
+}
+
+http_decoder_result_t http_decoder_write(http_decoder_t *decoder, void const *data, size_t len) {
+    decoder->in     = data;
+    decoder->in_len = len;
+    while (step(decoder)) {
+    }
+    if (decoder->state != STATE_ERROR) {
+        flush(decoder);
+    }
+    decoder->in     = NULL;
+    decoder->in_len = 0;
+    return decoder->result;
+}
+
+bool http_decoder_finished(http_decoder_t const *decoder) {
+    return decoder->state == STATE_DONE;
+}
@@ -0,0 +1,57 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Undoes the Content-Encoding of an HTTP response body while it streams in. gzip and deflate are inflated into a window
+// of the last 32KiB of output, which is also what is handed to the output callback, so nothing else is buffered.
+
+typedef enum {
+    HTTP_ENCODING_IDENTITY,
+    HTTP_ENCODING_GZIP,
+    HTTP_ENCODING_DEFLATE, // zlib wrapped, or bare deflate as some servers send it
+    HTTP_ENCODING_UNSUPPORTED,
+} http_encoding_t;
+
+typedef enum {
+    HTTP_DECODER_OK,
+    HTTP_DECODER_ERR_DATA,    // Not a valid stream or the checksum doesn't match
+    HTTP_DECODER_ERR_ABORTED, // The output callback returned false
+} http_decoder_result_t;
+
+// Return false to stop decoding
+typedef bool (*http_decoder_output_t)(void *ctx, void const *data, size_t len);
+
+typedef struct http_decoder http_decoder_t;
+
+// The encoding of a Content-Encoding header value, lists of more than one coding other than identity are unsupported
+http_encoding_t http_encoding_parse(char const *value, size_t len);
+
+// Returns NULL for encodings other than gzip and deflate or without memory
+http_decoder_t *http_decoder_create(http_encoding_t encoding, http_decoder_output_t output, void *ctx);
+void            http_decoder_destroy(http_decoder_t *decoder);
+
+// Decodes the next part of the body, output is passed on before this returns. Errors stick, anything after the end of
+// the stream is ignored.
+http_decoder_result_t http_decoder_write(http_decoder_t *decoder, void const *data, size_t len);
+
+// True once the end of the stream went by, checksum included
+bool http_decoder_finished(http_decoder_t const *decoder);
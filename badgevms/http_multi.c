@@ -0,0 +1,1088 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "http_multi.h"
+
+#include "badgevms_config.h"
+#include "esp_timer.h"
+#include "http_decoder.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <sys/select.h>
+
+typedef struct conn {
+    struct conn    *next; // In the idle list, most recently used first
+    http_pool_key_t key;
+    void           *handle;
+    int64_t         idle_since;
+} conn_t;
+
+typedef enum {
+    STATE_PENDING,
+    STATE_CONNECTING,
+    STATE_SENDING,
+    STATE_HEADERS,
+    STATE_BODY,
+    STATE_DONE,
+} state_t;
+
+typedef enum {
+    BODY_NONE,
+    BODY_LENGTH,
+    BODY_CHUNKED,
+    BODY_CLOSE, // Ends when the server closes the connection
+} body_t;
+
+typedef enum {
+    CHUNK_SIZE,
+    CHUNK_DATA,
+    CHUNK_DATA_END,
+    CHUNK_TRAILER,
+} chunk_t;
+
+typedef struct transfer {
+    struct transfer     *next;
+    http_multi_request_t request;
+    state_t              state;
+    char                *url;
+    char                *method;
+    char                *headers;
+    bool                 send_body;
+    http_pool_key_t      key;
+    bool                 key_valid;
+    int64_t              deadline; // 0 for none
+
+    conn_t *conn;
+    bool    fresh;   // Don't take a kept-alive connection
+    bool    reused;  // The connection was kept alive, it may have been closed by the server in the meantime
+    bool    retried; // Already sent again after finding the connection closed
+    int     wait;    // HTTP_MULTI_WANT_READ or _WRITE, 0 if the transfer can go on right away
+    int     redirects;
+    int     connects;
+
+    char  *tx;
+    size_t tx_len;
+    size_t tx_done;
+    char  *rx;
+    size_t rx_len;
+    bool   got_response;
+
+    bool            status_seen;
+    int             status;
+    bool            keep_alive;
+    bool            chunked;
+    bool            transfer_encoded;
+    bool            redirect;
+    body_t          body;
+    chunk_t         chunk;
+    int64_t         content_length;
+    int64_t         remaining;
+    char           *location;
+    http_encoding_t encoding;
+    http_decoder_t *decoder;
+
+    http_multi_result_t result;
+    uint32_t            message; // Order in which messages are read, 0 if there is none
+} transfer_t;
+
+struct http_multi {
+    http_multi_transport_t transport;
+    void                  *ctx;
+    int                    max_total;
+    int                    max_per_host;
+    transfer_t            *transfers; // In the order they were added
+    conn_t                *idle;
+    int                    idle_count;
+    int                    running; // Transfers holding a connection
+    uint32_t               messages;
+    http_multi_stats_t     stats;
+};
+
+static int64_t now_us(void) {
+    return esp_timer_get_time();
+}
+
+static bool same_host(http_pool_key_t const *a, http_pool_key_t const *b) {
+    return a->https == b->https && a->port == b->port && strcmp(a->host, b->host) == 0;
+}
+
+static bool holds_connection(transfer_t const *t) {
+    return t->state >= STATE_CONNECTING && t->state <= STATE_BODY;
+}
+
+static void set_url(transfer_t *t, char *url) {
+    free(t->url);
+    t->url       = url;
+    t->key_valid = url && http_pool_key_from_url(&t->key, url, t->request.config);
+}
+
+static void free_buffers(transfer_t *t) {
+    free(t->tx);
+    free(t->rx);
+    free(t->location);
+    http_decoder_destroy(t->decoder);
+    t->tx       = NULL;
+    t->rx       = NULL;
+    t->location = NULL;
+    t->decoder  = NULL;
+}
+
+static void free_transfer(transfer_t *t) {
+    free_buffers(t);
+    free(t->url);
+    free(t->method);
+    free(t->headers);
+    free(t);
+}
+
+static void close_idle(http_multi_t *multi, conn_t **link) {
+    conn_t *conn = *link;
+    *link        = conn->next;
+    multi->idle_count--;
+    multi->transport.close(conn->handle);
+    free(conn);
+}
+
+static void close_oldest_idle(http_multi_t *multi) {
+    conn_t **link = &multi->idle;
+    while ((*link)->next) {
+        link = &(*link)->next;
+    }
+    close_idle(multi, link);
+}
+
+static void release_connection(http_multi_t *multi, transfer_t *t, bool keep) {
+    conn_t *conn = t->conn;
+    if (!conn) {
+        return;
+    }
+
+    t->conn = NULL;
+    multi->running--;
+
+    if (!keep) {
+        multi->transport.close(conn->handle);
+        free(conn);
+        return;
+    }
+
+    conn->idle_since = now_us();
+    conn->next       = multi->idle;
+    multi->idle      = conn;
+    multi->idle_count++;
+    while (multi->max_total && multi->idle && multi->running + multi->idle_count > multi->max_total) {
+        close_oldest_idle(multi);
+    }
+}
+
+static void finish(http_multi_t *multi, transfer_t *t, http_multi_result_t result) {
+    release_connection(multi, t, false);
+    t->state   = STATE_DONE;
+    t->result  = result;
+    t->message = ++multi->messages;
+
+    if (t->request.done) {
+        http_multi_response_t response = {
+            .status         = t->status,
+            .content_length = t->content_length,
+            .connects       = t->connects,
+            .url            = t->url,
+        };
+        t->request.done(t->request.user_data, result, &response);
+    }
+}
+
+// A kept-alive connection the server closed before the request got there is only noticed when using it, the request
+// is sent again over a new one
+static void fail(http_multi_t *multi, transfer_t *t, http_multi_result_t result) {
+    bool io_error = result == HTTP_MULTI_ERR_SEND || result == HTTP_MULTI_ERR_RECV;
+    if (t->reused && !t->got_response && !t->retried && io_error) {
+        release_connection(multi, t, false);
+        multi->stats.retried++;
+        t->retried = true;
+        t->fresh   = true;
+        t->state   = STATE_PENDING;
+        return;
+    }
+    finish(multi, t, result);
+}
+
+static int host_running(http_multi_t *multi, http_pool_key_t const *key) {
+    int count = 0;
+    for (transfer_t *t = multi->transfers; t; t = t->next) {
+        if (holds_connection(t) && same_host(&t->key, key)) {
+            count++;
+        }
+    }
+    return count;
+}
+
+static conn_t **find_idle(http_multi_t *multi, http_pool_key_t const *key) {
+    for (conn_t **link = &multi->idle; *link; link = &(*link)->next) {
+        if (same_host(&(*link)->key, key) && (*link)->key.config == key->config) {
+            return link;
+        }
+    }
+    return NULL;
+}
+
+static bool can_start(http_multi_t *multi, transfer_t *t) {
+    if (!t->key_valid) {
+        return true;
+    }
+    if (multi->max_per_host && host_running(multi, &t->key) >= multi->max_per_host) {
+        return false;
+    }
+    if (!t->fresh && find_idle(multi, &t->key)) {
+        return true;
+    }
+    return !multi->max_total || multi->running < multi->max_total;
+}
+
+static bool has_header(char const *headers, char const *name) {
+    size_t len = strlen(name);
+    for (char const *line = headers; line && *line; line = strchr(line, '\n')) {
+        if (*line == '\n') {
+            line++;
+        }
+        if (strncasecmp(line, name, len) == 0 && line[len] == ':') {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool build_request(transfer_t *t) {
+    char const *authority = strstr(t->url, "://") + 3;
+    char const *path      = authority + strcspn(authority, "/?#");
+    int         path_len  = strcspn(path, "#");
+    char const *slash     = *path == '/' ? "" : "/";
+
+    char port[8] = "";
+    if (t->key.port != (t->key.https ? 443 : 80)) {
+        snprintf(port, sizeof(port), ":%u", t->key.port);
+    }
+
+    char const *method  = t->method ? t->method : "GET";
+    char const *headers = t->headers ? t->headers : "";
+    bool        host    = !has_header(headers, "Host");
+    size_t      body    = t->send_body ? t->request.body_len : 0;
+
+    char length[40] = "";
+    if (body || strcmp(method, "POST") == 0 || strcmp(method, "PUT") == 0 || strcmp(method, "PATCH") == 0) {
+        snprintf(length, sizeof(length), "Content-Length: %zu\r\n", body);
+    }
+
+    char const *format = "%s %s%.*s HTTP/1.1\r\n%s%s%s%s%s%s%s\r\n";
+    int         len    = snprintf(
+        NULL,
+        0,
+        format,
+        method,
+        slash,
+        path_len,
+        path,
+        host ? "Host: " : "",
+        host ? t->key.host : "",
+        host ? port : "",
+        host ? "\r\n" : "",
+        length,
+        t->request.forbid_reuse ? "Connection: close\r\n" : "",
+        headers
+    );
+
+    free(t->tx);
+    t->tx = malloc(len + 1 + body);
+    if (!t->tx) {
+        return false;
+    }
+
+    snprintf(
+        t->tx,
+        len + 1,
+        format,
+        method,
+        slash,
+        path_len,
+        path,
+        host ? "Host: " : "",
+        host ? t->key.host : "",
+        host ? port : "",
+        host ? "\r\n" : "",
+        length,
+        t->request.forbid_reuse ? "Connection: close\r\n" : "",
+        headers
+    );
+    if (body) {
+        memcpy(t->tx + len, t->request.body, body);
+    }
+    t->tx_len  = len + body;
+    t->tx_done = 0;
+    return true;
+}
+
+// Returns true if the transfer left the pending state, with a connection or done
+static bool start(http_multi_t *multi, transfer_t *t) {
+    if (!t->key_valid) {
+        finish(multi, t, HTTP_MULTI_ERR_URL);
+        return true;
+    }
+
+    if (!can_start(multi, t)) {
+        return false;
+    }
+
+    if (!build_request(t) || (!t->rx && !(t->rx = malloc(HTTP_MULTI_BUFFER_BYTES)))) {
+        finish(multi, t, HTTP_MULTI_ERR_NO_MEM);
+        return true;
+    }
+
+    conn_t **idle = t->fresh ? NULL : find_idle(multi, &t->key);
+    if (idle) {
+        t->conn = *idle;
+        *idle   = t->conn->next;
+        multi->idle_count--;
+        t->reused = true;
+        t->state  = STATE_SENDING;
+        multi->stats.reused++;
+    } else {
+        while (multi->max_total && multi->idle && multi->running + multi->idle_count >= multi->max_total) {
+            close_oldest_idle(multi);
+        }
+
+        conn_t *conn = calloc(1, sizeof(conn_t));
+        if (!conn) {
+            finish(multi, t, HTTP_MULTI_ERR_NO_MEM);
+            return true;
+        }
+
+        conn->key    = t->key;
+        conn->handle = multi->transport.open(multi->ctx, &t->key, t->request.user_data);
+        if (!conn->handle) {
+            free(conn);
+            finish(multi, t, HTTP_MULTI_ERR_CONNECT);
+            return true;
+        }
+
+        t->conn   = conn;
+        t->reused = false;
+        t->state  = STATE_CONNECTING;
+        t->connects++;
+        multi->stats.opened++;
+    }
+
+    multi->running++;
+    if (multi->running > (int)multi->stats.max_running) {
+        multi->stats.max_running = multi->running;
+    }
+
+    t->wait           = 0;
+    t->rx_len         = 0;
+    t->got_response   = false;
+    t->status_seen    = false;
+    t->status         = 0;
+    t->content_length = -1;
+    return true;
+}
+
+static char *resolve_location(char const *base, char const *location) {
+    if (strncasecmp(location, "http://", 7) == 0 || strncasecmp(location, "https://", 8) == 0) {
+        return strdup(location);
+    }
+
+    char const *authority = strstr(base, "://") + 3;
+    char const *path      = authority + strcspn(authority, "/?#");
+    size_t      keep;
+
+    if (location[0] == '/' && location[1] == '/') {
+        keep = authority - base - 2;
+    } else if (location[0] == '/') {
+        keep = path - base;
+    } else if (location[0] == '?') {
+        keep = path - base + strcspn(path, "?#");
+    } else {
+        char const *end   = path + strcspn(path, "?#");
+        char const *slash = NULL;
+        for (char const *p = path; p < end; p++) {
+            if (*p == '/') {
+                slash = p;
+            }
+        }
+        keep = slash ? slash + 1 - base : path - base;
+    }
+
+    bool   add_slash = location[0] != '/' && location[0] != '?' && base + keep == path;
+    size_t len       = keep + add_slash + strlen(location);
+    char  *url       = malloc(len + 1);
+    if (url) {
+        memcpy(url, base, keep);
+        if (add_slash) {
+            url[keep] = '/';
+        }
+        strcpy(url + keep + add_slash, location);
+    }
+    return url;
+}
+
+// The response is in, the transfer is done or goes back to pending to follow a redirect
+static void complete(http_multi_t *multi, transfer_t *t) {
+    bool keep = t->keep_alive && !t->request.forbid_reuse && t->body != BODY_CLOSE;
+
+    if (!t->redirect) {
+        if (t->decoder && !http_decoder_finished(t->decoder)) {
+            finish(multi, t, HTTP_MULTI_ERR_ENCODING);
+            return;
+        }
+        release_connection(multi, t, keep);
+        finish(multi, t, HTTP_MULTI_OK);
+        return;
+    }
+
+    if (t->request.max_redirects >= 0 && t->redirects >= t->request.max_redirects) {
+        finish(multi, t, HTTP_MULTI_ERR_REDIRECTS);
+        return;
+    }
+
+    char *url = resolve_location(t->url, t->location);
+    if (!url) {
+        finish(multi, t, HTTP_MULTI_ERR_NO_MEM);
+        return;
+    }
+
+    release_connection(multi, t, keep);
+    set_url(t, url);
+    t->redirects++;
+
+    bool head = t->method && strcmp(t->method, "HEAD") == 0;
+    bool post = t->method && strcmp(t->method, "POST") == 0;
+    if ((t->status == 303 && !head) || ((t->status == 301 || t->status == 302) && post)) {
+        free(t->method);
+        t->method    = NULL;
+        t->send_body = false;
+    }
+
+    t->fresh   = t->request.fresh_connect;
+    t->retried = false;
+    t->state   = STATE_PENDING;
+}
+
+static bool value_is(char const *value, size_t len, char const *expected) {
+    return len == strlen(expected) && strncasecmp(value, expected, len) == 0;
+}
+
+static bool value_has(char const *value, size_t len, char const *token) {
+    size_t token_len = strlen(token);
+    for (size_t i = 0; i + token_len <= len; i++) {
+        if (strncasecmp(value + i, token, token_len) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Whether the last element of a comma separated list is token
+static bool value_ends_with(char const *value, size_t len, char const *token) {
+    size_t start = len;
+    while (start && value[start - 1] != ',') {
+        start--;
+    }
+    while (start < len && (value[start] == ' ' || value[start] == '\t')) {
+        start++;
+    }
+    return value_is(value + start, len - start, token);
+}
+
+static bool decoded(void *ctx, void const *data, size_t len) {
+    transfer_t *t = ctx;
+    return !t->request.data || t->request.data(t->request.user_data, data, len);
+}
+
+// Returns false if the transfer stopped reading
+static bool headers_done(http_multi_t *multi, transfer_t *t) {
+    if (t->status < 200) {
+        t->status_seen = false;
+        return true;
+    }
+
+    bool head  = t->method && strcmp(t->method, "HEAD") == 0;
+    t->redirect = t->request.max_redirects != 0 && t->location &&
+                  (t->status == 301 || t->status == 302 || t->status == 303 || t->status == 307 || t->status == 308);
+
+    if (!t->redirect && t->request.resume_from > 0 && t->status == 200) {
+        finish(multi, t, HTTP_MULTI_ERR_RANGE);
+        return false;
+    }
+
+    if (head || t->status == 204 || t->status == 304) {
+        t->body = BODY_NONE;
+    } else if (t->chunked) {
+        t->body  = BODY_CHUNKED;
+        t->chunk = CHUNK_SIZE;
+        // A length next to chunked was not meant for this client, and whatever follows on the connection isn't either
+        if (t->content_length >= 0) {
+            t->content_length = -1;
+            t->keep_alive     = false;
+        }
+    } else if (t->transfer_encoded) {
+        t->body = BODY_CLOSE;
+    } else if (t->content_length >= 0) {
+        t->body      = BODY_LENGTH;
+        t->remaining = t->content_length;
+    } else {
+        t->body = BODY_CLOSE;
+    }
+
+    if (t->body == BODY_NONE || (t->body == BODY_LENGTH && t->remaining == 0)) {
+        complete(multi, t);
+        return false;
+    }
+
+    if (t->request.decode && !t->redirect && t->encoding != HTTP_ENCODING_IDENTITY) {
+        if (t->encoding == HTTP_ENCODING_UNSUPPORTED) {
+            finish(multi, t, HTTP_MULTI_ERR_ENCODING);
+            return false;
+        }
+        t->decoder = http_decoder_create(t->encoding, decoded, t);
+        if (!t->decoder) {
+            finish(multi, t, HTTP_MULTI_ERR_NO_MEM);
+            return false;
+        }
+    }
+
+    t->state = STATE_BODY;
+    return true;
+}
+
+static bool header_line(http_multi_t *multi, transfer_t *t, char const *line, size_t len) {
+    if (!t->status_seen) {
+        if (len < 12 || strncmp(line, "HTTP/1.", 7) != 0 || line[8] != ' ' || !isdigit((unsigned char)line[9]) ||
+            !isdigit((unsigned char)line[10]) || !isdigit((unsigned char)line[11])) {
+            finish(multi, t, HTTP_MULTI_ERR_PROTOCOL);
+            return false;
+        }
+        t->status_seen      = true;
+        t->status           = (line[9] - '0') * 100 + (line[10] - '0') * 10 + (line[11] - '0');
+        t->keep_alive       = line[7] != '0';
+        t->chunked          = false;
+        t->transfer_encoded = false;
+        t->content_length   = -1;
+        t->encoding         = HTTP_ENCODING_IDENTITY;
+        free(t->location);
+        t->location = NULL;
+        return true;
+    }
+
+    if (len == 0) {
+        return headers_done(multi, t);
+    }
+
+    if (t->status < 200) {
+        return true;
+    }
+
+    if (t->request.header && !t->request.header(t->request.user_data, line, len)) {
+        finish(multi, t, HTTP_MULTI_ERR_ABORTED);
+        return false;
+    }
+
+    char const *colon = memchr(line, ':', len);
+    if (!colon) {
+        return true;
+    }
+
+    size_t      name_len  = colon - line;
+    char const *value     = colon + 1;
+    size_t      value_len = len - name_len - 1;
+    while (value_len && (*value == ' ' || *value == '\t')) {
+        value++;
+        value_len--;
+    }
+    while (value_len && (value[value_len - 1] == ' ' || value[value_len - 1] == '\t')) {
+        value_len--;
+    }
+
+    if (value_is(line, name_len, "Content-Length")) {
+        int64_t length = 0;
+        for (size_t i = 0; i < value_len; i++) {
+            if (!isdigit((unsigned char)value[i]) || length > INT64_MAX / 10 - 9) {
+                finish(multi, t, HTTP_MULTI_ERR_PROTOCOL);
+                return false;
+            }
+            length = length * 10 + (value[i] - '0');
+        }
+        // The same length twice is allowed, different ones leave no way to tell where the body ends
+        if (!value_len || (t->content_length >= 0 && t->content_length != length)) {
+            finish(multi, t, HTTP_MULTI_ERR_PROTOCOL);
+            return false;
+        }
+        t->content_length = length;
+    } else if (value_is(line, name_len, "Transfer-Encoding")) {
+        // Unless chunked is the last coding the body goes on until the connection closes
+        t->transfer_encoded = true;
+        t->chunked          = value_ends_with(value, value_len, "chunked");
+    } else if (value_is(line, name_len, "Content-Encoding")) {
+        t->encoding = http_encoding_parse(value, value_len);
+    } else if (value_is(line, name_len, "Connection")) {
+        if (value_has(value, value_len, "close")) {
+            t->keep_alive = false;
+        } else if (value_has(value, value_len, "keep-alive")) {
+            t->keep_alive = true;
+        }
+    } else if (value_is(line, name_len, "Location")) {
+        free(t->location);
+        t->location = malloc(value_len + 1);
+        if (!t->location) {
+            finish(multi, t, HTTP_MULTI_ERR_NO_MEM);
+            return false;
+        }
+        memcpy(t->location, value, value_len);
+        t->location[value_len] = '\0';
+    }
+    return true;
+}
+
+static bool deliver(http_multi_t *multi, transfer_t *t, char const *data, size_t len) {
+    if (t->redirect || !len) {
+        return true;
+    }
+
+    if (t->decoder) {
+        http_decoder_result_t result = http_decoder_write(t->decoder, data, len);
+        if (result == HTTP_DECODER_OK) {
+            return true;
+        }
+        finish(multi, t, result == HTTP_DECODER_ERR_ABORTED ? HTTP_MULTI_ERR_ABORTED : HTTP_MULTI_ERR_ENCODING);
+        return false;
+    }
+
+    if (!t->request.data || t->request.data(t->request.user_data, data, len)) {
+        return true;
+    }
+    finish(multi, t, HTTP_MULTI_ERR_ABORTED);
+    return false;
+}
+
+// Consumes the complete lines and body bytes in rx, returns false if the transfer stopped reading
+static bool process(http_multi_t *multi, transfer_t *t) {
+    size_t pos = 0;
+    bool   go  = true;
+
+    while (go && pos < t->rx_len) {
+        char  *data  = t->rx + pos;
+        size_t avail = t->rx_len - pos;
+        char  *nl    = NULL;
+        size_t line  = 0;
+
+        bool needs_line = t->state == STATE_HEADERS || (t->body == BODY_CHUNKED && t->chunk != CHUNK_DATA);
+        if (needs_line) {
+            nl = memchr(data, '\n', avail);
+            if (!nl) {
+                break;
+            }
+            line = nl - data;
+            if (line && data[line - 1] == '\r') {
+                line--;
+            }
+            pos += nl - data + 1;
+        }
+
+        if (t->state == STATE_HEADERS) {
+            go = header_line(multi, t, data, line);
+            continue;
+        }
+
+        switch (t->body) {
+            case BODY_LENGTH: {
+                size_t n = (int64_t)avail < t->remaining ? avail : (size_t)t->remaining;
+                pos          += n;
+                t->remaining -= n;
+                go            = deliver(multi, t, data, n);
+                if (go && !t->remaining) {
+                    // More than the body means the connection is out of step with the server
+                    t->keep_alive = t->keep_alive && pos == t->rx_len;
+                    complete(multi, t);
+                    go = false;
+                }
+                break;
+            }
+
+            case BODY_CLOSE:
+                pos += avail;
+                go   = deliver(multi, t, data, avail);
+                break;
+
+            case BODY_CHUNKED:
+                if (t->chunk == CHUNK_SIZE) {
+                    int64_t size   = 0;
+                    size_t  digits = 0;
+                    while (digits < line && isxdigit((unsigned char)data[digits]) && size < INT64_MAX / 16) {
+                        char c = tolower((unsigned char)data[digits++]);
+                        size   = size * 16 + (c <= '9' ? c - '0' : c - 'a' + 10);
+                    }
+                    // Only whitespace may come between the size and its extensions
+                    size_t end = digits;
+                    while (end < line && (data[end] == ' ' || data[end] == '\t')) {
+                        end++;
+                    }
+                    if (!digits || (end < line && data[end] != ';')) {
+                        finish(multi, t, HTTP_MULTI_ERR_PROTOCOL);
+                        go = false;
+                    } else {
+                        t->remaining = size;
+                        t->chunk     = size ? CHUNK_DATA : CHUNK_TRAILER;
+                    }
+                } else if (t->chunk == CHUNK_DATA) {
+                    size_t n = (int64_t)avail < t->remaining ? avail : (size_t)t->remaining;
+                    pos          += n;
+                    t->remaining -= n;
+                    go            = deliver(multi, t, data, n);
+                    if (!t->remaining) {
+                        t->chunk = CHUNK_DATA_END;
+                    }
+                } else if (t->chunk == CHUNK_DATA_END) {
+                    if (line) {
+                        finish(multi, t, HTTP_MULTI_ERR_PROTOCOL);
+                        go = false;
+                    } else {
+                        t->chunk = CHUNK_SIZE;
+                    }
+                } else if (!line) {
+                    t->keep_alive = t->keep_alive && pos == t->rx_len;
+                    complete(multi, t);
+                    go = false;
+                }
+                break;
+
+            default: break;
+        }
+    }
+
+    if (!go) {
+        return false;
+    }
+
+    t->rx_len -= pos;
+    memmove(t->rx, t->rx + pos, t->rx_len);
+    if (t->rx_len == HTTP_MULTI_BUFFER_BYTES) {
+        finish(multi, t, HTTP_MULTI_ERR_PROTOCOL);
+        return false;
+    }
+    return true;
+}
+
+static void step(http_multi_t *multi, transfer_t *t) {
+    t->wait = 0;
+    for (;;) {
+        void *handle = t->conn->handle;
+        int   ret;
+
+        switch (t->state) {
+            case STATE_CONNECTING:
+                ret = multi->transport.connect(handle);
+                if (ret == 0) {
+                    t->state = STATE_SENDING;
+                    continue;
+                }
+                if (ret == HTTP_MULTI_WANT_READ || ret == HTTP_MULTI_WANT_WRITE) {
+                    t->wait = ret;
+                } else {
+                    fail(multi, t, HTTP_MULTI_ERR_CONNECT);
+                }
+                return;
+
+            case STATE_SENDING:
+                if (t->tx_done == t->tx_len) {
+                    t->state = STATE_HEADERS;
+                    continue;
+                }
+                ret = multi->transport.write(handle, t->tx + t->tx_done, t->tx_len - t->tx_done);
+                if (ret > 0) {
+                    t->tx_done += ret;
+                    continue;
+                }
+                if (ret == HTTP_MULTI_WANT_READ || ret == HTTP_MULTI_WANT_WRITE) {
+                    t->wait = ret;
+                } else {
+                    fail(multi, t, HTTP_MULTI_ERR_SEND);
+                }
+                return;
+
+            case STATE_HEADERS:
+            case STATE_BODY:
+                ret = multi->transport.read(handle, t->rx + t->rx_len, HTTP_MULTI_BUFFER_BYTES - t->rx_len);
+                if (ret > 0) {
+                    t->got_response  = true;
+                    t->rx_len       += ret;
+                    if (!process(multi, t)) {
+                        return;
+                    }
+                    continue;
+                }
+                if (ret == HTTP_MULTI_WANT_READ || ret == HTTP_MULTI_WANT_WRITE) {
+                    t->wait = ret;
+                } else if (ret == 0 && t->state == STATE_BODY && t->body == BODY_CLOSE) {
+                    complete(multi, t);
+                } else if (ret == 0 && t->state == STATE_BODY) {
+                    fail(multi, t, HTTP_MULTI_ERR_PARTIAL);
+                } else {
+                    fail(multi, t, ret == 0 && t->got_response ? HTTP_MULTI_ERR_PROTOCOL : HTTP_MULTI_ERR_RECV);
+                }
+                return;
+
+            default: return;
+        }
+    }
+}
+
+http_multi_t *http_multi_create(http_multi_transport_t const *transport, void *ctx) {
+    http_multi_t *multi = calloc(1, sizeof(http_multi_t));
+    if (!multi) {
+        return NULL;
+    }
+
+    multi->transport    = *transport;
+    multi->ctx          = ctx;
+    multi->max_total    = HTTP_MULTI_MAX_TOTAL;
+    multi->max_per_host = HTTP_MULTI_MAX_PER_HOST;
+    return multi;
+}
+
+void http_multi_destroy(http_multi_t *multi) {
+    if (!multi) {
+        return;
+    }
+
+    while (multi->transfers) {
+        transfer_t *t    = multi->transfers;
+        multi->transfers = t->next;
+        release_connection(multi, t, false);
+        free_transfer(t);
+    }
+    while (multi->idle) {
+        close_idle(multi, &multi->idle);
+    }
+    free(multi);
+}
+
+void http_multi_set_limits(http_multi_t *multi, int max_total, int max_per_host) {
+    multi->max_total    = max_total > 0 ? max_total : 0;
+    multi->max_per_host = max_per_host > 0 ? max_per_host : 0;
+}
+
+bool http_multi_add(http_multi_t *multi, http_multi_request_t const *request) {
+    transfer_t **link = &multi->transfers;
+    for (; *link; link = &(*link)->next) {
+        if ((*link)->request.user_data == request->user_data) {
+            return false;
+        }
+    }
+
+    transfer_t *t = calloc(1, sizeof(transfer_t));
+    if (!t) {
+        return false;
+    }
+
+    t->request         = *request;
+    t->request.url     = NULL;
+    t->request.method  = NULL;
+    t->request.headers = NULL;
+    t->method          = request->method && strcmp(request->method, "GET") != 0 ? strdup(request->method) : NULL;
+    t->headers         = request->headers ? strdup(request->headers) : NULL;
+    t->send_body       = request->body_len > 0;
+    t->fresh           = request->fresh_connect;
+    t->content_length  = -1;
+
+    if ((request->method && strcmp(request->method, "GET") != 0 && !t->method) || (request->headers && !t->headers)) {
+        free_transfer(t);
+        return false;
+    }
+
+    if (request->url) {
+        char *url = strdup(request->url);
+        if (!url) {
+            free_transfer(t);
+            return false;
+        }
+        set_url(t, url);
+    }
+
+    if (request->timeout_ms > 0) {
+        t->deadline = now_us() + (int64_t)request->timeout_ms * 1000;
+    }
+
+    *link = t;
+    return true;
+}
+
+bool http_multi_remove(http_multi_t *multi, void *user_data) {
+    for (transfer_t **link = &multi->transfers; *link; link = &(*link)->next) {
+        transfer_t *t = *link;
+        if (t->request.user_data == user_data) {
+            *link = t->next;
+            release_connection(multi, t, false);
+            free_transfer(t);
+            return true;
+        }
+    }
+    return false;
+}
+
+int http_multi_perform(http_multi_t *multi) {
+    int64_t now    = now_us();
+    int     active = 0;
+
+    for (conn_t **link = &multi->idle; *link;) {
+        if (now - (*link)->idle_since >= (int64_t)HTTP_POOL_IDLE_TIMEOUT_MS * 1000) {
+            close_idle(multi, link);
+        } else {
+            link = &(*link)->next;
+        }
+    }
+
+    for (transfer_t *t = multi->transfers; t; t = t->next) {
+        if (t->state == STATE_DONE) {
+            continue;
+        }
+
+        if (t->deadline && now >= t->deadline) {
+            finish(multi, t, HTTP_MULTI_ERR_TIMEOUT);
+        }
+
+        // Following a redirect or retrying puts a transfer back to pending
+        for (;;) {
+            if (t->state == STATE_PENDING && !start(multi, t)) {
+                break;
+            }
+            if (t->state == STATE_DONE) {
+                break;
+            }
+            step(multi, t);
+            if (t->state != STATE_PENDING) {
+                break;
+            }
+        }
+
+        if (t->state == STATE_DONE) {
+            free_buffers(t);
+        } else {
+            active++;
+        }
+    }
+
+    return active;
+}
+
+int http_multi_poll(http_multi_t *multi, http_multi_waitfd_t *extra, int extra_count, int timeout_ms) {
+    int64_t now     = now_us();
+    int64_t timeout = timeout_ms > 0 ? (int64_t)timeout_ms * 1000 : 0;
+    int     max_fd  = -1;
+    fd_set  readable;
+    fd_set  writable;
+
+    FD_ZERO(&readable);
+    FD_ZERO(&writable);
+
+    for (transfer_t *t = multi->transfers; t; t = t->next) {
+        if (t->state == STATE_DONE) {
+            continue;
+        }
+        if (t->deadline && t->deadline - now < timeout) {
+            timeout = t->deadline > now ? t->deadline - now : 0;
+        }
+
+        if (t->state == STATE_PENDING) {
+            if (can_start(multi, t)) {
+                timeout = 0;
+            }
+            continue;
+        }
+
+        int fd = multi->transport.fd(t->conn->handle);
+        if (!t->wait || fd < 0) {
+            timeout = 0;
+            continue;
+        }
+
+        FD_SET(fd, t->wait == HTTP_MULTI_WANT_WRITE ? &writable : &readable);
+        if (fd > max_fd) {
+            max_fd = fd;
+        }
+    }
+
+    for (int i = 0; i < extra_count; i++) {
+        extra[i].revents = 0;
+        if (extra[i].events & HTTP_MULTI_POLL_IN) {
+            FD_SET(extra[i].fd, &readable);
+        }
+        if (extra[i].events & HTTP_MULTI_POLL_OUT) {
+            FD_SET(extra[i].fd, &writable);
+        }
+        if ((extra[i].events & (HTTP_MULTI_POLL_IN | HTTP_MULTI_POLL_OUT)) && extra[i].fd > max_fd) {
+            max_fd = extra[i].fd;
+        }
+    }
+
+    struct timeval tv    = {.tv_sec = timeout / 1000000, .tv_usec = timeout % 1000000};
+    int            ready = select(max_fd + 1, &readable, &writable, NULL, &tv);
+    if (ready <= 0) {
+        return ready;
+    }
+
+    for (int i = 0; i < extra_count; i++) {
+        if (FD_ISSET(extra[i].fd, &readable)) {
+            extra[i].revents |= HTTP_MULTI_POLL_IN;
+        }
+        if (FD_ISSET(extra[i].fd, &writable)) {
+            extra[i].revents |= HTTP_MULTI_POLL_OUT;
+        }
+    }
+    return ready;
+}
+
+bool http_multi_info_read(http_multi_t *multi, void **user_data, http_multi_result_t *result, int *left) {
+    transfer_t *oldest = NULL;
+    int         count  = 0;
+
+    for (transfer_t *t = multi->transfers; t; t = t->next) {
+        if (t->message) {
+            count++;
+            if (!oldest || t->message < oldest->message) {
+                oldest = t;
+            }
+        }
+    }
+
+    if (!oldest) {
+        *left = 0;
+        return false;
+    }
+
+    oldest->message = 0;
+    *user_data      = oldest->request.user_data;
+    *result         = oldest->result;
+    *left           = count - 1;
+    return true;
+}
+
+void http_multi_stats_get(http_multi_t *multi, http_multi_stats_t *stats) {
+    *stats = multi->stats;
+}
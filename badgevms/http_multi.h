@@ -0,0 +1,136 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "http_pool.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The transfers of one curl multi handle, all driven from the thread calling http_multi_perform over connections that
+// never block. The HTTP/1.1 exchange is done here, connecting, reading and writing goes through the transport given at
+// creation. Connections are kept alive within the multi, at most max_per_host of them in use for the same scheme,
+// host and port and at most max_total open.
+
+typedef enum {
+    HTTP_MULTI_OK = 0,
+    HTTP_MULTI_ERR_URL,
+    HTTP_MULTI_ERR_CONNECT,
+    HTTP_MULTI_ERR_SEND,
+    HTTP_MULTI_ERR_RECV,
+    HTTP_MULTI_ERR_PARTIAL, // The connection closed before the end of the body
+    HTTP_MULTI_ERR_PROTOCOL,
+    HTTP_MULTI_ERR_ENCODING, // The body is in a Content-Encoding that isn't supported or doesn't decode
+    HTTP_MULTI_ERR_RANGE,    // The server sent all of the body instead of resuming it
+    HTTP_MULTI_ERR_TIMEOUT,
+    HTTP_MULTI_ERR_ABORTED, // A header or data callback returned false
+    HTTP_MULTI_ERR_REDIRECTS,
+    HTTP_MULTI_ERR_NO_MEM,
+} http_multi_result_t;
+
+// Returned by the transport when it has to wait for the connection
+#define HTTP_MULTI_WANT_READ  (-2)
+#define HTTP_MULTI_WANT_WRITE (-3)
+
+#define HTTP_MULTI_POLL_IN  0x1
+#define HTTP_MULTI_POLL_OUT 0x4
+
+typedef struct {
+    // Starts connecting to the host of key, returns NULL if that failed right away
+    void *(*open)(void *ctx, http_pool_key_t const *key, void *user_data);
+    // Returns 0 once connected, HTTP_MULTI_WANT_READ or _WRITE while connecting and -1 on failure
+    int (*connect)(void *conn);
+    int (*fd)(void *conn);
+    // Return the bytes transferred, HTTP_MULTI_WANT_READ or _WRITE when they would block and -1 on errors. read
+    // returns 0 when the peer closed the connection.
+    int (*read)(void *conn, void *buf, size_t len);
+    int (*write)(void *conn, void const *buf, size_t len);
+    void (*close)(void *conn);
+} http_multi_transport_t;
+
+typedef struct {
+    int         status;
+    int64_t     content_length; // -1 if the response didn't say
+    int         connects;       // Connections made for the transfer, 0 if it only used kept-alive ones
+    char const *url;            // After following redirects
+} http_multi_response_t;
+
+typedef struct {
+    char const *url;
+    char const *method;  // NULL for GET
+    char const *headers; // Request header lines, each ending in CRLF, NULL for none
+    void const *body;    // Has to stay around until the transfer is done or removed
+    size_t      body_len;
+    long        timeout_ms; // For the whole transfer, 0 for none
+    int         max_redirects;
+    bool        fresh_connect;
+    bool        forbid_reuse;
+    // Undo the gzip or deflate Content-Encoding of the body. A resume_from above 0 means the headers ask for the body
+    // from there on, a server answering with all of it fails the transfer.
+    bool        decode;
+    int64_t     resume_from;
+    uint64_t    config; // Passed on in the key to open, kept-alive connections are only shared by the same config
+    void       *user_data;
+
+    // Each response header line without the line ending, the body, return false to abort the transfer
+    bool (*header)(void *user_data, char const *line, size_t len);
+    bool (*data)(void *user_data, void const *data, size_t len);
+    // Called once when the transfer is done, before its message can be read
+    void (*done)(void *user_data, http_multi_result_t result, http_multi_response_t const *response);
+} http_multi_request_t;
+
+typedef struct {
+    int   fd;
+    short events;
+    short revents;
+} http_multi_waitfd_t;
+
+typedef struct {
+    uint32_t opened;      // Connections made
+    uint32_t reused;      // Requests sent over a kept-alive connection
+    uint32_t retried;     // Requests sent again because a kept-alive connection turned out to be closed
+    uint32_t max_running; // Most transfers that had a connection at the same time
+} http_multi_stats_t;
+
+typedef struct http_multi http_multi_t;
+
+http_multi_t *http_multi_create(http_multi_transport_t const *transport, void *ctx);
+// Closes all connections, transfers still in the multi are dropped without calling done
+void          http_multi_destroy(http_multi_t *multi);
+
+// 0 for no limit
+void http_multi_set_limits(http_multi_t *multi, int max_total, int max_per_host);
+
+// Queues a transfer, the request is copied except for the body. Returns false if user_data is already in the multi
+// or there is no memory.
+bool http_multi_add(http_multi_t *multi, http_multi_request_t const *request);
+// Drops the transfer of user_data, unfinished or not, along with its message. Returns false if it isn't in the multi.
+bool http_multi_remove(http_multi_t *multi, void *user_data);
+
+// Moves every transfer along as far as it goes without blocking, returns the number not done yet
+int http_multi_perform(http_multi_t *multi);
+
+// Waits until a transfer can move along, one of the extra file descriptors is ready or timeout_ms passed, whichever is
+// first. Returns the number of file descriptors that are ready, -1 on errors.
+int http_multi_poll(http_multi_t *multi, http_multi_waitfd_t *extra, int extra_count, int timeout_ms);
+
+// Takes the oldest message of a finished transfer, *left is set to the number still waiting
+bool http_multi_info_read(http_multi_t *multi, void **user_data, http_multi_result_t *result, int *left);
+
+void http_multi_stats_get(http_multi_t *multi, http_multi_stats_t *stats);
@@ -0,0 +1,279 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "http_pool.h"
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+static char const *TAG = "http_pool";
+
+typedef enum {
+    SLOT_FREE,
+    SLOT_IDLE,
+    SLOT_BUSY,
+} slot_state_t;
+
+typedef struct {
+    slot_state_t    state;
+    uint32_t        last_used;
+    void           *handle;
+    http_pool_key_t key;
+} pool_slot_t;
+
+struct http_pool {
+    SemaphoreHandle_t  lock;
+    http_pool_close_fn close;
+    http_pool_stats_t  stats;
+    pool_slot_t        slots[HTTP_POOL_CONNECTIONS];
+};
+
+static bool same_host(http_pool_key_t const *a, http_pool_key_t const *b) {
+    return a->https == b->https && a->port == b->port && strcmp(a->host, b->host) == 0;
+}
+
+bool http_pool_key_from_url(http_pool_key_t *key, char const *url, uint64_t config) {
+    if (!url) {
+        return false;
+    }
+
+    if (strncasecmp(url, "http://", 7) == 0) {
+        key->https = false;
+        key->port  = 80;
+        url       += 7;
+    } else if (strncasecmp(url, "https://", 8) == 0) {
+        key->https = true;
+        key->port  = 443;
+        url       += 8;
+    } else {
+        return false;
+    }
+
+    char const *end = url + strcspn(url, "/?#");
+    char const *at  = NULL;
+    for (char const *p = url; p < end; p++) {
+        if (*p == '@') {
+            at = p;
+        }
+    }
+    if (at) {
+        url = at + 1;
+    }
+
+    char const *host_end;
+    char const *port = NULL;
+    if (*url == '[') {
+        host_end = memchr(url, ']', end - url);
+        if (!host_end) {
+            return false;
+        }
+        host_end++;
+        if (host_end < end) {
+            if (*host_end != ':') {
+                return false;
+            }
+            port = host_end + 1;
+        }
+    } else {
+        host_end = memchr(url, ':', end - url);
+        if (host_end) {
+            port = host_end + 1;
+        } else {
+            host_end = end;
+        }
+    }
+
+    size_t len = host_end - url;
+    if (len == 0 || len >= HTTP_POOL_HOST_MAX) {
+        return false;
+    }
+
+    if (port && port < end) {
+        unsigned long value = 0;
+        for (char const *p = port; p < end; p++) {
+            if (!isdigit((unsigned char)*p)) {
+                return false;
+            }
+            value = value * 10 + (*p - '0');
+            if (value > 65535) {
+                return false;
+            }
+        }
+        if (value == 0) {
+            return false;
+        }
+        key->port = value;
+    }
+
+    for (size_t i = 0; i < len; i++) {
+        key->host[i] = tolower((unsigned char)url[i]);
+    }
+    key->host[len] = '\0';
+    key->config    = config;
+    return true;
+}
+
+http_pool_t *http_pool_create(http_pool_close_fn close) {
+    http_pool_t *pool = calloc(1, sizeof(http_pool_t));
+    if (!pool) {
+        return NULL;
+    }
+
+    pool->lock = xSemaphoreCreateMutex();
+    if (!pool->lock) {
+        free(pool);
+        return NULL;
+    }
+
+    pool->close = close;
+    return pool;
+}
+
+void http_pool_destroy(http_pool_t *pool, bool close) {
+    if (!pool) {
+        return;
+    }
+
+    for (int i = 0; close && i < HTTP_POOL_CONNECTIONS; i++) {
+        if (pool->slots[i].state != SLOT_FREE && pool->slots[i].handle) {
+            pool->close(pool->slots[i].handle);
+        }
+    }
+
+    vSemaphoreDelete(pool->lock);
+    free(pool);
+}
+
+static void free_slot(pool_slot_t *slot, void **closing, int *num_closing) {
+    if (slot->handle) {
+        closing[(*num_closing)++] = slot->handle;
+    }
+    slot->state  = SLOT_FREE;
+    slot->handle = NULL;
+}
+
+int http_pool_acquire(http_pool_t *pool, http_pool_key_t const *key, uint32_t now_ms, void **handle) {
+    void *closing[HTTP_POOL_CONNECTIONS];
+    int   num_closing = 0;
+    int   found       = -1;
+    int   empty       = -1;
+    int   host_count  = 0;
+    int   host_idle   = -1;
+    int   oldest_idle = -1;
+
+    xSemaphoreTake(pool->lock, portMAX_DELAY);
+
+    for (int i = 0; i < HTTP_POOL_CONNECTIONS; i++) {
+        pool_slot_t *slot = &pool->slots[i];
+
+        if (slot->state == SLOT_IDLE && now_ms - slot->last_used >= HTTP_POOL_IDLE_TIMEOUT_MS) {
+            free_slot(slot, closing, &num_closing);
+            pool->stats.expired++;
+        }
+
+        if (slot->state == SLOT_FREE) {
+            if (empty < 0) {
+                empty = i;
+            }
+            continue;
+        }
+
+        if (same_host(&slot->key, key)) {
+            host_count++;
+            if (slot->state == SLOT_IDLE) {
+                if (found < 0 && slot->key.config == key->config) {
+                    found = i;
+                } else if (host_idle < 0) {
+                    host_idle = i;
+                }
+            }
+        }
+
+        if (slot->state == SLOT_IDLE &&
+            (oldest_idle < 0 || (int32_t)(slot->last_used - pool->slots[oldest_idle].last_used) < 0)) {
+            oldest_idle = i;
+        }
+    }
+
+    if (found >= 0) {
+        pool->slots[found].state = SLOT_BUSY;
+        *handle                  = pool->slots[found].handle;
+        pool->stats.reused++;
+        goto out;
+    }
+
+    // A host at its limit can only get a new connection in place of one of its idle ones made with another config
+    int victim = host_count >= HTTP_POOL_MAX_PER_HOST ? host_idle : empty >= 0 ? empty : oldest_idle;
+    if (victim < 0) {
+        pool->stats.busy++;
+        goto out;
+    }
+
+    if (pool->slots[victim].state == SLOT_IDLE) {
+        free_slot(&pool->slots[victim], closing, &num_closing);
+        pool->stats.evicted++;
+    }
+
+    found                    = victim;
+    pool->slots[found].state = SLOT_BUSY;
+    pool->slots[found].key   = *key;
+    *handle                  = NULL;
+    pool->stats.opened++;
+
+out:
+    xSemaphoreGive(pool->lock);
+
+    for (int i = 0; i < num_closing; i++) {
+        pool->close(closing[i]);
+    }
+
+    return found;
+}
+
+void http_pool_release(http_pool_t *pool, int slot, void *handle, bool keep, uint32_t now_ms) {
+    if (slot < 0 || slot >= HTTP_POOL_CONNECTIONS) {
+        ESP_LOGE(TAG, "Releasing invalid slot %i", slot);
+        return;
+    }
+
+    xSemaphoreTake(pool->lock, portMAX_DELAY);
+    if (keep && handle) {
+        pool->slots[slot].state     = SLOT_IDLE;
+        pool->slots[slot].handle    = handle;
+        pool->slots[slot].last_used = now_ms;
+        handle                      = NULL;
+    } else {
+        pool->slots[slot].state  = SLOT_FREE;
+        pool->slots[slot].handle = NULL;
+    }
+    xSemaphoreGive(pool->lock);
+
+    if (handle) {
+        pool->close(handle);
+    }
+}
+
+void http_pool_stats_get(http_pool_t *pool, http_pool_stats_t *stats) {
+    xSemaphoreTake(pool->lock, portMAX_DELAY);
+    *stats = pool->stats;
+    xSemaphoreGive(pool->lock);
+}
@@ -0,0 +1,63 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "badgevms_config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Kept-alive HTTP connections of one process, shared by all its curl handles. The pool only does the bookkeeping: it
+// hands out slots, each either holding an idle connection to reuse or empty for the caller to connect, and closes
+// connections through the callback given at creation when they expire, are evicted or the pool is destroyed.
+
+typedef struct {
+    bool     https;
+    uint16_t port;
+    uint64_t config; // Settings fixed when a connection is made, only connections with the same config are shared
+    char     host[HTTP_POOL_HOST_MAX];
+} http_pool_key_t;
+
+typedef struct {
+    uint32_t opened;  // Empty slots handed out for a new connection
+    uint32_t reused;  // Idle connections handed out again
+    uint32_t expired; // Idle connections closed after HTTP_POOL_IDLE_TIMEOUT_MS
+    uint32_t evicted; // Idle connections closed to make room for another one
+    uint32_t busy;    // Requests turned away because their host or the whole pool was at its limit
+} http_pool_stats_t;
+
+typedef struct http_pool http_pool_t;
+
+typedef void (*http_pool_close_fn)(void *handle);
+
+// Fills in the key of an http or https URL, returns false for anything the pool can't be used for
+bool http_pool_key_from_url(http_pool_key_t *key, char const *url, uint64_t config);
+
+http_pool_t *http_pool_create(http_pool_close_fn close);
+// Without close the connections in the pool are left alone, for when they go away with the process that made them
+void         http_pool_destroy(http_pool_t *pool, bool close);
+
+// Returns a slot for the key and sets *handle to the idle connection in it, or to NULL when the caller has to make a
+// new one. Returns -1 when the host already has HTTP_POOL_MAX_PER_HOST connections or the pool is full of busy ones.
+int http_pool_acquire(http_pool_t *pool, http_pool_key_t const *key, uint32_t now_ms, void **handle);
+
+// Gives a slot back with the connection now in it. The connection stays open for reuse if keep is set, handle NULL
+// frees the slot without closing anything.
+void http_pool_release(http_pool_t *pool, int slot, void *handle, bool keep, uint32_t now_ms);
+
+void http_pool_stats_get(http_pool_t *pool, http_pool_stats_t *stats);
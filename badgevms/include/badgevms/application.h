@@ -77,6 +77,11 @@ bool application_set_name(application_t *application, char const *name);
 // Change the interpreter of an application_t instance
 bool application_set_interpreter(application_t *application, char const *interpreter);
 
+// Hold back the changes made by the application_set_*() functions until application_commit_update(), which stores
+// them all at once. After a crash either all of them or none of them are there.
+bool application_begin_update(application_t *application);
+bool application_commit_update(application_t *application);
+
 // Remove an application and all its associated files. Might fail.
 bool application_destroy(application_t *application);
 
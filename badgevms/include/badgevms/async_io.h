@@ -0,0 +1,58 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+
+// Asynchronous file I/O, performed by the kernel I/O tasks while the caller keeps running. Only works on files on a
+// filesystem device.
+typedef int io_request_t;
+
+typedef enum {
+    IO_OP_READ,
+    IO_OP_WRITE,
+    IO_OP_FSYNC,
+    IO_OP_SENDFILE,
+} io_op_t;
+
+// Use the current file position instead of an absolute offset
+#define IO_OFFSET_CURRENT ((off_t)-1)
+
+// Queue an operation on fd, returns -1 and sets errno if the queue is full. Data to write is copied before this
+// returns, data read is copied into buf by io_wait(), so buf must stay valid until then. Requests larger than the
+// kernel bounce buffer complete short. An offset other than IO_OFFSET_CURRENT moves the file position.
+io_request_t io_submit(io_op_t op, int fd, void *buf, size_t count, off_t offset);
+
+// Returns 1 if the request has completed, 0 if it is still in flight and -1 if it is not a valid request
+int io_poll(io_request_t request);
+
+// Wait for the request to complete and return its result, after which the request is gone. On a timeout -1 is
+// returned with errno set to ETIMEDOUT and the request stays valid.
+ssize_t io_wait(io_request_t request, bool block, uint32_t timeout_msec);
+
+// Queue sending count bytes of the file in in_fd to the socket out_fd, like sendfile() but completed with io_poll()
+// and io_wait(). The data goes from the filesystem to the socket without passing through the caller. With offset set
+// to IO_OFFSET_CURRENT the file position moves past what was sent, it is left alone otherwise. The request does not
+// wait for room in the socket, even a blocking one, it completes short or fails with EAGAIN when the socket is full.
+io_request_t io_sendfile(int out_fd, int in_fd, off_t offset, size_t count);
+
+// Drop a request, waiting for it if it is already running
+int io_cancel(io_request_t request);
@@ -21,19 +21,21 @@
 #include "pixel_formats.h"
 
 #include <stdbool.h>
+#include <stdint.h>
 
 typedef enum {
     WINDOW_FLAG_NONE            = 0,
-    WINDOW_FLAG_FULLSCREEN      = (1 << 0), // Only one fullscreen application can run at a tim
-    WINDOW_FLAG_ALWAYS_ON_TOP   = (1 << 1), // Does not apply to fullscreen apps
-    WINDOW_FLAG_UNDECORATED     = (1 << 2), // Create a floating window
-    WINDOW_FLAG_MAXIMIZED       = (1 << 3), // Create an application window of the maximum size
-    WINDOW_FLAG_MAXIMIZED_LEFT  = (1 << 4), // Create a window and have it cover the whole left of the screen
-    WINDOW_FLAG_MAXIMIZED_RIGHT = (1 << 5), // Create a window and have it cover the whole right of the screen
-    WINDOW_FLAG_DOUBLE_BUFFERED = (1 << 6), // Create a double buffered window
-    WINDOW_FLAG_LOW_PRIORITY    = (1 << 7), // Don't elevate my priority, even if I'm fullscreen
-    WINDOW_FLAG_FLIP_HORIZONTAL = (1 << 8), // Flip my window horizontally
-    WINDOW_FLAG_FLIP_VERTICAL   = (1 << 9), // Flip my window vertically
+    WINDOW_FLAG_FULLSCREEN      = (1 << 0),  // Only one fullscreen application can run at a tim
+    WINDOW_FLAG_ALWAYS_ON_TOP   = (1 << 1),  // Does not apply to fullscreen apps
+    WINDOW_FLAG_UNDECORATED     = (1 << 2),  // Create a floating window
+    WINDOW_FLAG_MAXIMIZED       = (1 << 3),  // Create an application window of the maximum size
+    WINDOW_FLAG_MAXIMIZED_LEFT  = (1 << 4),  // Create a window and have it cover the whole left of the screen
+    WINDOW_FLAG_MAXIMIZED_RIGHT = (1 << 5),  // Create a window and have it cover the whole right of the screen
+    WINDOW_FLAG_DOUBLE_BUFFERED = (1 << 6),  // Create a double buffered window
+    WINDOW_FLAG_LOW_PRIORITY    = (1 << 7),  // Don't elevate my priority, even if I'm fullscreen
+    WINDOW_FLAG_FLIP_HORIZONTAL = (1 << 8),  // Flip my window horizontally
+    WINDOW_FLAG_FLIP_VERTICAL   = (1 << 9),  // Flip my window vertically
+    WINDOW_FLAG_ALPHA           = (1 << 10), // Blend my window with what's below, needs a framebuffer with alpha
 } window_flag_t;
 
 typedef struct {
@@ -51,7 +53,36 @@ typedef struct {
     int w, h;
 } window_rect_t;
 
-typedef struct window *window_handle_t;
+#define COMPOSITOR_HISTOGRAM_BUCKETS 8
+
+// Bucket i counts samples below (1 << i) milliseconds that did not fit in an earlier bucket, the last bucket
+// counts everything else
+typedef struct {
+    uint32_t count;
+    uint32_t min_us;
+    uint32_t max_us;
+    uint64_t total_us;
+    uint32_t histogram[COMPOSITOR_HISTOGRAM_BUCKETS];
+} compositor_timing_t;
+
+typedef struct {
+    uint32_t            vblanks;           // Panel refreshes
+    uint32_t            frames_composited; // Frames the compositor built
+    uint32_t            frames_missed;     // Panel refreshes that passed without the compositor running
+    uint32_t            frame_seq;         // Sequence number of the last frame sent to the panel
+    compositor_timing_t frame_time;        // Compositor time spent on each frame
+    compositor_timing_t ppa_time;          // Time spent waiting for the PPA each frame
+} compositor_stats_t;
+
+typedef struct {
+    uint32_t            frames_presented;  // Calls to window_present()
+    uint32_t            frames_composited; // Presented frames picked up by the compositor
+    uint32_t            deadlines_missed;  // Frames that took longer than one refresh to reach the panel
+    compositor_timing_t present_latency;   // From window_present() until sent to the panel
+} window_stats_t;
+
+typedef struct window             *window_handle_t;
+typedef struct window_transaction *window_transaction_handle_t;
 
 window_handle_t window_create(char const *title, window_size_t size, window_flag_t flags);
 framebuffer_t  *window_framebuffer_create(window_handle_t window, window_size_t size, pixel_format_t pixel_format);
@@ -74,9 +105,31 @@ window_size_t  window_framebuffer_size_get(window_handle_t window);
 window_size_t  window_framebuffer_size_set(window_handle_t window, window_size_t size);
 pixel_format_t window_framebuffer_format_get(window_handle_t window);
 
+// Batch any number of window changes and have the compositor apply them all in the same frame. Changes are
+// applied in the order they were added. A transaction is consumed by commit or abort. With block set to false
+// commit returns immediately, the changes become visible with the next frame.
+window_transaction_handle_t window_transaction_begin(void);
+bool window_transaction_position_set(
+    window_transaction_handle_t transaction, window_handle_t window, window_coords_t coords
+);
+bool window_transaction_size_set(window_transaction_handle_t transaction, window_handle_t window, window_size_t size);
+bool window_transaction_flags_set(window_transaction_handle_t transaction, window_handle_t window, window_flag_t flags);
+bool window_transaction_title_set(window_transaction_handle_t transaction, window_handle_t window, char const *title);
+bool window_transaction_commit(window_transaction_handle_t transaction, bool block);
+void window_transaction_abort(window_transaction_handle_t transaction);
+
 framebuffer_t *window_framebuffer_get(window_handle_t window);
-void           window_present(window_handle_t window, bool block, window_rect_t *rects, int num_rects);
+
+// Returns the sequence number of the frame that will show this content, for use with window_frame_wait()
+uint32_t window_present(window_handle_t window, bool block, window_rect_t *rects, int num_rects);
+// Wait until frame frame_seq has been sent to the panel, returns false on timeout
+bool     window_frame_wait(uint32_t frame_seq, bool block, uint32_t timeout_msec);
+
+bool window_stats_get(window_handle_t window, window_stats_t *stats, bool reset);
+void compositor_stats_get(compositor_stats_t *stats, bool reset);
 
 event_t window_event_poll(window_handle_t window, bool block, uint32_t timeout_msec);
+// An fd that poll() and select() report readable while the window has events waiting, closed with the window
+int     window_event_fd(window_handle_t window);
 
 void get_screen_info(int *width, int *height, pixel_format_t *format, float *refresh_rate);
@@ -19,10 +19,12 @@
 #include "keyboard.h"
 #include "pathfuncs.h"
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
 #include <dirent.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
@@ -35,10 +37,53 @@ typedef enum {
     DEVICE_TYPE_ORIENTATION,
     DEVICE_TYPE_SOCKET,
     DEVICE_TYPE_FILESYSTEM,
+    DEVICE_TYPE_WINDOW,
+    DEVICE_TYPE_DNS,
 } device_type_t;
 
+typedef enum {
+    FILESYSTEM_SYNC_ON_CLOSE, // Every close commits the file, the default
+    FILESYSTEM_SYNC_PERIODIC, // Closed files are committed in the background every interval
+    FILESYSTEM_SYNC_EXPLICIT, // Closed files are committed by sync(), when the filesystem needs them or at shutdown
+} filesystem_sync_policy_t;
+
+typedef struct {
+    uint32_t hits;             // Blocks read from the cache
+    uint32_t misses;           // Blocks read from the device because they were not cached
+    uint32_t readahead_blocks; // Blocks read ahead of a sequential reader
+    uint32_t readahead_hits;   // Read ahead blocks that were used before being evicted
+    uint32_t evictions;        // Blocks dropped to make room
+    uint32_t invalidations;    // Cached blocks dropped because they were written
+    uint32_t bypassed;         // Large reads that went straight to the device
+} filesystem_cache_stats_t;
+
+// Ordered from slowest to fastest
+typedef enum {
+    FILESYSTEM_BUS_NONE,          // Not on an SD bus, like the internal flash
+    FILESYSTEM_BUS_SD_DEFAULT,    // Default speed, up to 25MHz
+    FILESYSTEM_BUS_SD_HIGH_SPEED, // High speed, up to 50MHz
+    FILESYSTEM_BUS_SD_UHS_DDR50,  // UHS-I DDR50, up to 50MHz on both clock edges
+    FILESYSTEM_BUS_SD_UHS_SDR50,  // UHS-I SDR50, up to 100MHz
+} filesystem_bus_mode_t;
+
+typedef struct {
+    filesystem_bus_mode_t bus_mode;
+    uint32_t              bus_freq_khz;         // Clock the card actually runs at
+    uint8_t               bus_width;            // Data lines
+    uint32_t              sector_size;          // Bytes
+    uint32_t              max_transfer_sectors; // Longest single device transfer, 0 if unlimited
+    uint32_t              allocation_unit;      // Cluster size the filesystem gets when it is formatted
+    uint32_t              probe_read_kib_s;     // Sequential read speed in KiB/s measured at mount, 0 if not measured
+    uint64_t              bytes_read;           // Totals of all transfers to and from the device since mounting
+    uint64_t              read_us;
+    uint64_t              bytes_written;
+    uint64_t              write_us;
+} filesystem_info_t;
+
 typedef enum { ORIENTATION_0, ORIENTATION_90, ORIENTATION_180, ORIENTATION_270 } orientation_t;
 
+struct poll_waiter;
+
 typedef struct device {
     device_type_t type;
     int (*_open)(void *dev, path_t *path, int flags, mode_t mode);
@@ -47,6 +92,8 @@ typedef struct device {
     ssize_t (*_read)(void *dev, int fd, void *buf, size_t count);
     ssize_t (*_lseek)(void *dev, int fd, off_t offset, int whence);
     void (*_destroy)(void *dev);
+    // Returns the POLL* events fd is ready for, see wait_queue.h. Devices without it are always ready.
+    short (*_poll)(void *dev, int fd, short events, struct poll_waiter *waiter);
 } device_t;
 
 typedef struct filesystem {
@@ -60,6 +107,11 @@ typedef struct filesystem {
     DIR *(*_opendir)(void *dev, path_t *path);
     struct dirent *(*_readdir)(void *dev, DIR *dirp);
     int (*_closedir)(void *dev, DIR *dirp);
+    int (*_fsync)(void *dev, int fd);
+    int (*_sync)(void *dev);
+    int (*_set_sync_policy)(void *dev, filesystem_sync_policy_t policy, uint32_t interval_ms);
+    bool (*_cache_stats)(void *dev, filesystem_cache_stats_t *stats, bool reset);
+    bool (*_info)(void *dev, filesystem_info_t *info);
 } filesystem_device_t;
 
 typedef struct lcd_device {
@@ -92,8 +144,28 @@ typedef struct {
     device_t device;
 } wifi_device_t;
 
+// Socket calls return -1 with errno set when they fail, like their POSIX counterparts
 typedef struct {
     device_t device;
+    int (*_socket)(void *dev, int domain, int type, int protocol);
+    int (*_accept)(void *dev, int fd, struct sockaddr *addr, socklen_t *addrlen);
+    int (*_bind)(void *dev, int fd, struct sockaddr const *addr, socklen_t addrlen);
+    int (*_connect)(void *dev, int fd, struct sockaddr const *addr, socklen_t addrlen);
+    int (*_listen)(void *dev, int fd, int backlog);
+    int (*_shutdown)(void *dev, int fd, int how);
+    int (*_getsockname)(void *dev, int fd, struct sockaddr *addr, socklen_t *addrlen);
+    int (*_getpeername)(void *dev, int fd, struct sockaddr *addr, socklen_t *addrlen);
+    ssize_t (*_sendto)(
+        void *dev, int fd, void const *buf, size_t len, int flags, struct sockaddr const *addr, socklen_t addrlen
+    );
+    ssize_t (*_recvfrom)(
+        void *dev, int fd, void *buf, size_t len, int flags, struct sockaddr *addr, socklen_t *addrlen
+    );
+    ssize_t (*_sendmsg)(void *dev, int fd, struct msghdr const *msg, int flags);
+    ssize_t (*_recvmsg)(void *dev, int fd, struct msghdr *msg, int flags);
+    int (*_setsockopt)(void *dev, int fd, int level, int name, void const *value, socklen_t len);
+    int (*_getsockopt)(void *dev, int fd, int level, int name, void *value, socklen_t *len);
+    int (*_fcntl)(void *dev, int fd, int cmd, int arg); // F_GETFL and F_SETFL with O_NONBLOCK
 } socket_device_t;
 
 typedef struct {
@@ -103,3 +175,6 @@ typedef struct {
 } orientation_device_t;
 
 device_t *device_get(char const *name);
+int       filesystem_sync_policy_set(char const *device_name, filesystem_sync_policy_t policy, uint32_t interval_ms);
+bool      filesystem_cache_stats_get(char const *device_name, filesystem_cache_stats_t *stats, bool reset);
+bool      filesystem_info_get(char const *device_name, filesystem_info_t *info);
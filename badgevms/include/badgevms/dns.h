@@ -0,0 +1,36 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <netdb.h>
+
+// Not among the errors of lwIP's getaddrinfo()
+#ifndef EAI_AGAIN
+#define EAI_AGAIN 205
+#endif
+
+// Host name lookups that don't block. dns_lookup() returns an fd that poll() and select() see as readable once the
+// answer is in, dns_lookup_result() then turns it into a list like getaddrinfo() does. Close the fd when done, the
+// list is freed with freeaddrinfo(). All processes share one cache of answers, lookups of the same name at the same
+// time share one query.
+//
+// family is AF_INET, AF_INET6 or AF_UNSPEC for both. Returns -1 with errno set if the lookup can't be started.
+int dns_lookup(char const *host, int family);
+
+// Returns 0 with the list in res, EAI_AGAIN while the lookup is still running, or another EAI_ error like getaddrinfo()
+int dns_lookup_result(int fd, char const *service, struct addrinfo const *hints, struct addrinfo **res);
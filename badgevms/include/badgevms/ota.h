@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 
 typedef struct ota_session_t ota_session_t;
 typedef ota_session_t       *ota_handle_t;
@@ -10,5 +11,18 @@ bool         ota_write(ota_handle_t session, void *buffer, int block_size);
 bool         ota_session_commit(ota_handle_t session);
 bool         ota_session_abort(ota_handle_t session);
 
+// ota_write() returns once the data is copied, the kernel writes it to flash while the next part comes in. Returns
+// false once a write failed, the session is aborted then.
+//
+// ota_download() fetches url into the session, resuming a connection that broke off with a Range request. With sha256
+// set to 64 hex digits, ota_session_commit() refuses an image with another hash. Returns false when the download
+// failed for good, the session is aborted then.
+//
+// ota_session_offset() is the number of bytes taken so far, where an application feeding the session itself resumes
+// after an interrupted transfer.
+bool   ota_download(ota_handle_t session, char const *url, char const *sha256);
+bool   ota_session_expect_sha256(ota_handle_t session, char const *sha256);
+size_t ota_session_offset(ota_handle_t session);
+
 bool ota_get_running_version(char **version);
 bool ota_get_invalid_version(char **version);
@@ -20,13 +20,36 @@
 
 #include <string.h>
 
+// Longest BadgeVMS path parse_path accepts, including the terminating NUL. Paths are at most 255 characters, longer
+// ones fail with PATH_PARSE_TOO_LONG.
+#define PATH_MAX_LEN 256
+
+// Longest UNIX path path_to_unix can produce from a parsed path, including the terminating NUL
+#define PATH_UNIX_MAX_LEN (PATH_MAX_LEN + 1)
+
+// A piece of the string that was parsed, not NUL terminated. ptr is NULL if the component is absent.
+typedef struct {
+    char const *ptr;
+    size_t      len;
+} path_span_t;
+
+typedef struct {
+    path_span_t device;
+    path_span_t directory;
+    path_span_t filename;
+} path_spans_t;
+
+// Components are NUL terminated and point into buffer, a path_t must not be copied. It takes close to 300 bytes of the
+// stack it lives on: opening a path keeps one around while the driver builds the UNIX path, renaming keeps two.
 typedef struct {
-    char  *buffer;
     char  *device;
     char  *directory;
     char  *filename;
-    char  *unixpath;
+    size_t device_len;
+    size_t directory_len;
+    size_t filename_len;
     size_t len;
+    char   buffer[PATH_MAX_LEN];
 } path_t;
 
 typedef enum {
@@ -37,10 +60,12 @@ typedef enum {
     PATH_PARSE_INVALID_DEVICE_CHAR = -4,
     PATH_PARSE_INVALID_DIR_CHAR    = -5,
     PATH_PARSE_INVALID_FILE_CHAR   = -6,
-    PATH_PARSE_EMPTY_PATH          = -7
+    PATH_PARSE_EMPTY_PATH          = -7,
+    PATH_PARSE_TOO_LONG            = -8
 } path_parse_result_t;
 
 path_parse_result_t parse_path(char const *path, path_t *result);
+path_parse_result_t parse_path_spans(char const *path, path_spans_t *result);
 void                path_free(path_t *path);
 bool                mkdir_p(char const *path);
 bool                rm_rf(char const *path);
@@ -30,6 +30,8 @@ typedef void CURL;
 typedef int  CURLcode;
 typedef int  CURLoption;
 
+typedef int64_t curl_off_t;
+
 typedef enum {
     CURLE_OK = 0,
     CURLE_UNSUPPORTED_PROTOCOL,
@@ -58,55 +60,69 @@ typedef enum {
     CURLE_SEND_FAIL_REWIND,
     CURLE_SSL_ENGINE_INITFAILED,
     CURLE_LOGIN_DENIED,
-    CURLE_ABORTED_BY_CALLBACK
+    CURLE_ABORTED_BY_CALLBACK,
+    CURLE_RANGE_ERROR,
+    CURLE_PARTIAL_FILE
 } curl_easy_error_t;
 
 typedef enum {
-    CURLOPT_URL               = 10002,
-    CURLOPT_PROXY             = 10004,
-    CURLOPT_USERPWD           = 10005,
-    CURLOPT_PROXYUSERPWD      = 10006,
-    CURLOPT_RANGE             = 10007,
-    CURLOPT_POSTFIELDS        = 10015,
-    CURLOPT_REFERER           = 10016,
-    CURLOPT_USERAGENT         = 10018,
-    CURLOPT_HTTPHEADER        = 10023,
-    CURLOPT_COOKIE            = 10022,
-    CURLOPT_COOKIEFILE        = 10031,
-    CURLOPT_COOKIEJAR         = 10082,
-    CURLOPT_CUSTOMREQUEST     = 10036,
-    CURLOPT_POSTFIELDSIZE     = 60,
-    CURLOPT_TIMEOUT           = 78,
-    CURLOPT_TIMEOUT_MS        = 155,
-    CURLOPT_CONNECTTIMEOUT    = 78,
-    CURLOPT_CONNECTTIMEOUT_MS = 156,
-    CURLOPT_SSL_VERIFYPEER    = 64,
-    CURLOPT_SSL_VERIFYHOST    = 81,
-    CURLOPT_CAINFO            = 10065,
-    CURLOPT_CAPATH            = 10097,
-    CURLOPT_WRITEFUNCTION     = 20011,
-    CURLOPT_WRITEDATA         = 10001,
-    CURLOPT_HEADERFUNCTION    = 20079,
-    CURLOPT_HEADERDATA        = 10029,
-    CURLOPT_FOLLOWLOCATION    = 52,
-    CURLOPT_MAXREDIRS         = 68,
-    CURLOPT_HTTPGET           = 80,
-    CURLOPT_POST              = 47,
-    CURLOPT_PUT               = 54,
-    CURLOPT_NOBODY            = 44,
-    CURLOPT_VERBOSE           = 41,
-    CURLOPT_PROXYTYPE         = 101,
-    CURLOPT_PROXYPORT         = 59,
-    CURLOPT_HTTPAUTH          = 107,
-    CURLOPT_PROXYAUTH         = 111,
-    CURLOPT_BUFFERSIZE        = 98,
+    CURLOPT_URL                 = 10002,
+    CURLOPT_PROXY               = 10004,
+    CURLOPT_USERPWD             = 10005,
+    CURLOPT_PROXYUSERPWD        = 10006,
+    CURLOPT_RANGE               = 10007,
+    CURLOPT_POSTFIELDS          = 10015,
+    CURLOPT_REFERER             = 10016,
+    CURLOPT_USERAGENT           = 10018,
+    CURLOPT_HTTPHEADER          = 10023,
+    CURLOPT_COOKIE              = 10022,
+    CURLOPT_COOKIEFILE          = 10031,
+    CURLOPT_COOKIEJAR           = 10082,
+    CURLOPT_COOKIELIST          = 10135,
+    CURLOPT_CUSTOMREQUEST       = 10036,
+    CURLOPT_POSTFIELDSIZE       = 60,
+    CURLOPT_TIMEOUT             = 78,
+    CURLOPT_TIMEOUT_MS          = 155,
+    CURLOPT_CONNECTTIMEOUT      = 78,
+    CURLOPT_CONNECTTIMEOUT_MS   = 156,
+    CURLOPT_SSL_VERIFYPEER      = 64,
+    CURLOPT_SSL_VERIFYHOST      = 81,
+    CURLOPT_CAINFO              = 10065,
+    CURLOPT_CAPATH              = 10097,
+    CURLOPT_WRITEFUNCTION       = 20011,
+    CURLOPT_WRITEDATA           = 10001,
+    CURLOPT_HEADERFUNCTION      = 20079,
+    CURLOPT_HEADERDATA          = 10029,
+    CURLOPT_FOLLOWLOCATION      = 52,
+    CURLOPT_MAXREDIRS           = 68,
+    CURLOPT_HTTPGET             = 80,
+    CURLOPT_POST                = 47,
+    CURLOPT_PUT                 = 54,
+    CURLOPT_NOBODY              = 44,
+    CURLOPT_VERBOSE             = 41,
+    CURLOPT_PROXYTYPE           = 101,
+    CURLOPT_PROXYPORT           = 59,
+    CURLOPT_HTTPAUTH            = 107,
+    CURLOPT_PROXYAUTH           = 111,
+    CURLOPT_BUFFERSIZE          = 98,
+    CURLOPT_FRESH_CONNECT       = 74,
+    CURLOPT_FORBID_REUSE        = 75,
+    CURLOPT_SSL_SESSIONID_CACHE = 150,
+    CURLOPT_CA_CACHE_TIMEOUT    = 321,
+    CURLOPT_ACCEPT_ENCODING     = 10102,
+    CURLOPT_RESUME_FROM         = 21,
+    CURLOPT_RESUME_FROM_LARGE   = 30116,
 } curl_easy_option_t;
 
 typedef enum {
     CURLINFO_RESPONSE_CODE           = 0x200002,
     CURLINFO_CONTENT_LENGTH_DOWNLOAD = 0x300003,
     CURLINFO_CONTENT_TYPE            = 0x100012,
-    CURLINFO_EFFECTIVE_URL           = 0x100001
+    CURLINFO_EFFECTIVE_URL           = 0x100001,
+    CURLINFO_NUM_CONNECTS            = 0x20001a,
+    // BadgeVMS only, connections made and pooled connections reused over all transfers of the handle
+    CURLINFO_TOTAL_CONNECTS          = 0x200100,
+    CURLINFO_TOTAL_REUSES            = 0x200101
 } curl_easy_info_t;
 
 // Proxy types (for CURLOPT_PROXYTYPE)
@@ -136,6 +152,46 @@ typedef size_t (*curl_header_callback)(void *contents, size_t size, size_t nmemb
 
 typedef struct curl_handle curl_handle_t;
 
+typedef void CURLM;
+
+typedef enum {
+    CURLM_CALL_MULTI_PERFORM = -1,
+    CURLM_OK                 = 0,
+    CURLM_BAD_HANDLE,
+    CURLM_BAD_EASY_HANDLE,
+    CURLM_OUT_OF_MEMORY,
+    CURLM_INTERNAL_ERROR,
+    CURLM_BAD_SOCKET,
+    CURLM_UNKNOWN_OPTION,
+    CURLM_ADDED_ALREADY,
+} CURLMcode;
+
+typedef enum {
+    CURLMOPT_MAX_HOST_CONNECTIONS  = 7,
+    CURLMOPT_MAX_TOTAL_CONNECTIONS = 13,
+} CURLMoption;
+
+typedef enum { CURLMSG_NONE, CURLMSG_DONE } CURLMSG;
+
+typedef struct {
+    CURLMSG msg;
+    CURL   *easy_handle;
+    union {
+        void    *whatever;
+        CURLcode result;
+    } data;
+} CURLMsg;
+
+#define CURL_WAIT_POLLIN  0x0001
+#define CURL_WAIT_POLLPRI 0x0002
+#define CURL_WAIT_POLLOUT 0x0004
+
+struct curl_waitfd {
+    int   fd;
+    short events;
+    short revents;
+};
+
 struct curl_slist {
     char              *data;
     struct curl_slist *next;
@@ -151,6 +207,24 @@ char const *curl_easy_strerror(CURLcode error);
 struct curl_slist *curl_slist_append(struct curl_slist *list, char const *string);
 void               curl_slist_free_all(struct curl_slist *list);
 
+// Transfers added to a multi handle run at the same time from curl_multi_perform, without blocking. Proxies are not
+// supported: a handle with CURLOPT_PROXY set fails with CURLE_UNSUPPORTED_PROTOCOL, on its own or in a multi handle,
+// without connecting anywhere.
+CURLM      *curl_multi_init(void);
+CURLMcode   curl_multi_setopt(CURLM *multi, CURLMoption option, ...);
+CURLMcode   curl_multi_add_handle(CURLM *multi, CURL *curl);
+CURLMcode   curl_multi_remove_handle(CURLM *multi, CURL *curl);
+CURLMcode   curl_multi_perform(CURLM *multi, int *running_handles);
+CURLMcode   curl_multi_poll(
+    CURLM *multi, struct curl_waitfd *extra_fds, unsigned extra_nfds, int timeout_ms, int *numfds
+);
+CURLMcode   curl_multi_wait(
+    CURLM *multi, struct curl_waitfd *extra_fds, unsigned extra_nfds, int timeout_ms, int *numfds
+);
+CURLMsg    *curl_multi_info_read(CURLM *multi, int *msgs_in_queue);
+CURLMcode   curl_multi_cleanup(CURLM *multi);
+char const *curl_multi_strerror(CURLMcode error);
+
 CURLcode curl_global_init(long flags);
 void     curl_global_cleanup(void);
 
@@ -0,0 +1,396 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "io_queue.h"
+
+#include "esp_heap_caps.h"
+#include "splice.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#define IO_SLOT_BITS  8
+#define IO_SLOT_MASK  ((1 << IO_SLOT_BITS) - 1)
+#define IO_GENERATION 0x7fff
+
+_Static_assert(IO_QUEUE_DEPTH <= (1 << IO_SLOT_BITS), "IO_QUEUE_DEPTH does not fit in a request handle");
+
+static io_request_t slot_request(io_queue_t *queue, io_slot_t *slot) {
+    return ((slot->generation & IO_GENERATION) << IO_SLOT_BITS) | (int)(slot - queue->slots);
+}
+
+static void slot_free(io_slot_t *slot) {
+    if (slot->bounce) {
+        heap_caps_free(slot->bounce);
+    }
+
+    uint16_t generation = slot->generation + 1;
+    memset(slot, 0, sizeof(io_slot_t));
+    slot->generation = generation;
+    slot->next       = -1;
+    slot->state      = IO_SLOT_FREE;
+}
+
+void io_queue_init(io_queue_t *queue) {
+    memset(queue, 0, sizeof(io_queue_t));
+    queue->head = -1;
+    queue->tail = -1;
+    for (int i = 0; i < IO_QUEUE_DEPTH; ++i) {
+        queue->slots[i].next = -1;
+    }
+}
+
+void *io_bounce_create(io_op_t op, void const *buf, size_t *count) {
+    if (op == IO_OP_FSYNC) {
+        *count = 0;
+    }
+
+    if (*count > IO_BOUNCE_MAX) {
+        *count = IO_BOUNCE_MAX;
+    }
+
+    if (!*count) {
+        return NULL;
+    }
+
+    void *bounce = heap_caps_malloc(*count, MALLOC_CAP_SPIRAM);
+    if (bounce && op == IO_OP_WRITE) {
+        memcpy(bounce, buf, *count);
+    }
+
+    return bounce;
+}
+
+io_request_t io_queue_submit(
+    io_queue_t *queue,
+    io_op_t     op,
+    device_t   *device,
+    int         dev_fd,
+    void       *buf,
+    void       *bounce,
+    size_t      count,
+    off_t       offset,
+    void const *owner,
+    int        *err
+) {
+    io_slot_t *slot = NULL;
+    for (int i = 0; i < IO_QUEUE_DEPTH; ++i) {
+        if (queue->slots[i].state == IO_SLOT_FREE) {
+            slot = &queue->slots[i];
+            break;
+        }
+    }
+
+    if (!slot) {
+        *err = EAGAIN;
+        return -1;
+    }
+
+    slot->state  = IO_SLOT_QUEUED;
+    slot->op     = op;
+    slot->device = device;
+    slot->dev_fd = dev_fd;
+    slot->buf    = buf;
+    slot->bounce = bounce;
+    slot->count  = count;
+    slot->offset = offset;
+    slot->owner  = owner;
+    slot->next   = -1;
+
+    int index = slot - queue->slots;
+    if (queue->tail < 0) {
+        queue->head = index;
+    } else {
+        queue->slots[queue->tail].next = index;
+    }
+    queue->tail = index;
+    queue->queued++;
+
+    return slot_request(queue, slot);
+}
+
+io_request_t io_queue_submit_sendfile(
+    io_queue_t *queue,
+    device_t   *device,
+    int         dev_fd,
+    device_t   *sink,
+    int         sink_fd,
+    size_t      count,
+    off_t       offset,
+    void const *owner,
+    int        *err
+) {
+    if (count > IO_BOUNCE_MAX) {
+        count = IO_BOUNCE_MAX;
+    }
+
+    io_request_t request =
+        io_queue_submit(queue, IO_OP_SENDFILE, device, dev_fd, NULL, NULL, count, offset, owner, err);
+    if (request >= 0) {
+        io_slot_t *slot = &queue->slots[request & IO_SLOT_MASK];
+        slot->sink      = sink;
+        slot->sink_fd   = sink_fd;
+    }
+
+    return request;
+}
+
+// Whether a and b touch the same file or socket, which has to see them in the order they were submitted
+static bool slots_conflict(io_slot_t const *a, io_slot_t const *b) {
+    if (a->device == b->device && a->dev_fd == b->dev_fd) {
+        return true;
+    }
+
+    if (a->sink && a->sink == b->sink && a->sink_fd == b->sink_fd) {
+        return true;
+    }
+
+    return (a->sink && a->sink == b->device && a->sink_fd == b->dev_fd) ||
+           (b->sink && b->sink == a->device && b->sink_fd == a->dev_fd);
+}
+
+static bool slot_blocked(io_queue_t *queue, io_slot_t const *slot) {
+    for (int i = 0; i < IO_QUEUE_DEPTH; ++i) {
+        if (queue->slots[i].state == IO_SLOT_RUNNING && slots_conflict(&queue->slots[i], slot)) {
+            return true;
+        }
+    }
+
+    // Nor may it overtake an older request on the same file that is held back
+    for (int i = queue->head; i >= 0 && &queue->slots[i] != slot; i = queue->slots[i].next) {
+        if (slots_conflict(&queue->slots[i], slot)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+io_slot_t *io_queue_take(io_queue_t *queue) {
+    int prev  = -1;
+    int index = queue->head;
+    while (index >= 0 && slot_blocked(queue, &queue->slots[index])) {
+        prev  = index;
+        index = queue->slots[index].next;
+    }
+
+    if (index < 0) {
+        if (queue->queued) {
+            queue->deferred++;
+        }
+        return NULL;
+    }
+
+    io_slot_t *slot = &queue->slots[index];
+    if (prev < 0) {
+        queue->head = slot->next;
+    } else {
+        queue->slots[prev].next = slot->next;
+    }
+
+    if (queue->tail == index) {
+        queue->tail = prev;
+    }
+    queue->queued--;
+
+    slot->next  = -1;
+    slot->state = IO_SLOT_RUNNING;
+    return slot;
+}
+
+void io_slot_execute(io_slot_t *slot) {
+    device_t *device = slot->device;
+
+    errno = 0;
+    // A sendfile seeks by itself, it leaves the file position alone with an offset
+    if (slot->offset != IO_OFFSET_CURRENT && slot->op != IO_OP_FSYNC && slot->op != IO_OP_SENDFILE) {
+        if (!device->_lseek) {
+            slot->result = -1;
+            slot->error  = ESPIPE;
+            return;
+        }
+
+        if (device->_lseek(device, slot->dev_fd, slot->offset, SEEK_SET) < 0) {
+            slot->result = -1;
+            slot->error  = errno ? errno : EINVAL;
+            return;
+        }
+    }
+
+    switch (slot->op) {
+        case IO_OP_READ:
+            slot->result = device->_read ? device->_read(device, slot->dev_fd, slot->bounce, slot->count) : -1;
+            break;
+        case IO_OP_WRITE:
+            slot->result = device->_write ? device->_write(device, slot->dev_fd, slot->bounce, slot->count) : -1;
+            break;
+        case IO_OP_FSYNC: {
+            filesystem_device_t *fs_device = (filesystem_device_t *)device;
+            if (device->type == DEVICE_TYPE_FILESYSTEM && fs_device->_fsync) {
+                slot->result = fs_device->_fsync(fs_device, slot->dev_fd);
+            } else {
+                slot->result = 0;
+            }
+            break;
+        }
+        case IO_OP_SENDFILE: {
+            int error    = 0;
+            slot->result = splice_transfer(
+                device,
+                slot->dev_fd,
+                slot->sink,
+                slot->sink_fd,
+                slot->offset,
+                slot->count,
+                &error
+            );
+            errno = error;
+            break;
+        }
+        default:
+            slot->result = -1;
+            errno        = EINVAL;
+    }
+
+    slot->error = 0;
+    if (slot->result < 0) {
+        slot->error = errno ? errno : ENOSYS;
+    }
+}
+
+void *io_queue_complete(io_queue_t *queue, io_slot_t *slot) {
+    (void)queue;
+
+    if (slot->cancelled) {
+        slot_free(slot);
+        return NULL;
+    }
+
+    slot->state = IO_SLOT_DONE;
+    if (slot->waiter) {
+        slot->notified = true;
+    }
+
+    return slot->waiter;
+}
+
+size_t io_queue_retry(io_queue_t *queue) {
+    size_t deferred = queue->deferred;
+    queue->deferred = 0;
+    return deferred;
+}
+
+io_slot_t *io_queue_find(io_queue_t *queue, io_request_t request, void const *owner) {
+    if (request < 0) {
+        return NULL;
+    }
+
+    int index = request & IO_SLOT_MASK;
+    if (index >= IO_QUEUE_DEPTH) {
+        return NULL;
+    }
+
+    io_slot_t *slot = &queue->slots[index];
+    if (slot->state == IO_SLOT_FREE || slot->cancelled || slot->owner != owner ||
+        slot_request(queue, slot) != request) {
+        return NULL;
+    }
+
+    return slot;
+}
+
+bool io_queue_claim(io_queue_t *queue, io_slot_t *slot) {
+    (void)queue;
+
+    if (slot->state != IO_SLOT_DONE) {
+        return false;
+    }
+
+    slot->state = IO_SLOT_REAPING;
+    return true;
+}
+
+ssize_t io_slot_finish(io_slot_t *slot, int *err) {
+    if (slot->op == IO_OP_READ && slot->buf && slot->result > 0) {
+        memcpy(slot->buf, slot->bounce, slot->result);
+    }
+
+    void *bounce = slot->bounce;
+    slot->bounce = NULL;
+    if (bounce) {
+        heap_caps_free(bounce);
+    }
+
+    *err = slot->error;
+    return slot->result;
+}
+
+void io_queue_release(io_queue_t *queue, io_slot_t *slot) {
+    (void)queue;
+    slot_free(slot);
+}
+
+bool io_queue_cancel(io_queue_t *queue, io_slot_t *slot) {
+    if (slot->state != IO_SLOT_QUEUED) {
+        return false;
+    }
+
+    int index = slot - queue->slots;
+    int prev  = -1;
+    for (int i = queue->head; i >= 0; i = queue->slots[i].next) {
+        if (i == index) {
+            break;
+        }
+        prev = i;
+    }
+
+    if (prev < 0) {
+        queue->head = slot->next;
+    } else {
+        queue->slots[prev].next = slot->next;
+    }
+
+    if (queue->tail == index) {
+        queue->tail = prev;
+    }
+    queue->queued--;
+
+    slot_free(slot);
+    return true;
+}
+
+size_t io_queue_cancel_owner(io_queue_t *queue, void const *owner) {
+    size_t running = 0;
+
+    for (int i = 0; i < IO_QUEUE_DEPTH; ++i) {
+        io_slot_t *slot = &queue->slots[i];
+        if (slot->state == IO_SLOT_FREE || slot->owner != owner) {
+            continue;
+        }
+
+        switch (slot->state) {
+            case IO_SLOT_QUEUED: io_queue_cancel(queue, slot); break;
+            case IO_SLOT_RUNNING:
+                slot->cancelled = true;
+                running++;
+                break;
+            default: slot_free(slot);
+        }
+    }
+
+    return running;
+}
@@ -0,0 +1,121 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "badgevms/async_io.h"
+#include "badgevms/device.h"
+#include "badgevms_config.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+
+// The request queue behind the kernel I/O tasks. None of these functions lock, io_service.c holds its lock around
+// everything except io_bounce_create(), io_slot_execute() and io_slot_finish().
+
+typedef enum {
+    IO_SLOT_FREE,
+    IO_SLOT_QUEUED,
+    IO_SLOT_RUNNING,
+    IO_SLOT_DONE,
+    IO_SLOT_REAPING,
+} io_slot_state_t;
+
+typedef struct {
+    io_slot_state_t state;
+    uint16_t        generation;
+    bool            cancelled;
+    bool            notified;
+    int             next;
+    io_op_t         op;
+    device_t       *device;
+    int             dev_fd;
+    off_t           offset;
+    size_t          count;
+    void           *buf;
+    void           *bounce;
+    device_t       *sink; // The socket of IO_OP_SENDFILE
+    int             sink_fd;
+    void const     *owner;
+    void           *waiter;
+    ssize_t         result;
+    int             error;
+} io_slot_t;
+
+typedef struct {
+    io_slot_t slots[IO_QUEUE_DEPTH];
+    int       head;
+    int       tail;
+    size_t    queued;
+    size_t    deferred; // Times io_queue_take() found only requests held back behind a running one
+} io_queue_t;
+
+void io_queue_init(io_queue_t *queue);
+
+// Runs in the context of the caller, clamps *count to IO_BOUNCE_MAX and copies the data of a write
+void *io_bounce_create(io_op_t op, void const *buf, size_t *count);
+
+// Takes ownership of bounce on success, returns -1 and sets *err otherwise
+io_request_t io_queue_submit(
+    io_queue_t *queue,
+    io_op_t     op,
+    device_t   *device,
+    int         dev_fd,
+    void       *buf,
+    void       *bounce,
+    size_t      count,
+    off_t       offset,
+    void const *owner,
+    int        *err
+);
+
+// An IO_OP_SENDFILE from the file of device to sink, count is clamped to IO_BOUNCE_MAX
+io_request_t io_queue_submit_sendfile(
+    io_queue_t *queue,
+    device_t   *device,
+    int         dev_fd,
+    device_t   *sink,
+    int         sink_fd,
+    size_t      count,
+    off_t       offset,
+    void const *owner,
+    int        *err
+);
+
+// The oldest queued request that does not touch the file or socket of a running or older queued one, now running, or
+// NULL. Requests on one file descriptor therefore run one at a time and in order.
+io_slot_t *io_queue_take(io_queue_t *queue);
+void       io_slot_execute(io_slot_t *slot);
+// Returns the task waiting for the request, if any
+void      *io_queue_complete(io_queue_t *queue, io_slot_t *slot);
+// How many takes came up empty since the last call because every queued request was held back. Called after a
+// completion, which may have let those through.
+size_t     io_queue_retry(io_queue_t *queue);
+
+io_slot_t *io_queue_find(io_queue_t *queue, io_request_t request, void const *owner);
+// Marks a completed request as being reaped by the caller
+bool       io_queue_claim(io_queue_t *queue, io_slot_t *slot);
+// Runs in the context of the owner, copies read data into the buffer of the request
+ssize_t    io_slot_finish(io_slot_t *slot, int *err);
+void       io_queue_release(io_queue_t *queue, io_slot_t *slot);
+
+// Removes a request that has not started yet
+bool   io_queue_cancel(io_queue_t *queue, io_slot_t *slot);
+// Drops every request of owner, returns how many are still running and will be dropped when they complete
+size_t io_queue_cancel_owner(io_queue_t *queue, void const *owner);
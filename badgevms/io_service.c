@@ -0,0 +1,444 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "io_service.h"
+
+#include "badgevms_config.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "io_queue.h"
+#include "stat_cache.h"
+#include "task.h"
+#include "why_io.h"
+
+#include <stdbool.h>
+
+#include <errno.h>
+#include <fcntl.h>
+
+static char const *TAG = "io_service";
+
+static io_queue_t        io_queue;
+static SemaphoreHandle_t io_lock;
+static SemaphoreHandle_t io_pending;
+static TaskHandle_t      io_tasks[IO_TASKS];
+static bool              io_started;
+
+// Ferries file data between the processes and the filesystems
+static void charon(void *ignored) {
+    while (1) {
+        xSemaphoreTake(io_pending, portMAX_DELAY);
+
+        xSemaphoreTake(io_lock, portMAX_DELAY);
+        io_slot_t *slot = io_queue_take(&io_queue);
+        xSemaphoreGive(io_lock);
+
+        if (!slot) {
+            // Cancelled before we got to it, or held back behind a running request on the same file
+            continue;
+        }
+
+        io_slot_execute(slot);
+
+        // Notify while holding the lock so a waiter that timed out can tell whether it still has to consume it
+        xSemaphoreTake(io_lock, portMAX_DELAY);
+        TaskHandle_t waiter = io_queue_complete(&io_queue, slot);
+        if (waiter) {
+            xTaskNotifyGiveIndexed(waiter, 0);
+        }
+        size_t retry = io_queue_retry(&io_queue);
+        xSemaphoreGive(io_lock);
+
+        // Wake the I/O tasks that found only requests waiting for this one to finish
+        while (retry--) {
+            xSemaphoreGive(io_pending);
+        }
+    }
+}
+
+static io_request_t
+    io_service_submit(io_op_t op, device_t *device, int dev_fd, void *buf, size_t count, off_t offset, int *err) {
+    void *bounce = io_bounce_create(op, buf, &count);
+    if (!bounce && count) {
+        *err = ENOMEM;
+        return -1;
+    }
+
+    xSemaphoreTake(io_lock, portMAX_DELAY);
+    io_request_t request =
+        io_queue_submit(&io_queue, op, device, dev_fd, buf, bounce, count, offset, get_task_info()->thread, err);
+    xSemaphoreGive(io_lock);
+
+    if (request < 0) {
+        heap_caps_free(bounce);
+        return -1;
+    }
+
+    xSemaphoreGive(io_pending);
+    return request;
+}
+
+static ssize_t io_service_wait(io_request_t request, bool block, uint32_t timeout_msec, int *err) {
+    void const  *owner   = get_task_info()->thread;
+    TaskHandle_t me      = xTaskGetCurrentTaskHandle();
+    TickType_t   start   = xTaskGetTickCount();
+    TickType_t   timeout = block ? portMAX_DELAY : pdMS_TO_TICKS(timeout_msec);
+    io_slot_t   *slot;
+
+    while (1) {
+        xSemaphoreTake(io_lock, portMAX_DELAY);
+        slot = io_queue_find(&io_queue, request, owner);
+        if (!slot) {
+            xSemaphoreGive(io_lock);
+            *err = EINVAL;
+            return -1;
+        }
+
+        if (io_queue_claim(&io_queue, slot)) {
+            xSemaphoreGive(io_lock);
+            break;
+        }
+
+        TickType_t waited = xTaskGetTickCount() - start;
+        if (!block && waited >= timeout) {
+            xSemaphoreGive(io_lock);
+            *err = ETIMEDOUT;
+            return -1;
+        }
+
+        slot->waiter   = me;
+        slot->notified = false;
+        xSemaphoreGive(io_lock);
+
+        uint32_t woken = ulTaskNotifyTakeIndexed(0, pdTRUE, block ? portMAX_DELAY : timeout - waited);
+
+        xSemaphoreTake(io_lock, portMAX_DELAY);
+        if (slot->waiter == me) {
+            slot->waiter = NULL;
+            if (!woken && slot->notified) {
+                // Completed between our timeout and taking the lock, don't leave the notification for someone else
+                ulTaskNotifyTakeIndexed(0, pdTRUE, 0);
+            }
+        }
+        xSemaphoreGive(io_lock);
+    }
+
+    ssize_t result = io_slot_finish(slot, err);
+
+    xSemaphoreTake(io_lock, portMAX_DELAY);
+    io_queue_release(&io_queue, slot);
+    xSemaphoreGive(io_lock);
+
+    return result;
+}
+
+static device_t *fd_to_filesystem(int fd, int *dev_fd, int *err) {
+    task_info_t *task_info = get_task_info();
+
+    if (fd < 0 || fd >= MAXFD || !task_info->thread->file_handles[fd].is_open) {
+        *err = EBADF;
+        return NULL;
+    }
+
+    device_t *device = task_info->thread->file_handles[fd].device;
+    if (!device || device->type != DEVICE_TYPE_FILESYSTEM) {
+        *err = EINVAL;
+        return NULL;
+    }
+
+    *dev_fd = task_info->thread->file_handles[fd].dev_fd;
+    return device;
+}
+
+static device_t *fd_to_socket(int fd, int *dev_fd, int *err) {
+    task_info_t *task_info = get_task_info();
+
+    if (fd < 0 || fd >= MAXFD || !task_info->thread->file_handles[fd].is_open) {
+        *err = EBADF;
+        return NULL;
+    }
+
+    device_t *device = task_info->thread->file_handles[fd].device;
+    if (!device || device->type != DEVICE_TYPE_SOCKET) {
+        *err = EINVAL;
+        return NULL;
+    }
+
+    *dev_fd = task_info->thread->file_handles[fd].dev_fd;
+    return device;
+}
+
+static io_request_t io_service_sendfile(int out_fd, int in_fd, off_t offset, size_t count, int *err) {
+    int sink_fd = -1;
+    int dev_fd  = -1;
+
+    device_t *device = fd_to_filesystem(in_fd, &dev_fd, err);
+    device_t *sink   = device ? fd_to_socket(out_fd, &sink_fd, err) : NULL;
+    if (!sink) {
+        return -1;
+    }
+
+    xSemaphoreTake(io_lock, portMAX_DELAY);
+    io_request_t request =
+        io_queue_submit_sendfile(&io_queue, device, dev_fd, sink, sink_fd, count, offset, get_task_info()->thread, err);
+    xSemaphoreGive(io_lock);
+
+    if (request >= 0) {
+        xSemaphoreGive(io_pending);
+    }
+    return request;
+}
+
+// The I/O tasks send without waiting for room, so a sendfile() to a blocking socket waits here, in the caller
+static bool socket_blocking(int fd) {
+    int              dev_fd;
+    int              err;
+    socket_device_t *sock = (socket_device_t *)fd_to_socket(fd, &dev_fd, &err);
+
+    return sock && !(sock->_fcntl && (sock->_fcntl(sock, dev_fd, F_GETFL, 0) & O_NONBLOCK));
+}
+
+static bool wait_writable(int fd, int *err) {
+    struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+
+    if (why_poll(&pfd, 1, -1) < 0) {
+        *err = get_task_info()->_errno;
+        return false;
+    }
+    return true;
+}
+
+bool io_service_running(void) {
+    return io_started;
+}
+
+ssize_t io_service_transfer(io_op_t op, device_t *device, int dev_fd, void *buf, size_t count) {
+    size_t done = 0;
+    int    err  = 0;
+
+    do {
+        size_t chunk = count - done;
+        if (chunk > IO_BOUNCE_MAX) {
+            chunk = IO_BOUNCE_MAX;
+        }
+
+        io_request_t request =
+            io_service_submit(op, device, dev_fd, (char *)buf + done, chunk, IO_OFFSET_CURRENT, &err);
+        if (request < 0) {
+            break;
+        }
+
+        ssize_t r = io_service_wait(request, true, 0, &err);
+        if (r < 0) {
+            break;
+        }
+
+        done += r;
+        if ((size_t)r < chunk) {
+            break;
+        }
+    } while (done < count);
+
+    if (!done && err) {
+        get_task_info()->_errno = err;
+        return -1;
+    }
+
+    return done;
+}
+
+void io_service_cancel_owner(void const *owner) {
+    if (!io_started) {
+        return;
+    }
+
+    while (1) {
+        xSemaphoreTake(io_lock, portMAX_DELAY);
+        size_t running = io_queue_cancel_owner(&io_queue, owner);
+        xSemaphoreGive(io_lock);
+
+        if (!running) {
+            break;
+        }
+
+        vTaskDelay(1);
+    }
+}
+
+io_request_t io_submit(io_op_t op, int fd, void *buf, size_t count, off_t offset) {
+    int err    = 0;
+    int dev_fd = -1;
+
+    if (!io_started || op < IO_OP_READ || op > IO_OP_FSYNC || (count && !buf)) {
+        get_task_info()->_errno = io_started ? EINVAL : ENOSYS;
+        return -1;
+    }
+
+    device_t *device = fd_to_filesystem(fd, &dev_fd, &err);
+    if (!device) {
+        get_task_info()->_errno = err;
+        return -1;
+    }
+
+    // Dropped again on close, which is what makes the new size visible to stat
+    if (op == IO_OP_WRITE) {
+        stat_cache_invalidate_hash(get_task_info()->thread->file_handles[fd].stat_hash);
+    }
+
+    io_request_t request = io_service_submit(op, device, dev_fd, buf, count, offset, &err);
+    if (request < 0) {
+        get_task_info()->_errno = err;
+    }
+
+    return request;
+}
+
+int io_poll(io_request_t request) {
+    if (!io_started) {
+        get_task_info()->_errno = EINVAL;
+        return -1;
+    }
+
+    xSemaphoreTake(io_lock, portMAX_DELAY);
+    io_slot_t *slot  = io_queue_find(&io_queue, request, get_task_info()->thread);
+    int        state = slot ? slot->state : IO_SLOT_FREE;
+    xSemaphoreGive(io_lock);
+
+    if (!slot) {
+        get_task_info()->_errno = EINVAL;
+        return -1;
+    }
+
+    return state == IO_SLOT_DONE;
+}
+
+ssize_t io_wait(io_request_t request, bool block, uint32_t timeout_msec) {
+    int err = EINVAL;
+
+    ssize_t result = io_started ? io_service_wait(request, block, timeout_msec, &err) : -1;
+    if (result < 0) {
+        get_task_info()->_errno = err;
+    }
+
+    return result;
+}
+
+int io_cancel(io_request_t request) {
+    int err = EINVAL;
+
+    if (!io_started) {
+        get_task_info()->_errno = err;
+        return -1;
+    }
+
+    xSemaphoreTake(io_lock, portMAX_DELAY);
+    io_slot_t *slot      = io_queue_find(&io_queue, request, get_task_info()->thread);
+    bool       cancelled = slot && io_queue_cancel(&io_queue, slot);
+    if (slot && !cancelled) {
+        // Already running or done, the data goes nowhere
+        slot->buf = NULL;
+    }
+    xSemaphoreGive(io_lock);
+
+    if (!slot) {
+        get_task_info()->_errno = err;
+        return -1;
+    }
+
+    if (!cancelled) {
+        io_service_wait(request, true, 0, &err);
+    }
+
+    return 0;
+}
+
+bool io_service_init(void) {
+    io_queue_init(&io_queue);
+
+    io_lock    = xSemaphoreCreateMutex();
+    io_pending = xSemaphoreCreateCounting(IO_QUEUE_DEPTH, 0);
+    if (!io_lock || !io_pending) {
+        ESP_LOGE(TAG, "Unable to create I/O queue");
+        return false;
+    }
+
+    for (int i = 0; i < IO_TASKS; ++i) {
+        if (create_kernel_task(charon, "Charon", 4096, NULL, 8, &io_tasks[i], 0) != pdTRUE) {
+            ESP_LOGE(TAG, "Unable to create I/O task %i", i);
+            return false;
+        }
+    }
+
+    io_started = true;
+    return true;
+}
+
+io_request_t io_sendfile(int out_fd, int in_fd, off_t offset, size_t count) {
+    int err = ENOSYS;
+
+    io_request_t request = io_started ? io_service_sendfile(out_fd, in_fd, offset, count, &err) : -1;
+    if (request < 0) {
+        get_task_info()->_errno = err;
+    }
+
+    return request;
+}
+
+ssize_t why_sendfile(int out_fd, int in_fd, off_t *offset, size_t count) {
+    size_t done     = 0;
+    int    err      = io_started ? 0 : ENOSYS;
+    bool   blocking = io_started && socket_blocking(out_fd);
+
+    while (io_started && done < count) {
+        size_t chunk = count - done;
+        if (chunk > IO_BOUNCE_MAX) {
+            chunk = IO_BOUNCE_MAX;
+        }
+
+        off_t        at      = offset ? *offset + (off_t)done : IO_OFFSET_CURRENT;
+        io_request_t request = io_service_sendfile(out_fd, in_fd, at, chunk, &err);
+        if (request < 0) {
+            break;
+        }
+
+        ssize_t r = io_service_wait(request, true, 0, &err);
+        if (r < 0 && err == EAGAIN && blocking && wait_writable(out_fd, &err)) {
+            continue;
+        }
+        if (r < 0) {
+            break;
+        }
+
+        done += r;
+        // Short at the end of the file, or where a non-blocking socket filled up
+        if (!r || ((size_t)r < chunk && !blocking)) {
+            break;
+        }
+    }
+
+    if (offset) {
+        *offset += done;
+    }
+
+    if (!done && err) {
+        get_task_info()->_errno = err;
+        return -1;
+    }
+
+    return done;
+}
@@ -0,0 +1,34 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "badgevms/async_io.h"
+#include "badgevms/device.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <sys/types.h>
+
+bool io_service_init(void);
+bool io_service_running(void);
+
+// Read or write through the I/O tasks on behalf of the calling task, waits for completion
+ssize_t io_service_transfer(io_op_t op, device_t *device, int dev_fd, void *buf, size_t count);
+
+// Drops the requests of a thread that is being destroyed, waits for the ones already running
+void io_service_cancel_owner(void const *owner);
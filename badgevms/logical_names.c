@@ -35,10 +35,12 @@
     } while (0)
 #endif
 
+#include "badgevms_config.h"
 #include "hash_helper.h"
 #include "logical_names.h"
 #include "thirdparty/khash.h"
 
+#include <stdatomic.h>
 #include <stdio.h>
 
 #include <ctype.h>
@@ -80,6 +82,26 @@ static parsed_components_t const parsed_components_null = {
 KHASH_MAP_INIT_STR(lnametable, logical_name_target_t);
 static khash_t(lnametable) * logical_name_table;
 
+// The flattened search list of a name: the name followed by every fully resolved translation, NUL separated. For a
+// path the name is its device with the ':', the rest of the path is added to a translation. Readers don't lock,
+// seq is odd while the slot is being rewritten and a reader that saw it change throws away what it copied.
+typedef struct {
+    atomic_uint  seq;
+    unsigned int generation;
+    uint32_t     hash;
+    uint16_t     key_len;
+    uint16_t     count;
+    uint16_t     offsets[LOGICAL_NAME_CACHE_MAX_LIST + 1];
+    char         data[LOGICAL_NAME_CACHE_SLOT_BYTES];
+} cache_slot_t;
+
+static cache_slot_t cache[LOGICAL_NAME_CACHE_SLOTS];
+// Bumped on every change to the table, entries compiled under an older generation are dead
+static atomic_uint  cache_generation = 1;
+static atomic_uint  cache_hits;
+static atomic_uint  cache_misses;
+static atomic_uint  cache_uncacheable;
+
 static inline bool raw_cmp(raw_string_t *l, raw_string_t *r) {
     if (l->pointer != r->pointer)
         return false;
@@ -472,6 +494,226 @@ static parsed_components_t _logical_name_resolve(parsed_components_t path, size_
     return _logical_name_resolve(path, list_idx, depth + 1);
 }
 
+static logical_name_result_t logical_name_resolve_uncached(char *logical_name, size_t idx) {
+    parsed_components_t   parsed = _logical_name_resolve(parse_cstring(logical_name), idx, 0);
+    logical_name_result_t result = {
+        .result       = parsed_components_serialize(parsed),
+        .result_count = parsed.count,
+    };
+    return result;
+}
+
+static uint32_t key_hash(char const *key, size_t len) {
+    uint32_t hash = 0;
+    for (size_t i = 0; i < len; ++i) {
+        hash = (hash << 5) - hash + (uint8_t)key[i];
+    }
+    return hash;
+}
+
+// Everything up to and including the device's ':' for a path, the whole string when it isn't one. Resolving a path
+// starts by translating that part, which is what ends up in the cache.
+static size_t cache_key_len(char const *logical_name, size_t len) {
+    parsed_components_t parsed = parse_string(raw_from_ptr((char *)logical_name, len, false));
+    return parsed.unparsable.len ? len : parsed.device.len + 1;
+}
+
+// Copies out translation idx of the name, the list has *count entries
+static bool cache_lookup(char const *key, size_t len, uint32_t hash, size_t idx, char **translation, size_t *count) {
+    cache_slot_t *slot       = &cache[hash % LOGICAL_NAME_CACHE_SLOTS];
+    unsigned int  generation = atomic_load_explicit(&cache_generation, memory_order_acquire);
+    unsigned int  seq        = atomic_load_explicit(&slot->seq, memory_order_acquire);
+
+    if (seq & 1) {
+        return false;
+    }
+
+    if (slot->generation != generation || slot->hash != hash || slot->key_len != len) {
+        return false;
+    }
+
+    size_t slot_count = slot->count;
+    if (idx >= slot_count || slot_count > LOGICAL_NAME_CACHE_MAX_LIST || memcmp(slot->data, key, len) != 0) {
+        return false;
+    }
+
+    // Everything read so far may be torn, don't trust the offsets further than the slot
+    size_t start = slot->offsets[idx];
+    size_t end   = slot->offsets[idx + 1];
+    if (start >= end || end > LOGICAL_NAME_CACHE_SLOT_BYTES) {
+        return false;
+    }
+
+    char *result = malloc(end - start);
+    if (!result) {
+        return false;
+    }
+    memcpy(result, slot->data + start, end - start - 1);
+    result[end - start - 1] = '\0';
+
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq) {
+        free(result);
+        return false;
+    }
+
+    *translation = result;
+    *count       = slot_count;
+    return true;
+}
+
+static void cache_store(
+    char const            *key,
+    size_t                 len,
+    uint32_t               hash,
+    unsigned int           generation,
+    logical_name_result_t *list,
+    size_t                 count
+) {
+    size_t needed = len;
+    for (size_t i = 0; i < count; ++i) {
+        if (!list[i].result || list[i].result_count != count) {
+            // Not a stable list, leave it to the slow path
+            atomic_fetch_add(&cache_uncacheable, 1);
+            return;
+        }
+        needed += strlen(list[i].result) + 1;
+    }
+
+    if (needed > LOGICAL_NAME_CACHE_SLOT_BYTES) {
+        atomic_fetch_add(&cache_uncacheable, 1);
+        return;
+    }
+
+    cache_slot_t *slot = &cache[hash % LOGICAL_NAME_CACHE_SLOTS];
+    unsigned int  seq  = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+
+    // Someone else is filling this slot, they can have it
+    if ((seq & 1) || !atomic_compare_exchange_strong(&slot->seq, &seq, seq + 1)) {
+        return;
+    }
+    atomic_thread_fence(memory_order_release);
+
+    slot->generation = generation;
+    slot->hash       = hash;
+    slot->key_len    = len;
+    slot->count      = count;
+    memcpy(slot->data, key, len);
+
+    size_t offset = len;
+    for (size_t i = 0; i < count; ++i) {
+        size_t result_len = strlen(list[i].result) + 1;
+        slot->offsets[i]  = offset;
+        memcpy(slot->data + offset, list[i].result, result_len);
+        offset += result_len;
+    }
+    slot->offsets[count] = offset;
+
+    atomic_store_explicit(&slot->seq, seq + 2, memory_order_release);
+}
+
+// Puts the directories and file of the path behind the translation of its device, like resolving it from scratch
+// would, and resolves what they name themselves. Everything in the translation is final already and isn't looked up
+// again. Both strings must be writable.
+static bool translation_apply(char *translation, size_t count, char *logical_name, logical_name_result_t *out) {
+    parsed_components_t device = parse_cstring(translation);
+    parsed_components_t path   = parse_cstring(logical_name);
+
+    if (device.unparsable.len || !device.device.len || device.dir_count + path.dir_count > MAX_DIR_DEPTH) {
+        return false;
+    }
+
+    for (int i = 0; i < path.dir_count; ++i) {
+        path.dir_components[i] = resolve_string(path.dir_components[i], 0, 1);
+    }
+    memmove(&path.dir_components[device.dir_count], path.dir_components, path.dir_count * sizeof(raw_string_t));
+    memcpy(path.dir_components, device.dir_components, device.dir_count * sizeof(raw_string_t));
+    path.dir_count += device.dir_count;
+    path.device     = device.device;
+    path.filename   = device.filename.len ? device.filename : resolve_string(path.filename, 0, 1);
+
+    out->result       = parsed_components_serialize(path);
+    out->result_count = count;
+    return true;
+}
+
+// Translates the whole search list of the name in one go, so walking it afterwards, for any path on it, only hits
+// the cache
+static bool cache_compile(char const *key, size_t len, uint32_t hash, size_t idx, char **translation, size_t *count) {
+    unsigned int          generation = atomic_load_explicit(&cache_generation, memory_order_acquire);
+    logical_name_result_t list[LOGICAL_NAME_CACHE_MAX_LIST];
+    bool                  found = false;
+
+    // One spare byte, resolving a device may try it with a ':' added
+    char *tmp = malloc(len + 2);
+    if (!tmp) {
+        return false;
+    }
+    memcpy(tmp, key, len);
+    tmp[len] = '\0';
+
+    list[0] = logical_name_resolve_uncached(tmp, 0);
+    *count  = list[0].result_count;
+
+    if (!*count || *count > LOGICAL_NAME_CACHE_MAX_LIST || len > LOGICAL_NAME_CACHE_SLOT_BYTES) {
+        atomic_fetch_add(&cache_uncacheable, 1);
+        logical_name_result_free(list[0]);
+        free(tmp);
+        return false;
+    }
+
+    for (size_t i = 1; i < *count; ++i) {
+        list[i] = logical_name_resolve_uncached(tmp, i);
+    }
+    free(tmp);
+
+    cache_store(key, len, hash, generation, list, *count);
+
+    for (size_t i = 0; i < *count; ++i) {
+        if (i == idx && list[i].result && list[i].result_count == *count) {
+            *translation = list[i].result;
+            found        = true;
+        } else {
+            logical_name_result_free(list[i]);
+        }
+    }
+
+    return found;
+}
+
+// logical_name is a writable copy of key
+static logical_name_result_t cached_resolve(char const *key, char *logical_name, size_t idx) {
+    size_t                len     = strlen(key);
+    size_t                key_len = cache_key_len(key, len);
+    uint32_t              hash    = key_hash(key, key_len);
+    char                 *translation;
+    size_t                count;
+    logical_name_result_t result;
+
+    if (cache_lookup(key, key_len, hash, idx, &translation, &count)) {
+        atomic_fetch_add(&cache_hits, 1);
+    } else {
+        atomic_fetch_add(&cache_misses, 1);
+        if (!cache_compile(key, key_len, hash, idx, &translation, &count)) {
+            return logical_name_resolve_uncached(logical_name, idx);
+        }
+    }
+
+    if (key_len == len) {
+        result.result       = translation;
+        result.result_count = count;
+        return result;
+    }
+
+    if (!translation_apply(translation, count, logical_name, &result)) {
+        atomic_fetch_add(&cache_uncacheable, 1);
+        result = logical_name_resolve_uncached(logical_name, idx);
+    }
+
+    free(translation);
+    return result;
+}
+
 bool logical_names_system_init() {
     ESP_LOGI(TAG, "Initializing");
     logical_name_table = kh_init(lnametable);
@@ -534,6 +776,7 @@ int logical_name_set(char const *logical_name, char const *target, bool is_termi
 
     if (name.target_count) {
         khash_insert_str(lnametable, logical_name_table, logical_name, name, char const *);
+        atomic_fetch_add_explicit(&cache_generation, 1, memory_order_release);
         return 0;
     }
 
@@ -553,6 +796,7 @@ logical_name_target_t logical_name_get(char const *logical_name) {
 
 void logical_name_del(char const *logical_name) {
     khash_del_str(lnametable, logical_name_table, logical_name, "Logical name did not exist");
+    atomic_fetch_add_explicit(&cache_generation, 1, memory_order_release);
 }
 
 logical_name_result_t logical_name_resolve(char *logical_name, size_t idx) {
@@ -561,23 +805,39 @@ logical_name_result_t logical_name_resolve(char *logical_name, size_t idx) {
         // Don't try and parse empty strings or NULL
         result.result_count = 0;
         result.result       = NULL;
-        goto out;
+        return result;
     }
-    parsed_components_t parsed = _logical_name_resolve(parse_cstring(logical_name), idx, 0);
-    result.result              = parsed_components_serialize(parsed);
-    result.result_count        = parsed.count;
 
-out:
-    return result;
+    return cached_resolve(logical_name, logical_name, idx);
 }
 
 logical_name_result_t logical_name_resolve_const(char const *logical_name, size_t idx) {
-    char                 *tmp    = strdup(logical_name);
-    logical_name_result_t result = logical_name_resolve(tmp, idx);
+    logical_name_result_t result;
+    if (!logical_name || !strlen(logical_name)) {
+        result.result_count = 0;
+        result.result       = NULL;
+        return result;
+    }
+
+    char *tmp = strdup(logical_name);
+    if (!tmp) {
+        result.result_count = 0;
+        result.result       = NULL;
+        return result;
+    }
+
+    result = cached_resolve(logical_name, tmp, idx);
     free(tmp);
     return result;
 }
 
+void logical_name_cache_stats_get(logical_name_cache_stats_t *stats) {
+    stats->hits        = atomic_load(&cache_hits);
+    stats->misses      = atomic_load(&cache_misses);
+    stats->uncacheable = atomic_load(&cache_uncacheable);
+    stats->generation  = atomic_load(&cache_generation);
+}
+
 void logical_name_result_free(logical_name_result_t result) {
     free(result.result);
 }
@@ -657,6 +917,176 @@ test_t tests[] = {
     {NULL, NULL, 0, 0},
 };
 
+#include <time.h>
+
+#define BENCH_ITERATIONS 20000
+
+static bool check_resolve(char const *in, size_t idx, char const *expect, size_t expect_count) {
+    logical_name_result_t res  = logical_name_resolve_const(in, idx);
+    bool                  fail = res.result_count != expect_count || !res.result || strcmp(res.result, expect) != 0;
+
+    if (fail) {
+        printf(
+            "\033[31mCache testcase '%s' idx %zi failed.\n\tExpected: '%s' (%zi)\n\tActual:   '%s' (%zi)\033[0m\n",
+            in,
+            idx,
+            expect,
+            expect_count,
+            res.result,
+            res.result_count
+        );
+    }
+
+    logical_name_result_free(res);
+    return !fail;
+}
+
+// The cached result has to be exactly what resolving from scratch gives
+static bool check_against_uncached(char const *in, size_t idx) {
+    char                 *tmp    = strdup(in);
+    logical_name_result_t slow   = logical_name_resolve_uncached(tmp, idx);
+    logical_name_result_t cached = logical_name_resolve_const(in, idx);
+    bool                  fail   = slow.result_count != cached.result_count || !slow.result != !cached.result ||
+                  (slow.result && strcmp(slow.result, cached.result) != 0);
+
+    if (fail) {
+        printf(
+            "\033[31mCached '%s' idx %zi differs.\n\tUncached: '%s' (%zi)\n\tCached:   '%s' (%zi)\033[0m\n",
+            in,
+            idx,
+            slow.result,
+            slow.result_count,
+            cached.result,
+            cached.result_count
+        );
+    }
+
+    free(tmp);
+    logical_name_result_free(slow);
+    logical_name_result_free(cached);
+    return !fail;
+}
+
+static bool cache_tests(test_t *tests) {
+    bool                       error = false;
+    logical_name_cache_stats_t before, after;
+
+    printf("=== Running cache tests === \n");
+
+    // Second time around everything should come from the cache
+    logical_name_cache_stats_get(&before);
+    for (test_t *test = tests; test->in; ++test) {
+        error |= !check_against_uncached(test->in, test->idx);
+    }
+    logical_name_cache_stats_get(&after);
+    if (after.hits == before.hits) {
+        printf("\033[31mNothing was served from the cache\033[0m\n");
+        error = true;
+    }
+
+    // Walking a search list compiles it once, for every path on it
+    logical_name_set("WALK", "SEARCH:[W], USER:", false);
+    logical_name_cache_stats_get(&before);
+    error |= !check_resolve("WALK:[X]a.txt", 0, "DRIVE0:[SUBDIR.W.X]a.txt", 2);
+    error |= !check_resolve("WALK:[X]a.txt", 1, "MYFLASH:[dira.X]a.txt", 2);
+    error |= !check_resolve("WALK:[X]b.txt", 0, "DRIVE0:[SUBDIR.W.X]b.txt", 2);
+    error |= !check_resolve("WALK:[DIR1]FILE1", 1, "MYFLASH:[dira.SUBST1]FILENAME.EXT", 2);
+    error |= !check_resolve("WALK:", 1, "MYFLASH:[dira]", 2);
+    error |= !check_against_uncached("WALK:[DIR1.DIR3]FILE2", 0);
+    logical_name_cache_stats_get(&after);
+    if (after.misses - before.misses != 1 || after.hits - before.hits != 5) {
+        printf(
+            "\033[31mSearch list walk: %u misses, %u hits\033[0m\n",
+            after.misses - before.misses,
+            after.hits - before.hits
+        );
+        error = true;
+    }
+
+    // Any change invalidates, also for names that only show up halfway through the chain
+    error |= !check_resolve("USER:file.txt", 0, "MYFLASH:[dira]file.txt", 1);
+    logical_name_cache_stats_get(&before);
+    logical_name_set("FLASH0", "OTHERFLASH", false);
+    logical_name_cache_stats_get(&after);
+    if (after.generation == before.generation) {
+        printf("\033[31mlogical_name_set() did not bump the generation\033[0m\n");
+        error = true;
+    }
+    error |= !check_resolve("USER:file.txt", 0, "OTHERFLASH:[dira]file.txt", 1);
+    logical_name_set("FLASH0", "MYFLASH", false);
+    error |= !check_resolve("USER:file.txt", 0, "MYFLASH:[dira]file.txt", 1);
+
+    error |= !check_resolve("SIMPLE", 0, "STRING", 1);
+    logical_name_del("SIMPLE");
+    error |= !check_resolve("SIMPLE", 0, "SIMPLE", 1);
+    logical_name_set("SIMPLE", "STRING", false);
+    error |= !check_resolve("SIMPLE", 0, "STRING", 1);
+
+    // Lists that grow and shrink
+    logical_name_set("GROW", "ONE", false);
+    error |= !check_resolve("GROW", 0, "ONE", 1);
+    logical_name_set("GROW", "ONE, TWO", false);
+    error |= !check_resolve("GROW", 1, "TWO", 2);
+    logical_name_set("GROW", "ONE", false);
+    error |= !check_resolve("GROW", 0, "ONE", 1);
+
+    printf("=== End     cache tests === \n\n");
+    return error;
+}
+
+static double bench_seconds(char const *path, size_t count, bool cached) {
+    clock_t start = clock();
+    for (int i = 0; i < BENCH_ITERATIONS; ++i) {
+        for (size_t idx = 0; idx < count; ++idx) {
+            logical_name_result_t res;
+            if (cached) {
+                res = logical_name_resolve_const(path, idx);
+            } else {
+                char *tmp = strdup(path);
+                res       = logical_name_resolve_uncached(tmp, idx);
+                free(tmp);
+            }
+            logical_name_result_free(res);
+        }
+    }
+    return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+static bool cache_benchmark() {
+    bool error = false;
+    char name[16];
+    char target[16];
+
+    // A SYS$LIBRARY style search list where every entry goes through a long chain of names
+    for (int i = 0; i < 12; ++i) {
+        snprintf(name, sizeof(name), "LIB%d", i);
+        snprintf(target, sizeof(target), "LIB%d:", i + 1);
+        logical_name_set(strdup(name), target, false);
+    }
+    logical_name_set("LIB12", "SD0:[BADGEVMS.LIB]", false);
+    logical_name_set("ALTLIB", "LIB4:[ALT]", false);
+    logical_name_set("SYS$LIBRARY", "LIB0:, ALTLIB:, FLASH0:[SYS.LIB], LIB6:[OLD]", false);
+
+    char const *path = "SYS$LIBRARY:[SUB]libfoo.so";
+    for (size_t idx = 0; idx < 4; ++idx) {
+        error |= !check_against_uncached(path, idx);
+    }
+    error |= !check_resolve(path, 1, "SD0:[BADGEVMS.LIB.ALT.SUB]libfoo.so", 4);
+
+    double uncached = bench_seconds(path, 4, false);
+    double cached   = bench_seconds(path, 4, true);
+
+    printf(
+        "Resolving a 4 entry search list %d times: %.1f ms uncached, %.1f ms cached (%.1fx)\n",
+        BENCH_ITERATIONS,
+        uncached * 1000,
+        cached * 1000,
+        cached > 0 ? uncached / cached : 0
+    );
+
+    return error;
+}
+
 int main() {
     logical_names_system_init();
 
@@ -753,6 +1183,9 @@ int main() {
         ++test;
     }
 
+    error |= cache_tests(tests);
+    error |= cache_benchmark();
+
     if (!error) {
         printf("\033[32mAll tests passed\033[0m\n");
     }
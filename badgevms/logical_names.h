@@ -25,6 +25,13 @@ typedef struct {
     size_t result_count;
 } logical_name_result_t;
 
+typedef struct {
+    uint32_t     hits;
+    uint32_t     misses;
+    uint32_t     uncacheable;
+    unsigned int generation;
+} logical_name_cache_stats_t;
+
 typedef struct {
     char **target;
     size_t target_count;
@@ -38,3 +45,4 @@ void                  logical_name_del(char const *logical_name);
 void                  logical_name_result_free(logical_name_result_t result);
 logical_name_result_t logical_name_resolve(char *logical_name, size_t idx);
 logical_name_result_t logical_name_resolve_const(char const *logical_name, size_t idx);
+void                  logical_name_cache_stats_get(logical_name_cache_stats_t *stats);
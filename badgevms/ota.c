@@ -16,11 +16,18 @@
 
 #include "badgevms/ota.h"
 
+#include "badgevms_config.h"
+#include "curl/curl.h"
 #include "esp_log.h"
 #include "esp_ota_ops.h"
+#include "ota_stream.h"
 #include "task.h"
 
 #include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
 
 #define TAG "why_ota"
 
@@ -31,8 +38,20 @@ struct ota_session_t {
     esp_ota_handle_t       update_handle;
     atomic_flag            open;
     atomic_bool            error;
+    bool                   streaming;
+    bool                   verify;
+    uint8_t                sha256[32];
 };
 
+typedef struct {
+    CURL  *curl;
+    long   status; // Of the response the headers are coming in for
+    size_t start;  // Position in the image of the first byte of the body
+    size_t received;
+    size_t length;
+    bool   have_length;
+} ota_fetch_t;
+
 static ota_session_t session = {
     .configured       = NULL,
     .running          = NULL,
@@ -42,6 +61,41 @@ static ota_session_t session = {
     .error            = ATOMIC_VAR_INIT(false),
 };
 
+// Shared by every update, Hephaestus writes what ota_write() and ota_download() receive into flash
+static ota_stream_t *stream;
+static TaskHandle_t  hephaestus_handle;
+
+static void hephaestus(void *ignored) {
+    while (true) {
+        ota_stream_drain(stream);
+    }
+}
+
+static bool start_writer(void) {
+    if (hephaestus_handle) {
+        return true;
+    }
+
+    if (!stream) {
+        stream = ota_stream_create(OTA_STREAM_BUFFER_BYTES);
+        if (!stream) {
+            return false;
+        }
+    }
+
+    return create_kernel_task(hephaestus, "Hephaestus", 4096, NULL, 8, &hephaestus_handle, 0) == pdTRUE;
+}
+
+static bool flash_write(void *ctx, size_t offset, void const *data, size_t len) {
+    ota_session_t *s   = ctx;
+    esp_err_t      err = esp_ota_write(s->update_handle, data, len);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "esp_ota_write at offset %zu failed (%s)", offset, esp_err_to_name(err));
+        return false;
+    }
+    return true;
+}
+
 ota_handle_t ota_session_open() {
     esp_err_t err;
 
@@ -49,6 +103,12 @@ ota_handle_t ota_session_open() {
         return NULL;
     }
 
+    if (!start_writer()) {
+        ESP_LOGE(TAG, "Unable to start the OTA writer");
+        atomic_flag_clear(&session.open);
+        return NULL;
+    }
+
     task_record_resource_alloc(RES_OTA, (ota_handle_t)&session);
 
     session.configured = esp_ota_get_boot_partition();
@@ -75,17 +135,144 @@ ota_handle_t ota_session_open() {
     }
 
     atomic_store(&session.error, false);
+    session.verify    = false;
+    session.streaming = true;
+    ota_stream_begin(stream, flash_write, &session);
 
     return (ota_handle_t)&session;
 }
 
 bool ota_write(ota_handle_t session, void *buffer, int block_size) {
-    esp_err_t err;
     if (atomic_load(&session->error)) {
         return false;
     }
-    err = esp_ota_write(session->update_handle, (void const *)buffer, block_size);
-    if (err != ESP_OK) {
+    if (block_size < 0 || !ota_stream_feed(stream, ota_stream_offset(stream), buffer, block_size)) {
+        ota_session_abort(session);
+        return false;
+    }
+    return true;
+}
+
+size_t ota_session_offset(ota_handle_t session) {
+    return session->streaming ? ota_stream_offset(stream) : 0;
+}
+
+bool ota_session_expect_sha256(ota_handle_t session, char const *sha256) {
+    if (strlen(sha256) != sizeof(session->sha256) * 2) {
+        return false;
+    }
+
+    for (size_t i = 0; i < sizeof(session->sha256); ++i) {
+        unsigned int byte;
+        if (sscanf(sha256 + i * 2, "%2x", &byte) != 1) {
+            return false;
+        }
+        session->sha256[i] = byte;
+    }
+
+    session->verify = true;
+    return true;
+}
+
+static size_t fetch_header(void *contents, size_t size, size_t nmemb, void *userp) {
+    ota_fetch_t *fetch = userp;
+    size_t       len   = size * nmemb;
+    char         line[128];
+
+    snprintf(line, sizeof(line), "%.*s", (int)len, (char const *)contents);
+    curl_easy_getinfo(fetch->curl, CURLINFO_RESPONSE_CODE, &fetch->status);
+
+    size_t first, last;
+    if (strncasecmp(line, "Content-Range: bytes ", 21) == 0 && sscanf(line + 21, "%zu-%zu", &first, &last) == 2) {
+        fetch->start = first;
+    } else if (strncasecmp(line, "Content-Length: ", 16) == 0) {
+        fetch->length      = strtoull(line + 16, NULL, 10);
+        fetch->have_length = true;
+    }
+    return len;
+}
+
+static size_t fetch_data(void *contents, size_t size, size_t nmemb, void *userp) {
+    ota_fetch_t *fetch = userp;
+    size_t       len   = size * nmemb;
+
+    // An error page, or the body of a redirect, is not part of the image
+    if (!fetch->status) {
+        curl_easy_getinfo(fetch->curl, CURLINFO_RESPONSE_CODE, &fetch->status);
+    }
+    if (fetch->status != 200 && fetch->status != 206) {
+        return 0;
+    }
+
+    // A server that ignores the Range header sends the image from the start, the part we have is skipped
+    if (!ota_stream_feed(stream, fetch->start + fetch->received, contents, len)) {
+        return 0;
+    }
+    fetch->received += len;
+    return len;
+}
+
+static ota_fetch_result_t fetch_url(void *ctx, char const *url, size_t offset, ota_stream_t *s) {
+    ota_fetch_t        fetch   = {0};
+    struct curl_slist *headers = NULL;
+    char               range[48];
+
+    CURL *curl = curl_easy_init();
+    if (!curl) {
+        return OTA_FETCH_FAILED;
+    }
+    fetch.curl = curl;
+
+    if (offset) {
+        ESP_LOGW(TAG, "Resuming download of %s at %zu", url, offset);
+        snprintf(range, sizeof(range), "Range: bytes=%zu-", offset);
+        headers = curl_slist_append(NULL, range);
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    }
+
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, fetch_header);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, &fetch);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, fetch_data);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &fetch);
+
+    CURLcode res    = curl_easy_perform(curl);
+    long     status = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+    curl_easy_cleanup(curl);
+    curl_slist_free_all(headers);
+
+    if (ota_stream_failed(s)) {
+        return OTA_FETCH_FAILED;
+    }
+
+    if (status && status != 200 && status != 206) {
+        ESP_LOGE(TAG, "Download of %s failed with status %ld", url, status);
+        return OTA_FETCH_FAILED;
+    }
+
+    if (res == CURLE_OK && (!fetch.have_length || fetch.received == fetch.length)) {
+        return OTA_FETCH_DONE;
+    }
+
+    ESP_LOGW(TAG, "Download of %s broke off at %zu (%s)", url, ota_stream_offset(s), curl_easy_strerror(res));
+    vTaskDelay(pdMS_TO_TICKS(OTA_DOWNLOAD_RETRY_DELAY_MS));
+    return OTA_FETCH_BROKEN;
+}
+
+bool ota_download(ota_handle_t session, char const *url, char const *sha256) {
+    if (atomic_load(&session->error)) {
+        return false;
+    }
+
+    if (sha256 && !ota_session_expect_sha256(session, sha256)) {
+        ESP_LOGE(TAG, "Invalid SHA-256 %s", sha256);
+        ota_session_abort(session);
+        return false;
+    }
+
+    if (!ota_stream_download(stream, fetch_url, NULL, url, OTA_DOWNLOAD_RETRIES)) {
+        ESP_LOGE(TAG, "Download of %s failed after %zu bytes", url, ota_stream_offset(stream));
         ota_session_abort(session);
         return false;
     }
@@ -94,9 +281,25 @@ bool ota_write(ota_handle_t session, void *buffer, int block_size) {
 
 bool ota_session_commit(ota_handle_t session) {
     esp_err_t err;
+    uint8_t   digest[32];
     if (atomic_load(&session->error)) {
         return false;
     }
+
+    bool written       = ota_stream_finish(stream, digest);
+    session->streaming = false;
+    if (!written) {
+        ota_session_abort(session);
+        return false;
+    }
+
+    if (session->verify && memcmp(digest, session->sha256, sizeof(digest)) != 0) {
+        ESP_LOGE(TAG, "SHA-256 of the image doesn't match, image is corrupted");
+        ota_session_abort(session);
+        return false;
+    }
+
+    ESP_LOGI(TAG, "Wrote %zu bytes", ota_stream_written(stream));
     err = esp_ota_end(session->update_handle);
     if (err != ESP_OK) {
         if (err == ESP_ERR_OTA_VALIDATE_FAILED) {
@@ -117,6 +320,10 @@ bool ota_session_commit(ota_handle_t session) {
 }
 
 bool ota_session_abort(ota_handle_t session) {
+    if (session->streaming) {
+        ota_stream_cancel(stream);
+        session->streaming = false;
+    }
     esp_ota_abort(session->update_handle);
     task_record_resource_free(RES_OTA, session);
     atomic_flag_clear(&session->open);
@@ -0,0 +1,229 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "ota_stream.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "mbedtls/sha256.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    uint8_t *data;
+    size_t   len;
+} ota_buffer_t;
+
+// The receiving side fills buffers in turn and the writer task writes them in the same order, so with every buffer
+// back in the free semaphore next_fill and next_write are the same
+struct ota_stream {
+    SemaphoreHandle_t      free;
+    SemaphoreHandle_t      full;
+    ota_buffer_t           buffers[OTA_STREAM_BUFFERS];
+    size_t                 buffer_bytes;
+    int                    fill;
+    int                    next_fill;
+    int                    next_write;
+    ota_stream_write_fn    write;
+    void                  *ctx;
+    size_t                 offset;
+    atomic_size_t          written;
+    atomic_bool            failed;
+    mbedtls_sha256_context sha;
+};
+
+ota_stream_t *ota_stream_create(size_t buffer_bytes) {
+    ota_stream_t *stream = calloc(1, sizeof(ota_stream_t));
+    if (!stream) {
+        return NULL;
+    }
+
+    stream->free         = xSemaphoreCreateCounting(OTA_STREAM_BUFFERS, OTA_STREAM_BUFFERS);
+    stream->full         = xSemaphoreCreateCounting(OTA_STREAM_BUFFERS, 0);
+    stream->buffer_bytes = buffer_bytes;
+    stream->fill         = -1;
+    if (!stream->free || !stream->full) {
+        goto error;
+    }
+
+    for (int i = 0; i < OTA_STREAM_BUFFERS; ++i) {
+        stream->buffers[i].data = malloc(buffer_bytes);
+        if (!stream->buffers[i].data) {
+            goto error;
+        }
+    }
+
+    mbedtls_sha256_init(&stream->sha);
+    return stream;
+
+error:
+    for (int i = 0; i < OTA_STREAM_BUFFERS; ++i) {
+        free(stream->buffers[i].data);
+    }
+    if (stream->free) {
+        vSemaphoreDelete(stream->free);
+    }
+    if (stream->full) {
+        vSemaphoreDelete(stream->full);
+    }
+    free(stream);
+    return NULL;
+}
+
+void ota_stream_begin(ota_stream_t *stream, ota_stream_write_fn write, void *ctx) {
+    stream->write  = write;
+    stream->ctx    = ctx;
+    stream->offset = 0;
+    stream->fill   = -1;
+    atomic_store(&stream->written, 0);
+    atomic_store(&stream->failed, false);
+
+    mbedtls_sha256_starts(&stream->sha, 0);
+}
+
+static void submit(ota_stream_t *stream) {
+    stream->fill = -1;
+    xSemaphoreGive(stream->full);
+}
+
+bool ota_stream_feed(ota_stream_t *stream, size_t position, void const *data, size_t len) {
+    if (atomic_load(&stream->failed) || position > stream->offset) {
+        return false;
+    }
+
+    size_t skip = stream->offset - position;
+    if (skip >= len) {
+        return true;
+    }
+
+    uint8_t const *src = (uint8_t const *)data + skip;
+    len -= skip;
+
+    while (len) {
+        if (stream->fill < 0) {
+            xSemaphoreTake(stream->free, portMAX_DELAY);
+            stream->fill      = stream->next_fill;
+            stream->next_fill = (stream->next_fill + 1) % OTA_STREAM_BUFFERS;
+            stream->buffers[stream->fill].len = 0;
+            if (atomic_load(&stream->failed)) {
+                return false;
+            }
+        }
+
+        ota_buffer_t *buffer = &stream->buffers[stream->fill];
+        size_t        n      = stream->buffer_bytes - buffer->len;
+        if (n > len) {
+            n = len;
+        }
+
+        memcpy(buffer->data + buffer->len, src, n);
+        buffer->len    += n;
+        stream->offset += n;
+        src            += n;
+        len            -= n;
+
+        if (buffer->len == stream->buffer_bytes) {
+            submit(stream);
+        }
+    }
+
+    return !atomic_load(&stream->failed);
+}
+
+size_t ota_stream_offset(ota_stream_t *stream) {
+    return stream->offset;
+}
+
+size_t ota_stream_written(ota_stream_t *stream) {
+    return atomic_load(&stream->written);
+}
+
+bool ota_stream_failed(ota_stream_t *stream) {
+    return atomic_load(&stream->failed);
+}
+
+static void wait_idle(ota_stream_t *stream) {
+    if (stream->fill >= 0) {
+        submit(stream);
+    }
+
+    for (int i = 0; i < OTA_STREAM_BUFFERS; ++i) {
+        xSemaphoreTake(stream->free, portMAX_DELAY);
+    }
+    for (int i = 0; i < OTA_STREAM_BUFFERS; ++i) {
+        xSemaphoreGive(stream->free);
+    }
+}
+
+bool ota_stream_finish(ota_stream_t *stream, uint8_t digest[32]) {
+    wait_idle(stream);
+
+    bool ok = !atomic_load(&stream->failed) && mbedtls_sha256_finish(&stream->sha, digest) == 0;
+    mbedtls_sha256_free(&stream->sha);
+    mbedtls_sha256_init(&stream->sha);
+    return ok;
+}
+
+void ota_stream_cancel(ota_stream_t *stream) {
+    atomic_store(&stream->failed, true);
+    wait_idle(stream);
+    mbedtls_sha256_free(&stream->sha);
+    mbedtls_sha256_init(&stream->sha);
+}
+
+void ota_stream_drain(ota_stream_t *stream) {
+    xSemaphoreTake(stream->full, portMAX_DELAY);
+
+    ota_buffer_t *buffer = &stream->buffers[stream->next_write];
+    stream->next_write   = (stream->next_write + 1) % OTA_STREAM_BUFFERS;
+
+    if (buffer->len && !atomic_load(&stream->failed)) {
+        size_t written = atomic_load(&stream->written);
+        if (stream->write(stream->ctx, written, buffer->data, buffer->len)) {
+            mbedtls_sha256_update(&stream->sha, buffer->data, buffer->len);
+            atomic_store(&stream->written, written + buffer->len);
+        } else {
+            atomic_store(&stream->failed, true);
+        }
+    }
+
+    xSemaphoreGive(stream->free);
+}
+
+bool ota_stream_download(ota_stream_t *stream, ota_stream_fetch_fn fetch, void *ctx, char const *url, int retries) {
+    int stalled = 0;
+
+    while (true) {
+        size_t             offset = ota_stream_offset(stream);
+        ota_fetch_result_t result = fetch(ctx, url, offset, stream);
+
+        if (result == OTA_FETCH_FAILED || ota_stream_failed(stream)) {
+            return false;
+        }
+        if (result == OTA_FETCH_DONE) {
+            return true;
+        }
+
+        if (ota_stream_offset(stream) > offset) {
+            stalled = 0;
+        } else if (++stalled > retries) {
+            return false;
+        }
+    }
+}
@@ -0,0 +1,70 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The pipeline between whoever receives an update and the flash. The receiving side copies into one buffer while the
+// writer task programs the other one, hashing what made it to flash. A stream is reused for one update after another.
+
+#define OTA_STREAM_BUFFERS 2
+
+typedef struct ota_stream ota_stream_t;
+
+// Called by the writer task, offset is the number of bytes written before
+typedef bool (*ota_stream_write_fn)(void *ctx, size_t offset, void const *data, size_t len);
+
+typedef enum {
+    OTA_FETCH_DONE,
+    OTA_FETCH_BROKEN,
+    OTA_FETCH_FAILED,
+} ota_fetch_result_t;
+
+// Gets url from offset on and feeds it to the stream. BROKEN means the transfer stopped early and is worth another
+// try, FAILED that it isn't.
+typedef ota_fetch_result_t (*ota_stream_fetch_fn)(void *ctx, char const *url, size_t offset, ota_stream_t *stream);
+
+ota_stream_t *ota_stream_create(size_t buffer_bytes);
+
+// Starts an update, there may not be another one going on
+void ota_stream_begin(ota_stream_t *stream, ota_stream_write_fn write, void *ctx);
+
+// Takes the bytes of the image starting at position. What is before ota_stream_offset() was taken already and is
+// skipped, a position beyond it is refused. Blocks while every buffer waits for the flash, returns false once a write
+// failed.
+bool ota_stream_feed(ota_stream_t *stream, size_t position, void const *data, size_t len);
+
+// Bytes taken so far, where an interrupted transfer resumes
+size_t ota_stream_offset(ota_stream_t *stream);
+// Bytes that made it to flash
+size_t ota_stream_written(ota_stream_t *stream);
+bool   ota_stream_failed(ota_stream_t *stream);
+
+// Writes out the rest and waits for it, digest gets the SHA-256 of the image. Returns false if a write failed.
+bool ota_stream_finish(ota_stream_t *stream, uint8_t digest[32]);
+// Drops whatever isn't written yet and waits for a write in progress, the write callback isn't called after this
+void ota_stream_cancel(ota_stream_t *stream);
+
+// Runs in the writer task, waits for a buffer and writes it
+void ota_stream_drain(ota_stream_t *stream);
+
+// Fetches url into the stream, resuming where the previous attempt stopped. Tries again for as long as attempts get
+// further, and up to retries times in a row when they don't.
+bool ota_stream_download(ota_stream_t *stream, ota_stream_fetch_fn fetch, void *ctx, char const *url, int retries);
@@ -16,6 +16,7 @@
 
 #include "badgevms/pathfuncs.h"
 
+#include "pathfuncs_private.h"
 #include "why_io.h"
 
 #include <stdbool.h>
@@ -24,6 +25,7 @@
 
 #include <errno.h>
 #include <string.h>
+#include <sys/stat.h>
 
 static inline bool is_valid_device_char(char c) {
     return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '_' || c == '-' ||
@@ -34,26 +36,18 @@ static inline bool is_valid_path_char(char c) {
     return is_valid_device_char(c) || c == '.';
 }
 
-// Parse a path in the form of DEVICE:[DIR.SUBDIR]FILENAME.EXT
-path_parse_result_t parse_path(char const *path, path_t *result) {
+// Parse a path in the form of DEVICE:[DIR.SUBDIR]FILENAME.EXT without copying it
+path_parse_result_t parse_path_spans(char const *path, path_spans_t *result) {
     if (!path || !*path) {
         return PATH_PARSE_EMPTY_PATH;
     }
 
-    result->buffer    = NULL;
-    result->device    = NULL;
-    result->directory = NULL;
-    result->filename  = NULL;
-    result->unixpath  = NULL;
-    result->len       = strlen(path);
+    result->device    = (path_span_t){NULL, 0};
+    result->directory = (path_span_t){NULL, 0};
+    result->filename  = (path_span_t){NULL, 0};
 
-    result->buffer = why_strdup(path);
-    if (!result->buffer) {
-        return PATH_PARSE_EMPTY_PATH;
-    }
-
-    char *p     = result->buffer;
-    char *start = p;
+    char const *p     = path;
+    char const *start = p;
 
     // Everything up to the ':' is the device part
     while (*p && *p != ':') {
@@ -71,8 +65,7 @@ path_parse_result_t parse_path(char const *path, path_t *result) {
         return PATH_PARSE_EMPTY_DEVICE;
     }
 
-    *p             = '\0';
-    result->device = start;
+    result->device = (path_span_t){start, p - start};
     p++; // Skip ':'
 
     // Directory comes next [dir.name]
@@ -93,8 +86,7 @@ path_parse_result_t parse_path(char const *path, path_t *result) {
         }
 
         if (p > start) {
-            *p                = '\0';
-            result->directory = start;
+            result->directory = (path_span_t){start, p - start};
         }
 
         p++; // Skip ']'
@@ -108,60 +100,110 @@ path_parse_result_t parse_path(char const *path, path_t *result) {
             }
             p++;
         }
-        result->filename = start;
+        result->filename = (path_span_t){start, p - start};
     }
 
     return PATH_PARSE_OK;
 }
 
-char *path_to_unix(path_t *path) {
-    if (path->unixpath) {
-        return path->unixpath;
+static char *span_to_buffer(path_span_t span, char const *path, char *buffer) {
+    if (!span.ptr) {
+        return NULL;
     }
 
-    // Most unix paths are shorter than BadgeVMS paths except for directory-less paths.
-    char  *unixpath      = malloc(path->len + 3);
-    size_t device_len    = strlen(path->device);
-    size_t directory_len = 0;
-    size_t filename_len  = 0;
+    char *component     = buffer + (span.ptr - path);
+    component[span.len] = '\0';
+    return component;
+}
 
-    if (path->directory) {
-        directory_len = strlen(path->directory);
+// Parse into the buffer inside result, the components are NUL terminated in place of their separators
+path_parse_result_t parse_path(char const *path, path_t *result) {
+    if (!path || !*path) {
+        return PATH_PARSE_EMPTY_PATH;
     }
 
-    if (path->filename) {
-        filename_len = strlen(path->filename);
+    result->device        = NULL;
+    result->directory     = NULL;
+    result->filename      = NULL;
+    result->device_len    = 0;
+    result->directory_len = 0;
+    result->filename_len  = 0;
+    result->len           = strnlen(path, PATH_MAX_LEN);
+
+    if (result->len == PATH_MAX_LEN) {
+        return PATH_PARSE_TOO_LONG;
     }
 
-    size_t o      = 0;
-    unixpath[o++] = '/';
-    memcpy(&unixpath[o], path->device, device_len);
-    o             += device_len;
-    unixpath[o++]  = '/';
+    path_spans_t        spans;
+    path_parse_result_t res = parse_path_spans(path, &spans);
+    if (res != PATH_PARSE_OK) {
+        return res;
+    }
+
+    memcpy(result->buffer, path, result->len + 1);
+
+    result->device        = span_to_buffer(spans.device, path, result->buffer);
+    result->directory     = span_to_buffer(spans.directory, path, result->buffer);
+    result->filename      = span_to_buffer(spans.filename, path, result->buffer);
+    result->device_len    = spans.device.len;
+    result->directory_len = spans.directory.len;
+    result->filename_len  = spans.filename.len;
 
-    if (directory_len) {
-        for (size_t i = 0; i < directory_len; ++i) {
+    return PATH_PARSE_OK;
+}
+
+path_parse_result_t path_to_unix(path_t const *path, char *buf, size_t size) {
+    size_t needed = 1 + path->device_len + 1 + path->filename_len + 1;
+    if (path->directory_len) {
+        needed += path->directory_len + 1;
+    }
+
+    if (needed > size) {
+        return PATH_PARSE_TOO_LONG;
+    }
+
+    size_t o = 0;
+    buf[o++] = '/';
+    memcpy(&buf[o], path->device, path->device_len);
+    o        += path->device_len;
+    buf[o++]  = '/';
+
+    if (path->directory_len) {
+        for (size_t i = 0; i < path->directory_len; ++i) {
             char c = path->directory[i];
             if (c == '.')
                 c = '/';
-            unixpath[o++] = c;
+            buf[o++] = c;
         }
-        unixpath[o++] = '/';
+        buf[o++] = '/';
     }
 
-    if (filename_len) {
-        memcpy(&unixpath[o], path->filename, filename_len);
-        o += filename_len;
+    if (path->filename_len) {
+        memcpy(&buf[o], path->filename, path->filename_len);
+        o += path->filename_len;
     }
 
-    unixpath[o]    = 0;
-    path->unixpath = unixpath;
-    return unixpath;
+    buf[o] = 0;
+    return PATH_PARSE_OK;
 }
 
+path_parse_result_t path_set_filename(path_t *path, char const *filename) {
+    size_t filename_len = strlen(filename);
+    if (path->len + 1 + filename_len + 1 > sizeof(path->buffer)) {
+        return PATH_PARSE_TOO_LONG;
+    }
+
+    // Goes after the terminating NUL of the parsed string, the old filename is left in place
+    char *copy = &path->buffer[path->len + 1];
+    memcpy(copy, filename, filename_len + 1);
+    path->filename     = copy;
+    path->filename_len = filename_len;
+    return PATH_PARSE_OK;
+}
+
+// Nothing is allocated anymore, kept for existing callers
 void path_free(path_t *path) {
-    why_free(path->buffer);
-    free(path->unixpath);
+    (void)path;
 }
 
 bool mkdir_p(char const *path) {
@@ -169,65 +211,59 @@ bool mkdir_p(char const *path) {
         return false;
     }
 
-    path_t              parsed_path;
-    path_parse_result_t parse_result = parse_path(path, &parsed_path);
-
-    if (parse_result != PATH_PARSE_OK) {
+    path_spans_t spans;
+    if (parse_path_spans(path, &spans) != PATH_PARSE_OK) {
         return false;
     }
 
-    if (!parsed_path.directory || strlen(parsed_path.directory) == 0) {
-        path_free(&parsed_path);
+    if (!spans.directory.len) {
         return true;
     }
 
-    char *current_path = NULL;
-    why_asprintf(&current_path, "%s:", parsed_path.device ? parsed_path.device : "");
-    if (!current_path) {
-        path_free(&parsed_path);
+    char current_path[PATH_MAX_LEN];
+    if (spans.device.len + spans.directory.len + 4 > sizeof(current_path)) {
         return false;
     }
 
-    char *dir_copy = why_strdup(parsed_path.directory);
-    if (!dir_copy) {
-        why_free(current_path);
-        path_free(&parsed_path);
-        return false;
-    }
+    memcpy(current_path, spans.device.ptr, spans.device.len);
+    size_t o          = spans.device.len;
+    current_path[o++] = ':';
+    current_path[o++] = '[';
 
-    bool  success   = true;
-    char *dir_token = strtok(dir_copy, ".");
+    size_t      dir_start = o;
+    char const *dir       = spans.directory.ptr;
+    char const *dir_end   = dir + spans.directory.len;
 
-    while (dir_token && success) {
-        char *new_path = path_dirconcat(current_path, dir_token);
-        if (!new_path) {
-            success = false;
-            break;
+    while (dir < dir_end) {
+        char const *component_end = memchr(dir, '.', dir_end - dir);
+        if (!component_end) {
+            component_end = dir_end;
         }
 
-        struct stat st;
-        if (why_stat(new_path, &st) != 0) {
-            if (why_mkdir(new_path, 0755) != 0 && errno != EEXIST) {
-                success = false;
-                why_free(new_path);
-                break;
+        // Empty components are skipped, like strtok does
+        if (component_end > dir) {
+            if (o > dir_start) {
+                current_path[o++] = '.';
+            }
+            memcpy(&current_path[o], dir, component_end - dir);
+            o                   += component_end - dir;
+            current_path[o]      = ']';
+            current_path[o + 1]  = '\0';
+
+            struct stat st;
+            if (why_stat(current_path, &st) != 0) {
+                if (why_mkdir(current_path, 0755) != 0 && errno != EEXIST) {
+                    return false;
+                }
+            } else if (!S_ISDIR(st.st_mode)) {
+                return false;
             }
-        } else if (!S_ISDIR(st.st_mode)) {
-            success = false;
-            why_free(new_path);
-            break;
         }
 
-        why_free(current_path);
-        current_path = new_path;
-        dir_token    = strtok(NULL, ".");
+        dir = component_end + 1;
     }
 
-    why_free(current_path);
-    why_free(dir_copy);
-    path_free(&parsed_path);
-
-    return success;
+    return true;
 }
 
 bool rm_rf(char const *path) {
@@ -18,4 +18,8 @@
 
 #include "badgevms/pathfuncs.h"
 
-char *path_to_unix(path_t *path);
+// Writes the UNIX form of path into buf, PATH_PARSE_TOO_LONG if it does not fit in size bytes
+path_parse_result_t path_to_unix(path_t const *path, char *buf, size_t size);
+
+// Points the filename of a parsed path at a copy of filename, which may contain any character but '\0'
+path_parse_result_t path_set_filename(path_t *path, char const *filename);
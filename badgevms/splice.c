@@ -0,0 +1,140 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "splice.h"
+
+#include "badgevms/async_io.h"
+#include "badgevms_config.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include <sys/socket.h>
+
+static char const *TAG = "splice";
+
+_Static_assert(SPLICE_BUFFERS <= 32, "SPLICE_BUFFERS does not fit in the free mask");
+
+static uint8_t    *pool;
+static atomic_uint pool_free; // Bit n set when buffer n is free
+
+bool splice_init(void) {
+    pool = heap_caps_malloc(SPLICE_BUFFERS * SPLICE_BUFFER_BYTES, MALLOC_CAP_SPIRAM);
+    if (!pool) {
+        ESP_LOGE(TAG, "Unable to allocate the buffer pool");
+        return false;
+    }
+
+    atomic_store(&pool_free, (uint32_t)((1ull << SPLICE_BUFFERS) - 1));
+    return true;
+}
+
+static uint8_t *buffer_get(void) {
+    unsigned int mask = atomic_load(&pool_free);
+    while (mask) {
+        int n = __builtin_ctz(mask);
+        if (atomic_compare_exchange_weak(&pool_free, &mask, mask & ~(1u << n))) {
+            return pool + n * SPLICE_BUFFER_BYTES;
+        }
+    }
+
+    return heap_caps_malloc(SPLICE_BUFFER_BYTES, MALLOC_CAP_SPIRAM);
+}
+
+static void buffer_put(uint8_t *buffer) {
+    if (pool && buffer >= pool && buffer < pool + SPLICE_BUFFERS * SPLICE_BUFFER_BYTES) {
+        atomic_fetch_or(&pool_free, 1u << ((buffer - pool) / SPLICE_BUFFER_BYTES));
+    } else {
+        heap_caps_free(buffer);
+    }
+}
+
+static bool seek(device_t *device, int fd, off_t offset, int whence, off_t *position) {
+    errno      = 0;
+    off_t done = device->_lseek(device, fd, offset, whence);
+    if (done < 0) {
+        return false;
+    }
+    if (position) {
+        *position = done;
+    }
+    return true;
+}
+
+ssize_t splice_transfer(device_t *in, int in_fd, device_t *out, int out_fd, off_t offset, size_t count, int *err) {
+    socket_device_t *sock = (socket_device_t *)out;
+    if (!in->_read || !in->_lseek || out->type != DEVICE_TYPE_SOCKET || !sock->_sendto) {
+        *err = EINVAL;
+        return -1;
+    }
+
+    off_t saved;
+    if (!seek(in, in_fd, 0, SEEK_CUR, &saved) ||
+        (offset != IO_OFFSET_CURRENT && !seek(in, in_fd, offset, SEEK_SET, NULL))) {
+        *err = errno ? errno : ESPIPE;
+        return -1;
+    }
+
+    uint8_t *buffer = buffer_get();
+    if (!buffer) {
+        *err = ENOMEM;
+        return -1;
+    }
+
+    off_t  start = offset == IO_OFFSET_CURRENT ? saved : offset;
+    size_t sent  = 0;
+    int    error = 0;
+
+    while (sent < count) {
+        size_t  chunk = count - sent < SPLICE_BUFFER_BYTES ? count - sent : SPLICE_BUFFER_BYTES;
+        ssize_t got   = in->_read(in, in_fd, buffer, chunk);
+        if (got <= 0) {
+            error = got < 0 ? (errno ? errno : EIO) : 0;
+            break;
+        }
+
+        ssize_t written = 0;
+        while (written < got) {
+            // Never waits for room, a stalled peer would hold up the file I/O of every process
+            ssize_t n = sock->_sendto(out, out_fd, buffer + written, got - written, MSG_DONTWAIT, NULL, 0);
+            if (n <= 0) {
+                error = n < 0 ? (errno ? errno : EIO) : 0;
+                break;
+            }
+            written += n;
+        }
+
+        sent += written;
+        if (written < got) {
+            break;
+        }
+    }
+
+    buffer_put(buffer);
+
+    // The file position ends up where the caller asked for, whatever was read ahead of a socket that filled up
+    seek(in, in_fd, offset == IO_OFFSET_CURRENT ? start + (off_t)sent : saved, SEEK_SET, NULL);
+
+    if (!sent && error) {
+        *err = error;
+        return -1;
+    }
+    return sent;
+}
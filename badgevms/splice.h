@@ -0,0 +1,37 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "badgevms/device.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <sys/types.h>
+
+// Moves file data to a socket without it passing through the process, in chunks of SPLICE_BUFFER_BYTES through
+// buffers shared by every transfer. Without the pool, or when all of its buffers are in use, a transfer allocates one
+// of its own.
+bool splice_init(void);
+
+// Sends at most count bytes of in_fd, from offset or the current position with IO_OFFSET_CURRENT, to the socket
+// out_fd. Only with IO_OFFSET_CURRENT does the file position move, to just past what was sent. It is moved around in
+// between, so nothing else may use in_fd meanwhile, which the I/O queue sees to. The socket is never waited for,
+// blocking or not. Returns the bytes sent, which is short at the end of the file or when the socket is full, or -1
+// with *err set if nothing was sent.
+ssize_t splice_transfer(device_t *in, int in_fd, device_t *out, int out_fd, off_t offset, size_t count, int *err);
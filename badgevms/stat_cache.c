@@ -0,0 +1,250 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "stat_cache.h"
+
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "pathfuncs_private.h"
+
+#include <stdatomic.h>
+#include <string.h>
+
+#include <errno.h>
+
+// seq is odd while the slot is being rewritten, a reader that saw it change throws away what it copied. epoch is
+// bumped whenever a path that maps to the slot changes, the entry is only good while it still matches.
+typedef struct {
+    atomic_uint  seq;
+    atomic_uint  epoch;
+    unsigned int entry_epoch;
+    unsigned int generation;
+    uint32_t     hash;
+    uint16_t     len;
+    bool         exists;
+    struct stat  st;
+    char         key[STAT_CACHE_KEY_BYTES];
+} stat_slot_t;
+
+static char const *TAG = "stat_cache";
+
+static stat_slot_t *slots;
+// Bumped by stat_cache_flush, entries stored under an older generation are dead
+static atomic_uint  generation = 1;
+static atomic_uint  hits;
+static atomic_uint  negative_hits;
+static atomic_uint  misses;
+static atomic_uint  uncacheable;
+static atomic_uint  invalidations;
+
+bool stat_cache_init(void) {
+    slots = heap_caps_malloc(sizeof(stat_slot_t) * STAT_CACHE_SLOTS, MALLOC_CAP_SPIRAM);
+    if (!slots) {
+        ESP_LOGE(TAG, "Unable to allocate %d slots", STAT_CACHE_SLOTS);
+        return false;
+    }
+
+    memset(slots, 0, sizeof(stat_slot_t) * STAT_CACHE_SLOTS);
+    ESP_LOGI(TAG, "%d slots", STAT_CACHE_SLOTS);
+    return true;
+}
+
+static inline stat_slot_t *slot_of(uint32_t hash) {
+    return &slots[hash % STAT_CACHE_SLOTS];
+}
+
+// FAT names are case insensitive and a directory can be named with or without the trailing slash. Returns the length
+// of the folded key, or 0 if the path can't be cached. *alias is set for short name aliases like LONGNA~1.TXT, which
+// name the same file as a long name the cache can't connect them to.
+static size_t fold_path(path_t const *path, char *key, uint32_t *hash, bool *alias) {
+    char unixpath[PATH_UNIX_MAX_LEN];
+
+    *hash  = 2166136261u;
+    *alias = false;
+    if (path_to_unix(path, unixpath, sizeof(unixpath)) != PATH_PARSE_OK) {
+        return 0;
+    }
+
+    size_t len = strlen(unixpath);
+    if (len > path->device_len + 2 && unixpath[len - 1] == '/') {
+        len--;
+    }
+
+    for (size_t i = 0; i < len; i++) {
+        char c = unixpath[i];
+        if (c >= 'A' && c <= 'Z') {
+            c += 'a' - 'A';
+        }
+        if (c == '~') {
+            *alias = true;
+        }
+        *hash = (*hash ^ (uint8_t)c) * 16777619u;
+        if (i < STAT_CACHE_KEY_BYTES) {
+            key[i] = c;
+        }
+    }
+
+    if (!*hash || *hash == STAT_CACHE_HASH_ALIAS) {
+        *hash = 1;
+    }
+    return len < STAT_CACHE_KEY_BYTES && !*alias ? len : 0;
+}
+
+void stat_cache_key(path_t const *path, stat_cache_key_t *key) {
+    bool alias;
+
+    key->len = fold_path(path, key->key, &key->hash, &alias);
+    if (!slots) {
+        key->len = 0;
+        return;
+    }
+    if (!key->len) {
+        atomic_fetch_add(&uncacheable, 1);
+        return;
+    }
+
+    key->generation = atomic_load_explicit(&generation, memory_order_acquire);
+    key->epoch      = atomic_load_explicit(&slot_of(key->hash)->epoch, memory_order_acquire);
+}
+
+bool stat_cache_lookup(stat_cache_key_t const *key, struct stat *statbuf, bool *exists) {
+    if (!key->len) {
+        return false;
+    }
+
+    stat_slot_t *slot = slot_of(key->hash);
+    unsigned int seq  = atomic_load_explicit(&slot->seq, memory_order_acquire);
+
+    if ((seq & 1) || slot->generation != atomic_load_explicit(&generation, memory_order_acquire) ||
+        slot->entry_epoch != atomic_load_explicit(&slot->epoch, memory_order_acquire) || slot->hash != key->hash ||
+        slot->len != key->len || memcmp(slot->key, key->key, key->len) != 0) {
+        atomic_fetch_add(&misses, 1);
+        return false;
+    }
+
+    bool        found = slot->exists;
+    struct stat st    = slot->st;
+
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq) {
+        atomic_fetch_add(&misses, 1);
+        return false;
+    }
+
+    if (found && statbuf) {
+        *statbuf = st;
+    }
+    *exists = found;
+    atomic_fetch_add(found ? &hits : &negative_hits, 1);
+    return true;
+}
+
+void stat_cache_store(stat_cache_key_t const *key, struct stat const *statbuf) {
+    if (!key->len) {
+        return;
+    }
+
+    stat_slot_t *slot = slot_of(key->hash);
+    unsigned int seq  = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+
+    // Someone else is filling this slot, they can have it
+    if ((seq & 1) || !atomic_compare_exchange_strong(&slot->seq, &seq, seq + 1)) {
+        return;
+    }
+    atomic_thread_fence(memory_order_release);
+
+    // After a change since the key was taken the entry would be dead on arrival, keep what is in the slot
+    if (atomic_load_explicit(&generation, memory_order_acquire) == key->generation &&
+        atomic_load_explicit(&slot->epoch, memory_order_acquire) == key->epoch) {
+        slot->entry_epoch = key->epoch;
+        slot->generation  = key->generation;
+        slot->hash        = key->hash;
+        slot->len         = key->len;
+        slot->exists      = statbuf != NULL;
+        if (statbuf) {
+            slot->st = *statbuf;
+        }
+        memcpy(slot->key, key->key, key->len);
+    }
+
+    atomic_store_explicit(&slot->seq, seq + 2, memory_order_release);
+}
+
+int stat_cache_stat(filesystem_device_t *device, path_t *path, struct stat *statbuf) {
+    stat_cache_key_t key;
+    bool             exists;
+
+    if (!device->_stat) {
+        return -1;
+    }
+
+    stat_cache_key(path, &key);
+    if (stat_cache_lookup(&key, statbuf, &exists)) {
+        if (!exists) {
+            errno = ENOENT;
+            return -1;
+        }
+        return 0;
+    }
+
+    int res = device->_stat(device, path, statbuf);
+    if (res == 0) {
+        stat_cache_store(&key, statbuf);
+    } else if (errno == ENOENT) {
+        stat_cache_store(&key, NULL);
+    }
+    return res;
+}
+
+uint32_t stat_cache_hash(path_t const *path) {
+    char     key[STAT_CACHE_KEY_BYTES];
+    uint32_t hash;
+    bool     alias;
+
+    fold_path(path, key, &hash, &alias);
+    return alias ? STAT_CACHE_HASH_ALIAS : hash;
+}
+
+void stat_cache_invalidate(path_t const *path) {
+    stat_cache_invalidate_hash(stat_cache_hash(path));
+}
+
+void stat_cache_invalidate_hash(uint32_t hash) {
+    if (hash == STAT_CACHE_HASH_ALIAS) {
+        stat_cache_flush();
+        return;
+    }
+    if (!slots || !hash) {
+        return;
+    }
+
+    atomic_fetch_add_explicit(&slot_of(hash)->epoch, 1, memory_order_release);
+    atomic_fetch_add(&invalidations, 1);
+}
+
+void stat_cache_flush(void) {
+    atomic_fetch_add_explicit(&generation, 1, memory_order_release);
+    atomic_fetch_add(&invalidations, 1);
+}
+
+void stat_cache_stats_get(stat_cache_stats_t *stats) {
+    stats->hits          = atomic_load(&hits);
+    stats->negative_hits = atomic_load(&negative_hits);
+    stats->misses        = atomic_load(&misses);
+    stats->uncacheable   = atomic_load(&uncacheable);
+    stats->invalidations = atomic_load(&invalidations);
+}
@@ -0,0 +1,73 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "badgevms/device.h"
+#include "badgevms_config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <sys/stat.h>
+
+// Results of stat on filesystem paths, both found and not found, so search lists don't walk FAT directories for the
+// same missing names over and over. Entries are keyed by the case folded UNIX path and live in a direct mapped table
+// that readers don't lock. Anything that changes a path must invalidate it after the change is made.
+
+typedef struct {
+    uint32_t hits;
+    uint32_t negative_hits; // Hits that said the path doesn't exist
+    uint32_t misses;
+    uint32_t uncacheable;   // Paths too long or using a short name alias
+    uint32_t invalidations;
+} stat_cache_stats_t;
+
+// A path ready for lookup and store, taken before asking the filesystem so a change made in between is not cached
+typedef struct {
+    uint32_t     hash; // Never 0
+    unsigned int epoch;
+    unsigned int generation;
+    uint16_t     len; // 0 if the path is not cached
+    char         key[STAT_CACHE_KEY_BYTES];
+} stat_cache_key_t;
+
+bool stat_cache_init(void);
+
+void stat_cache_key(path_t const *path, stat_cache_key_t *key);
+
+// Returns true on a hit, with *exists false for a path known not to exist
+bool stat_cache_lookup(stat_cache_key_t const *key, struct stat *statbuf, bool *exists);
+
+// statbuf NULL records that the path doesn't exist
+void stat_cache_store(stat_cache_key_t const *key, struct stat const *statbuf);
+
+// Stat through the cache, like the device's _stat
+int stat_cache_stat(filesystem_device_t *device, path_t *path, struct stat *statbuf);
+
+// What stat_cache_hash returns for a short name alias, invalidating it drops everything
+#define STAT_CACHE_HASH_ALIAS UINT32_MAX
+
+// The hash of a key can be kept to invalidate the path later, like for an open file
+uint32_t stat_cache_hash(path_t const *path);
+void     stat_cache_invalidate(path_t const *path);
+void     stat_cache_invalidate_hash(uint32_t hash);
+
+// Drops everything, for changes that affect whole trees like renaming a directory
+void stat_cache_flush(void);
+
+void stat_cache_stats_get(stat_cache_stats_t *stats);
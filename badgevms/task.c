@@ -19,14 +19,21 @@
 #include "badgevms/event.h"
 #include "badgevms/ota.h"
 #include "compositor/compositor_private.h"
+#include "cookie_store.h"
+#include "dir_stream.h"
 #include "curl/curl.h"
 #include "elf_symbols.h"
 #include "esp_elf.h"
 #include "esp_log.h"
 #include "esp_tls.h"
 #include "hash_helper.h"
+#include "http_pool.h"
+#include "io_service.h"
 #include "memory.h"
+#include "stat_cache.h"
 #include "thirdparty/khash.h"
+#include "tls_session_cache.h"
+#include "wait_queue.h"
 #include "why_io.h"
 
 #include <stdatomic.h>
@@ -35,6 +42,8 @@
 #include <regex.h>
 #include <string.h>
 
+#include <sys/socket.h>
+
 KHASH_MAP_INIT_INT(ptable, void *);
 KHASH_MAP_INIT_INT(restable, int);
 
@@ -195,7 +204,24 @@ static task_thread_t *task_thread_init(uintptr_t start) {
     return ret;
 }
 
-static void task_thread_destroy(task_thread_t *thread) {
+// Lends Hades the memory of a process that is being torn down, so what is freed in there goes back to the heap of the
+// process instead of into that of the kernel. The task switch hooks map it in and out as they would for the process.
+static void task_memory_enter(task_info_t *task_info) {
+    vTaskSuspendAll();
+    vTaskSetThreadLocalStoragePointer(NULL, 1, task_info);
+    remap_task(task_info);
+    xTaskResumeAll();
+}
+
+static void task_memory_leave(task_info_t *task_info) {
+    vTaskSuspendAll();
+    unmap_task(task_info);
+    vTaskSetThreadLocalStoragePointer(NULL, 1, &kernel_task);
+    xTaskResumeAll();
+}
+
+static void task_thread_destroy(task_info_t *task_info) {
+    task_thread_t *thread = task_info->thread;
     if (!thread) {
         return;
     }
@@ -215,6 +241,17 @@ static void task_thread_destroy(task_thread_t *thread) {
 
     ESP_LOGI(TAG, "Destroying thread info");
 
+    // Cut the sockets off first, so a sendfile to one that is still running gives up rather than being waited for
+    for (int i = 0; i < MAXFD; ++i) {
+        socket_device_t *sock = (socket_device_t *)thread->file_handles[i].device;
+        if (thread->file_handles[i].is_open && sock->device.type == DEVICE_TYPE_SOCKET && sock->_shutdown) {
+            sock->_shutdown(sock, thread->file_handles[i].dev_fd, SHUT_RDWR);
+        }
+    }
+
+    // The I/O tasks may still be using the file handles below
+    io_service_cancel_owner(thread);
+
     for (int i = 0; i < MAXFD; ++i) {
         // We sadly can't reuse the why_close code as it must be ran from inside the user task
         if (thread->file_handles[i].is_open) {
@@ -222,9 +259,20 @@ static void task_thread_destroy(task_thread_t *thread) {
             if (thread->file_handles[i].device->_close) {
                 thread->file_handles[i].device->_close(thread->file_handles[i].device, thread->file_handles[i].dev_fd);
             }
+            stat_cache_invalidate_hash(thread->file_handles[i].stat_hash);
         }
     }
 
+    // The idle pooled esp_http_clients were made by the process, their transports and copies of the CA PEM are on the
+    // kernel heap and their TLS connections are below. Clean them up as the process would, which also takes those
+    // connections off its RES_ESP_TLS list.
+    http_pool_t *pool = (http_pool_t *)atomic_load(&thread->http_pool);
+    if (pool) {
+        task_memory_enter(task_info);
+        http_pool_destroy(pool, true);
+        task_memory_leave(task_info);
+    }
+
     for (int i = 0; i < RES_RESOURCE_TYPE_MAX; ++i) {
         for (khiter_t k = kh_begin(thread->resources[i]); k != kh_end(thread->resources[i]); ++k) {
             if (kh_exist(thread->resources[i], k)) {
@@ -255,6 +303,13 @@ static void task_thread_destroy(task_thread_t *thread) {
                         break;
                     case RES_OTA: ota_session_abort(ptr); break;
                     case RES_ESP_TLS: esp_tls_conn_destroy(ptr); break;
+                    case RES_DIR:
+                        // The stream is in the process's memory, the directory it has open is not
+                        ESP_LOGW(TAG, "Cleaning up directory %p", ptr);
+                        task_memory_enter(task_info);
+                        dir_stream_abort(ptr);
+                        task_memory_leave(task_info);
+                        break;
                     default: ESP_LOGE(TAG, "Unknown resource type %i in thread_delete", type);
                 }
             }
@@ -263,6 +318,9 @@ static void task_thread_destroy(task_thread_t *thread) {
         kh_destroy(restable, thread->resources[i]);
     }
 
+    tls_session_cache_destroy((tls_session_cache_t *)atomic_load(&thread->tls_sessions));
+    cookie_store_destroy((cookie_store_t *)atomic_load(&thread->cookie_store));
+
     pages_deallocate(thread->pages);
 
     free(thread);
@@ -608,7 +666,12 @@ static void IRAM_ATTR hades(void *ignored) {
                 pid_t parent_pid = task_info->parent;
 
                 process_table_remove_task(task_info);
-                task_thread_destroy(task_info->thread);
+
+                // Unhook a poll() the task died in before the devices it was waiting on go away
+                poll_waiter_destroy(task_info->poll_waiter);
+                task_info->poll_waiter = NULL;
+
+                task_thread_destroy(task_info);
                 task_info_delete(task_info);
 
                 if (xSemaphoreTake(process_table_lock, portMAX_DELAY) != pdTRUE) {
@@ -46,6 +46,7 @@ typedef enum {
     RES_WINDOW,
     RES_DEVICE,
     RES_ESP_TLS,
+    RES_DIR,
     RES_RESOURCE_TYPE_MAX
 } task_resource_type_t;
 
@@ -59,6 +60,7 @@ typedef struct {
     bool      is_open;
     int       dev_fd;
     device_t *device;
+    uint32_t  stat_hash; // Stat cache entry to drop when the file changes, 0 if it was opened read only
 } file_handle_t;
 
 typedef struct {
@@ -74,6 +76,9 @@ typedef struct {
     struct malloc_state  malloc_state;
     struct malloc_params malloc_params;
     kh_restable_t       *resources[RES_RESOURCE_TYPE_MAX];
+    atomic_uintptr_t     http_pool;    // http_pool_t of kept-alive curl connections, made on first use
+    atomic_uintptr_t     tls_sessions; // tls_session_cache_t of resumable TLS sessions, made on first use
+    atomic_uintptr_t     cookie_store; // cookie_store_t of the cookies of all curl handles, made on first use
 } task_thread_t;
 
 typedef struct task_info {
@@ -110,6 +115,12 @@ typedef struct task_info {
     struct tm     localtime_tm;
     QueueHandle_t children;
 
+    // Set by curl for the duration of a transfer, NULL for the TLS cache defaults
+    struct tls_cache_options const *tls_options;
+
+    // Made by the first poll() or select() of the thread
+    struct poll_waiter *poll_waiter;
+
     void *pad; // For debugging
 } task_info_t;
 
@@ -132,6 +143,9 @@ bool         task_application_is_running(char const *unique_id);
 uint32_t     get_num_tasks();
 task_info_t *get_taskinfo_for_pid(pid_t pid);
 
+// Kernel tasks get small stacks, 3 or 4 KiB for most. Anything that takes a path, like open, stat or rename, must not
+// run on them: logical name resolution alone can take over 4 KiB and the path_t, stat cache key and UNIX paths of the
+// driver add another 1 KiB, before FatFs and logging. Processes get at least MIN_STACK_SIZE.
 BaseType_t create_kernel_task(
     TaskFunction_t      pvTaskCode,
     char const *const   pcName,
@@ -0,0 +1,297 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "tls_cache.h"
+
+#include "badgevms_config.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "mbedtls/platform_util.h"
+#include "mbedtls/sha256.h"
+#include "task.h"
+#include "tls_session_cache.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+static char const *TAG = "tls_cache";
+
+typedef struct {
+    bool             used;
+    bool             stale; // Replaced by a newer parse, freed when the last connection using it is done
+    int              refs;
+    uint32_t         parsed;
+    uint32_t         last_used;
+    unsigned char    digest[32];
+    mbedtls_x509_crt chain;
+} ca_entry_t;
+
+_Static_assert(TLS_CACHE_TRUST_BYTES == TLS_SESSION_TRUST_BYTES, "Trust digests go into the session cache");
+
+static tls_cache_options_t const default_options = {
+    .sessions     = true,
+    .ca_max_age_s = TLS_CA_CACHE_MAX_AGE_S,
+};
+
+static SemaphoreHandle_t ca_lock;
+static ca_entry_t        ca_entries[TLS_CA_CACHE_ENTRIES];
+static uint32_t          ca_clock;
+
+static uint32_t now_s(void) {
+    return esp_timer_get_time() / 1000000;
+}
+
+static tls_cache_options_t const *options(void) {
+    tls_cache_options_t const *options = get_task_info()->tls_options;
+    return options ? options : &default_options;
+}
+
+static tls_session_cache_t *process_sessions(bool create) {
+    task_thread_t       *thread = get_task_info()->thread;
+    tls_session_cache_t *cache  = (tls_session_cache_t *)atomic_load(&thread->tls_sessions);
+    if (cache || !create) {
+        return cache;
+    }
+
+    cache = tls_session_cache_create();
+    if (!cache) {
+        return NULL;
+    }
+
+    uintptr_t expected = 0;
+    if (!atomic_compare_exchange_strong(&thread->tls_sessions, &expected, (uintptr_t)cache)) {
+        tls_session_cache_destroy(cache);
+        return (tls_session_cache_t *)expected;
+    }
+    return cache;
+}
+
+bool tls_cache_init(void) {
+    ca_lock = xSemaphoreCreateMutex();
+    return ca_lock != NULL;
+}
+
+// Every part goes in with its length or as a fixed size value, so different setups can't run into the same bytes
+static int digest_part(mbedtls_sha256_context *ctx, void const *data, size_t len) {
+    uint64_t size = data ? len : UINT64_MAX;
+    int      ret  = mbedtls_sha256_update(ctx, (unsigned char const *)&size, sizeof(size));
+    if (ret == 0 && data) {
+        ret = mbedtls_sha256_update(ctx, data, len);
+    }
+    return ret;
+}
+
+bool tls_cache_trust_digest(tls_cache_trust_t const *trust, unsigned char digest[TLS_CACHE_TRUST_BYTES]) {
+    unsigned char const flags[2] = {trust->global_store, trust->skip_common_name};
+    char const         *name     = trust->common_name;
+
+    mbedtls_sha256_context ctx;
+    mbedtls_sha256_init(&ctx);
+    int ret = mbedtls_sha256_starts(&ctx, 0);
+    if (ret == 0) {
+        ret = digest_part(&ctx, trust->ca, trust->ca_len);
+    }
+    if (ret == 0) {
+        ret = digest_part(&ctx, &trust->bundle, sizeof(trust->bundle));
+    }
+    if (ret == 0) {
+        ret = digest_part(&ctx, flags, sizeof(flags));
+    }
+    if (ret == 0) {
+        ret = digest_part(&ctx, name, name ? strlen(name) : 0);
+    }
+    if (ret == 0) {
+        ret = mbedtls_sha256_finish(&ctx, digest);
+    }
+    mbedtls_sha256_free(&ctx);
+    return ret == 0;
+}
+
+bool tls_cache_session_resume(mbedtls_ssl_context *ssl, char const *host, uint16_t port, unsigned char const *trust) {
+    tls_session_cache_t *cache = process_sessions(false);
+    if (!cache || !options()->sessions) {
+        return false;
+    }
+
+    size_t         len;
+    unsigned char *data = tls_session_cache_get(cache, host, port, trust, &len, now_s());
+    if (!data) {
+        return false;
+    }
+
+    mbedtls_ssl_session session;
+    mbedtls_ssl_session_init(&session);
+    int ret = mbedtls_ssl_session_load(&session, data, len);
+    if (ret == 0) {
+        ret = mbedtls_ssl_set_session(ssl, &session);
+    }
+    mbedtls_ssl_session_free(&session);
+    mbedtls_platform_zeroize(data, len);
+    free(data);
+
+    if (ret != 0) {
+        ESP_LOGW(TAG, "Unable to resume session with %s:%u: -0x%04x", host, port, -ret);
+        tls_session_cache_forget(cache, host, port, trust);
+        return false;
+    }
+    return true;
+}
+
+void tls_cache_session_store(
+    mbedtls_ssl_session const *session,
+    char const                *host,
+    uint16_t                   port,
+    unsigned char const       *trust
+) {
+    if (!options()->sessions) {
+        return;
+    }
+
+    tls_session_cache_t *cache = process_sessions(true);
+    if (!cache) {
+        return;
+    }
+
+    size_t len = 0;
+    if (mbedtls_ssl_session_save(session, NULL, 0, &len) != MBEDTLS_ERR_SSL_BUFFER_TOO_SMALL) {
+        return;
+    }
+
+    unsigned char *data = malloc(len);
+    if (!data) {
+        return;
+    }
+
+    if (mbedtls_ssl_session_save(session, data, len, &len) == 0) {
+        uint32_t lifetime_s = 0;
+#if defined(MBEDTLS_SSL_SESSION_TICKETS) && defined(MBEDTLS_SSL_CLI_C)
+        lifetime_s = session->MBEDTLS_PRIVATE(ticket_lifetime);
+#endif
+        tls_session_cache_put(cache, host, port, trust, data, len, lifetime_s, now_s());
+    }
+
+    mbedtls_platform_zeroize(data, len);
+    free(data);
+}
+
+void tls_cache_session_forget(char const *host, uint16_t port, unsigned char const *trust) {
+    tls_session_cache_t *cache = process_sessions(false);
+    if (cache) {
+        tls_session_cache_forget(cache, host, port, trust);
+    }
+}
+
+static void ca_entry_free(ca_entry_t *entry) {
+    mbedtls_x509_crt_free(&entry->chain);
+    memset(entry, 0, sizeof(ca_entry_t));
+}
+
+mbedtls_x509_crt *tls_cache_ca_get(unsigned char const *buf, size_t len) {
+    long max_age = options()->ca_max_age_s;
+    if (!ca_lock || max_age == 0) {
+        return NULL;
+    }
+
+    unsigned char digest[32];
+    if (mbedtls_sha256(buf, len, digest, 0) != 0) {
+        return NULL;
+    }
+
+    uint32_t          now    = now_s();
+    mbedtls_x509_crt *result = NULL;
+    ca_entry_t       *spare  = NULL;
+
+    xSemaphoreTake(ca_lock, portMAX_DELAY);
+
+    for (int i = 0; i < TLS_CA_CACHE_ENTRIES; i++) {
+        ca_entry_t *entry = &ca_entries[i];
+        if (entry->used && !entry->stale && memcmp(entry->digest, digest, sizeof(digest)) == 0) {
+            if (max_age > 0 && now - entry->parsed > (uint32_t)max_age) {
+                if (entry->refs) {
+                    entry->stale = true;
+                } else {
+                    ca_entry_free(entry);
+                }
+                continue;
+            }
+
+            entry->refs++;
+            entry->last_used = ++ca_clock;
+            result           = &entry->chain;
+            goto out;
+        }
+    }
+
+    // An unused slot, or the least recently used chain no connection holds
+    for (int i = 0; i < TLS_CA_CACHE_ENTRIES; i++) {
+        ca_entry_t *entry = &ca_entries[i];
+        if (!entry->used) {
+            spare = entry;
+            break;
+        }
+        if (!entry->refs && (!spare || (int32_t)(entry->last_used - spare->last_used) < 0)) {
+            spare = entry;
+        }
+    }
+
+    if (!spare) {
+        goto out;
+    }
+
+    if (spare->used) {
+        ca_entry_free(spare);
+    }
+
+    mbedtls_x509_crt_init(&spare->chain);
+    int ret = mbedtls_x509_crt_parse(&spare->chain, buf, len);
+    if (ret < 0) {
+        ESP_LOGW(TAG, "Unable to parse CA certificates: -0x%04x", -ret);
+        ca_entry_free(spare);
+        goto out;
+    }
+
+    memcpy(spare->digest, digest, sizeof(digest));
+    spare->used      = true;
+    spare->refs      = 1;
+    spare->parsed    = now;
+    spare->last_used = ++ca_clock;
+    result           = &spare->chain;
+
+out:
+    xSemaphoreGive(ca_lock);
+    return result;
+}
+
+bool tls_cache_ca_put(mbedtls_x509_crt *chain) {
+    for (int i = 0; i < TLS_CA_CACHE_ENTRIES; i++) {
+        ca_entry_t *entry = &ca_entries[i];
+        if (chain != &entry->chain) {
+            continue;
+        }
+
+        xSemaphoreTake(ca_lock, portMAX_DELAY);
+        if (--entry->refs == 0 && entry->stale) {
+            ca_entry_free(entry);
+        }
+        xSemaphoreGive(ca_lock);
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,70 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "mbedtls/ssl.h"
+#include "mbedtls/x509_crt.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The TLS caches used by our esp-tls: resumable sessions per process and parsed CA certificate chains shared by every
+// connection given the same certificates. curl points the task at its options for the duration of a transfer.
+
+typedef struct tls_cache_options {
+    bool sessions;     // Resume cached sessions and cache new ones
+    long ca_max_age_s; // Share CA chains parsed at most this long ago, 0 to parse them for the connection, -1 forever
+} tls_cache_options_t;
+
+#define TLS_CACHE_TRUST_BYTES 32
+
+// What a connection verifies the server against. A resumed session skips that verification, so sessions are cached
+// under a digest of this and only offered to connections that trust the same.
+typedef struct {
+    unsigned char const *ca; // CA certificates, NULL for none
+    size_t               ca_len;
+    uintptr_t            bundle; // The attach function of the certificate bundle, 0 for none
+    bool                 global_store;
+    char const          *common_name; // The name the certificate has to be for instead of the host, NULL for the host
+    bool                 skip_common_name;
+} tls_cache_trust_t;
+
+bool tls_cache_init(void);
+
+// Returns false if the digest couldn't be made, the session cache can't be used then
+bool tls_cache_trust_digest(tls_cache_trust_t const *trust, unsigned char digest[TLS_CACHE_TRUST_BYTES]);
+
+// Offers ssl the cached session for host, port and trust digest, returns true if there was one
+bool tls_cache_session_resume(mbedtls_ssl_context *ssl, char const *host, uint16_t port, unsigned char const *trust);
+
+// session is what mbedtls_ssl_get_session gave for a connection to host and port under the trust digest, it can only
+// be exported once
+void tls_cache_session_store(
+    mbedtls_ssl_session const *session,
+    char const                *host,
+    uint16_t                   port,
+    unsigned char const       *trust
+);
+
+void tls_cache_session_forget(char const *host, uint16_t port, unsigned char const *trust);
+
+// Returns the parsed chain of the certificates in buf, NULL if the caller has to parse them itself. Every chain
+// returned must be given back with tls_cache_ca_put, which returns false for chains that didn't come from here.
+mbedtls_x509_crt *tls_cache_ca_get(unsigned char const *buf, size_t len);
+bool              tls_cache_ca_put(mbedtls_x509_crt *chain);
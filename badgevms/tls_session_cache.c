@@ -0,0 +1,215 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "tls_session_cache.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+typedef struct {
+    uint16_t      port;
+    uint32_t      expires;
+    uint32_t      last_used;
+    size_t        len;
+    char         *host;
+    void         *session;
+    unsigned char trust[TLS_SESSION_TRUST_BYTES];
+} session_slot_t;
+
+struct tls_session_cache {
+    SemaphoreHandle_t         lock;
+    tls_session_cache_stats_t stats;
+    uint32_t                  clock; // Orders last_used, wall time doesn't move between quick lookups
+    session_slot_t            slots[TLS_SESSION_CACHE_SLOTS];
+};
+
+// Sessions hold the keys of the connection they came from
+static void wipe(void *data, size_t len) {
+    volatile unsigned char *p = data;
+    while (len--) {
+        *p++ = 0;
+    }
+}
+
+static void clear_slot(session_slot_t *slot) {
+    if (slot->session) {
+        wipe(slot->session, slot->len);
+    }
+    free(slot->session);
+    free(slot->host);
+    memset(slot, 0, sizeof(session_slot_t));
+}
+
+static session_slot_t *find_slot(
+    tls_session_cache_t *cache,
+    char const          *host,
+    uint16_t             port,
+    unsigned char const *trust
+) {
+    for (int i = 0; i < TLS_SESSION_CACHE_SLOTS; i++) {
+        session_slot_t *slot = &cache->slots[i];
+        if (slot->host && slot->port == port && strcasecmp(slot->host, host) == 0 &&
+            memcmp(slot->trust, trust, TLS_SESSION_TRUST_BYTES) == 0) {
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+tls_session_cache_t *tls_session_cache_create(void) {
+    tls_session_cache_t *cache = calloc(1, sizeof(tls_session_cache_t));
+    if (!cache) {
+        return NULL;
+    }
+
+    cache->lock = xSemaphoreCreateMutex();
+    if (!cache->lock) {
+        free(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+void tls_session_cache_destroy(tls_session_cache_t *cache) {
+    if (!cache) {
+        return;
+    }
+
+    for (int i = 0; i < TLS_SESSION_CACHE_SLOTS; i++) {
+        clear_slot(&cache->slots[i]);
+    }
+    vSemaphoreDelete(cache->lock);
+    free(cache);
+}
+
+bool tls_session_cache_put(
+    tls_session_cache_t *cache,
+    char const          *host,
+    uint16_t             port,
+    unsigned char const *trust,
+    void const          *session,
+    size_t               len,
+    uint32_t             lifetime_s,
+    uint32_t             now_s
+) {
+    if (!len) {
+        return false;
+    }
+
+    char *host_copy    = strdup(host);
+    void *session_copy = malloc(len);
+    if (!host_copy || !session_copy) {
+        free(host_copy);
+        free(session_copy);
+        return false;
+    }
+    memcpy(session_copy, session, len);
+
+    if (lifetime_s == 0 || lifetime_s > TLS_SESSION_CACHE_MAX_AGE_S) {
+        lifetime_s = TLS_SESSION_CACHE_MAX_AGE_S;
+    }
+
+    xSemaphoreTake(cache->lock, portMAX_DELAY);
+
+    session_slot_t *slot = find_slot(cache, host, port, trust);
+    if (!slot) {
+        for (int i = 0; i < TLS_SESSION_CACHE_SLOTS; i++) {
+            session_slot_t *candidate = &cache->slots[i];
+            if (!candidate->host) {
+                slot = candidate;
+                break;
+            }
+            if (!slot || (int32_t)(candidate->last_used - slot->last_used) < 0) {
+                slot = candidate;
+            }
+        }
+        if (slot->host) {
+            cache->stats.evicted++;
+        }
+    }
+
+    clear_slot(slot);
+    slot->host      = host_copy;
+    slot->port      = port;
+    slot->session   = session_copy;
+    memcpy(slot->trust, trust, TLS_SESSION_TRUST_BYTES);
+    slot->len       = len;
+    slot->expires   = now_s + lifetime_s;
+    slot->last_used = ++cache->clock;
+    cache->stats.stores++;
+
+    xSemaphoreGive(cache->lock);
+    return true;
+}
+
+void *tls_session_cache_get(
+    tls_session_cache_t *cache,
+    char const          *host,
+    uint16_t             port,
+    unsigned char const *trust,
+    size_t              *len,
+    uint32_t             now_s
+) {
+    void *copy = NULL;
+
+    xSemaphoreTake(cache->lock, portMAX_DELAY);
+
+    session_slot_t *slot = find_slot(cache, host, port, trust);
+    if (slot && (int32_t)(slot->expires - now_s) <= 0) {
+        clear_slot(slot);
+        cache->stats.expired++;
+        slot = NULL;
+    }
+
+    if (slot) {
+        copy = malloc(slot->len);
+        if (copy) {
+            memcpy(copy, slot->session, slot->len);
+            *len            = slot->len;
+            slot->last_used = ++cache->clock;
+        }
+    }
+
+    if (copy) {
+        cache->stats.hits++;
+    } else {
+        cache->stats.misses++;
+    }
+
+    xSemaphoreGive(cache->lock);
+    return copy;
+}
+
+void tls_session_cache_forget(tls_session_cache_t *cache, char const *host, uint16_t port, unsigned char const *trust) {
+    xSemaphoreTake(cache->lock, portMAX_DELAY);
+    session_slot_t *slot = find_slot(cache, host, port, trust);
+    if (slot) {
+        clear_slot(slot);
+        cache->stats.forgotten++;
+    }
+    xSemaphoreGive(cache->lock);
+}
+
+void tls_session_cache_stats_get(tls_session_cache_t *cache, tls_session_cache_stats_t *stats) {
+    xSemaphoreTake(cache->lock, portMAX_DELAY);
+    *stats = cache->stats;
+    xSemaphoreGive(cache->lock);
+}
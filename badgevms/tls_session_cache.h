@@ -0,0 +1,72 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "badgevms_config.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Serialized TLS sessions of one process by host, port and trust, so a new connection can resume instead of doing a
+// full handshake. Sessions are opaque here, tls_cache.c does the mbedtls side. The trust is a digest of what the
+// connection verified the server against: a resumed handshake skips verification, so a session may only be offered to
+// connections that would have trusted the same server.
+
+#define TLS_SESSION_TRUST_BYTES 32
+
+typedef struct {
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t stores;
+    uint32_t expired; // Lookups that found a session past its lifetime
+    uint32_t evicted; // Sessions dropped to make room for another host
+    uint32_t forgotten;
+} tls_session_cache_stats_t;
+
+typedef struct tls_session_cache tls_session_cache_t;
+
+tls_session_cache_t *tls_session_cache_create(void);
+void                 tls_session_cache_destroy(tls_session_cache_t *cache);
+
+// Replaces the session of host, port and trust, it is kept for lifetime_s but never more than
+// TLS_SESSION_CACHE_MAX_AGE_S, 0 for that maximum. Returns false if it couldn't be stored.
+bool tls_session_cache_put(
+    tls_session_cache_t *cache,
+    char const          *host,
+    uint16_t             port,
+    unsigned char const *trust,
+    void const          *session,
+    size_t               len,
+    uint32_t             lifetime_s,
+    uint32_t             now_s
+);
+
+// Returns a malloc'd copy of the session of host, port and trust, NULL if there is none or it expired
+void *tls_session_cache_get(
+    tls_session_cache_t *cache,
+    char const          *host,
+    uint16_t             port,
+    unsigned char const *trust,
+    size_t              *len,
+    uint32_t             now_s
+);
+
+void tls_session_cache_forget(tls_session_cache_t *cache, char const *host, uint16_t port, unsigned char const *trust);
+
+void tls_session_cache_stats_get(tls_session_cache_t *cache, tls_session_cache_stats_t *stats);
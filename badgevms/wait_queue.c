@@ -0,0 +1,291 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "wait_queue.h"
+
+#include "badgevms_config.h"
+#include "esp_timer.h"
+#include "esp_vfs_eventfd.h"
+#include "freertos/task.h"
+
+#include <stdlib.h>
+
+#include <unistd.h>
+
+bool wait_queue_init(wait_queue_t *queue) {
+    queue->head = NULL;
+    queue->lock = xSemaphoreCreateMutex();
+    return queue->lock != NULL;
+}
+
+static void waiter_kick(poll_waiter_t *waiter) {
+    xSemaphoreGive(waiter->wake);
+
+    int wake_fd = atomic_load(&waiter->wake_fd);
+    if (wake_fd >= 0) {
+        uint64_t one = 1;
+        write(wake_fd, &one, sizeof(one));
+    }
+}
+
+void wait_queue_deinit(wait_queue_t *queue) {
+    if (!queue->lock) {
+        return;
+    }
+
+    // A waiter takes its link out under the queue lock on the way out of poll(), so the lock stays until every one
+    // of them has been woken and is gone
+    while (1) {
+        xSemaphoreTake(queue->lock, portMAX_DELAY);
+        bool empty = !queue->head;
+        for (poll_link_t *link = queue->head; link; link = link->next) {
+            waiter_kick(link->waiter);
+        }
+        xSemaphoreGive(queue->lock);
+
+        if (empty) {
+            break;
+        }
+        vTaskDelay(1);
+    }
+
+    vSemaphoreDelete(queue->lock);
+    queue->lock = NULL;
+}
+
+void wait_queue_wake(wait_queue_t *queue) {
+    xSemaphoreTake(queue->lock, portMAX_DELAY);
+    for (poll_link_t *link = queue->head; link; link = link->next) {
+        waiter_kick(link->waiter);
+    }
+    xSemaphoreGive(queue->lock);
+}
+
+void poll_recheck(poll_waiter_t *waiter, uint32_t interval_ms) {
+    if (!waiter) {
+        return;
+    }
+
+    if (!waiter->recheck_ms || interval_ms < waiter->recheck_ms) {
+        waiter->recheck_ms = interval_ms ? interval_ms : 1;
+    }
+}
+
+void poll_wait(poll_waiter_t *waiter, wait_queue_t *queue) {
+    if (!waiter) {
+        return;
+    }
+
+    // Room for one link per entry was made before the scan, a device that wants more gets looked at again instead
+    if (waiter->num_links == waiter->max_links) {
+        poll_recheck(waiter, POLL_FALLBACK_INTERVAL_MS);
+        return;
+    }
+
+    poll_link_t *link = &waiter->links[waiter->num_links++];
+    link->waiter      = waiter;
+    link->queue       = queue;
+    link->prev        = NULL;
+
+    xSemaphoreTake(queue->lock, portMAX_DELAY);
+    link->next = queue->head;
+    if (queue->head) {
+        queue->head->prev = link;
+    }
+    queue->head = link;
+    xSemaphoreGive(queue->lock);
+}
+
+void poll_wait_fd(poll_waiter_t *waiter, int native_fd, short events) {
+    if (!waiter) {
+        return;
+    }
+
+    // The last slot is kept for the wake fd
+    if (waiter->num_fds + 1 >= waiter->max_fds) {
+        poll_recheck(waiter, POLL_FALLBACK_INTERVAL_MS);
+        return;
+    }
+
+    waiter->fds[waiter->num_fds++] = (struct pollfd){.fd = native_fd, .events = events};
+}
+
+static void unlink_all(poll_waiter_t *waiter) {
+    for (size_t i = 0; i < waiter->num_links; ++i) {
+        poll_link_t  *link  = &waiter->links[i];
+        wait_queue_t *queue = link->queue;
+
+        xSemaphoreTake(queue->lock, portMAX_DELAY);
+        if (link->prev) {
+            link->prev->next = link->next;
+        } else {
+            queue->head = link->next;
+        }
+        if (link->next) {
+            link->next->prev = link->prev;
+        }
+        xSemaphoreGive(queue->lock);
+    }
+
+    waiter->num_links  = 0;
+    waiter->num_fds    = 0;
+    waiter->recheck_ms = 0;
+}
+
+poll_waiter_t *poll_waiter_create(void) {
+    poll_waiter_t *waiter = calloc(1, sizeof(poll_waiter_t));
+    if (!waiter) {
+        return NULL;
+    }
+
+    waiter->wake = xSemaphoreCreateBinary();
+    if (!waiter->wake) {
+        free(waiter);
+        return NULL;
+    }
+
+    atomic_store(&waiter->wake_fd, -1);
+    return waiter;
+}
+
+void poll_waiter_destroy(poll_waiter_t *waiter) {
+    if (!waiter) {
+        return;
+    }
+
+    unlink_all(waiter);
+
+    int wake_fd = atomic_load(&waiter->wake_fd);
+    if (wake_fd >= 0) {
+        close(wake_fd);
+    }
+
+    vSemaphoreDelete(waiter->wake);
+    free(waiter->links);
+    free(waiter->fds);
+    free(waiter);
+}
+
+static bool reserve(poll_waiter_t *waiter, size_t count) {
+    if (waiter->max_links < count) {
+        poll_link_t *links = realloc(waiter->links, count * sizeof(poll_link_t));
+        if (!links) {
+            return false;
+        }
+        waiter->links     = links;
+        waiter->max_links = count;
+    }
+
+    if (waiter->max_fds < count + 1) {
+        struct pollfd *fds = realloc(waiter->fds, (count + 1) * sizeof(struct pollfd));
+        if (!fds) {
+            return false;
+        }
+        waiter->fds     = fds;
+        waiter->max_fds = count + 1;
+    }
+
+    return true;
+}
+
+static int scan(poll_entry_t *entries, size_t count, poll_waiter_t *waiter) {
+    int ready = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        poll_entry_t *entry = &entries[i];
+
+        if (!entry->device) {
+            entry->revents = POLLNVAL;
+        } else if (entry->device->_poll) {
+            short revents  = entry->device->_poll(entry->device, entry->dev_fd, entry->events, waiter);
+            entry->revents = revents & (entry->events | POLLERR | POLLHUP | POLLNVAL);
+        } else {
+            entry->revents = entry->events & (POLLIN | POLLRDNORM | POLLOUT | POLLWRNORM);
+        }
+
+        if (entry->revents) {
+            ++ready;
+        }
+    }
+
+    return ready;
+}
+
+static void block(poll_waiter_t *waiter, int64_t wait_us) {
+    if (!waiter->num_fds) {
+        TickType_t ticks = wait_us < 0 ? portMAX_DELAY : pdMS_TO_TICKS((wait_us + 999) / 1000);
+        xSemaphoreTake(waiter->wake, ticks ? ticks : 1);
+        return;
+    }
+
+    // Sockets only wake the native poll(), so wait queues have to wake it too
+    int wake_fd = atomic_load(&waiter->wake_fd);
+    if (wake_fd < 0) {
+        wake_fd = eventfd(0, 0);
+        if (wake_fd < 0) {
+            // Fall back to looking at the sockets now and then
+            xSemaphoreTake(waiter->wake, pdMS_TO_TICKS(POLL_FALLBACK_INTERVAL_MS));
+            return;
+        }
+        atomic_store(&waiter->wake_fd, wake_fd);
+    }
+
+    // A wake before the wake fd was there only gave the semaphore
+    if (xSemaphoreTake(waiter->wake, 0) == pdTRUE) {
+        return;
+    }
+
+    struct pollfd *wake = &waiter->fds[waiter->num_fds];
+    *wake               = (struct pollfd){.fd = wake_fd, .events = POLLIN};
+
+    int timeout = wait_us < 0 ? -1 : (int)((wait_us + 999) / 1000);
+    if (poll(waiter->fds, waiter->num_fds + 1, timeout) > 0 && (wake->revents & POLLIN)) {
+        uint64_t count;
+        read(wake_fd, &count, sizeof(count));
+        xSemaphoreTake(waiter->wake, 0);
+    }
+}
+
+int poll_entries(poll_waiter_t *waiter, poll_entry_t *entries, size_t count, int timeout_ms) {
+    int64_t deadline = timeout_ms < 0 ? INT64_MAX : esp_timer_get_time() + timeout_ms * 1000LL;
+
+    // Without room to hook the waiter onto a device poll_wait() falls back to looking at it again now and then
+    poll_waiter_t *hook = timeout_ms ? waiter : NULL;
+    if (hook) {
+        reserve(waiter, count);
+    }
+
+    // A wake left over from an earlier poll() only costs one extra scan
+    int ready = scan(entries, count, hook);
+    while (!ready) {
+        int64_t now = esp_timer_get_time();
+        if (now >= deadline) {
+            break;
+        }
+
+        int64_t wait_us = deadline == INT64_MAX ? -1 : deadline - now;
+        if (waiter->recheck_ms && (wait_us < 0 || wait_us > waiter->recheck_ms * 1000LL)) {
+            wait_us = waiter->recheck_ms * 1000LL;
+        }
+
+        block(waiter, wait_us);
+        ready = scan(entries, count, NULL);
+    }
+
+    unlink_all(waiter);
+    return ready;
+}
@@ -0,0 +1,89 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "badgevms/device.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/poll.h>
+
+// Readiness of file descriptors for poll() and select(). The _poll callback of a device says what an fd is ready for
+// and hooks the waiter onto whatever will tell it that changed: a wait queue the device wakes, a native lwIP socket
+// or, for hardware that can only be polled, an interval to look again after. It has to do so before looking at the
+// state of the fd, so a change in between isn't missed.
+
+typedef struct poll_waiter poll_waiter_t;
+typedef struct poll_link   poll_link_t;
+
+typedef struct {
+    SemaphoreHandle_t lock;
+    poll_link_t      *head;
+} wait_queue_t;
+
+struct poll_link {
+    poll_waiter_t *waiter;
+    wait_queue_t  *queue;
+    poll_link_t   *prev;
+    poll_link_t   *next;
+};
+
+// One per task, reused by every poll() of that task
+struct poll_waiter {
+    SemaphoreHandle_t wake;
+    atomic_int        wake_fd; // eventfd that wakes the native poll(), -1 until a poll() needed one
+    poll_link_t      *links;
+    size_t            num_links;
+    size_t            max_links;
+    struct pollfd    *fds;
+    size_t            num_fds;
+    size_t            max_fds;
+    uint32_t          recheck_ms;
+};
+
+typedef struct {
+    device_t *device; // NULL for an fd that isn't open
+    int       dev_fd;
+    short     events;
+    short     revents;
+} poll_entry_t;
+
+bool wait_queue_init(wait_queue_t *queue);
+// Wakes the poll() calls still waiting on the queue and returns once they are off it. The device must already report
+// the fd as gone (POLLHUP or POLLNVAL) and no longer hook waiters onto the queue, or they would wait again.
+void wait_queue_deinit(wait_queue_t *queue);
+// Wakes every poll() waiting on the queue, from a task, not from an interrupt
+void wait_queue_wake(wait_queue_t *queue);
+
+// For the _poll callback of a device, waiter is NULL when poll() only wants to know the current state
+void poll_wait(poll_waiter_t *waiter, wait_queue_t *queue);
+void poll_wait_fd(poll_waiter_t *waiter, int native_fd, short events);
+void poll_recheck(poll_waiter_t *waiter, uint32_t interval_ms);
+
+poll_waiter_t *poll_waiter_create(void);
+void           poll_waiter_destroy(poll_waiter_t *waiter);
+
+// Waits for at least one entry to be ready or timeout_ms to pass, forever if it is negative. Returns the number of
+// entries with revents set. An fd that isn't open reports POLLNVAL, a device without _poll is always ready for
+// reading and writing, like a regular file.
+int poll_entries(poll_waiter_t *waiter, poll_entry_t *entries, size_t count, int timeout_ms);
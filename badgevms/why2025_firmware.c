@@ -25,6 +25,7 @@
 #include "badgevms/ota.h"
 #include "badgevms/process.h"
 #include "badgevms_config.h"
+#include "block_cache.h"
 #include "compositor/compositor_private.h"
 #include "device_private.h"
 #include "drivers/badgevms_i2c_bus.h"
@@ -35,19 +36,25 @@
 #include "drivers/tca8418.h"
 #include "drivers/tty.h"
 #include "drivers/wifi.h"
+#include "dns_service.h"
 #include "esp_debug_helpers.h"
 #include "esp_event.h"
 #include "esp_log.h"
 #include "esp_ota_ops.h"
+#include "esp_vfs_eventfd.h"
 #include "esp_private/panic_internal.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "init.h"
+#include "io_service.h"
 #include "logical_names.h"
 #include "memory.h"
 #include "nvs_flash.h"
 #include "ota_private.h"
+#include "splice.h"
+#include "stat_cache.h"
 #include "task.h"
+#include "tls_cache.h"
 
 #include <errno.h>
 #include <string.h>
@@ -98,6 +105,14 @@ int app_main(void) {
         invalidate_ota_partition();
     }
 
+    if (!io_service_init()) {
+        ESP_LOGE(TAG, "Failed to initialize I/O subsystem");
+        invalidate_ota_partition();
+    }
+
+    // Allowed to fail, every sendfile() then allocates its own buffer
+    splice_init();
+
     if (!logical_names_system_init()) {
         ESP_LOGE(TAG, "Failed to initialize logical names subsystem");
         invalidate_ota_partition();
@@ -111,6 +126,13 @@ int app_main(void) {
         ret = nvs_flash_init();
     }
 
+    // Allowed to fail, the filesystems just won't be cached
+    block_cache_init(BLOCK_CACHE_BYTES);
+    stat_cache_init();
+
+    // Allowed to fail, CA certificates are then parsed for every connection
+    tls_cache_init();
+
     if (!device_register("FLASH0", fatfs_create_spi("FLASH0", "storage", true))) {
         ESP_LOGE(TAG, "Failed to initialize FLASH0 driver");
         invalidate_ota_partition();
@@ -139,6 +161,17 @@ int app_main(void) {
         invalidate_ota_partition();
     }
 
+    // Lets poll() wake up a task that is blocked on sockets
+    esp_vfs_eventfd_config_t eventfd_config = {.max_fds = EVENTFD_MAX};
+    if (esp_vfs_eventfd_register(&eventfd_config) != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to register eventfd, poll() on sockets will be slow to wake");
+    }
+
+    if (!dns_service_init()) {
+        ESP_LOGE(TAG, "Failed to initialize DNS service");
+        invalidate_ota_partition();
+    }
+
     if (!device_register("PANEL0", st7703_create())) {
         ESP_LOGE(TAG, "Failed to initialize PANEL0 driver");
         invalidate_ota_partition();
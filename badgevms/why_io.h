@@ -22,6 +22,8 @@
 #include <fcntl.h>
 #include <unistd.h>
 
+#include <sys/poll.h>
+
 void *why_malloc(size_t size);
 void  why_free(void *_Nullable ptr);
 void *why_calloc(size_t nmemb, size_t size);
@@ -33,6 +35,7 @@ ssize_t why_read(int fd, void *buf, size_t count);
 off_t   why_lseek(int fd, off_t offset, int whence);
 int     why_open(char const *pathname, int flags, mode_t mode);
 int     why_close(int fd);
+int     why_poll(struct pollfd *fds, nfds_t nfds, int timeout);
 
 FILE *why_fopen(char const *restrict pathname, char const *restrict mode);
 int   why_fclose(FILE *stream);
@@ -79,9 +82,14 @@ int            why_unlink(char const *pathname);
 int            why_mkdir(char const *pathname, mode_t mode);
 int            why_rmdir(char const *pathname);
 int            why_fstat(int fd, struct stat *restrict statbuf);
+int            why_fsync(int fd);
+int            why_fdatasync(int fd);
+void           why_sync(void);
 int            why_rename(char const *oldpath, char const *newpath);
 int            why_remove(char const *pathname);
 DIR           *why_opendir(char const *name);
 struct dirent *why_readdir(DIR *dirp);
 int            why_closedir(DIR *dirp);
 void           why_rewinddir(DIR *dirp);
+long           why_telldir(DIR *dirp);
+void           why_seekdir(DIR *dirp, long loc);
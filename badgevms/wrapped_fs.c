@@ -15,7 +15,10 @@
  */
 
 #include "badgevms/pathfuncs.h"
+#include "device_private.h"
+#include "dir_stream.h"
 #include "logical_names.h"
+#include "stat_cache.h"
 #include "task.h"
 #include "why_io.h"
 
@@ -25,32 +28,9 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
-#define kcalloc(N, Z)  why_calloc(N, Z)
-#define kmalloc(Z)     why_malloc(Z)
-#define krealloc(P, Z) why_realloc(P, Z)
-#define kfree(P)       why_free(P)
-
-#include "thirdparty/khash.h"
-
-KHASH_SET_INIT_STR(seen);
-typedef khash_t(seen) * seen_names_t;
-
 typedef int (*fs_operation_func)(filesystem_device_t *fs_dev, path_t *path, void *extra_data);
 typedef int (*why_helper_func)(char const *resolved_path, void *extra_data);
 
-typedef struct why_dirent_entry {
-    struct dirent            dirent;        // Standard dirent structure
-    char                    *badgevms_name; // BadgeVMS name
-    struct why_dirent_entry *next;
-} why_dirent_entry_t;
-
-typedef struct why_dir {
-    char               *original_badgevms_path; // Original BadgeVMS path requested
-    why_dirent_entry_t *entries;
-    why_dirent_entry_t *current;
-    size_t              entry_count;
-} why_dir_t;
-
 static int _why_filesystem_op(char const *resolved_path, fs_operation_func operation, void *extra_data) {
     path_t parsed_path;
     int    res = parse_path(resolved_path, &parsed_path);
@@ -178,6 +158,10 @@ static int _why_rename_single(char const *oldpath_resolved, char const *newpath_
     }
 
     int result = fs_device->_rename(fs_device, &parsed_oldpath, &parsed_newpath);
+    if (result == 0) {
+        // Could have been a directory, taking everything below it along
+        stat_cache_flush();
+    }
 
     path_free(&parsed_oldpath);
     path_free(&parsed_newpath);
@@ -185,29 +169,39 @@ static int _why_rename_single(char const *oldpath_resolved, char const *newpath_
 }
 
 static int _stat_operation(filesystem_device_t *fs_dev, path_t *path, void *extra_data) {
-    if (!fs_dev->_stat)
-        return -1;
     struct stat *statbuf = (struct stat *)extra_data;
-    return fs_dev->_stat(fs_dev, path, statbuf);
+    return stat_cache_stat(fs_dev, path, statbuf);
 }
 
 static int _unlink_operation(filesystem_device_t *fs_dev, path_t *path, void *extra_data) {
     if (!fs_dev->_unlink)
         return -1;
-    return fs_dev->_unlink(fs_dev, path);
+    int result = fs_dev->_unlink(fs_dev, path);
+    if (result == 0) {
+        stat_cache_invalidate(path);
+    }
+    return result;
 }
 
 static int _mkdir_operation(filesystem_device_t *fs_dev, path_t *path, void *extra_data) {
     if (!fs_dev->_mkdir)
         return -1;
-    mode_t mode = *(mode_t *)extra_data;
-    return fs_dev->_mkdir(fs_dev, path, mode);
+    mode_t mode   = *(mode_t *)extra_data;
+    int    result = fs_dev->_mkdir(fs_dev, path, mode);
+    if (result == 0) {
+        stat_cache_invalidate(path);
+    }
+    return result;
 }
 
 static int _rmdir_operation(filesystem_device_t *fs_dev, path_t *path, void *extra_data) {
     if (!fs_dev->_rmdir)
         return -1;
-    return fs_dev->_rmdir(fs_dev, path);
+    int result = fs_dev->_rmdir(fs_dev, path);
+    if (result == 0) {
+        stat_cache_invalidate(path);
+    }
+    return result;
 }
 
 static int _why_stat_wrapper(char const *resolved_path, void *extra_data) {
@@ -289,6 +283,97 @@ int why_fstat(int fd, struct stat *restrict statbuf) {
     return fs_device->_fstat(fs_device, task_info->thread->file_handles[fd].dev_fd, statbuf);
 }
 
+int why_fsync(int fd) {
+    task_info_t *task_info = get_task_info();
+
+    if (fd < 0 || fd >= MAXFD || !task_info->thread->file_handles[fd].is_open) {
+        task_info->_errno = EBADF;
+        return -1;
+    }
+
+    device_t *device = task_info->thread->file_handles[fd].device;
+    if (!device || device->type != DEVICE_TYPE_FILESYSTEM) {
+        task_info->_errno = EINVAL;
+        return -1;
+    }
+
+    filesystem_device_t *fs_device = (filesystem_device_t *)device;
+    if (!fs_device->_fsync) {
+        return 0;
+    }
+
+    int result = fs_device->_fsync(fs_device, task_info->thread->file_handles[fd].dev_fd);
+    stat_cache_invalidate_hash(task_info->thread->file_handles[fd].stat_hash);
+    return result;
+}
+
+int why_fdatasync(int fd) {
+    return why_fsync(fd);
+}
+
+void why_sync(void) {
+    device_sync_all();
+}
+
+int filesystem_sync_policy_set(char const *device_name, filesystem_sync_policy_t policy, uint32_t interval_ms) {
+    task_info_t *task_info = get_task_info();
+
+    if (!device_name || policy < FILESYSTEM_SYNC_ON_CLOSE || policy > FILESYSTEM_SYNC_EXPLICIT) {
+        task_info->_errno = EINVAL;
+        return -1;
+    }
+
+    device_t *device = device_get(device_name);
+    if (!device || device->type != DEVICE_TYPE_FILESYSTEM) {
+        task_info->_errno = ENODEV;
+        return -1;
+    }
+
+    filesystem_device_t *fs_device = (filesystem_device_t *)device;
+    if (!fs_device->_set_sync_policy) {
+        task_info->_errno = ENOTSUP;
+        return -1;
+    }
+
+    return fs_device->_set_sync_policy(fs_device, policy, interval_ms);
+}
+
+bool filesystem_cache_stats_get(char const *device_name, filesystem_cache_stats_t *stats, bool reset) {
+    if (!device_name || !stats) {
+        return false;
+    }
+
+    device_t *device = device_get(device_name);
+    if (!device || device->type != DEVICE_TYPE_FILESYSTEM) {
+        return false;
+    }
+
+    filesystem_device_t *fs_device = (filesystem_device_t *)device;
+    if (!fs_device->_cache_stats) {
+        return false;
+    }
+
+    return fs_device->_cache_stats(fs_device, stats, reset);
+}
+
+bool filesystem_info_get(char const *device_name, filesystem_info_t *info) {
+    if (!device_name || !info) {
+        return false;
+    }
+
+    device_t *device = device_get(device_name);
+    if (!device || device->type != DEVICE_TYPE_FILESYSTEM) {
+        return false;
+    }
+
+    filesystem_device_t *fs_device = (filesystem_device_t *)device;
+    if (!fs_device->_info) {
+        return false;
+    }
+
+    return fs_device->_info(fs_device, info);
+}
+
 int why_rename(char const *oldpath, char const *newpath) {
     task_info_t *task_info = get_task_info();
     ESP_LOGI("why_rename", "Calling rename from task %p: %s -> %s", task_info->handle, oldpath, newpath);
@@ -349,123 +434,6 @@ int why_remove(char const *pathname) {
     }
 }
 
-static void seen_names_init(seen_names_t *seen) {
-    *seen = kh_init(seen);
-}
-
-static bool seen_names_contains(seen_names_t seen, char const *name) {
-    khiter_t k = kh_get(seen, seen, name);
-    return (k != kh_end(seen));
-}
-
-static bool seen_names_add(seen_names_t seen, char const *name) {
-    if (seen_names_contains(seen, name)) {
-        return false; // Already seen (shadowed)
-    }
-
-    int   ret;
-    char *name_copy = why_strdup(name);
-    if (!name_copy)
-        return false;
-
-    kh_put(seen, seen, name_copy, &ret);
-    if (ret < 0) {
-        why_free(name_copy); // Put failed
-        return false;
-    }
-    return true;
-}
-
-static void seen_names_cleanup(seen_names_t seen) {
-    khiter_t k;
-    // Free all the strdup'd keys
-    for (k = kh_begin(seen); k != kh_end(seen); ++k) {
-        if (kh_exist(seen, k)) {
-            why_free((void *)kh_key(seen, k));
-        }
-    }
-    kh_destroy(seen, seen);
-}
-
-static why_dirent_entry_t *create_dirent_entry(const struct dirent *original_dirent, char const *badgevms_name) {
-    why_dirent_entry_t *entry = why_malloc(sizeof(why_dirent_entry_t));
-    if (!entry)
-        return NULL;
-
-    memcpy(&entry->dirent, original_dirent, sizeof(struct dirent));
-
-    entry->badgevms_name = why_strdup(badgevms_name);
-    if (!entry->badgevms_name) {
-        why_free(entry);
-        return NULL;
-    }
-
-    strncpy(entry->dirent.d_name, badgevms_name, sizeof(entry->dirent.d_name) - 1);
-    entry->dirent.d_name[sizeof(entry->dirent.d_name) - 1] = '\0';
-
-    entry->next = NULL;
-    return entry;
-}
-
-static void free_dirent_entry(why_dirent_entry_t *entry) {
-    if (entry) {
-        why_free(entry->badgevms_name);
-        why_free(entry);
-    }
-}
-
-static void add_entry_to_list(why_dir_t *dir, why_dirent_entry_t *entry) {
-    entry->next  = dir->entries;
-    dir->entries = entry;
-    dir->entry_count++;
-}
-
-static bool read_directory_location(char const *resolved_path, why_dir_t *merged_dir, seen_names_t seen) {
-    path_t parsed_path;
-    int    res = parse_path(resolved_path, &parsed_path);
-
-    if (res != 0) {
-        return false;
-    }
-
-    device_t *device = device_get(parsed_path.device);
-    if (!device || device->type != DEVICE_TYPE_FILESYSTEM) {
-        path_free(&parsed_path);
-        return false;
-    }
-
-    filesystem_device_t *fs_device = (filesystem_device_t *)device;
-    if (!fs_device->_opendir || !fs_device->_readdir || !fs_device->_closedir) {
-        path_free(&parsed_path);
-        return false;
-    }
-
-    DIR *device_dir = fs_device->_opendir(fs_device, &parsed_path);
-    if (!device_dir) {
-        path_free(&parsed_path);
-        return false;
-    }
-
-    struct dirent *entry;
-    while ((entry = fs_device->_readdir(fs_device, device_dir)) != NULL) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
-        }
-
-        if (seen_names_add(seen, entry->d_name)) {
-            why_dirent_entry_t *new_entry = create_dirent_entry(entry, entry->d_name);
-            if (new_entry) {
-                add_entry_to_list(merged_dir, new_entry);
-            }
-        }
-    }
-
-    fs_device->_closedir(fs_device, device_dir);
-    path_free(&parsed_path);
-
-    return true;
-}
-
 DIR *why_opendir(char const *name) {
     task_info_t *task_info = get_task_info();
     ESP_LOGI("why_opendir", "Calling opendir from task %p for path %s", task_info->handle, name);
@@ -475,60 +443,15 @@ DIR *why_opendir(char const *name) {
         return NULL;
     }
 
-    why_dir_t *merged_dir = why_malloc(sizeof(why_dir_t));
-    if (!merged_dir) {
-        task_info->_errno = ENOMEM;
-        return NULL;
-    }
-
-    merged_dir->original_badgevms_path = why_strdup(name);
-    merged_dir->entries                = NULL;
-    merged_dir->current                = NULL;
-    merged_dir->entry_count            = 0;
-
-    if (!merged_dir->original_badgevms_path) {
-        why_free(merged_dir);
-        task_info->_errno = ENOMEM;
+    int           err;
+    dir_stream_t *stream = dir_stream_open(name, &err);
+    if (!stream) {
+        task_info->_errno = err;
         return NULL;
     }
 
-    seen_names_t seen;
-    seen_names_init(&seen);
-
-    logical_name_result_t lname               = logical_name_resolve_const(name, 0);
-    size_t                result_count        = lname.result_count;
-    bool                  found_any_directory = false;
-
-    ESP_LOGI("why_opendir", "Reading directory %s from %zi locations", name, result_count);
-    for (int i = 0; i < result_count; ++i) {
-        ESP_LOGI("why_opendir", "Trying location: %s", lname.result);
-
-        if (read_directory_location(lname.result, merged_dir, seen)) {
-            ESP_LOGI("why_opendir", "Successfully read entries from %s", lname.result);
-            found_any_directory = true;
-        }
-
-        logical_name_result_free(lname);
-        ESP_LOGI("why_opendir", "Resolving at index %i", i + 1);
-        lname = logical_name_resolve_const(name, i + 1);
-    }
-
-    logical_name_result_free(lname);
-    seen_names_cleanup(seen);
-
-    if (!found_any_directory) {
-        ESP_LOGI("why_opendir", "No readable directories found for %s", name);
-        why_free(merged_dir->original_badgevms_path);
-        why_free(merged_dir);
-        task_info->_errno = ENOENT;
-        return NULL;
-    }
-
-    merged_dir->current = merged_dir->entries;
-
-    ESP_LOGI("why_opendir", "Successfully opened merged directory %s with %zi entries", name, merged_dir->entry_count);
-
-    return (DIR *)merged_dir;
+    task_record_resource_alloc(RES_DIR, stream);
+    return (DIR *)stream;
 }
 
 struct dirent *why_readdir(DIR *dirp) {
@@ -537,16 +460,7 @@ struct dirent *why_readdir(DIR *dirp) {
         return NULL;
     }
 
-    why_dir_t *merged_dir = (why_dir_t *)dirp;
-
-    if (!merged_dir->current) {
-        return NULL;
-    }
-
-    why_dirent_entry_t *current_entry = merged_dir->current;
-    merged_dir->current               = current_entry->next;
-
-    return &current_entry->dirent;
+    return dir_stream_read((dir_stream_t *)dirp);
 }
 
 int why_closedir(DIR *dirp) {
@@ -558,30 +472,36 @@ int why_closedir(DIR *dirp) {
         return -1;
     }
 
-    why_dir_t *merged_dir = (why_dir_t *)dirp;
+    task_record_resource_free(RES_DIR, dirp);
+    dir_stream_close((dir_stream_t *)dirp);
+    return 0;
+}
 
-    why_dirent_entry_t *current = merged_dir->entries;
-    while (current) {
-        why_dirent_entry_t *next = current->next;
-        free_dirent_entry(current);
-        current = next;
+void why_rewinddir(DIR *dirp) {
+    if (!dirp) {
+        get_task_info()->_errno = EBADF;
+        return;
     }
 
-    why_free(merged_dir->original_badgevms_path);
-    why_free(merged_dir);
+    dir_stream_rewind((dir_stream_t *)dirp);
 
-    return 0;
+    get_task_info()->_errno = 0;
 }
 
-void why_rewinddir(DIR *dirp) {
+long why_telldir(DIR *dirp) {
     if (!dirp) {
         get_task_info()->_errno = EBADF;
-        return;
+        return -1;
     }
 
-    why_dir_t *merged_dir = (why_dir_t *)dirp;
+    return dir_stream_tell((dir_stream_t *)dirp);
+}
 
-    merged_dir->current = merged_dir->entries;
+void why_seekdir(DIR *dirp, long loc) {
+    if (!dirp) {
+        get_task_info()->_errno = EBADF;
+        return;
+    }
 
-    get_task_info()->_errno = 0;
+    dir_stream_seek((dir_stream_t *)dirp, loc);
 }
@@ -18,13 +18,16 @@
 #include "esp_flash.h"
 #include "esp_log.h"
 #include "esp_mac.h"
+#include "io_service.h"
 #include "logical_names.h"
 #include "lwip/ip4_addr.h"
 #include "lwip/netdb.h"
 #include "lwip/sockets.h"
 #include "rom/uart.h"
+#include "stat_cache.h"
 #include "task.h"
 #include "thirdparty/dlmalloc.h"
+#include "wait_queue.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -34,8 +37,11 @@
 #include <iconv.h>
 #include <math.h>
 #include <regex.h>
+#include <stdarg.h>
 #include <string.h>
 #include <sys/errno.h>
+#include <sys/poll.h>
+#include <sys/select.h>
 #include <sys/types.h>
 #include <time.h>
 #include <wchar.h>
@@ -297,13 +303,26 @@ ssize_t why_write(int fd, void const *buf, size_t count) {
 
     task_info_t *task_info = get_task_info();
     ESP_LOGD("why_write", "Calling write from task %p fd = %i count = %zi", task_info->handle, fd, count);
+    device_t *device = task_info->thread->file_handles[fd].device;
+    if (device->type == DEVICE_TYPE_FILESYSTEM && task_info->pid && io_service_running()) {
+        ssize_t ret =
+            io_service_transfer(IO_OP_WRITE, device, task_info->thread->file_handles[fd].dev_fd, (void *)buf, count);
+        stat_cache_invalidate_hash(task_info->thread->file_handles[fd].stat_hash);
+        return ret;
+    }
+
     if (task_info->thread->file_handles[fd].device->_write) {
-        return task_info->thread->file_handles[fd].device->_write(
+        ssize_t ret = task_info->thread->file_handles[fd].device->_write(
             task_info->thread->file_handles[fd].device,
             task_info->thread->file_handles[fd].dev_fd,
             buf,
             count
         );
+        if (ret < 0) {
+            task_info->_errno = errno;
+        }
+        stat_cache_invalidate_hash(task_info->thread->file_handles[fd].stat_hash);
+        return ret;
     } else {
         ESP_LOGE("why_write", "fd %i has no valid write function", fd);
     }
@@ -319,6 +338,11 @@ ssize_t why_read(int fd, void *buf, size_t count) {
 
     task_info_t *task_info = get_task_info();
     ESP_LOGI("why_read", "Calling read from task %p fd = %i count = %zi", task_info->handle, fd, count);
+    device_t *device = task_info->thread->file_handles[fd].device;
+    if (device->type == DEVICE_TYPE_FILESYSTEM && task_info->pid && io_service_running()) {
+        return io_service_transfer(IO_OP_READ, device, task_info->thread->file_handles[fd].dev_fd, buf, count);
+    }
+
     if (task_info->thread->file_handles[fd].device->_read) {
         ESP_LOGD(
             "why_read",
@@ -328,12 +352,16 @@ ssize_t why_read(int fd, void *buf, size_t count) {
             buf,
             count
         );
-        return task_info->thread->file_handles[fd].device->_read(
+        ssize_t ret = task_info->thread->file_handles[fd].device->_read(
             task_info->thread->file_handles[fd].device,
             task_info->thread->file_handles[fd].dev_fd,
             buf,
             count
         );
+        if (ret < 0) {
+            task_info->_errno = errno;
+        }
+        return ret;
     } else {
         ESP_LOGE("why_read", "fd %i has no valid read function", fd);
     }
@@ -357,10 +385,13 @@ off_t why_lseek(int fd, off_t offset, int whence) {
     return 0;
 }
 
-static int _why_open(char const *pathname, int flags, mode_t mode, device_t **device) {
-    int    dev_fd = -1;
-    path_t parsed_path;
-    int    res = parse_path(pathname, &parsed_path);
+static int _why_open(char const *pathname, int flags, mode_t mode, device_t **device, uint32_t *stat_hash) {
+    int              dev_fd = -1;
+    path_t           parsed_path;
+    stat_cache_key_t key = {0};
+    bool             exists;
+    bool             writing = (flags & O_ACCMODE) != O_RDONLY || (flags & (O_CREAT | O_TRUNC));
+    int              res     = parse_path(pathname, &parsed_path);
 
     if (res) {
         goto out;
@@ -371,163 +402,285 @@ static int _why_open(char const *pathname, int flags, mode_t mode, device_t **de
         goto out;
     }
 
-    dev_fd = (*device)->_open(device, &parsed_path, flags, mode);
+    bool filesystem = (*device)->type == DEVICE_TYPE_FILESYSTEM;
+    if (filesystem && !(flags & O_CREAT)) {
+        // Search lists get probed for the same missing files over and over
+        stat_cache_key(&parsed_path, &key);
+        if (stat_cache_lookup(&key, NULL, &exists) && !exists) {
+            errno = ENOENT;
+            goto out;
+        }
+    }
+
+    dev_fd = (*device)->_open(*device, &parsed_path, flags, mode);
     if (dev_fd < 0) {
+        if (filesystem && !(flags & O_CREAT) && errno == ENOENT) {
+            stat_cache_store(&key, NULL);
+        }
         goto out;
     }
 
+    *stat_hash = 0;
+    if (filesystem && writing) {
+        stat_cache_invalidate(&parsed_path);
+        *stat_hash = stat_cache_hash(&parsed_path);
+    }
+
 out:
     path_free(&parsed_path);
     return dev_fd;
 }
 
+static int _why_task_add_socket(task_info_t *task_info, device_t *dev, int dev_fd) {
+    for (int i = 0; i < MAXFD; ++i) {
+        if (task_info->thread->file_handles[i].is_open == false) {
+            task_info->thread->file_handles[i].is_open = true;
+            task_info->thread->file_handles[i].dev_fd  = dev_fd;
+            task_info->thread->file_handles[i].device  = dev;
+            return i;
+        }
+    }
+
+    ESP_LOGE("why_socket", "No free file handles available for socket %i", dev_fd);
+    dev->_close(dev, dev_fd);
+    task_info->_errno = EMFILE;
+    return -1;
+}
+
 int why_socket(int domain, int type, int protocol) {
     task_info_t *task_info = get_task_info();
     ESP_LOGW("why_socket", "Calling socket from task %p", task_info->handle);
 
-    if (domain != AF_INET || type != SOCK_STREAM || protocol != 0) {
-        task_info->_errno = EAFNOSUPPORT;
+    socket_device_t *dev = (socket_device_t *)device_get("SOCKET0");
+    if (!dev || dev->device.type != DEVICE_TYPE_SOCKET || !dev->_socket) {
+        task_info->_errno = ENODEV;
         return -1;
     }
 
-    device_t *dev = device_get("SOCKET0");
-    if (!dev) {
-        task_info->_errno = ENODEV;
+    int dev_fd = dev->_socket(dev, domain, type, protocol);
+    if (dev_fd < 0) {
+        task_info->_errno = errno;
         return -1;
     }
 
-    int fd = -1;
+    int fd = _why_task_add_socket(task_info, &dev->device, dev_fd);
+    ESP_LOGW("why_socket", "Got device specific fd %i for task fd %i", dev_fd, fd);
+    return fd;
+}
 
-    for (int i = 0; i < MAXFD; ++i) {
-        if (task_info->thread->file_handles[i].is_open == false) {
-            fd = i;
-            break;
-        }
+static inline socket_device_t *_why_task_get_socket(int fd, int *sock) {
+    task_info_t *task_info = get_task_info();
+    ESP_LOGD("why_open_socket", "Calling open socket from task %p fd %i", task_info->handle, fd);
+
+    if (fd < 0 || fd >= MAXFD || !task_info->thread->file_handles[fd].is_open) {
+        task_info->_errno = EBADF;
+        return NULL;
     }
 
-    if (fd == -1) {
-        task_info->_errno = ENOMEM;
+    if (!task_info->thread->file_handles[fd].device ||
+        task_info->thread->file_handles[fd].device->type != DEVICE_TYPE_SOCKET) {
+        task_info->_errno = ENOTSOCK;
+        return NULL;
+    }
+
+    *sock = task_info->thread->file_handles[fd].dev_fd;
+    return (socket_device_t *)task_info->thread->file_handles[fd].device;
+}
+
+// Socket calls that fail leave errno in the kernel's copy, the application reads the task's
+static inline int _why_socket_result(int ret) {
+    if (ret < 0) {
+        get_task_info()->_errno = errno;
+    }
+    return ret;
+}
+
+int why_listen(int sockfd, int backlog) {
+    int              sock;
+    socket_device_t *dev = _why_task_get_socket(sockfd, &sock);
+    if (!dev) {
         return -1;
     }
 
+    return _why_socket_result(dev->_listen(dev, sock, backlog));
+}
 
-    int dev_fd = socket(domain, type, protocol);
-    if (dev_fd < 0) {
-        task_info->_errno = ENOMEM;
+int why_connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
+    int              sock;
+    socket_device_t *dev = _why_task_get_socket(sockfd, &sock);
+    if (!dev) {
         return -1;
     }
 
-    ESP_LOGW("why_socket", "Got device specific fd %i for task fd %i", dev_fd, fd);
-    task_info->thread->file_handles[fd].is_open = true;
-    task_info->thread->file_handles[fd].dev_fd  = dev_fd;
-    task_info->thread->file_handles[fd].device  = dev;
+    if (addr && addr->sa_family == AF_INET) {
+        struct sockaddr_in *addr_in = (struct sockaddr_in *)addr;
+        ESP_LOGI("why_connect", "Connecting to %s:%d", inet_ntoa(addr_in->sin_addr), ntohs(addr_in->sin_port));
+    }
+    return _why_socket_result(dev->_connect(dev, sock, addr, addrlen));
+}
+
+int why_accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen) {
+    int              sock;
+    socket_device_t *dev = _why_task_get_socket(sockfd, &sock);
+    if (!dev) {
+        return -1;
+    }
+
+    ESP_LOGW("why_accept", "Accepting connection on socket %i", sockfd);
+    int newfd = _why_socket_result(dev->_accept(dev, sock, addr, addrlen));
+    if (newfd < 0) {
+        return -1;
+    }
 
+    int fd = _why_task_add_socket(get_task_info(), &dev->device, newfd);
+    ESP_LOGW("why_accept", "Assigned new fd %i to accepted socket %i", fd, newfd);
     return fd;
 }
 
-static inline int _why_task_get_socket(int fd) {
-    task_info_t *task_info = get_task_info();
-    ESP_LOGW("why_open_socket", "Calling open socket from task %p fd %i", task_info->handle, fd);
-
-    if (fd < 0 || fd >= MAXFD || !task_info->thread->file_handles[fd].is_open) {
-        task_info->_errno = EBADF;
+int why_bind(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
+    int              sock;
+    socket_device_t *dev = _why_task_get_socket(sockfd, &sock);
+    if (!dev) {
         return -1;
     }
 
-    if (!task_info->thread->file_handles[fd].device ||
-        task_info->thread->file_handles[fd].device->type != DEVICE_TYPE_SOCKET) {
-        task_info->_errno = ENOTSOCK;
+    if (addr && addr->sa_family == AF_INET) {
+        struct sockaddr_in *addr_in = (struct sockaddr_in *)addr;
+        ESP_LOGI("why_bind", "Binding to %s:%d", inet_ntoa(addr_in->sin_addr), ntohs(addr_in->sin_port));
+    }
+    return _why_socket_result(dev->_bind(dev, sock, addr, addrlen));
+}
+
+int why_shutdown(int sockfd, int how) {
+    int              sock;
+    socket_device_t *dev = _why_task_get_socket(sockfd, &sock);
+    if (!dev) {
         return -1;
     }
 
-    return task_info->thread->file_handles[fd].dev_fd;
+    return _why_socket_result(dev->_shutdown(dev, sock, how));
 }
 
-int why_listen(int sockfd, int backlog) {
-    int sock = _why_task_get_socket(sockfd);
+int why_getsockname(int sockfd, struct sockaddr *addr, socklen_t *addrlen) {
+    int              sock;
+    socket_device_t *dev = _why_task_get_socket(sockfd, &sock);
+    if (!dev) {
+        return -1;
+    }
 
-    if (sock < 0) {
-        get_task_info()->_errno = EBADF;
+    return _why_socket_result(dev->_getsockname(dev, sock, addr, addrlen));
+}
+
+int why_getpeername(int sockfd, struct sockaddr *addr, socklen_t *addrlen) {
+    int              sock;
+    socket_device_t *dev = _why_task_get_socket(sockfd, &sock);
+    if (!dev) {
         return -1;
     }
 
-    return listen(sock, backlog);
+    return _why_socket_result(dev->_getpeername(dev, sock, addr, addrlen));
 }
 
+ssize_t why_sendto(
+    int sockfd, void const *buf, size_t len, int flags, struct sockaddr const *dest_addr, socklen_t addrlen
+) {
+    int              sock;
+    socket_device_t *dev = _why_task_get_socket(sockfd, &sock);
+    if (!dev) {
+        return -1;
+    }
+
+    return _why_socket_result(dev->_sendto(dev, sock, buf, len, flags, dest_addr, addrlen));
+}
 
-int why_connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
-    int sock = _why_task_get_socket(sockfd);
+ssize_t why_send(int sockfd, void const *buf, size_t len, int flags) {
+    return why_sendto(sockfd, buf, len, flags, NULL, 0);
+}
 
-    if (sock < 0) {
-        get_task_info()->_errno = EBADF;
+ssize_t why_recvfrom(int sockfd, void *buf, size_t len, int flags, struct sockaddr *src_addr, socklen_t *addrlen) {
+    int              sock;
+    socket_device_t *dev = _why_task_get_socket(sockfd, &sock);
+    if (!dev) {
         return -1;
     }
 
-    if (addr->sa_family != AF_INET) {
-        get_task_info()->_errno = EAFNOSUPPORT;
+    return _why_socket_result(dev->_recvfrom(dev, sock, buf, len, flags, src_addr, addrlen));
+}
+
+ssize_t why_recv(int sockfd, void *buf, size_t len, int flags) {
+    return why_recvfrom(sockfd, buf, len, flags, NULL, NULL);
+}
+
+ssize_t why_sendmsg(int sockfd, struct msghdr const *msg, int flags) {
+    int              sock;
+    socket_device_t *dev = _why_task_get_socket(sockfd, &sock);
+    if (!dev) {
         return -1;
     }
 
-    struct sockaddr_in *addr_in = (struct sockaddr_in *)addr;
-    ESP_LOGI("why_connect", "Connecting to %s:%d", inet_ntoa(addr_in->sin_addr), ntohs(addr_in->sin_port));
-    return connect(sock, (struct sockaddr *)addr_in, addrlen);
+    return _why_socket_result(dev->_sendmsg(dev, sock, msg, flags));
 }
 
-int why_accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen) {
-    int sock = _why_task_get_socket(sockfd);
-    if (sock < 0) {
-        get_task_info()->_errno = EBADF;
+ssize_t why_recvmsg(int sockfd, struct msghdr *msg, int flags) {
+    int              sock;
+    socket_device_t *dev = _why_task_get_socket(sockfd, &sock);
+    if (!dev) {
         return -1;
     }
-    ESP_LOGW("why_accept", "Accepting connection on socket %i", sockfd);
-    int newfd = accept(sock, addr, addrlen);
 
-    if (newfd < 0) {
-        get_task_info()->_errno = errno;
+    return _why_socket_result(dev->_recvmsg(dev, sock, msg, flags));
+}
+
+int why_setsockopt(int sockfd, int level, int optname, void const *optval, socklen_t optlen) {
+    int              sock;
+    socket_device_t *dev = _why_task_get_socket(sockfd, &sock);
+    if (!dev) {
         return -1;
     }
 
-    task_info_t *task_info = get_task_info();
-    ESP_LOGW("why_accept", "Accepted connection on socket %i, new fd %i", sockfd, newfd);
-    for (int i = 0; i < MAXFD; ++i) {
-        if (task_info->thread->file_handles[i].is_open == false) {
-            task_info->thread->file_handles[i].is_open = true;
-            task_info->thread->file_handles[i].dev_fd  = newfd;
-            task_info->thread->file_handles[i].device  = task_info->thread->file_handles[sockfd].device;
-            ESP_LOGW("why_accept", "Assigned new fd %i to accepted socket %i", i, newfd);
-            return i;
-        }
+    return _why_socket_result(dev->_setsockopt(dev, sock, level, optname, optval, optlen));
+}
+
+int why_getsockopt(int sockfd, int level, int optname, void *optval, socklen_t *optlen) {
+    int              sock;
+    socket_device_t *dev = _why_task_get_socket(sockfd, &sock);
+    if (!dev) {
+        return -1;
     }
 
-    ESP_LOGE("why_accept", "No free file handles available for new socket %i", newfd);
-    get_task_info()->_errno = EMFILE;
-    close(newfd);
-    return -1;
+    return _why_socket_result(dev->_getsockopt(dev, sock, level, optname, optval, optlen));
 }
 
-int why_bind(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
-    int sock = _why_task_get_socket(sockfd);
-    if (sock < 0) {
-        get_task_info()->_errno = EBADF;
+// Only sockets have flags worth changing, O_NONBLOCK through F_SETFL
+int why_fcntl(int fd, int cmd, ...) {
+    task_info_t *task_info = get_task_info();
+
+    if (fd < 0 || fd >= MAXFD || !task_info->thread->file_handles[fd].is_open) {
+        task_info->_errno = EBADF;
         return -1;
     }
 
-    if (addr->sa_family != AF_INET) {
-        get_task_info()->_errno = EAFNOSUPPORT;
+    socket_device_t *dev = (socket_device_t *)task_info->thread->file_handles[fd].device;
+    if (!dev || dev->device.type != DEVICE_TYPE_SOCKET || !dev->_fcntl) {
+        task_info->_errno = EINVAL;
         return -1;
     }
 
-    struct sockaddr_in *addr_in = (struct sockaddr_in *)addr;
-    ESP_LOGI("why_bind", "Binding to %s:%d", inet_ntoa(addr_in->sin_addr), ntohs(addr_in->sin_port));
-    return bind(sock, (struct sockaddr *)addr_in, addrlen);
+    va_list ap;
+    va_start(ap, cmd);
+    int arg = cmd == F_SETFL ? va_arg(ap, int) : 0;
+    va_end(ap);
+
+    return _why_socket_result(dev->_fcntl(dev, task_info->thread->file_handles[fd].dev_fd, cmd, arg));
 }
 
 int why_open(char const *pathname, int flags, mode_t mode) {
     task_info_t *task_info = get_task_info();
     ESP_LOGI("why_open", "Calling open from task %p for path %s", task_info->handle, pathname);
 
-    int       fd     = -1;
-    int       dev_fd = -1;
+    int       fd        = -1;
+    int       dev_fd    = -1;
+    uint32_t  stat_hash = 0;
     device_t *device;
 
     logical_name_result_t lname        = logical_name_resolve_const(pathname, 0);
@@ -536,7 +689,7 @@ int why_open(char const *pathname, int flags, mode_t mode) {
     ESP_LOGI("why_open", "Finding file %s, %zi options\n", pathname, result_count);
     for (int i = 0; i < result_count; ++i) {
         ESP_LOGI("why_open", "Trying location: %s\n", lname.result);
-        dev_fd = _why_open(lname.result, flags, mode, &device);
+        dev_fd = _why_open(lname.result, flags, mode, &device, &stat_hash);
         if (dev_fd >= 0) {
             ESP_LOGI("why_open", "Found file at %s\n", lname.result);
             break;
@@ -566,9 +719,10 @@ int why_open(char const *pathname, int flags, mode_t mode) {
 
     ESP_LOGD("why_open", "Got device specific fd %i for task fd %i", dev_fd, fd);
 
-    task_info->thread->file_handles[fd].is_open = true;
-    task_info->thread->file_handles[fd].dev_fd  = dev_fd;
-    task_info->thread->file_handles[fd].device  = device;
+    task_info->thread->file_handles[fd].is_open   = true;
+    task_info->thread->file_handles[fd].dev_fd    = dev_fd;
+    task_info->thread->file_handles[fd].device    = device;
+    task_info->thread->file_handles[fd].stat_hash = stat_hash;
 
 out:
     ESP_LOGI("why_open", "Calling open from task %p for path %s returning %i", task_info->handle, pathname, fd);
@@ -588,6 +742,7 @@ int why_close(int fd) {
             task_info->thread->file_handles[fd].device,
             task_info->thread->file_handles[fd].dev_fd
         );
+        stat_cache_invalidate_hash(task_info->thread->file_handles[fd].stat_hash);
         memset(&task_info->thread->file_handles[fd], 0, sizeof(file_handle_t));
         return ret;
     } else {
@@ -599,6 +754,117 @@ out:
     return -1;
 }
 
+static poll_entry_t poll_entry_for(task_info_t *task_info, int fd, short events) {
+    poll_entry_t entry = {.events = events};
+
+    if (fd < MAXFD && task_info->thread->file_handles[fd].is_open) {
+        entry.device = task_info->thread->file_handles[fd].device;
+        entry.dev_fd = task_info->thread->file_handles[fd].dev_fd;
+    }
+    return entry;
+}
+
+int why_poll(struct pollfd *fds, nfds_t nfds, int timeout) {
+    task_info_t *task_info = get_task_info();
+
+    if (nfds > MAXFD) {
+        task_info->_errno = EINVAL;
+        return -1;
+    }
+
+    if (!task_info->poll_waiter) {
+        task_info->poll_waiter = poll_waiter_create();
+        if (!task_info->poll_waiter) {
+            task_info->_errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    poll_entry_t entries[nfds ? nfds : 1];
+    nfds_t       index[nfds ? nfds : 1];
+    size_t       count = 0;
+
+    for (nfds_t i = 0; i < nfds; ++i) {
+        fds[i].revents = 0;
+        if (fds[i].fd < 0) {
+            continue;
+        }
+        entries[count] = poll_entry_for(task_info, fds[i].fd, fds[i].events);
+        index[count++] = i;
+    }
+
+    int ready = poll_entries(task_info->poll_waiter, entries, count, timeout);
+    for (size_t i = 0; i < count; ++i) {
+        fds[index[i]].revents = entries[i].revents;
+    }
+    return ready;
+}
+
+int why_select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, struct timeval *timeout) {
+    task_info_t *task_info = get_task_info();
+
+    if (nfds < 0 || nfds > FD_SETSIZE) {
+        task_info->_errno = EINVAL;
+        return -1;
+    }
+
+    struct pollfd fds[nfds ? nfds : 1];
+    nfds_t        count = 0;
+
+    for (int fd = 0; fd < nfds; ++fd) {
+        short events = 0;
+        if (readfds && FD_ISSET(fd, readfds))
+            events |= POLLIN;
+        if (writefds && FD_ISSET(fd, writefds))
+            events |= POLLOUT;
+        if (exceptfds && FD_ISSET(fd, exceptfds))
+            events |= POLLPRI;
+        if (events) {
+            fds[count++] = (struct pollfd){.fd = fd, .events = events};
+        }
+    }
+
+    int timeout_ms = -1;
+    if (timeout) {
+        timeout_ms = timeout->tv_sec * 1000 + (timeout->tv_usec + 999) / 1000;
+    }
+
+    if (why_poll(fds, count, timeout_ms) < 0) {
+        return -1;
+    }
+
+    for (nfds_t i = 0; i < count; ++i) {
+        if (fds[i].revents & POLLNVAL) {
+            task_info->_errno = EBADF;
+            return -1;
+        }
+    }
+
+    if (readfds)
+        FD_ZERO(readfds);
+    if (writefds)
+        FD_ZERO(writefds);
+    if (exceptfds)
+        FD_ZERO(exceptfds);
+
+    int ready = 0;
+    for (nfds_t i = 0; i < count; ++i) {
+        if ((fds[i].events & POLLIN) && (fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+            FD_SET(fds[i].fd, readfds);
+            ++ready;
+        }
+        if ((fds[i].events & POLLOUT) && (fds[i].revents & (POLLOUT | POLLERR))) {
+            FD_SET(fds[i].fd, writefds);
+            ++ready;
+        }
+        if ((fds[i].events & POLLPRI) && (fds[i].revents & POLLPRI)) {
+            FD_SET(fds[i].fd, exceptfds);
+            ++ready;
+        }
+    }
+    return ready;
+}
+
 pid_t why_getpid(void) {
     task_info_t *task_info = get_task_info();
     return task_info->pid;
@@ -626,6 +892,8 @@ void why_abort(void) {
 
 #undef inet_ntoa
 #undef inet_aton
+#undef inet_ntop
+#undef inet_pton
 char *inet_ntoa(struct in_addr __in) {
     return ip4addr_ntoa((ip4_addr_t const *)&(__in));
 }
@@ -634,6 +902,14 @@ int inet_aton(char const *__cp, struct in_addr *__inp) {
     return ip4addr_aton(__cp, (ip4_addr_t *)__inp);
 }
 
+char const *inet_ntop(int af, void const *src, char *dst, socklen_t size) {
+    return lwip_inet_ntop(af, src, dst, size);
+}
+
+int inet_pton(int af, char const *src, void *dst) {
+    return lwip_inet_pton(af, src, dst);
+}
+
 char const *get_mac_address() {
     static char mac_address_string[18] = {0};
     uint8_t     mac[6];
@@ -21,6 +21,7 @@
 #include <fcntl.h>
 #include <errno.h>
 
+#include "badgevms/dns_service.h"
 #include "badgevms/task.h"
 
 #if CONFIG_IDF_TARGET_LINUX && !ESP_TLS_WITH_LWIP
@@ -196,24 +197,47 @@ esp_tls_t *esp_tls_init(void)
     return tls;
 }
 
-static esp_err_t esp_tls_hostname_to_fd(const char *host, size_t hostlen, int port, esp_tls_addr_family_t addr_family, struct sockaddr_storage *address, int* fd)
+static esp_err_t esp_tls_dns_address_to_fd(const dns_address_t *entry, int port, struct sockaddr_storage *address, int *fd)
 {
-    struct addrinfo *address_info;
-    struct addrinfo hints;
-    memset(&hints, 0, sizeof(hints));
+    *fd = socket(entry->family, SOCK_STREAM, IPPROTO_TCP);
+    if (*fd < 0) {
+        ESP_LOGE(TAG, "Failed to create socket (family %d)", entry->family);
+        return ESP_ERR_ESP_TLS_CANNOT_CREATE_SOCKET;
+    }
+
+    memset(address, 0, sizeof(struct sockaddr_storage));
+    if (entry->family == AF_INET) {
+        struct sockaddr_in *p = (struct sockaddr_in *)address;
+        p->sin_family = AF_INET;
+        p->sin_port = htons(port);
+        memcpy(&p->sin_addr, entry->addr, sizeof(p->sin_addr));
+    } else {
+        struct sockaddr_in6 *p = (struct sockaddr_in6 *)address;
+        p->sin6_family = AF_INET6;
+        p->sin6_port = htons(port);
+        memcpy(&p->sin6_addr, entry->addr, sizeof(p->sin6_addr));
+    }
+    return ESP_OK;
+}
 
+static int esp_tls_addr_family_to_af(esp_tls_addr_family_t addr_family)
+{
     switch (addr_family) {
         case ESP_TLS_AF_INET:
-            hints.ai_family = AF_INET;
-            break;
+            return AF_INET;
         case ESP_TLS_AF_INET6:
-            hints.ai_family = AF_INET6;
-            break;
+            return AF_INET6;
         default:
-            hints.ai_family = AF_UNSPEC;
-            break;
+            return AF_UNSPEC;
     }
+}
 
+static esp_err_t esp_tls_hostname_to_fd(const char *host, size_t hostlen, int port, esp_tls_addr_family_t addr_family, struct sockaddr_storage *address, int* fd)
+{
+    struct addrinfo *address_info;
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = esp_tls_addr_family_to_af(addr_family);
     hints.ai_socktype = SOCK_STREAM;
 
     char *use_host = strndup(host, hostlen);
@@ -365,17 +389,10 @@ static esp_err_t esp_tls_set_socket_non_blocking(int fd, bool non_blocking)
     return ESP_OK;
 }
 
-static inline esp_err_t tcp_connect(const char *host, int hostlen, int port, const esp_tls_cfg_t *cfg, esp_tls_error_handle_t error_handle, int *sockfd)
+/* Connects fd to address, closes fd if that fails */
+static esp_err_t tcp_connect_fd(int fd, const struct sockaddr_storage *address, const char *host, int port, const esp_tls_cfg_t *cfg, esp_tls_error_handle_t error_handle, int *sockfd)
 {
-    struct sockaddr_storage address;
-    int fd;
-
-    esp_tls_addr_family_t addr_family = (cfg != NULL) ? cfg->addr_family : ESP_TLS_AF_UNSPEC;
-    esp_err_t ret = esp_tls_hostname_to_fd(host, hostlen, port, addr_family, &address, &fd);
-    if (ret != ESP_OK) {
-        ESP_INT_EVENT_TRACKER_CAPTURE(error_handle, ESP_TLS_ERR_TYPE_SYSTEM, errno);
-        return ret;
-    }
+    esp_err_t ret;
 
     // Set timeout options, keep-alive options and bind device options if configured
     ret = esp_tls_set_socket_options(fd, cfg);
@@ -392,14 +409,14 @@ static inline esp_err_t tcp_connect(const char *host, int hostlen, int port, con
     ret = ESP_ERR_ESP_TLS_FAILED_CONNECT_TO_HOST;
     ESP_LOGD(TAG, "[sock=%d] Connecting to server. HOST: %s, Port: %d", fd, host, port);
 #if IPV4_ENABLED && IPV6_ENABLED
-    socklen_t addr_len = (address.ss_family == AF_INET) ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+    socklen_t addr_len = (address->ss_family == AF_INET) ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
 #elif IPV6_ENABLED
     socklen_t addr_len = sizeof(struct sockaddr_in6);
 #else
     /* IPv4 only */
     socklen_t addr_len = sizeof(struct sockaddr_in);
 #endif
-    if (connect(fd, (struct sockaddr *)&address, addr_len) < 0) {
+    if (connect(fd, (const struct sockaddr *)address, addr_len) < 0) {
         if (errno == EINPROGRESS) {
             fd_set fdset;
             struct timeval tv = { .tv_usec = 0, .tv_sec = ESP_TLS_DEFAULT_CONN_TIMEOUT }; // Default connection timeout is 10 s
@@ -463,6 +480,64 @@ err:
     return ret;
 }
 
+/* Resolves through the DNS cache shared by all processes, which already has the answer when a non-blocking connect
+ * waited for the lookup first. The addresses are tried in turn, IPv6 and IPv4 taking turns as the cache gives them,
+ * until one of them connects. A non-blocking connect only gets as far as the first one that starts connecting. */
+static esp_err_t tcp_connect_dns_service(const char *host, int hostlen, int port, const esp_tls_cfg_t *cfg, esp_tls_error_handle_t error_handle, int *sockfd)
+{
+    char *use_host = strndup(host, hostlen);
+    if (!use_host) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    dns_result_t result;
+    esp_tls_addr_family_t addr_family = (cfg != NULL) ? cfg->addr_family : ESP_TLS_AF_UNSPEC;
+    if (dns_service_resolve(use_host, esp_tls_addr_family_to_af(addr_family), -1, &result) != DNS_STATUS_OK) {
+        ESP_LOGE(TAG, "couldn't get hostname for :%s: dns status %d", use_host, result.status);
+        ESP_INT_EVENT_TRACKER_CAPTURE(error_handle, ESP_TLS_ERR_TYPE_SYSTEM, errno);
+        free(use_host);
+        return ESP_ERR_ESP_TLS_CANNOT_RESOLVE_HOSTNAME;
+    }
+    free(use_host);
+
+    esp_err_t ret = ESP_ERR_ESP_TLS_CANNOT_RESOLVE_HOSTNAME;
+    for (size_t i = 0; i < result.count; i++) {
+        struct sockaddr_storage address;
+        int fd;
+
+        ret = esp_tls_dns_address_to_fd(&result.addresses[i], port, &address, &fd);
+        if (ret == ESP_OK) {
+            ret = tcp_connect_fd(fd, &address, host, port, cfg, error_handle, sockfd);
+        }
+        if (ret == ESP_OK) {
+            return ESP_OK;
+        }
+        if (i + 1 < result.count) {
+            ESP_LOGD(TAG, "Connecting to address %u of %s failed, trying the next one", (unsigned)i, host);
+        }
+    }
+    return ret;
+}
+
+static inline esp_err_t tcp_connect(const char *host, int hostlen, int port, const esp_tls_cfg_t *cfg, esp_tls_error_handle_t error_handle, int *sockfd)
+{
+    struct sockaddr_storage address;
+    int fd;
+
+    if (dns_service_running()) {
+        return tcp_connect_dns_service(host, hostlen, port, cfg, error_handle, sockfd);
+    }
+
+    esp_tls_addr_family_t addr_family = (cfg != NULL) ? cfg->addr_family : ESP_TLS_AF_UNSPEC;
+    esp_err_t ret = esp_tls_hostname_to_fd(host, hostlen, port, addr_family, &address, &fd);
+    if (ret != ESP_OK) {
+        ESP_INT_EVENT_TRACKER_CAPTURE(error_handle, ESP_TLS_ERR_TYPE_SYSTEM, errno);
+        return ret;
+    }
+
+    return tcp_connect_fd(fd, &address, host, port, cfg, error_handle, sockfd);
+}
+
 static int esp_tls_low_level_conn(const char *hostname, int hostlen, int port, const esp_tls_cfg_t *cfg, esp_tls_t *tls)
 {
 
@@ -486,16 +561,15 @@ static int esp_tls_low_level_conn(const char *hostname, int hostlen, int port, c
             ESP_LOGD(TAG, "non-tls connection established");
             return 1;
         }
-        if (cfg && cfg->non_block) {
-            FD_ZERO(&tls->rset);
-            FD_SET(tls->sockfd, &tls->rset);
-            tls->wset = tls->rset;
-        }
         tls->conn_state = ESP_TLS_CONNECTING;
     /* falls through */
     case ESP_TLS_CONNECTING:
         if (cfg && cfg->non_block) {
             ESP_LOGD(TAG, "connecting...");
+            /* select() clears the sets when it times out, set them again for every try */
+            FD_ZERO(&tls->rset);
+            FD_SET(tls->sockfd, &tls->rset);
+            tls->wset = tls->rset;
             struct timeval tv;
             ms_to_timeval(cfg->timeout_ms, &tv);
 
@@ -520,6 +594,10 @@ static int esp_tls_low_level_conn(const char *hostname, int hostlen, int port, c
             }
         }
         /* By now, the connection has been established */
+#ifdef CONFIG_ESP_TLS_USING_MBEDTLS
+        tls->cache_host = strndup(hostname, hostlen);
+        tls->cache_port = port;
+#endif
         esp_ret = create_ssl_handle(hostname, hostlen, cfg, tls);
         if (esp_ret != ESP_OK) {
             ESP_LOGE(TAG, "create_ssl_handle failed");
@@ -17,6 +17,7 @@
 #include "esp_tls_private.h"
 #include "esp_tls_error_capture_internal.h"
 #include "esp_tls_platform_port.h"
+#include "badgevms/tls_cache.h"
 #include <errno.h>
 #include "esp_log.h"
 #include "esp_check.h"
@@ -85,6 +86,34 @@ typedef struct esp_tls_pki_t {
 
 static esp_err_t set_server_config(esp_tls_cfg_server_t *cfg, esp_tls_t *tls);
 
+/* Only sessions of connections that verified the server are cached and offered, a session from an unverified
+ * connection must never let a verified one skip the certificate check. Fills in the trust digest the session of a
+ * cacheable connection goes under. */
+static bool session_cacheable(esp_tls_t *tls, const esp_tls_cfg_t *cfg)
+{
+    if (tls->role != ESP_TLS_CLIENT || tls->cache_host == NULL || cfg->skip_common_name || cfg->clientcert_buf != NULL) {
+        return false;
+    }
+#ifdef CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+    if (cfg->client_session != NULL) {
+        return false;
+    }
+#endif
+    if (cfg->crt_bundle_attach == NULL && cfg->cacert_buf == NULL && cfg->use_global_ca_store == false) {
+        return false;
+    }
+
+    const tls_cache_trust_t trust = {
+        .ca = cfg->cacert_buf,
+        .ca_len = cfg->cacert_bytes,
+        .bundle = (uintptr_t)cfg->crt_bundle_attach,
+        .global_store = cfg->use_global_ca_store,
+        .common_name = cfg->common_name,
+        .skip_common_name = cfg->skip_common_name,
+    };
+    return tls_cache_trust_digest(&trust, tls->cache_trust);
+}
+
 esp_err_t esp_create_mbedtls_handle(const char *hostname, size_t hostlen, const void *cfg, esp_tls_t *tls, void *server_params)
 {
     assert(cfg != NULL);
@@ -167,6 +196,13 @@ esp_err_t esp_create_mbedtls_handle(const char *hostname, size_t hostlen, const
     }
     mbedtls_ssl_set_bio(&tls->ssl, &tls->server_fd, mbedtls_net_send, mbedtls_net_recv, NULL);
 
+    if (session_cacheable(tls, (esp_tls_cfg_t *)cfg)) {
+        tls->cache_session_offered = tls_cache_session_resume(&tls->ssl, tls->cache_host, tls->cache_port, tls->cache_trust);
+    } else if (tls->cache_host != NULL) {
+        free(tls->cache_host);
+        tls->cache_host = NULL;
+    }
+
     return ESP_OK;
 
 exit:
@@ -260,6 +296,16 @@ int esp_mbedtls_handshake(esp_tls_t *tls, const esp_tls_cfg_t *cfg)
     if (ret == 0) {
         tls->conn_state = ESP_TLS_DONE;
 
+        /* TLS 1.3 sessions only exist once the server sent a ticket, esp_mbedtls_read stores those */
+        if (tls->cache_host != NULL && mbedtls_ssl_get_version_number(&tls->ssl) != MBEDTLS_SSL_VERSION_TLS1_3) {
+            mbedtls_ssl_session session;
+            mbedtls_ssl_session_init(&session);
+            if (mbedtls_ssl_get_session(&tls->ssl, &session) == 0) {
+                tls_cache_session_store(&session, tls->cache_host, tls->cache_port, tls->cache_trust);
+            }
+            mbedtls_ssl_session_free(&session);
+        }
+
 #ifdef CONFIG_ESP_TLS_USE_DS_PERIPHERAL
         esp_ds_release_ds_lock();
 #endif
@@ -274,6 +320,9 @@ int esp_mbedtls_handshake(esp_tls_t *tls, const esp_tls_cfg_t *cfg)
                 /* This is to check whether handshake failed due to invalid certificate*/
                 esp_mbedtls_verify_certificate(tls);
             }
+            if (tls->cache_session_offered) {
+                tls_cache_session_forget(tls->cache_host, tls->cache_port, tls->cache_trust);
+            }
             tls->conn_state = ESP_TLS_FAIL;
             return -1;
         }
@@ -351,6 +400,10 @@ ssize_t esp_mbedtls_read(esp_tls_t *tls, char *data, size_t datalen)
 
                 ESP_LOGD(TAG, "Session ticket saved in the client session context");
                 tls->client_session_len = session_ticket_len;
+                if (tls->cache_host != NULL) {
+                    tls_cache_session_store(&tls13_saved_client_session->saved_session, tls->cache_host, tls->cache_port,
+                                            tls->cache_trust);
+                }
                 mbedtls_ssl_session_free(&tls13_saved_client_session->saved_session);
                 free(tls13_saved_client_session);
                 tls13_saved_client_session = NULL;
@@ -454,10 +507,12 @@ void esp_mbedtls_cleanup(esp_tls_t *tls)
     if (!tls) {
         return;
     }
-    if (tls->cacert_ptr != global_cacert) {
+    if (tls->cacert_ptr != global_cacert && !tls_cache_ca_put(tls->cacert_ptr)) {
         mbedtls_x509_crt_free(tls->cacert_ptr);
     }
     tls->cacert_ptr = NULL;
+    free(tls->cache_host);
+    tls->cache_host = NULL;
     mbedtls_x509_crt_free(&tls->cacert);
     mbedtls_x509_crt_free(&tls->clientcert);
     mbedtls_pk_free(&tls->clientkey);
@@ -476,6 +531,12 @@ void esp_mbedtls_cleanup(esp_tls_t *tls)
 static esp_err_t set_ca_cert(esp_tls_t *tls, const unsigned char *cacert, size_t cacert_len)
 {
     assert(tls);
+    tls->cacert_ptr = tls_cache_ca_get(cacert, cacert_len);
+    if (tls->cacert_ptr != NULL) {
+        mbedtls_ssl_conf_authmode(&tls->conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+        mbedtls_ssl_conf_ca_chain(&tls->conf, tls->cacert_ptr, NULL);
+        return ESP_OK;
+    }
     tls->cacert_ptr = &tls->cacert;
     mbedtls_x509_crt_init(tls->cacert_ptr);
     int ret = mbedtls_x509_crt_parse(tls->cacert_ptr, cacert, cacert_len);
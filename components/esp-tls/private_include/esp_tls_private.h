@@ -23,6 +23,7 @@
 #include "mbedtls/entropy.h"
 #include "mbedtls/ctr_drbg.h"
 #include "mbedtls/error.h"
+#include "badgevms/tls_cache.h"
 #ifdef CONFIG_ESP_TLS_SERVER_SESSION_TICKETS
 #include "mbedtls/ssl_ticket.h"
 #endif
@@ -68,6 +69,12 @@ struct esp_tls {
     bool use_ecdsa_peripheral;                                                  /*!< Use the ECDSA peripheral for the private key operations. */
     uint8_t ecdsa_efuse_blk;                                                    /*!< The efuse block number where the ECDSA key is stored. */
 #endif
+    char *cache_host;                                                           /*!< Host the session cache knows this connection by,
+                                                                                     NULL if its session is not cached */
+    uint16_t cache_port;                                                        /*!< Port the session cache knows this connection by */
+    unsigned char cache_trust[TLS_CACHE_TRUST_BYTES];                           /*!< Digest of what the server is verified against,
+                                                                                     sessions are only shared under the same one */
+    bool cache_session_offered;                                                 /*!< A cached session was offered in the handshake */
 #if CONFIG_MBEDTLS_SSL_PROTO_TLS1_3 && CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
     unsigned char *client_session;                                              /*!< Pointer for the serialized client session ticket context. */
     size_t client_session_len;                                                  /*!< Length of the serialized client session ticket context. */
@@ -255,6 +255,8 @@ static int http_on_header_event(esp_http_client_handle_t client)
 static int http_on_header_field(http_parser *parser, const char *at, size_t length)
 {
     esp_http_client_t *client = parser->data;
+    /* The status line is in by now, let the handler of HTTP_EVENT_ON_HEADER see it */
+    client->response->status_code = parser->status_code;
     http_on_header_event(client);
     HTTP_RET_ON_FALSE_DBG(http_utils_append_string(&client->current_header_key, at, length), -1, TAG, "Failed to append string");
 
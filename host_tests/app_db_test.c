@@ -0,0 +1,780 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+// The application database against a fake filesystem that renames like FAT. A scripted run of creates, updates and
+// deletes, compactions included, is cut short by a power cut at every byte written and every file created, removed or
+// renamed. After each cut the database is opened again and must hold everything that was acknowledged, plus the
+// change that was under way either entirely or not at all. Also covers torn and corrupted files, failed writes and
+// ends with a microbenchmark of opening and looking up a large database.
+
+#include "app_db.h"
+#include "badgevms_config.h"
+#include "check.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "why_io.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <errno.h>
+#include <time.h>
+
+#define DB_PATH  "FLASH0:[BADGEVMS.APPS]APPLICATIONS.DB"
+#define TMP_PATH "FLASH0:[BADGEVMS.APPS]APPLICATIONS.DB_"
+
+#define FAKE_FILES   4
+#define FAKE_FDS     4
+#define MODEL_APPS   12
+#define SCRIPT_OPS   160
+#define CUT_STRIDE   7
+#define STRING_BYTES 64
+#define BENCH_APPS   500
+#define BENCH_GETS   100000
+
+typedef struct {
+    char     name[64];
+    bool     exists;
+    uint8_t *data;
+    size_t   len;
+    size_t   cap;
+} fake_file_t;
+
+typedef struct {
+    bool   used;
+    int    file;
+    size_t pos;
+    bool   append;
+} fake_fd_t;
+
+typedef struct {
+    bool     exists;
+    bool     set[APP_DB_STRINGS];
+    char     strings[APP_DB_STRINGS][STRING_BYTES];
+    uint32_t source;
+} model_app_t;
+
+typedef enum {
+    OP_CREATE,
+    OP_UPDATE,
+    OP_DELETE,
+} op_type_t;
+
+typedef struct {
+    op_type_t   type;
+    int         app;
+    model_app_t value;
+} script_op_t;
+
+static fake_file_t files[FAKE_FILES];
+static fake_fd_t   fds[FAKE_FDS];
+static int         lock_depth;
+
+// Units left before the power goes, -1 for never. Each byte written and each file created, removed or renamed is one.
+static long power_budget = -1;
+static bool powered_off;
+static long units_used;
+
+// Fail the next write after this many bytes without cutting the power
+static long fail_write_after = -1;
+
+static model_app_t model[MODEL_APPS];
+static script_op_t script[SCRIPT_OPS];
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void) {
+    return &lock_depth;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks) {
+    (void)semaphore;
+    (void)ticks;
+    CHECK(lock_depth == 0);
+    lock_depth++;
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore) {
+    (void)semaphore;
+    CHECK(lock_depth == 1);
+    lock_depth--;
+    return pdTRUE;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t semaphore) {
+    (void)semaphore;
+}
+
+// How many of the units an operation needs happen before the power goes
+static long consume(long units) {
+    if (powered_off) {
+        return 0;
+    }
+
+    units_used += units;
+    if (power_budget < 0) {
+        return units;
+    }
+
+    if (units > power_budget) {
+        units        = power_budget;
+        power_budget = 0;
+        powered_off  = true;
+        return units;
+    }
+
+    power_budget -= units;
+    return units;
+}
+
+static int find_file(char const *name) {
+    for (int i = 0; i < FAKE_FILES; i++) {
+        if (files[i].exists && strcmp(files[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int new_file(char const *name) {
+    for (int i = 0; i < FAKE_FILES; i++) {
+        if (!files[i].exists) {
+            snprintf(files[i].name, sizeof(files[i].name), "%s", name);
+            files[i].exists = true;
+            files[i].len    = 0;
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void fs_reset(void) {
+    for (int i = 0; i < FAKE_FILES; i++) {
+        files[i].exists = false;
+        files[i].len    = 0;
+    }
+    memset(fds, 0, sizeof(fds));
+    power_budget     = -1;
+    powered_off      = false;
+    fail_write_after = -1;
+}
+
+int why_open(char const *pathname, int flags, mode_t mode) {
+    (void)mode;
+    if (powered_off) {
+        errno = EIO;
+        return -1;
+    }
+
+    int file = find_file(pathname);
+    if (file < 0 || (flags & O_TRUNC)) {
+        if (file < 0 && !(flags & O_CREAT)) {
+            errno = ENOENT;
+            return -1;
+        }
+        if (consume(1) != 1) {
+            errno = EIO;
+            return -1;
+        }
+        if (file < 0) {
+            file = new_file(pathname);
+        } else {
+            files[file].len = 0;
+        }
+        if (file < 0) {
+            errno = ENOSPC;
+            return -1;
+        }
+    }
+
+    for (int fd = 0; fd < FAKE_FDS; fd++) {
+        if (!fds[fd].used) {
+            fds[fd] = (fake_fd_t){.used = true, .file = file, .append = (flags & O_APPEND) != 0};
+            return fd;
+        }
+    }
+
+    errno = EMFILE;
+    return -1;
+}
+
+int why_close(int fd) {
+    fds[fd].used = false;
+    return powered_off ? -1 : 0;
+}
+
+ssize_t why_read(int fd, void *buf, size_t count) {
+    if (powered_off) {
+        return -1;
+    }
+
+    fake_file_t *file = &files[fds[fd].file];
+    if (fds[fd].pos >= file->len) {
+        return 0;
+    }
+    if (count > file->len - fds[fd].pos) {
+        count = file->len - fds[fd].pos;
+    }
+    memcpy(buf, file->data + fds[fd].pos, count);
+    fds[fd].pos += count;
+    return count;
+}
+
+ssize_t why_write(int fd, void const *buf, size_t count) {
+    fake_file_t *file = &files[fds[fd].file];
+    if (fds[fd].append) {
+        fds[fd].pos = file->len;
+    }
+
+    size_t done   = consume(count);
+    bool   failed = done != count;
+    if (fail_write_after >= 0 && done > (size_t)fail_write_after) {
+        done             = fail_write_after;
+        fail_write_after = -1;
+        failed           = true;
+    }
+
+    if (fds[fd].pos + done > file->cap) {
+        file->cap  = (fds[fd].pos + done) * 2;
+        file->data = realloc(file->data, file->cap);
+    }
+    memcpy(file->data + fds[fd].pos, buf, done);
+    fds[fd].pos += done;
+    if (fds[fd].pos > file->len) {
+        file->len = fds[fd].pos;
+    }
+
+    if (failed) {
+        errno = EIO;
+        return done ? (ssize_t)done : -1;
+    }
+    return done;
+}
+
+off_t why_lseek(int fd, off_t offset, int whence) {
+    if (powered_off) {
+        return -1;
+    }
+
+    if (whence == SEEK_END) {
+        offset += files[fds[fd].file].len;
+    } else if (whence == SEEK_CUR) {
+        offset += fds[fd].pos;
+    }
+    fds[fd].pos = offset;
+    return offset;
+}
+
+int why_fsync(int fd) {
+    (void)fd;
+    return powered_off ? -1 : 0;
+}
+
+int why_stat(char const *restrict pathname, struct stat *restrict statbuf) {
+    int file = powered_off ? -1 : find_file(pathname);
+    if (file < 0) {
+        errno = ENOENT;
+        return -1;
+    }
+    memset(statbuf, 0, sizeof(*statbuf));
+    statbuf->st_size = files[file].len;
+    return 0;
+}
+
+int why_unlink(char const *pathname) {
+    int file = powered_off ? -1 : find_file(pathname);
+    if (file < 0 || consume(1) != 1) {
+        return -1;
+    }
+    files[file].exists = false;
+    return 0;
+}
+
+// Like FAT, an existing file is not replaced
+int why_rename(char const *oldpath, char const *newpath) {
+    int file = powered_off ? -1 : find_file(oldpath);
+    if (file < 0 || find_file(newpath) >= 0 || consume(1) != 1) {
+        return -1;
+    }
+    snprintf(files[file].name, sizeof(files[file].name), "%s", newpath);
+    return 0;
+}
+
+static void model_to_record(int i, model_app_t const *app, app_db_record_t *record, char *uid) {
+    sprintf(uid, "app_%02d", i);
+    for (int s = 0; s < APP_DB_STRINGS; s++) {
+        record->strings[s] = app->set[s] ? app->strings[s] : NULL;
+    }
+    record->strings[APP_DB_UNIQUE_IDENTIFIER] = uid;
+    record->source                            = app->source;
+}
+
+static void random_app(model_app_t *app) {
+    app->exists = true;
+    app->source = rand() % 3;
+    for (int s = APP_DB_NAME; s < APP_DB_STRINGS; s++) {
+        app->set[s] = rand() % 5 != 0;
+        int len     = rand() % (STRING_BYTES - 1);
+        for (int c = 0; c < len; c++) {
+            app->strings[s][c] = 'a' + rand() % 26;
+        }
+        app->strings[s][len] = '\0';
+    }
+}
+
+typedef struct {
+    model_app_t const *expect;
+    bool               match;
+} compare_t;
+
+static bool compare_record(app_db_record_t const *record, void *context) {
+    compare_t *cmp = context;
+    cmp->match     = record->source == cmp->expect->source;
+    for (int s = APP_DB_NAME; s < APP_DB_STRINGS; s++) {
+        if (!cmp->expect->set[s]) {
+            cmp->match = cmp->match && !record->strings[s];
+        } else {
+            cmp->match = cmp->match && record->strings[s] && strcmp(record->strings[s], cmp->expect->strings[s]) == 0;
+        }
+    }
+    return true;
+}
+
+static bool count_record(app_db_record_t const *record, void *context) {
+    (void)record;
+    (*(int *)context)++;
+    return true;
+}
+
+static bool app_matches(app_db_t *db, int i, model_app_t const *expect) {
+    char uid[16];
+    sprintf(uid, "app_%02d", i);
+
+    compare_t cmp   = {.expect = expect};
+    bool      found = app_db_get(db, uid, compare_record, &cmp);
+    return expect->exists ? found && cmp.match : !found;
+}
+
+static bool db_matches(app_db_t *db, model_app_t const *state) {
+    int expected = 0;
+    for (int i = 0; i < MODEL_APPS; i++) {
+        if (!app_matches(db, i, &state[i])) {
+            return false;
+        }
+        expected += state[i].exists;
+    }
+
+    int seen = 0;
+    app_db_foreach(db, count_record, &seen);
+    return seen == expected;
+}
+
+static bool apply(app_db_t *db, script_op_t const *op) {
+    app_db_record_t record;
+    char            uid[16];
+    model_to_record(op->app, &op->value, &record, uid);
+
+    switch (op->type) {
+        case OP_CREATE: return app_db_put(db, &record, true);
+        case OP_UPDATE: return app_db_put(db, &record, false);
+        case OP_DELETE: return app_db_delete(db, uid);
+    }
+    return false;
+}
+
+static void build_script(void) {
+    model_app_t state[MODEL_APPS] = {0};
+
+    srand(39);
+    for (int n = 0; n < SCRIPT_OPS; n++) {
+        script_op_t *op = &script[n];
+        op->app         = rand() % MODEL_APPS;
+        if (!state[op->app].exists) {
+            op->type = OP_CREATE;
+            random_app(&op->value);
+        } else if (rand() % 6 == 0) {
+            op->type = OP_DELETE;
+            memset(&op->value, 0, sizeof(op->value));
+        } else {
+            op->type  = OP_UPDATE;
+            op->value = state[op->app];
+            // A few fields at once, like an install that sets the version and the binary together
+            for (int s = APP_DB_NAME; s < APP_DB_STRINGS; s++) {
+                if (rand() % 2) {
+                    snprintf(op->value.strings[s], STRING_BYTES, "v%d-%.50s", n, state[op->app].strings[s]);
+                    op->value.set[s] = true;
+                }
+            }
+        }
+        state[op->app] = op->value;
+    }
+}
+
+static void test_basic(void) {
+    fs_reset();
+
+    app_db_t *db = app_db_open(DB_PATH);
+    CHECK(db);
+    CHECK(find_file(DB_PATH) >= 0);
+    CHECK(find_file(TMP_PATH) < 0);
+
+    model_app_t app = {.exists = true, .source = 1};
+    app.set[APP_DB_NAME] = true;
+    strcpy(app.strings[APP_DB_NAME], "Calculator");
+    app.set[APP_DB_VERSION] = true;
+    strcpy(app.strings[APP_DB_VERSION], "");
+
+    app_db_record_t record;
+    char            uid[16];
+    model_to_record(3, &app, &record, uid);
+    CHECK(app_db_put(db, &record, true));
+    CHECK(!app_db_put(db, &record, true));
+    CHECK(app_matches(db, 3, &app));
+
+    // Unique identifiers are as case insensitive as the directories they name
+    compare_t cmp = {.expect = &app};
+    CHECK(app_db_get(db, "APP_03", compare_record, &cmp) && cmp.match);
+    CHECK(!app_db_get(db, "app_04", NULL, NULL));
+
+    app.set[APP_DB_BINARY_PATH] = true;
+    strcpy(app.strings[APP_DB_BINARY_PATH], "[bin]calc.elf");
+    app.set[APP_DB_NAME] = false;
+    model_to_record(3, &app, &record, uid);
+    CHECK(app_db_put(db, &record, false));
+    CHECK(app_matches(db, 3, &app));
+
+    record.strings[APP_DB_UNIQUE_IDENTIFIER] = "";
+    CHECK(!app_db_put(db, &record, false));
+    record.strings[APP_DB_UNIQUE_IDENTIFIER] = NULL;
+    CHECK(!app_db_put(db, &record, false));
+
+    app_db_close(db);
+    db = app_db_open(DB_PATH);
+    CHECK(db && app_matches(db, 3, &app));
+
+    CHECK(app_db_delete(db, "APP_03"));
+    CHECK(!app_db_delete(db, "app_03"));
+    app_db_close(db);
+
+    db = app_db_open(DB_PATH);
+    model_app_t gone = {0};
+    CHECK(db && app_matches(db, 3, &gone));
+
+    app_db_stats_t stats;
+    app_db_stats_get(db, &stats);
+    CHECK(stats.records == 0);
+    CHECK(stats.dropped_bytes == 0);
+    app_db_close(db);
+    CHECK(lock_depth == 0);
+}
+
+static void test_compaction(void) {
+    fs_reset();
+
+    app_db_t *db = app_db_open(DB_PATH);
+    CHECK(db);
+
+    model_app_t app = {0};
+    srand(1);
+    random_app(&app);
+
+    app_db_record_t record;
+    char            uid[16];
+    for (int n = 0; n < 2000; n++) {
+        snprintf(app.strings[APP_DB_VERSION], STRING_BYTES, "%d", n);
+        app.set[APP_DB_VERSION] = true;
+        model_to_record(0, &app, &record, uid);
+        CHECK(app_db_put(db, &record, false));
+    }
+
+    app_db_stats_t stats;
+    app_db_stats_get(db, &stats);
+    CHECK(stats.compactions > 0);
+    CHECK(stats.log_bytes <= stats.live_bytes + 2 * APP_DB_COMPACT_SLACK);
+    CHECK(files[find_file(DB_PATH)].len == stats.log_bytes);
+    CHECK(find_file(TMP_PATH) < 0);
+
+    CHECK(app_db_compact(db));
+    app_db_stats_get(db, &stats);
+    CHECK(stats.log_bytes == stats.live_bytes);
+    app_db_close(db);
+
+    db = app_db_open(DB_PATH);
+    CHECK(db && app_matches(db, 0, &app));
+    app_db_close(db);
+}
+
+// The script cut short every CUT_STRIDE units, which lands in every part of records, headers and compactions
+static void test_power_cuts(void) {
+    build_script();
+
+    // Uncut run to count units and check the script compacts at all
+    fs_reset();
+    units_used   = 0;
+    app_db_t *db = app_db_open(DB_PATH);
+    for (int n = 0; n < SCRIPT_OPS; n++) {
+        CHECK(apply(db, &script[n]));
+    }
+    app_db_stats_t stats;
+    app_db_stats_get(db, &stats);
+    CHECK(stats.compactions > 1);
+    app_db_close(db);
+
+    long total = units_used;
+    int  cuts  = 0;
+    for (long cut = 0; cut <= total; cut += CUT_STRIDE) {
+        fs_reset();
+        memset(model, 0, sizeof(model));
+        power_budget = cut;
+
+        db = app_db_open(DB_PATH);
+        if (!db) {
+            // Lost power while creating the empty database
+            CHECK(powered_off);
+        }
+
+        int n = 0;
+        for (; db && n < SCRIPT_OPS; n++) {
+            if (!apply(db, &script[n])) {
+                break;
+            }
+            model[script[n].app] = script[n].value;
+        }
+        app_db_close(db);
+
+        if (!powered_off) {
+            CHECK(db && n == SCRIPT_OPS);
+            continue;
+        }
+        cuts++;
+
+        // Power back on
+        power_budget = -1;
+        powered_off  = false;
+        memset(fds, 0, sizeof(fds));
+
+        db = app_db_open(DB_PATH);
+        CHECK(db);
+        if (!db) {
+            continue;
+        }
+
+        bool matches = db_matches(db, model);
+        if (!matches && n < SCRIPT_OPS) {
+            model_app_t before   = model[script[n].app];
+            model[script[n].app] = script[n].value;
+            matches              = db_matches(db, model);
+            if (!matches) {
+                model[script[n].app] = before;
+            }
+        }
+        if (!matches) {
+            printf("FAIL power cut after %ld of %ld units, in op %d\n", cut, total, n);
+            failures++;
+        }
+
+        // Whatever was torn off must not get in the way of what comes next
+        model_app_t next = {0};
+        random_app(&next);
+        app_db_record_t record;
+        char            uid[16];
+        model_to_record(MODEL_APPS - 1, &next, &record, uid);
+        CHECK(app_db_put(db, &record, false));
+        model[MODEL_APPS - 1] = next;
+        app_db_close(db);
+
+        db = app_db_open(DB_PATH);
+        CHECK(db && db_matches(db, model));
+        CHECK(find_file(TMP_PATH) < 0);
+        app_db_close(db);
+    }
+
+    CHECK(cuts > 0);
+    printf("app_db_test: %d power cuts over %ld units\n", cuts, total);
+}
+
+// Plain bitwise CRC-32 of the first 12 bytes, to forge a valid header
+static uint32_t header_crc(uint8_t const *header) {
+    uint32_t crc = 0xffffffff;
+    for (int i = 0; i < 12; i++) {
+        crc ^= header[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+        }
+    }
+    return ~crc;
+}
+
+static void test_corruption(void) {
+    fs_reset();
+
+    app_db_t *db = app_db_open(DB_PATH);
+    model_app_t apps[3];
+    srand(7);
+    for (int i = 0; i < 3; i++) {
+        random_app(&apps[i]);
+        app_db_record_t record;
+        char            uid[16];
+        model_to_record(i, &apps[i], &record, uid);
+        CHECK(app_db_put(db, &record, true));
+    }
+    app_db_close(db);
+
+    // A bit flipped in the last record only loses that record
+    fake_file_t *file          = &files[find_file(DB_PATH)];
+    file->data[file->len - 3] ^= 0x10;
+
+    model_app_t gone = {0};
+    db               = app_db_open(DB_PATH);
+    CHECK(db && app_matches(db, 0, &apps[0]) && app_matches(db, 1, &apps[1]) && app_matches(db, 2, &gone));
+
+    app_db_stats_t stats;
+    app_db_stats_get(db, &stats);
+    CHECK(stats.dropped_bytes > 0);
+    app_db_close(db);
+
+    // The torn off part is gone from the file
+    file = &files[find_file(DB_PATH)];
+    CHECK(file->len == stats.log_bytes);
+
+    // Garbage after the last record
+    size_t len = file->len;
+    memset(file->data + len, 0xa5, 100);
+    file->len += 100;
+    db         = app_db_open(DB_PATH);
+    CHECK(db && app_matches(db, 1, &apps[1]));
+    CHECK(files[find_file(DB_PATH)].len == len);
+    app_db_close(db);
+
+    // A database from newer firmware is left alone
+    file          = &files[find_file(DB_PATH)];
+    file->data[4] = 99;
+    uint32_t crc  = header_crc(file->data);
+    memcpy(file->data + 12, &crc, sizeof(crc));
+    CHECK(!app_db_open(DB_PATH));
+    CHECK(file->len == len && file->data[4] == 99);
+
+    // A header that is not a header
+    file->data[0] ^= 0xff;
+    db             = app_db_open(DB_PATH);
+    CHECK(db && app_matches(db, 0, &gone));
+    app_db_close(db);
+}
+
+// A write that fails halfway without losing power, the next change must not land after the torn record
+static void test_failed_write(void) {
+    fs_reset();
+
+    app_db_t       *db = app_db_open(DB_PATH);
+    model_app_t     a, b;
+    app_db_record_t record;
+    char            uid[16];
+
+    srand(11);
+    random_app(&a);
+    random_app(&b);
+
+    model_to_record(0, &a, &record, uid);
+    CHECK(app_db_put(db, &record, true));
+
+    fail_write_after = 10;
+    model_to_record(1, &b, &record, uid);
+    CHECK(!app_db_put(db, &record, true));
+    CHECK(!app_db_get(db, "app_01", NULL, NULL));
+
+    CHECK(app_db_put(db, &record, true));
+    app_db_close(db);
+
+    db = app_db_open(DB_PATH);
+    CHECK(db && app_matches(db, 0, &a) && app_matches(db, 1, &b));
+
+    app_db_stats_t stats;
+    app_db_stats_get(db, &stats);
+    CHECK(stats.dropped_bytes == 0);
+    app_db_close(db);
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void bench(void) {
+    fs_reset();
+
+    app_db_t *db = app_db_open(DB_PATH);
+    srand(3);
+    for (int i = 0; i < BENCH_APPS; i++) {
+        model_app_t     app;
+        app_db_record_t record;
+        char            uid[16];
+        random_app(&app);
+        model_to_record(i, &app, &record, uid);
+        CHECK(app_db_put(db, &record, true));
+    }
+    app_db_close(db);
+
+    double start = now_ms();
+    db           = app_db_open(DB_PATH);
+    double open  = now_ms() - start;
+
+    char names[BENCH_APPS][16];
+    for (int i = 0; i < BENCH_APPS; i++) {
+        sprintf(names[i], "app_%02d", i);
+    }
+
+    int found = 0;
+    start     = now_ms();
+    for (int n = 0; n < BENCH_GETS; n++) {
+        found += app_db_get(db, names[n % BENCH_APPS], NULL, NULL);
+    }
+    double gets = now_ms() - start;
+    CHECK(found == BENCH_GETS);
+
+    int seen = 0;
+    start    = now_ms();
+    app_db_foreach(db, count_record, &seen);
+    double iterate = now_ms() - start;
+    CHECK(seen == BENCH_APPS);
+
+    printf(
+        "app_db_test: %d apps, open %.2fms, lookup %.0fns, iterate %.3fms\n",
+        BENCH_APPS,
+        open,
+        gets * 1000000.0 / BENCH_GETS,
+        iterate
+    );
+    app_db_close(db);
+}
+
+int main(void) {
+    test_basic();
+    test_compaction();
+    test_power_cuts();
+    test_corruption();
+    test_failed_write();
+    bench();
+
+    for (int i = 0; i < FAKE_FILES; i++) {
+        free(files[i].data);
+    }
+
+    return check_report("app_db_test");
+}
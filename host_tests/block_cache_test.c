@@ -0,0 +1,360 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Drives the block cache with simulated block devices: sequential and random readers with FatFs-like access
+// patterns, writes in between, two devices sharing the budget, and a randomized run against a plain copy of the
+// device contents. Prints transaction counts and hit rates next to what the device would have seen without it.
+
+#include "block_cache.h"
+#include "badgevms_config.h"
+#include "check.h"
+#include "esp_heap_caps.h"
+#include "freertos/semphr.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CACHE_BUDGET (256 * 1024)
+
+typedef struct {
+    uint8_t *data;
+    uint32_t sector_size;
+    uint32_t sector_count;
+    uint32_t reads;
+    uint32_t read_sectors;
+    uint32_t writes;
+    bool     fail;
+} sim_device_t;
+
+static int lock_depth;
+static int live_allocations;
+
+// Single threaded, but catches taking the lock twice or never giving it back
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void) {
+    return &lock_depth;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks) {
+    (void)semaphore;
+    (void)ticks;
+    CHECK(lock_depth == 0);
+    lock_depth++;
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore) {
+    (void)semaphore;
+    CHECK(lock_depth == 1);
+    lock_depth--;
+    return pdTRUE;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t semaphore) {
+    (void)semaphore;
+}
+
+void *heap_caps_malloc(size_t size, uint32_t caps) {
+    (void)caps;
+    live_allocations++;
+    return malloc(size);
+}
+
+void heap_caps_free(void *ptr) {
+    if (ptr) {
+        live_allocations--;
+    }
+    free(ptr);
+}
+
+static int sim_read(void *ctx, void *buf, uint32_t sector, uint32_t count) {
+    sim_device_t *dev = ctx;
+
+    CHECK(lock_depth == 0);
+    CHECK(sector + count <= dev->sector_count);
+    if (dev->fail) {
+        return -1;
+    }
+
+    dev->reads++;
+    dev->read_sectors += count;
+    memcpy(buf, dev->data + (size_t)sector * dev->sector_size, (size_t)count * dev->sector_size);
+    return 0;
+}
+
+static int sim_write(void *ctx, void const *buf, uint32_t sector, uint32_t count) {
+    sim_device_t *dev = ctx;
+
+    CHECK(lock_depth == 0);
+    CHECK(sector + count <= dev->sector_count);
+    if (dev->fail) {
+        return -1;
+    }
+
+    dev->writes++;
+    memcpy(dev->data + (size_t)sector * dev->sector_size, buf, (size_t)count * dev->sector_size);
+    return 0;
+}
+
+static block_cache_volume_t *sim_attach(sim_device_t *dev, uint32_t sector_size, uint32_t sector_count, int seed) {
+    memset(dev, 0, sizeof(sim_device_t));
+    dev->sector_size  = sector_size;
+    dev->sector_count = sector_count;
+    dev->data         = malloc((size_t)sector_size * sector_count);
+
+    srand(seed);
+    for (size_t i = 0; i < (size_t)sector_size * sector_count; ++i) {
+        dev->data[i] = rand();
+    }
+
+    block_cache_backend_t backend = {
+        .ctx          = dev,
+        .read         = sim_read,
+        .write        = sim_write,
+        .sector_size  = sector_size,
+        .sector_count = sector_count,
+    };
+    return block_cache_attach(&backend);
+}
+
+static void sim_detach(sim_device_t *dev, block_cache_volume_t *volume) {
+    block_cache_detach(volume);
+    free(dev->data);
+}
+
+static bool read_check(sim_device_t *dev, block_cache_volume_t *volume, uint32_t sector, uint32_t count) {
+    static uint8_t buf[256 * 4096];
+
+    if (block_cache_read(volume, buf, sector, count) != 0) {
+        return false;
+    }
+    return memcmp(buf, dev->data + (size_t)sector * dev->sector_size, (size_t)count * dev->sector_size) == 0;
+}
+
+static void report(char const *what, sim_device_t *dev, block_cache_volume_t *volume, uint32_t uncached) {
+    filesystem_cache_stats_t stats;
+    block_cache_stats_get(volume, &stats, true);
+
+    uint32_t lookups = stats.hits + stats.misses;
+    printf(
+        "%-28s %6u reads (%6u uncached) %5.1f%% hits, %u read ahead, %u of those used, %u evictions\n",
+        what,
+        dev->reads,
+        uncached,
+        lookups ? stats.hits * 100.0 / lookups : 0.0,
+        stats.readahead_blocks,
+        stats.readahead_hits,
+        stats.evictions
+    );
+    dev->reads        = 0;
+    dev->read_sectors = 0;
+    dev->writes       = 0;
+}
+
+// FatFs reads sector by sector whenever a file is read in small pieces
+static void check_sequential(uint32_t sector_size) {
+    sim_device_t          dev;
+    block_cache_volume_t *volume = sim_attach(&dev, sector_size, (4 * 1024 * 1024) / sector_size, 1);
+    uint32_t              length = (1024 * 1024) / sector_size;
+    bool                  ok     = true;
+
+    CHECK(volume != NULL);
+    for (uint32_t s = 100; s < 100 + length; ++s) {
+        ok = read_check(&dev, volume, s, 1) && ok;
+    }
+    CHECK(ok);
+
+    filesystem_cache_stats_t stats;
+    block_cache_stats_get(volume, &stats, false);
+    CHECK(dev.reads * 10 < length);
+    CHECK(stats.readahead_hits * 10 > stats.readahead_blocks * 9);
+    CHECK(block_cache_blocks_used() <= CACHE_BUDGET / BLOCK_CACHE_BLOCK_SIZE);
+    report(sector_size == 512 ? "sequential, 512 byte sectors" : "sequential, 4k sectors", &dev, volume, length);
+
+    sim_detach(&dev, volume);
+    CHECK(block_cache_blocks_used() == 0);
+}
+
+static void check_random(void) {
+    sim_device_t          dev;
+    block_cache_volume_t *volume = sim_attach(&dev, 512, 32768, 2);
+    bool                  ok     = true;
+
+    srand(3);
+    for (int i = 0; i < 4000; ++i) {
+        ok = read_check(&dev, volume, rand() % 32768, 1) && ok;
+    }
+    CHECK(ok);
+
+    filesystem_cache_stats_t stats;
+    block_cache_stats_get(volume, &stats, false);
+    CHECK(stats.readahead_blocks < 400);
+    report("random sectors", &dev, volume, 4000);
+
+    sim_detach(&dev, volume);
+}
+
+// Two files read alternately, each stream keeps its own window
+static void check_interleaved(void) {
+    sim_device_t          dev;
+    block_cache_volume_t *volume = sim_attach(&dev, 512, 32768, 4);
+    bool                  ok     = true;
+
+    for (uint32_t s = 0; s < 1024; ++s) {
+        ok = read_check(&dev, volume, 1000 + s, 1) && ok;
+        ok = read_check(&dev, volume, 20000 + s, 1) && ok;
+    }
+    CHECK(ok);
+    CHECK(dev.reads < 2048 / 10);
+    report("two interleaved readers", &dev, volume, 2048);
+
+    sim_detach(&dev, volume);
+}
+
+static void check_writes(void) {
+    sim_device_t          dev;
+    block_cache_volume_t *volume = sim_attach(&dev, 512, 4096, 5);
+    uint8_t               buf[3 * 512];
+    filesystem_cache_stats_t stats;
+
+    CHECK(read_check(&dev, volume, 0, 64));
+
+    // A write in the middle of a cached block drops it, the next read sees the new data
+    memset(buf, 0xaa, sizeof(buf));
+    CHECK(block_cache_write(volume, buf, 10, 3) == 0);
+    CHECK(memcmp(dev.data + 10 * 512, buf, sizeof(buf)) == 0);
+    block_cache_stats_get(volume, &stats, true);
+    CHECK(stats.invalidations == 1);
+    CHECK(read_check(&dev, volume, 8, 8));
+
+    // Spanning blocks
+    memset(buf, 0x55, sizeof(buf));
+    CHECK(block_cache_write(volume, buf, 15, 3) == 0);
+    block_cache_stats_get(volume, &stats, true);
+    CHECK(stats.invalidations == 2);
+    CHECK(read_check(&dev, volume, 0, 64));
+
+    // Discards
+    block_cache_invalidate(volume, 0, 4096);
+    block_cache_stats_get(volume, &stats, true);
+    CHECK(stats.invalidations >= 8);
+    dev.reads = 0;
+    CHECK(read_check(&dev, volume, 0, 1));
+    CHECK(dev.reads == 1);
+
+    // Backend errors come through and leave nothing behind
+    dev.fail = true;
+    CHECK(block_cache_read(volume, buf, 2000, 1) == -1);
+    CHECK(block_cache_write(volume, buf, 0, 1) == -1);
+    dev.fail = false;
+    CHECK(read_check(&dev, volume, 2000, 1));
+
+    sim_detach(&dev, volume);
+}
+
+static void check_edges(void) {
+    sim_device_t          a;
+    sim_device_t          b;
+    block_cache_volume_t *va = sim_attach(&a, 512, 1003, 6);
+    block_cache_volume_t *vb = sim_attach(&b, 4096, 1000, 7);
+
+    // Devices that don't end on a block boundary
+    CHECK(read_check(&a, va, 1000, 3));
+    CHECK(read_check(&a, va, 990, 13));
+    for (uint32_t s = 900; s < 1003; ++s) {
+        CHECK(read_check(&a, va, s, 1));
+    }
+
+    // The same sector numbers on two devices
+    CHECK(read_check(&a, va, 0, 8));
+    CHECK(read_check(&b, vb, 0, 1));
+    CHECK(read_check(&a, va, 0, 8));
+
+    // Large reads go straight to the device
+    a.reads = 0;
+    CHECK(read_check(&a, va, 100, BLOCK_CACHE_READAHEAD_MAX * 8));
+    CHECK(a.reads == 1);
+
+    // Reads that straddle one more block than fits in the scratch buffer
+    CHECK(read_check(&a, va, 7 + 200, BLOCK_CACHE_READAHEAD_MAX * 8 - 1));
+
+    // Unsupported sector sizes are left alone
+    block_cache_backend_t odd = {.sector_size = 3000, .sector_count = 10};
+    CHECK(block_cache_attach(&odd) == NULL);
+
+    sim_detach(&a, va);
+    sim_detach(&b, vb);
+}
+
+// Random reads and writes of random lengths on two devices at once, checked against the device contents
+static void check_random_mix(void) {
+    sim_device_t          devs[2];
+    block_cache_volume_t *volumes[2];
+    static uint8_t        buf[256 * 4096];
+    bool                  ok = true;
+
+    volumes[0] = sim_attach(&devs[0], 512, 8191, 8);
+    volumes[1] = sim_attach(&devs[1], 4096, 2047, 9);
+
+    srand(10);
+    for (int i = 0; i < 20000; ++i) {
+        int           d      = rand() % 2;
+        sim_device_t *dev    = &devs[d];
+        uint32_t      count  = 1 + (rand() % 4 ? rand() % 8 : rand() % 200);
+        uint32_t      sector = rand() % (dev->sector_count - count);
+
+        // Mostly continue a previous read so readahead gets exercised too
+        if (rand() % 3 && i) {
+            sector = (sector / 64) * 64;
+        }
+
+        if (rand() % 5 == 0) {
+            for (size_t j = 0; j < (size_t)count * dev->sector_size; ++j) {
+                buf[j] = rand();
+            }
+            ok = block_cache_write(volumes[d], buf, sector, count) == 0 && ok;
+        } else {
+            ok = read_check(dev, volumes[d], sector, count) && ok;
+        }
+        ok = block_cache_blocks_used() <= CACHE_BUDGET / BLOCK_CACHE_BLOCK_SIZE && ok;
+    }
+    CHECK(ok);
+    CHECK(lock_depth == 0);
+
+    sim_detach(&devs[0], volumes[0]);
+    sim_detach(&devs[1], volumes[1]);
+}
+
+int main(void) {
+    CHECK(!block_cache_init(BLOCK_CACHE_BLOCK_SIZE));
+    CHECK(block_cache_init(CACHE_BUDGET));
+    int base_allocations = live_allocations;
+
+    check_sequential(512);
+    check_sequential(4096);
+    check_random();
+    check_interleaved();
+    check_writes();
+    check_edges();
+    check_random_mix();
+
+    CHECK(block_cache_blocks_used() == 0);
+    CHECK(live_allocations == base_allocations);
+
+    return check_report("block_cache_test");
+}
@@ -0,0 +1,56 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdatomic.h>
+#include <stdio.h>
+
+// The checks of the host tests. A failed check is printed and counted, the test carries on and main() ends with
+// check_report(). Checks can fail from any thread.
+
+static atomic_int failures;
+
+// What the test is working on, like the input of a fuzzer, printed with failed checks when not NULL
+static char const *check_context;
+
+#define CHECK(cond)                                                                                                    \
+    do {                                                                                                               \
+        if (!(cond)) {                                                                                                 \
+            check_failed(__FILE__, __LINE__, #cond);                                                                   \
+        }                                                                                                              \
+    } while (0)
+
+static inline void check_failed(char const *file, int line, char const *cond) {
+    if (check_context) {
+        printf("FAIL %s:%d: %s (\"%s\")\n", file, line, cond, check_context);
+    } else {
+        printf("FAIL %s:%d: %s\n", file, line, cond);
+    }
+    atomic_fetch_add(&failures, 1);
+}
+
+// Prints the outcome of the test and returns its exit status
+static inline int check_report(char const *name) {
+    int failed = atomic_load(&failures);
+    if (failed) {
+        printf("%s: %d failures\n", name, failed);
+        return 1;
+    }
+
+    printf("%s: OK\n", name);
+    return 0;
+}
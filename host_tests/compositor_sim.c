@@ -0,0 +1,945 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Runs the compositor renderer on the host. The PPA is replaced by a software implementation, the LCD by a buffer
+// that keeps the last frame scanned out. Scenes are scripted through a small client API and every frame that goes
+// to the panel is compared against a full redraw of the same scene.
+//
+// Usage: compositor_sim [--update] [--dump DIR]
+//   --update  print a new golden table instead of checking against it
+//   --dump    write every scenario's final panel contents to DIR as PPM
+
+#include "compositor/render.h"
+#include "check.h"
+#include "driver/ppa.h"
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/param.h>
+#include <time.h>
+
+#define PANEL_PIXELS  (FRAMEBUFFER_MAX_W * FRAMEBUFFER_MAX_H)
+#define SETTLE_FRAMES DISPLAY_FRAMEBUFFERS
+#define BENCH_FRAMES  60
+
+typedef struct {
+    char const *scenario;
+    int         rotation;
+    uint32_t    hash;
+} golden_t;
+
+// Generated with --update, panel contents after each scenario
+static golden_t const goldens[] = {
+    {"single", 0, 0x4d076ab9},
+    {"single", 1, 0x2396b2e1},
+    {"single", 2, 0x95691291},
+    {"single", 3, 0xae9f3c09},
+    {"overlap", 0, 0x509ecbe3},
+    {"overlap", 1, 0xa3770caf},
+    {"overlap", 2, 0xe8cb9823},
+    {"overlap", 3, 0x55982faf},
+    {"scaled", 0, 0xcd7d5cd3},
+    {"scaled", 1, 0x566ac887},
+    {"scaled", 2, 0x934727f3},
+    {"scaled", 3, 0x77b75117},
+    {"fullscreen", 0, 0x6795e22d},
+    {"fullscreen", 1, 0x2a559c5d},
+    {"fullscreen", 2, 0x41af198d},
+    {"fullscreen", 3, 0x8fa1c11d},
+    {"translucent", 0, 0x1214788d},
+    {"translucent", 1, 0xaf6a53dd},
+    {"translucent", 2, 0x35b156ed},
+    {"translucent", 3, 0x84f3cf2d},
+    {"split", 0, 0x626e1c7e},
+    {"split", 1, 0x82f9a1e2},
+    {"split", 2, 0x510d0b52},
+    {"split", 3, 0x0df5b66e},
+};
+
+static char const *const rotation_names[] = {"0", "90", "180", "270"};
+
+static bool update_goldens;
+static bool verify_frames;
+
+// Software PPA
+
+struct ppa_client_t {
+    ppa_operation_t oper_type;
+};
+
+static struct ppa_client_t ppa_clients[2];
+static int                 num_ppa_clients;
+static uint32_t            ppa_errors;
+static uint32_t            ppa_blends;
+
+typedef struct {
+    uint8_t a, r, g, b;
+} argb_t;
+
+static argb_t pixel_read(void const *buffer, uint32_t pic_w, int x, int y, int color_mode, bool rgb_swap) {
+    argb_t p = {.a = 255};
+
+    if (color_mode == PPA_SRM_COLOR_MODE_RGB565) {
+        uint16_t v = ((uint16_t const *)buffer)[y * pic_w + x];
+        p.r        = ((v >> 11) & 0x1f) << 3;
+        p.g        = ((v >> 5) & 0x3f) << 2;
+        p.b        = (v & 0x1f) << 3;
+    } else {
+        uint32_t v = ((uint32_t const *)buffer)[y * pic_w + x];
+        p.a        = v >> 24;
+        p.r        = v >> 16;
+        p.g        = v >> 8;
+        p.b        = v;
+    }
+
+    if (rgb_swap) {
+        uint8_t t = p.r;
+        p.r       = p.b;
+        p.b       = t;
+    }
+
+    return p;
+}
+
+static void pixel_write(void *buffer, uint32_t pic_w, int x, int y, int color_mode, argb_t p) {
+    if (color_mode == PPA_SRM_COLOR_MODE_RGB565) {
+        ((uint16_t *)buffer)[y * pic_w + x] = ((p.r & 0xf8) << 8) | ((p.g & 0xfc) << 3) | (p.b >> 3);
+    } else {
+        ((uint32_t *)buffer)[y * pic_w + x] = ((uint32_t)p.a << 24) | (p.r << 16) | (p.g << 8) | p.b;
+    }
+}
+
+static uint32_t color_mode_bpp(int color_mode) {
+    return color_mode == PPA_SRM_COLOR_MODE_RGB565 ? 2 : 4;
+}
+
+static bool block_fits(uint32_t pic_w, uint32_t pic_h, uint32_t x, uint32_t y, uint32_t w, uint32_t h) {
+    return w && h && x + w <= pic_w && y + h <= pic_h;
+}
+
+esp_err_t ppa_register_client(ppa_client_config_t const *config, ppa_client_handle_t *ret_client) {
+    if (num_ppa_clients == sizeof(ppa_clients) / sizeof(ppa_clients[0])) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    ppa_clients[num_ppa_clients].oper_type = config->oper_type;
+    *ret_client                            = &ppa_clients[num_ppa_clients++];
+    return ESP_OK;
+}
+
+esp_err_t ppa_do_scale_rotate_mirror(ppa_client_handle_t ppa_client, ppa_srm_oper_config_t const *oper_config) {
+    ppa_in_pic_blk_config_t const  *in  = &oper_config->in;
+    ppa_out_pic_blk_config_t const *out = &oper_config->out;
+
+    // The hardware has 4 fractional bits of scale
+    float scale_x = (int)(oper_config->scale_x * 16) / 16.0f;
+    float scale_y = (int)(oper_config->scale_y * 16) / 16.0f;
+
+    uint32_t scaled_w = in->block_w * scale_x;
+    uint32_t scaled_h = in->block_h * scale_y;
+    bool     swap_wh  = oper_config->rotation_angle == PPA_SRM_ROTATION_ANGLE_90 ||
+                   oper_config->rotation_angle == PPA_SRM_ROTATION_ANGLE_270;
+    uint32_t out_w    = swap_wh ? scaled_h : scaled_w;
+    uint32_t out_h    = swap_wh ? scaled_w : scaled_h;
+
+    if (!ppa_client || ppa_client->oper_type != PPA_OPERATION_SRM || scale_x <= 0 || scale_y <= 0 ||
+        !block_fits(in->pic_w, in->pic_h, in->block_offset_x, in->block_offset_y, in->block_w, in->block_h) ||
+        !block_fits(out->pic_w, out->pic_h, out->block_offset_x, out->block_offset_y, out_w, out_h) ||
+        out->buffer_size < out->pic_w * out->pic_h * color_mode_bpp(out->srm_cm)) {
+        ppa_errors++;
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    for (uint32_t oy = 0; oy < out_h; oy++) {
+        for (uint32_t ox = 0; ox < out_w; ox++) {
+            uint32_t u, v;
+
+            // Rotation is counter clockwise
+            switch (oper_config->rotation_angle) {
+                case PPA_SRM_ROTATION_ANGLE_90:
+                    u = scaled_w - 1 - oy;
+                    v = ox;
+                    break;
+                case PPA_SRM_ROTATION_ANGLE_180:
+                    u = scaled_w - 1 - ox;
+                    v = scaled_h - 1 - oy;
+                    break;
+                case PPA_SRM_ROTATION_ANGLE_270:
+                    u = oy;
+                    v = scaled_h - 1 - ox;
+                    break;
+                default:
+                    u = ox;
+                    v = oy;
+                    break;
+            }
+
+            uint32_t sx = MIN((uint32_t)(u / scale_x), in->block_w - 1) + in->block_offset_x;
+            uint32_t sy = MIN((uint32_t)(v / scale_y), in->block_h - 1) + in->block_offset_y;
+
+            argb_t p = pixel_read(in->buffer, in->pic_w, sx, sy, in->srm_cm, oper_config->rgb_swap);
+            pixel_write(out->buffer, out->pic_w, out->block_offset_x + ox, out->block_offset_y + oy, out->srm_cm, p);
+        }
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t ppa_do_blend(ppa_client_handle_t ppa_client, ppa_blend_oper_config_t const *oper_config) {
+    ppa_in_pic_blk_config_t const  *bg  = &oper_config->in_bg;
+    ppa_in_pic_blk_config_t const  *fg  = &oper_config->in_fg;
+    ppa_out_pic_blk_config_t const *out = &oper_config->out;
+
+    if (!ppa_client || ppa_client->oper_type != PPA_OPERATION_BLEND || bg->block_w != fg->block_w ||
+        bg->block_h != fg->block_h ||
+        !block_fits(bg->pic_w, bg->pic_h, bg->block_offset_x, bg->block_offset_y, bg->block_w, bg->block_h) ||
+        !block_fits(fg->pic_w, fg->pic_h, fg->block_offset_x, fg->block_offset_y, fg->block_w, fg->block_h) ||
+        !block_fits(out->pic_w, out->pic_h, out->block_offset_x, out->block_offset_y, bg->block_w, bg->block_h)) {
+        ppa_errors++;
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    ppa_blends++;
+
+    // Blend and SRM color modes share their numbering
+    for (uint32_t y = 0; y < bg->block_h; y++) {
+        for (uint32_t x = 0; x < bg->block_w; x++) {
+            int    bx = bg->block_offset_x + x;
+            int    by = bg->block_offset_y + y;
+            int    fx = fg->block_offset_x + x;
+            int    fy = fg->block_offset_y + y;
+            argb_t b  = pixel_read(bg->buffer, bg->pic_w, bx, by, bg->blend_cm, false);
+            argb_t f  = pixel_read(fg->buffer, fg->pic_w, fx, fy, fg->blend_cm, false);
+
+            argb_t o = {
+                .a = 255,
+                .r = (f.r * f.a + b.r * (255 - f.a) + 127) / 255,
+                .g = (f.g * f.a + b.g * (255 - f.a) + 127) / 255,
+                .b = (f.b * f.a + b.b * (255 - f.a) + 127) / 255,
+            };
+            pixel_write(out->buffer, out->pic_w, out->block_offset_x + x, out->block_offset_y + y, out->blend_cm, o);
+        }
+    }
+
+    return ESP_OK;
+}
+
+// Remaining platform functions the renderer calls
+
+int64_t esp_timer_get_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+char const *esp_err_to_name(esp_err_t code) {
+    switch (code) {
+        case ESP_OK: return "ESP_OK";
+        case ESP_ERR_NO_MEM: return "ESP_ERR_NO_MEM";
+        case ESP_ERR_INVALID_ARG: return "ESP_ERR_INVALID_ARG";
+        case ESP_ERR_INVALID_STATE: return "ESP_ERR_INVALID_STATE";
+        default: return "ESP_FAIL";
+    }
+}
+
+void *heap_caps_aligned_calloc(size_t alignment, size_t n, size_t size, uint32_t caps) {
+    (void)caps;
+    size_t bytes = (n * size + alignment - 1) & ~(alignment - 1);
+    void  *ptr   = aligned_alloc(alignment, bytes);
+    if (ptr) {
+        memset(ptr, 0, bytes);
+    }
+    return ptr;
+}
+
+// Fake LCD and the compositor's frame loop
+
+static window_t *window_stack;
+static uint16_t *framebuffers[DISPLAY_FRAMEBUFFERS];
+static uint16_t *panel;
+static uint16_t *reference;
+static int       cur_fb;
+static uint32_t  frames_scanned_out;
+static uint64_t  frame_us_total;
+static uint64_t  ppa_us_total;
+static uint32_t  frames_timed;
+
+// Redraw the whole scene into the reference buffer without disturbing the damage tracking
+static void reference_render(void) {
+    int  saved_background = background_damaged;
+    int  saved_decoration = decoration_damaged;
+    bool saved_visible    = visible_regions_valid;
+    int  saved_dirty[MAX_WINDOWS + 1];
+    int  n = 0;
+
+    window_t *window = window_stack;
+    if (window) {
+        do {
+            saved_dirty[n++] = window->fb_dirty;
+            window           = window->next;
+        } while (window != window_stack && n < MAX_WINDOWS + 1);
+    }
+
+    uint32_t ppa_us = 0;
+    uint32_t blends = ppa_blends;
+    mark_scene_damaged();
+    render_scene(window_stack, reference, cur_fb, &ppa_us);
+    ppa_blends = blends;
+
+    background_damaged    = saved_background;
+    decoration_damaged    = saved_decoration;
+    visible_regions_valid = saved_visible;
+
+    n      = 0;
+    window = window_stack;
+    if (window) {
+        do {
+            window->fb_dirty = saved_dirty[n++];
+            window           = window->next;
+        } while (window != window_stack && n < MAX_WINDOWS + 1);
+    }
+}
+
+static void sim_frame(void) {
+    uint32_t ppa_us = 0;
+
+    if (window_stack) {
+        window_t *window = window_stack;
+        do {
+            managed_framebuffer_t *framebuffer = window->framebuffers[window->front_fb];
+            if (framebuffer && !atomic_flag_test_and_set(&framebuffer->clean)) {
+                window->fb_dirty        = 7;
+                window->content_pending = true;
+            }
+            window = window->next;
+        } while (window != window_stack);
+    }
+
+    int64_t start   = esp_timer_get_time();
+    bool    changes = render_scene(window_stack, framebuffers[cur_fb], cur_fb, &ppa_us);
+    frame_us_total += esp_timer_get_time() - start;
+    ppa_us_total   += ppa_us;
+    frames_timed++;
+
+    if (window_stack) {
+        window_t *window = window_stack;
+        do {
+            window->content_pending = false;
+            window                  = window->next;
+        } while (window != window_stack);
+    }
+
+    if (!changes) {
+        return;
+    }
+
+    memcpy(panel, framebuffers[cur_fb], FRAMEBUFFER_BYTES);
+    frames_scanned_out++;
+
+    if (verify_frames) {
+        reference_render();
+        if (memcmp(panel, reference, FRAMEBUFFER_BYTES) != 0) {
+            printf("FAIL frame %u from framebuffer %d differs from a full redraw\n", frames_scanned_out, cur_fb);
+            failures++;
+        }
+    }
+
+    cur_fb = (cur_fb + 1) % DISPLAY_FRAMEBUFFERS;
+}
+
+static void sim_settle(void) {
+    for (int i = 0; i < SETTLE_FRAMES; i++) {
+        sim_frame();
+    }
+}
+
+// Scripted clients
+
+static void fill_pattern(managed_framebuffer_t *framebuffer, int seed, bool translucent) {
+    for (int y = 0; y < framebuffer->h; y++) {
+        for (int x = 0; x < framebuffer->w; x++) {
+            uint8_t r = (x * 255) / framebuffer->w;
+            uint8_t g = (y * 255) / framebuffer->h;
+            uint8_t b = ((x / 8 + y / 8 + seed) & 1) ? 0xff : (seed * 40);
+
+            switch (framebuffer->format) {
+                case BADGEVMS_PIXELFORMAT_RGB565:
+                case BADGEVMS_PIXELFORMAT_BGR565:
+                    framebuffer->framebuffer.pixels[y * framebuffer->w + x] = rgb888_to_rgb565(r, g, b);
+                    break;
+                default: {
+                    uint8_t a = translucent ? (x * 255) / framebuffer->w : 0xff;
+                    ((uint32_t *)framebuffer->framebuffer.pixels)[y * framebuffer->w + x] =
+                        ((uint32_t)a << 24) | (r << 16) | (g << 8) | b;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+static window_t *sim_window_create(
+    char const *title, window_rect_t rect, window_size_t fb_size, pixel_format_t format, window_flag_t flags, int seed
+) {
+    window_t              *window      = calloc(1, sizeof(window_t));
+    managed_framebuffer_t *framebuffer = calloc(1, sizeof(managed_framebuffer_t));
+    bool                   is_565      = format == BADGEVMS_PIXELFORMAT_RGB565 || format == BADGEVMS_PIXELFORMAT_BGR565;
+
+    framebuffer->w                  = fb_size.w;
+    framebuffer->h                  = fb_size.h;
+    framebuffer->format             = format;
+    framebuffer->framebuffer.w      = fb_size.w;
+    framebuffer->framebuffer.h      = fb_size.h;
+    framebuffer->framebuffer.format = format;
+    framebuffer->framebuffer.pixels = calloc(fb_size.w * fb_size.h, is_565 ? 2 : 4);
+    atomic_flag_test_and_set(&framebuffer->clean);
+
+    window->framebuffers[0] = framebuffer;
+    window->title           = strdup(title);
+    window->flags           = flags;
+    window->rect            = rect;
+    if (flags & WINDOW_FLAG_FULLSCREEN) {
+        window->rect = (window_rect_t){0, 0, FRAMEBUFFER_MAX_W, FRAMEBUFFER_MAX_H};
+    }
+
+    fill_pattern(framebuffer, seed, flags & WINDOW_FLAG_ALPHA);
+
+    if (window_stack) {
+        window_t *tail = window_stack->prev;
+        window->next       = window_stack;
+        window->prev       = tail;
+        tail->next         = window;
+        window_stack->prev = window;
+    } else {
+        window->next = window;
+        window->prev = window;
+    }
+    window_stack = window;
+    mark_scene_damaged();
+
+    return window;
+}
+
+static void sim_window_present(window_t *window, int seed) {
+    managed_framebuffer_t *framebuffer = window->framebuffers[window->front_fb];
+    fill_pattern(framebuffer, seed, window->flags & WINDOW_FLAG_ALPHA);
+    atomic_flag_clear(&framebuffer->clean);
+}
+
+static void sim_window_move(window_t *window, int x, int y) {
+    window->rect.x = x;
+    window->rect.y = y;
+    mark_scene_damaged();
+}
+
+// Like ALT-TAB, rotates the stack until window is in front
+static void sim_window_raise(window_t *window) {
+    window_stack = window;
+    mark_stack_damaged(window_stack);
+}
+
+static void sim_destroy_all(void) {
+    while (window_stack) {
+        window_t *window = window_stack;
+        if (window->next == window) {
+            window_stack = NULL;
+        } else {
+            window->prev->next = window->next;
+            window->next->prev = window->prev;
+            window_stack       = window->next;
+        }
+        free(window->framebuffers[0]->framebuffer.pixels);
+        free(window->framebuffers[0]);
+        free(window->title);
+        free(window);
+    }
+    mark_scene_damaged();
+}
+
+// Scenarios
+
+static void scenario_single(void) {
+    window_t *window = sim_window_create(
+        "Single",
+        (window_rect_t){100, 120, 200, 150},
+        (window_size_t){200, 150},
+        BADGEVMS_PIXELFORMAT_RGB565,
+        0,
+        1
+    );
+    sim_settle();
+
+    sim_window_present(window, 2);
+    sim_settle();
+}
+
+static void scenario_overlap(void) {
+    window_t *a = sim_window_create(
+        "Back",
+        (window_rect_t){40, 60, 300, 240},
+        (window_size_t){300, 240},
+        BADGEVMS_PIXELFORMAT_RGB565,
+        0,
+        1
+    );
+    window_t *b = sim_window_create(
+        "Middle",
+        (window_rect_t){200, 180, 260, 200},
+        (window_size_t){260, 200},
+        BADGEVMS_PIXELFORMAT_BGR565,
+        0,
+        2
+    );
+    sim_window_create(
+        "Front",
+        (window_rect_t){120, 300, 320, 160},
+        (window_size_t){320, 160},
+        BADGEVMS_PIXELFORMAT_ABGR8888,
+        0,
+        3
+    );
+    sim_settle();
+
+    // Content updates of partially covered windows
+    sim_window_present(a, 4);
+    sim_frame();
+    sim_window_present(b, 5);
+    sim_settle();
+
+    sim_window_raise(b);
+    sim_settle();
+
+    sim_window_move(a, 300, 400);
+    sim_settle();
+}
+
+static void scenario_scaled(void) {
+    sim_window_create(
+        "Double",
+        (window_rect_t){20, 40, 400, 300},
+        (window_size_t){200, 150},
+        BADGEVMS_PIXELFORMAT_RGB565,
+        0,
+        1
+    );
+    window_t *window = sim_window_create(
+        "One and a half",
+        (window_rect_t){300, 320, 300, 225},
+        (window_size_t){200, 150},
+        BADGEVMS_PIXELFORMAT_RGBA8888,
+        0,
+        2
+    );
+    sim_settle();
+
+    sim_window_present(window, 3);
+    sim_settle();
+}
+
+static void scenario_fullscreen(void) {
+    sim_window_create(
+        "Behind",
+        (window_rect_t){50, 50, 200, 200},
+        (window_size_t){200, 200},
+        BADGEVMS_PIXELFORMAT_RGB565,
+        0,
+        1
+    );
+    window_t *window = sim_window_create(
+        "Fullscreen",
+        (window_rect_t){0},
+        (window_size_t){360, 360},
+        BADGEVMS_PIXELFORMAT_RGB565,
+        WINDOW_FLAG_FULLSCREEN,
+        2
+    );
+    sim_settle();
+
+    sim_window_present(window, 3);
+    sim_settle();
+}
+
+static void scenario_translucent(void) {
+    window_t *background = sim_window_create(
+        "Background",
+        (window_rect_t){20, 20, 600, 560},
+        (window_size_t){300, 280},
+        BADGEVMS_PIXELFORMAT_RGB565,
+        0,
+        1
+    );
+    window_t *overlay = sim_window_create(
+        "Overlay A",
+        (window_rect_t){100, 150, 320, 200},
+        (window_size_t){160, 100},
+        BADGEVMS_PIXELFORMAT_ARGB8888,
+        WINDOW_FLAG_ALPHA,
+        2
+    );
+    sim_window_create(
+        "Overlay B",
+        (window_rect_t){250, 250, 200, 200},
+        (window_size_t){200, 200},
+        BADGEVMS_PIXELFORMAT_BGRA8888,
+        WINDOW_FLAG_ALPHA,
+        3
+    );
+    sim_settle();
+
+    // Whatever shines through changed
+    sim_window_present(background, 4);
+    sim_settle();
+
+    sim_window_move(overlay, 300, 100);
+    sim_window_present(overlay, 5);
+    sim_settle();
+
+    // Nothing changed, so nothing gets blended again, not even the translucent window on top
+    uint32_t blends = ppa_blends;
+    sim_settle();
+    CHECK(ppa_blends == blends);
+}
+
+static void scenario_split(void) {
+    // Leaves strips of 65 and 33 lines visible, which have to be split up for the PPA
+    sim_window_create(
+        "Tall",
+        (window_rect_t){100, 100, 300, 300},
+        (window_size_t){300, 300},
+        BADGEVMS_PIXELFORMAT_RGB565,
+        0,
+        1
+    );
+    sim_window_create(
+        "Cover",
+        (window_rect_t){50, 125 + 65, 400, 100},
+        (window_size_t){200, 50},
+        BADGEVMS_PIXELFORMAT_RGB565,
+        0,
+        2
+    );
+    sim_settle();
+}
+
+typedef struct {
+    char const *name;
+    void (*run)(void);
+} scenario_t;
+
+static scenario_t const scenarios[] = {
+    {"single", scenario_single},
+    {"overlap", scenario_overlap},
+    {"scaled", scenario_scaled},
+    {"fullscreen", scenario_fullscreen},
+    {"translucent", scenario_translucent},
+    {"split", scenario_split},
+};
+
+#define NUM_SCENARIOS (sizeof(scenarios) / sizeof(scenarios[0]))
+
+static void sim_reset(rotation_angle_t angle) {
+    rotation = angle;
+    cur_fb   = 0;
+    for (int i = 0; i < DISPLAY_FRAMEBUFFERS; i++) {
+        memset(framebuffers[i], 0, FRAMEBUFFER_BYTES);
+    }
+    memset(panel, 0, FRAMEBUFFER_BYTES);
+    mark_scene_damaged();
+    frames_scanned_out = 0;
+    frame_us_total     = 0;
+    ppa_us_total       = 0;
+    frames_timed       = 0;
+}
+
+static uint32_t fnv1a(uint16_t const *pixels, size_t count) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < count; i++) {
+        hash = (hash ^ (pixels[i] & 0xff)) * 16777619u;
+        hash = (hash ^ (pixels[i] >> 8)) * 16777619u;
+    }
+    return hash;
+}
+
+// What the user sees, undoing the panel rotation
+static uint32_t logical_hash(void) {
+    uint32_t hash = 2166136261u;
+    for (int y = 0; y < FRAMEBUFFER_MAX_H; y++) {
+        for (int x = 0; x < FRAMEBUFFER_MAX_W; x++) {
+            int fb_x, fb_y;
+            rotate_coordinates(x, y, rotation, &fb_x, &fb_y);
+            uint16_t pixel = panel[fb_y * FRAMEBUFFER_MAX_W + fb_x];
+            hash           = (hash ^ (pixel & 0xff)) * 16777619u;
+            hash           = (hash ^ (pixel >> 8)) * 16777619u;
+        }
+    }
+    return hash;
+}
+
+static void dump_ppm(char const *dir, char const *name, int angle) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s_%s.ppm", dir, name, rotation_names[angle]);
+
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        printf("Unable to write %s\n", path);
+        return;
+    }
+
+    // Clients are rgb_swapped onto the panel, so blue sits in the top bits
+    fprintf(f, "P6\n%d %d\n255\n", FRAMEBUFFER_MAX_W, FRAMEBUFFER_MAX_H);
+    for (int i = 0; i < PANEL_PIXELS; i++) {
+        uint8_t rgb[3] = {
+            (panel[i] & 0x1f) << 3,
+            ((panel[i] >> 5) & 0x3f) << 2,
+            ((panel[i] >> 11) & 0x1f) << 3,
+        };
+        fwrite(rgb, 1, 3, f);
+    }
+    fclose(f);
+}
+
+static bool golden_lookup(char const *scenario, int angle, uint32_t *hash) {
+    for (size_t i = 0; i < sizeof(goldens) / sizeof(goldens[0]); i++) {
+        if (goldens[i].scenario && !strcmp(goldens[i].scenario, scenario) && goldens[i].rotation == angle) {
+            *hash = goldens[i].hash;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void run_scenarios(char const *dump_dir) {
+    verify_frames = true;
+
+    if (update_goldens) {
+        printf("static golden_t const goldens[] = {\n");
+    }
+
+    for (size_t s = 0; s < NUM_SCENARIOS; s++) {
+        uint32_t logical[4];
+
+        for (int angle = ROTATION_ANGLE_0; angle <= ROTATION_ANGLE_270; angle++) {
+            sim_reset(angle);
+            scenarios[s].run();
+
+            uint32_t hash  = fnv1a(panel, PANEL_PIXELS);
+            logical[angle] = logical_hash();
+
+            if (dump_dir) {
+                dump_ppm(dump_dir, scenarios[s].name, angle);
+            }
+
+            if (update_goldens) {
+                printf("    {\"%s\", %d, 0x%08x},\n", scenarios[s].name, angle, hash);
+            } else {
+                uint32_t expected;
+                if (!golden_lookup(scenarios[s].name, angle, &expected)) {
+                    printf("FAIL %s rotation %s: no golden\n", scenarios[s].name, rotation_names[angle]);
+                    failures++;
+                } else if (hash != expected) {
+                    printf(
+                        "FAIL %s rotation %s: got 0x%08x expected 0x%08x\n",
+                        scenarios[s].name,
+                        rotation_names[angle],
+                        hash,
+                        expected
+                    );
+                    failures++;
+                }
+
+                printf(
+                    "%-12s rotation %-3s %3u frames, avg %6llu us/frame, %6llu us in the PPA\n",
+                    scenarios[s].name,
+                    rotation_names[angle],
+                    frames_scanned_out,
+                    (unsigned long long)(frame_us_total / frames_timed),
+                    (unsigned long long)(ppa_us_total / frames_timed)
+                );
+            }
+
+            sim_destroy_all();
+        }
+
+        // The panel is mounted rotated, what ends up in front of the user must not depend on that
+        for (int angle = ROTATION_ANGLE_90; angle <= ROTATION_ANGLE_270; angle++) {
+            if (logical[angle] != logical[ROTATION_ANGLE_0]) {
+                printf(
+                    "FAIL %s: rotation %s looks different from rotation 0\n",
+                    scenarios[s].name,
+                    rotation_names[angle]
+                );
+                failures++;
+            }
+        }
+    }
+
+    if (update_goldens) {
+        printf("};\n");
+    }
+}
+
+// Every window presents every frame, the worst case for the renderer
+static void run_benchmark(void) {
+    verify_frames = false;
+
+    for (int angle = ROTATION_ANGLE_0; angle <= ROTATION_ANGLE_270; angle++) {
+        window_t *windows[MAX_WINDOWS];
+
+        sim_reset(angle);
+        for (int i = 0; i < MAX_WINDOWS; i++) {
+            char title[20];
+            snprintf(title, sizeof(title), "Bench %d", i);
+            windows[i] = sim_window_create(
+                title,
+                (window_rect_t){20 + i * 30, 20 + i * 30, 320, 240},
+                (i & 1) ? (window_size_t){160, 120} : (window_size_t){320, 240},
+                BADGEVMS_PIXELFORMAT_RGB565,
+                0,
+                i
+            );
+        }
+        sim_frame();
+
+        frame_us_total = 0;
+        ppa_us_total   = 0;
+        frames_timed   = 0;
+        for (int frame = 0; frame < BENCH_FRAMES; frame++) {
+            for (int i = 0; i < MAX_WINDOWS; i++) {
+                atomic_flag_clear(&windows[i]->framebuffers[0]->clean);
+            }
+            sim_frame();
+        }
+
+        printf(
+            "bench        rotation %-3s %3d windows, avg %6llu us/frame, %6llu us in the PPA\n",
+            rotation_names[angle],
+            MAX_WINDOWS,
+            (unsigned long long)(frame_us_total / frames_timed),
+            (unsigned long long)(ppa_us_total / frames_timed)
+        );
+
+        sim_destroy_all();
+    }
+}
+
+static bool rects_cover(rect_array_t *rects, window_rect_t area) {
+    int total = 0;
+    for (int i = 0; i < rects->count; i++) {
+        total += rects->rects[i].w * rects->rects[i].h;
+    }
+    return total == area.w * area.h;
+}
+
+static void test_split_rects(void) {
+    int const heights[] = {33, 65, 97, 129};
+
+    for (size_t i = 0; i < sizeof(heights) / sizeof(heights[0]); i++) {
+        window_rect_t rect    = {10, 20, 100, heights[i]};
+        rect_array_t  visible = {.count = 1, .rects = {rect}};
+        int           passes  = 0;
+
+        while (ppa_workaround_split_rects(&visible, 1.0) && passes < 10) {
+            passes++;
+        }
+
+        CHECK(passes >= 1 && passes < 10);
+        CHECK(rects_cover(&visible, rect));
+        for (int j = 0; j < visible.count; j++) {
+            CHECK(visible.rects[j].h % 32 != 1 || visible.rects[j].h <= 32);
+        }
+    }
+
+    // A 130 line high strip at scale 2 is 65 lines in the client framebuffer
+    {
+        window_rect_t rect    = {0, 0, 50, 130};
+        rect_array_t  visible = {.count = 1, .rects = {rect}};
+        int           passes  = 0;
+
+        while (ppa_workaround_split_rects(&visible, 2.0) && passes < 10) {
+            passes++;
+        }
+
+        CHECK(passes >= 1 && passes < 10);
+        CHECK(rects_cover(&visible, rect));
+        for (int j = 0; j < visible.count; j++) {
+            int fb_height = (int)(visible.rects[j].h / 2.0);
+            CHECK(fb_height % 32 != 1 || fb_height <= 32);
+        }
+    }
+
+    // Harmless heights are left alone
+    {
+        rect_array_t visible = {.count = 3, .rects = {{0, 0, 10, 32}, {0, 32, 10, 64}, {0, 96, 10, 1}}};
+        CHECK(!ppa_workaround_split_rects(&visible, 1.0));
+        CHECK(visible.count == 3);
+        CHECK(visible.rects[1].h == 64);
+    }
+
+    // A full array of problematic strips can't grow past the array
+    {
+        rect_array_t visible = {.count = MAX_VISIBLE_RECTS};
+        for (int j = 0; j < MAX_VISIBLE_RECTS; j++) {
+            visible.rects[j] = (window_rect_t){0, j * 65, 10, 65};
+        }
+
+        CHECK(ppa_workaround_split_rects(&visible, 1.0));
+        CHECK(visible.count == MAX_VISIBLE_RECTS);
+        for (int j = 0; j < visible.count; j++) {
+            CHECK(visible.rects[j].h > 0 && visible.rects[j].h < 65);
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    char const *dump_dir = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--update")) {
+            update_goldens = true;
+        } else if (!strcmp(argv[i], "--dump") && i + 1 < argc) {
+            dump_dir = argv[++i];
+        } else {
+            printf("Usage: %s [--update] [--dump DIR]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    for (int i = 0; i < DISPLAY_FRAMEBUFFERS; i++) {
+        framebuffers[i] = malloc(FRAMEBUFFER_BYTES);
+    }
+    panel     = malloc(FRAMEBUFFER_BYTES);
+    reference = malloc(FRAMEBUFFER_BYTES);
+
+    if (!render_init()) {
+        printf("FAIL render_init\n");
+        return 1;
+    }
+
+    test_split_rects();
+    run_scenarios(dump_dir);
+
+    if (!update_goldens) {
+        run_benchmark();
+    }
+
+    CHECK(ppa_errors == 0);
+
+    return check_report("compositor_sim");
+}
@@ -0,0 +1,412 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// The per-process cookie store: cookie dates, domain and path matching, which cookies go with which request and in
+// what order, expiry, eviction, the cookie jar round trip and when the jar needs writing. Ends with threads sharing a
+// store and a microbenchmark of header lookups in a full store.
+
+#include "cookie_store.h"
+#include "badgevms_config.h"
+#include "check.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <time.h>
+
+#define CHECK_HEADER(store, url, now, expected)                                                                        \
+    do {                                                                                                               \
+        char header[1024];                                                                                             \
+        cookie_store_header(store, url, now, header, sizeof(header));                                                  \
+        if (strcmp(header, expected) != 0) {                                                                           \
+            printf("FAIL %s:%d: %s got '%s' want '%s'\n", __FILE__, __LINE__, url, header, expected);                  \
+            failures++;                                                                                                \
+        }                                                                                                              \
+    } while (0)
+
+#define NOW            1700000000
+#define STRESS_THREADS 8
+#define STRESS_OPS     20000
+#define BENCH_LOOKUPS  200000
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void) {
+    pthread_mutex_t *mutex = malloc(sizeof(pthread_mutex_t));
+    pthread_mutex_init(mutex, NULL);
+    return mutex;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks) {
+    (void)ticks;
+    pthread_mutex_lock(semaphore);
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore) {
+    pthread_mutex_unlock(semaphore);
+    return pdTRUE;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t semaphore) {
+    pthread_mutex_destroy(semaphore);
+    free(semaphore);
+}
+
+static void test_dates(void) {
+    // 2015-10-21 07:28:00 UTC
+    CHECK(cookie_parse_date("Wed, 21 Oct 2015 07:28:00 GMT") == 1445412480);
+    CHECK(cookie_parse_date("Wednesday, 21-Oct-15 07:28:00 GMT") == 1445412480);
+    CHECK(cookie_parse_date("Wed Oct 21 07:28:00 2015") == 1445412480);
+    CHECK(cookie_parse_date("21 october 2015 7:28:0") == 1445412480);
+    CHECK(cookie_parse_date("Thu, 01 Jan 1970 00:00:00 GMT") == 0);
+    CHECK(cookie_parse_date("Tue, 29 Feb 2028 12:00:00 GMT") == 1835438400);
+    CHECK(cookie_parse_date("Fri, 31 Dec 2100 23:59:59 GMT") == 4133980799);
+
+    CHECK(cookie_parse_date("") == -1);
+    CHECK(cookie_parse_date("tomorrow") == -1);
+    CHECK(cookie_parse_date("Wed, 21 Oct 2015 GMT") == -1);
+    CHECK(cookie_parse_date("Wed, 32 Oct 2015 07:28:00 GMT") == -1);
+    CHECK(cookie_parse_date("Tue, 29 Feb 2027 12:00:00 GMT") == -1);
+    CHECK(cookie_parse_date("Wed, 21 Oct 2015 24:00:00 GMT") == -1);
+    CHECK(cookie_parse_date("Wed, 21 Foo 2015 07:28:00 GMT") == -1);
+    CHECK(cookie_parse_date("Wed, 21 Oct 1600 07:28:00 GMT") == -1);
+}
+
+static void test_matching(void) {
+    CHECK(cookie_domain_match("example.com", "example.com"));
+    CHECK(cookie_domain_match("www.example.com", "example.com"));
+    CHECK(cookie_domain_match("a.b.example.com", "example.com"));
+    CHECK(cookie_domain_match("WWW.Example.COM", "example.com"));
+    CHECK(!cookie_domain_match("badexample.com", "example.com"));
+    CHECK(!cookie_domain_match("example.com", "www.example.com"));
+    CHECK(!cookie_domain_match("10.0.0.1", "0.0.1"));
+    CHECK(cookie_domain_match("10.0.0.1", "10.0.0.1"));
+
+    CHECK(cookie_path_match("/", 1, "/"));
+    CHECK(cookie_path_match("/api/v1", 7, "/"));
+    CHECK(cookie_path_match("/api/v1", 7, "/api"));
+    CHECK(cookie_path_match("/api/v1", 7, "/api/"));
+    CHECK(cookie_path_match("/api", 4, "/api"));
+    CHECK(!cookie_path_match("/apiv1", 6, "/api"));
+    CHECK(!cookie_path_match("/ap", 3, "/api"));
+    CHECK(!cookie_path_match("/", 1, "/api"));
+}
+
+static void test_requests(void) {
+    cookie_store_t *store = cookie_store_create();
+
+    CHECK(cookie_store_receive(store, "https://www.example.com/a/b", "host=1", NOW));
+    CHECK(cookie_store_receive(store, "https://www.example.com/a/b", "dom=2; Domain=.Example.com; Path=/", NOW));
+    CHECK(cookie_store_receive(store, "https://www.example.com/a/b", "deep=3; Path=/a/b/c", NOW));
+    CHECK(cookie_store_receive(store, "https://www.example.com/", "sec=4; Secure; HttpOnly", NOW));
+    CHECK(cookie_store_receive(store, "http://user:pw@www.example.com:8080/x?y=/z", "port=5", NOW));
+
+    // Rejected: another site, a top level domain, a secure cookie over http, no name or no value separator
+    CHECK(!cookie_store_receive(store, "https://www.example.com/", "evil=1; Domain=example.org", NOW));
+    CHECK(!cookie_store_receive(store, "https://www.example.com/", "tld=1; Domain=com", NOW));
+    CHECK(!cookie_store_receive(store, "http://www.example.com/", "sec2=1; Secure", NOW));
+    CHECK(!cookie_store_receive(store, "https://www.example.com/", "=1", NOW));
+    CHECK(!cookie_store_receive(store, "https://www.example.com/", "novalue", NOW));
+    CHECK(!cookie_store_receive(store, "ftp://www.example.com/", "a=1", NOW));
+    CHECK(cookie_store_count(store) == 5);
+
+    // Host-only cookies stay on their host, default paths are the request's directory, longer paths go first. Cookies
+    // don't care about ports, and plain ones go over https too.
+    CHECK_HEADER(store, "https://www.example.com/a/b/c/d", NOW, "deep=3; host=1; dom=2; sec=4; port=5");
+    CHECK_HEADER(store, "https://www.example.com/a/x", NOW, "host=1; dom=2; sec=4; port=5");
+    CHECK_HEADER(store, "http://www.example.com/a/x", NOW, "host=1; dom=2; port=5");
+    CHECK_HEADER(store, "https://api.example.com/a/b/c", NOW, "dom=2");
+    CHECK_HEADER(store, "https://example.com/", NOW, "dom=2");
+    CHECK_HEADER(store, "https://example.org/", NOW, "");
+    CHECK_HEADER(store, "https://www.example.com/x#frag", NOW, "dom=2; sec=4; port=5");
+
+    // The same name, domain and path replaces a cookie, keeping its place
+    CHECK(cookie_store_receive(store, "https://www.example.com/", "dom=7; Domain=example.com", NOW));
+    CHECK_HEADER(store, "https://example.com/", NOW, "dom=7");
+    CHECK(cookie_store_count(store) == 5);
+
+    // Deleting through Max-Age and a date in the past
+    CHECK(cookie_store_receive(store, "https://www.example.com/", "dom=; Domain=example.com; Max-Age=0", NOW));
+    CHECK(cookie_store_receive(store, "https://www.example.com/", "sec=; Expires=Thu, 01 Jan 1970 00:00:00 GMT", NOW));
+    CHECK_HEADER(store, "https://www.example.com/a/b/c", NOW, "deep=3; host=1; port=5");
+    CHECK(cookie_store_count(store) == 3);
+
+    // Max-Age wins over Expires, both run out
+    CHECK(cookie_store_receive(store, "https://t.example.com/", "a=1; Max-Age=60; Expires=31 Dec 2100 0:0:0", NOW));
+    CHECK(cookie_store_receive(store, "https://t.example.com/", "b=2; Expires=Tue, 14 Nov 2023 22:15:00 GMT", NOW));
+    CHECK_HEADER(store, "https://t.example.com/", NOW, "a=1; b=2");
+    CHECK_HEADER(store, "https://t.example.com/", NOW + 59, "a=1; b=2");
+    CHECK_HEADER(store, "https://t.example.com/", NOW + 60, "b=2");
+    CHECK_HEADER(store, "https://t.example.com/", NOW + 2000, "");
+
+    // A cookie that doesn't fit is left out whole, the length needed is still returned
+    char   small[12];
+    size_t len = cookie_store_header(store, "https://www.example.com/a/b/c", NOW, small, sizeof(small));
+    CHECK(len == strlen("deep=3; host=1; port=5"));
+    CHECK(strcmp(small, "deep=3") == 0);
+    CHECK(cookie_store_header(store, "https://www.example.com/a/b/c", NOW, NULL, 0) == len);
+
+    // Without a URL, like CURLOPT_COOKIELIST, a Domain is required
+    CHECK(!cookie_store_receive(store, NULL, "x=1", NOW));
+    CHECK(cookie_store_receive(store, NULL, "x=1; Domain=example.net", NOW));
+    CHECK_HEADER(store, "https://www.example.net/", NOW, "x=1");
+
+    cookie_store_destroy(store);
+}
+
+typedef struct {
+    char   data[64 * 1024];
+    size_t len;
+    int    lines;
+} jar_t;
+
+static bool jar_write(void *ctx, char const *line) {
+    jar_t *jar = ctx;
+    size_t len = strlen(line);
+    if (jar->len + len >= sizeof(jar->data)) {
+        return false;
+    }
+    memcpy(jar->data + jar->len, line, len + 1);
+    jar->len += len;
+    jar->lines++;
+    return true;
+}
+
+static bool jar_fail(void *ctx, char const *line) {
+    (void)ctx;
+    (void)line;
+    return false;
+}
+
+static void load_jar(cookie_store_t *store, jar_t *jar, time_t now) {
+    for (char *line = jar->data; *line;) {
+        char *end = strchr(line, '\n');
+        cookie_store_load_line(store, line, now);
+        line = end ? end + 1 : line + strlen(line);
+    }
+}
+
+static void test_jar(void) {
+    cookie_store_t *store = cookie_store_create();
+    static jar_t    jar;
+
+    CHECK(!cookie_store_needs_save(store, NOW, 0));
+
+    cookie_store_receive(store, "https://www.example.com/a/", "host=1; SameSite=Strict", NOW);
+    cookie_store_receive(store, "https://www.example.com/", "dom=2; Domain=example.com; Max-Age=3600", NOW);
+    cookie_store_receive(store, "https://www.example.com/", "sec=3; Secure; HttpOnly; Max-Age=10", NOW);
+
+    // Changes wait for the delay, counted from the first one
+    CHECK(cookie_store_needs_save(store, NOW, 0));
+    CHECK(!cookie_store_needs_save(store, NOW + COOKIE_JAR_SAVE_DELAY_S - 1, COOKIE_JAR_SAVE_DELAY_S));
+    CHECK(cookie_store_needs_save(store, NOW + COOKIE_JAR_SAVE_DELAY_S, COOKIE_JAR_SAVE_DELAY_S));
+
+    CHECK(cookie_store_save(store, NOW, jar_fail, NULL) == -1);
+    CHECK(cookie_store_needs_save(store, NOW, 0));
+
+    memset(&jar, 0, sizeof(jar));
+    CHECK(cookie_store_save(store, NOW, jar_write, &jar) == 3);
+    CHECK(jar.lines == 5);
+    CHECK(!cookie_store_needs_save(store, NOW, 0));
+
+    // The same cookie sent again is not a change, a new value is
+    cookie_store_receive(store, "https://www.example.com/a/", "host=1; SameSite=Strict", NOW + 1);
+    CHECK(!cookie_store_needs_save(store, NOW + 1, 0));
+    cookie_store_receive(store, "https://www.example.com/a/", "host=9; SameSite=Strict", NOW + 1);
+    CHECK(cookie_store_needs_save(store, NOW + 1, 0));
+
+    // Loading gives the same cookies back and doesn't count as a change, expired ones are skipped
+    cookie_store_t *loaded = cookie_store_create();
+    load_jar(loaded, &jar, NOW);
+    CHECK(cookie_store_count(loaded) == 3);
+    CHECK(!cookie_store_needs_save(loaded, NOW, 0));
+    CHECK_HEADER(loaded, "https://www.example.com/a/b", NOW, "host=1; dom=2; sec=3");
+    CHECK_HEADER(loaded, "https://api.example.com/a/b", NOW, "dom=2");
+    CHECK_HEADER(loaded, "http://www.example.com/a/b", NOW, "host=1; dom=2");
+    cookie_store_destroy(loaded);
+
+    loaded = cookie_store_create();
+    load_jar(loaded, &jar, NOW + 10);
+    CHECK(cookie_store_count(loaded) == 2);
+    cookie_store_destroy(loaded);
+
+    // Jars from before host_only was saved, with a trailing tab, and lines that aren't cookies
+    loaded = cookie_store_create();
+    CHECK(cookie_store_load_line(loaded, "old\t1\texample.com\t/\t0\t0\t0\t0\t\n", NOW));
+    CHECK(!cookie_store_load_line(loaded, "# comment\n", NOW));
+    CHECK(!cookie_store_load_line(loaded, "\n", NOW));
+    CHECK(!cookie_store_load_line(loaded, "short\t1\texample.com\n", NOW));
+    CHECK(!cookie_store_load_line(loaded, "nopath\t1\texample.com\tx\t0\t0\t0\t0\n", NOW));
+    CHECK_HEADER(loaded, "https://www.example.com/", NOW, "old=1");
+    cookie_store_destroy(loaded);
+
+    // Clearing session cookies leaves the others
+    cookie_store_save(store, NOW, jar_write, &jar);
+    cookie_store_clear(store, true, NOW);
+    CHECK(cookie_store_count(store) == 2);
+    CHECK(cookie_store_needs_save(store, NOW, 0));
+    cookie_store_clear(store, false, NOW);
+    CHECK(cookie_store_count(store) == 0);
+
+    cookie_store_destroy(store);
+}
+
+static void test_eviction(void) {
+    cookie_store_t *store = cookie_store_create();
+    char            url[64];
+    char            cookie[32];
+
+    for (int i = 0; i < COOKIE_STORE_MAX_COOKIES; i++) {
+        snprintf(url, sizeof(url), "https://host%d.example.com/", i);
+        snprintf(cookie, sizeof(cookie), "c%d=%d", i, i);
+        cookie_store_receive(store, url, cookie, NOW);
+    }
+    CHECK(cookie_store_count(store) == COOKIE_STORE_MAX_COOKIES);
+
+    // Using the first cookie makes the second the least recently used one
+    CHECK_HEADER(store, "https://host0.example.com/", NOW, "c0=0");
+    cookie_store_receive(store, "https://new.example.com/", "new=1", NOW);
+    CHECK(cookie_store_count(store) == COOKIE_STORE_MAX_COOKIES);
+    CHECK_HEADER(store, "https://host0.example.com/", NOW, "c0=0");
+    CHECK_HEADER(store, "https://host1.example.com/", NOW, "");
+    CHECK_HEADER(store, "https://new.example.com/", NOW, "new=1");
+
+    // Expired cookies go before any live one
+    cookie_store_receive(store, "https://host2.example.com/", "c2=2; Max-Age=1", NOW);
+    cookie_store_receive(store, "https://new2.example.com/", "new=2", NOW + 5);
+    CHECK(cookie_store_count(store) == COOKIE_STORE_MAX_COOKIES);
+    CHECK_HEADER(store, "https://host3.example.com/", NOW + 5, "c3=3");
+
+    cookie_store_destroy(store);
+}
+
+typedef struct {
+    cookie_store_t *store;
+    int             id;
+} stress_arg_t;
+
+static void *stress_thread(void *arg) {
+    stress_arg_t *stress = arg;
+    char          url[64];
+    char          cookie[32];
+    char          header[4096];
+    unsigned      seed = stress->id;
+
+    for (int i = 0; i < STRESS_OPS; i++) {
+        int host = rand_r(&seed) % 16;
+        snprintf(url, sizeof(url), "https://h%d.example.com/p%d", host, stress->id);
+        if (i % 4 == 0) {
+            snprintf(cookie, sizeof(cookie), "t%d=%d; Domain=example.com", stress->id, i);
+            cookie_store_receive(stress->store, url, cookie, NOW);
+        } else if (i % 4 == 1) {
+            snprintf(cookie, sizeof(cookie), "h%d=%d; Max-Age=%d", stress->id, i, i % 3);
+            cookie_store_receive(stress->store, url, cookie, NOW + i % 2);
+        } else {
+            size_t len = cookie_store_header(stress->store, url, NOW + 1, header, sizeof(header));
+            if (len >= sizeof(header) || strlen(header) != len) {
+                printf("FAIL header length %zu for %s\n", len, url);
+                failures++;
+            }
+        }
+    }
+    return NULL;
+}
+
+static void test_stress(void) {
+    cookie_store_t *store = cookie_store_create();
+    pthread_t       threads[STRESS_THREADS];
+    stress_arg_t    args[STRESS_THREADS];
+
+    for (int i = 0; i < STRESS_THREADS; i++) {
+        args[i] = (stress_arg_t){store, i};
+        pthread_create(&threads[i], NULL, stress_thread, &args[i]);
+    }
+    for (int i = 0; i < STRESS_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    // Each thread ends up with its domain cookie plus whatever host cookies haven't run out
+    char header[4096];
+    cookie_store_header(store, "https://example.com/", NOW + 1, header, sizeof(header));
+    for (int i = 0; i < STRESS_THREADS; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "t%d=", i);
+        CHECK(strstr(header, name) != NULL);
+    }
+    CHECK(cookie_store_count(store) <= COOKIE_STORE_MAX_COOKIES);
+
+    cookie_store_destroy(store);
+}
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// A full store spread over many sites, looked up for one of them. The old cookie list went through every cookie for
+// every request.
+static void bench(void) {
+    cookie_store_t *store = cookie_store_create();
+    char            url[64];
+    char            cookie[48];
+    char            header[1024];
+
+    for (int i = 0; i < COOKIE_STORE_MAX_COOKIES; i++) {
+        snprintf(url, sizeof(url), "https://www.site%d.com/", i % 32);
+        snprintf(cookie, sizeof(cookie), "session%d=0123456789abcdef", i);
+        cookie_store_receive(store, url, cookie, NOW);
+    }
+
+    double start = now_us();
+    size_t total = 0;
+    for (int i = 0; i < BENCH_LOOKUPS; i++) {
+        snprintf(url, sizeof(url), "https://www.site%d.com/api/v1/items", i % 32);
+        total += cookie_store_header(store, url, NOW, header, sizeof(header));
+    }
+    double elapsed = now_us() - start;
+
+    CHECK(total > 0);
+    CHECK_HEADER(
+        store,
+        "https://www.site5.com/",
+        NOW,
+        "session5=0123456789abcdef; session37=0123456789abcdef; session69=0123456789abcdef; "
+        "session101=0123456789abcdef"
+    );
+    printf("cookie_store_test: %d lookups in a store of %d cookies, %.2fus each\n", BENCH_LOOKUPS,
+           COOKIE_STORE_MAX_COOKIES, elapsed / BENCH_LOOKUPS);
+
+    cookie_store_destroy(store);
+}
+
+int main(void) {
+    test_dates();
+    test_matching();
+    test_requests();
+    test_jar();
+    test_eviction();
+    test_stress();
+    bench();
+
+    return check_report("cookie_store_test");
+}
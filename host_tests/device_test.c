@@ -0,0 +1,205 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+// The device table: registration, then reader threads looking up devices while a writer registers others. A reader
+// must always find the devices registered before it started and must never get the wrong device for a name. Ends with
+// a microbenchmark of lookups.
+
+#include "badgevms/device.h"
+#include "badgevms_config.h"
+#include "check.h"
+#include "device_private.h"
+#include "esp_system.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <time.h>
+#include <unistd.h>
+
+#define STABLE_DEVICES 8
+#define CHURN_DEVICES  8
+#define READERS        4
+#define BENCH_LOOKUPS  1000000
+
+typedef struct {
+    device_t device;
+    char     name[DEVICE_NAME_MAX];
+} fake_device_t;
+
+static atomic_bool   writer_done;
+static atomic_long   reader_lookups;
+static fake_device_t stable[STABLE_DEVICES];
+static fake_device_t churn[CHURN_DEVICES];
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void) {
+    pthread_mutex_t *mutex = malloc(sizeof(pthread_mutex_t));
+    pthread_mutex_init(mutex, NULL);
+    return mutex;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks) {
+    (void)ticks;
+    pthread_mutex_lock(semaphore);
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore) {
+    pthread_mutex_unlock(semaphore);
+    return pdTRUE;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t semaphore) {
+    pthread_mutex_destroy(semaphore);
+    free(semaphore);
+}
+
+esp_err_t esp_register_shutdown_handler(shutdown_handler_t handle) {
+    (void)handle;
+    return ESP_OK;
+}
+
+static void test_registry(void) {
+    static fake_device_t a = {.device.type = DEVICE_TYPE_FILESYSTEM};
+    static fake_device_t b = {.device.type = DEVICE_TYPE_FILESYSTEM};
+
+    CHECK(device_get("FAKE0") == NULL);
+    CHECK(device_register("FAKE0", &a.device));
+    CHECK(!device_register("FAKE0", &b.device));
+    CHECK(!device_register("A_NAME_THAT_IS_TOO_LONG", &b.device));
+    CHECK(!device_register("FAKE1", NULL));
+    CHECK(device_get("FAKE0") == &a.device);
+    CHECK(device_get("FAKE") == NULL);
+    CHECK(device_get("FAKE00") == NULL);
+    CHECK(device_get(NULL) == NULL);
+
+    CHECK(device_register("FAKE1", &b.device));
+    CHECK(device_get("FAKE0") == &a.device);
+    CHECK(device_get("FAKE1") == &b.device);
+
+    // Fill the table up, the devices of the stress test are already in there
+    static fake_device_t extra[DEVICE_TABLE_SLOTS];
+    char                 name[DEVICE_NAME_MAX];
+    int                  registered = STABLE_DEVICES + CHURN_DEVICES + 2;
+    for (int i = 0; i < DEVICE_TABLE_SLOTS; i++) {
+        snprintf(name, sizeof(name), "EXTRA%d", i);
+        registered += device_register(name, &extra[i].device);
+    }
+    CHECK(registered == DEVICE_TABLE_SLOTS);
+
+    int room = DEVICE_TABLE_SLOTS - STABLE_DEVICES - CHURN_DEVICES - 2;
+    for (int i = 0; i < DEVICE_TABLE_SLOTS; i++) {
+        snprintf(name, sizeof(name), "EXTRA%d", i);
+        CHECK(device_get(name) == (i < room ? &extra[i].device : NULL));
+    }
+    CHECK(device_get("FAKE0") == &a.device);
+}
+
+static void *reader(void *arg) {
+    unsigned int seed = (uintptr_t)arg;
+    long         n    = 0;
+
+    while (!atomic_load(&writer_done)) {
+        int i = rand_r(&seed) % STABLE_DEVICES;
+        if (device_get(stable[i].name) != &stable[i].device) {
+            failures++;
+        }
+
+        int       c      = rand_r(&seed) % CHURN_DEVICES;
+        device_t *device = device_get(churn[c].name);
+        if (device && device != &churn[c].device) {
+            failures++;
+        }
+        n++;
+    }
+
+    atomic_fetch_add(&reader_lookups, n * 2);
+    return NULL;
+}
+
+static void test_stress(void) {
+    for (int i = 0; i < STABLE_DEVICES; i++) {
+        snprintf(stable[i].name, sizeof(stable[i].name), "STABLE%d", i);
+        CHECK(device_register(stable[i].name, &stable[i].device));
+    }
+    for (int i = 0; i < CHURN_DEVICES; i++) {
+        snprintf(churn[i].name, sizeof(churn[i].name), "CHURN%d", i);
+    }
+
+    pthread_t threads[READERS];
+    for (int i = 0; i < READERS; i++) {
+        pthread_create(&threads[i], NULL, reader, (void *)(uintptr_t)(i + 1));
+    }
+
+    // New slots get filled in under the readers, give them time to look up each state of the table
+    for (int i = 0; i < CHURN_DEVICES; i++) {
+        usleep(10000);
+        CHECK(device_register(churn[i].name, &churn[i].device));
+    }
+    usleep(10000);
+    atomic_store(&writer_done, true);
+
+    for (int i = 0; i < READERS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (int i = 0; i < CHURN_DEVICES; i++) {
+        CHECK(device_get(churn[i].name) == &churn[i].device);
+    }
+
+    printf(
+        "device_test: %d readers did %ld lookups during %d registrations\n",
+        READERS,
+        atomic_load(&reader_lookups),
+        CHURN_DEVICES
+    );
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void bench(void) {
+    int    found = 0;
+    double start = now_ms();
+    for (int n = 0; n < BENCH_LOOKUPS; n++) {
+        found += device_get(stable[n % STABLE_DEVICES].name) != NULL;
+    }
+    double lookups = now_ms() - start;
+    CHECK(found == BENCH_LOOKUPS);
+
+    printf("device_test: device_get %.1fns\n", lookups * 1000000.0 / BENCH_LOOKUPS);
+}
+
+int main(void) {
+    CHECK(device_init());
+
+    test_stress();
+    test_registry();
+    bench();
+
+    return check_report("device_test");
+}
@@ -0,0 +1,464 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Reads directories spread over a search list of fake filesystem devices with thousands of entries each. Checks that
+// every name is returned exactly once with shadowing, that telldir/seekdir/rewinddir agree with a plain read, and
+// measures how much work happens before the first entry comes back.
+//
+// Usage: dir_stream_test [ENTRIES_PER_DEVICE]
+
+#define _GNU_SOURCE
+
+#include "badgevms/device.h"
+#include "check.h"
+#include "dir_stream.h"
+#include "esp_heap_caps.h"
+#include "logical_names.h"
+#include "why_io.h"
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <errno.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define NUM_FAKE_FS 3
+#define MAX_ID      100000
+
+typedef struct {
+    filesystem_device_t filesystem;
+    char const         *name;
+    int                 first;
+    int                 count;
+    int                 opendir_calls;
+    int                 readdir_calls;
+    int                 stat_calls;
+    int                 open_dirs;
+} fake_fs_t;
+
+typedef struct {
+    fake_fs_t    *fs;
+    int           next;
+    struct dirent dirent;
+} fake_dir_t;
+
+static int       live_allocations;
+static fake_fs_t fake_fs[NUM_FAKE_FS];
+
+// Kernel heap, counted so a stream can be shown not to grow
+
+void *why_malloc(size_t size) {
+    live_allocations++;
+    return malloc(size);
+}
+
+void *why_calloc(size_t nmemb, size_t size) {
+    live_allocations++;
+    return calloc(nmemb, size);
+}
+
+void why_free(void *ptr) {
+    if (ptr) {
+        live_allocations--;
+    }
+    free(ptr);
+}
+
+// The stat cache is left uninitialized, so shadowing is always checked against the fake filesystems
+
+void *heap_caps_malloc(size_t size, uint32_t caps) {
+    (void)caps;
+    return malloc(size);
+}
+
+void heap_caps_free(void *ptr) {
+    free(ptr);
+}
+
+char *why_strdup(char const *s) {
+    live_allocations++;
+    return strdup(s);
+}
+
+int why_asprintf(char **restrict strp, char const *restrict fmt, ...) {
+    live_allocations++;
+    va_list ap;
+    va_start(ap, fmt);
+    int ret = vasprintf(strp, fmt, ap);
+    va_end(ap);
+    return ret;
+}
+
+// Only pathfuncs.c's helpers use these, which this test doesn't call
+
+int why_stat(char const *restrict pathname, struct stat *restrict statbuf) {
+    (void)pathname;
+    (void)statbuf;
+    return -1;
+}
+
+int why_mkdir(char const *pathname, mode_t mode) {
+    (void)pathname;
+    (void)mode;
+    return -1;
+}
+
+int why_unlink(char const *pathname) {
+    (void)pathname;
+    return -1;
+}
+
+int why_rmdir(char const *pathname) {
+    (void)pathname;
+    return -1;
+}
+
+DIR *why_opendir(char const *name) {
+    (void)name;
+    return NULL;
+}
+
+struct dirent *why_readdir(DIR *dirp) {
+    (void)dirp;
+    return NULL;
+}
+
+int why_closedir(DIR *dirp) {
+    (void)dirp;
+    return -1;
+}
+
+// Fake filesystems, each has one directory [APPS] holding appNNNNN.json for ids first..first+count-1
+
+static bool fake_is_apps(path_t *path) {
+    return path->directory && strcmp(path->directory, "APPS") == 0;
+}
+
+static bool fake_has(fake_fs_t *fs, char const *filename) {
+    int  id;
+    char check[32];
+    if (sscanf(filename, "app%d.json", &id) != 1) {
+        return false;
+    }
+    snprintf(check, sizeof(check), "app%05d.json", id);
+    return strcmp(check, filename) == 0 && id >= fs->first && id < fs->first + fs->count;
+}
+
+static int fake_stat(void *dev, path_t *path, struct stat *restrict statbuf) {
+    fake_fs_t *fs = dev;
+    fs->stat_calls++;
+    if (!fake_is_apps(path) || !path->filename || !fake_has(fs, path->filename)) {
+        return -1;
+    }
+    memset(statbuf, 0, sizeof(*statbuf));
+    statbuf->st_mode = S_IFREG;
+    return 0;
+}
+
+static DIR *fake_opendir(void *dev, path_t *path) {
+    fake_fs_t *fs = dev;
+    fs->opendir_calls++;
+    if (!fake_is_apps(path) || path->filename) {
+        return NULL;
+    }
+
+    fake_dir_t *dir = calloc(1, sizeof(fake_dir_t));
+    dir->fs         = fs;
+    fs->open_dirs++;
+    return (DIR *)dir;
+}
+
+// "." and ".." come first, like on FAT
+static struct dirent *fake_readdir(void *dev, DIR *dirp) {
+    fake_fs_t  *fs  = dev;
+    fake_dir_t *dir = (fake_dir_t *)dirp;
+    fs->readdir_calls++;
+
+    int n = dir->next++;
+    if (n == 0) {
+        strcpy(dir->dirent.d_name, ".");
+    } else if (n == 1) {
+        strcpy(dir->dirent.d_name, "..");
+    } else if (n - 2 < fs->count) {
+        snprintf(dir->dirent.d_name, sizeof(dir->dirent.d_name), "app%05d.json", fs->first + n - 2);
+    } else {
+        return NULL;
+    }
+    return &dir->dirent;
+}
+
+static int fake_closedir(void *dev, DIR *dirp) {
+    fake_fs_t *fs = dev;
+    fs->open_dirs--;
+    free(dirp);
+    return 0;
+}
+
+device_t *device_get(char const *name) {
+    for (int i = 0; i < NUM_FAKE_FS; i++) {
+        if (strcmp(fake_fs[i].name, name) == 0) {
+            return &fake_fs[i].filesystem.device;
+        }
+    }
+    return NULL;
+}
+
+static void fake_fs_init(int per_device) {
+    static char const *const names[NUM_FAKE_FS] = {"FAKE0", "FAKE1", "FAKE2"};
+
+    for (int i = 0; i < NUM_FAKE_FS; i++) {
+        memset(&fake_fs[i], 0, sizeof(fake_fs_t));
+        fake_fs[i].filesystem.device.type = DEVICE_TYPE_FILESYSTEM;
+        fake_fs[i].filesystem._stat       = fake_stat;
+        fake_fs[i].filesystem._opendir    = fake_opendir;
+        fake_fs[i].filesystem._readdir    = fake_readdir;
+        fake_fs[i].filesystem._closedir   = fake_closedir;
+        fake_fs[i].name                   = names[i];
+        // Each device overlaps half of the previous one
+        fake_fs[i].first                  = i * per_device / 2;
+        fake_fs[i].count                  = per_device;
+    }
+}
+
+static void fake_fs_reset_counters(void) {
+    for (int i = 0; i < NUM_FAKE_FS; i++) {
+        fake_fs[i].opendir_calls = 0;
+        fake_fs[i].readdir_calls = 0;
+        fake_fs[i].stat_calls    = 0;
+    }
+}
+
+static int fake_fs_counter_sum(size_t offset) {
+    int sum = 0;
+    for (int i = 0; i < NUM_FAKE_FS; i++) {
+        sum += *(int *)((char *)&fake_fs[i] + offset);
+    }
+    return sum;
+}
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int entry_id(struct dirent *entry) {
+    int id = -1;
+    sscanf(entry->d_name, "app%d.json", &id);
+    return id;
+}
+
+// Every id in the union of the devices exactly once, in a stable order
+static void check_contents(int per_device, int *order, int *count) {
+    static uint8_t seen[MAX_ID];
+    memset(seen, 0, sizeof(seen));
+
+    int           err;
+    dir_stream_t *stream = dir_stream_open("APPS:", &err);
+    CHECK(stream != NULL);
+    if (!stream) {
+        return;
+    }
+
+    int            live_open = live_allocations;
+    int            n         = 0;
+    struct dirent *entry;
+    while ((entry = dir_stream_read(stream)) != NULL) {
+        int id = entry_id(entry);
+        CHECK(id >= 0 && id < MAX_ID);
+        if (id < 0 || id >= MAX_ID) {
+            continue;
+        }
+        CHECK(seen[id] == 0);
+        seen[id]++;
+        order[n++] = id;
+    }
+
+    // The stream does not hold on to what it has read
+    CHECK(live_allocations == live_open);
+
+    int expected = (NUM_FAKE_FS - 1) * per_device / 2 + per_device;
+    CHECK(n == expected);
+    for (int id = 0; id < expected; id++) {
+        CHECK(seen[id] == 1);
+    }
+
+    CHECK(dir_stream_tell(stream) == n);
+    CHECK(dir_stream_read(stream) == NULL);
+
+    dir_stream_close(stream);
+    *count = n;
+}
+
+static void check_positions(int const *order, int count) {
+    int           err;
+    dir_stream_t *stream = dir_stream_open("APPS:", &err);
+    CHECK(stream != NULL);
+    if (!stream) {
+        return;
+    }
+
+    // Rewinding is free, the next read starts over
+    for (int i = 0; i < 10; i++) {
+        dir_stream_read(stream);
+    }
+    fake_fs_reset_counters();
+    dir_stream_rewind(stream);
+    CHECK(fake_fs_counter_sum(offsetof(fake_fs_t, readdir_calls)) == 0);
+    CHECK(dir_stream_tell(stream) == 0);
+
+    struct dirent *entry = dir_stream_read(stream);
+    CHECK(entry && entry_id(entry) == order[0]);
+
+    // Forward seeks only read what they skip
+    long targets[] = {1, 7, count / 3, count / 2, count - 1};
+    for (size_t i = 0; i < sizeof(targets) / sizeof(targets[0]); i++) {
+        dir_stream_seek(stream, targets[i]);
+        CHECK(dir_stream_tell(stream) == targets[i]);
+        entry = dir_stream_read(stream);
+        CHECK(entry && entry_id(entry) == order[targets[i]]);
+    }
+
+    // Backwards seeks and seeks to what telldir returned
+    long backwards[] = {count / 2, 3, 0, count - 2};
+    for (size_t i = 0; i < sizeof(backwards) / sizeof(backwards[0]); i++) {
+        dir_stream_seek(stream, backwards[i]);
+        long loc = dir_stream_tell(stream);
+        CHECK(loc == backwards[i]);
+        entry = dir_stream_read(stream);
+        CHECK(entry && entry_id(entry) == order[loc]);
+    }
+
+    // Past the end just ends up at the end
+    dir_stream_seek(stream, count + 100);
+    CHECK(dir_stream_tell(stream) == count);
+    CHECK(dir_stream_read(stream) == NULL);
+
+    dir_stream_close(stream);
+}
+
+static void check_errors(void) {
+    int err = 0;
+    CHECK(dir_stream_open("NOSUCH:[APPS]", &err) == NULL);
+    CHECK(err == ENOENT);
+
+    err = 0;
+    CHECK(dir_stream_open("FAKE0:[NOPE]", &err) == NULL);
+    CHECK(err == ENOENT);
+
+    // A search list whose first members are unreadable starts at the first one that is
+    err                  = 0;
+    dir_stream_t *stream = dir_stream_open("LATE:", &err);
+    CHECK(stream != NULL);
+    if (stream) {
+        struct dirent *entry = dir_stream_read(stream);
+        CHECK(entry && entry_id(entry) == fake_fs[2].first);
+        dir_stream_close(stream);
+    }
+}
+
+// What a process that dies halfway through a directory leaves behind
+static void check_abort(void) {
+    int           err;
+    dir_stream_t *stream = dir_stream_open("APPS:", &err);
+    CHECK(stream != NULL);
+    if (!stream) {
+        return;
+    }
+
+    dir_stream_read(stream);
+    CHECK(fake_fs_counter_sum(offsetof(fake_fs_t, open_dirs)) == 1);
+
+    int live = live_allocations;
+    dir_stream_abort(stream);
+    CHECK(fake_fs_counter_sum(offsetof(fake_fs_t, open_dirs)) == 0);
+    CHECK(live_allocations == live);
+
+    dir_stream_close(stream);
+}
+
+static void measure(int per_device, int count) {
+    int           err;
+    double        start  = now_us();
+    dir_stream_t *stream = dir_stream_open("APPS:", &err);
+    fake_fs_reset_counters();
+    struct dirent *first       = stream ? dir_stream_read(stream) : NULL;
+    double         first_us    = now_us() - start;
+    int            first_reads = fake_fs_counter_sum(offsetof(fake_fs_t, readdir_calls));
+
+    CHECK(first != NULL);
+    CHECK(first_reads <= 3);
+
+    fake_fs_reset_counters();
+    int n = 1;
+    while (dir_stream_read(stream)) {
+        n++;
+    }
+    double all_us = now_us() - start;
+    int    stats  = fake_fs_counter_sum(offsetof(fake_fs_t, stat_calls));
+    CHECK(n == count);
+
+    dir_stream_close(stream);
+
+    printf(
+        "dir_stream_test: %d devices x %d entries, first entry after %d device reads in %.1fus, all %d in %.1fus, "
+        "%d shadow stats\n",
+        NUM_FAKE_FS,
+        per_device,
+        first_reads,
+        first_us,
+        n,
+        all_us,
+        stats
+    );
+}
+
+int main(int argc, char *argv[]) {
+    int per_device = argc > 1 ? atoi(argv[1]) : 5000;
+    if (per_device < 16 || per_device > MAX_ID / NUM_FAKE_FS) {
+        printf("ENTRIES_PER_DEVICE must be between 16 and %d\n", MAX_ID / NUM_FAKE_FS);
+        return 1;
+    }
+
+    logical_names_system_init();
+    logical_name_set("APPS:", "FAKE0:[APPS], NOSUCH:[APPS], FAKE1:[APPS], FAKE2:[APPS], FAKE0:[EMPTY]", false);
+    logical_name_set("LATE:", "NOSUCH:[APPS], FAKE1:[NOPE], FAKE2:[APPS]", false);
+
+    fake_fs_init(per_device);
+
+    int *order = calloc(MAX_ID, sizeof(int));
+    int  count = 0;
+
+    check_contents(per_device, order, &count);
+    check_positions(order, count);
+    check_errors();
+    check_abort();
+    measure(per_device, count);
+
+    // Small enough that the shadow filter stays sparse
+    fake_fs_init(200);
+    check_contents(200, order, &count);
+    check_positions(order, count);
+    measure(200, count);
+
+    free(order);
+
+    return check_report("dir_stream_test");
+}
@@ -0,0 +1,631 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// The DNS resolver against two stub servers on the loopback interface: A and AAAA answers, CNAME chains behind
+// compressed names, names that don't exist, families without addresses, a server failing over to the next, late and
+// missing answers, answers that don't belong to the query, sharing queries and the cache with its TTLs.
+
+#define _GNU_SOURCE
+
+#include "dns_resolver.h"
+#include "check.h"
+#include "esp_heap_caps.h"
+#include "esp_random.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/poll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SERVERS         2
+#define PENDING_MAX     32
+#define SLOW_ANSWER_MS  300
+#define DELAY_ANSWER_MS 100
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+    UBaseType_t     count;
+    UBaseType_t     max;
+} semaphore_t;
+
+typedef struct {
+    int64_t                 due;
+    struct sockaddr_storage to;
+    socklen_t               to_len;
+    size_t                  len;
+    uint8_t                 data[512];
+} pending_t;
+
+typedef struct {
+    int        fd;
+    int        port;
+    atomic_int received;
+    pending_t  pending[PENDING_MAX];
+} server_t;
+
+static atomic_long clock_skew;
+static atomic_bool stopping;
+static atomic_bool no_servers;
+static atomic_bool ipv6_usable;
+static server_t    servers[SERVERS];
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max_count, UBaseType_t initial_count) {
+    semaphore_t *semaphore = calloc(1, sizeof(semaphore_t));
+    pthread_mutex_init(&semaphore->mutex, NULL);
+    pthread_cond_init(&semaphore->cond, NULL);
+    semaphore->count = initial_count;
+    semaphore->max   = max_count;
+    return semaphore;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void) {
+    return xSemaphoreCreateCounting(1, 0);
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void) {
+    return xSemaphoreCreateCounting(1, 1);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t handle, TickType_t ticks) {
+    semaphore_t    *semaphore = handle;
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec  += ticks / 1000;
+    deadline.tv_nsec += (ticks % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&semaphore->mutex);
+    while (!semaphore->count) {
+        if (ticks == 0) {
+            break;
+        } else if (ticks == portMAX_DELAY) {
+            pthread_cond_wait(&semaphore->cond, &semaphore->mutex);
+        } else if (pthread_cond_timedwait(&semaphore->cond, &semaphore->mutex, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+
+    BaseType_t taken = semaphore->count ? pdTRUE : pdFALSE;
+    if (taken) {
+        semaphore->count--;
+    }
+    pthread_mutex_unlock(&semaphore->mutex);
+    return taken;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t handle) {
+    semaphore_t *semaphore = handle;
+    BaseType_t   given     = pdFALSE;
+
+    pthread_mutex_lock(&semaphore->mutex);
+    if (semaphore->count < semaphore->max) {
+        semaphore->count++;
+        given = pdTRUE;
+        pthread_cond_signal(&semaphore->cond);
+    }
+    pthread_mutex_unlock(&semaphore->mutex);
+    return given;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t handle) {
+    semaphore_t *semaphore = handle;
+    pthread_mutex_destroy(&semaphore->mutex);
+    pthread_cond_destroy(&semaphore->cond);
+    free(semaphore);
+}
+
+void *heap_caps_malloc(size_t size, uint32_t caps) {
+    (void)caps;
+    return malloc(size);
+}
+
+void heap_caps_free(void *ptr) {
+    free(ptr);
+}
+
+uint32_t esp_random(void) {
+    return (uint32_t)random();
+}
+
+// Skewed forward to let cached answers expire without waiting for them
+int64_t esp_timer_get_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000 + atomic_load(&clock_skew);
+}
+
+static int64_t real_time(void) {
+    return esp_timer_get_time() - atomic_load(&clock_skew);
+}
+
+static uint8_t *put16(uint8_t *p, uint16_t value) {
+    p[0] = value >> 8;
+    p[1] = value & 0xff;
+    return p + 2;
+}
+
+static uint8_t *put32(uint8_t *p, uint32_t value) {
+    return put16(put16(p, value >> 16), value & 0xffff);
+}
+
+static uint8_t *put_name(uint8_t *p, char const *name) {
+    while (*name) {
+        char const *dot = strchr(name, '.');
+        size_t      len = dot ? (size_t)(dot - name) : strlen(name);
+        *p++            = len;
+        memcpy(p, name, len);
+        p    += len;
+        name += dot ? len + 1 : len;
+    }
+    *p++ = 0;
+    return p;
+}
+
+static uint8_t *put_record(uint8_t *p, uint16_t owner, uint16_t type, uint32_t ttl, void const *rdata, size_t len) {
+    p = put16(p, 0xc000 | owner);
+    p = put16(p, type);
+    p = put16(p, 1);
+    p = put32(p, ttl);
+    p = put16(p, len);
+    memcpy(p, rdata, len);
+    return p + len;
+}
+
+static uint8_t *put_soa(uint8_t *p, uint32_t ttl, uint32_t minimum) {
+    uint8_t  rdata[128];
+    uint8_t *r = put_name(rdata, "ns.test");
+    r          = put_name(r, "hostmaster.test");
+    r          = put32(r, 1);
+    r          = put32(r, 3600);
+    r          = put32(r, 600);
+    r          = put32(r, 86400);
+    r          = put32(r, minimum);
+    return put_record(p, 12, 6, ttl, rdata, r - rdata);
+}
+
+static void set_counts(uint8_t *packet, uint16_t answers, uint16_t authority) {
+    put16(packet + 6, answers);
+    put16(packet + 8, authority);
+}
+
+static void queue(
+    server_t *server, struct sockaddr_storage const *to, socklen_t to_len, void const *data, size_t len, int delay_ms
+) {
+    for (int i = 0; i < PENDING_MAX; i++) {
+        pending_t *pending = &server->pending[i];
+        if (!pending->due) {
+            pending->due    = real_time() + delay_ms * 1000LL + 1;
+            pending->to     = *to;
+            pending->to_len = to_len;
+            pending->len    = len;
+            memcpy(pending->data, data, len);
+            return;
+        }
+    }
+}
+
+static void answer(
+    server_t *server, uint8_t const *query, size_t len, struct sockaddr_storage const *from, socklen_t from_len
+) {
+    char   name[256] = "";
+    size_t pos       = 12;
+    size_t name_len  = 0;
+
+    while (pos < len && query[pos]) {
+        if (name_len) {
+            name[name_len++] = '.';
+        }
+        memcpy(name + name_len, query + pos + 1, query[pos]);
+        name_len += query[pos];
+        pos      += query[pos] + 1;
+    }
+    name[name_len] = '\0';
+    pos++;
+    if (pos + 4 > len) {
+        return;
+    }
+
+    uint16_t type   = query[pos] << 8 | query[pos + 1];
+    bool     v6     = type == 28;
+    size_t   header = pos + 4;
+    int      index  = server - servers;
+    uint8_t  packet[512];
+    uint8_t *p = packet + header;
+
+    memcpy(packet, query, header);
+    put16(packet + 2, 0x8180);
+
+    uint8_t a[4], aaaa[16];
+    if (strcmp(name, "silent.test") == 0) {
+        return;
+    } else if (strcmp(name, "example.test") == 0) {
+        if (v6) {
+            inet_pton(AF_INET6, "2001:db8::1", aaaa);
+            p = put_record(p, 12, 28, 60, aaaa, 16);
+            set_counts(packet, 1, 0);
+        } else {
+            inet_pton(AF_INET, "192.0.2.1", a);
+            p = put_record(p, 12, 1, 60, a, 4);
+            inet_pton(AF_INET, "192.0.2.2", a);
+            p = put_record(p, 12, 1, 60, a, 4);
+            set_counts(packet, 2, 0);
+        }
+    } else if (strcmp(name, "alias.test") == 0) {
+        // alias.test -> middle.test -> target.test, with the addresses first and the chain backwards
+        uint8_t  middle[32], target[32];
+        size_t   middle_len = put_name(middle, "middle.test") - middle;
+        size_t   target_len = put_name(target, "target.test") - target;
+        uint8_t *addresses  = p;
+
+        // Leave room for the address record owned by the second CNAME's target, patched in below
+        p                    = put_record(p, 0, v6 ? 28 : 1, 10, aaaa, v6 ? 16 : 4);
+        size_t second        = p - packet;
+        p                    = put_record(p, 0, 5, 30, target, target_len);
+        size_t first         = p - packet;
+        p                    = put_record(p, 12, 5, 30, middle, middle_len);
+        size_t target_offset = second + 12;
+        size_t middle_offset = first + 12;
+        put16(addresses, 0xc000 | target_offset);
+        put16(packet + second, 0xc000 | middle_offset);
+        if (v6) {
+            inet_pton(AF_INET6, "2001:db8::10", addresses + 12);
+        } else {
+            inet_pton(AF_INET, "192.0.2.10", addresses + 12);
+        }
+        set_counts(packet, 3, 0);
+    } else if (strcmp(name, "missing.test") == 0) {
+        put16(packet + 2, 0x8183);
+        p = put_soa(p, 60, 30);
+        set_counts(packet, 0, 1);
+    } else if (strcmp(name, "nosoa.test") == 0) {
+        put16(packet + 2, 0x8183);
+        set_counts(packet, 0, 0);
+    } else if (strcmp(name, "v4only.test") == 0) {
+        if (v6) {
+            p = put_soa(p, 20, 20);
+            set_counts(packet, 0, 1);
+        } else {
+            inet_pton(AF_INET, "192.0.2.20", a);
+            p = put_record(p, 12, 1, 60, a, 4);
+            set_counts(packet, 1, 0);
+        }
+    } else if (strcmp(name, "slow6.test") == 0 || strcmp(name, "delay.test") == 0) {
+        if (v6) {
+            inet_pton(AF_INET6, "2001:db8::30", aaaa);
+            p = put_record(p, 12, 28, 60, aaaa, 16);
+        } else {
+            inet_pton(AF_INET, "192.0.2.30", a);
+            p = put_record(p, 12, 1, 60, a, 4);
+        }
+        set_counts(packet, 1, 0);
+        int delay = name[0] == 'd' ? DELAY_ANSWER_MS : v6 ? SLOW_ANSWER_MS : 0;
+        queue(server, from, from_len, packet, p - packet, delay);
+        return;
+    } else if (strcmp(name, "failover.test") == 0) {
+        if (index == 0) {
+            put16(packet + 2, 0x8182);
+            set_counts(packet, 0, 0);
+        } else if (v6) {
+            inet_pton(AF_INET6, "2001:db8::40", aaaa);
+            p = put_record(p, 12, 28, 60, aaaa, 16);
+            set_counts(packet, 1, 0);
+        } else {
+            inet_pton(AF_INET, "192.0.2.40", a);
+            p = put_record(p, 12, 1, 60, a, 4);
+            set_counts(packet, 1, 0);
+        }
+    } else if (strcmp(name, "noise.test") == 0) {
+        inet_pton(AF_INET, "192.0.2.66", a);
+        p = put_record(p, 12, 1, 60, a, 4);
+        set_counts(packet, 1, 0);
+
+        // Someone else's id, a question that wasn't asked, a record running off the end and a pointer loop
+        uint8_t bogus[512];
+        memcpy(bogus, packet, p - packet);
+        put16(bogus, (query[0] << 8 | query[1]) ^ 0x5a5a);
+        queue(server, from, from_len, bogus, p - packet, 0);
+        memcpy(bogus, packet, p - packet);
+        bogus[13] = 'm';
+        queue(server, from, from_len, bogus, p - packet, 0);
+        memcpy(bogus, packet, p - packet);
+        queue(server, from, from_len, bogus, p - packet - 3, 0);
+        memcpy(bogus, packet, p - packet);
+        put16(bogus + header, 0xc000 | header);
+        queue(server, from, from_len, bogus, p - packet, 0);
+
+        inet_pton(AF_INET, "192.0.2.60", packet + header + 12);
+    } else if (strcmp(name, "short.test") == 0) {
+        inet_pton(AF_INET, "192.0.2.50", a);
+        p = put_record(p, 12, 1, 1, a, 4);
+        set_counts(packet, 1, 0);
+    } else if (strncmp(name, "host", 4) == 0 && !v6) {
+        a[0] = 10;
+        a[1] = 0;
+        a[2] = 0;
+        a[3] = atoi(name + 4);
+        p    = put_record(p, 12, 1, 60, a, 4);
+        set_counts(packet, 1, 0);
+    } else {
+        put16(packet + 2, 0x8183);
+        set_counts(packet, 0, 0);
+    }
+
+    queue(server, from, from_len, packet, p - packet, 0);
+}
+
+static void *serve(void *arg) {
+    server_t *server = arg;
+    uint8_t   packet[512];
+
+    while (!atomic_load(&stopping)) {
+        struct pollfd pfd = {.fd = server->fd, .events = POLLIN};
+        if (poll(&pfd, 1, 2) > 0) {
+            struct sockaddr_storage from;
+            socklen_t               from_len = sizeof(from);
+            ssize_t len = recvfrom(server->fd, packet, sizeof(packet), 0, (struct sockaddr *)&from, &from_len);
+            if (len > 12) {
+                atomic_fetch_add(&server->received, 1);
+                answer(server, packet, len, &from, from_len);
+            }
+        }
+
+        int64_t now = real_time();
+        for (int i = 0; i < PENDING_MAX; i++) {
+            pending_t *pending = &server->pending[i];
+            if (pending->due && pending->due <= now) {
+                sendto(server->fd, pending->data, pending->len, 0, (struct sockaddr *)&pending->to, pending->to_len);
+                pending->due = 0;
+            }
+        }
+    }
+    return NULL;
+}
+
+static size_t get_servers(void *ctx, struct sockaddr_storage *addresses, size_t max) {
+    (void)ctx;
+    if (atomic_load(&no_servers)) {
+        return 0;
+    }
+
+    size_t count = 0;
+    for (; count < SERVERS && count < max; count++) {
+        struct sockaddr_in *sin = (struct sockaddr_in *)&addresses[count];
+        memset(&addresses[count], 0, sizeof(struct sockaddr_storage));
+        sin->sin_family      = AF_INET;
+        sin->sin_port        = htons(servers[count].port);
+        sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    }
+    return count;
+}
+
+static bool get_ipv6_usable(void *ctx) {
+    (void)ctx;
+    return atomic_load(&ipv6_usable);
+}
+
+static void *run_resolver(void *arg) {
+    dns_resolver_run(arg);
+    return NULL;
+}
+
+static dns_status_t lookup(dns_resolver_t *resolver, char const *name, int family, dns_result_t *result) {
+    dns_query_t *query = dns_query_start(resolver, name, family);
+    dns_query_wait(query, -1);
+    dns_query_result(query, result);
+    dns_query_release(query);
+    return result->status;
+}
+
+static bool has_address(dns_result_t const *result, size_t index, int family, char const *text) {
+    uint8_t addr[16] = {0};
+    inet_pton(family, text, addr);
+    return index < result->count && result->addresses[index].family == family &&
+           memcmp(result->addresses[index].addr, addr, family == AF_INET ? 4 : 16) == 0;
+}
+
+static int received(void) {
+    return atomic_load(&servers[0].received) + atomic_load(&servers[1].received);
+}
+
+static double now_ms(void) {
+    return real_time() / 1000.0;
+}
+
+int main(void) {
+    pthread_t server_threads[SERVERS];
+    for (int i = 0; i < SERVERS; i++) {
+        struct sockaddr_in address = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+        socklen_t          len     = sizeof(address);
+
+        servers[i].fd = socket(AF_INET, SOCK_DGRAM, 0);
+        bind(servers[i].fd, (struct sockaddr *)&address, sizeof(address));
+        getsockname(servers[i].fd, (struct sockaddr *)&address, &len);
+        servers[i].port = ntohs(address.sin_port);
+        pthread_create(&server_threads[i], NULL, serve, &servers[i]);
+    }
+
+    atomic_store(&ipv6_usable, true);
+    dns_resolver_ops_t ops      = {.servers = get_servers, .ipv6_usable = get_ipv6_usable};
+    dns_resolver_t    *resolver = dns_resolver_create(&ops, NULL);
+    pthread_t          resolver_thread;
+    pthread_create(&resolver_thread, NULL, run_resolver, resolver);
+
+    dns_result_t result;
+    dns_stats_t  stats, before;
+
+    // Both families at once, IPv6 first
+    CHECK(lookup(resolver, "example.test", AF_UNSPEC, &result) == DNS_STATUS_OK);
+    CHECK(result.count == 3);
+    CHECK(has_address(&result, 0, AF_INET6, "2001:db8::1"));
+    CHECK(has_address(&result, 1, AF_INET, "192.0.2.1"));
+    CHECK(has_address(&result, 2, AF_INET, "192.0.2.2"));
+    dns_resolver_stats_get(resolver, &stats);
+    CHECK(stats.queries == 2);
+
+    // From the cache, for either family and however the name is written
+    int sent = received();
+    CHECK(lookup(resolver, "example.test", AF_UNSPEC, &result) == DNS_STATUS_OK && result.count == 3);
+    CHECK(lookup(resolver, "Example.TEST.", AF_INET, &result) == DNS_STATUS_OK && result.count == 2);
+    CHECK(has_address(&result, 0, AF_INET, "192.0.2.1"));
+    CHECK(dns_resolver_cached(resolver, "example.test", AF_INET6, &result) && result.count == 1);
+    CHECK(received() == sent);
+    dns_resolver_stats_get(resolver, &stats);
+    CHECK(stats.hits == 2);
+
+    // CNAME chains behind compressed names, answered in any order
+    CHECK(lookup(resolver, "alias.test", AF_INET, &result) == DNS_STATUS_OK);
+    CHECK(result.count == 1 && has_address(&result, 0, AF_INET, "192.0.2.10"));
+    CHECK(lookup(resolver, "alias.test", AF_INET6, &result) == DNS_STATUS_OK);
+    CHECK(result.count == 1 && has_address(&result, 0, AF_INET6, "2001:db8::10"));
+
+    // Names that don't exist are remembered for the SOA's negative TTL, but not without one
+    dns_resolver_stats_get(resolver, &before);
+    CHECK(lookup(resolver, "missing.test", AF_UNSPEC, &result) == DNS_STATUS_NOT_FOUND && result.count == 0);
+    CHECK(lookup(resolver, "missing.test", AF_UNSPEC, &result) == DNS_STATUS_NOT_FOUND);
+    CHECK(lookup(resolver, "nosoa.test", AF_INET, &result) == DNS_STATUS_NOT_FOUND);
+    CHECK(lookup(resolver, "nosoa.test", AF_INET, &result) == DNS_STATUS_NOT_FOUND);
+    dns_resolver_stats_get(resolver, &stats);
+    CHECK(stats.negative - before.negative == 1);
+    CHECK(stats.queries - before.queries == 4);
+
+    // A family without addresses
+    CHECK(lookup(resolver, "v4only.test", AF_UNSPEC, &result) == DNS_STATUS_OK);
+    CHECK(result.count == 1 && has_address(&result, 0, AF_INET, "192.0.2.20"));
+    CHECK(lookup(resolver, "v4only.test", AF_INET6, &result) == DNS_STATUS_NOT_FOUND);
+
+    // A slow family doesn't hold up the lookup, its answer still makes it into the cache
+    double start = now_ms();
+    CHECK(lookup(resolver, "slow6.test", AF_UNSPEC, &result) == DNS_STATUS_OK);
+    CHECK(now_ms() - start < SLOW_ANSWER_MS);
+    CHECK(result.count == 1 && has_address(&result, 0, AF_INET, "192.0.2.30"));
+    usleep((SLOW_ANSWER_MS + 200) * 1000);
+    CHECK(dns_resolver_cached(resolver, "slow6.test", AF_INET6, &result));
+    CHECK(has_address(&result, 0, AF_INET6, "2001:db8::30"));
+
+    // The first server fails, the second answers
+    CHECK(lookup(resolver, "failover.test", AF_UNSPEC, &result) == DNS_STATUS_OK && result.count == 2);
+    CHECK(atomic_load(&servers[1].received) > 0);
+
+    // Answers that don't belong to the query or are broken are ignored
+    CHECK(lookup(resolver, "noise.test", AF_INET, &result) == DNS_STATUS_OK);
+    CHECK(result.count == 1 && has_address(&result, 0, AF_INET, "192.0.2.60"));
+
+    // Lookups of a name in flight share its query, which signals its fd once done
+    dns_resolver_stats_get(resolver, &before);
+    dns_query_t *first  = dns_query_start(resolver, "delay.test", AF_UNSPEC);
+    dns_query_t *second = dns_query_start(resolver, "delay.test", AF_UNSPEC);
+    CHECK(first == second);
+    CHECK(!dns_query_done(first));
+    CHECK(dns_query_wait(first, 10) == DNS_STATUS_PENDING);
+    struct pollfd pfd = {.fd = dns_query_fd(first), .events = POLLIN};
+    CHECK(poll(&pfd, 1, 5000) == 1);
+    CHECK(dns_query_done(first));
+    CHECK(dns_query_wait(first, -1) == DNS_STATUS_OK && dns_query_wait(second, -1) == DNS_STATUS_OK);
+    dns_query_release(first);
+    dns_query_release(second);
+    dns_resolver_stats_get(resolver, &stats);
+    CHECK(stats.coalesced - before.coalesced == 1);
+    CHECK(stats.queries - before.queries == 2);
+
+    // Names that can't be looked up
+    CHECK(lookup(resolver, "a..test", AF_INET, &result) == DNS_STATUS_INVALID);
+    CHECK(lookup(resolver, "", AF_INET, &result) == DNS_STATUS_INVALID);
+    CHECK(lookup(resolver, ".", AF_INET, &result) == DNS_STATUS_INVALID);
+    CHECK(lookup(resolver, "example.test", AF_UNIX, &result) == DNS_STATUS_INVALID);
+    char long_label[80];
+    memset(long_label, 'a', 64);
+    strcpy(long_label + 64, ".test");
+    CHECK(lookup(resolver, long_label, AF_INET, &result) == DNS_STATUS_INVALID);
+
+    // More lookups than run at once and names than fit in the cache
+    dns_query_t *many[DNS_CACHE_ENTRIES + 8];
+    for (int i = 0; i < DNS_CACHE_ENTRIES + 8; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "host%d.test", i);
+        many[i] = dns_query_start(resolver, name, AF_INET);
+    }
+    for (int i = 0; i < DNS_CACHE_ENTRIES + 8; i++) {
+        CHECK(dns_query_wait(many[i], -1) == DNS_STATUS_OK);
+        dns_query_result(many[i], &result);
+        CHECK(result.count == 1 && result.addresses[0].addr[3] == i);
+        dns_query_release(many[i]);
+    }
+    dns_resolver_stats_get(resolver, &stats);
+    CHECK(stats.evictions >= 8);
+
+    // Short TTLs are kept for the minimum, then asked for again
+    CHECK(lookup(resolver, "short.test", AF_INET, &result) == DNS_STATUS_OK);
+    CHECK(dns_resolver_cached(resolver, "short.test", AF_INET, &result));
+    atomic_fetch_add(&clock_skew, (DNS_CACHE_MIN_TTL_S - 1) * 1000000LL);
+    CHECK(dns_resolver_cached(resolver, "short.test", AF_INET, &result));
+    atomic_fetch_add(&clock_skew, 2 * 1000000LL);
+    CHECK(!dns_resolver_cached(resolver, "short.test", AF_INET, &result));
+    sent = received();
+    CHECK(lookup(resolver, "short.test", AF_INET, &result) == DNS_STATUS_OK);
+    CHECK(received() == sent + 1);
+
+    // Only IPv4 addresses are asked for when IPv6 is no use
+    dns_resolver_flush(resolver);
+    atomic_store(&ipv6_usable, false);
+    CHECK(lookup(resolver, "example.test", AF_UNSPEC, &result) == DNS_STATUS_OK);
+    CHECK(result.count == 2 && result.addresses[0].family == AF_INET);
+    atomic_store(&ipv6_usable, true);
+
+    // Without servers or answers
+    dns_resolver_flush(resolver);
+    atomic_store(&no_servers, true);
+    CHECK(lookup(resolver, "example.test", AF_INET, &result) == DNS_STATUS_FAILED);
+    atomic_store(&no_servers, false);
+
+    dns_resolver_stats_get(resolver, &before);
+    start = now_ms();
+    CHECK(lookup(resolver, "silent.test", AF_UNSPEC, &result) == DNS_STATUS_TIMEOUT);
+    CHECK(now_ms() - start >= DNS_QUERY_RETRY_MS * DNS_QUERY_ATTEMPTS - 50);
+    dns_resolver_stats_get(resolver, &stats);
+    CHECK(stats.timeouts - before.timeouts == 1);
+    CHECK(stats.queries - before.queries == 2 * DNS_QUERY_ATTEMPTS);
+
+    dns_resolver_stop(resolver);
+    pthread_join(resolver_thread, NULL);
+    dns_resolver_destroy(resolver);
+
+    atomic_store(&stopping, true);
+    for (int i = 0; i < SERVERS; i++) {
+        pthread_join(server_threads[i], NULL);
+        close(servers[i].fd);
+    }
+
+    return check_report("dns_resolver_test");
+}
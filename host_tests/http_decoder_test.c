@@ -0,0 +1,431 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+// The streaming inflater of curl responses against zlib on the host: gzip, zlib and bare deflate streams of every
+// block type and strategy, fed whole and in pieces down to single bytes, gzip header fields, bad checksums, truncated
+// and mangled streams, an output callback that stops it and parsing Content-Encoding values. Ends with throughput.
+
+#include "http_decoder.h"
+#include "check.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <time.h>
+#include <zlib.h>
+
+#define INPUT_BYTES  (160 * 1024)
+#define MUTATIONS    3000
+#define BENCH_ROUNDS 20
+
+typedef enum {
+    FORMAT_GZIP,
+    FORMAT_ZLIB,
+    FORMAT_RAW,
+} format_t;
+
+typedef struct {
+    uint8_t *data;
+    size_t   len;
+    size_t   size;
+    int      calls;
+    int      stop_after; // Calls after which the output refuses more, 0 for never
+} sink_t;
+
+typedef struct {
+    char const *name;
+    int         level;
+    int         strategy;
+} setting_t;
+
+static setting_t const settings[] = {
+    {"stored", 0, Z_DEFAULT_STRATEGY},
+    {"fast", 1, Z_DEFAULT_STRATEGY},
+    {"default", 6, Z_DEFAULT_STRATEGY},
+    {"best", 9, Z_DEFAULT_STRATEGY},
+    {"fixed", 6, Z_FIXED},
+    {"huffman", 6, Z_HUFFMAN_ONLY},
+    {"rle", 6, Z_RLE},
+};
+
+static uint32_t rng = 12345;
+
+static uint32_t next_random(void) {
+    rng = rng * 1103515245 + 12345;
+    return rng >> 8;
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static bool sink_output(void *ctx, void const *data, size_t len) {
+    sink_t *sink = ctx;
+    sink->calls++;
+    if (sink->len + len > sink->size) {
+        return false;
+    }
+    memcpy(sink->data + sink->len, data, len);
+    sink->len += len;
+    return !sink->stop_after || sink->calls < sink->stop_after;
+}
+
+static int window_bits(format_t format) {
+    return format == FORMAT_GZIP ? 15 + 16 : format == FORMAT_ZLIB ? 15 : -15;
+}
+
+static http_encoding_t encoding_of(format_t format) {
+    return format == FORMAT_GZIP ? HTTP_ENCODING_GZIP : HTTP_ENCODING_DEFLATE;
+}
+
+static uint8_t *compress_with(
+    uint8_t const *data, size_t len, format_t format, setting_t const *setting, gz_header *header, size_t *out_len
+) {
+    z_stream stream = {0};
+    CHECK(deflateInit2(&stream, setting->level, Z_DEFLATED, window_bits(format), 9, setting->strategy) == Z_OK);
+    if (header) {
+        CHECK(deflateSetHeader(&stream, header) == Z_OK);
+    }
+
+    size_t   size = deflateBound(&stream, len) + 1024;
+    uint8_t *out  = malloc(size);
+    stream.next_in   = (Bytef *)data;
+    stream.avail_in  = len;
+    stream.next_out  = out;
+    stream.avail_out = size;
+    CHECK(deflate(&stream, Z_FINISH) == Z_STREAM_END);
+    *out_len = stream.total_out;
+    deflateEnd(&stream);
+    return out;
+}
+
+// Feeds the stream in pieces of piece bytes, or of random sizes for 0, returns the result of the last write
+static http_decoder_result_t
+    decode(format_t format, uint8_t const *data, size_t len, size_t piece, sink_t *sink, bool *finished) {
+    http_decoder_t *decoder = http_decoder_create(encoding_of(format), sink_output, sink);
+    CHECK(decoder != NULL);
+
+    http_decoder_result_t result = HTTP_DECODER_OK;
+    for (size_t pos = 0; pos < len && result == HTTP_DECODER_OK;) {
+        size_t n = piece ? piece : 1 + next_random() % 3000;
+        if (n > len - pos) {
+            n = len - pos;
+        }
+        result  = http_decoder_write(decoder, data + pos, n);
+        pos    += n;
+    }
+
+    *finished = http_decoder_finished(decoder);
+    http_decoder_destroy(decoder);
+    return result;
+}
+
+static void fill_text(uint8_t *data, size_t len) {
+    static char const *const words[] = {"catalog", "app", "badge", "version", "name", "icon", "\"url\": ", "{", "}\n"};
+    size_t                   pos     = 0;
+    while (pos < len) {
+        char const *word = words[next_random() % 9];
+        for (size_t i = 0; word[i] && pos < len; i++) {
+            data[pos++] = word[i];
+        }
+        if (pos < len) {
+            data[pos++] = ' ';
+        }
+    }
+}
+
+static void fill_random(uint8_t *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        data[i] = next_random();
+    }
+}
+
+// Random blocks repeated further back than most matches reach, up to the full window
+static void fill_far_repeats(uint8_t *data, size_t len) {
+    size_t block = 30000;
+    fill_random(data, block);
+    for (size_t pos = block; pos < len; pos++) {
+        data[pos] = data[pos - block];
+    }
+}
+
+static void fill_runs(uint8_t *data, size_t len) {
+    for (size_t pos = 0; pos < len;) {
+        size_t  run  = 1 + next_random() % 600;
+        uint8_t byte = next_random();
+        for (size_t i = 0; i < run && pos < len; i++) {
+            data[pos++] = byte;
+        }
+    }
+}
+
+static void test_round_trips(void) {
+    static void (*const fills[])(uint8_t *, size_t) = {fill_text, fill_random, fill_far_repeats, fill_runs};
+    static size_t const lengths[]                   = {0, 1, 1000, INPUT_BYTES};
+    static size_t const pieces[]                    = {SIZE_MAX, 1, 7, 0};
+
+    uint8_t *input  = malloc(INPUT_BYTES);
+    uint8_t *output = malloc(INPUT_BYTES);
+    int      cases  = 0;
+
+    for (size_t f = 0; f < sizeof(fills) / sizeof(fills[0]); f++) {
+        fills[f](input, INPUT_BYTES);
+        for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+            for (format_t format = FORMAT_GZIP; format <= FORMAT_RAW; format++) {
+                for (size_t s = 0; s < sizeof(settings) / sizeof(settings[0]); s++) {
+                    size_t   compressed_len;
+                    uint8_t *compressed = compress_with(input, lengths[l], format, &settings[s], NULL, &compressed_len);
+
+                    for (size_t p = 0; p < sizeof(pieces) / sizeof(pieces[0]); p++) {
+                        // Byte by byte only for the short ones and one setting, it takes a while
+                        if (pieces[p] == 1 && lengths[l] == INPUT_BYTES && s != 2) {
+                            continue;
+                        }
+                        sink_t sink = {.data = output, .size = INPUT_BYTES};
+                        bool   finished;
+                        http_decoder_result_t result =
+                            decode(format, compressed, compressed_len, pieces[p], &sink, &finished);
+                        if (result != HTTP_DECODER_OK || !finished || sink.len != lengths[l] ||
+                            memcmp(output, input, lengths[l]) != 0) {
+                            printf(
+                                "FAIL fill %zu, %zu bytes, format %d, %s, pieces of %zu\n",
+                                f,
+                                lengths[l],
+                                format,
+                                settings[s].name,
+                                pieces[p]
+                            );
+                            failures++;
+                        }
+                        cases++;
+                    }
+                    free(compressed);
+                }
+            }
+        }
+    }
+
+    printf("http_decoder_test: %d round trips\n", cases);
+    free(input);
+    free(output);
+}
+
+static void test_gzip_header(void) {
+    uint8_t   input[5000];
+    uint8_t   output[sizeof(input)];
+    uint8_t   extra[300];
+    size_t    compressed_len;
+    bool      finished;
+    gz_header header = {
+        .text      = 1,
+        .time      = 1700000000,
+        .os        = 3,
+        .extra     = extra,
+        .extra_len = sizeof(extra),
+        .name      = (Bytef *)"catalog.json",
+        .comment   = (Bytef *)"every header field there is",
+        .hcrc      = 1,
+    };
+
+    fill_text(input, sizeof(input));
+    fill_random(extra, sizeof(extra));
+    uint8_t *compressed = compress_with(input, sizeof(input), FORMAT_GZIP, &settings[2], &header, &compressed_len);
+
+    for (size_t piece = 1; piece <= 64; piece *= 4) {
+        sink_t sink = {.data = output, .size = sizeof(output)};
+        CHECK(decode(FORMAT_GZIP, compressed, compressed_len, piece, &sink, &finished) == HTTP_DECODER_OK);
+        CHECK(finished && sink.len == sizeof(input) && memcmp(output, input, sizeof(input)) == 0);
+    }
+    free(compressed);
+}
+
+static void test_bad_streams(void) {
+    uint8_t  input[20000];
+    uint8_t  output[sizeof(input)];
+    size_t   compressed_len;
+    bool     finished;
+    sink_t   sink;
+    uint8_t *compressed;
+
+    fill_text(input, sizeof(input));
+
+    // A mismatch in the gzip CRC or size and in the zlib Adler-32 is caught
+    compressed = compress_with(input, sizeof(input), FORMAT_GZIP, &settings[2], NULL, &compressed_len);
+    for (size_t back = 1; back <= 8; back++) {
+        compressed[compressed_len - back] ^= 0x10;
+        sink = (sink_t){.data = output, .size = sizeof(output)};
+        CHECK(decode(FORMAT_GZIP, compressed, compressed_len, 0, &sink, &finished) == HTTP_DECODER_ERR_DATA);
+        CHECK(!finished);
+        compressed[compressed_len - back] ^= 0x10;
+    }
+
+    // Cut short it is not finished, with whatever came out so far correct. Extra bytes after the end are ignored.
+    sink = (sink_t){.data = output, .size = sizeof(output)};
+    CHECK(decode(FORMAT_GZIP, compressed, compressed_len - 1, 0, &sink, &finished) == HTTP_DECODER_OK);
+    CHECK(!finished && sink.len == sizeof(input) && memcmp(output, input, sizeof(input)) == 0);
+    sink = (sink_t){.data = output, .size = sizeof(output)};
+    CHECK(decode(FORMAT_GZIP, compressed, compressed_len / 2, 0, &sink, &finished) == HTTP_DECODER_OK);
+    CHECK(!finished && sink.len < sizeof(input) && memcmp(output, input, sink.len) == 0);
+
+    uint8_t *longer = malloc(compressed_len + 10);
+    memcpy(longer, compressed, compressed_len);
+    memset(longer + compressed_len, 0xaa, 10);
+    sink = (sink_t){.data = output, .size = sizeof(output)};
+    CHECK(decode(FORMAT_GZIP, longer, compressed_len + 10, 0, &sink, &finished) == HTTP_DECODER_OK);
+    CHECK(finished && sink.len == sizeof(input));
+    free(longer);
+
+    compressed[0] = 0x1e;
+    sink          = (sink_t){.data = output, .size = sizeof(output)};
+    CHECK(decode(FORMAT_GZIP, compressed, compressed_len, 0, &sink, &finished) == HTTP_DECODER_ERR_DATA);
+    free(compressed);
+
+    compressed = compress_with(input, sizeof(input), FORMAT_ZLIB, &settings[2], NULL, &compressed_len);
+    compressed[compressed_len - 1] ^= 1;
+    sink = (sink_t){.data = output, .size = sizeof(output)};
+    CHECK(decode(FORMAT_ZLIB, compressed, compressed_len, 0, &sink, &finished) == HTTP_DECODER_ERR_DATA);
+    free(compressed);
+
+    // Reserved block type, a stored block whose length check is off and a match reaching before the start
+    static uint8_t const reserved[]    = {0x07, 0x00};
+    static uint8_t const bad_stored[]  = {0x01, 0x05, 0x00, 0xfa, 0xfe, 'h', 'e', 'l', 'l', 'o'};
+    static uint8_t const early_match[] = {0x03, 0x02, 0x00};
+    sink                               = (sink_t){.data = output, .size = sizeof(output)};
+    CHECK(decode(FORMAT_RAW, reserved, sizeof(reserved), 0, &sink, &finished) == HTTP_DECODER_ERR_DATA);
+    CHECK(decode(FORMAT_RAW, bad_stored, sizeof(bad_stored), 0, &sink, &finished) == HTTP_DECODER_ERR_DATA);
+    CHECK(decode(FORMAT_RAW, early_match, sizeof(early_match), 0, &sink, &finished) == HTTP_DECODER_ERR_DATA);
+
+    // Mangled streams fail or decode to something, either way within bounds
+    int errors = 0;
+    for (format_t format = FORMAT_GZIP; format <= FORMAT_RAW; format++) {
+        compressed = compress_with(input, sizeof(input), format, &settings[2], NULL, &compressed_len);
+        for (int i = 0; i < MUTATIONS; i++) {
+            size_t  at   = next_random() % compressed_len;
+            uint8_t flip = 1 + next_random() % 255;
+            compressed[at] ^= flip;
+            sink = (sink_t){.data = output, .size = sizeof(output)};
+            if (decode(format, compressed, compressed_len, 0, &sink, &finished) != HTTP_DECODER_OK) {
+                errors++;
+            }
+            compressed[at] ^= flip;
+        }
+        free(compressed);
+    }
+    CHECK(errors > MUTATIONS);
+}
+
+static void test_abort(void) {
+    uint8_t input[100000];
+    uint8_t output[sizeof(input)];
+    size_t  compressed_len;
+
+    fill_random(input, sizeof(input));
+    uint8_t *compressed = compress_with(input, sizeof(input), FORMAT_GZIP, &settings[0], NULL, &compressed_len);
+
+    sink_t          sink    = {.data = output, .size = sizeof(output), .stop_after = 1};
+    http_decoder_t *decoder = http_decoder_create(HTTP_ENCODING_GZIP, sink_output, &sink);
+    CHECK(http_decoder_write(decoder, compressed, compressed_len) == HTTP_DECODER_ERR_ABORTED);
+    CHECK(sink.calls == 1 && sink.len > 0 && sink.len < sizeof(input));
+    CHECK(http_decoder_write(decoder, compressed, compressed_len) == HTTP_DECODER_ERR_ABORTED);
+    CHECK(sink.calls == 1 && !http_decoder_finished(decoder));
+    http_decoder_destroy(decoder);
+    free(compressed);
+
+    CHECK(http_decoder_create(HTTP_ENCODING_IDENTITY, sink_output, &sink) == NULL);
+    CHECK(http_decoder_create(HTTP_ENCODING_UNSUPPORTED, sink_output, &sink) == NULL);
+}
+
+static void test_encoding_parse(void) {
+    static struct {
+        char const     *value;
+        http_encoding_t encoding;
+    } const cases[] = {
+        {"gzip", HTTP_ENCODING_GZIP},
+        {"x-gzip", HTTP_ENCODING_GZIP},
+        {"GZip", HTTP_ENCODING_GZIP},
+        {" deflate ", HTTP_ENCODING_DEFLATE},
+        {"", HTTP_ENCODING_IDENTITY},
+        {"identity", HTTP_ENCODING_IDENTITY},
+        {"identity, gzip", HTTP_ENCODING_GZIP},
+        {"gzip,identity", HTTP_ENCODING_GZIP},
+        {"br", HTTP_ENCODING_UNSUPPORTED},
+        {"gzipped", HTTP_ENCODING_UNSUPPORTED},
+        {"deflate, gzip", HTTP_ENCODING_UNSUPPORTED},
+        {"gzip, br", HTTP_ENCODING_UNSUPPORTED},
+    };
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        if (http_encoding_parse(cases[i].value, strlen(cases[i].value)) != cases[i].encoding) {
+            printf("FAIL Content-Encoding '%s'\n", cases[i].value);
+            failures++;
+        }
+    }
+}
+
+static bool discard(void *ctx, void const *data, size_t len) {
+    (void)data;
+    *(size_t *)ctx += len;
+    return true;
+}
+
+static void bench(void) {
+    uint8_t *input = malloc(INPUT_BYTES);
+    size_t   compressed_len;
+
+    fill_text(input, INPUT_BYTES);
+    uint8_t *compressed = compress_with(input, INPUT_BYTES, FORMAT_GZIP, &settings[2], NULL, &compressed_len);
+
+    size_t out   = 0;
+    double start = now_ms();
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        http_decoder_t *decoder = http_decoder_create(HTTP_ENCODING_GZIP, discard, &out);
+        for (size_t pos = 0; pos < compressed_len; pos += 1460) {
+            size_t n = compressed_len - pos < 1460 ? compressed_len - pos : 1460;
+            http_decoder_write(decoder, compressed + pos, n);
+        }
+        CHECK(http_decoder_finished(decoder));
+        http_decoder_destroy(decoder);
+    }
+    double elapsed = now_ms() - start;
+    CHECK(out == (size_t)INPUT_BYTES * BENCH_ROUNDS);
+
+    printf(
+        "http_decoder_test: %d KiB of text gzipped to %zu bytes (%.1fx), inflated at %.1f MB/s\n",
+        INPUT_BYTES / 1024,
+        compressed_len,
+        (double)INPUT_BYTES / compressed_len,
+        out / 1000.0 / elapsed
+    );
+    free(compressed);
+    free(input);
+}
+
+int main(void) {
+    test_round_trips();
+    test_gzip_header();
+    test_bad_streams();
+    test_abort();
+    test_encoding_parse();
+    bench();
+
+    return check_report("http_decoder_test");
+}
@@ -0,0 +1,995 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// The curl multi engine against an HTTP/1.1 server on the loopback interface that answers after a delay and tracks
+// how many requests per host it handles at the same time. Fetches a batch of resources in parallel within the host
+// and total limits, then covers keep-alive reuse, chunked and close-delimited bodies, redirects, POST, timeouts,
+// removing a running transfer and a kept-alive connection the server closed, gzip and deflate bodies, resuming with
+// a range and malformed or cut off bodies. Every host name resolves to 127.0.0.1.
+
+#include "http_multi.h"
+#include "badgevms_config.h"
+#include "check.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RESOURCES     48
+#define DELAY_MS      20
+#define SERVER_HOSTS  4
+#define CATALOG_LINES 120
+
+typedef struct {
+    char host[32];
+    int  active;
+    int  max;
+} host_load_t;
+
+typedef struct {
+    char                body[4096];
+    size_t              len;
+    int                 headers;
+    bool                done;
+    http_multi_result_t result;
+    int                 status;
+    int64_t             content_length;
+    int                 connects;
+    char                url[128];
+} fetch_t;
+
+static atomic_int      accepted;
+static atomic_int      opened;
+static uint16_t        server_port;
+static pthread_mutex_t load_lock = PTHREAD_MUTEX_INITIALIZER;
+static host_load_t     load[SERVER_HOSTS];
+static int             total_active;
+static int             total_max;
+static char            catalog[4096];
+static size_t          catalog_len;
+
+// The catalog gzipped, the deflate stream in it is also served with a zlib wrapper and bare
+static uint8_t const catalog_gzip[] = {
+    0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x03, 0x75, 0xd6, 0x39, 0x4e, 0x25, 0x41, 0x00, 0x44, 0x41,
+    0x9f, 0x53, 0xfc, 0x23, 0xd4, 0xbe, 0x1c, 0x07, 0x21, 0x66, 0x40, 0xfa, 0x02, 0x87, 0xfb, 0x0b, 0x8d, 0x3d, 0x91,
+    0x6e, 0x7a, 0xa1, 0xae, 0xae, 0x7a, 0xcf, 0xcf, 0xaf, 0xf7, 0x47, 0x79, 0x7c, 0xff, 0x79, 0xfc, 0x7c, 0xbc, 0x3f,
+    0xde, 0x5e, 0x7f, 0x5e, 0x9f, 0xdf, 0x7f, 0x5f, 0x9e, 0xff, 0xd6, 0xca, 0xb5, 0x71, 0xed, 0x5c, 0x07, 0xd7, 0xc9,
+    0x75, 0x71, 0xdd, 0x5c, 0x0f, 0xd7, 0x6b, 0x45, 0xc0, 0x59, 0x57, 0xcd, 0xab, 0xf6, 0x55, 0x03, 0xab, 0x85, 0xd5,
+    0xc4, 0x6a, 0x63, 0x35, 0xb2, 0x5a, 0xd9, 0xac, 0x6c, 0xe1, 0x1b, 0x5a, 0xd9, 0xac, 0x6c, 0x56, 0x36, 0x2b, 0x9b,
+    0x95, 0xcd, 0xca, 0x66, 0x65, 0xb3, 0xb2, 0x5b, 0xd9, 0xad, 0xec, 0xe1, 0xa8, 0x5a, 0xd9, 0xad, 0xec, 0x56, 0x76,
+    0x2b, 0xbb, 0x95, 0xdd, 0xca, 0x6e, 0xe5, 0xb0, 0x72, 0x58, 0x39, 0xac, 0x1c, 0xe1, 0x8f, 0xb4, 0x72, 0x58, 0x39,
+    0xac, 0x1c, 0x56, 0x0e, 0x2b, 0x87, 0x95, 0xd3, 0xca, 0x69, 0xe5, 0xb4, 0x72, 0x5a, 0x39, 0xc3, 0xc5, 0x63, 0xe5,
+    0xb4, 0x72, 0x5a, 0x39, 0xad, 0x9c, 0x56, 0x2e, 0x2b, 0x97, 0x95, 0xcb, 0xca, 0x65, 0xe5, 0xb2, 0x72, 0x85, 0xfb,
+    0xd5, 0xca, 0x65, 0xe5, 0xb2, 0x72, 0x59, 0xb9, 0xad, 0xdc, 0x56, 0x6e, 0x2b, 0xb7, 0x95, 0xdb, 0xca, 0x6d, 0xe5,
+    0x0e, 0xcf, 0x88, 0x95, 0xdb, 0xca, 0x6d, 0xe5, 0xb1, 0xf2, 0x58, 0x79, 0xac, 0x3c, 0x56, 0x1e, 0x2b, 0x8f, 0x95,
+    0xc7, 0xca, 0x13, 0x5e, 0x4b, 0x2b, 0x8f, 0x95, 0xd7, 0xca, 0x6b, 0xe5, 0xb5, 0xf2, 0x5a, 0x79, 0xad, 0xbc, 0x56,
+    0x5e, 0x2b, 0xaf, 0x95, 0x37, 0x44, 0x41, 0xaa, 0x82, 0x90, 0x05, 0x25, 0x74, 0x41, 0x09, 0x61, 0x50, 0x42, 0x19,
+    0x94, 0x90, 0x06, 0x25, 0xb4, 0x41, 0x09, 0x71, 0x50, 0x42, 0x1d, 0x94, 0x90, 0x07, 0x25, 0x78, 0x63, 0x06, 0x05,
+    0x6f, 0x0a, 0xa1, 0x54, 0x42, 0x29, 0x85, 0x52, 0x0b, 0xa5, 0x18, 0x4a, 0x35, 0x94, 0x72, 0xe8, 0xff, 0x1e, 0xfa,
+    0x05, 0xfa, 0x82, 0x61, 0xf7, 0xd2, 0x0a, 0x00, 0x00,
+};
+
+#define GZIP_HEADER_BYTES  10
+#define GZIP_TRAILER_BYTES 8
+#define CATALOG_ADLER32    0x7f1e8b72
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void) {
+    pthread_mutex_t *mutex = malloc(sizeof(pthread_mutex_t));
+    pthread_mutex_init(mutex, NULL);
+    return mutex;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks) {
+    (void)ticks;
+    pthread_mutex_lock(semaphore);
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore) {
+    pthread_mutex_unlock(semaphore);
+    return pdTRUE;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t semaphore) {
+    pthread_mutex_destroy(semaphore);
+    free(semaphore);
+}
+
+int64_t esp_timer_get_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static double now_ms(void) {
+    return esp_timer_get_time() / 1000.0;
+}
+
+static void load_change(char const *host, int delta) {
+    pthread_mutex_lock(&load_lock);
+    for (int i = 0; i < SERVER_HOSTS; i++) {
+        if (!load[i].host[0] || strcmp(load[i].host, host) == 0) {
+            snprintf(load[i].host, sizeof(load[i].host), "%s", host);
+            load[i].active += delta;
+            if (load[i].active > load[i].max) {
+                load[i].max = load[i].active;
+            }
+            break;
+        }
+    }
+    total_active += delta;
+    if (total_active > total_max) {
+        total_max = total_active;
+    }
+    pthread_mutex_unlock(&load_lock);
+}
+
+static int load_max(char const *host) {
+    int max = 0;
+    pthread_mutex_lock(&load_lock);
+    for (int i = 0; i < SERVER_HOSTS; i++) {
+        if (strcmp(load[i].host, host) == 0) {
+            max = load[i].max;
+        }
+    }
+    pthread_mutex_unlock(&load_lock);
+    return max;
+}
+
+static void load_reset(void) {
+    pthread_mutex_lock(&load_lock);
+    memset(load, 0, sizeof(load));
+    total_active = 0;
+    total_max    = 0;
+    pthread_mutex_unlock(&load_lock);
+}
+
+// Reads one request head into buf, returns its length or -1 if the peer closed first
+static int read_head(int fd, char *buf, size_t size) {
+    size_t len = 0;
+    while (len < size - 1) {
+        ssize_t n = read(fd, buf + len, 1);
+        if (n <= 0) {
+            return -1;
+        }
+        len++;
+        buf[len] = '\0';
+        if (len >= 4 && memcmp(buf + len - 4, "\r\n\r\n", 4) == 0) {
+            return len;
+        }
+    }
+    return -1;
+}
+
+static void send_all(int fd, char const *data, size_t len) {
+    while (len) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return;
+        }
+        data += n;
+        len  -= n;
+    }
+}
+
+static void respond_bytes(int fd, char const *status, char const *headers, void const *body, size_t body_len) {
+    char head[1024];
+    int  len = snprintf(head, sizeof(head), "HTTP/1.1 %s\r\nContent-Length: %zu\r\n%s\r\n", status, body_len, headers);
+    send_all(fd, head, len);
+    send_all(fd, body, body_len);
+}
+
+static void respond(int fd, char const *status, char const *headers, char const *body) {
+    respond_bytes(fd, status, headers, body, strlen(body));
+}
+
+// The catalog gzipped in chunks of 7 bytes, so the gzip header, the deflate stream and the trailer all span chunks
+static void respond_gzip_chunked(int fd) {
+    char const *head = "HTTP/1.1 200 OK\r\nContent-Encoding: gzip\r\nTransfer-Encoding: chunked\r\n\r\n";
+    send_all(fd, head, strlen(head));
+    for (size_t pos = 0; pos < sizeof(catalog_gzip); pos += 7) {
+        size_t n = sizeof(catalog_gzip) - pos < 7 ? sizeof(catalog_gzip) - pos : 7;
+        char   size[16];
+        snprintf(size, sizeof(size), "%zx\r\n", n);
+        send_all(fd, size, strlen(size));
+        send_all(fd, (char const *)catalog_gzip + pos, n);
+        send_all(fd, "\r\n", 2);
+    }
+    send_all(fd, "0\r\n\r\n", 5);
+}
+
+static void respond_deflate(int fd, bool wrapped) {
+    uint8_t body[sizeof(catalog_gzip)];
+    size_t  len = 0;
+    size_t  raw = sizeof(catalog_gzip) - GZIP_HEADER_BYTES - GZIP_TRAILER_BYTES;
+
+    if (wrapped) {
+        body[len++] = 0x78;
+        body[len++] = 0xda;
+    }
+    memcpy(body + len, catalog_gzip + GZIP_HEADER_BYTES, raw);
+    len += raw;
+    if (wrapped) {
+        for (int shift = 24; shift >= 0; shift -= 8) {
+            body[len++] = CATALOG_ADLER32 >> shift;
+        }
+    }
+    respond_bytes(fd, "200 OK", "Content-Encoding: deflate\r\n", body, len);
+}
+
+// The catalog from where a "Range: bytes=N-" header asks for, all of it without one
+static void respond_range(int fd, char const *request) {
+    char const *range = strstr(request, "\r\nRange: bytes=");
+    if (!range) {
+        respond_bytes(fd, "200 OK", "", catalog, catalog_len);
+        return;
+    }
+
+    size_t start = strtoul(range + 15, NULL, 10);
+    char   headers[128];
+    if (start >= catalog_len) {
+        snprintf(headers, sizeof(headers), "Content-Range: bytes */%zu\r\n", catalog_len);
+        respond(fd, "416 Range Not Satisfiable", headers, "");
+        return;
+    }
+    snprintf(headers, sizeof(headers), "Content-Range: bytes %zu-%zu/%zu\r\n", start, catalog_len - 1, catalog_len);
+    respond_bytes(fd, "206 Partial Content", headers, catalog + start, catalog_len - start);
+}
+
+// Answers requests on one connection until the client or the endpoint closes it. "X-Drop: 1" closes without
+// announcing it after the response, like a server whose keep-alive timeout ran out.
+static void *serve_connection(void *arg) {
+    int  fd = (int)(intptr_t)arg;
+    char request[1024];
+    char body[1024];
+
+    while (read_head(fd, request, sizeof(request)) > 0) {
+        char  method[8] = "";
+        char  path[128] = "";
+        char  host[32]  = "";
+        char *line      = strstr(request, "\r\nHost: ");
+        sscanf(request, "%7s %127s", method, path);
+        if (line) {
+            sscanf(line + 8, "%31[^:\r]", host);
+        }
+
+        size_t body_len = 0;
+        line            = strstr(request, "\r\nContent-Length: ");
+        if (line) {
+            body_len = strtoul(line + 18, NULL, 10);
+        }
+        if (body_len >= sizeof(body) || (body_len && recv(fd, body, body_len, MSG_WAITALL) != (ssize_t)body_len)) {
+            break;
+        }
+        body[body_len] = '\0';
+
+        bool keep = !strstr(request, "Connection: close") && !strstr(request, "X-Drop: 1");
+        load_change(host, 1);
+
+        if (strncmp(path, "/res/", 5) == 0) {
+            usleep(DELAY_MS * 1000);
+            char text[64];
+            snprintf(text, sizeof(text), "resource %s from %s", path + 5, host);
+            respond(fd, "200 OK", "", text);
+        } else if (strcmp(path, "/chunked") == 0) {
+            char const *response = "HTTP/1.1 100 Continue\r\n\r\n"
+                                   "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\nX-Test: 1\r\n\r\n"
+                                   "5\r\nhello\r\n1;ext=1\r\n \r\nA\r\nchunked wo\r\n3\r\nrld\r\n"
+                                   "0\r\nX-Trailer: 1\r\n\r\n";
+            send_all(fd, response, strlen(response));
+        } else if (strcmp(path, "/close") == 0) {
+            char const *response = "HTTP/1.0 200 OK\r\n\r\nuntil the connection closes";
+            send_all(fd, response, strlen(response));
+            keep = false;
+        } else if (strcmp(path, "/redirect") == 0) {
+            respond(fd, "302 Found", "Location: res/7\r\n", "moved");
+        } else if (strcmp(path, "/loop") == 0) {
+            respond(fd, "301 Moved Permanently", "Location: /loop\r\n", "");
+        } else if (strcmp(path, "/see-other") == 0) {
+            char location[128];
+            snprintf(location, sizeof(location), "Location: http://other:%u/method\r\n", server_port);
+            respond(fd, "303 See Other", location, "");
+        } else if (strcmp(path, "/method") == 0) {
+            respond(fd, "200 OK", "", method);
+        } else if (strcmp(path, "/echo") == 0) {
+            respond(fd, "200 OK", "", body);
+        } else if (strcmp(path, "/slow") == 0) {
+            usleep(2000 * 1000);
+            respond(fd, "200 OK", "", "slow");
+        } else if (strcmp(path, "/empty") == 0) {
+            respond(fd, "204 No Content", "", "");
+        } else if (strcmp(path, "/gzip") == 0) {
+            respond_bytes(fd, "200 OK", "Content-Encoding: gzip\r\n", catalog_gzip, sizeof(catalog_gzip));
+        } else if (strcmp(path, "/gzip-chunked") == 0) {
+            respond_gzip_chunked(fd);
+        } else if (strcmp(path, "/gzip-cut") == 0) {
+            respond_bytes(fd, "200 OK", "Content-Encoding: gzip\r\n", catalog_gzip, sizeof(catalog_gzip) - 4);
+        } else if (strcmp(path, "/deflate") == 0) {
+            respond_deflate(fd, true);
+        } else if (strcmp(path, "/raw-deflate") == 0) {
+            respond_deflate(fd, false);
+        } else if (strcmp(path, "/brotli") == 0) {
+            respond(fd, "200 OK", "Content-Encoding: br\r\n", "not gzip");
+        } else if (strcmp(path, "/range") == 0) {
+            respond_range(fd, request);
+        } else if (strcmp(path, "/no-range") == 0) {
+            respond_bytes(fd, "200 OK", "", catalog, catalog_len);
+        } else if (strcmp(path, "/short") == 0) {
+            char const *response = "HTTP/1.1 200 OK\r\nContent-Length: 100\r\n\r\nnot 100 bytes";
+            send_all(fd, response, strlen(response));
+            keep = false;
+        } else if (strcmp(path, "/short-chunked") == 0) {
+            char const *response = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nhello\r\n";
+            send_all(fd, response, strlen(response));
+            keep = false;
+        } else if (strcmp(path, "/bad-chunk") == 0) {
+            char const *response = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n5 x\r\nhello\r\n0\r\n\r\n";
+            send_all(fd, response, strlen(response));
+        } else if (strcmp(path, "/chunk-space") == 0) {
+            char const *response = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+                                   "5\t ;x=1\r\nhello\r\n0\r\n\r\n";
+            send_all(fd, response, strlen(response));
+        } else if (strcmp(path, "/two-lengths") == 0) {
+            respond(fd, "200 OK", "Content-Length: 6\r\n", "hello");
+        } else if (strcmp(path, "/length-and-chunked") == 0) {
+            char const *response = "HTTP/1.1 200 OK\r\nContent-Length: 100\r\nTransfer-Encoding: chunked\r\n\r\n"
+                                   "5\r\nhello\r\n0\r\n\r\n";
+            send_all(fd, response, strlen(response));
+        } else if (strcmp(path, "/too-long") == 0) {
+            char const *response = "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nhello and then some";
+            send_all(fd, response, strlen(response));
+        } else if (strcmp(path, "/not-chunked") == 0) {
+            char const *response = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked, identity\r\n"
+                                   "Content-Length: 2\r\n\r\n5\r\nhello\r\n";
+            send_all(fd, response, strlen(response));
+            keep = false;
+        } else {
+            respond(fd, "404 Not Found", "", "not found");
+        }
+
+        load_change(host, -1);
+        if (!keep) {
+            break;
+        }
+    }
+
+    close(fd);
+    return NULL;
+}
+
+static void *serve(void *arg) {
+    int listener = (int)(intptr_t)arg;
+    while (true) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        atomic_fetch_add(&accepted, 1);
+
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        pthread_t thread;
+        pthread_create(&thread, NULL, serve_connection, (void *)(intptr_t)fd);
+        pthread_detach(thread);
+    }
+    return NULL;
+}
+
+static void start_server(void) {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    int one      = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in addr = {
+        .sin_family      = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    socklen_t addr_len = sizeof(addr);
+    if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listener, 128) != 0) {
+        perror("listen");
+        exit(1);
+    }
+    getsockname(listener, (struct sockaddr *)&addr, &addr_len);
+    server_port = ntohs(addr.sin_port);
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, serve, (void *)(intptr_t)listener);
+    pthread_detach(thread);
+}
+
+static void *sock_open(void *ctx, http_pool_key_t const *key, void *user_data) {
+    (void)ctx;
+    (void)user_data;
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    struct sockaddr_in addr = {
+        .sin_family      = AF_INET,
+        .sin_port        = htons(key->port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 && errno != EINPROGRESS) {
+        close(fd);
+        return NULL;
+    }
+
+    atomic_fetch_add(&opened, 1);
+    int *conn = malloc(sizeof(int));
+    *conn     = fd;
+    return conn;
+}
+
+static int sock_connect(void *conn) {
+    struct pollfd pfd = {.fd = *(int *)conn, .events = POLLOUT};
+    if (poll(&pfd, 1, 0) == 0) {
+        return HTTP_MULTI_WANT_WRITE;
+    }
+
+    int       error = 0;
+    socklen_t len   = sizeof(error);
+    getsockopt(pfd.fd, SOL_SOCKET, SO_ERROR, &error, &len);
+    return error ? -1 : 0;
+}
+
+static int sock_fd(void *conn) {
+    return *(int *)conn;
+}
+
+static int sock_read(void *conn, void *buf, size_t len) {
+    ssize_t n = recv(*(int *)conn, buf, len, 0);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ? HTTP_MULTI_WANT_READ : (int)n;
+}
+
+static int sock_write(void *conn, void const *buf, size_t len) {
+    ssize_t n = send(*(int *)conn, buf, len, MSG_NOSIGNAL);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ? HTTP_MULTI_WANT_WRITE : (int)n;
+}
+
+static void sock_close(void *conn) {
+    close(*(int *)conn);
+    free(conn);
+}
+
+static http_multi_transport_t const transport = {
+    .open    = sock_open,
+    .connect = sock_connect,
+    .fd      = sock_fd,
+    .read    = sock_read,
+    .write   = sock_write,
+    .close   = sock_close,
+};
+
+static bool on_header(void *user_data, char const *line, size_t len) {
+    (void)line;
+    (void)len;
+    fetch_t *fetch = user_data;
+    fetch->headers++;
+    return true;
+}
+
+static bool on_data(void *user_data, void const *data, size_t len) {
+    fetch_t *fetch = user_data;
+    if (fetch->len + len >= sizeof(fetch->body)) {
+        return false;
+    }
+    memcpy(fetch->body + fetch->len, data, len);
+    fetch->len            += len;
+    fetch->body[fetch->len] = '\0';
+    return true;
+}
+
+static void on_done(void *user_data, http_multi_result_t result, http_multi_response_t const *response) {
+    fetch_t *fetch        = user_data;
+    fetch->done           = true;
+    fetch->result         = result;
+    fetch->status         = response->status;
+    fetch->content_length = response->content_length;
+    fetch->connects       = response->connects;
+    snprintf(fetch->url, sizeof(fetch->url), "%s", response->url ? response->url : "");
+}
+
+static http_multi_request_t request_for(fetch_t *fetch, char const *url) {
+    memset(fetch, 0, sizeof(*fetch));
+    return (http_multi_request_t){
+        .url           = url,
+        .max_redirects = 5,
+        .user_data     = fetch,
+        .header        = on_header,
+        .data          = on_data,
+        .done          = on_done,
+    };
+}
+
+static void url_for(char *url, size_t size, char const *host, char const *path) {
+    snprintf(url, size, "http://%s:%u%s", host, server_port, path);
+}
+
+// Drives the multi until every transfer is done, the way an application loop around curl_multi_perform does
+static void run(http_multi_t *multi) {
+    while (http_multi_perform(multi) > 0) {
+        http_multi_poll(multi, NULL, 0, 1000);
+    }
+}
+
+static bool fetch_one(http_multi_t *multi, fetch_t *fetch, http_multi_request_t const *request) {
+    if (!http_multi_add(multi, request)) {
+        return false;
+    }
+    run(multi);
+
+    void               *user_data;
+    http_multi_result_t result;
+    int                 left;
+    bool                got = http_multi_info_read(multi, &user_data, &result, &left);
+    http_multi_remove(multi, fetch);
+    return got && user_data == fetch && result == fetch->result && left == 0;
+}
+
+// Fetches RESOURCES resources of DELAY_MS each from the hosts, returns how long that took
+static double fetch_batch(http_multi_t *multi, char const *const *hosts, int host_count, fetch_t *fetches) {
+    static char urls[RESOURCES][64];
+
+    double start = now_ms();
+    for (int i = 0; i < RESOURCES; i++) {
+        char path[16];
+        snprintf(path, sizeof(path), "/res/%d", i);
+        url_for(urls[i], sizeof(urls[i]), hosts[i % host_count], path);
+        http_multi_request_t request = request_for(&fetches[i], urls[i]);
+        CHECK(http_multi_add(multi, &request));
+    }
+    run(multi);
+    double elapsed = now_ms() - start;
+
+    // Messages come out in the order the transfers finished, each once
+    void               *user_data;
+    http_multi_result_t result;
+    int                 left;
+    int                 messages = 0;
+    while (http_multi_info_read(multi, &user_data, &result, &left)) {
+        CHECK(left == RESOURCES - 1 - messages);
+        CHECK(result == HTTP_MULTI_OK && ((fetch_t *)user_data)->done);
+        messages++;
+    }
+    CHECK(messages == RESOURCES);
+
+    for (int i = 0; i < RESOURCES; i++) {
+        char text[64];
+        snprintf(text, sizeof(text), "resource %d from %s", i, hosts[i % host_count]);
+        CHECK(fetches[i].result == HTTP_MULTI_OK && fetches[i].status == 200);
+        CHECK(strcmp(fetches[i].body, text) == 0);
+        CHECK(fetches[i].content_length == (int64_t)strlen(text));
+        http_multi_remove(multi, &fetches[i]);
+    }
+    return elapsed;
+}
+
+static void test_parallel(void) {
+    static fetch_t     fetches[RESOURCES];
+    char const        *host[] = {"localhost"};
+    http_multi_stats_t stats;
+
+    // One at a time, what curl_easy_perform in a loop gets at best
+    http_multi_t *multi = http_multi_create(&transport, NULL);
+    http_multi_set_limits(multi, 1, 1);
+    load_reset();
+    double serial = fetch_batch(multi, host, 1, fetches);
+    CHECK(load_max("localhost") == 1);
+    http_multi_destroy(multi);
+
+    // The default limits
+    multi = http_multi_create(&transport, NULL);
+    load_reset();
+    atomic_store(&opened, 0);
+    double parallel = fetch_batch(multi, host, 1, fetches);
+    http_multi_stats_get(multi, &stats);
+    CHECK(load_max("localhost") <= HTTP_MULTI_MAX_PER_HOST);
+    CHECK(stats.max_running == HTTP_MULTI_MAX_PER_HOST);
+    CHECK(stats.opened == HTTP_MULTI_MAX_PER_HOST && stats.opened + stats.reused == RESOURCES);
+    CHECK(atomic_load(&opened) == HTTP_MULTI_MAX_PER_HOST);
+    CHECK(parallel < serial / 2);
+    http_multi_destroy(multi);
+
+    printf(
+        "http_multi_test: %d resources of %dms, one at a time %.1fms, %d per host %.1fms (%.1fx)\n",
+        RESOURCES,
+        DELAY_MS,
+        serial,
+        HTTP_MULTI_MAX_PER_HOST,
+        parallel,
+        serial / parallel
+    );
+}
+
+static void test_hosts(void) {
+    static fetch_t     fetches[RESOURCES];
+    char const        *hosts[] = {"a.test", "b.test"};
+    http_multi_stats_t stats;
+
+    // The total limit caps both hosts together, connections to one host are closed to make room for the other
+    http_multi_t *multi = http_multi_create(&transport, NULL);
+    http_multi_set_limits(multi, 3, 2);
+    load_reset();
+    double elapsed = fetch_batch(multi, hosts, 2, fetches);
+    http_multi_stats_get(multi, &stats);
+    CHECK(load_max("a.test") <= 2 && load_max("b.test") <= 2);
+    CHECK(total_max <= 3 && stats.max_running == 3);
+    http_multi_destroy(multi);
+
+    printf("http_multi_test: 2 hosts, at most 3 connections %.1fms\n", elapsed);
+}
+
+static void test_reuse(void) {
+    http_multi_t      *multi = http_multi_create(&transport, NULL);
+    http_multi_stats_t stats;
+    fetch_t            fetch;
+    char               url[64];
+
+    atomic_store(&accepted, 0);
+    url_for(url, sizeof(url), "localhost", "/res/1");
+    for (int i = 0; i < 5; i++) {
+        http_multi_request_t request = request_for(&fetch, url);
+        CHECK(fetch_one(multi, &fetch, &request));
+        CHECK(fetch.result == HTTP_MULTI_OK && fetch.connects == (i == 0));
+    }
+    http_multi_stats_get(multi, &stats);
+    CHECK(stats.opened == 1 && stats.reused == 4);
+
+    // Connections aren't shared between configs, or kept when asked not to
+    http_multi_request_t request = request_for(&fetch, url);
+    request.config               = 1;
+    CHECK(fetch_one(multi, &fetch, &request));
+    CHECK(fetch.connects == 1);
+
+    request              = request_for(&fetch, url);
+    request.forbid_reuse = true;
+    CHECK(fetch_one(multi, &fetch, &request));
+    CHECK(fetch.connects == 0);
+
+    request = request_for(&fetch, url);
+    CHECK(fetch_one(multi, &fetch, &request));
+    CHECK(fetch.connects == 1);
+
+    request               = request_for(&fetch, url);
+    request.fresh_connect = true;
+    CHECK(fetch_one(multi, &fetch, &request));
+    CHECK(fetch.connects == 1);
+    CHECK(atomic_load(&accepted) == 4);
+
+    // A connection the server closed while it was idle is found out when using it, the request goes again
+    request         = request_for(&fetch, url);
+    request.headers = "X-Drop: 1\r\n";
+    CHECK(fetch_one(multi, &fetch, &request));
+    usleep(10000);
+    request = request_for(&fetch, url);
+    CHECK(fetch_one(multi, &fetch, &request));
+    CHECK(fetch.result == HTTP_MULTI_OK && strcmp(fetch.body, "resource 1 from localhost") == 0);
+    CHECK(fetch.connects == 1);
+    http_multi_stats_get(multi, &stats);
+    CHECK(stats.retried == 1);
+
+    http_multi_destroy(multi);
+}
+
+static void test_bodies(void) {
+    http_multi_t *multi = http_multi_create(&transport, NULL);
+    fetch_t       fetch;
+    char          url[64];
+
+    // Interim responses are skipped, chunk extensions and trailers are dropped
+    url_for(url, sizeof(url), "localhost", "/chunked");
+    http_multi_request_t request = request_for(&fetch, url);
+    CHECK(fetch_one(multi, &fetch, &request));
+    CHECK(fetch.result == HTTP_MULTI_OK && fetch.status == 200 && fetch.content_length == -1);
+    CHECK(strcmp(fetch.body, "hello chunked world") == 0);
+    CHECK(fetch.headers == 2);
+
+    // The connection is still good after it
+    request = request_for(&fetch, url);
+    CHECK(fetch_one(multi, &fetch, &request));
+    CHECK(fetch.connects == 0 && strcmp(fetch.body, "hello chunked world") == 0);
+
+    url_for(url, sizeof(url), "localhost", "/close");
+    request = request_for(&fetch, url);
+    CHECK(fetch_one(multi, &fetch, &request));
+    CHECK(fetch.result == HTTP_MULTI_OK && strcmp(fetch.body, "until the connection closes") == 0);
+
+    url_for(url, sizeof(url), "localhost", "/res/2");
+    request        = request_for(&fetch, url);
+    request.method = "HEAD";
+    CHECK(fetch_one(multi, &fetch, &request));
+    CHECK(fetch.result == HTTP_MULTI_OK && fetch.len == 0 && fetch.content_length == 25);
+
+    url_for(url, sizeof(url), "localhost", "/empty");
+    request = request_for(&fetch, url);
+    CHECK(fetch_one(multi, &fetch, &request));
+    CHECK(fetch.result == HTTP_MULTI_OK && fetch.status == 204 && fetch.len == 0);
+
+    url_for(url, sizeof(url), "localhost", "/echo");
+    char body[1000];
+    for (size_t i = 0; i < sizeof(body); i++) {
+        body[i] = 'a' + i % 26;
+    }
+    request          = request_for(&fetch, url);
+    request.method   = "POST";
+    request.body     = body;
+    request.body_len = sizeof(body);
+    CHECK(fetch_one(multi, &fetch, &request));
+    CHECK(fetch.result == HTTP_MULTI_OK && fetch.len == sizeof(body) && memcmp(fetch.body, body, sizeof(body)) == 0);
+
+    // A data callback stops the transfer
+    url_for(url, sizeof(url), "localhost", "/res/3");
+    request      = request_for(&fetch, url);
+    fetch.len    = sizeof(fetch.body);
+    CHECK(fetch_one(multi, &fetch, &request));
+    CHECK(fetch.result == HTTP_MULTI_ERR_ABORTED);
+
+    http_multi_destroy(multi);
+}
+
+static void test_redirects(void) {
+    http_multi_t *multi = http_multi_create(&transport, NULL);
+    fetch_t       fetch;
+    char          url[64];
+    char          want[64];
+
+    url_for(url, sizeof(url), "localhost", "/redirect");
+    url_for(want, sizeof(want), "localhost", "/res/7");
+    http_multi_request_t request = request_for(&fetch, url);
+    CHECK(fetch_one(multi, &fetch, &request));
+    CHECK(fetch.result == HTTP_MULTI_OK && fetch.status == 200 && strcmp(fetch.url, want) == 0);
+    CHECK(strcmp(fetch.body, "resource 7 from localhost") == 0);
+
+    request               = request_for(&fetch, url);
+    request.max_redirects = 0;
+    CHECK(fetch_one(multi, &fetch, &request));
+    CHECK(fetch.result == HTTP_MULTI_OK && fetch.status == 302 && strcmp(fetch.body, "moved") == 0);
+
+    url_for(url, sizeof(url), "localhost", "/loop");
+    request = request_for(&fetch, url);
+    CHECK(fetch_one(multi, &fetch, &request));
+    CHECK(fetch.result == HTTP_MULTI_ERR_REDIRECTS);
+
+    // See other turns a POST into a GET, here to another host. Giving up on the loop closed the connection, so this
+    // makes one for each host.
+    url_for(url, sizeof(url), "localhost", "/see-other");
+    request          = request_for(&fetch, url);
+    request.method   = "POST";
+    request.body     = "x";
+    request.body_len = 1;
+    CHECK(fetch_one(multi, &fetch, &request));
+    CHECK(fetch.result == HTTP_MULTI_OK && strcmp(fetch.body, "GET") == 0 && fetch.connects == 2);
+
+    http_multi_destroy(multi);
+}
+
+static void test_encodings(void) {
+    http_multi_t *multi = http_multi_create(&transport, NULL);
+    fetch_t       fetch;
+    char          url[64];
+
+    static char const *const paths[] = {"/gzip", "/gzip-chunked", "/deflate", "/raw-deflate"};
+    for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); i++) {
+        url_for(url, sizeof(url), "localhost", paths[i]);
+        http_multi_request_t request = request_for(&fetch, url);
+        request.decode               = true;
+        CHECK(fetch_one(multi, &fetch, &request));
+        CHECK(fetch.result == HTTP_MULTI_OK && fetch.len == catalog_len);
+        CHECK(memcmp(fetch.body, catalog, catalog_len) == 0);
+    }
+
+    // Left alone unless asked for
+    url_for(url, sizeof(url), "localhost", "/gzip");
+    http_multi_request_t request = request_for(&fetch, url);
+    CHECK(fetch_one(multi, &fetch, &request));
+    CHECK(fetch.result == HTTP_MULTI_OK && fetch.len == sizeof(catalog_gzip));
+    CHECK(memcmp(fetch.body, catalog_gzip, sizeof(catalog_gzip)) == 0);
+
+    url_for(url, sizeof(url), "localhost", "/brotli");
+    request = request_for(&fetch, url);
+    CHECK(fetch_one(multi, &fetch, &request));
+    CHECK(fetch.result == HTTP_MULTI_OK && strcmp(fetch.body, "not gzip") == 0);
+    request        = request_for(&fetch, url);
+    request.decode = true;
+    CHECK(fetch_one(multi, &fetch, &request));
+    CHECK(fetch.result == HTTP_MULTI_ERR_ENCODING && fetch.len == 0);
+
+    // A stream cut short within a complete body
+    url_for(url, sizeof(url), "localhost", "/gzip-cut");
+    request        = request_for(&fetch, url);
+    request.decode = true;
+    CHECK(fetch_one(multi, &fetch, &request));
+    CHECK(fetch.result == HTTP_MULTI_ERR_ENCODING && fetch.len == catalog_len);
+
+    // A data callback stops decoding too
+    url_for(url, sizeof(url), "localhost", "/gzip");
+    request        = request_for(&fetch, url);
+    request.decode = true;
+    fetch.len      = sizeof(fetch.body);
+    CHECK(fetch_one(multi, &fetch, &request));
+    CHECK(fetch.result == HTTP_MULTI_ERR_ABORTED);
+
+    http_multi_destroy(multi);
+}
+
+static void test_ranges(void) {
+    http_multi_t *multi = http_multi_create(&transport, NULL);
+    fetch_t       fetch;
+    char          url[64];
+
+    url_for(url, sizeof(url), "localhost", "/range");
+    http_multi_request_t request = request_for(&fetch, url);
+    request.headers              = "Range: bytes=1000-\r\n";
+    request.resume_from          = 1000;
+    CHECK(fetch_one(multi, &fetch, &request));
+    CHECK(fetch.result == HTTP_MULTI_OK && fetch.status == 206);
+    CHECK(fetch.len == catalog_len - 1000 && memcmp(fetch.body, catalog + 1000, fetch.len) == 0);
+
+    // A server that sends everything again can't be resumed from, one without a resume is fine with it
+    url_for(url, sizeof(url), "localhost", "/no-range");
+    request             = request_for(&fetch, url);
+    request.headers     = "Range: bytes=1000-\r\n";
+    request.resume_from = 1000;
+    CHECK(fetch_one(multi, &fetch, &request));
+    CHECK(fetch.result == HTTP_MULTI_ERR_RANGE && fetch.status == 200 && fetch.len == 0);
+    request         = request_for(&fetch, url);
+    request.headers = "Range: bytes=1000-\r\n";
+    CHECK(fetch_one(multi, &fetch, &request));
+    CHECK(fetch.result == HTTP_MULTI_OK && fetch.len == catalog_len);
+
+    url_for(url, sizeof(url), "localhost", "/range");
+    request             = request_for(&fetch, url);
+    request.headers     = "Range: bytes=9999-\r\n";
+    request.resume_from = 9999;
+    CHECK(fetch_one(multi, &fetch, &request));
+    CHECK(fetch.result == HTTP_MULTI_OK && fetch.status == 416 && fetch.len == 0);
+
+    http_multi_destroy(multi);
+}
+
+static void test_framing(void) {
+    http_multi_t *multi = http_multi_create(&transport, NULL);
+    fetch_t       fetch;
+    char          url[64];
+
+    static struct {
+        char const         *path;
+        http_multi_result_t result;
+        char const         *body;
+        bool                reused;
+    } const cases[] = {
+        {"/short", HTTP_MULTI_ERR_PARTIAL, "not 100 bytes", false},
+        {"/short-chunked", HTTP_MULTI_ERR_PARTIAL, "hello", false},
+        {"/bad-chunk", HTTP_MULTI_ERR_PROTOCOL, "", false},
+        {"/chunk-space", HTTP_MULTI_OK, "hello", true},
+        {"/two-lengths", HTTP_MULTI_ERR_PROTOCOL, "", false},
+        {"/length-and-chunked", HTTP_MULTI_OK, "hello", false},
+        {"/too-long", HTTP_MULTI_OK, "hello", false},
+        {"/not-chunked", HTTP_MULTI_OK, "5\r\nhello\r\n", false},
+    };
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        url_for(url, sizeof(url), "localhost", cases[i].path);
+        http_multi_request_t request = request_for(&fetch, url);
+        CHECK(fetch_one(multi, &fetch, &request));
+        if (fetch.result != cases[i].result || strcmp(fetch.body, cases[i].body) != 0) {
+            printf("FAIL %s: result %d, body '%s'\n", cases[i].path, fetch.result, fetch.body);
+            failures++;
+        }
+
+        // Only a well formed response leaves a connection worth keeping
+        url_for(url, sizeof(url), "localhost", "/res/5");
+        request = request_for(&fetch, url);
+        CHECK(fetch_one(multi, &fetch, &request));
+        CHECK(fetch.result == HTTP_MULTI_OK && fetch.connects == !cases[i].reused);
+    }
+
+    http_multi_destroy(multi);
+}
+
+static void test_errors(void) {
+    http_multi_t *multi = http_multi_create(&transport, NULL);
+    fetch_t       fetch;
+    fetch_t       other;
+    char          url[64];
+
+    http_multi_request_t request = request_for(&fetch, "ftp://localhost/");
+    CHECK(fetch_one(multi, &fetch, &request));
+    CHECK(fetch.result == HTTP_MULTI_ERR_URL);
+
+    // Nothing listens on port 1
+    request = request_for(&fetch, "http://localhost:1/");
+    CHECK(fetch_one(multi, &fetch, &request));
+    CHECK(fetch.result == HTTP_MULTI_ERR_CONNECT);
+
+    url_for(url, sizeof(url), "localhost", "/slow");
+    request            = request_for(&fetch, url);
+    request.timeout_ms = 100;
+    double start       = now_ms();
+    CHECK(fetch_one(multi, &fetch, &request));
+    CHECK(fetch.result == HTTP_MULTI_ERR_TIMEOUT && now_ms() - start < 1000);
+
+    // A transfer removed while running goes away without a message, the others carry on
+    request = request_for(&fetch, url);
+    CHECK(http_multi_add(multi, &request));
+    CHECK(!http_multi_add(multi, &request));
+    url_for(url, sizeof(url), "localhost", "/res/4");
+    http_multi_request_t second = request_for(&other, url);
+    CHECK(http_multi_add(multi, &second));
+    for (int i = 0; i < 5; i++) {
+        http_multi_perform(multi);
+        http_multi_poll(multi, NULL, 0, 5);
+    }
+    CHECK(http_multi_remove(multi, &fetch));
+    CHECK(!http_multi_remove(multi, &fetch));
+    run(multi);
+    CHECK(!fetch.done && other.result == HTTP_MULTI_OK);
+
+    void               *user_data;
+    http_multi_result_t result;
+    int                 left;
+    CHECK(http_multi_info_read(multi, &user_data, &result, &left) && user_data == &other && left == 0);
+    CHECK(!http_multi_info_read(multi, &user_data, &result, &left));
+
+    // Extra file descriptors are waited on too
+    int fds[2];
+    CHECK(pipe(fds) == 0);
+    CHECK(write(fds[1], "x", 1) == 1);
+    http_multi_waitfd_t extra[] = {{.fd = fds[0], .events = HTTP_MULTI_POLL_IN}};
+    CHECK(http_multi_poll(multi, extra, 1, 1000) == 1 && extra[0].revents == HTTP_MULTI_POLL_IN);
+    close(fds[0]);
+    close(fds[1]);
+
+    http_multi_destroy(multi);
+}
+
+int main(void) {
+    for (int i = 0; i < CATALOG_LINES; i++) {
+        catalog_len += snprintf(catalog + catalog_len, sizeof(catalog) - catalog_len, "line %d of the catalog\n", i);
+    }
+    start_server();
+
+    test_parallel();
+    test_hosts();
+    test_reuse();
+    test_bodies();
+    test_redirects();
+    test_encodings();
+    test_ranges();
+    test_framing();
+    test_errors();
+
+    return check_report("http_multi_test");
+}
@@ -0,0 +1,582 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Drives the kernel I/O request queue against a fake filesystem device: ordering, bounce buffer semantics, stale and
+// foreign request handles, cancellation and process teardown, then a run with worker and submitter threads that
+// follows the same locking as io_service.c.
+
+#define _GNU_SOURCE
+
+#include "badgevms/device.h"
+#include "check.h"
+#include "esp_heap_caps.h"
+#include "io_queue.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define NUM_FILES  32
+#define FILE_SIZE  4096
+#define SUBMITTERS 4
+#define WORKERS    2
+#define ROUNDS     2000
+
+typedef struct {
+    char   data[FILE_SIZE];
+    size_t size;
+    off_t  pos;
+} fake_file_t;
+
+typedef struct {
+    filesystem_device_t filesystem;
+    fake_file_t         files[NUM_FILES];
+    atomic_int          lseek_calls;
+    atomic_int          fsync_calls;
+    bool                fail;
+} fake_fs_t;
+
+static atomic_int live_allocations;
+static fake_fs_t  fake_fs;
+
+void *heap_caps_malloc(size_t size, uint32_t caps) {
+    (void)caps;
+    atomic_fetch_add(&live_allocations, 1);
+    return malloc(size);
+}
+
+void heap_caps_free(void *ptr) {
+    if (ptr) {
+        atomic_fetch_sub(&live_allocations, 1);
+    }
+    free(ptr);
+}
+
+static ssize_t fake_read(void *dev, int fd, void *buf, size_t count) {
+    fake_fs_t   *fs   = dev;
+    fake_file_t *file = &fs->files[fd];
+
+    if (fs->fail) {
+        errno = EIO;
+        return -1;
+    }
+
+    if ((size_t)file->pos >= file->size) {
+        return 0;
+    }
+
+    if (count > file->size - file->pos) {
+        count = file->size - file->pos;
+    }
+
+    memcpy(buf, file->data + file->pos, count);
+    file->pos += count;
+    return count;
+}
+
+static ssize_t fake_write(void *dev, int fd, void const *buf, size_t count) {
+    fake_fs_t   *fs   = dev;
+    fake_file_t *file = &fs->files[fd];
+
+    if (fs->fail) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    if (count > (size_t)(FILE_SIZE - file->pos)) {
+        count = FILE_SIZE - file->pos;
+    }
+
+    memcpy(file->data + file->pos, buf, count);
+    file->pos += count;
+    if ((size_t)file->pos > file->size) {
+        file->size = file->pos;
+    }
+    return count;
+}
+
+static ssize_t fake_lseek(void *dev, int fd, off_t offset, int whence) {
+    fake_fs_t *fs = dev;
+
+    atomic_fetch_add(&fs->lseek_calls, 1);
+    if (whence != SEEK_SET || offset < 0 || offset > FILE_SIZE) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    fs->files[fd].pos = offset;
+    return offset;
+}
+
+static int fake_fsync(void *dev, int fd) {
+    (void)fd;
+    atomic_fetch_add(&((fake_fs_t *)dev)->fsync_calls, 1);
+    return 0;
+}
+
+static void fake_fs_init(void) {
+    memset(&fake_fs, 0, sizeof(fake_fs));
+    fake_fs.filesystem.device.type   = DEVICE_TYPE_FILESYSTEM;
+    fake_fs.filesystem.device._read  = fake_read;
+    fake_fs.filesystem.device._write = fake_write;
+    fake_fs.filesystem.device._lseek = fake_lseek;
+    fake_fs.filesystem._fsync        = fake_fsync;
+
+    for (int i = 0; i < NUM_FILES; ++i) {
+        for (int j = 0; j < FILE_SIZE; ++j) {
+            fake_fs.files[i].data[j] = (char)(i * 31 + j);
+        }
+        fake_fs.files[i].size = FILE_SIZE;
+    }
+}
+
+static io_request_t submit(
+    io_queue_t *queue, io_op_t op, int fd, void *buf, size_t count, off_t offset, void const *owner, int *err
+) {
+    void *bounce = io_bounce_create(op, buf, &count);
+    if (!bounce && count) {
+        *err = ENOMEM;
+        return -1;
+    }
+
+    io_request_t request =
+        io_queue_submit(queue, op, &fake_fs.filesystem.device, fd, buf, bounce, count, offset, owner, err);
+    if (request < 0) {
+        heap_caps_free(bounce);
+    }
+    return request;
+}
+
+static void run_one(io_queue_t *queue) {
+    io_slot_t *slot = io_queue_take(queue);
+    CHECK(slot != NULL);
+    if (slot) {
+        io_slot_execute(slot);
+        io_queue_complete(queue, slot);
+    }
+}
+
+static ssize_t reap(io_queue_t *queue, io_request_t request, void const *owner, int *err) {
+    io_slot_t *slot = io_queue_find(queue, request, owner);
+    if (!slot || !io_queue_claim(queue, slot)) {
+        *err = EINVAL;
+        return -1;
+    }
+
+    ssize_t result = io_slot_finish(slot, err);
+    io_queue_release(queue, slot);
+    return result;
+}
+
+static void check_basics(void) {
+    static io_queue_t queue;
+    int               owner;
+    int               err;
+    char              buf[3][64];
+
+    fake_fs_init();
+    io_queue_init(&queue);
+
+    // Requests run in submission order, even when they are reaped in another
+    io_request_t r0 = submit(&queue, IO_OP_READ, 0, buf[0], 16, 0, &owner, &err);
+    io_request_t r1 = submit(&queue, IO_OP_READ, 1, buf[1], 16, 100, &owner, &err);
+    io_request_t r2 = submit(&queue, IO_OP_FSYNC, 2, NULL, 0, IO_OFFSET_CURRENT, &owner, &err);
+    CHECK(r0 >= 0 && r1 >= 0 && r2 >= 0);
+    CHECK(r0 != r1 && r1 != r2);
+    CHECK(queue.queued == 3);
+
+    io_slot_t *slot = io_queue_take(&queue);
+    CHECK(slot == io_queue_find(&queue, r0, &owner));
+    CHECK(slot->state == IO_SLOT_RUNNING);
+    CHECK(!io_queue_claim(&queue, slot));
+    io_slot_execute(slot);
+    io_queue_complete(&queue, slot);
+    run_one(&queue);
+    run_one(&queue);
+    CHECK(io_queue_take(&queue) == NULL);
+    CHECK(queue.queued == 0);
+    CHECK(fake_fs.lseek_calls == 2);
+    CHECK(fake_fs.fsync_calls == 1);
+
+    // Read data only lands in the caller's buffer when it reaps the request
+    memset(buf, 0, sizeof(buf));
+    CHECK(reap(&queue, r2, &owner, &err) == 0);
+    CHECK(reap(&queue, r1, &owner, &err) == 16);
+    CHECK(memcmp(buf[1], fake_fs.files[1].data + 100, 16) == 0);
+    CHECK(buf[0][0] == 0 && buf[0][15] == 0);
+    CHECK(reap(&queue, r0, &owner, &err) == 16);
+    CHECK(memcmp(buf[0], fake_fs.files[0].data, 16) == 0);
+
+    // A reaped handle is gone, even once its slot is in use again
+    CHECK(io_queue_find(&queue, r0, &owner) == NULL);
+    io_request_t again = submit(&queue, IO_OP_READ, 0, buf[0], 16, IO_OFFSET_CURRENT, &owner, &err);
+    CHECK(again >= 0 && again != r0);
+    CHECK(io_queue_find(&queue, r0, &owner) == NULL);
+    CHECK(io_queue_find(&queue, again, &err) == NULL);
+    CHECK(io_queue_find(&queue, -1, &owner) == NULL);
+    run_one(&queue);
+    CHECK(reap(&queue, again, &owner, &err) == 16);
+    CHECK(memcmp(buf[0], fake_fs.files[0].data + 16, 16) == 0);
+
+    // Data to write is taken at submission
+    strcpy(buf[0], "hello, world");
+    io_request_t w = submit(&queue, IO_OP_WRITE, 3, buf[0], 12, 8, &owner, &err);
+    strcpy(buf[0], "overwritten!");
+    run_one(&queue);
+    CHECK(reap(&queue, w, &owner, &err) == 12);
+    CHECK(memcmp(fake_fs.files[3].data + 8, "hello, world", 12) == 0);
+
+    // Errors come back with their errno
+    fake_fs.fail = true;
+    w            = submit(&queue, IO_OP_WRITE, 3, buf[0], 12, IO_OFFSET_CURRENT, &owner, &err);
+    run_one(&queue);
+    CHECK(reap(&queue, w, &owner, &err) == -1);
+    CHECK(err == ENOSPC);
+    fake_fs.fail = false;
+
+    r0 = submit(&queue, IO_OP_READ, 4, buf[0], 16, FILE_SIZE + 1, &owner, &err);
+    run_one(&queue);
+    CHECK(reap(&queue, r0, &owner, &err) == -1);
+    CHECK(err == EINVAL);
+
+    // Large transfers are clamped to the bounce buffer
+    size_t count  = IO_BOUNCE_MAX + 100;
+    void  *bounce = io_bounce_create(IO_OP_READ, NULL, &count);
+    CHECK(count == IO_BOUNCE_MAX);
+    heap_caps_free(bounce);
+
+    // The queue fills up
+    io_request_t all[IO_QUEUE_DEPTH];
+    for (int i = 0; i < IO_QUEUE_DEPTH; ++i) {
+        all[i] = submit(&queue, IO_OP_READ, i % NUM_FILES, buf[0], 4, 0, &owner, &err);
+        CHECK(all[i] >= 0);
+    }
+    CHECK(submit(&queue, IO_OP_READ, 0, buf[0], 4, 0, &owner, &err) == -1);
+    CHECK(err == EAGAIN);
+
+    // Cancelling the head, the middle and the tail keeps the rest in order
+    slot = io_queue_find(&queue, all[0], &owner);
+    CHECK(io_queue_cancel(&queue, slot));
+    CHECK(io_queue_cancel(&queue, io_queue_find(&queue, all[5], &owner)));
+    CHECK(io_queue_cancel(&queue, io_queue_find(&queue, all[IO_QUEUE_DEPTH - 1], &owner)));
+    CHECK(io_queue_find(&queue, all[5], &owner) == NULL);
+    CHECK(queue.queued == IO_QUEUE_DEPTH - 3);
+
+    io_request_t last = submit(&queue, IO_OP_READ, 0, buf[0], 4, 0, &owner, &err);
+    CHECK(last >= 0);
+    for (int i = 1; i < IO_QUEUE_DEPTH - 1; ++i) {
+        if (i == 5) {
+            continue;
+        }
+        slot = io_queue_take(&queue);
+        CHECK(slot == io_queue_find(&queue, all[i], &owner));
+        io_slot_execute(slot);
+        io_queue_complete(&queue, slot);
+        CHECK(!io_queue_cancel(&queue, slot));
+        CHECK(reap(&queue, all[i], &owner, &err) == 4);
+    }
+    slot = io_queue_take(&queue);
+    CHECK(slot == io_queue_find(&queue, last, &owner));
+    io_slot_execute(slot);
+
+    // A waiter is only handed back while it is waiting
+    slot->waiter = &owner;
+    CHECK(io_queue_complete(&queue, slot) == &owner);
+    CHECK(slot->notified);
+    CHECK(reap(&queue, last, &owner, &err) == 4);
+    CHECK(queue.queued == 0 && queue.head == -1 && queue.tail == -1);
+    CHECK(live_allocations == 0);
+}
+
+static void check_teardown(void) {
+    static io_queue_t queue;
+    int               owner;
+    int               other;
+    int               err;
+    char              buf[4][16];
+
+    fake_fs_init();
+    io_queue_init(&queue);
+
+    io_request_t done    = submit(&queue, IO_OP_READ, 0, buf[0], 16, 0, &owner, &err);
+    io_request_t running = submit(&queue, IO_OP_READ, 1, buf[1], 16, 0, &owner, &err);
+    io_request_t theirs  = submit(&queue, IO_OP_READ, 2, buf[2], 16, 0, &other, &err);
+    io_request_t queued  = submit(&queue, IO_OP_READ, 3, buf[3], 16, 0, &owner, &err);
+
+    run_one(&queue);
+    io_slot_t *slot = io_queue_take(&queue);
+    CHECK(slot == io_queue_find(&queue, running, &owner));
+
+    // Everything but the running request goes at once, that one is dropped by its worker
+    CHECK(io_queue_cancel_owner(&queue, &owner) == 1);
+    CHECK(io_queue_find(&queue, done, &owner) == NULL);
+    CHECK(io_queue_find(&queue, running, &owner) == NULL);
+    CHECK(io_queue_find(&queue, queued, &owner) == NULL);
+    CHECK(io_queue_find(&queue, theirs, &other) != NULL);
+    CHECK(io_queue_cancel_owner(&queue, &owner) == 1);
+
+    slot->waiter = &owner;
+    io_slot_execute(slot);
+    CHECK(io_queue_complete(&queue, slot) == NULL);
+    CHECK(slot->state == IO_SLOT_FREE);
+    CHECK(io_queue_cancel_owner(&queue, &owner) == 0);
+
+    run_one(&queue);
+    CHECK(io_queue_take(&queue) == NULL);
+    CHECK(reap(&queue, theirs, &other, &err) == 16);
+    CHECK(live_allocations == 0);
+}
+
+static void check_same_fd(void) {
+    static io_queue_t queue;
+    int               owner;
+    int               err;
+    char              buf[16];
+
+    fake_fs_init();
+    io_queue_init(&queue);
+
+    // Two writes to one file queued back to back, with a read of another file behind them
+    io_request_t first  = submit(&queue, IO_OP_WRITE, 0, "abcd", 4, 0, &owner, &err);
+    io_request_t second = submit(&queue, IO_OP_WRITE, 0, "efgh", 4, IO_OFFSET_CURRENT, &owner, &err);
+    io_request_t other  = submit(&queue, IO_OP_READ, 1, buf, 16, 0, &owner, &err);
+    CHECK(first >= 0 && second >= 0 && other >= 0);
+
+    // The second write waits for the first, the read of the other file goes past it
+    io_slot_t *running = io_queue_take(&queue);
+    CHECK(running == io_queue_find(&queue, first, &owner));
+    io_slot_t *slot = io_queue_take(&queue);
+    CHECK(slot == io_queue_find(&queue, other, &owner));
+    CHECK(io_queue_take(&queue) == NULL);
+    CHECK(io_queue_take(&queue) == NULL);
+    CHECK(queue.queued == 1);
+
+    io_slot_execute(slot);
+    io_queue_complete(&queue, slot);
+    CHECK(io_queue_retry(&queue) == 2);
+    CHECK(io_queue_take(&queue) == NULL);
+
+    io_slot_execute(running);
+    io_queue_complete(&queue, running);
+    CHECK(io_queue_retry(&queue) == 1);
+    CHECK(io_queue_retry(&queue) == 0);
+
+    run_one(&queue);
+    CHECK(queue.queued == 0 && queue.head == -1 && queue.tail == -1);
+    CHECK(reap(&queue, first, &owner, &err) == 4);
+    CHECK(reap(&queue, second, &owner, &err) == 4);
+    CHECK(reap(&queue, other, &owner, &err) == 16);
+    CHECK(memcmp(fake_fs.files[0].data, "abcdefgh", 8) == 0);
+
+    // A request held back also holds back the newer ones that share its file or socket
+    device_t     sock = {.type = DEVICE_TYPE_SOCKET};
+    io_request_t read = submit(&queue, IO_OP_READ, 2, buf, 4, 0, &owner, &err);
+    io_request_t sent = io_queue_submit_sendfile(&queue, &fake_fs.filesystem.device, 2, &sock, 0, 4, 0, &owner, &err);
+    io_request_t next = io_queue_submit_sendfile(&queue, &fake_fs.filesystem.device, 3, &sock, 0, 4, 0, &owner, &err);
+    io_request_t last = submit(&queue, IO_OP_READ, 3, buf, 4, 0, &owner, &err);
+    CHECK(read >= 0 && sent >= 0 && next >= 0 && last >= 0);
+
+    running = io_queue_take(&queue);
+    CHECK(running == io_queue_find(&queue, read, &owner));
+    CHECK(io_queue_take(&queue) == NULL);
+    io_slot_execute(running);
+    io_queue_complete(&queue, running);
+
+    running = io_queue_take(&queue);
+    CHECK(running == io_queue_find(&queue, sent, &owner));
+    CHECK(io_queue_take(&queue) == NULL);
+    CHECK(io_queue_cancel_owner(&queue, &owner) == 1);
+    io_queue_complete(&queue, running);
+    CHECK(queue.queued == 0 && queue.head == -1 && queue.tail == -1);
+    CHECK(live_allocations == 0);
+}
+
+typedef struct {
+    io_queue_t      queue;
+    pthread_mutex_t lock;
+    pthread_cond_t  work;
+    pthread_cond_t  completed;
+    bool            stop;
+} stress_t;
+
+static stress_t stress;
+
+static void *stress_worker(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&stress.lock);
+    while (1) {
+        io_slot_t *slot = io_queue_take(&stress.queue);
+        if (!slot) {
+            if (stress.stop) {
+                break;
+            }
+            pthread_cond_wait(&stress.work, &stress.lock);
+            continue;
+        }
+        pthread_mutex_unlock(&stress.lock);
+
+        io_slot_execute(slot);
+
+        pthread_mutex_lock(&stress.lock);
+        if (io_queue_complete(&stress.queue, slot)) {
+            pthread_cond_broadcast(&stress.completed);
+        }
+        if (io_queue_retry(&stress.queue)) {
+            pthread_cond_broadcast(&stress.work);
+        }
+    }
+    pthread_mutex_unlock(&stress.lock);
+
+    return NULL;
+}
+
+static ssize_t stress_wait(io_request_t request, void const *owner, int *err) {
+    pthread_mutex_lock(&stress.lock);
+    io_slot_t *slot = io_queue_find(&stress.queue, request, owner);
+    while (slot && !io_queue_claim(&stress.queue, slot)) {
+        slot->waiter = (void *)owner;
+        pthread_cond_wait(&stress.completed, &stress.lock);
+        slot->waiter = NULL;
+    }
+    pthread_mutex_unlock(&stress.lock);
+
+    if (!slot) {
+        *err = EINVAL;
+        return -1;
+    }
+
+    ssize_t result = io_slot_finish(slot, err);
+
+    pthread_mutex_lock(&stress.lock);
+    io_queue_release(&stress.queue, slot);
+    pthread_mutex_unlock(&stress.lock);
+    return result;
+}
+
+// Each submitter keeps one request in flight on each of its files, writing a pattern and reading it back
+static void *stress_submitter(void *arg) {
+    int          id    = (int)(intptr_t)arg;
+    int const    files = NUM_FILES / SUBMITTERS;
+    io_request_t requests[NUM_FILES / SUBMITTERS];
+    char         out[NUM_FILES / SUBMITTERS][64];
+    char         in[NUM_FILES / SUBMITTERS][64];
+
+    for (int round = 0; round < ROUNDS; ++round) {
+        bool    write = round % 2 == 0;
+        io_op_t op    = write ? IO_OP_WRITE : IO_OP_READ;
+        size_t  len   = 1 + (round / 2 * 7 + id) % sizeof(out[0]);
+        off_t   at    = (round / 2 % 16) * sizeof(out[0]);
+
+        for (int f = 0; f < files; ++f) {
+            int fd = id * files + f;
+            int err;
+
+            if (write) {
+                for (size_t i = 0; i < sizeof(out[f]); ++i) {
+                    out[f][i] = (char)(round + fd + i);
+                }
+            }
+
+            size_t count  = len;
+            void  *bounce = io_bounce_create(op, out[f], &count);
+
+            pthread_mutex_lock(&stress.lock);
+            while (1) {
+                requests[f] = io_queue_submit(
+                    &stress.queue,
+                    op,
+                    &fake_fs.filesystem.device,
+                    fd,
+                    write ? out[f] : in[f],
+                    bounce,
+                    count,
+                    at,
+                    &stress,
+                    &err
+                );
+                if (requests[f] >= 0) {
+                    break;
+                }
+
+                // Full, let the workers catch up
+                pthread_mutex_unlock(&stress.lock);
+                usleep(10);
+                pthread_mutex_lock(&stress.lock);
+            }
+            pthread_cond_signal(&stress.work);
+            pthread_mutex_unlock(&stress.lock);
+        }
+
+        for (int f = 0; f < files; ++f) {
+            int     err;
+            ssize_t result = stress_wait(requests[f], &stress, &err);
+            CHECK(result == (ssize_t)len);
+            if (!write && result == (ssize_t)len) {
+                CHECK(memcmp(in[f], out[f], len) == 0);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static void check_threads(void) {
+    pthread_t workers[WORKERS];
+    pthread_t submitters[SUBMITTERS];
+
+    fake_fs_init();
+    io_queue_init(&stress.queue);
+    pthread_mutex_init(&stress.lock, NULL);
+    pthread_cond_init(&stress.work, NULL);
+    pthread_cond_init(&stress.completed, NULL);
+
+    for (int i = 0; i < WORKERS; ++i) {
+        pthread_create(&workers[i], NULL, stress_worker, NULL);
+    }
+    for (int i = 0; i < SUBMITTERS; ++i) {
+        pthread_create(&submitters[i], NULL, stress_submitter, (void *)(intptr_t)i);
+    }
+    for (int i = 0; i < SUBMITTERS; ++i) {
+        pthread_join(submitters[i], NULL);
+    }
+
+    pthread_mutex_lock(&stress.lock);
+    stress.stop = true;
+    pthread_cond_broadcast(&stress.work);
+    pthread_mutex_unlock(&stress.lock);
+    for (int i = 0; i < WORKERS; ++i) {
+        pthread_join(workers[i], NULL);
+    }
+
+    CHECK(stress.queue.queued == 0);
+    CHECK(live_allocations == 0);
+}
+
+int main(void) {
+    check_basics();
+    check_teardown();
+    check_same_fd();
+    check_threads();
+
+    return check_report("io_queue_test");
+}
@@ -0,0 +1,599 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// The OTA stream between an HTTP server on the loopback interface and a fake flash that takes as long to program as it
+// takes the network to deliver: overlap of receiving and writing against writing in the receiving thread, the SHA-256
+// of what was written, connections that break and servers that ignore the Range header, failing flash writes and
+// cancelling an update half way.
+
+#define _GNU_SOURCE
+
+#include "ota_stream.h"
+#include "check.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/evp.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+// The server sends NET_CHUNK every CHUNK_US, the fake flash takes as long to erase a block before writing it. A stall
+// of the flash much longer than the socket buffers can cover holds up a server that writes in the receiving thread.
+#define IMAGE_BYTES  (512 * 1024)
+#define BUFFER_BYTES (64 * 1024)
+#define ERASE_BYTES  (64 * 1024)
+#define NET_CHUNK    4096
+#define CHUNK_US     2000
+#define ERASE_US     (ERASE_BYTES / NET_CHUNK * CHUNK_US)
+#define RETRIES      3
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+    UBaseType_t     count;
+} semaphore_t;
+
+typedef struct {
+    bool   honour_range;
+    int    status;
+    size_t drop_after;
+    int    drops;
+    int    requests;
+    size_t last_range;
+} server_t;
+
+typedef struct {
+    bool   direct;
+    size_t direct_offset;
+} client_t;
+
+typedef struct {
+    uint8_t    data[IMAGE_BYTES];
+    size_t     fail_at;
+    size_t     next;
+    bool       slow;
+    atomic_int writes;
+    atomic_int out_of_order;
+    atomic_int in_flight;
+    atomic_int overlapped;
+} flash_t;
+
+static uint8_t         image[IMAGE_BYTES];
+static uint8_t         image_digest[32];
+static int             server_port;
+static pthread_mutex_t server_lock = PTHREAD_MUTEX_INITIALIZER;
+static server_t        server;
+static flash_t         flash;
+static ota_stream_t   *stream;
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max_count, UBaseType_t initial_count) {
+    (void)max_count;
+    semaphore_t *semaphore = calloc(1, sizeof(semaphore_t));
+    pthread_mutex_init(&semaphore->mutex, NULL);
+    pthread_cond_init(&semaphore->cond, NULL);
+    semaphore->count = initial_count;
+    return semaphore;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void) {
+    return xSemaphoreCreateCounting(1, 1);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t handle, TickType_t ticks) {
+    (void)ticks;
+    semaphore_t *semaphore = handle;
+    pthread_mutex_lock(&semaphore->mutex);
+    while (!semaphore->count) {
+        pthread_cond_wait(&semaphore->cond, &semaphore->mutex);
+    }
+    semaphore->count--;
+    pthread_mutex_unlock(&semaphore->mutex);
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t handle) {
+    semaphore_t *semaphore = handle;
+    pthread_mutex_lock(&semaphore->mutex);
+    semaphore->count++;
+    pthread_cond_signal(&semaphore->cond);
+    pthread_mutex_unlock(&semaphore->mutex);
+    return pdTRUE;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t handle) {
+    semaphore_t *semaphore = handle;
+    pthread_mutex_destroy(&semaphore->mutex);
+    pthread_cond_destroy(&semaphore->cond);
+    free(semaphore);
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void server_reset(bool honour_range, int status, size_t drop_after, int drops) {
+    pthread_mutex_lock(&server_lock);
+    server = (server_t){
+        .honour_range = honour_range,
+        .status       = status,
+        .drop_after   = drop_after,
+        .drops        = drops,
+    };
+    pthread_mutex_unlock(&server_lock);
+}
+
+static void send_all(int fd, void const *data, size_t len) {
+    while (len) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return;
+        }
+        data  = (uint8_t const *)data + n;
+        len  -= n;
+    }
+}
+
+static void *serve_connection(void *arg) {
+    int    fd = (int)(intptr_t)arg;
+    char   request[1024];
+    size_t have = 0;
+
+    while (have < sizeof(request) - 1) {
+        ssize_t n = recv(fd, request + have, sizeof(request) - 1 - have, 0);
+        if (n <= 0) {
+            close(fd);
+            return NULL;
+        }
+        have          += n;
+        request[have]  = '\0';
+        if (strstr(request, "\r\n\r\n")) {
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&server_lock);
+    server.requests++;
+    size_t start = 0;
+    char  *range = strstr(request, "Range: bytes=");
+    if (range) {
+        server.last_range = strtoul(range + strlen("Range: bytes="), NULL, 10);
+        if (server.honour_range) {
+            start = server.last_range;
+        }
+    }
+    int    status = server.status;
+    size_t limit  = IMAGE_BYTES;
+    if (server.drops) {
+        server.drops--;
+        limit = start + server.drop_after < IMAGE_BYTES ? start + server.drop_after : IMAGE_BYTES;
+    }
+    pthread_mutex_unlock(&server_lock);
+
+    char header[256];
+    int  len;
+    if (status != 200) {
+        len = snprintf(header, sizeof(header), "HTTP/1.1 %d Nope\r\nContent-Length: 0\r\n\r\n", status);
+        send_all(fd, header, len);
+        close(fd);
+        return NULL;
+    }
+
+    if (range && start) {
+        len = snprintf(
+            header,
+            sizeof(header),
+            "HTTP/1.1 206 Partial Content\r\nContent-Length: %zu\r\nContent-Range: bytes %zu-%d/%d\r\n\r\n",
+            (size_t)IMAGE_BYTES - start,
+            start,
+            IMAGE_BYTES - 1,
+            IMAGE_BYTES
+        );
+    } else {
+        len = snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\nContent-Length: %d\r\n\r\n", IMAGE_BYTES);
+    }
+    send_all(fd, header, len);
+
+    for (size_t pos = start; pos < limit; pos += NET_CHUNK) {
+        size_t n = limit - pos < NET_CHUNK ? limit - pos : NET_CHUNK;
+        usleep(CHUNK_US);
+        send_all(fd, image + pos, n);
+    }
+
+    close(fd);
+    return NULL;
+}
+
+static void *serve(void *arg) {
+    int listener = (int)(intptr_t)arg;
+
+    while (true) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+
+        int one    = 1;
+        int window = NET_CHUNK;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &window, sizeof(window));
+
+        pthread_t thread;
+        pthread_create(&thread, NULL, serve_connection, (void *)(intptr_t)fd);
+        pthread_detach(thread);
+    }
+    return NULL;
+}
+
+static void start_server(void) {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    int one      = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in addr = {
+        .sin_family      = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    socklen_t addr_len = sizeof(addr);
+    if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listener, 16) != 0) {
+        perror("listen");
+        exit(1);
+    }
+    getsockname(listener, (struct sockaddr *)&addr, &addr_len);
+    server_port = ntohs(addr.sin_port);
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, serve, (void *)(intptr_t)listener);
+    pthread_detach(thread);
+}
+
+static bool flash_write(void *ctx, size_t offset, void const *data, size_t len) {
+    flash_t *f = ctx;
+
+    atomic_fetch_add(&f->in_flight, 1);
+    if (f->slow) {
+        for (size_t block = (offset + ERASE_BYTES - 1) / ERASE_BYTES; block * ERASE_BYTES < offset + len; ++block) {
+            usleep(ERASE_US);
+        }
+    }
+    if (offset + len > f->fail_at || offset + len > IMAGE_BYTES) {
+        atomic_fetch_sub(&f->in_flight, 1);
+        return false;
+    }
+    if (offset != f->next) {
+        atomic_fetch_add(&f->out_of_order, 1);
+    }
+
+    memcpy(f->data + offset, data, len);
+    f->next = offset + len;
+    atomic_fetch_add(&f->writes, 1);
+    atomic_fetch_sub(&f->in_flight, 1);
+    return true;
+}
+
+static void *writer(void *arg) {
+    (void)arg;
+    while (true) {
+        ota_stream_drain(stream);
+    }
+    return NULL;
+}
+
+static void flash_reset(bool slow, size_t fail_at) {
+    memset(flash.data, 0, sizeof(flash.data));
+    flash.fail_at = fail_at;
+    flash.next    = 0;
+    flash.slow    = slow;
+    atomic_store(&flash.writes, 0);
+    atomic_store(&flash.out_of_order, 0);
+    atomic_store(&flash.in_flight, 0);
+    atomic_store(&flash.overlapped, 0);
+}
+
+// Like the curl fetch in ota.c, with the body going to the stream or, for comparison, straight to the flash
+static ota_fetch_result_t fetch(void *ctx, char const *url, size_t offset, ota_stream_t *s) {
+    client_t *client = ctx;
+
+    // A receive window about as small as the one of lwIP on the badge
+    int fd     = socket(AF_INET, SOCK_STREAM, 0);
+    int window = NET_CHUNK;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &window, sizeof(window));
+
+    struct sockaddr_in addr = {
+        .sin_family      = AF_INET,
+        .sin_port        = htons(server_port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return OTA_FETCH_BROKEN;
+    }
+
+    char request[256];
+    int  len = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: localhost\r\n", url);
+    if (offset) {
+        len += snprintf(request + len, sizeof(request) - len, "Range: bytes=%zu-\r\n", offset);
+    }
+    len += snprintf(request + len, sizeof(request) - len, "Connection: close\r\n\r\n");
+    send_all(fd, request, len);
+
+    static char buf[NET_CHUNK * 2];
+    size_t      have = 0;
+    char       *body = NULL;
+    while (!body && have < sizeof(buf) - 1) {
+        ssize_t n = recv(fd, buf + have, sizeof(buf) - 1 - have, 0);
+        if (n <= 0) {
+            close(fd);
+            return OTA_FETCH_BROKEN;
+        }
+        have      += n;
+        buf[have]  = '\0';
+        body       = strstr(buf, "\r\n\r\n");
+    }
+    if (!body) {
+        close(fd);
+        return OTA_FETCH_FAILED;
+    }
+    body += 4;
+
+    int    status   = atoi(buf + strlen("HTTP/1.1 "));
+    size_t length   = strtoul(strstr(buf, "Content-Length: ") + strlen("Content-Length: "), NULL, 10);
+    size_t position = 0;
+    char  *range    = strstr(buf, "Content-Range: bytes ");
+    if (range && range < body) {
+        position = strtoul(range + strlen("Content-Range: bytes "), NULL, 10);
+    }
+    if (status != 200 && status != 206) {
+        close(fd);
+        return OTA_FETCH_FAILED;
+    }
+
+    size_t end   = position + length;
+    size_t chunk = buf + have - body;
+    while (true) {
+        if (chunk) {
+            if (client->direct) {
+                if (!flash_write(&flash, client->direct_offset, body, chunk)) {
+                    close(fd);
+                    return OTA_FETCH_FAILED;
+                }
+                client->direct_offset += chunk;
+            } else if (!ota_stream_feed(s, position, body, chunk)) {
+                close(fd);
+                return OTA_FETCH_FAILED;
+            }
+            position += chunk;
+        }
+        if (position >= end) {
+            break;
+        }
+
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0) {
+            break;
+        }
+        // The flash was busy with an earlier chunk while this one came in
+        if (atomic_load(&flash.in_flight)) {
+            atomic_fetch_add(&flash.overlapped, 1);
+        }
+        body  = buf;
+        chunk = n;
+    }
+
+    close(fd);
+    return position == end ? OTA_FETCH_DONE : OTA_FETCH_BROKEN;
+}
+
+static bool image_matches(void) {
+    return memcmp(flash.data, image, IMAGE_BYTES) == 0;
+}
+
+static void test_pipeline(void) {
+    client_t client = {0};
+
+    server_reset(true, 200, 0, 0);
+    flash_reset(true, SIZE_MAX);
+    client.direct = true;
+    double start  = now_ms();
+    CHECK(fetch(&client, "/image", 0, NULL) == OTA_FETCH_DONE);
+    double serial = now_ms() - start;
+    CHECK(image_matches());
+    CHECK(atomic_load(&flash.overlapped) == 0);
+
+    uint8_t digest[32];
+    flash_reset(true, SIZE_MAX);
+    client.direct = false;
+    start         = now_ms();
+    ota_stream_begin(stream, flash_write, &flash);
+    CHECK(ota_stream_download(stream, fetch, &client, "/image", RETRIES));
+    CHECK(ota_stream_finish(stream, digest));
+    double pipelined = now_ms() - start;
+
+    CHECK(image_matches());
+    CHECK(memcmp(digest, image_digest, sizeof(digest)) == 0);
+    CHECK(ota_stream_offset(stream) == IMAGE_BYTES);
+    CHECK(ota_stream_written(stream) == IMAGE_BYTES);
+    CHECK(atomic_load(&flash.out_of_order) == 0);
+    CHECK(server.requests == 2);
+
+    // Timings depend on the load of the machine, only whether the network kept going during the erases is checked
+    int overlapped = atomic_load(&flash.overlapped);
+    printf(
+        "%d KiB, writing while receiving %.1fms (%d chunks received during a write), writing in the receiving thread "
+        "%.1fms (%.2fx)\n",
+        IMAGE_BYTES / 1024,
+        pipelined,
+        overlapped,
+        serial,
+        serial / pipelined
+    );
+    CHECK(overlapped > 0);
+}
+
+static void test_resume(bool honour_range) {
+    client_t client = {0};
+    uint8_t  digest[32];
+
+    server_reset(honour_range, 200, 50000, 3);
+    flash_reset(false, SIZE_MAX);
+    ota_stream_begin(stream, flash_write, &flash);
+    CHECK(ota_stream_download(stream, fetch, &client, "/image", RETRIES));
+    CHECK(ota_stream_finish(stream, digest));
+
+    CHECK(image_matches());
+    CHECK(memcmp(digest, image_digest, sizeof(digest)) == 0);
+    CHECK(atomic_load(&flash.out_of_order) == 0);
+    CHECK(server.requests == 4);
+    CHECK(server.last_range == (honour_range ? 150000 : 50000));
+}
+
+static void test_stalled(void) {
+    client_t client = {0};
+    uint8_t  digest[32];
+
+    // Every response breaks off after the first bytes, which are new only the first time round when the server
+    // ignores the Range header
+    server_reset(false, 200, 1000, 100);
+    flash_reset(false, SIZE_MAX);
+    ota_stream_begin(stream, flash_write, &flash);
+    CHECK(!ota_stream_download(stream, fetch, &client, "/image", RETRIES));
+    CHECK(server.requests == RETRIES + 2);
+    CHECK(ota_stream_offset(stream) == 1000);
+    ota_stream_cancel(stream);
+
+    server_reset(true, 404, 0, 0);
+    ota_stream_begin(stream, flash_write, &flash);
+    CHECK(!ota_stream_download(stream, fetch, &client, "/image", RETRIES));
+    CHECK(server.requests == 1);
+    CHECK(ota_stream_finish(stream, digest));
+}
+
+static void test_write_failure(void) {
+    client_t client = {0};
+    uint8_t  digest[32];
+
+    server_reset(true, 200, 0, 0);
+    flash_reset(false, 100000);
+    ota_stream_begin(stream, flash_write, &flash);
+    CHECK(!ota_stream_download(stream, fetch, &client, "/image", RETRIES));
+    CHECK(ota_stream_failed(stream));
+    CHECK(server.requests == 1);
+    CHECK(!ota_stream_finish(stream, digest));
+    CHECK(ota_stream_written(stream) == 100000 / BUFFER_BYTES * BUFFER_BYTES);
+    CHECK(!ota_stream_feed(stream, ota_stream_offset(stream), image, 1));
+}
+
+static void test_feed(void) {
+    uint8_t digest[32];
+    uint8_t expected[32];
+
+    // Pieces that don't line up with the buffers, parts sent again and a gap
+    flash_reset(false, SIZE_MAX);
+    ota_stream_begin(stream, flash_write, &flash);
+    size_t pos = 0;
+    while (pos < IMAGE_BYTES) {
+        size_t n = (pos * 7 + 1234) % 5000 + 1;
+        if (n > IMAGE_BYTES - pos) {
+            n = IMAGE_BYTES - pos;
+        }
+        CHECK(ota_stream_feed(stream, pos, image + pos, n));
+        CHECK(ota_stream_feed(stream, pos / 2, image + pos / 2, pos - pos / 2 + n));
+        pos += n;
+    }
+    CHECK(!ota_stream_feed(stream, pos + 1, image, 1));
+    CHECK(ota_stream_finish(stream, digest));
+    CHECK(image_matches());
+    CHECK(memcmp(digest, image_digest, sizeof(digest)) == 0);
+
+    // Ending part way into a buffer
+    ota_stream_begin(stream, flash_write, &flash);
+    CHECK(ota_stream_feed(stream, 0, image, BUFFER_BYTES + 10));
+    CHECK(ota_stream_finish(stream, digest));
+    EVP_Digest(image, BUFFER_BYTES + 10, expected, NULL, EVP_sha256(), NULL);
+    CHECK(memcmp(digest, expected, sizeof(digest)) == 0);
+    CHECK(ota_stream_written(stream) == BUFFER_BYTES + 10);
+
+    ota_stream_begin(stream, flash_write, &flash);
+    CHECK(ota_stream_finish(stream, digest));
+    EVP_Digest(image, 0, expected, NULL, EVP_sha256(), NULL);
+    CHECK(memcmp(digest, expected, sizeof(digest)) == 0);
+    CHECK(ota_stream_written(stream) == 0);
+}
+
+static void test_cancel(void) {
+    flash_reset(true, SIZE_MAX);
+    ota_stream_begin(stream, flash_write, &flash);
+    CHECK(ota_stream_feed(stream, 0, image, BUFFER_BYTES * 3 + 100));
+    ota_stream_cancel(stream);
+
+    int writes = atomic_load(&flash.writes);
+    CHECK(writes < 4);
+    usleep(50000);
+    CHECK(atomic_load(&flash.writes) == writes);
+    CHECK(!ota_stream_feed(stream, ota_stream_offset(stream), image, 1));
+
+    // The stream is ready for the next update
+    uint8_t digest[32];
+    flash_reset(false, SIZE_MAX);
+    ota_stream_begin(stream, flash_write, &flash);
+    CHECK(ota_stream_feed(stream, 0, image, IMAGE_BYTES));
+    CHECK(ota_stream_finish(stream, digest));
+    CHECK(image_matches());
+    CHECK(memcmp(digest, image_digest, sizeof(digest)) == 0);
+}
+
+int main(void) {
+    unsigned int seed = 2025;
+    for (size_t i = 0; i < IMAGE_BYTES; ++i) {
+        image[i] = rand_r(&seed);
+    }
+    EVP_Digest(image, IMAGE_BYTES, image_digest, NULL, EVP_sha256(), NULL);
+
+    stream = ota_stream_create(BUFFER_BYTES);
+    if (!stream) {
+        printf("Unable to create stream\n");
+        return 1;
+    }
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, writer, NULL);
+    pthread_detach(thread);
+
+    start_server();
+
+    test_pipeline();
+    test_resume(true);
+    test_resume(false);
+    test_stalled();
+    test_write_failure();
+    test_feed();
+    test_cancel();
+
+    return check_report("ota_stream_test");
+}
@@ -0,0 +1,606 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Feeds random and mostly-valid paths to pathfuncs.c and to a copy of the heap based implementation it replaced, and
+// checks that both agree. The filesystem seen by mkdir_p is faked, every stat and mkdir is logged and compared.
+//
+// Usage: pathfuncs_fuzz [ITERATIONS] [SEED]
+
+#define _GNU_SOURCE
+
+#include "badgevms/pathfuncs.h"
+#include "check.h"
+#include "pathfuncs_private.h"
+#include "why_io.h"
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <errno.h>
+#include <sys/stat.h>
+
+#define INPUT_MAX_LEN 320
+#define FS_LOG        4096
+
+static int      allocations;
+static uint32_t rng_state;
+static uint32_t fs_seed;
+static char     fs_log[FS_LOG];
+static size_t   fs_log_len;
+
+// Kernel heap and filesystem, counted and faked
+
+void *why_malloc(size_t size) {
+    allocations++;
+    return malloc(size);
+}
+
+void why_free(void *ptr) {
+    free(ptr);
+}
+
+char *why_strdup(char const *s) {
+    allocations++;
+    return strdup(s);
+}
+
+int why_asprintf(char **restrict strp, char const *restrict fmt, ...) {
+    allocations++;
+    va_list ap;
+    va_start(ap, fmt);
+    int ret = vasprintf(strp, fmt, ap);
+    va_end(ap);
+    return ret;
+}
+
+static uint32_t fnv1a(char const *s) {
+    uint32_t hash = 0x811c9dc5;
+    while (*s) {
+        hash = (hash ^ (uint8_t)*s++) * 0x01000193;
+    }
+    return hash;
+}
+
+static void fs_log_add(char op, char const *path) {
+    int len = snprintf(&fs_log[fs_log_len], FS_LOG - fs_log_len, "%c %s\n", op, path);
+    if (len > 0 && fs_log_len + len < FS_LOG) {
+        fs_log_len += len;
+    }
+}
+
+// Whether a path exists is a function of its name, so both implementations see the same filesystem
+int why_stat(char const *restrict pathname, struct stat *restrict statbuf) {
+    fs_log_add('S', pathname);
+    uint32_t hash = fnv1a(pathname) ^ fs_seed;
+    memset(statbuf, 0, sizeof(*statbuf));
+    switch (hash % 5) {
+        case 0: statbuf->st_mode = S_IFDIR; return 0;
+        case 1: statbuf->st_mode = S_IFREG; return 0;
+        default: errno = ENOENT; return -1;
+    }
+}
+
+int why_mkdir(char const *pathname, mode_t mode) {
+    (void)mode;
+    fs_log_add('M', pathname);
+    uint32_t hash = fnv1a(pathname) ^ fs_seed;
+    switch ((hash >> 8) % 7) {
+        case 0: errno = EEXIST; return -1;
+        case 1: errno = EACCES; return -1;
+        default: return 0;
+    }
+}
+
+int why_unlink(char const *pathname) {
+    (void)pathname;
+    return -1;
+}
+
+int why_rmdir(char const *pathname) {
+    (void)pathname;
+    return -1;
+}
+
+DIR *why_opendir(char const *name) {
+    (void)name;
+    return NULL;
+}
+
+struct dirent *why_readdir(DIR *dirp) {
+    (void)dirp;
+    return NULL;
+}
+
+int why_closedir(DIR *dirp) {
+    (void)dirp;
+    return -1;
+}
+
+// The implementation before paths were parsed in place
+
+typedef struct {
+    char  *buffer;
+    char  *device;
+    char  *directory;
+    char  *filename;
+    char  *unixpath;
+    size_t len;
+} ref_path_t;
+
+static inline bool ref_is_valid_device_char(char c) {
+    return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '_' || c == '-' ||
+           c == '$';
+}
+
+static inline bool ref_is_valid_path_char(char c) {
+    return ref_is_valid_device_char(c) || c == '.';
+}
+
+static path_parse_result_t ref_parse_path(char const *path, ref_path_t *result) {
+    if (!path || !*path) {
+        return PATH_PARSE_EMPTY_PATH;
+    }
+
+    result->buffer    = NULL;
+    result->device    = NULL;
+    result->directory = NULL;
+    result->filename  = NULL;
+    result->unixpath  = NULL;
+    result->len       = strlen(path);
+
+    result->buffer = strdup(path);
+    if (!result->buffer) {
+        return PATH_PARSE_EMPTY_PATH;
+    }
+
+    char *p     = result->buffer;
+    char *start = p;
+
+    while (*p && *p != ':') {
+        if (!ref_is_valid_device_char(*p)) {
+            return PATH_PARSE_INVALID_DEVICE_CHAR;
+        }
+        p++;
+    }
+
+    if (*p != ':') {
+        return PATH_PARSE_NO_DEVICE;
+    }
+
+    if (p == start) {
+        return PATH_PARSE_EMPTY_DEVICE;
+    }
+
+    *p             = '\0';
+    result->device = start;
+    p++;
+
+    if (*p == '[') {
+        p++;
+        start = p;
+
+        while (*p && *p != ']') {
+            if (!ref_is_valid_path_char(*p)) {
+                return PATH_PARSE_INVALID_DIR_CHAR;
+            }
+            p++;
+        }
+
+        if (*p != ']') {
+            return PATH_PARSE_UNCLOSED_DIRECTORY;
+        }
+
+        if (p > start) {
+            *p                = '\0';
+            result->directory = start;
+        }
+
+        p++;
+    }
+
+    if (*p != '\0') {
+        start = p;
+        while (*p) {
+            if (!ref_is_valid_path_char(*p)) {
+                return PATH_PARSE_INVALID_FILE_CHAR;
+            }
+            p++;
+        }
+        result->filename = start;
+    }
+
+    return PATH_PARSE_OK;
+}
+
+static char *ref_path_to_unix(ref_path_t *path) {
+    if (path->unixpath) {
+        return path->unixpath;
+    }
+
+    char  *unixpath      = malloc(path->len + 3);
+    size_t device_len    = strlen(path->device);
+    size_t directory_len = 0;
+    size_t filename_len  = 0;
+
+    if (path->directory) {
+        directory_len = strlen(path->directory);
+    }
+
+    if (path->filename) {
+        filename_len = strlen(path->filename);
+    }
+
+    size_t o      = 0;
+    unixpath[o++] = '/';
+    memcpy(&unixpath[o], path->device, device_len);
+    o             += device_len;
+    unixpath[o++]  = '/';
+
+    if (directory_len) {
+        for (size_t i = 0; i < directory_len; ++i) {
+            char c = path->directory[i];
+            if (c == '.')
+                c = '/';
+            unixpath[o++] = c;
+        }
+        unixpath[o++] = '/';
+    }
+
+    if (filename_len) {
+        memcpy(&unixpath[o], path->filename, filename_len);
+        o += filename_len;
+    }
+
+    unixpath[o]    = 0;
+    path->unixpath = unixpath;
+    return unixpath;
+}
+
+static void ref_path_free(ref_path_t *path) {
+    free(path->buffer);
+    free(path->unixpath);
+}
+
+static char *ref_path_dirconcat(char const *path, char const *subdir) {
+    if (!path || !*path || !subdir || !*subdir) {
+        return NULL;
+    }
+
+    ref_path_t parsed_path;
+    if (ref_parse_path(path, &parsed_path) != PATH_PARSE_OK) {
+        return NULL;
+    }
+
+    char *result_str = NULL;
+    if (parsed_path.directory) {
+        asprintf(
+            &result_str,
+            "%s:[%s.%s]%s",
+            parsed_path.device,
+            parsed_path.directory,
+            subdir,
+            parsed_path.filename ? parsed_path.filename : ""
+        );
+    } else {
+        asprintf(
+            &result_str,
+            "%s:[%s]%s",
+            parsed_path.device,
+            subdir,
+            parsed_path.filename ? parsed_path.filename : ""
+        );
+    }
+
+    ref_path_free(&parsed_path);
+    return result_str;
+}
+
+static bool ref_mkdir_p(char const *path) {
+    if (!path || *path == '\0') {
+        return false;
+    }
+
+    ref_path_t parsed_path;
+    if (ref_parse_path(path, &parsed_path) != PATH_PARSE_OK) {
+        return false;
+    }
+
+    if (!parsed_path.directory || strlen(parsed_path.directory) == 0) {
+        ref_path_free(&parsed_path);
+        return true;
+    }
+
+    char *current_path = NULL;
+    asprintf(&current_path, "%s:", parsed_path.device);
+    char *dir_copy = strdup(parsed_path.directory);
+
+    bool  success   = true;
+    char *dir_token = strtok(dir_copy, ".");
+
+    while (dir_token && success) {
+        char *new_path = ref_path_dirconcat(current_path, dir_token);
+        if (!new_path) {
+            success = false;
+            break;
+        }
+
+        struct stat st;
+        if (why_stat(new_path, &st) != 0) {
+            if (why_mkdir(new_path, 0755) != 0 && errno != EEXIST) {
+                success = false;
+                free(new_path);
+                break;
+            }
+        } else if (!S_ISDIR(st.st_mode)) {
+            success = false;
+            free(new_path);
+            break;
+        }
+
+        free(current_path);
+        current_path = new_path;
+        dir_token    = strtok(NULL, ".");
+    }
+
+    free(current_path);
+    free(dir_copy);
+    ref_path_free(&parsed_path);
+
+    return success;
+}
+
+// Input generation
+
+static uint32_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static char random_char(void) {
+    static char const syntax[] = ":[].";
+    static char const valid[]  = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_-$";
+    static char const junk[]   = "/\\ *?<>|\"'~\x01\x7f\xe9";
+
+    uint32_t r = rng() % 16;
+    if (r < 3) {
+        return syntax[rng() % (sizeof(syntax) - 1)];
+    }
+    if (r < 15) {
+        return valid[rng() % (sizeof(valid) - 1)];
+    }
+    return junk[rng() % (sizeof(junk) - 1)];
+}
+
+static void random_component(char *out, size_t *o, size_t max, bool dots) {
+    size_t len = rng() % 12;
+    for (size_t i = 0; i < len && *o < max; i++) {
+        char c = random_char();
+        if (c == '[' || c == ']' || c == ':' || (!dots && c == '.')) {
+            c = 'x';
+        }
+        out[(*o)++] = c;
+    }
+}
+
+// Mostly DEV:[A.B]FILE shaped, with the occasional corruption and the occasional very long path
+static void generate_input(char *out) {
+    size_t max = rng() % 8 == 0 ? INPUT_MAX_LEN - 1 : 64;
+    size_t o   = 0;
+
+    if (rng() % 4 == 0) {
+        size_t len = rng() % (max + 1);
+        for (; o < len; o++) {
+            out[o] = random_char();
+        }
+        out[o] = '\0';
+        return;
+    }
+
+    random_component(out, &o, max, false);
+    if (o < max && rng() % 16) {
+        out[o++] = ':';
+    }
+
+    if (o < max && rng() % 3) {
+        out[o++]       = '[';
+        int components = rng() % (max > 64 ? 40 : 5);
+        for (int i = 0; i < components && o < max; i++) {
+            if (i && o < max) {
+                out[o++] = '.';
+            }
+            random_component(out, &o, max, false);
+        }
+        if (o < max && rng() % 16) {
+            out[o++] = ']';
+        }
+    }
+
+    if (rng() % 2) {
+        random_component(out, &o, max, true);
+    }
+
+    if (o && rng() % 32 == 0) {
+        out[rng() % o] = random_char();
+    }
+
+    out[o] = '\0';
+}
+
+// Comparison
+
+static bool same_string(char const *a, char const *b) {
+    if (!a || !b) {
+        return a == b;
+    }
+    return strcmp(a, b) == 0;
+}
+
+static bool span_is(path_span_t span, char const *s) {
+    if (!s) {
+        return span.ptr == NULL && span.len == 0;
+    }
+    return span.ptr && span.len == strlen(s) && memcmp(span.ptr, s, span.len) == 0;
+}
+
+static void check_input(char const *input) {
+    check_context = input;
+
+    ref_path_t          ref;
+    path_t              path;
+    path_spans_t        spans;
+    path_parse_result_t ref_res = ref_parse_path(input, &ref);
+
+    allocations                 = 0;
+    path_parse_result_t res     = parse_path(input, &path);
+    path_parse_result_t res_spn = parse_path_spans(input, &spans);
+    CHECK(allocations == 0);
+
+    CHECK(res_spn == ref_res);
+    if (strlen(input) >= PATH_MAX_LEN) {
+        CHECK(res == PATH_PARSE_TOO_LONG);
+    } else {
+        CHECK(res == ref_res);
+    }
+
+    if (ref_res == PATH_PARSE_OK) {
+        CHECK(span_is(spans.device, ref.device));
+        CHECK(span_is(spans.directory, ref.directory));
+        CHECK(span_is(spans.filename, ref.filename));
+    }
+
+    if (res == PATH_PARSE_OK) {
+        CHECK(same_string(path.device, ref.device));
+        CHECK(same_string(path.directory, ref.directory));
+        CHECK(same_string(path.filename, ref.filename));
+        CHECK(path.device_len == strlen(path.device));
+        CHECK(path.directory_len == (path.directory ? strlen(path.directory) : 0));
+        CHECK(path.filename_len == (path.filename ? strlen(path.filename) : 0));
+        CHECK(path.len == ref.len);
+
+        char const *ref_unix = ref_path_to_unix(&ref);
+        size_t      needed   = strlen(ref_unix) + 1;
+        char        unixpath[PATH_UNIX_MAX_LEN + 1];
+
+        CHECK(needed <= PATH_UNIX_MAX_LEN);
+
+        // Every buffer that is too small reports it and leaves the rest alone
+        for (size_t size = 0; size <= needed; size++) {
+            memset(unixpath, 0x5a, sizeof(unixpath));
+            allocations             = 0;
+            path_parse_result_t cvt = path_to_unix(&path, unixpath, size);
+            CHECK(allocations == 0);
+            if (size < needed) {
+                CHECK(cvt == PATH_PARSE_TOO_LONG);
+                CHECK((uint8_t)unixpath[0] == 0x5a);
+            } else {
+                CHECK(cvt == PATH_PARSE_OK);
+                CHECK(strcmp(unixpath, ref_unix) == 0);
+                CHECK((uint8_t)unixpath[needed] == 0x5a);
+            }
+        }
+    }
+
+    if (ref_res != PATH_PARSE_EMPTY_PATH) {
+        ref_path_free(&ref);
+    }
+
+    // Both see the same fake filesystem, the stat and mkdir calls have to match as well
+    fs_seed    = rng();
+    fs_log_len = 0;
+    fs_log[0]  = '\0';
+    bool ref_ok = ref_mkdir_p(input);
+
+    char ref_log[FS_LOG];
+    memcpy(ref_log, fs_log, fs_log_len + 1);
+
+    fs_log_len  = 0;
+    fs_log[0]   = '\0';
+    allocations = 0;
+    bool ok     = mkdir_p(input);
+    CHECK(allocations == 0);
+
+    if (strlen(input) < PATH_MAX_LEN) {
+        CHECK(ok == ref_ok);
+        CHECK(strcmp(fs_log, ref_log) == 0);
+    }
+
+    check_context = NULL;
+}
+
+static void check_fixed_cases(void) {
+    static char const *const cases[] = {
+        "",
+        ":",
+        "SD0:",
+        "SD0:file",
+        "SD0:[]",
+        "SD0:[]file.txt",
+        "SD0:[dir]",
+        "SD0:[dir.sub.subsub]file.tar.gz",
+        "SD0:[..]",
+        "SD0:[.a..b.]x",
+        "SD0:[dir",
+        "SD0:[dir]]",
+        "SD0:[d/r]",
+        "SD0:dir/file",
+        "S D0:file",
+        "$SYS:[APPS]",
+        "nodevice",
+        "[dir]file",
+    };
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        check_input(cases[i]);
+    }
+
+    // Right at the limit
+    char input[PATH_MAX_LEN + 2];
+    for (size_t len = PATH_MAX_LEN - 8; len <= PATH_MAX_LEN + 1; len++) {
+        memcpy(input, "SD0:[", 5);
+        memset(input + 5, 'a', len - 5);
+        input[len - 1] = ']';
+        input[len]     = '\0';
+        check_input(input);
+
+        memset(input + 5, 'b', len - 5);
+        input[len] = '\0';
+        check_input(input);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    long iterations = argc > 1 ? strtol(argv[1], NULL, 0) : 200000;
+    rng_state       = argc > 2 ? (uint32_t)strtoul(argv[2], NULL, 0) : 0x2025;
+    if (!rng_state) {
+        rng_state = 1;
+    }
+
+    check_fixed_cases();
+
+    char input[INPUT_MAX_LEN];
+    for (long i = 0; i < iterations && failures < 20; i++) {
+        generate_input(input);
+        check_input(input);
+    }
+
+    printf("pathfuncs_fuzz: %ld inputs\n", iterations);
+    return check_report("pathfuncs_fuzz");
+}
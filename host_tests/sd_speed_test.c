@@ -0,0 +1,234 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// SD bus speed negotiation against made up cards and boards: which modes get tried, what the driver ends up running
+// at when the card can't keep up with the host, and falling back when a mode doesn't work on the bus.
+
+#include "badgevms_config.h"
+#include "check.h"
+#include "drivers/sd_speed.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define MODE_BIT(mode) (1u << (mode))
+
+// What a card supports, and which modes the bus between it and the host can't carry
+typedef struct {
+    bool     present;
+    bool     high_speed;
+    bool     uhs1;
+    bool     sdr50;
+    bool     ddr50;
+    uint32_t broken_modes;
+    int      attempts;
+} sim_card_t;
+
+static sd_board_t const full_board = {
+    .uhs1         = true,
+    .ddr          = true,
+    .max_freq_khz = SD_FREQ_SDR50_KHZ,
+    .max_mode     = FILESYSTEM_BUS_SD_UHS_SDR50,
+};
+
+static uint32_t min_u32(uint32_t a, uint32_t b) {
+    return a < b ? a : b;
+}
+
+// Follows what the SDMMC driver does during card init: the 1.8V switch only happens when both sides want it and the
+// clock is the highest that both the host limit and the card allow
+static bool sim_try_mount(void *ctx, filesystem_bus_mode_t mode, sd_card_desc_t *card) {
+    sim_card_t        *sim      = ctx;
+    sd_host_settings_t settings = sd_speed_host_settings(mode);
+
+    sim->attempts++;
+    if (!sim->present || (sim->broken_modes & MODE_BIT(mode))) {
+        return false;
+    }
+
+    card->is_uhs1 = settings.uhs1 && sim->uhs1;
+    if (card->is_uhs1) {
+        card->is_ddr        = settings.ddr && sim->ddr50;
+        uint32_t card_max   = card->is_ddr ? SD_FREQ_DDR50_KHZ : sim->sdr50 ? SD_FREQ_SDR50_KHZ : SD_FREQ_DDR50_KHZ;
+        card->real_freq_khz = min_u32(settings.freq_khz, card_max);
+    } else {
+        uint32_t card_max   = sim->high_speed ? SD_FREQ_HIGHSPEED_KHZ : SD_FREQ_DEFAULT_KHZ;
+        card->real_freq_khz = min_u32(settings.freq_khz, card_max);
+    }
+    return true;
+}
+
+static bool same_modes(filesystem_bus_mode_t const *got, int count, filesystem_bus_mode_t const *want, int want_count) {
+    if (count != want_count) {
+        return false;
+    }
+    for (int i = 0; i < count; i++) {
+        if (got[i] != want[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+#define CHECK_CANDIDATES(board, max, ...)                                                                              \
+    do {                                                                                                               \
+        filesystem_bus_mode_t want[] = {__VA_ARGS__};                                                                  \
+        filesystem_bus_mode_t got[SD_SPEED_MAX_CANDIDATES];                                                            \
+        int                   count = sd_speed_candidates(board, got, max);                                            \
+        CHECK(same_modes(got, count, want, sizeof(want) / sizeof(want[0])));                                           \
+    } while (0)
+
+static void check_candidates(void) {
+    CHECK_CANDIDATES(
+        &full_board,
+        SD_SPEED_MAX_CANDIDATES,
+        FILESYSTEM_BUS_SD_UHS_SDR50,
+        FILESYSTEM_BUS_SD_UHS_DDR50,
+        FILESYSTEM_BUS_SD_HIGH_SPEED,
+        FILESYSTEM_BUS_SD_DEFAULT
+    );
+
+    // No way to switch the IO voltage
+    sd_board_t board = full_board;
+    board.uhs1       = false;
+    CHECK_CANDIDATES(&board, SD_SPEED_MAX_CANDIDATES, FILESYSTEM_BUS_SD_HIGH_SPEED, FILESYSTEM_BUS_SD_DEFAULT);
+
+    // Wiring only good for 50MHz
+    board              = full_board;
+    board.max_freq_khz = 50000;
+    CHECK_CANDIDATES(
+        &board,
+        SD_SPEED_MAX_CANDIDATES,
+        FILESYSTEM_BUS_SD_UHS_DDR50,
+        FILESYSTEM_BUS_SD_HIGH_SPEED,
+        FILESYSTEM_BUS_SD_DEFAULT
+    );
+
+    board     = full_board;
+    board.ddr = false;
+    CHECK_CANDIDATES(
+        &board,
+        SD_SPEED_MAX_CANDIDATES,
+        FILESYSTEM_BUS_SD_UHS_SDR50,
+        FILESYSTEM_BUS_SD_HIGH_SPEED,
+        FILESYSTEM_BUS_SD_DEFAULT
+    );
+
+    board          = full_board;
+    board.max_mode = FILESYSTEM_BUS_SD_HIGH_SPEED;
+    CHECK_CANDIDATES(&board, SD_SPEED_MAX_CANDIDATES, FILESYSTEM_BUS_SD_HIGH_SPEED, FILESYSTEM_BUS_SD_DEFAULT);
+
+    // The UHS-I modes are left to boards that opt in
+    board              = full_board;
+    board.max_mode     = SD_MAX_BUS_MODE;
+    board.max_freq_khz = SD_MAX_FREQ_KHZ;
+    CHECK_CANDIDATES(&board, SD_SPEED_MAX_CANDIDATES, FILESYSTEM_BUS_SD_HIGH_SPEED, FILESYSTEM_BUS_SD_DEFAULT);
+
+    board          = full_board;
+    board.max_mode = FILESYSTEM_BUS_SD_DEFAULT;
+    CHECK_CANDIDATES(&board, SD_SPEED_MAX_CANDIDATES, FILESYSTEM_BUS_SD_DEFAULT);
+
+    // Default speed is always the last resort, however short the list
+    CHECK_CANDIDATES(&full_board, 2, FILESYSTEM_BUS_SD_UHS_SDR50, FILESYSTEM_BUS_SD_DEFAULT);
+    CHECK_CANDIDATES(&full_board, 1, FILESYSTEM_BUS_SD_DEFAULT);
+
+    filesystem_bus_mode_t modes[SD_SPEED_MAX_CANDIDATES];
+    int                   count = sd_speed_candidates(&full_board, modes, SD_SPEED_MAX_CANDIDATES);
+    for (int i = 0; i < count; i++) {
+        CHECK(sd_speed_host_settings(modes[i]).freq_khz <= full_board.max_freq_khz);
+    }
+    CHECK(sd_speed_host_settings(FILESYSTEM_BUS_SD_UHS_DDR50).ddr);
+    CHECK(!sd_speed_host_settings(FILESYSTEM_BUS_SD_UHS_SDR50).ddr);
+    CHECK(!sd_speed_host_settings(FILESYSTEM_BUS_SD_HIGH_SPEED).uhs1);
+}
+
+static void check_resolve(void) {
+    sd_card_desc_t card = {.is_uhs1 = true, .real_freq_khz = SD_FREQ_SDR50_KHZ};
+    CHECK(sd_speed_resolve(&card) == FILESYSTEM_BUS_SD_UHS_SDR50);
+
+    card = (sd_card_desc_t){.is_uhs1 = true, .is_ddr = true, .real_freq_khz = SD_FREQ_DDR50_KHZ};
+    CHECK(sd_speed_resolve(&card) == FILESYSTEM_BUS_SD_UHS_DDR50);
+
+    // UHS-I card that only got as far as SDR25
+    card = (sd_card_desc_t){.is_uhs1 = true, .real_freq_khz = SD_FREQ_DDR50_KHZ};
+    CHECK(sd_speed_resolve(&card) == FILESYSTEM_BUS_SD_HIGH_SPEED);
+
+    card = (sd_card_desc_t){.real_freq_khz = SD_FREQ_HIGHSPEED_KHZ};
+    CHECK(sd_speed_resolve(&card) == FILESYSTEM_BUS_SD_HIGH_SPEED);
+
+    card = (sd_card_desc_t){.real_freq_khz = SD_FREQ_DEFAULT_KHZ};
+    CHECK(sd_speed_resolve(&card) == FILESYSTEM_BUS_SD_DEFAULT);
+
+    card = (sd_card_desc_t){.is_mmc = true, .is_uhs1 = true, .real_freq_khz = SD_FREQ_SDR50_KHZ};
+    CHECK(sd_speed_resolve(&card) == FILESYSTEM_BUS_SD_HIGH_SPEED);
+}
+
+static void check_negotiate(void) {
+    sim_card_t card = {.present = true, .high_speed = true, .uhs1 = true, .sdr50 = true, .ddr50 = true};
+    CHECK(sd_speed_negotiate(&full_board, sim_try_mount, &card) == FILESYSTEM_BUS_SD_UHS_SDR50);
+    CHECK(card.attempts == 1);
+
+    // SDR50 doesn't survive the bus, the next best thing does
+    card = (sim_card_t){
+        .present      = true,
+        .high_speed   = true,
+        .uhs1         = true,
+        .sdr50        = true,
+        .ddr50        = true,
+        .broken_modes = MODE_BIT(FILESYSTEM_BUS_SD_UHS_SDR50),
+    };
+    CHECK(sd_speed_negotiate(&full_board, sim_try_mount, &card) == FILESYSTEM_BUS_SD_UHS_DDR50);
+    CHECK(card.attempts == 2);
+
+    // A card without UHS-I mounts straight away and reports the high speed it settled for
+    card = (sim_card_t){.present = true, .high_speed = true};
+    CHECK(sd_speed_negotiate(&full_board, sim_try_mount, &card) == FILESYSTEM_BUS_SD_HIGH_SPEED);
+    CHECK(card.attempts == 1);
+
+    card = (sim_card_t){.present = true};
+    CHECK(sd_speed_negotiate(&full_board, sim_try_mount, &card) == FILESYSTEM_BUS_SD_DEFAULT);
+
+    // UHS-I card in a slot that can't switch voltage
+    sd_board_t board = full_board;
+    board.uhs1       = false;
+    card             = (sim_card_t){.present = true, .high_speed = true, .uhs1 = true, .sdr50 = true};
+    CHECK(sd_speed_negotiate(&board, sim_try_mount, &card) == FILESYSTEM_BUS_SD_HIGH_SPEED);
+
+    // Everything fast is broken
+    card = (sim_card_t){
+        .present      = true,
+        .high_speed   = true,
+        .uhs1         = true,
+        .sdr50        = true,
+        .broken_modes = MODE_BIT(FILESYSTEM_BUS_SD_UHS_SDR50) | MODE_BIT(FILESYSTEM_BUS_SD_UHS_DDR50) |
+                        MODE_BIT(FILESYSTEM_BUS_SD_HIGH_SPEED),
+    };
+    CHECK(sd_speed_negotiate(&full_board, sim_try_mount, &card) == FILESYSTEM_BUS_SD_DEFAULT);
+    CHECK(card.attempts == 4);
+
+    card = (sim_card_t){.present = false};
+    CHECK(sd_speed_negotiate(&full_board, sim_try_mount, &card) == FILESYSTEM_BUS_NONE);
+    CHECK(card.attempts == 4);
+}
+
+int main(void) {
+    check_candidates();
+    check_resolve();
+    check_negotiate();
+
+    return check_report("sd_speed_test");
+}
@@ -0,0 +1,121 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Host stand-in for the ESP-IDF header of the same name, just enough to build the compositor renderer
+
+#pragma once
+
+#include "esp_err.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct ppa_client_t *ppa_client_handle_t;
+
+typedef enum {
+    PPA_OPERATION_SRM,
+    PPA_OPERATION_BLEND,
+    PPA_OPERATION_FILL,
+} ppa_operation_t;
+
+typedef enum {
+    PPA_TRANS_MODE_BLOCKING,
+    PPA_TRANS_MODE_NON_BLOCKING,
+} ppa_trans_mode_t;
+
+typedef enum {
+    PPA_SRM_ROTATION_ANGLE_0,
+    PPA_SRM_ROTATION_ANGLE_90,
+    PPA_SRM_ROTATION_ANGLE_180,
+    PPA_SRM_ROTATION_ANGLE_270,
+} ppa_srm_rotation_angle_t;
+
+typedef enum {
+    PPA_SRM_COLOR_MODE_ARGB8888,
+    PPA_SRM_COLOR_MODE_RGB888,
+    PPA_SRM_COLOR_MODE_RGB565,
+} ppa_srm_color_mode_t;
+
+typedef enum {
+    PPA_BLEND_COLOR_MODE_ARGB8888,
+    PPA_BLEND_COLOR_MODE_RGB888,
+    PPA_BLEND_COLOR_MODE_RGB565,
+} ppa_blend_color_mode_t;
+
+typedef enum {
+    PPA_ALPHA_NO_CHANGE,
+    PPA_ALPHA_FIX_VALUE,
+    PPA_ALPHA_SCALE,
+    PPA_ALPHA_INVERT,
+} ppa_alpha_update_mode_t;
+
+typedef struct {
+    ppa_operation_t oper_type;
+    uint32_t        max_pending_trans_num;
+} ppa_client_config_t;
+
+typedef struct {
+    void const *buffer;
+    uint32_t    pic_w;
+    uint32_t    pic_h;
+    uint32_t    block_w;
+    uint32_t    block_h;
+    uint32_t    block_offset_x;
+    uint32_t    block_offset_y;
+    union {
+        ppa_srm_color_mode_t   srm_cm;
+        ppa_blend_color_mode_t blend_cm;
+    };
+} ppa_in_pic_blk_config_t;
+
+typedef struct {
+    void    *buffer;
+    uint32_t buffer_size;
+    uint32_t pic_w;
+    uint32_t pic_h;
+    uint32_t block_offset_x;
+    uint32_t block_offset_y;
+    union {
+        ppa_srm_color_mode_t   srm_cm;
+        ppa_blend_color_mode_t blend_cm;
+    };
+} ppa_out_pic_blk_config_t;
+
+typedef struct {
+    ppa_in_pic_blk_config_t  in;
+    ppa_out_pic_blk_config_t out;
+    ppa_srm_rotation_angle_t rotation_angle;
+    float                    scale_x;
+    float                    scale_y;
+    bool                     mirror_x;
+    bool                     mirror_y;
+    bool                     rgb_swap;
+    bool                     byte_swap;
+    ppa_trans_mode_t         mode;
+} ppa_srm_oper_config_t;
+
+typedef struct {
+    ppa_in_pic_blk_config_t  in_bg;
+    ppa_in_pic_blk_config_t  in_fg;
+    ppa_out_pic_blk_config_t out;
+    ppa_alpha_update_mode_t  bg_alpha_update_mode;
+    ppa_alpha_update_mode_t  fg_alpha_update_mode;
+    ppa_trans_mode_t         mode;
+} ppa_blend_oper_config_t;
+
+esp_err_t ppa_register_client(ppa_client_config_t const *config, ppa_client_handle_t *ret_client);
+esp_err_t ppa_do_scale_rotate_mirror(ppa_client_handle_t ppa_client, ppa_srm_oper_config_t const *oper_config);
+esp_err_t ppa_do_blend(ppa_client_handle_t ppa_client, ppa_blend_oper_config_t const *oper_config);
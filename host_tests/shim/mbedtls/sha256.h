@@ -0,0 +1,53 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// Host stand-in for the mbedtls header of the same name on top of OpenSSL, just enough for the host tests
+
+#pragma once
+
+#include <stddef.h>
+
+#include <openssl/evp.h>
+
+typedef struct {
+    EVP_MD_CTX *md;
+} mbedtls_sha256_context;
+
+static inline void mbedtls_sha256_init(mbedtls_sha256_context *ctx) {
+    ctx->md = EVP_MD_CTX_new();
+}
+
+static inline void mbedtls_sha256_free(mbedtls_sha256_context *ctx) {
+    EVP_MD_CTX_free(ctx->md);
+    ctx->md = NULL;
+}
+
+static inline int mbedtls_sha256_starts(mbedtls_sha256_context *ctx, int is224) {
+    return EVP_DigestInit_ex(ctx->md, is224 ? EVP_sha224() : EVP_sha256(), NULL) == 1 ? 0 : -1;
+}
+
+static inline int mbedtls_sha256_update(mbedtls_sha256_context *ctx, unsigned char const *input, size_t ilen) {
+    return EVP_DigestUpdate(ctx->md, input, ilen) == 1 ? 0 : -1;
+}
+
+static inline int mbedtls_sha256_finish(mbedtls_sha256_context *ctx, unsigned char *output) {
+    return EVP_DigestFinal_ex(ctx->md, output, NULL) == 1 ? 0 : -1;
+}
+
+static inline int mbedtls_sha256(unsigned char const *input, size_t ilen, unsigned char *output, int is224) {
+    return EVP_Digest(input, ilen, output, NULL, is224 ? EVP_sha224() : EVP_sha256(), NULL) == 1 ? 0 : -1;
+}
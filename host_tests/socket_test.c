@@ -0,0 +1,316 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+// The socket device against the host's own sockets on the loopback interface: UDP over IPv4 and IPv6, non-blocking
+// reads, scatter/gather through sendmsg() and recvmsg(), the socket options applications may touch and the checks on
+// what they pass in.
+
+#define _GNU_SOURCE
+
+#include "badgevms/device.h"
+#include "check.h"
+#include "socket.h"
+#include "wait_queue.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/poll.h>
+#include <sys/socket.h>
+
+#define CHECK_ERRNO(call, err)                                                                                         \
+    do {                                                                                                               \
+        errno = 0;                                                                                                     \
+        CHECK((call) == -1);                                                                                           \
+        CHECK(errno == (err));                                                                                         \
+    } while (0)
+
+static int waited_fd = -1;
+
+void poll_wait_fd(poll_waiter_t *waiter, int native_fd, short events) {
+    (void)waiter;
+    (void)events;
+    waited_fd = native_fd;
+}
+
+static socket_device_t *dev;
+
+static int open_socket(int domain, int type) {
+    int fd = dev->_socket(dev, domain, type, 0);
+    CHECK(fd >= 0);
+    return fd;
+}
+
+static void close_socket(int fd) {
+    dev->device._close(dev, fd);
+}
+
+// Binds to an ephemeral port on the loopback address of the domain, false if the host has no such address
+static bool bind_loopback(int fd, int domain, struct sockaddr_storage *addr, socklen_t *len) {
+    memset(addr, 0, sizeof(*addr));
+    if (domain == AF_INET) {
+        struct sockaddr_in *in = (struct sockaddr_in *)addr;
+        in->sin_family         = AF_INET;
+        in->sin_addr.s_addr    = htonl(INADDR_LOOPBACK);
+        *len                   = sizeof(*in);
+    } else {
+        struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)addr;
+        in6->sin6_family         = AF_INET6;
+        in6->sin6_addr           = in6addr_loopback;
+        *len                     = sizeof(*in6);
+    }
+
+    if (dev->_bind(dev, fd, (struct sockaddr *)addr, *len) < 0) {
+        return false;
+    }
+    CHECK(dev->_getsockname(dev, fd, (struct sockaddr *)addr, len) == 0);
+    return true;
+}
+
+static void test_create(void) {
+    CHECK_ERRNO(dev->_socket(dev, AF_UNIX, SOCK_STREAM, 0), EAFNOSUPPORT);
+    CHECK_ERRNO(dev->_socket(dev, AF_INET, SOCK_RAW, 0), EPROTOTYPE);
+    CHECK_ERRNO(dev->_socket(dev, AF_INET, SOCK_DGRAM, IPPROTO_TCP), EPROTONOSUPPORT);
+    CHECK_ERRNO(dev->_socket(dev, AF_INET6, SOCK_STREAM, IPPROTO_UDP), EPROTONOSUPPORT);
+
+    int fd = dev->_socket(dev, AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    CHECK(fd >= 0);
+
+    struct sockaddr_un {
+        sa_family_t family;
+        char        path[108];
+    } unix_addr = {.family = AF_UNIX};
+    struct sockaddr_in short_addr = {.sin_family = AF_INET};
+
+    CHECK_ERRNO(dev->_bind(dev, fd, (struct sockaddr *)&unix_addr, sizeof(unix_addr)), EAFNOSUPPORT);
+    CHECK_ERRNO(dev->_bind(dev, fd, (struct sockaddr *)&short_addr, sizeof(short_addr) - 4), EINVAL);
+    CHECK_ERRNO(dev->_bind(dev, fd, NULL, 0), EINVAL);
+    CHECK_ERRNO(dev->_sendto(dev, fd, "x", 1, 0, (struct sockaddr *)&unix_addr, sizeof(unix_addr)), EAFNOSUPPORT);
+    CHECK_ERRNO(dev->_sendmsg(dev, fd, NULL, 0), EINVAL);
+    CHECK_ERRNO(dev->_recvmsg(dev, fd, NULL, 0), EINVAL);
+
+    close_socket(fd);
+}
+
+static void test_datagrams(int domain) {
+    struct sockaddr_storage a_addr, b_addr, from;
+    socklen_t               a_len, b_len, from_len;
+    char                    buf[64];
+
+    int a = dev->_socket(dev, domain, SOCK_DGRAM, 0);
+    int b = dev->_socket(dev, domain, SOCK_DGRAM, 0);
+    if (a < 0 || b < 0 || !bind_loopback(a, domain, &a_addr, &a_len) || !bind_loopback(b, domain, &b_addr, &b_len)) {
+        printf("socket_test: no %s loopback, skipping\n", domain == AF_INET ? "IPv4" : "IPv6");
+        if (a >= 0)
+            close_socket(a);
+        if (b >= 0)
+            close_socket(b);
+        return;
+    }
+
+    CHECK(dev->_sendto(dev, a, "ping", 4, 0, (struct sockaddr *)&b_addr, b_len) == 4);
+    from_len = sizeof(from);
+    CHECK(dev->_recvfrom(dev, b, buf, sizeof(buf), 0, (struct sockaddr *)&from, &from_len) == 4);
+    CHECK(memcmp(buf, "ping", 4) == 0);
+    CHECK(from_len == a_len);
+    CHECK(memcmp(&from, &a_addr, a_len) == 0);
+
+    // A connected datagram socket takes plain writes, connecting to AF_UNSPEC drops the peer again
+    CHECK(dev->_connect(dev, b, (struct sockaddr *)&a_addr, a_len) == 0);
+    CHECK(dev->device._write(dev, b, "pong", 4) == 4);
+    CHECK(dev->device._read(dev, a, buf, sizeof(buf)) == 4);
+    CHECK(memcmp(buf, "pong", 4) == 0);
+
+    struct sockaddr unspec = {.sa_family = AF_UNSPEC};
+    CHECK(dev->_connect(dev, b, &unspec, sizeof(unspec)) == 0);
+    CHECK_ERRNO(dev->_getpeername(dev, b, (struct sockaddr *)&from, &from_len), ENOTCONN);
+
+    close_socket(a);
+    close_socket(b);
+}
+
+static void test_nonblocking(void) {
+    struct sockaddr_storage addr;
+    socklen_t               len;
+    char                    buf[16];
+
+    int fd = open_socket(AF_INET, SOCK_DGRAM);
+    CHECK(bind_loopback(fd, AF_INET, &addr, &len));
+
+    int flags = dev->_fcntl(dev, fd, F_GETFL, 0);
+    CHECK(flags >= 0 && !(flags & O_NONBLOCK));
+    CHECK(dev->_fcntl(dev, fd, F_SETFL, flags | O_NONBLOCK) == 0);
+    CHECK(dev->_fcntl(dev, fd, F_GETFL, 0) & O_NONBLOCK);
+
+    errno = 0;
+    CHECK(dev->_recvfrom(dev, fd, buf, sizeof(buf), 0, NULL, NULL) == -1);
+    CHECK(errno == EAGAIN || errno == EWOULDBLOCK);
+    errno = 0;
+    CHECK(dev->device._read(dev, fd, buf, sizeof(buf)) == -1);
+    CHECK(errno == EAGAIN || errno == EWOULDBLOCK);
+
+    // poll() hooks the native socket and sees the datagram once it is there
+    waited_fd = -1;
+    CHECK(dev->device._poll(dev, fd, POLLIN, NULL) == 0);
+    CHECK(waited_fd == fd);
+    CHECK(dev->_sendto(dev, fd, "self", 4, 0, (struct sockaddr *)&addr, len) == 4);
+    CHECK(dev->device._poll(dev, fd, POLLIN, NULL) & POLLIN);
+    CHECK(dev->_recvfrom(dev, fd, buf, sizeof(buf), 0, NULL, NULL) == 4);
+
+    CHECK(dev->_fcntl(dev, fd, F_SETFL, 0) == 0);
+    CHECK(!(dev->_fcntl(dev, fd, F_GETFL, 0) & O_NONBLOCK));
+
+    // MSG_DONTWAIT makes a single call non-blocking
+    errno = 0;
+    CHECK(dev->_recvfrom(dev, fd, buf, sizeof(buf), MSG_DONTWAIT, NULL, NULL) == -1);
+    CHECK(errno == EAGAIN || errno == EWOULDBLOCK);
+
+    CHECK_ERRNO(dev->_fcntl(dev, fd, F_SETFD, FD_CLOEXEC), EINVAL);
+    CHECK_ERRNO(dev->_fcntl(dev, fd, F_DUPFD, 0), EINVAL);
+
+    close_socket(fd);
+}
+
+static void test_messages(void) {
+    struct sockaddr_storage addr, from;
+    socklen_t               len;
+    char                    head[4], tail[8], small[3];
+
+    int fd = open_socket(AF_INET, SOCK_DGRAM);
+    CHECK(bind_loopback(fd, AF_INET, &addr, &len));
+
+    struct iovec  out[]  = {{"head", 4}, {"tail", 4}};
+    struct msghdr send_m = {.msg_name = &addr, .msg_namelen = len, .msg_iov = out, .msg_iovlen = 2};
+    CHECK(dev->_sendmsg(dev, fd, &send_m, 0) == 8);
+
+    struct iovec  in[]   = {{head, sizeof(head)}, {tail, sizeof(tail)}};
+    struct msghdr recv_m = {.msg_name = &from, .msg_namelen = sizeof(from), .msg_iov = in, .msg_iovlen = 2};
+    CHECK(dev->_recvmsg(dev, fd, &recv_m, 0) == 8);
+    CHECK(memcmp(head, "head", 4) == 0);
+    CHECK(memcmp(tail, "tail", 4) == 0);
+    CHECK(recv_m.msg_namelen == len);
+    CHECK(!(recv_m.msg_flags & MSG_TRUNC));
+
+    // The rest of a datagram that doesn't fit is dropped and reported
+    CHECK(dev->_sendmsg(dev, fd, &send_m, 0) == 8);
+    struct iovec  short_in = {small, sizeof(small)};
+    struct msghdr short_m  = {.msg_iov = &short_in, .msg_iovlen = 1};
+    CHECK(dev->_recvmsg(dev, fd, &short_m, 0) == 3);
+    CHECK(short_m.msg_flags & MSG_TRUNC);
+
+    struct sockaddr_in bad   = {.sin_family = AF_INET};
+    struct msghdr      bad_m = {.msg_name = &bad, .msg_namelen = 2, .msg_iov = out, .msg_iovlen = 2};
+    CHECK_ERRNO(dev->_sendmsg(dev, fd, &bad_m, 0), EINVAL);
+
+    close_socket(fd);
+}
+
+static void test_stream(void) {
+    struct sockaddr_storage addr;
+    socklen_t               len;
+    char                    buf[16];
+
+    int server = open_socket(AF_INET, SOCK_STREAM);
+    int client = open_socket(AF_INET, SOCK_STREAM);
+    CHECK(bind_loopback(server, AF_INET, &addr, &len));
+    CHECK(dev->_listen(dev, server, 1) == 0);
+    CHECK(dev->_connect(dev, client, (struct sockaddr *)&addr, len) == 0);
+
+    int conn = dev->_accept(dev, server, NULL, NULL);
+    CHECK(conn >= 0);
+
+    CHECK(dev->_sendto(dev, client, "stream", 6, 0, NULL, 0) == 6);
+    CHECK(dev->_recvfrom(dev, conn, buf, 6, MSG_WAITALL, NULL, NULL) == 6);
+    CHECK(dev->_shutdown(dev, client, SHUT_WR) == 0);
+    CHECK(dev->device._read(dev, conn, buf, sizeof(buf)) == 0);
+
+    close_socket(conn);
+    close_socket(client);
+    close_socket(server);
+}
+
+static void test_options(void) {
+    int       value;
+    socklen_t len = sizeof(value);
+
+    int stream = open_socket(AF_INET, SOCK_STREAM);
+    int dgram  = open_socket(AF_INET6, SOCK_DGRAM);
+
+    value = 1;
+    CHECK(dev->_setsockopt(dev, stream, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value)) == 0);
+    CHECK(dev->_getsockopt(dev, stream, IPPROTO_TCP, TCP_NODELAY, &value, &len) == 0);
+    CHECK(value != 0);
+
+    value = 1;
+    CHECK(dev->_setsockopt(dev, stream, SOL_SOCKET, SO_KEEPALIVE, &value, sizeof(value)) == 0);
+    value = 30;
+    CHECK(dev->_setsockopt(dev, stream, IPPROTO_TCP, TCP_KEEPIDLE, &value, sizeof(value)) == 0);
+
+    value = 16 * 1024;
+    CHECK(dev->_setsockopt(dev, stream, SOL_SOCKET, SO_RCVBUF, &value, sizeof(value)) == 0);
+    CHECK(dev->_setsockopt(dev, stream, SOL_SOCKET, SO_SNDBUF, &value, sizeof(value)) == 0);
+    len = sizeof(value);
+    CHECK(dev->_getsockopt(dev, stream, SOL_SOCKET, SO_SNDBUF, &value, &len) == 0);
+    CHECK(value > 0);
+
+    len = sizeof(value);
+    CHECK(dev->_getsockopt(dev, dgram, SOL_SOCKET, SO_TYPE, &value, &len) == 0);
+    CHECK(value == SOCK_DGRAM);
+    len = sizeof(value);
+    CHECK(dev->_getsockopt(dev, dgram, SOL_SOCKET, SO_ERROR, &value, &len) == 0);
+    value = 1;
+    CHECK(dev->_setsockopt(dev, dgram, IPPROTO_IPV6, IPV6_V6ONLY, &value, sizeof(value)) == 0);
+    CHECK(dev->_setsockopt(dev, dgram, SOL_SOCKET, SO_BROADCAST, &value, sizeof(value)) == 0);
+
+    // Read-only options and ones that reach beyond the socket aren't for applications
+    CHECK_ERRNO(dev->_setsockopt(dev, dgram, SOL_SOCKET, SO_TYPE, &value, sizeof(value)), ENOPROTOOPT);
+    CHECK_ERRNO(dev->_setsockopt(dev, dgram, SOL_SOCKET, SO_BINDTODEVICE, "lo", 3), ENOPROTOOPT);
+    CHECK_ERRNO(dev->_setsockopt(dev, stream, IPPROTO_TCP, TCP_CORK, &value, sizeof(value)), ENOPROTOOPT);
+    len = sizeof(value);
+    CHECK_ERRNO(dev->_getsockopt(dev, stream, IPPROTO_UDP, 1, &value, &len), ENOPROTOOPT);
+
+    close_socket(stream);
+    close_socket(dgram);
+}
+
+int main(void) {
+    dev = (socket_device_t *)socket_create();
+    CHECK(dev && dev->device.type == DEVICE_TYPE_SOCKET);
+    if (!dev) {
+        return 1;
+    }
+
+    test_create();
+    test_datagrams(AF_INET);
+    test_datagrams(AF_INET6);
+    test_nonblocking();
+    test_messages();
+    test_stream();
+    test_options();
+
+    free(dev);
+
+    return check_report("socket_test");
+}
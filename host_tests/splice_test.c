@@ -0,0 +1,365 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// sendfile through the kernel I/O queue, from a filesystem device backed by a file on the host to a socket device on
+// one end of a socket pair: offsets and the file position, the end of the file, a socket that fills up, blocking or
+// not, errors on either side and more transfers at once than there are pool buffers.
+
+#define _GNU_SOURCE
+
+#include "badgevms/device.h"
+#include "check.h"
+#include "esp_heap_caps.h"
+#include "io_queue.h"
+#include "splice.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define FILE_BYTES (3 * IO_BOUNCE_MAX + 1234)
+#define THREADS    (SPLICE_BUFFERS * 2)
+
+typedef struct {
+    filesystem_device_t filesystem;
+    atomic_bool         fail;
+    atomic_int          reads;
+} file_fs_t;
+
+typedef struct {
+    int    fd;
+    size_t len;
+    char  *data;
+} drain_t;
+
+static atomic_int      live_allocations;
+static file_fs_t       file_fs;
+static socket_device_t socket_device;
+static uint8_t         contents[FILE_BYTES];
+
+void *heap_caps_malloc(size_t size, uint32_t caps) {
+    (void)caps;
+    atomic_fetch_add(&live_allocations, 1);
+    return malloc(size);
+}
+
+void heap_caps_free(void *ptr) {
+    if (ptr) {
+        atomic_fetch_sub(&live_allocations, 1);
+    }
+    free(ptr);
+}
+
+static ssize_t file_read(void *dev, int fd, void *buf, size_t count) {
+    file_fs_t *fs = dev;
+
+    atomic_fetch_add(&fs->reads, 1);
+    if (atomic_load(&fs->fail)) {
+        errno = EIO;
+        return -1;
+    }
+    return read(fd, buf, count);
+}
+
+static ssize_t file_write(void *dev, int fd, void const *buf, size_t count) {
+    (void)dev;
+    return write(fd, buf, count);
+}
+
+static ssize_t file_lseek(void *dev, int fd, off_t offset, int whence) {
+    (void)dev;
+    return lseek(fd, offset, whence);
+}
+
+static ssize_t socket_sendto(
+    void *dev, int fd, void const *buf, size_t len, int flags, struct sockaddr const *addr, socklen_t addrlen
+) {
+    (void)dev;
+    return sendto(fd, buf, len, flags | MSG_NOSIGNAL, addr, addrlen);
+}
+
+static int open_file(void) {
+    char path[] = "/tmp/splice_test_XXXXXX";
+    int  fd     = mkstemp(path);
+    unlink(path);
+    CHECK(write(fd, contents, FILE_BYTES) == FILE_BYTES);
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+static void *drain(void *arg) {
+    drain_t *d = arg;
+    ssize_t  n;
+
+    while ((n = read(d->fd, d->data + d->len, FILE_BYTES + 1 - d->len)) > 0) {
+        d->len += n;
+    }
+    return NULL;
+}
+
+// Reads everything that comes out of the other end of the pair until it is closed
+static void start_drain(int fd, drain_t *d, pthread_t *thread) {
+    d->fd   = fd;
+    d->len  = 0;
+    d->data = malloc(FILE_BYTES + 1);
+    pthread_create(thread, NULL, drain, d);
+}
+
+static size_t finish_drain(int write_end, drain_t *d, pthread_t thread) {
+    close(write_end);
+    pthread_join(thread, NULL);
+    close(d->fd);
+    return d->len;
+}
+
+// The path sendfile() takes on the badge, one request on the I/O queue run by a kernel I/O task
+static ssize_t sendfile_request(int sock, int file, off_t offset, size_t count, int *err) {
+    static io_queue_t queue;
+    int               owner;
+
+    io_queue_init(&queue);
+    io_request_t request = io_queue_submit_sendfile(
+        &queue,
+        &file_fs.filesystem.device,
+        file,
+        &socket_device.device,
+        sock,
+        count,
+        offset,
+        &owner,
+        err
+    );
+    if (request < 0) {
+        return -1;
+    }
+
+    io_slot_t *slot = io_queue_take(&queue);
+    io_slot_execute(slot);
+    io_queue_complete(&queue, slot);
+
+    slot = io_queue_find(&queue, request, &owner);
+    CHECK(slot && io_queue_claim(&queue, slot));
+    ssize_t result = io_slot_finish(slot, err);
+    io_queue_release(&queue, slot);
+    return result;
+}
+
+static void check_offsets(void) {
+    int       pair[2];
+    drain_t   d;
+    pthread_t thread;
+    int       err  = 0;
+    int       file = open_file();
+
+    socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+    start_drain(pair[1], &d, &thread);
+
+    // From an offset, the file position stays where it was
+    lseek(file, 100, SEEK_SET);
+    CHECK(sendfile_request(pair[0], file, 5000, 40000, &err) == 40000);
+    CHECK(lseek(file, 0, SEEK_CUR) == 100);
+
+    // From the file position, which moves along
+    CHECK(sendfile_request(pair[0], file, IO_OFFSET_CURRENT, 1000, &err) == 1000);
+    CHECK(lseek(file, 0, SEEK_CUR) == 1100);
+
+    // A request is clamped to IO_BOUNCE_MAX and completes short at the end of the file
+    lseek(file, 0, SEEK_SET);
+    CHECK(sendfile_request(pair[0], file, IO_OFFSET_CURRENT, FILE_BYTES, &err) == IO_BOUNCE_MAX);
+    CHECK(sendfile_request(pair[0], file, FILE_BYTES - 10, 100, &err) == 10);
+    CHECK(sendfile_request(pair[0], file, FILE_BYTES, 100, &err) == 0);
+
+    CHECK(finish_drain(pair[0], &d, thread) == 40000 + 1000 + IO_BOUNCE_MAX + 10);
+    CHECK(memcmp(d.data, contents + 5000, 40000) == 0);
+    CHECK(memcmp(d.data + 40000, contents + 100, 1000) == 0);
+    CHECK(memcmp(d.data + 41000, contents, IO_BOUNCE_MAX) == 0);
+    CHECK(memcmp(d.data + 41000 + IO_BOUNCE_MAX, contents + FILE_BYTES - 10, 10) == 0);
+    free(d.data);
+    close(file);
+}
+
+static void check_whole_file(void) {
+    int       pair[2];
+    drain_t   d;
+    pthread_t thread;
+    int       err  = 0;
+    int       file = open_file();
+
+    socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+    start_drain(pair[1], &d, &thread);
+
+    size_t sent = 0;
+    while (sent < FILE_BYTES) {
+        ssize_t n = sendfile_request(pair[0], file, IO_OFFSET_CURRENT, FILE_BYTES - sent, &err);
+        CHECK(n > 0);
+        if (n <= 0) {
+            break;
+        }
+        sent += n;
+    }
+
+    CHECK(finish_drain(pair[0], &d, thread) == FILE_BYTES);
+    CHECK(memcmp(d.data, contents, FILE_BYTES) == 0);
+    free(d.data);
+    close(file);
+}
+
+static void check_full_socket(bool blocking) {
+    int      pair[2];
+    int      err      = 0;
+    int      file     = open_file();
+    int      size     = 4096;
+    uint8_t *received = malloc(FILE_BYTES);
+
+    socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+    setsockopt(pair[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    if (!blocking) {
+        fcntl(pair[0], F_SETFL, O_NONBLOCK);
+    }
+
+    // Stops where the socket filled up, even a blocking one, the file position only moves past what went out
+    ssize_t first = sendfile_request(pair[0], file, IO_OFFSET_CURRENT, IO_BOUNCE_MAX, &err);
+    CHECK(first > 0 && first < IO_BOUNCE_MAX);
+    CHECK(lseek(file, 0, SEEK_CUR) == first);
+
+    // Nothing fits at all
+    CHECK(sendfile_request(pair[0], file, IO_OFFSET_CURRENT, IO_BOUNCE_MAX, &err) == -1);
+    CHECK(err == EAGAIN || err == EWOULDBLOCK);
+    CHECK(lseek(file, 0, SEEK_CUR) == first);
+
+    // Picks up where it left off once there is room
+    size_t got = 0;
+    while (got < (size_t)first) {
+        ssize_t n = read(pair[1], received + got, first - got);
+        if (n <= 0) {
+            break;
+        }
+        got += n;
+    }
+    ssize_t second = sendfile_request(pair[0], file, IO_OFFSET_CURRENT, 100, &err);
+    CHECK(second == 100);
+    CHECK(read(pair[1], received + got, 100) == 100);
+    CHECK(memcmp(received, contents, first + 100) == 0);
+
+    close(pair[0]);
+    close(pair[1]);
+    close(file);
+    free(received);
+}
+
+static void check_errors(void) {
+    int pair[2];
+    int err  = 0;
+    int file = open_file();
+
+    socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+
+    atomic_store(&file_fs.fail, true);
+    CHECK(sendfile_request(pair[0], file, 0, 1000, &err) == -1 && err == EIO);
+    atomic_store(&file_fs.fail, false);
+
+    close(pair[1]);
+    CHECK(sendfile_request(pair[0], file, IO_OFFSET_CURRENT, 1000, &err) == -1 && err == EPIPE);
+    CHECK(lseek(file, 0, SEEK_CUR) == 0);
+
+    // Not a file that can seek
+    int pipe_fds[2];
+    CHECK(pipe(pipe_fds) == 0);
+    CHECK(sendfile_request(pair[0], pipe_fds[0], IO_OFFSET_CURRENT, 1000, &err) == -1 && err == ESPIPE);
+
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    close(pair[0]);
+    close(file);
+}
+
+static void *concurrent(void *arg) {
+    (void)arg;
+    int       pair[2];
+    drain_t   d;
+    pthread_t thread;
+    int       file = open_file();
+
+    socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+    start_drain(pair[1], &d, &thread);
+    for (off_t offset = 0; offset < FILE_BYTES;) {
+        int     error = 0;
+        ssize_t n     = splice_transfer(
+            &file_fs.filesystem.device, file, &socket_device.device, pair[0], offset, FILE_BYTES - offset, &error
+        );
+        CHECK(n > 0);
+        if (n <= 0) {
+            break;
+        }
+        offset += n;
+    }
+
+    CHECK(finish_drain(pair[0], &d, thread) == FILE_BYTES);
+    CHECK(memcmp(d.data, contents, FILE_BYTES) == 0);
+    free(d.data);
+    close(file);
+    return NULL;
+}
+
+int main(void) {
+    signal(SIGPIPE, SIG_IGN);
+
+    for (int i = 0; i < FILE_BYTES; i++) {
+        contents[i] = (uint8_t)(i * 7 + i / 251);
+    }
+
+    file_fs.filesystem.device.type   = DEVICE_TYPE_FILESYSTEM;
+    file_fs.filesystem.device._read  = file_read;
+    file_fs.filesystem.device._write = file_write;
+    file_fs.filesystem.device._lseek = file_lseek;
+    socket_device.device.type        = DEVICE_TYPE_SOCKET;
+    socket_device._sendto            = socket_sendto;
+
+    // Without the pool every transfer brings its own buffer
+    check_whole_file();
+    CHECK(atomic_load(&live_allocations) == 0);
+
+    CHECK(splice_init());
+    int pool_allocations = atomic_load(&live_allocations);
+
+    check_offsets();
+    check_whole_file();
+    check_full_socket(false);
+    check_full_socket(true);
+    check_errors();
+
+    pthread_t threads[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        pthread_create(&threads[i], NULL, concurrent, NULL);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    CHECK(atomic_load(&live_allocations) == pool_allocations);
+
+    return check_report("splice_test");
+}
@@ -0,0 +1,517 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// The stat cache against a fake filesystem: positive and negative hits, every kind of invalidation, changes that
+// race with a lookup, a randomized run against the filesystem itself and readers racing a writer. Ends with a
+// microbenchmark of search list style probing for missing files, with and without the cache.
+
+#include "stat_cache.h"
+#include "check.h"
+#include "esp_heap_caps.h"
+#include "pathfuncs_private.h"
+#include "why_io.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <errno.h>
+#include <time.h>
+
+#define FAKE_FILES    64
+#define RANDOM_OPS    20000
+#define RACE_READS    200000
+#define BENCH_MEMBERS 3
+#define BENCH_LOOKUPS 100000
+
+typedef struct {
+    char        name[PATH_UNIX_MAX_LEN];
+    bool        exists;
+    atomic_long size;
+} fake_file_t;
+
+static filesystem_device_t fake_fs;
+static fake_file_t         files[FAKE_FILES];
+static atomic_int          fs_stats;
+
+void *heap_caps_malloc(size_t size, uint32_t caps) {
+    (void)caps;
+    return malloc(size);
+}
+
+void heap_caps_free(void *ptr) {
+    free(ptr);
+}
+
+// pathfuncs.c links against these, none of the functions using them are called here
+
+void *why_malloc(size_t size) {
+    return malloc(size);
+}
+
+void why_free(void *ptr) {
+    free(ptr);
+}
+
+char *why_strdup(char const *s) {
+    return strdup(s);
+}
+
+int why_asprintf(char **restrict strp, char const *restrict fmt, ...) {
+    (void)strp;
+    (void)fmt;
+    return -1;
+}
+
+int why_stat(char const *restrict pathname, struct stat *restrict statbuf) {
+    (void)pathname;
+    (void)statbuf;
+    return -1;
+}
+
+int why_mkdir(char const *pathname, mode_t mode) {
+    (void)pathname;
+    (void)mode;
+    return -1;
+}
+
+int why_unlink(char const *pathname) {
+    (void)pathname;
+    return -1;
+}
+
+int why_rmdir(char const *pathname) {
+    (void)pathname;
+    return -1;
+}
+
+DIR *why_opendir(char const *name) {
+    (void)name;
+    return NULL;
+}
+
+struct dirent *why_readdir(DIR *dirp) {
+    (void)dirp;
+    return NULL;
+}
+
+int why_closedir(DIR *dirp) {
+    (void)dirp;
+    return -1;
+}
+
+// Case insensitive and without a trailing slash, like FAT
+static void fold(char const *in, char *out) {
+    size_t len = strlen(in);
+    if (len > 1 && in[len - 1] == '/') {
+        len--;
+    }
+    for (size_t i = 0; i < len; i++) {
+        out[i] = in[i] >= 'A' && in[i] <= 'Z' ? in[i] + 'a' - 'A' : in[i];
+    }
+    out[len] = '\0';
+}
+
+static fake_file_t *fake_find(char const *unixpath, bool create) {
+    char name[PATH_UNIX_MAX_LEN];
+    fold(unixpath, name);
+
+    for (int i = 0; i < FAKE_FILES; i++) {
+        if (files[i].name[0] && strcmp(files[i].name, name) == 0) {
+            return &files[i];
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    for (int i = 0; i < FAKE_FILES; i++) {
+        if (!files[i].name[0]) {
+            strcpy(files[i].name, name);
+            return &files[i];
+        }
+    }
+    return NULL;
+}
+
+static int fake_stat(void *dev, path_t *path, struct stat *restrict statbuf) {
+    (void)dev;
+    char unixpath[PATH_UNIX_MAX_LEN];
+
+    atomic_fetch_add(&fs_stats, 1);
+    if (path_to_unix(path, unixpath, sizeof(unixpath)) != PATH_PARSE_OK) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    fake_file_t *file = fake_find(unixpath, false);
+    if (!file || !file->exists) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    memset(statbuf, 0, sizeof(*statbuf));
+    statbuf->st_mode = S_IFREG;
+    statbuf->st_size = atomic_load(&file->size);
+    return 0;
+}
+
+// Changes the file underneath, the way a filesystem call would
+static void fake_set(char const *path, bool exists, long size) {
+    path_t parsed;
+    char   unixpath[PATH_UNIX_MAX_LEN];
+
+    CHECK(parse_path(path, &parsed) == PATH_PARSE_OK);
+    CHECK(path_to_unix(&parsed, unixpath, sizeof(unixpath)) == PATH_PARSE_OK);
+    fake_file_t *file = fake_find(unixpath, true);
+    file->exists      = exists;
+    atomic_store(&file->size, size);
+}
+
+static void invalidate(char const *path) {
+    path_t parsed;
+    CHECK(parse_path(path, &parsed) == PATH_PARSE_OK);
+    stat_cache_invalidate(&parsed);
+}
+
+// Returns the size, or -1 if the file doesn't exist
+static long do_stat(char const *path) {
+    path_t      parsed;
+    struct stat st;
+
+    CHECK(parse_path(path, &parsed) == PATH_PARSE_OK);
+    errno = 0;
+    if (stat_cache_stat(&fake_fs, &parsed, &st) != 0) {
+        CHECK(errno == ENOENT);
+        return -1;
+    }
+    return st.st_size;
+}
+
+static void reset(void) {
+    memset(files, 0, sizeof(files));
+    stat_cache_flush();
+    atomic_store(&fs_stats, 0);
+}
+
+static void check_hits(void) {
+    reset();
+    fake_set("FLASH0:[CONFIG]APP.TOML", true, 10);
+
+    CHECK(do_stat("FLASH0:[CONFIG]APP.TOML") == 10);
+    CHECK(do_stat("FLASH0:[CONFIG]APP.TOML") == 10);
+    CHECK(fs_stats == 1);
+
+    // Same file, other spelling
+    CHECK(do_stat("flash0:[config]app.toml") == 10);
+    CHECK(fs_stats == 1);
+
+    CHECK(do_stat("FLASH0:[CONFIG]MISSING.TOML") == -1);
+    CHECK(do_stat("FLASH0:[CONFIG]MISSING.TOML") == -1);
+    CHECK(fs_stats == 2);
+
+    // A directory with and without the trailing slash
+    fake_set("FLASH0:[CONFIG]", true, 0);
+    CHECK(do_stat("FLASH0:[CONFIG]") == 0);
+    CHECK(do_stat("FLASH0:CONFIG") == 0);
+    CHECK(fs_stats == 3);
+
+    // Cached without being told, the whole point
+    fake_set("FLASH0:[CONFIG]MISSING.TOML", true, 5);
+    CHECK(do_stat("FLASH0:[CONFIG]MISSING.TOML") == -1);
+
+    stat_cache_stats_t stats;
+    stat_cache_stats_get(&stats);
+    CHECK(stats.hits >= 3);
+    CHECK(stats.negative_hits >= 2);
+}
+
+static void check_invalidation(void) {
+    reset();
+
+    // Created
+    CHECK(do_stat("FLASH0:[A]NEW.TXT") == -1);
+    fake_set("FLASH0:[A]NEW.TXT", true, 1);
+    invalidate("FLASH0:[A]NEW.TXT");
+    CHECK(do_stat("FLASH0:[A]NEW.TXT") == 1);
+
+    // Written, through the hash an open file keeps
+    path_t parsed;
+    CHECK(parse_path("FLASH0:[A]NEW.TXT", &parsed) == PATH_PARSE_OK);
+    uint32_t hash = stat_cache_hash(&parsed);
+    CHECK(hash != 0);
+    fake_set("FLASH0:[A]NEW.TXT", true, 2);
+    stat_cache_invalidate_hash(hash);
+    CHECK(do_stat("FLASH0:[A]NEW.TXT") == 2);
+
+    // Deleted under another spelling
+    fake_set("FLASH0:[A]NEW.TXT", false, 0);
+    invalidate("flash0:[a]new.txt");
+    CHECK(do_stat("FLASH0:[A]NEW.TXT") == -1);
+
+    // Directory made with the other form of its name
+    CHECK(do_stat("FLASH0:[A]SUB") == -1);
+    fake_set("FLASH0:[A.SUB]", true, 0);
+    invalidate("FLASH0:[A.SUB]");
+    CHECK(do_stat("FLASH0:[A]SUB") == 0);
+
+    // Renamed directory, everything below it moves
+    fake_set("FLASH0:[A.SUB]F.TXT", true, 3);
+    CHECK(do_stat("FLASH0:[A.SUB]F.TXT") == 3);
+    CHECK(do_stat("FLASH0:[B]F.TXT") == -1);
+    fake_set("FLASH0:[A.SUB]F.TXT", false, 0);
+    fake_set("FLASH0:[B]F.TXT", true, 3);
+    stat_cache_flush();
+    CHECK(do_stat("FLASH0:[A.SUB]F.TXT") == -1);
+    CHECK(do_stat("FLASH0:[B]F.TXT") == 3);
+
+    // Other devices with the same path are other files
+    fake_set("SD0:[B]F.TXT", true, 9);
+    CHECK(do_stat("SD0:[B]F.TXT") == 9);
+    CHECK(do_stat("FLASH0:[B]F.TXT") == 3);
+}
+
+static void check_races(void) {
+    reset();
+
+    // The file appears after the filesystem said it wasn't there but before that got stored
+    stat_cache_key_t key;
+    path_t           parsed;
+    bool             exists;
+    CHECK(parse_path("FLASH0:LATE.TXT", &parsed) == PATH_PARSE_OK);
+    stat_cache_key(&parsed, &key);
+    fake_set("FLASH0:LATE.TXT", true, 4);
+    stat_cache_invalidate(&parsed);
+    stat_cache_store(&key, NULL);
+    CHECK(!stat_cache_lookup(&key, NULL, &exists));
+    CHECK(do_stat("FLASH0:LATE.TXT") == 4);
+
+    // Same with a flush in between
+    CHECK(parse_path("FLASH0:LATER.TXT", &parsed) == PATH_PARSE_OK);
+    stat_cache_key(&parsed, &key);
+    stat_cache_flush();
+    stat_cache_store(&key, NULL);
+    stat_cache_key(&parsed, &key);
+    CHECK(!stat_cache_lookup(&key, NULL, &exists));
+
+    // Short name aliases only come in through directory entries. They are never cached, and changing one forgets
+    // everything.
+    struct stat st;
+    fake_set("FLASH0:LONGFILENAME.TXT", true, 6);
+    CHECK(do_stat("FLASH0:LONGFILENAME.TXT") == 6);
+    CHECK(parse_path("FLASH0:X", &parsed) == PATH_PARSE_OK);
+    CHECK(path_set_filename(&parsed, "LONGFI~1.TXT") == PATH_PARSE_OK);
+    int before = fs_stats;
+    CHECK(stat_cache_stat(&fake_fs, &parsed, &st) == -1);
+    CHECK(stat_cache_stat(&fake_fs, &parsed, &st) == -1);
+    CHECK(fs_stats == before + 2);
+    fake_set("FLASH0:LONGFILENAME.TXT", false, 0);
+    stat_cache_invalidate(&parsed);
+    CHECK(do_stat("FLASH0:LONGFILENAME.TXT") == -1);
+
+    // Same for a file opened through the alias and written later
+    uint32_t hash = stat_cache_hash(&parsed);
+    CHECK(hash == STAT_CACHE_HASH_ALIAS);
+    fake_set("FLASH0:LONGFILENAME.TXT", true, 7);
+    stat_cache_invalidate_hash(hash);
+    CHECK(do_stat("FLASH0:LONGFILENAME.TXT") == 7);
+
+    // Too long to cache
+    char long_path[STAT_CACHE_KEY_BYTES + 32];
+    memset(long_path, 'X', sizeof(long_path));
+    memcpy(long_path, "FLASH0:", 7);
+    strcpy(long_path + sizeof(long_path) - 5, ".TXT");
+    before = fs_stats;
+    CHECK(do_stat(long_path) == -1);
+    CHECK(do_stat(long_path) == -1);
+    CHECK(fs_stats == before + 2);
+}
+
+static void check_collisions(void) {
+    reset();
+
+    // Find names sharing a slot
+    char     names[2][32];
+    uint32_t first = 0;
+    int      found = 0;
+    for (int i = 0; found < 2 && i < 100000; i++) {
+        path_t parsed;
+        snprintf(names[found], sizeof(names[found]), "FLASH0:F%d.TXT", i);
+        CHECK(parse_path(names[found], &parsed) == PATH_PARSE_OK);
+        uint32_t slot = stat_cache_hash(&parsed) % STAT_CACHE_SLOTS;
+        if (found == 0) {
+            first = slot;
+            found++;
+        } else if (slot == first) {
+            found++;
+        }
+    }
+    CHECK(found == 2);
+
+    fake_set(names[0], true, 1);
+    CHECK(do_stat(names[0]) == 1);
+    CHECK(do_stat(names[1]) == -1);
+    CHECK(do_stat(names[0]) == 1);
+    CHECK(do_stat(names[1]) == -1);
+
+    // Invalidating one may forget the other, but never makes it wrong
+    fake_set(names[1], true, 2);
+    invalidate(names[1]);
+    CHECK(do_stat(names[0]) == 1);
+    CHECK(do_stat(names[1]) == 2);
+}
+
+// Every change goes through the filesystem and then invalidates, the cache has to agree with the filesystem
+static void check_random(void) {
+    reset();
+    srand(1234);
+
+    for (int op = 0; op < RANDOM_OPS; op++) {
+        char path[32];
+        snprintf(path, sizeof(path), "%s:[D%d]F%d.TXT", rand() % 2 ? "FLASH0" : "SD0", rand() % 3, rand() % 8);
+
+        switch (rand() % 4) {
+            case 0:
+                fake_set(path, true, rand() % 1000);
+                invalidate(path);
+                break;
+            case 1:
+                fake_set(path, false, 0);
+                invalidate(path);
+                break;
+            default: {
+                path_t parsed;
+                char   unixpath[PATH_UNIX_MAX_LEN];
+                CHECK(parse_path(path, &parsed) == PATH_PARSE_OK);
+                CHECK(path_to_unix(&parsed, unixpath, sizeof(unixpath)) == PATH_PARSE_OK);
+                fake_file_t *file = fake_find(unixpath, false);
+                long         want = file && file->exists ? atomic_load(&file->size) : -1;
+                CHECK(do_stat(path) == want);
+            }
+        }
+    }
+}
+
+static atomic_long race_version;
+static atomic_bool race_done;
+
+static void *race_writer(void *arg) {
+    (void)arg;
+    for (long v = 1; !atomic_load(&race_done); v++) {
+        fake_file_t *file = fake_find("/FLASH0/RACE.TXT", false);
+        atomic_store(&file->size, v);
+        invalidate("FLASH0:RACE.TXT");
+        atomic_store(&race_version, v);
+    }
+    return NULL;
+}
+
+// A stat that starts after a change was invalidated must see it
+static void *race_reader(void *arg) {
+    (void)arg;
+    for (int i = 0; i < RACE_READS; i++) {
+        long seen = atomic_load(&race_version);
+        long size = do_stat("FLASH0:RACE.TXT");
+        if (size < seen) {
+            CHECK(size >= seen);
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void check_threads(void) {
+    reset();
+    fake_set("FLASH0:RACE.TXT", true, 0);
+    atomic_store(&race_version, 0);
+    atomic_store(&race_done, false);
+
+    pthread_t writer;
+    pthread_t readers[3];
+    pthread_create(&writer, NULL, race_writer, NULL);
+    for (int i = 0; i < 3; i++) {
+        pthread_create(&readers[i], NULL, race_reader, NULL);
+    }
+    for (int i = 0; i < 3; i++) {
+        pthread_join(readers[i], NULL);
+    }
+    atomic_store(&race_done, true);
+    pthread_join(writer, NULL);
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Looking for a library in a search list where only the last member has it
+static void bench_search_list(void) {
+    static char const *members[BENCH_MEMBERS] = {"SD0:[LIBS]", "FLASH0:[LIBS]", "FLASH0:[SYSLIBS]"};
+
+    static path_t      parsed[BENCH_MEMBERS];
+
+    reset();
+    fake_set("FLASH0:[SYSLIBS]LIBC.SO", true, 100);
+    for (int m = 0; m < BENCH_MEMBERS; m++) {
+        char path[64];
+        snprintf(path, sizeof(path), "%sLIBC.SO", members[m]);
+        CHECK(parse_path(path, &parsed[m]) == PATH_PARSE_OK);
+    }
+
+    for (int cached = 0; cached < 2; cached++) {
+        stat_cache_flush();
+        atomic_store(&fs_stats, 0);
+
+        double start = now_ns();
+        for (int i = 0; i < BENCH_LOOKUPS; i++) {
+            for (int m = 0; m < BENCH_MEMBERS; m++) {
+                struct stat st;
+                int res = cached ? stat_cache_stat(&fake_fs, &parsed[m], &st) : fake_stat(&fake_fs, &parsed[m], &st);
+                if (res == 0) {
+                    break;
+                }
+            }
+        }
+        double ns = now_ns() - start;
+
+        printf(
+            "  %-9s %7d filesystem stats for %d lookups, %.0f ns per lookup\n",
+            cached ? "cached" : "uncached",
+            atomic_load(&fs_stats),
+            BENCH_LOOKUPS,
+            ns / BENCH_LOOKUPS
+        );
+    }
+}
+
+int main(void) {
+    fake_fs._stat = fake_stat;
+    CHECK(stat_cache_init());
+
+    check_hits();
+    check_invalidation();
+    check_races();
+    check_collisions();
+    check_random();
+    check_threads();
+    bench_search_list();
+
+    return check_report("stat_cache_test");
+}
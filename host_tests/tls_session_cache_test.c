@@ -0,0 +1,541 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// The per-process TLS session cache, first on its own and then between a real TLS client and server on the loopback
+// interface. The client stores every session the server gives it like our esp-tls does and offers the cached one on
+// the next connection, the server tells which handshakes resumed. Covers TLS 1.3 tickets, TLS 1.2, forgetting,
+// expiry, a server that lost its ticket keys and clients that trust different CAs, and ends with the time a full and a
+// resumed handshake take.
+
+#include "tls_session_cache.h"
+#include "badgevms_config.h"
+#include "check.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define HOST           "localhost"
+#define BENCH_REQUESTS 200
+
+typedef enum {
+    HANDSHAKE_FAILED,
+    HANDSHAKE_FULL,
+    HANDSHAKE_RESUMED,
+} handshake_t;
+
+static X509     *server_cert;
+static EVP_PKEY *server_key;
+static uint16_t  server_port;
+
+static _Atomic(SSL_CTX *) server_ctx;
+static atomic_int         server_full;
+static atomic_int         server_resumed;
+
+static tls_session_cache_t *client_cache;
+static uint32_t             clock_s = 1000;
+
+// Stand-ins for the digests of two trust setups
+static unsigned char const  trust_a[TLS_SESSION_TRUST_BYTES] = {0xaa};
+static unsigned char const  trust_b[TLS_SESSION_TRUST_BYTES] = {0xbb};
+static unsigned char const *client_trust                     = trust_a;
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void) {
+    pthread_mutex_t *mutex = malloc(sizeof(pthread_mutex_t));
+    pthread_mutex_init(mutex, NULL);
+    return mutex;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks) {
+    (void)ticks;
+    pthread_mutex_lock(semaphore);
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore) {
+    pthread_mutex_unlock(semaphore);
+    return pdTRUE;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t semaphore) {
+    pthread_mutex_destroy(semaphore);
+    free(semaphore);
+}
+
+static bool get_equals(tls_session_cache_t *cache, char const *host, uint16_t port, char const *want, uint32_t now) {
+    size_t len    = 0;
+    char  *result = tls_session_cache_get(cache, host, port, trust_a, &len, now);
+    bool   equal  = result && len == strlen(want) && memcmp(result, want, len) == 0;
+    free(result);
+    return equal;
+}
+
+static bool get_missing(tls_session_cache_t *cache, char const *host, uint16_t port, uint32_t now) {
+    size_t len    = 0;
+    void  *result = tls_session_cache_get(cache, host, port, trust_a, &len, now);
+    free(result);
+    return result == NULL;
+}
+
+static void test_basics(void) {
+    tls_session_cache_t      *cache = tls_session_cache_create();
+    tls_session_cache_stats_t stats;
+
+    CHECK(get_missing(cache, "example.com", 443, 0));
+    CHECK(tls_session_cache_put(cache, "example.com", 443, trust_a, "one", 3, 0, 0));
+    CHECK(get_equals(cache, "example.com", 443, "one", 0));
+    CHECK(get_equals(cache, "EXAMPLE.com", 443, "one", 0));
+    CHECK(get_missing(cache, "example.com", 8443, 0));
+    CHECK(get_missing(cache, "example.org", 443, 0));
+    CHECK(!tls_session_cache_put(cache, "example.com", 443, trust_a, "", 0, 0, 0));
+
+    // Ports are separate, the same host again replaces
+    CHECK(tls_session_cache_put(cache, "example.com", 8443, trust_a, "two", 3, 0, 0));
+    CHECK(tls_session_cache_put(cache, "Example.COM", 443, trust_a, "three", 5, 0, 0));
+    CHECK(get_equals(cache, "example.com", 443, "three", 0));
+    CHECK(get_equals(cache, "example.com", 8443, "two", 0));
+
+    tls_session_cache_forget(cache, "example.com", 443, trust_a);
+    tls_session_cache_forget(cache, "example.com", 443, trust_a);
+    CHECK(get_missing(cache, "example.com", 443, 0));
+    CHECK(get_equals(cache, "example.com", 8443, "two", 0));
+
+    tls_session_cache_stats_get(cache, &stats);
+    CHECK(stats.stores == 3);
+    CHECK(stats.forgotten == 1);
+    CHECK(stats.hits == 5);
+    CHECK(stats.misses == 4);
+    CHECK(stats.evicted == 0);
+
+    tls_session_cache_destroy(cache);
+}
+
+static void test_expiry(void) {
+    tls_session_cache_t      *cache = tls_session_cache_create();
+    tls_session_cache_stats_t stats;
+
+    CHECK(tls_session_cache_put(cache, "short", 443, trust_a, "s", 1, 60, 100));
+    CHECK(tls_session_cache_put(cache, "default", 443, trust_a, "d", 1, 0, 100));
+    CHECK(tls_session_cache_put(cache, "long", 443, trust_a, "l", 1, TLS_SESSION_CACHE_MAX_AGE_S * 10, 100));
+
+    CHECK(get_equals(cache, "short", 443, "s", 159));
+    CHECK(get_missing(cache, "short", 443, 160));
+    CHECK(get_missing(cache, "short", 443, 159));
+
+    // Lifetimes are capped at the maximum age, 0 meaning that maximum
+    CHECK(get_equals(cache, "default", 443, "d", 100 + TLS_SESSION_CACHE_MAX_AGE_S - 1));
+    CHECK(get_equals(cache, "long", 443, "l", 100 + TLS_SESSION_CACHE_MAX_AGE_S - 1));
+    CHECK(get_missing(cache, "default", 443, 100 + TLS_SESSION_CACHE_MAX_AGE_S));
+    CHECK(get_missing(cache, "long", 443, 100 + TLS_SESSION_CACHE_MAX_AGE_S));
+
+    // The clock wrapping around doesn't expire anything early
+    CHECK(tls_session_cache_put(cache, "wrap", 443, trust_a, "w", 1, 60, UINT32_MAX - 10));
+    CHECK(get_equals(cache, "wrap", 443, "w", 20));
+    CHECK(get_missing(cache, "wrap", 443, 50));
+
+    tls_session_cache_stats_get(cache, &stats);
+    CHECK(stats.expired == 4);
+
+    tls_session_cache_destroy(cache);
+}
+
+static void test_trust_keys(void) {
+    tls_session_cache_t *cache = tls_session_cache_create();
+    size_t               len   = 0;
+
+    CHECK(tls_session_cache_put(cache, "example.com", 443, trust_a, "a", 1, 0, 0));
+    void *result = tls_session_cache_get(cache, "example.com", 443, trust_b, &len, 0);
+    CHECK(result == NULL);
+
+    // The same host under another trust is a separate session, not a replacement
+    CHECK(tls_session_cache_put(cache, "example.com", 443, trust_b, "b", 1, 0, 0));
+    CHECK(get_equals(cache, "example.com", 443, "a", 0));
+    result = tls_session_cache_get(cache, "example.com", 443, trust_b, &len, 0);
+    CHECK(result && len == 1 && memcmp(result, "b", 1) == 0);
+    free(result);
+
+    tls_session_cache_forget(cache, "example.com", 443, trust_b);
+    CHECK(get_equals(cache, "example.com", 443, "a", 0));
+    result = tls_session_cache_get(cache, "example.com", 443, trust_b, &len, 0);
+    CHECK(result == NULL);
+
+    tls_session_cache_destroy(cache);
+}
+
+static void test_eviction(void) {
+    tls_session_cache_t      *cache = tls_session_cache_create();
+    tls_session_cache_stats_t stats;
+    char                      host[32];
+
+    for (int i = 0; i < TLS_SESSION_CACHE_SLOTS; i++) {
+        snprintf(host, sizeof(host), "host%d", i);
+        CHECK(tls_session_cache_put(cache, host, 443, trust_a, host, strlen(host), 0, 0));
+    }
+
+    // host0 was used last, so host1 is the one to go
+    CHECK(get_equals(cache, "host0", 443, "host0", 0));
+    CHECK(tls_session_cache_put(cache, "extra", 443, trust_a, "extra", 5, 0, 0));
+    CHECK(get_missing(cache, "host1", 443, 0));
+    CHECK(get_equals(cache, "host0", 443, "host0", 0));
+    CHECK(get_equals(cache, "extra", 443, "extra", 0));
+
+    for (int i = 2; i < TLS_SESSION_CACHE_SLOTS; i++) {
+        snprintf(host, sizeof(host), "host%d", i);
+        CHECK(get_equals(cache, host, 443, host, 0));
+    }
+
+    tls_session_cache_stats_get(cache, &stats);
+    CHECK(stats.evicted == 1);
+
+    tls_session_cache_destroy(cache);
+}
+
+static X509 *make_certificate(EVP_PKEY *key, char const *host) {
+    X509 *cert = X509_new();
+
+    X509_set_version(cert, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(cert), -60);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 60 * 60);
+    X509_set_pubkey(cert, key);
+
+    X509_NAME *name = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (unsigned char const *)host, -1, -1, 0);
+    X509_set_issuer_name(cert, name);
+
+    char alt_name[64];
+    snprintf(alt_name, sizeof(alt_name), "DNS:%s", host);
+    X509V3_CTX ctx;
+    X509V3_set_ctx_nodb(&ctx);
+    X509V3_set_ctx(&ctx, cert, cert, NULL, NULL, 0);
+    X509_EXTENSION *san = X509V3_EXT_conf_nid(NULL, &ctx, NID_subject_alt_name, alt_name);
+    X509_add_ext(cert, san, -1);
+    X509_EXTENSION_free(san);
+
+    X509_sign(cert, key, EVP_sha256());
+    return cert;
+}
+
+// A new context has new ticket keys, like a server that restarted
+static void new_server_ctx(void) {
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_use_certificate(ctx, server_cert);
+    SSL_CTX_use_PrivateKey(ctx, server_key);
+
+    SSL_CTX *old = atomic_exchange(&server_ctx, ctx);
+    SSL_CTX_free(old);
+}
+
+static void *serve(void *arg) {
+    int listener = (intptr_t)arg;
+    for (;;) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        SSL *ssl = SSL_new(atomic_load(&server_ctx));
+        SSL_set_fd(ssl, fd);
+        if (SSL_accept(ssl) == 1) {
+            char request[8];
+            if (SSL_read(ssl, request, sizeof(request)) > 0) {
+                if (SSL_session_reused(ssl)) {
+                    server_resumed++;
+                } else {
+                    server_full++;
+                }
+                SSL_write(ssl, "pong\n", 5);
+            }
+            SSL_shutdown(ssl);
+        }
+        SSL_free(ssl);
+        close(fd);
+    }
+    return NULL;
+}
+
+static void start_server(void) {
+    int                listener = socket(AF_INET, SOCK_STREAM, 0);
+    int                one      = 1;
+    struct sockaddr_in addr     = {0};
+    socklen_t          len      = sizeof(addr);
+
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(listener, (struct sockaddr *)&addr, sizeof(addr));
+    listen(listener, 16);
+    getsockname(listener, (struct sockaddr *)&addr, &len);
+    server_port = ntohs(addr.sin_port);
+
+    server_key  = EVP_PKEY_Q_keygen(NULL, NULL, "EC", "P-256");
+    server_cert = make_certificate(server_key, HOST);
+    new_server_ctx();
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, serve, (void *)(intptr_t)listener);
+    pthread_detach(thread);
+}
+
+// Every session the server hands out goes into the cache, TLS 1.3 ones arrive after the handshake
+static int store_session(SSL *ssl, SSL_SESSION *session) {
+    (void)ssl;
+    int len = i2d_SSL_SESSION(session, NULL);
+    if (len <= 0) {
+        return 0;
+    }
+
+    unsigned char *data = malloc(len);
+    unsigned char *p    = data;
+    i2d_SSL_SESSION(session, &p);
+    tls_session_cache_put(
+        client_cache,
+        HOST,
+        server_port,
+        client_trust,
+        data,
+        len,
+        SSL_SESSION_get_ticket_lifetime_hint(session),
+        clock_s
+    );
+    OPENSSL_cleanse(data, len);
+    free(data);
+    return 0;
+}
+
+static SSL_CTX *new_client_ctx(int max_version) {
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_max_proto_version(ctx, max_version);
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+    X509_STORE_add_cert(SSL_CTX_get_cert_store(ctx), server_cert);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, store_session);
+    return ctx;
+}
+
+static handshake_t connect_once(SSL_CTX *ctx) {
+    int                fd   = socket(AF_INET, SOCK_STREAM, 0);
+    int                one  = 1;
+    struct sockaddr_in addr = {0};
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    addr.sin_family         = AF_INET;
+    addr.sin_port           = htons(server_port);
+    addr.sin_addr.s_addr    = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return HANDSHAKE_FAILED;
+    }
+
+    SSL *ssl = SSL_new(ctx);
+    SSL_set_fd(ssl, fd);
+    SSL_set_tlsext_host_name(ssl, HOST);
+    SSL_set1_host(ssl, HOST);
+
+    size_t         len;
+    unsigned char *data    = tls_session_cache_get(client_cache, HOST, server_port, client_trust, &len, clock_s);
+    bool           offered = false;
+    if (data) {
+        unsigned char const *p       = data;
+        SSL_SESSION         *session = d2i_SSL_SESSION(NULL, &p, len);
+        offered                      = session && SSL_set_session(ssl, session) == 1;
+        SSL_SESSION_free(session);
+        OPENSSL_cleanse(data, len);
+        free(data);
+        if (!offered) {
+            tls_session_cache_forget(client_cache, HOST, server_port, client_trust);
+        }
+    }
+
+    handshake_t result = HANDSHAKE_FAILED;
+    char        reply[8];
+    if (SSL_connect(ssl) == 1 && SSL_write(ssl, "ping\n", 5) == 5 && SSL_read(ssl, reply, sizeof(reply)) == 5) {
+        result = SSL_session_reused(ssl) ? HANDSHAKE_RESUMED : HANDSHAKE_FULL;
+    } else if (offered) {
+        tls_session_cache_forget(client_cache, HOST, server_port, client_trust);
+    }
+
+    SSL_shutdown(ssl);
+    SSL_free(ssl);
+    close(fd);
+    return result;
+}
+
+static handshake_t connect_checked(SSL_CTX *ctx) {
+    int         full    = server_full;
+    int         resumed = server_resumed;
+    handshake_t result  = connect_once(ctx);
+
+    // Both ends have to agree on what happened
+    CHECK(result != HANDSHAKE_FAILED);
+    CHECK(server_full - full == (result == HANDSHAKE_FULL));
+    CHECK(server_resumed - resumed == (result == HANDSHAKE_RESUMED));
+    return result;
+}
+
+static void test_tls(char const *name, int max_version) {
+    SSL_CTX *ctx = new_client_ctx(max_version);
+    client_cache = tls_session_cache_create();
+
+    CHECK(connect_checked(ctx) == HANDSHAKE_FULL);
+    CHECK(connect_checked(ctx) == HANDSHAKE_RESUMED);
+    CHECK(connect_checked(ctx) == HANDSHAKE_RESUMED);
+
+    tls_session_cache_forget(client_cache, HOST, server_port, client_trust);
+    CHECK(connect_checked(ctx) == HANDSHAKE_FULL);
+    CHECK(connect_checked(ctx) == HANDSHAKE_RESUMED);
+
+    // Past the lifetime the session is dropped instead of offered
+    clock_s += TLS_SESSION_CACHE_MAX_AGE_S;
+    CHECK(connect_checked(ctx) == HANDSHAKE_FULL);
+    CHECK(connect_checked(ctx) == HANDSHAKE_RESUMED);
+
+    // The server can't decrypt the ticket anymore, the full handshake replaces the cached session
+    new_server_ctx();
+    CHECK(connect_checked(ctx) == HANDSHAKE_FULL);
+    CHECK(connect_checked(ctx) == HANDSHAKE_RESUMED);
+
+    tls_session_cache_stats_t stats;
+    tls_session_cache_stats_get(client_cache, &stats);
+    CHECK(stats.expired == 1);
+    CHECK(stats.forgotten == 1);
+    printf(
+        "%s: %u hits, %u misses, %u stores, %u expired\n",
+        name,
+        stats.hits,
+        stats.misses,
+        stats.stores,
+        stats.expired
+    );
+
+    tls_session_cache_destroy(client_cache);
+    SSL_CTX_free(ctx);
+}
+
+// Two clients of the same server that trust different CAs don't resume each other's sessions, each keeps its own
+static void test_trust(void) {
+    EVP_PKEY *other_key = EVP_PKEY_Q_keygen(NULL, NULL, "EC", "P-256");
+    X509     *other_ca  = make_certificate(other_key, "other.example");
+    SSL_CTX  *ctx_a     = new_client_ctx(TLS1_3_VERSION);
+    SSL_CTX  *ctx_b     = new_client_ctx(TLS1_3_VERSION);
+    X509_STORE_add_cert(SSL_CTX_get_cert_store(ctx_b), other_ca);
+    client_cache = tls_session_cache_create();
+
+    client_trust = trust_a;
+    CHECK(connect_checked(ctx_a) == HANDSHAKE_FULL);
+    CHECK(connect_checked(ctx_a) == HANDSHAKE_RESUMED);
+
+    client_trust = trust_b;
+    CHECK(connect_checked(ctx_b) == HANDSHAKE_FULL);
+    CHECK(connect_checked(ctx_b) == HANDSHAKE_RESUMED);
+
+    client_trust = trust_a;
+    CHECK(connect_checked(ctx_a) == HANDSHAKE_RESUMED);
+
+    // Forgetting the session of one leaves the other
+    tls_session_cache_forget(client_cache, HOST, server_port, trust_b);
+    CHECK(connect_checked(ctx_a) == HANDSHAKE_RESUMED);
+    client_trust = trust_b;
+    CHECK(connect_checked(ctx_b) == HANDSHAKE_FULL);
+    client_trust = trust_a;
+
+    tls_session_cache_stats_t stats;
+    tls_session_cache_stats_get(client_cache, &stats);
+    CHECK(stats.misses == 3);
+    CHECK(stats.evicted == 0);
+
+    tls_session_cache_destroy(client_cache);
+    SSL_CTX_free(ctx_a);
+    SSL_CTX_free(ctx_b);
+    X509_free(other_ca);
+    EVP_PKEY_free(other_key);
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void bench(char const *name, int max_version) {
+    SSL_CTX *ctx = new_client_ctx(max_version);
+    client_cache = tls_session_cache_create();
+
+    double full_ms    = 0;
+    double resumed_ms = 0;
+    int    resumed    = 0;
+    for (int i = 0; i < BENCH_REQUESTS; i++) {
+        tls_session_cache_forget(client_cache, HOST, server_port, client_trust);
+        double start = now_ms();
+        CHECK(connect_once(ctx) == HANDSHAKE_FULL);
+        full_ms += now_ms() - start;
+
+        start = now_ms();
+        if (connect_once(ctx) == HANDSHAKE_RESUMED) {
+            resumed++;
+        }
+        resumed_ms += now_ms() - start;
+    }
+    CHECK(resumed == BENCH_REQUESTS);
+
+    printf(
+        "%s: %d full %.3fms, resumed %.3fms per connection\n",
+        name,
+        BENCH_REQUESTS,
+        full_ms / BENCH_REQUESTS,
+        resumed_ms / BENCH_REQUESTS
+    );
+
+    tls_session_cache_destroy(client_cache);
+    SSL_CTX_free(ctx);
+}
+
+int main(void) {
+    test_basics();
+    test_expiry();
+    test_trust_keys();
+    test_eviction();
+
+    start_server();
+    test_tls("TLS 1.3", TLS1_3_VERSION);
+    test_tls("TLS 1.2", TLS1_2_VERSION);
+    test_trust();
+    bench("TLS 1.3", TLS1_3_VERSION);
+    bench("TLS 1.2", TLS1_2_VERSION);
+
+    return check_report("tls_session_cache_test");
+}
@@ -0,0 +1,594 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// poll() over fake devices: pipes that wake a wait queue, a device that can only be polled, native sockets from a
+// socketpair and a device that wants more hooks than poll() made room for. Checks wakeups come through without the
+// waiter spinning, timeouts, that waiters are unhooked afterwards and, with threads feeding pipes that other threads
+// poll, that no wakeup gets lost.
+
+#define _GNU_SOURCE
+
+#include "badgevms_config.h"
+#include "check.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "wait_queue.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PIPES           4
+#define STRESS_POLLERS  8
+#define STRESS_PER_FEED 3
+#define STRESS_BYTES    2000
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+    UBaseType_t     count;
+    UBaseType_t     max;
+} semaphore_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    size_t          bytes;
+    wait_queue_t    readable;
+} pipe_t;
+
+typedef struct {
+    device_t   device;
+    pipe_t     pipes[STRESS_POLLERS * STRESS_PER_FEED];
+    atomic_int polls;
+} pipe_device_t;
+
+typedef struct {
+    device_t device;
+    int64_t  ready_at;
+    int      polls;
+} polled_device_t;
+
+typedef struct {
+    device_t     device;
+    wait_queue_t first;
+    wait_queue_t second;
+    atomic_bool  ready;
+} greedy_device_t;
+
+typedef struct {
+    device_t        device;
+    pthread_mutex_t lock;
+    bool            open;
+    wait_queue_t    readable;
+} closing_device_t;
+
+static pipe_device_t   pipes;
+static polled_device_t polled;
+static greedy_device_t greedy;
+static device_t        native;
+static device_t        plain;
+
+static closing_device_t closing;
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max_count, UBaseType_t initial_count) {
+    semaphore_t *semaphore = calloc(1, sizeof(semaphore_t));
+    pthread_mutex_init(&semaphore->mutex, NULL);
+    pthread_cond_init(&semaphore->cond, NULL);
+    semaphore->count = initial_count;
+    semaphore->max   = max_count;
+    return semaphore;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void) {
+    return xSemaphoreCreateCounting(1, 0);
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void) {
+    return xSemaphoreCreateCounting(1, 1);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t handle, TickType_t ticks) {
+    semaphore_t    *semaphore = handle;
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec  += ticks / 1000;
+    deadline.tv_nsec += (ticks % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&semaphore->mutex);
+    while (!semaphore->count) {
+        if (ticks == 0) {
+            break;
+        } else if (ticks == portMAX_DELAY) {
+            pthread_cond_wait(&semaphore->cond, &semaphore->mutex);
+        } else if (pthread_cond_timedwait(&semaphore->cond, &semaphore->mutex, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+
+    BaseType_t taken = semaphore->count ? pdTRUE : pdFALSE;
+    if (taken) {
+        semaphore->count--;
+    }
+    pthread_mutex_unlock(&semaphore->mutex);
+    return taken;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t handle) {
+    semaphore_t *semaphore = handle;
+    BaseType_t   given     = pdFALSE;
+
+    pthread_mutex_lock(&semaphore->mutex);
+    if (semaphore->count < semaphore->max) {
+        semaphore->count++;
+        given = pdTRUE;
+        pthread_cond_signal(&semaphore->cond);
+    }
+    pthread_mutex_unlock(&semaphore->mutex);
+    return given;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t handle) {
+    semaphore_t *semaphore = handle;
+    pthread_mutex_destroy(&semaphore->mutex);
+    pthread_cond_destroy(&semaphore->cond);
+    free(semaphore);
+}
+
+void vTaskDelay(TickType_t ticks) {
+    usleep(ticks * 1000);
+}
+
+int64_t esp_timer_get_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static double now_ms(void) {
+    return esp_timer_get_time() / 1000.0;
+}
+
+static short pipe_poll(void *dev, int fd, short events, poll_waiter_t *waiter) {
+    (void)events;
+    pipe_device_t *device = dev;
+    pipe_t        *pipe   = &device->pipes[fd];
+
+    atomic_fetch_add(&device->polls, 1);
+    poll_wait(waiter, &pipe->readable);
+
+    pthread_mutex_lock(&pipe->lock);
+    short revents = POLLOUT | (pipe->bytes ? POLLIN : 0);
+    pthread_mutex_unlock(&pipe->lock);
+    return revents;
+}
+
+static void pipe_write(int fd, size_t bytes) {
+    pipe_t *pipe = &pipes.pipes[fd];
+
+    pthread_mutex_lock(&pipe->lock);
+    pipe->bytes += bytes;
+    pthread_mutex_unlock(&pipe->lock);
+    wait_queue_wake(&pipe->readable);
+}
+
+static size_t pipe_drain(int fd) {
+    pipe_t *pipe = &pipes.pipes[fd];
+
+    pthread_mutex_lock(&pipe->lock);
+    size_t bytes = pipe->bytes;
+    pipe->bytes  = 0;
+    pthread_mutex_unlock(&pipe->lock);
+    return bytes;
+}
+
+static short polled_poll(void *dev, int fd, short events, poll_waiter_t *waiter) {
+    (void)fd;
+    (void)events;
+    polled_device_t *device = dev;
+
+    device->polls++;
+    poll_recheck(waiter, 5);
+    return esp_timer_get_time() >= device->ready_at ? POLLIN : 0;
+}
+
+static short native_poll(void *dev, int fd, short events, poll_waiter_t *waiter) {
+    (void)dev;
+    struct pollfd pfd = {.fd = fd, .events = events};
+
+    poll_wait_fd(waiter, fd, events);
+    if (poll(&pfd, 1, 0) < 0) {
+        return POLLERR;
+    }
+    return pfd.revents;
+}
+
+static short greedy_poll(void *dev, int fd, short events, poll_waiter_t *waiter) {
+    (void)fd;
+    (void)events;
+    greedy_device_t *device = dev;
+
+    poll_wait(waiter, &device->first);
+    poll_wait(waiter, &device->second);
+    return atomic_load(&device->ready) ? POLLIN : 0;
+}
+
+// Like a window that is destroyed while another thread polls its events fd
+static short closing_poll(void *dev, int fd, short events, poll_waiter_t *waiter) {
+    (void)fd;
+    (void)events;
+    closing_device_t *device = dev;
+
+    pthread_mutex_lock(&device->lock);
+    if (!device->open) {
+        pthread_mutex_unlock(&device->lock);
+        return POLLHUP;
+    }
+    poll_wait(waiter, &device->readable);
+    pthread_mutex_unlock(&device->lock);
+    return 0;
+}
+
+static poll_entry_t pipe_entry(int fd, short events) {
+    return (poll_entry_t){.device = &pipes.device, .dev_fd = fd, .events = events};
+}
+
+typedef struct {
+    int    delay_ms;
+    int    fd;
+    size_t bytes;
+} delayed_write_t;
+
+static void *write_later(void *arg) {
+    delayed_write_t *write = arg;
+    usleep(write->delay_ms * 1000);
+    pipe_write(write->fd, write->bytes);
+    return NULL;
+}
+
+static bool unhooked(void) {
+    for (size_t i = 0; i < sizeof(pipes.pipes) / sizeof(pipes.pipes[0]); ++i) {
+        if (pipes.pipes[i].readable.head) {
+            return false;
+        }
+    }
+    return !greedy.first.head && !greedy.second.head;
+}
+
+static void test_basics(poll_waiter_t *waiter) {
+    poll_entry_t entries[3] = {pipe_entry(0, POLLIN), pipe_entry(1, POLLIN | POLLOUT)};
+
+    // Ready right away, and an fd that isn't open
+    entries[2] = (poll_entry_t){.device = NULL, .events = POLLIN};
+    CHECK(poll_entries(waiter, entries, 3, -1) == 2);
+    CHECK(entries[0].revents == 0);
+    CHECK(entries[1].revents == POLLOUT);
+    CHECK(entries[2].revents == POLLNVAL);
+
+    // Nothing to read, a timeout of 0 doesn't wait
+    double start = now_ms();
+    CHECK(poll_entries(waiter, entries, 1, 0) == 0);
+    CHECK(now_ms() - start < 5);
+
+    start = now_ms();
+    CHECK(poll_entries(waiter, entries, 1, 50) == 0);
+    double waited = now_ms() - start;
+    CHECK(waited >= 50 && waited < 80);
+    CHECK(unhooked());
+
+    // A device without _poll is always ready, like a regular file
+    entries[1] = (poll_entry_t){.device = &plain, .events = POLLIN | POLLPRI};
+    CHECK(poll_entries(waiter, entries, 2, -1) == 1);
+    CHECK(entries[1].revents == POLLIN);
+}
+
+static void test_wakeup(poll_waiter_t *waiter) {
+    poll_entry_t    entries[PIPES];
+    delayed_write_t write = {.delay_ms = 100, .fd = 2, .bytes = 10};
+    pthread_t       thread;
+
+    for (int i = 0; i < PIPES; ++i) {
+        entries[i] = pipe_entry(i, POLLIN);
+    }
+
+    // Blocked until the write, having looked at the pipes once before and once after
+    atomic_store(&pipes.polls, 0);
+    pthread_create(&thread, NULL, write_later, &write);
+    double start = now_ms();
+    CHECK(poll_entries(waiter, entries, PIPES, 5000) == 1);
+    double waited = now_ms() - start;
+    pthread_join(thread, NULL);
+
+    printf("woken after %.1fms by a write after %dms, %d device polls\n", waited, write.delay_ms, pipes.polls);
+    CHECK(waited >= 100 && waited < 150);
+    CHECK(entries[2].revents == POLLIN);
+    CHECK(atomic_load(&pipes.polls) <= 3 * PIPES);
+    CHECK(unhooked());
+    CHECK(pipe_drain(2) == 10);
+
+    // A wakeup that came in after a previous poll() returned costs a scan but doesn't end the next one early
+    pipe_write(3, 1);
+    CHECK(pipe_drain(3) == 1);
+    start = now_ms();
+    CHECK(poll_entries(waiter, entries, PIPES, 30) == 0);
+    CHECK(now_ms() - start >= 30);
+}
+
+static void test_polled(poll_waiter_t *waiter) {
+    poll_entry_t entries[2] = {pipe_entry(0, POLLIN), {.device = &polled.device, .events = POLLIN}};
+
+    polled.polls    = 0;
+    polled.ready_at = esp_timer_get_time() + 40000;
+    double start    = now_ms();
+    CHECK(poll_entries(waiter, entries, 2, 1000) == 1);
+    double waited = now_ms() - start;
+
+    CHECK(entries[1].revents == POLLIN);
+    CHECK(waited >= 40 && waited < 70);
+    // Looked at every 5ms, not in a loop
+    CHECK(polled.polls <= 12);
+}
+
+static void *send_later(void *arg) {
+    usleep(50000);
+    CHECK(write(*(int *)arg, "x", 1) == 1);
+    return NULL;
+}
+
+static void test_native(poll_waiter_t *waiter) {
+    int sockets[2];
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+
+    poll_entry_t entries[2] = {pipe_entry(0, POLLIN), {.device = &native, .dev_fd = sockets[0], .events = POLLIN}};
+
+    // Woken by the socket
+    pthread_t thread;
+    pthread_create(&thread, NULL, send_later, &sockets[1]);
+    double start = now_ms();
+    CHECK(poll_entries(waiter, entries, 2, 2000) == 1);
+    double waited = now_ms() - start;
+    pthread_join(thread, NULL);
+    CHECK(entries[1].revents == POLLIN);
+    CHECK(waited >= 50 && waited < 100);
+
+    char c;
+    CHECK(read(sockets[0], &c, 1) == 1);
+
+    // Woken by a wait queue while blocked on the socket
+    delayed_write_t write = {.delay_ms = 50, .fd = 0, .bytes = 1};
+    pthread_create(&thread, NULL, write_later, &write);
+    start = now_ms();
+    CHECK(poll_entries(waiter, entries, 2, 2000) == 1);
+    waited = now_ms() - start;
+    pthread_join(thread, NULL);
+    CHECK(entries[0].revents == POLLIN);
+    CHECK(entries[1].revents == 0);
+    CHECK(waited >= 50 && waited < 100);
+    CHECK(pipe_drain(0) == 1);
+    CHECK(unhooked());
+
+    close(sockets[0]);
+    close(sockets[1]);
+}
+
+static void *wake_greedy(void *arg) {
+    (void)arg;
+    usleep(50000);
+    atomic_store(&greedy.ready, true);
+    wait_queue_wake(&greedy.second);
+    return NULL;
+}
+
+static void test_greedy(poll_waiter_t *waiter) {
+    // One hook per entry, the second queue of the device falls back to looking again every so often
+    poll_entry_t entries[1] = {{.device = &greedy.device, .events = POLLIN}};
+    pthread_t    thread;
+
+    atomic_store(&greedy.ready, false);
+    pthread_create(&thread, NULL, wake_greedy, NULL);
+    double start = now_ms();
+    CHECK(poll_entries(waiter, entries, 1, 2000) == 1);
+    double waited = now_ms() - start;
+    pthread_join(thread, NULL);
+    CHECK(waited >= 50 && waited < 50 + POLL_FALLBACK_INTERVAL_MS + 30);
+    CHECK(unhooked());
+}
+
+typedef struct {
+    int        first_fd;
+    atomic_int consumed;
+    atomic_int timeouts;
+} poller_t;
+
+typedef struct {
+    poll_entry_t entry;
+    int          ready;
+} closing_poller_t;
+
+static void *poll_closing(void *arg) {
+    closing_poller_t *poller = arg;
+    poll_waiter_t    *waiter = poll_waiter_create();
+
+    poller->ready = poll_entries(waiter, &poller->entry, 1, -1);
+    poll_waiter_destroy(waiter);
+    return NULL;
+}
+
+static void test_close(void) {
+    closing_poller_t pollers[3];
+    pthread_t        threads[3];
+
+    pthread_mutex_init(&closing.lock, NULL);
+    closing.device = (device_t){._poll = closing_poll};
+    closing.open   = true;
+    CHECK(wait_queue_init(&closing.readable));
+
+    for (int i = 0; i < 3; ++i) {
+        pollers[i] = (closing_poller_t){
+            .entry = {.device = &closing.device, .events = POLLIN},
+            .ready = -1,
+        };
+        pthread_create(&threads[i], NULL, poll_closing, &pollers[i]);
+    }
+    usleep(50000);
+
+    // The queue only goes once every poller has been woken and has let go of it
+    pthread_mutex_lock(&closing.lock);
+    closing.open = false;
+    pthread_mutex_unlock(&closing.lock);
+    double start = now_ms();
+    wait_queue_deinit(&closing.readable);
+    double waited = now_ms() - start;
+
+    CHECK(closing.readable.lock == NULL);
+    CHECK(closing.readable.head == NULL);
+    for (int i = 0; i < 3; ++i) {
+        pthread_join(threads[i], NULL);
+        CHECK(pollers[i].ready == 1);
+        CHECK(pollers[i].entry.revents == POLLHUP);
+    }
+
+    printf("Closed a queue with 3 pollers on it in %.1fms\n", waited);
+    CHECK(waited < 50);
+}
+
+static atomic_bool stress_done;
+
+static void *stress_poller(void *arg) {
+    poller_t      *poller = arg;
+    poll_waiter_t *waiter = poll_waiter_create();
+    poll_entry_t   entries[STRESS_PER_FEED];
+
+    for (int i = 0; i < STRESS_PER_FEED; ++i) {
+        entries[i] = pipe_entry(poller->first_fd + i, POLLIN);
+    }
+
+    while (atomic_load(&poller->consumed) < STRESS_BYTES * STRESS_PER_FEED) {
+        if (poll_entries(waiter, entries, STRESS_PER_FEED, 1000) == 0) {
+            atomic_fetch_add(&poller->timeouts, 1);
+            if (atomic_load(&stress_done)) {
+                break;
+            }
+            continue;
+        }
+        for (int i = 0; i < STRESS_PER_FEED; ++i) {
+            if (entries[i].revents & POLLIN) {
+                atomic_fetch_add(&poller->consumed, pipe_drain(entries[i].dev_fd));
+            }
+        }
+    }
+
+    poll_waiter_destroy(waiter);
+    return NULL;
+}
+
+static void *stress_feeder(void *arg) {
+    poller_t    *poller = arg;
+    unsigned int seed   = poller->first_fd;
+
+    for (int i = 0; i < STRESS_BYTES * STRESS_PER_FEED; ++i) {
+        pipe_write(poller->first_fd + rand_r(&seed) % STRESS_PER_FEED, 1);
+        if (rand_r(&seed) % 8 == 0) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static void test_stress(void) {
+    poller_t  pollers[STRESS_POLLERS];
+    pthread_t threads[STRESS_POLLERS * 2];
+
+    for (int i = 0; i < STRESS_POLLERS * STRESS_PER_FEED; ++i) {
+        pipe_drain(i);
+    }
+
+    double start = now_ms();
+    for (int i = 0; i < STRESS_POLLERS; ++i) {
+        pollers[i] = (poller_t){.first_fd = i * STRESS_PER_FEED};
+        pthread_create(&threads[i * 2], NULL, stress_poller, &pollers[i]);
+        pthread_create(&threads[i * 2 + 1], NULL, stress_feeder, &pollers[i]);
+    }
+    for (int i = 0; i < STRESS_POLLERS; ++i) {
+        pthread_join(threads[i * 2 + 1], NULL);
+    }
+    atomic_store(&stress_done, true);
+    for (int i = 0; i < STRESS_POLLERS; ++i) {
+        pthread_join(threads[i * 2], NULL);
+    }
+
+    int consumed = 0;
+    int timeouts = 0;
+    for (int i = 0; i < STRESS_POLLERS; ++i) {
+        consumed += pollers[i].consumed;
+        timeouts += pollers[i].timeouts;
+    }
+
+    printf(
+        "%d pollers consumed %d of %d bytes in %.1fms, %d timeouts\n",
+        STRESS_POLLERS,
+        consumed,
+        STRESS_POLLERS * STRESS_BYTES * STRESS_PER_FEED,
+        now_ms() - start,
+        timeouts
+    );
+    CHECK(consumed == STRESS_POLLERS * STRESS_BYTES * STRESS_PER_FEED);
+    CHECK(timeouts == 0);
+    CHECK(unhooked());
+}
+
+int main(void) {
+    pipes.device = (device_t){._poll = pipe_poll};
+    for (size_t i = 0; i < sizeof(pipes.pipes) / sizeof(pipes.pipes[0]); ++i) {
+        pthread_mutex_init(&pipes.pipes[i].lock, NULL);
+        wait_queue_init(&pipes.pipes[i].readable);
+    }
+    polled.device = (device_t){._poll = polled_poll};
+    native        = (device_t){._poll = native_poll};
+    greedy.device = (device_t){._poll = greedy_poll};
+    wait_queue_init(&greedy.first);
+    wait_queue_init(&greedy.second);
+
+    poll_waiter_t *waiter = poll_waiter_create();
+    CHECK(waiter);
+
+    test_basics(waiter);
+    test_wakeup(waiter);
+    test_polled(waiter);
+    test_native(waiter);
+    test_greedy(waiter);
+    test_close();
+    test_stress();
+
+    poll_waiter_destroy(waiter);
+
+    return check_report("wait_queue_test");
+}
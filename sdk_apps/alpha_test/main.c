@@ -0,0 +1,176 @@
+#include "badgevms/compositor.h"
+#include "badgevms/event.h"
+#include "badgevms/framebuffer.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <math.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Stacks a few translucent windows on top of an animated opaque one and reports how long frames take.
+// TAB toggles WINDOW_FLAG_ALPHA on the overlays to compare against the opaque path, ESC quits.
+
+#define BG_WIDTH  (300)
+#define BG_HEIGHT (280)
+#define BG_W      (600)
+#define BG_H      (560)
+
+#define OVERLAY_WIDTH  (160)
+#define OVERLAY_HEIGHT (100)
+#define OVERLAY_W      (320)
+#define OVERLAY_H      (200)
+#define NUM_OVERLAYS   3
+
+#define REPORT_FRAMES 300
+
+static uint32_t const overlay_colors[NUM_OVERLAYS] = {0xff0000, 0x00ff00, 0x0000ff};
+
+static long elapsed_us(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1000000L + (end->tv_nsec - start->tv_nsec) / 1000L;
+}
+
+static void draw_background(framebuffer_t *framebuffer, int frame) {
+    uint16_t *pixels = (uint16_t *)framebuffer->pixels;
+    for (int y = 0; y < BG_HEIGHT; y++) {
+        for (int x = 0; x < BG_WIDTH; x++) {
+            bool check = (((x + frame) / 20) + (y / 20)) & 1;
+            pixels[y * BG_WIDTH + x] = check ? 0xffff : 0x001f;
+        }
+    }
+}
+
+static void draw_overlay(framebuffer_t *framebuffer, uint32_t color) {
+    uint32_t *pixels = (uint32_t *)framebuffer->pixels;
+    float     cx     = OVERLAY_WIDTH / 2.0f;
+    float     cy     = OVERLAY_HEIGHT / 2.0f;
+    float     max_d  = sqrtf(cx * cx + cy * cy);
+
+    // Opaque in the middle, fading out towards the corners
+    for (int y = 0; y < OVERLAY_HEIGHT; y++) {
+        for (int x = 0; x < OVERLAY_WIDTH; x++) {
+            float    d     = sqrtf((x - cx) * (x - cx) + (y - cy) * (y - cy));
+            uint32_t alpha = (uint32_t)(255.0f * (1.0f - d / max_d));
+            pixels[y * OVERLAY_WIDTH + x] = (alpha << 24) | color;
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    window_handle_t background = window_create("Alpha test", (window_size_t){BG_W, BG_H}, WINDOW_FLAG_DOUBLE_BUFFERED);
+    if (!background) {
+        printf("Unable to create background window\n");
+        return 1;
+    }
+
+    framebuffer_t *background_fb = window_framebuffer_create(
+        background,
+        (window_size_t){BG_WIDTH, BG_HEIGHT},
+        BADGEVMS_PIXELFORMAT_RGB565
+    );
+
+    window_handle_t overlays[NUM_OVERLAYS];
+    for (int i = 0; i < NUM_OVERLAYS; i++) {
+        char title[20];
+        snprintf(title, sizeof(title), "Overlay %d", i);
+        overlays[i] = window_create(title, (window_size_t){OVERLAY_W, OVERLAY_H}, WINDOW_FLAG_ALPHA);
+        if (!overlays[i]) {
+            printf("Unable to create overlay window %d\n", i);
+            return 1;
+        }
+
+        framebuffer_t *framebuffer = window_framebuffer_create(
+            overlays[i],
+            (window_size_t){OVERLAY_WIDTH, OVERLAY_HEIGHT},
+            BADGEVMS_PIXELFORMAT_ARGB8888
+        );
+        draw_overlay(framebuffer, overlay_colors[i]);
+        window_present(overlays[i], true, NULL, 0);
+    }
+
+    bool alpha  = true;
+    int  frame  = 0;
+    long min_us = 0;
+    long max_us = 0;
+    long sum_us = 0;
+
+    while (1) {
+        struct timespec start_time, end_time;
+        clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+        bool quit = false;
+        for (int i = 0; i < NUM_OVERLAYS; i++) {
+            event_t e = window_event_poll(overlays[i], false, 0);
+            if (e.type == EVENT_KEY_DOWN) {
+                if (e.keyboard.scancode == KEY_SCANCODE_ESCAPE) {
+                    quit = true;
+                }
+                if (e.keyboard.scancode == KEY_SCANCODE_TAB) {
+                    alpha = !alpha;
+                    printf("Overlays are now %s\n", alpha ? "translucent" : "opaque");
+                }
+            }
+        }
+
+        if (quit) {
+            break;
+        }
+
+        // Move all overlays in one go, they are applied during the same frame
+        window_transaction_handle_t transaction = window_transaction_begin();
+        for (int i = 0; i < NUM_OVERLAYS; i++) {
+            float           phase  = (frame / 60.0f) + (i * 2.0f);
+            window_coords_t coords = {
+                .x = 200 + (int)(150.0f * cosf(phase)),
+                .y = 250 + (int)(150.0f * sinf(phase)),
+            };
+            window_flag_t flags = window_flags_get(overlays[i]);
+            flags               = alpha ? flags | WINDOW_FLAG_ALPHA : flags & ~WINDOW_FLAG_ALPHA;
+
+            window_transaction_position_set(transaction, overlays[i], coords);
+            window_transaction_flags_set(transaction, overlays[i], flags);
+        }
+        window_transaction_commit(transaction, false);
+
+        draw_background(background_fb, frame);
+        window_present(background, true, NULL, 0);
+        background_fb = window_framebuffer_get(background);
+
+        clock_gettime(CLOCK_MONOTONIC, &end_time);
+        long frame_us = elapsed_us(&start_time, &end_time);
+
+        if (!min_us || frame_us < min_us) {
+            min_us = frame_us;
+        }
+        if (frame_us > max_us) {
+            max_us = frame_us;
+        }
+        sum_us += frame_us;
+
+        frame++;
+        if (frame % REPORT_FRAMES == 0) {
+            printf(
+                "%s overlays: %d frames, frame time min=%ldus avg=%ldus max=%ldus (%.1f FPS)\n",
+                alpha ? "Translucent" : "Opaque",
+                REPORT_FRAMES,
+                min_us,
+                sum_us / REPORT_FRAMES,
+                max_us,
+                1000000.0 / (sum_us / REPORT_FRAMES)
+            );
+            min_us = 0;
+            max_us = 0;
+            sum_us = 0;
+        }
+    }
+
+    for (int i = 0; i < NUM_OVERLAYS; i++) {
+        window_destroy(overlays[i]);
+    }
+    window_destroy(background);
+    printf("alpha_test exiting\n");
+    return 0;
+}
@@ -0,0 +1,120 @@
+#include "badgevms/compositor.h"
+#include "badgevms/event.h"
+#include "badgevms/framebuffer.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Renders at increasing loads, waits for every frame to reach the panel and prints what the compositor saw
+
+#define FB_WIDTH  (360)
+#define FB_HEIGHT (360)
+#define W_WIDTH   (720)
+#define W_HEIGHT  (720)
+
+#define FRAMES_PER_LOAD 240
+
+static int const loads[] = {0, 1, 2, 4, 8};
+
+static void print_timing(char const *name, compositor_timing_t *timing) {
+    if (!timing->count) {
+        printf("  %-16s no samples\n", name);
+        return;
+    }
+
+    printf(
+        "  %-16s n=%" PRIu32 " min=%" PRIu32 "us avg=%" PRIu32 "us max=%" PRIu32 "us\n",
+        name,
+        timing->count,
+        timing->min_us,
+        (uint32_t)(timing->total_us / timing->count),
+        timing->max_us
+    );
+
+    printf("  %-16s", "");
+    for (int i = 0; i < COMPOSITOR_HISTOGRAM_BUCKETS; i++) {
+        if (i < COMPOSITOR_HISTOGRAM_BUCKETS - 1) {
+            printf(" <%ums:%" PRIu32, 1u << i, timing->histogram[i]);
+        } else {
+            printf(" >=%ums:%" PRIu32, 1u << (i - 1), timing->histogram[i]);
+        }
+    }
+    printf("\n");
+}
+
+static void render(framebuffer_t *framebuffer, int frame, int passes) {
+    uint16_t *pixels = (uint16_t *)framebuffer->pixels;
+
+    // Pass 0 is the real frame, the rest is just there to burn time
+    for (int pass = 0; pass <= passes; pass++) {
+        for (int y = 0; y < FB_HEIGHT; y++) {
+            uint16_t color = ((y + frame + pass) & 0xff) * 0x0101;
+            for (int x = 0; x < FB_WIDTH; x++) {
+                pixels[y * FB_WIDTH + x] = color ^ x;
+            }
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    window_handle_t window = window_create(
+        "Compositor bench",
+        (window_size_t){W_WIDTH, W_HEIGHT},
+        WINDOW_FLAG_DOUBLE_BUFFERED | WINDOW_FLAG_FULLSCREEN
+    );
+    if (!window) {
+        printf("Unable to create window\n");
+        return 1;
+    }
+
+    framebuffer_t *framebuffer =
+        window_framebuffer_create(window, (window_size_t){FB_WIDTH, FB_HEIGHT}, BADGEVMS_PIXELFORMAT_RGB565);
+
+    int frame = 0;
+    for (int l = 0; l < sizeof(loads) / sizeof(loads[0]); l++) {
+        window_stats_t     window_stats;
+        compositor_stats_t compositor_stats;
+
+        window_stats_get(window, &window_stats, true);
+        compositor_stats_get(&compositor_stats, true);
+
+        for (int i = 0; i < FRAMES_PER_LOAD; i++, frame++) {
+            event_t e = window_event_poll(window, false, 0);
+            if (e.type == EVENT_KEY_DOWN && e.keyboard.scancode == KEY_SCANCODE_ESCAPE) {
+                goto out;
+            }
+
+            render(framebuffer, frame, loads[l]);
+            uint32_t seq = window_present(window, false, NULL, 0);
+            framebuffer  = window_framebuffer_get(window);
+            window_frame_wait(seq, true, 0);
+        }
+
+        window_stats_get(window, &window_stats, false);
+        compositor_stats_get(&compositor_stats, false);
+
+        printf("Load %d: %d frames, last frame %" PRIu32 "\n", loads[l], FRAMES_PER_LOAD, compositor_stats.frame_seq);
+        printf(
+            "  window: presented=%" PRIu32 " composited=%" PRIu32 " missed=%" PRIu32 "\n",
+            window_stats.frames_presented,
+            window_stats.frames_composited,
+            window_stats.deadlines_missed
+        );
+        print_timing("present latency", &window_stats.present_latency);
+        printf(
+            "  compositor: vblanks=%" PRIu32 " composited=%" PRIu32 " missed=%" PRIu32 "\n",
+            compositor_stats.vblanks,
+            compositor_stats.frames_composited,
+            compositor_stats.frames_missed
+        );
+        print_timing("frame time", &compositor_stats.frame_time);
+        print_timing("ppa time", &compositor_stats.ppa_time);
+    }
+
+out:
+    window_destroy(window);
+    printf("compositor_bench exiting\n");
+    return 0;
+}
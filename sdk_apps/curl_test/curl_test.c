@@ -225,7 +225,10 @@ void cookie_jar_example() {
         if (res != CURLE_OK) {
             printf("Cookie jar save test failed: %s\n", curl_easy_strerror(res));
         } else {
-            printf("Request completed, cookies should be saved to file\n");
+            printf("Request completed, saving cookies to file\n");
+
+            // The jar is normally written a while after the cookies change or on cleanup
+            curl_easy_setopt(curl, CURLOPT_COOKIELIST, "FLUSH");
 
             // Verify file was created
             FILE *verify_file = fopen(test_cookie_file, "r");
@@ -0,0 +1,121 @@
+#include "badgevms/device.h"
+#include "badgevms/pathfuncs.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Small file create/write/close and append/close throughput under each filesystem sync policy
+//
+// Usage: fs_sync_bench [DEVICE]   (default FLASH0)
+
+#define NUM_FILES   64
+#define NUM_APPENDS 128
+#define FILE_BYTES  512
+#define APPEND_SIZE 48
+#define INTERVAL_MS 1000
+
+typedef struct {
+    char const              *name;
+    filesystem_sync_policy_t policy;
+} policy_t;
+
+static policy_t const policies[] = {
+    {"sync-on-close", FILESYSTEM_SYNC_ON_CLOSE},
+    {"periodic", FILESYSTEM_SYNC_PERIODIC},
+    {"explicit", FILESYSTEM_SYNC_EXPLICIT},
+};
+
+static char buffer[FILE_BYTES];
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void report(char const *what, int ops, double ms) {
+    printf("  %-14s %4d ops %9.1fms %8.1f ops/s\n", what, ops, ms, ms > 0 ? ops * 1000.0 / ms : 0);
+}
+
+static int write_file(char const *path, int flags, size_t size) {
+    int fd = open(path, flags, 0644);
+    if (fd < 0) {
+        printf("Unable to open %s\n", path);
+        return -1;
+    }
+
+    if (write(fd, buffer, size) != (ssize_t)size) {
+        printf("Short write to %s\n", path);
+    }
+
+    return close(fd);
+}
+
+int main(int argc, char *argv[]) {
+    char const *device = argc > 1 ? argv[1] : "FLASH0";
+    char        dir[64];
+    char        path[128];
+
+    snprintf(dir, sizeof(dir), "%s:[FSBENCH]", device);
+    if (!mkdir_p(dir)) {
+        printf("Unable to create %s\n", dir);
+        return 1;
+    }
+
+    for (int i = 0; i < FILE_BYTES; i++) {
+        buffer[i] = 'a' + (i % 26);
+    }
+
+    for (int p = 0; p < sizeof(policies) / sizeof(policies[0]); p++) {
+        if (filesystem_sync_policy_set(device, policies[p].policy, INTERVAL_MS) != 0) {
+            printf("Unable to set policy %s on %s\n", policies[p].name, device);
+            continue;
+        }
+
+        printf("%s, policy %s\n", device, policies[p].name);
+
+        // Lots of small files, like per-app JSON
+        double start = now_ms();
+        for (int i = 0; i < NUM_FILES; i++) {
+            snprintf(path, sizeof(path), "%sFILE%03d.TXT", dir, i);
+            write_file(path, O_WRONLY | O_CREAT | O_TRUNC, FILE_BYTES);
+        }
+        report("create/close", NUM_FILES, now_ms() - start);
+
+        // One file appended to over and over, like a cookie jar or a log
+        snprintf(path, sizeof(path), "%sAPPEND.TXT", dir);
+        start = now_ms();
+        for (int i = 0; i < NUM_APPENDS; i++) {
+            write_file(path, O_WRONLY | O_CREAT | O_APPEND, APPEND_SIZE);
+        }
+        report("append/close", NUM_APPENDS, now_ms() - start);
+
+        // Rewriting the same file from the start
+        start = now_ms();
+        for (int i = 0; i < NUM_APPENDS; i++) {
+            write_file(path, O_WRONLY | O_CREAT | O_TRUNC, FILE_BYTES);
+        }
+        report("rewrite/close", NUM_APPENDS, now_ms() - start);
+
+        start = now_ms();
+        sync();
+        report("sync", 1, now_ms() - start);
+
+        for (int i = 0; i < NUM_FILES; i++) {
+            snprintf(path, sizeof(path), "%sFILE%03d.TXT", dir, i);
+            unlink(path);
+        }
+        snprintf(path, sizeof(path), "%sAPPEND.TXT", dir);
+        unlink(path);
+    }
+
+    filesystem_sync_policy_set(device, FILESYSTEM_SYNC_ON_CLOSE, 0);
+    rm_rf(dir);
+
+    printf("fs_sync_bench done\n");
+    return 0;
+}
@@ -374,25 +374,6 @@ static size_t WriteMemoryCallback(void *contents, size_t size, size_t nmemb, Mem
     return realsize;
 }
 
-static size_t WriteOTACallback(void *contents, size_t size, size_t nmemb, app_state_t *app) {
-    bool   err;
-    size_t realsize = size * nmemb;
-
-    printf("Size: %d \n", realsize);
-
-    char *buffer = (char *)calloc(realsize + 1, sizeof(char));
-
-    memcpy(buffer, contents, realsize);
-
-    err = ota_write(app->ota_session, buffer, realsize);
-    if (err == false) {
-        app->ota_error = true;
-    }
-
-    free(buffer);
-    return realsize;
-}
-
 void setup_wifi(void *data) {
     app_state_t *app = (app_state_t *)data;
 
@@ -477,37 +458,28 @@ void check_for_update(void *data) {
 
 void update_badge(void *data) {
     app_state_t *app = (app_state_t *)data;
-    CURL        *curl;
-    CURLcode     res;
-
-    curl = curl_easy_init();
 
     app->ota_error   = false;
     app->ota_session = ota_session_open();
 
-    if (curl) {
+    if (app->ota_session) {
         char *url = (char *)calloc(256, sizeof(char));
         sprintf(
             url,
             "https://badge.why2025.org/api/v3/projects/heplaphon_why_firmware_ota_test/rev%s/files/badgevms.bin",
             app->badgehub_revision
         );
-        curl_easy_setopt(curl, CURLOPT_URL, url);
-        curl_easy_setopt(curl, CURLOPT_BUFFERSIZE, 1024);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteOTACallback);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)app);
-        curl_easy_setopt(curl, CURLOPT_USERAGENT, "BadgeVMS-libcurl/1.0");
 
-        res = curl_easy_perform(curl);
-        if (res != CURLE_OK) {
-            printf("curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
+        // The kernel writes to flash while the download goes on and resumes it if the connection breaks
+        if (!ota_download(app->ota_session, url, NULL) || !ota_session_commit(app->ota_session)) {
+            printf("Firmware download failed\n");
             app->ota_error = true;
         }
-        ota_session_commit(app->ota_session);
         app->updated = true;
         free(url);
+    } else {
+        app->ota_error = true;
     }
-    curl_easy_cleanup(curl);
     app->key_pressed = false;
     app->state       = UPDATE_DONE;
     atomic_store(&app->thread_running, false);
@@ -0,0 +1,171 @@
+#include "badgevms/device.h"
+#include "badgevms/pathfuncs.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Sequential and random file throughput on a filesystem, with the bus mode it negotiated and what the device itself
+// saw
+//
+// Usage: sd_bench [DEVICE]   (default SD0)
+
+#define FILE_BYTES   (4 * 1024 * 1024)
+#define RANDOM_READS 256
+#define RANDOM_SIZE  4096
+#define MAX_BLOCK    (64 * 1024)
+
+static size_t const block_sizes[] = {512, 4096, 32 * 1024, MAX_BLOCK};
+
+static char buffer[MAX_BLOCK];
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static char const *bus_mode_name(filesystem_bus_mode_t mode) {
+    switch (mode) {
+        case FILESYSTEM_BUS_SD_DEFAULT: return "default speed";
+        case FILESYSTEM_BUS_SD_HIGH_SPEED: return "high speed";
+        case FILESYSTEM_BUS_SD_UHS_DDR50: return "UHS-I DDR50";
+        case FILESYSTEM_BUS_SD_UHS_SDR50: return "UHS-I SDR50";
+        default: return "none";
+    }
+}
+
+static double kib_s(uint64_t bytes, double ms) {
+    return ms > 0 ? bytes / 1024.0 * 1000.0 / ms : 0;
+}
+
+static void report(char const *what, size_t block, uint64_t bytes, double ms) {
+    printf("  %-8s %6zu B blocks %9.1fms %9.1f KiB/s\n", what, block, ms, kib_s(bytes, ms));
+}
+
+static void print_info(char const *device) {
+    filesystem_info_t info;
+    if (!filesystem_info_get(device, &info)) {
+        printf("No bus information for %s\n", device);
+        return;
+    }
+
+    printf(
+        "%s: %s, %" PRIu32 " kHz, %u bit, %" PRIu32 " B sectors, transfers up to %" PRIu32 " sectors\n",
+        device,
+        bus_mode_name(info.bus_mode),
+        info.bus_freq_khz,
+        info.bus_width,
+        info.sector_size,
+        info.max_transfer_sectors
+    );
+    printf("  probe read at mount %" PRIu32 " KiB/s\n", info.probe_read_kib_s);
+    printf(
+        "  device reads  %" PRIu64 " KiB, %.1f KiB/s\n",
+        info.bytes_read / 1024,
+        kib_s(info.bytes_read, info.read_us / 1000.0)
+    );
+    printf(
+        "  device writes %" PRIu64 " KiB, %.1f KiB/s\n",
+        info.bytes_written / 1024,
+        kib_s(info.bytes_written, info.write_us / 1000.0)
+    );
+}
+
+static double write_file(char const *path, size_t block) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        printf("Unable to open %s\n", path);
+        return -1;
+    }
+
+    double start = now_ms();
+    for (size_t done = 0; done < FILE_BYTES; done += block) {
+        if (write(fd, buffer, block) != (ssize_t)block) {
+            printf("Short write to %s\n", path);
+            break;
+        }
+    }
+    fsync(fd);
+    close(fd);
+    return now_ms() - start;
+}
+
+static double read_file(char const *path, size_t block) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        printf("Unable to open %s\n", path);
+        return -1;
+    }
+
+    double start = now_ms();
+    while (read(fd, buffer, block) > 0) {
+    }
+    close(fd);
+    return now_ms() - start;
+}
+
+static double read_random(char const *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        printf("Unable to open %s\n", path);
+        return -1;
+    }
+
+    double start = now_ms();
+    for (int i = 0; i < RANDOM_READS; i++) {
+        off_t offset = (off_t)(rand() % (FILE_BYTES / RANDOM_SIZE)) * RANDOM_SIZE;
+        lseek(fd, offset, SEEK_SET);
+        read(fd, buffer, RANDOM_SIZE);
+    }
+    close(fd);
+    return now_ms() - start;
+}
+
+int main(int argc, char *argv[]) {
+    char const *device = argc > 1 ? argv[1] : "SD0";
+    char        dir[64];
+    char        path[128];
+
+    print_info(device);
+
+    snprintf(dir, sizeof(dir), "%s:[SDBENCH]", device);
+    if (!mkdir_p(dir)) {
+        printf("Unable to create %s\n", dir);
+        return 1;
+    }
+    snprintf(path, sizeof(path), "%sBENCH.DAT", dir);
+
+    for (int i = 0; i < MAX_BLOCK; i++) {
+        buffer[i] = 'a' + (i % 26);
+    }
+
+    for (int b = 0; b < sizeof(block_sizes) / sizeof(block_sizes[0]); b++) {
+        report("write", block_sizes[b], FILE_BYTES, write_file(path, block_sizes[b]));
+        report("read", block_sizes[b], FILE_BYTES, read_file(path, block_sizes[b]));
+    }
+    report("random", RANDOM_SIZE, (uint64_t)RANDOM_READS * RANDOM_SIZE, read_random(path));
+
+    filesystem_cache_stats_t stats;
+    if (filesystem_cache_stats_get(device, &stats, false)) {
+        printf(
+            "  cache %" PRIu32 " hits, %" PRIu32 " misses, %" PRIu32 " read ahead, %" PRIu32 " bypassed\n",
+            stats.hits,
+            stats.misses,
+            stats.readahead_blocks,
+            stats.bypassed
+        );
+    }
+
+    print_info(device);
+
+    unlink(path);
+    rm_rf(dir);
+
+    printf("sd_bench done\n");
+    return 0;
+}
@@ -0,0 +1,100 @@
+#include "badgevms/pathfuncs.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Repeated stat and open of files that exist and files that don't, the way config lookups and library searches probe
+// them, and how quickly a change shows up
+//
+// Usage: stat_bench [DEVICE]   (default FLASH0)
+
+#define NUM_NAMES 16
+#define ROUNDS    64
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void report(char const *what, int ops, double ms) {
+    printf("  %-16s %5d ops %9.1fms %8.1f us/op\n", what, ops, ms, ms > 0 ? ms * 1000.0 / ops : 0);
+}
+
+int main(int argc, char *argv[]) {
+    char const *device = argc > 1 ? argv[1] : "FLASH0";
+    char        dir[64];
+    char        path[128];
+    struct stat st;
+
+    snprintf(dir, sizeof(dir), "%s:[STATBENCH]", device);
+    if (!mkdir_p(dir)) {
+        printf("Unable to create %s\n", dir);
+        return 1;
+    }
+
+    for (int i = 0; i < NUM_NAMES; i++) {
+        snprintf(path, sizeof(path), "%sFOUND%02d.TXT", dir, i);
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    printf("%s\n", device);
+
+    char const *kinds[] = {"FOUND", "MISSING"};
+    for (int k = 0; k < 2; k++) {
+        double start = now_ms();
+        for (int r = 0; r < ROUNDS; r++) {
+            for (int i = 0; i < NUM_NAMES; i++) {
+                snprintf(path, sizeof(path), "%s%s%02d.TXT", dir, kinds[k], i);
+                stat(path, &st);
+            }
+        }
+        snprintf(path, sizeof(path), "stat %s", k ? "missing" : "found");
+        report(path, ROUNDS * NUM_NAMES, now_ms() - start);
+    }
+
+    double start = now_ms();
+    for (int r = 0; r < ROUNDS; r++) {
+        for (int i = 0; i < NUM_NAMES; i++) {
+            snprintf(path, sizeof(path), "%sMISSING%02d.TXT", dir, i);
+            int fd = open(path, O_RDONLY);
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+    }
+    report("open missing", ROUNDS * NUM_NAMES, now_ms() - start);
+
+    // Every change has to be visible to the next stat
+    int stale = 0;
+    start     = now_ms();
+    for (int i = 0; i < NUM_NAMES; i++) {
+        snprintf(path, sizeof(path), "%sMISSING%02d.TXT", dir, i);
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd >= 0) {
+            write(fd, path, i);
+            close(fd);
+        }
+        if (stat(path, &st) != 0 || st.st_size != i) {
+            stale++;
+        }
+        unlink(path);
+        if (stat(path, &st) == 0) {
+            stale++;
+        }
+    }
+    report("create/unlink", NUM_NAMES, now_ms() - start);
+    printf("  %d stale results\n", stale);
+
+    rm_rf(dir);
+
+    printf("stat_bench done\n");
+    return stale != 0;
+}
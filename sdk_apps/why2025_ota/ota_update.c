@@ -64,24 +64,6 @@ static size_t file_cb(void *contents, size_t size, size_t nmemb, void *userp) {
     return realsize;
 }
 
-static size_t firmware_cb(void *contents, size_t size, size_t nmemb, ota_handle_t handle) {
-    debug_printf("firmware_cb(%p, %zu, %zu, %p)\n", contents, size, nmemb, handle);
-    bool   err;
-    size_t realsize = size * nmemb;
-
-    char *buffer = (char *)calloc(realsize + 1, sizeof(char));
-    memcpy(buffer, contents, realsize);
-
-    err = ota_write(handle, buffer, realsize);
-    if (err == false) {
-        printf("ota_write() failed\n");
-        return 0;
-    }
-
-    free(buffer);
-    return realsize;
-}
-
 bool do_http(char const *url, http_data_t *response_data, http_file_t *http_file) {
     debug_printf("do_http(%s, %p, %p)\n", url, response_data, http_file);
 
@@ -395,6 +377,7 @@ bool update_application(application_t *app, char const *version) {
     }
 
     if (result) {
+        application_begin_update(app);
         application_set_version(app, version);
         application_set_metadata(app, "metadata.json");
 
@@ -405,6 +388,8 @@ bool update_application(application_t *app, char const *version) {
         if (executable) {
             application_set_binary_path(app, executable);
         }
+
+        result = application_commit_update(app);
     }
 out:
     cJSON_Delete(json);
@@ -496,50 +481,17 @@ out:
 bool do_firmware_http(char const *url, ota_handle_t ota_session) {
     debug_printf("do_firmware_http(%s, %p)\n", url, ota_session);
 
-    bool ret = false;
-
     if (!url) {
         printf("No URL provided\n");
         return false;
     }
 
-    CURL *curl = curl_easy_init();
-    if (!curl) {
-        printf("Failed to allocate curl\n");
-        return false;
+    // The kernel writes to flash while the download goes on and resumes it if the connection breaks
+    bool ret = ota_download(ota_session, url, NULL);
+    if (!ret) {
+        printf("do_firmware_http(%s) download failed\n", url);
     }
 
-    curl_easy_setopt(curl, CURLOPT_URL, url);
-    curl_easy_setopt(curl, CURLOPT_BUFFERSIZE, 1024);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, firmware_cb);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)ota_session);
-    curl_easy_setopt(curl, CURLOPT_USERAGENT, HTTP_USERAGENT);
-    curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
-
-    CURLcode res = curl_easy_perform(curl);
-    if (res != CURLE_OK) {
-        char const *error_string = curl_easy_strerror(res);
-        if (error_string) {
-            printf("do_firmware_http(%s) curl_easy_perform() failed: %s\n", url, curl_easy_strerror(res));
-        } else {
-            printf("do_firmware_http(%s) curl_easy_perform() failed: %u\n", url, res);
-        }
-        goto out;
-    }
-
-    long response_code;
-    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
-
-    debug_printf("do_firmware_http(%s) response code: %ld\n", url, response_code);
-
-    if (response_code < 200 || response_code > 299) {
-        printf("do_firmware_http(%s) error: server response: <no response>\n", url);
-        goto out;
-    }
-
-    ret = true;
-out:
-    curl_easy_cleanup(curl);
     debug_printf("do_firmware_http(%s) returned %i\n", url, ret);
     return ret;
 }
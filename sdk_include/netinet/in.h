@@ -22,4 +22,33 @@ struct in6_addr {
   } un;
 };
 
+#define INADDR_NONE         ((in_addr_t)0xffffffffUL)
+#define INADDR_LOOPBACK     ((in_addr_t)0x7f000001UL)
+#define INADDR_ANY          ((in_addr_t)0x00000000UL)
+#define INADDR_BROADCAST    ((in_addr_t)0xffffffffUL)
+
+#define IN6ADDR_ANY_INIT {{{0,0,0,0}}}
+
+/*
+ * Options for level IPPROTO_IP
+ */
+#define IP_TOS             1
+#define IP_TTL             2
+#define IP_PKTINFO         8
+#define IP_MULTICAST_TTL   5
+#define IP_MULTICAST_IF    6
+#define IP_MULTICAST_LOOP  7
+#define IP_ADD_MEMBERSHIP  3
+#define IP_DROP_MEMBERSHIP 4
+
+/*
+ * Options for level IPPROTO_IPV6
+ */
+#define IPV6_V6ONLY 27 /* RFC3493: boolean control to restrict AF_INET6 sockets to IPv6 communications only. */
+
+typedef struct ip_mreq {
+    struct in_addr imr_multiaddr; /* IP multicast address of group */
+    struct in_addr imr_interface; /* local IP address of interface */
+} ip_mreq;
+
 #endif /* IN_H_ */
@@ -0,0 +1,48 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Same values as the kernel, which uses the ESP-IDF definitions
+#define POLLIN     (1u << 0)
+#define POLLRDNORM (1u << 1)
+#define POLLRDBAND (1u << 2)
+#define POLLPRI    (POLLRDBAND)
+#define POLLOUT    (1u << 3)
+#define POLLWRNORM (POLLOUT)
+#define POLLWRBAND (1u << 4)
+#define POLLERR    (1u << 5)
+#define POLLHUP    (1u << 6)
+#define POLLNVAL   (1u << 7)
+
+typedef unsigned int nfds_t;
+
+struct pollfd {
+    int   fd;
+    short events;
+    short revents;
+};
+
+int poll(struct pollfd *fds, nfds_t nfds, int timeout);
+
+#ifdef __cplusplus
+}
+#endif
@@ -10,6 +10,8 @@ extern "C" {
 #endif
 
 #include <stdint.h>
+#include <sys/types.h>
+#include <netinet/in.h>
 
 #define AF_UNIX             1
 #define PF_LOCAL            AF_UNIX
@@ -57,6 +59,24 @@ extern "C" {
 #define SO_NO_CHECK     0x100a /* don't create UDP checksum */
 #define SO_BINDTODEVICE 0x100b /* bind to device */
 
+#define SOL_SOCKET      0xfff  /* options for socket level */
+
+/* Flags we can use with send and recv. */
+#define MSG_PEEK       0x01    /* Peeks at an incoming message */
+#define MSG_WAITALL    0x02    /* Unimplemented: Requests that the function block until the full amount of data requested can be returned */
+#define MSG_OOB        0x04    /* Unimplemented: Requests out-of-band data. The significance and semantics of out-of-band data are protocol-specific */
+#define MSG_DONTWAIT   0x08    /* Nonblocking i/o for this operation only */
+#define MSG_MORE       0x10    /* Sender will send more */
+#define MSG_NOSIGNAL   0x20    /* Uninmplemented: Requests not to send the SIGPIPE signal if an attempt to send is made on a stream-oriented socket that is no longer connected. */
+
+/* Flags recvmsg sets in msg_flags */
+#define MSG_TRUNC   0x04
+#define MSG_CTRUNC  0x08
+
+#define SHUT_RD   0
+#define SHUT_WR   1
+#define SHUT_RDWR 2
+
 typedef uint32_t socklen_t;
 typedef uint8_t sa_family_t;
 typedef uint16_t in_port_t;
@@ -94,6 +114,21 @@ struct sockaddr_storage {
   uint32_t       s2_data3[3];
 };
 
+struct iovec {
+  void  *iov_base;
+  size_t iov_len;
+};
+
+struct msghdr {
+  void         *msg_name;
+  socklen_t     msg_namelen;
+  struct iovec *msg_iov;
+  int           msg_iovlen;
+  void         *msg_control;
+  socklen_t     msg_controllen;
+  int           msg_flags;
+};
+
 int socketpair(int domain, int type, int protocol, int sv[2]);
 
 int accept(int s,struct sockaddr *addr,socklen_t *addrlen);